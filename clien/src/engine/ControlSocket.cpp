@@ -367,6 +367,10 @@ int CControlSocket::CheckOverwriteFile()
 	{
 		if (!wxFile::Exists(pData->localFile))
 			return FZ_REPLY_OK;
+
+		// Ranges are parts of a larger transfer, the file has been checked before
+		if (pData->transferSettings.HasRange())
+			return FZ_REPLY_OK;
 	}
 
 	CDirentry entry;
@@ -929,6 +933,8 @@ void CRealControlSocket::OnSocketEvent(CSocketEventSource*, SocketEventType t, i
 			if (m_pProxyBackend && !m_pProxyBackend->Detached()) {
 				m_pProxyBackend->Detach();
 				m_pBackend = new CSocketBackend(this, *m_pSocket, engine_.GetRateLimiter());
+				if (m_pCurrentServer)
+					engine_.GetRateLimiter().SetServer(m_pBackend, *m_pCurrentServer);
 			}
 			OnConnect();
 		}
@@ -1035,6 +1041,8 @@ int CRealControlSocket::Connect(const CServer &server)
 	// International domain names
 	m_pCurrentServer->SetHost(ConvertDomainName(server.GetHost()), server.GetPort());
 
+	engine_.GetRateLimiter().SetServer(m_pBackend, *m_pCurrentServer);
+
 	return ContinueConnect();
 }
 
@@ -0,0 +1,208 @@
+#include <filezilla.h>
+#include "directory_comparison.h"
+
+size_t const CDirectoryComparison::npos;
+
+CDirectoryComparison::CDirectoryComparison(mode m, wxTimeSpan const& threshold, bool case_sensitive)
+	: mode_(m)
+	, threshold_(threshold)
+	, case_sensitive_(case_sensitive)
+{
+}
+
+wxString CDirectoryComparison::Key(wxString const& name, bool dir) const
+{
+	// A file and a directory of the same name are different entries.
+	// Names cannot contain slashes, so this can't collide with a file.
+	wxString key = case_sensitive_ ? name : name.Lower();
+	if (dir)
+		key += '/';
+	return key;
+}
+
+CDirectoryComparison::result CDirectoryComparison::Compare(entry const& left, entry const& right) const
+{
+	if (mode_ == mode::size) {
+		if (left.dir || left.size == right.size)
+			return result::equal;
+		return result::different;
+	}
+
+	if (!left.time.IsValid() || !right.time.IsValid())
+		return result::equal;
+
+	CDateTime leftTime = left.time;
+	CDateTime rightTime = right.time;
+
+	int cmp = leftTime.Compare(rightTime);
+	if (cmp < 0)
+		leftTime += threshold_;
+	else if (cmp > 0)
+		rightTime += threshold_;
+
+	// Within the threshold if adding it flipped the order
+	int const cmp2 = leftTime.Compare(rightTime);
+	if (cmp && cmp == -cmp2)
+		cmp = 0;
+
+	if (cmp < 0)
+		return result::right_newer;
+	if (cmp > 0)
+		return result::left_newer;
+	return result::equal;
+}
+
+void CDirectoryComparison::Set(side s, std::vector<entry> && entries)
+{
+	t_side& own = Own(s);
+	t_side& other = Other(s);
+
+	own.items.clear();
+	own.index.clear();
+	for (auto & item : other.items)
+		item.other = npos;
+
+	own.items.reserve(entries.size());
+	own.index.reserve(entries.size());
+	for (auto & e : entries) {
+		size_t const i = own.items.size();
+		own.items.emplace_back();
+		t_item & item = own.items.back();
+		item.e = std::move(e);
+
+		wxString key = Key(item.e.name, item.e.dir);
+
+		// Names that only differ in case on a case-insensitive comparison,
+		// only the first one gets joined.
+		auto const other_it = other.index.find(key);
+		if (!own.index.emplace(std::move(key), i).second)
+			continue;
+
+		if (other_it != other.index.end()) {
+			item.other = other_it->second;
+			other.items[other_it->second].other = i;
+		}
+	}
+
+	changes_.clear();
+}
+
+size_t CDirectoryComparison::Update(side s, entry const& e)
+{
+	t_side& own = Own(s);
+	t_side& other = Other(s);
+
+	wxString key = Key(e.name, e.dir);
+
+	auto const it = own.index.find(key);
+	if (it != own.index.end()) {
+		size_t const i = it->second;
+		match const old = GetMatch(s, i);
+		own.items[i].e = e;
+
+		match const m = GetMatch(s, i);
+		if (m.res != old.res)
+			changes_.push_back(m);
+		return i;
+	}
+
+	size_t const i = own.items.size();
+	own.items.emplace_back();
+	own.items.back().e = e;
+
+	auto const other_it = other.index.find(key);
+	own.index.emplace(std::move(key), i);
+	if (other_it != other.index.end()) {
+		own.items[i].other = other_it->second;
+		other.items[other_it->second].other = i;
+	}
+
+	changes_.push_back(GetMatch(s, i));
+	return i;
+}
+
+bool CDirectoryComparison::Remove(side s, wxString const& name, bool dir)
+{
+	t_side& own = Own(s);
+	t_side& other = Other(s);
+
+	auto const it = own.index.find(Key(name, dir));
+	if (it == own.index.end())
+		return false;
+
+	t_item& item = own.items[it->second];
+	own.index.erase(it);
+
+	item.removed = true;
+	if (item.other != npos) {
+		other.items[item.other].other = npos;
+		changes_.push_back(GetMatch(s == side::left ? side::right : side::left, item.other));
+		item.other = npos;
+	}
+
+	return true;
+}
+
+size_t CDirectoryComparison::Find(side s, wxString const& name, bool dir) const
+{
+	t_side const& own = sides_[static_cast<int>(s)];
+
+	auto const it = own.index.find(Key(name, dir));
+	if (it == own.index.end())
+		return npos;
+
+	return it->second;
+}
+
+CDirectoryComparison::match CDirectoryComparison::GetMatch(side s, size_t index) const
+{
+	match m;
+
+	t_item const& item = sides_[static_cast<int>(s)].items[index];
+	if (item.removed)
+		return m;
+
+	if (s == side::left) {
+		m.left = index;
+		m.right = item.other;
+	}
+	else {
+		m.left = item.other;
+		m.right = index;
+	}
+
+	if (m.right == npos)
+		m.res = result::left_only;
+	else if (m.left == npos)
+		m.res = result::right_only;
+	else
+		m.res = Compare(sides_[0].items[m.left].e, sides_[1].items[m.right].e);
+
+	return m;
+}
+
+std::vector<CDirectoryComparison::match> CDirectoryComparison::GetMatches() const
+{
+	std::vector<match> matches;
+	matches.reserve(sides_[0].items.size() + sides_[1].items.size());
+
+	for (size_t i = 0; i < sides_[0].items.size(); ++i) {
+		if (!sides_[0].items[i].removed)
+			matches.push_back(GetMatch(side::left, i));
+	}
+
+	for (size_t i = 0; i < sides_[1].items.size(); ++i) {
+		t_item const& item = sides_[1].items[i];
+		if (!item.removed && item.other == npos)
+			matches.push_back(GetMatch(side::right, i));
+	}
+
+	return matches;
+}
+
+std::vector<CDirectoryComparison::match> CDirectoryComparison::TakeChanges()
+{
+	std::vector<match> changes;
+	changes.swap(changes_);
+	return changes;
+}
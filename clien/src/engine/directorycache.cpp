@@ -1,27 +1,619 @@
 #include <filezilla.h>
 #include "directorycache.h"
+#include "file.h"
 
-CDirectoryCache::CDirectoryCache()
+#include <wx/filename.h>
+
+#include <algorithm>
+
+#ifndef __WXMSW__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+// FNV-1a over the lowercased path, used as key into the per-server path index
+size_t HashPathNoCase(CServerPath const& path)
+{
+	wxString const s = path.GetSafePath();
+
+	size_t hash = 2166136261u;
+	const wxChar* p = s.c_str();
+	for (size_t i = 0; i < s.size(); ++i) {
+		hash = (hash ^ static_cast<size_t>(static_cast<wxChar>(wxTolower(p[i])))) * 16777619u;
+	}
+	return hash;
+}
+
+// Identifies the server in the persistent cache. Does deliberately not
+// include any credentials.
+wxString GetServerKey(CServer const& server)
 {
+	return wxString::Format(_T("%d %d %s %u %s %d %d %s"),
+		static_cast<int>(server.GetProtocol()), static_cast<int>(server.GetType()),
+		server.GetHost(), server.GetPort(), server.GetUser(),
+		server.GetTimezoneOffset(), static_cast<int>(server.GetEncodingType()), server.GetCustomEncoding());
 }
 
-CDirectoryCache::~CDirectoryCache()
+// Rough estimate of the heap memory used by a listing
+int64_t EstimateSize(CDirectoryListing const& listing)
 {
-	for( auto & serverEntry : m_serverList ) {
-		for (auto & cacheEntry : serverEntry.cacheList ) {
-#ifdef __WXDEBUG__
-			m_totalFileCount -= cacheEntry.listing.GetCount();
+	int64_t size = sizeof(CDirectoryListing) + listing.path.GetPath().size() * sizeof(wxChar);
+
+	// Entry, its refcounted holder and the shared_ptr control block
+	int64_t const entry_overhead = sizeof(CDirentry) + sizeof(CRefcountObject<CDirentry>) + 2 * sizeof(void*) + 16;
+
+	for (unsigned int i = 0; i < listing.GetCount(); ++i) {
+		CDirentry const& entry = listing[i];
+		size += entry_overhead + (entry.name.size() + 1) * sizeof(wxChar);
+		if (entry.target) {
+			size += (entry.target->size() + 1) * sizeof(wxChar);
+		}
+	}
+
+	return size;
+}
+}
+
+/*
+ * The persistent tier stores listings in a single file which is memory-mapped
+ * on startup. Only an index of the records is built initially, listings are
+ * deserialized on first use.
+ *
+ * File format, all integers little-endian:
+ *   header: "FZDC", uint32 version, uint32 record count
+ *   record: uint32 length of the record body, followed by the body:
+ *     string server key, string safe path, int64 list time in ms since epoch,
+ *     int32 listing flags, uint32 entry count, entries
+ *   entry: string name, int64 size, string permissions, string owner/group,
+ *     int32 flags, uint8 has target, [string target], uint8 time accuracy
+ *     (0xff if no time), [int64 time in ms since epoch]
+ *   string: uint32 length, UTF-8 data
+ */
+class CDirectoryCache::CDiskCache final
+{
+public:
+	explicit CDiskCache(wxString const& file);
+	~CDiskCache();
+
+	CDiskCache(CDiskCache const&) = delete;
+	CDiskCache& operator=(CDiskCache const&) = delete;
+
+	// On success, the record is removed from the disk cache, the caller
+	// becomes responsible for the listing.
+	bool Load(wxString const& serverKey, CServerPath const& path, CDirectoryListing& listing);
+
+	// Forget about all records of the server with case-insensitively matching path
+	void Remove(wxString const& serverKey, CServerPath const& path);
+
+	// Forget about the record of the path and all its subdirectories
+	void RemoveDir(wxString const& serverKey, CServerPath const& path);
+
+	void RemoveServer(wxString const& serverKey);
+
+	// Writes the given listings, most important first, followed by the
+	// remaining records until the size limit is reached.
+	void Save(std::vector<std::pair<wxString, CDirectoryListing const*>> const& listings, int64_t limit);
+
+private:
+	static uint32_t const version = 1;
+
+	struct record final
+	{
+		CServerPath path;
+		size_t offset; // of the record length field
+		size_t length; // including the length field
+	};
+
+	typedef std::unordered_multimap<size_t, record> tRecords;
+
+	bool Map();
+	void Unmap();
+
+	wxString const file_;
+
+	unsigned char const* data_{};
+	size_t size_{};
+#ifdef __WXMSW__
+	HANDLE hFile_{INVALID_HANDLE_VALUE};
+	HANDLE hMapping_{};
+#else
+	int fd_{-1};
 #endif
-			tLruList::iterator* lruIt = (tLruList::iterator*)cacheEntry.lruIt;
-			if (lruIt) {
-				m_leastRecentlyUsedList.erase(*lruIt);
-				delete lruIt;
-			}
+
+	std::map<wxString, tRecords> servers_;
+};
+
+namespace {
+class CReader final
+{
+public:
+	CReader(unsigned char const* p, size_t size)
+		: p_(p), end_(p + size)
+	{}
+
+	bool ok() const { return ok_; }
+	size_t remaining() const { return end_ - p_; }
+	unsigned char const* pos() const { return p_; }
+
+	uint64_t ReadInt(size_t bytes)
+	{
+		if (!ok_ || remaining() < bytes) {
+			ok_ = false;
+			return 0;
+		}
+		uint64_t ret = 0;
+		for (size_t i = 0; i < bytes; ++i) {
+			ret |= static_cast<uint64_t>(p_[i]) << (i * 8);
+		}
+		p_ += bytes;
+		return ret;
+	}
+
+	uint8_t ReadU8() { return static_cast<uint8_t>(ReadInt(1)); }
+	uint32_t ReadU32() { return static_cast<uint32_t>(ReadInt(4)); }
+	int32_t ReadI32() { return static_cast<int32_t>(ReadU32()); }
+	int64_t ReadI64() { return static_cast<int64_t>(ReadInt(8)); }
+
+	wxString ReadString()
+	{
+		uint32_t const len = ReadU32();
+		if (!ok_ || remaining() < len) {
+			ok_ = false;
+			return wxString();
+		}
+		wxString ret = wxString::FromUTF8(reinterpret_cast<char const*>(p_), len);
+		p_ += len;
+		return ret;
+	}
+
+	void Skip(size_t len)
+	{
+		if (!ok_ || remaining() < len) {
+			ok_ = false;
+			return;
+		}
+		p_ += len;
+	}
+
+private:
+	unsigned char const* p_;
+	unsigned char const* const end_;
+	bool ok_{true};
+};
+
+class CWriter final
+{
+public:
+	std::vector<unsigned char> & buffer() { return buffer_; }
+
+	void WriteInt(uint64_t v, size_t bytes)
+	{
+		for (size_t i = 0; i < bytes; ++i) {
+			buffer_.push_back(static_cast<unsigned char>(v >> (i * 8)));
+		}
+	}
+
+	void WriteU8(uint8_t v) { WriteInt(v, 1); }
+	void WriteU32(uint32_t v) { WriteInt(v, 4); }
+	void WriteI32(int32_t v) { WriteInt(static_cast<uint32_t>(v), 4); }
+	void WriteI64(int64_t v) { WriteInt(static_cast<uint64_t>(v), 8); }
+
+	void WriteString(wxString const& s)
+	{
+		wxScopedCharBuffer const utf8 = s.utf8_str();
+		WriteU32(static_cast<uint32_t>(utf8.length()));
+		buffer_.insert(buffer_.end(), utf8.data(), utf8.data() + utf8.length());
+	}
+
+	void WriteRaw(unsigned char const* p, size_t len)
+	{
+		buffer_.insert(buffer_.end(), p, p + len);
+	}
+
+	void PatchU32(size_t offset, uint32_t v)
+	{
+		for (size_t i = 0; i < 4; ++i) {
+			buffer_[offset + i] = static_cast<unsigned char>(v >> (i * 8));
+		}
+	}
+
+private:
+	std::vector<unsigned char> buffer_;
+};
+
+void WriteListing(CWriter & writer, wxString const& serverKey, CDirectoryListing const& listing)
+{
+	size_t const start = writer.buffer().size();
+	writer.WriteU32(0); // Patched below
+
+	writer.WriteString(serverKey);
+	writer.WriteString(listing.path.GetSafePath());
+	writer.WriteI64(listing.m_firstListTime.GetTime().Degenerate().GetValue().GetValue());
+	writer.WriteI32(listing.m_flags);
+	writer.WriteU32(listing.GetCount());
+
+	for (unsigned int i = 0; i < listing.GetCount(); ++i) {
+		CDirentry const& entry = listing[i];
+		writer.WriteString(entry.name);
+		writer.WriteI64(entry.size.GetValue());
+		writer.WriteString(*entry.permissions);
+		writer.WriteString(*entry.ownerGroup);
+		writer.WriteI32(entry.flags);
+		if (entry.target) {
+			writer.WriteU8(1);
+			writer.WriteString(*entry.target);
+		}
+		else {
+			writer.WriteU8(0);
+		}
+		if (entry.has_date()) {
+			writer.WriteU8(static_cast<uint8_t>(entry.time.GetAccuracy()));
+			writer.WriteI64(entry.time.Degenerate().GetValue().GetValue());
+		}
+		else {
+			writer.WriteU8(0xff);
+		}
+	}
+
+	writer.PatchU32(start, static_cast<uint32_t>(writer.buffer().size() - start - 4));
+}
+
+bool ReadListing(CReader & reader, CDirectoryListing & listing)
+{
+	reader.ReadString(); // Server key, already known
+	if (!listing.path.SetSafePath(reader.ReadString())) {
+		return false;
+	}
+
+	int64_t const listTime = reader.ReadI64();
+	listing.m_firstListTime = CMonotonicTime(CDateTime(wxDateTime(wxLongLong(listTime)), CDateTime::milliseconds));
+	listing.m_flags = reader.ReadI32();
+
+	uint32_t const count = reader.ReadU32();
+	if (!reader.ok()) {
+		return false;
+	}
+
+	std::deque<CRefcountObject<CDirentry>> entries;
+
+	// Permissions and owners are mostly the same for all entries, share them.
+	CRefcountObject<wxString> permissions;
+	CRefcountObject<wxString> ownerGroup;
+
+	for (uint32_t i = 0; i < count && reader.ok(); ++i) {
+		CRefcountObject<CDirentry> e;
+		CDirentry & entry = e.Get();
+
+		entry.name = reader.ReadString();
+		entry.size = reader.ReadI64();
+
+		wxString const perms = reader.ReadString();
+		if (*permissions != perms) {
+			permissions = CRefcountObject<wxString>(perms);
+		}
+		entry.permissions = permissions;
+
+		wxString const owner = reader.ReadString();
+		if (*ownerGroup != owner) {
+			ownerGroup = CRefcountObject<wxString>(owner);
+		}
+		entry.ownerGroup = ownerGroup;
+
+		entry.flags = reader.ReadI32();
+		if (reader.ReadU8()) {
+			entry.target = CSparseOptional<wxString>(reader.ReadString());
+		}
+
+		uint8_t const accuracy = reader.ReadU8();
+		if (accuracy <= CDateTime::milliseconds) {
+			int64_t const t = reader.ReadI64();
+			entry.time = CDateTime(wxDateTime(wxLongLong(t)), static_cast<CDateTime::Accuracy>(accuracy));
+		}
+
+		entries.push_back(std::move(e));
+	}
+
+	if (!reader.ok()) {
+		return false;
+	}
+
+	listing.Assign(entries);
+	return true;
+}
+}
+
+CDirectoryCache::CDiskCache::CDiskCache(wxString const& file)
+	: file_(file)
+{
+	if (!Map()) {
+		return;
+	}
+
+	CReader reader(data_, size_);
+	if (reader.ReadU32() != 0x4344465au /* "FZDC" */ || reader.ReadU32() != version) {
+		Unmap();
+		return;
+	}
+
+	uint32_t const count = reader.ReadU32();
+	for (uint32_t i = 0; i < count && reader.ok(); ++i) {
+		size_t const offset = reader.pos() - data_;
+		uint32_t const length = reader.ReadU32();
+		if (!reader.ok() || reader.remaining() < length) {
+			break;
 		}
+
+		CReader body(reader.pos(), length);
+		wxString const serverKey = body.ReadString();
+		wxString const safePath = body.ReadString();
+		reader.Skip(length);
+
+		record r;
+		if (!body.ok() || !r.path.SetSafePath(safePath)) {
+			continue;
+		}
+		r.offset = offset;
+		r.length = length + 4;
+		servers_[serverKey].emplace(HashPathNoCase(r.path), r);
 	}
-#ifdef __WXDEBUG__
-	wxASSERT(m_totalFileCount == 0);
+}
+
+CDirectoryCache::CDiskCache::~CDiskCache()
+{
+	Unmap();
+}
+
+#ifdef __WXMSW__
+bool CDirectoryCache::CDiskCache::Map()
+{
+	hFile_ = CreateFile(file_, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, 0);
+	if (hFile_ == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	LARGE_INTEGER size{};
+	if (!GetFileSizeEx(hFile_, &size) || size.QuadPart <= 0 || static_cast<uint64_t>(size.QuadPart) > static_cast<size_t>(-1)) {
+		Unmap();
+		return false;
+	}
+
+	hMapping_ = CreateFileMapping(hFile_, 0, PAGE_READONLY, 0, 0, 0);
+	if (!hMapping_) {
+		Unmap();
+		return false;
+	}
+
+	data_ = static_cast<unsigned char const*>(MapViewOfFile(hMapping_, FILE_MAP_READ, 0, 0, 0));
+	if (!data_) {
+		Unmap();
+		return false;
+	}
+	size_ = static_cast<size_t>(size.QuadPart);
+
+	return true;
+}
+
+void CDirectoryCache::CDiskCache::Unmap()
+{
+	if (data_) {
+		UnmapViewOfFile(data_);
+		data_ = 0;
+	}
+	size_ = 0;
+	if (hMapping_) {
+		CloseHandle(hMapping_);
+		hMapping_ = 0;
+	}
+	if (hFile_ != INVALID_HANDLE_VALUE) {
+		CloseHandle(hFile_);
+		hFile_ = INVALID_HANDLE_VALUE;
+	}
+	servers_.clear();
+}
+#else
+bool CDirectoryCache::CDiskCache::Map()
+{
+	fd_ = open(file_.fn_str(), O_RDONLY | O_CLOEXEC);
+	if (fd_ == -1) {
+		return false;
+	}
+
+	struct stat buf;
+	if (fstat(fd_, &buf) != 0 || buf.st_size <= 0 || static_cast<uint64_t>(buf.st_size) > static_cast<size_t>(-1)) {
+		Unmap();
+		return false;
+	}
+
+	void* p = mmap(0, buf.st_size, PROT_READ, MAP_PRIVATE, fd_, 0);
+	if (p == MAP_FAILED) {
+		Unmap();
+		return false;
+	}
+	data_ = static_cast<unsigned char const*>(p);
+	size_ = static_cast<size_t>(buf.st_size);
+
+	return true;
+}
+
+void CDirectoryCache::CDiskCache::Unmap()
+{
+	if (data_) {
+		munmap(const_cast<unsigned char*>(data_), size_);
+		data_ = 0;
+	}
+	size_ = 0;
+	if (fd_ != -1) {
+		close(fd_);
+		fd_ = -1;
+	}
+	servers_.clear();
+}
 #endif
+
+bool CDirectoryCache::CDiskCache::Load(wxString const& serverKey, CServerPath const& path, CDirectoryListing& listing)
+{
+	auto sit = servers_.find(serverKey);
+	if (sit == servers_.end()) {
+		return false;
+	}
+
+	auto range = sit->second.equal_range(HashPathNoCase(path));
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second.path != path) {
+			continue;
+		}
+
+		CReader reader(data_ + it->second.offset + 4, it->second.length - 4);
+		bool const ok = ReadListing(reader, listing);
+
+		sit->second.erase(it);
+		if (sit->second.empty()) {
+			servers_.erase(sit);
+		}
+		return ok;
+	}
+
+	return false;
+}
+
+void CDirectoryCache::CDiskCache::Remove(wxString const& serverKey, CServerPath const& path)
+{
+	auto sit = servers_.find(serverKey);
+	if (sit == servers_.end()) {
+		return;
+	}
+
+	auto range = sit->second.equal_range(HashPathNoCase(path));
+	for (auto it = range.first; it != range.second; ) {
+		if (!it->second.path.CmpNoCase(path)) {
+			it = sit->second.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+	if (sit->second.empty()) {
+		servers_.erase(sit);
+	}
+}
+
+void CDirectoryCache::CDiskCache::RemoveDir(wxString const& serverKey, CServerPath const& path)
+{
+	auto sit = servers_.find(serverKey);
+	if (sit == servers_.end()) {
+		return;
+	}
+
+	for (auto it = sit->second.begin(); it != sit->second.end(); ) {
+		if (it->second.path == path || path.IsParentOf(it->second.path, true)) {
+			it = sit->second.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+	if (sit->second.empty()) {
+		servers_.erase(sit);
+	}
+}
+
+void CDirectoryCache::CDiskCache::RemoveServer(wxString const& serverKey)
+{
+	servers_.erase(serverKey);
+}
+
+void CDirectoryCache::CDiskCache::Save(std::vector<std::pair<wxString, CDirectoryListing const*>> const& listings, int64_t limit)
+{
+	CWriter writer;
+	writer.WriteU32(0x4344465au);
+	writer.WriteU32(version);
+	writer.WriteU32(0); // Record count, patched below
+
+	uint32_t count = 0;
+	for (auto const& listing : listings) {
+		if (static_cast<int64_t>(writer.buffer().size()) >= limit) {
+			break;
+		}
+		WriteListing(writer, listing.first, *listing.second);
+		++count;
+	}
+
+	// Records not touched in this session follow in their original order
+	std::vector<std::pair<size_t, size_t>> remaining;
+	for (auto const& server : servers_) {
+		for (auto const& r : server.second) {
+			remaining.emplace_back(r.second.offset, r.second.length);
+		}
+	}
+	std::sort(remaining.begin(), remaining.end());
+	for (auto const& r : remaining) {
+		if (static_cast<int64_t>(writer.buffer().size() + r.second) > limit) {
+			break;
+		}
+		writer.WriteRaw(data_ + r.first, r.second);
+		++count;
+	}
+	writer.PatchU32(8, count);
+
+	// Unmap first, the file cannot be replaced while mapped on all platforms
+	Unmap();
+
+	wxString const tmp = file_ + _T(".tmp");
+	{
+		CFile f;
+		if (!f.Open(tmp, CFile::write, CFile::truncate)) {
+			return;
+		}
+
+		std::vector<unsigned char> const& buffer = writer.buffer();
+		size_t written = 0;
+		while (written < buffer.size()) {
+			ssize_t w = f.Write(&buffer[written], buffer.size() - written);
+			if (w <= 0) {
+				f.Close();
+				wxRemoveFile(tmp);
+				return;
+			}
+			written += w;
+		}
+	}
+
+	wxRenameFile(tmp, file_, true);
+}
+
+CDirectoryCache::CDirectoryCache(COptionsBase& options)
+	: options_(options)
+{
+	wxString const file = options_.GetOption(OPTION_CACHE_FILE);
+	if (!file.empty()) {
+		if (options_.GetOptionVal(OPTION_CACHE_PERSISTENT)) {
+			disk_.reset(new CDiskCache(file));
+		}
+		else if (wxFileName::FileExists(file)) {
+			// Don't leave stale listings on disk once the user disabled the persistent cache
+			wxRemoveFile(file);
+		}
+	}
+}
+
+CDirectoryCache::~CDirectoryCache()
+{
+	if (disk_) {
+		std::vector<std::pair<wxString, CDirectoryListing const*>> listings;
+		listings.reserve(m_cacheList.size());
+
+		// Most recently used listings first
+		for (auto it = m_cacheList.rbegin(); it != m_cacheList.rend(); ++it) {
+			if (!it->listing.failed()) {
+				listings.emplace_back(GetServerKey(it->server->server), &it->listing);
+			}
+		}
+
+		disk_->Save(listings, static_cast<int64_t>(options_.GetOptionVal(OPTION_CACHE_SIZE_LIMIT)) * 1024 * 1024);
+	}
 }
 
 void CDirectoryCache::Store(const CDirectoryListing &listing, const CServer &server)
@@ -31,22 +623,26 @@ void CDirectoryCache::Store(const CDirectoryListing &listing, const CServer &ser
 	tServerIter sit = CreateServerEntry(server);
 	wxASSERT(sit != m_serverList.end());
 
-	m_totalFileCount += listing.GetCount();
+	if (disk_) {
+		disk_->Remove(GetServerKey(server), listing.path);
+	}
 
-	tCacheIter cit;
-	bool unused;
-	if (Lookup(cit, sit, listing.path, true, unused)) {
-		cit->modificationTime = CMonotonicTime::Now();
+	auto range = sit->paths.equal_range(HashPathNoCase(listing.path));
+	for (auto it = range.first; it != range.second; ++it) {
+		tCacheIter const cit = it->second;
+		if (cit->listing.path != listing.path) {
+			continue;
+		}
 
-		m_totalFileCount -= cit->listing.GetCount();
+		cit->modificationTime = CMonotonicTime::Now();
 		cit->listing = listing;
-
+		UpdateLru(cit);
+		UpdateSize(cit);
+		Prune();
 		return;
 	}
 
-	sit->cacheList.emplace_front(listing);
-
-	UpdateLru(sit, sit->cacheList.begin());
+	Insert(sit, listing);
 
 	Prune();
 }
@@ -55,12 +651,8 @@ bool CDirectoryCache::Lookup(CDirectoryListing &listing, const CServer &server,
 {
 	scoped_lock lock(mutex_);
 
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end())
-		return false;
-
 	tCacheIter iter;
-	if (Lookup(iter, sit, path, allowUnsureEntries, is_outdated)) {
+	if (Lookup(iter, server, path, allowUnsureEntries, is_outdated)) {
 		listing = iter->listing;
 		return true;
 	}
@@ -68,37 +660,68 @@ bool CDirectoryCache::Lookup(CDirectoryListing &listing, const CServer &server,
 	return false;
 }
 
-bool CDirectoryCache::Lookup(tCacheIter &cacheIter, tServerIter &sit, const CServerPath &path, bool allowUnsureEntries, bool& is_outdated)
+bool CDirectoryCache::Lookup(tCacheIter &cacheIter, const CServer& server, const CServerPath &path, bool allowUnsureEntries, bool& is_outdated)
 {
-	for (tCacheIter iter = sit->cacheList.begin(); iter != sit->cacheList.end(); ++iter) {
-		const CCacheEntry &entry = *iter;
+	tServerIter sit = GetServerEntry(server);
 
-		if (entry.listing.path != path)
-			continue;
+	tCacheIter iter = m_cacheList.end();
+	if (sit != m_serverList.end()) {
+		auto range = sit->paths.equal_range(HashPathNoCase(path));
+		for (auto it = range.first; it != range.second; ++it) {
+			if (it->second->listing.path == path) {
+				iter = it->second;
+				break;
+			}
+		}
+	}
 
-		UpdateLru(sit, iter);
+	if (iter == m_cacheList.end()) {
+		if (!disk_) {
+			return false;
+		}
 
-		if (!allowUnsureEntries && entry.listing.get_unsure_flags())
+		CDirectoryListing listing;
+		if (!disk_->Load(GetServerKey(server), path, listing)) {
 			return false;
+		}
 
-		cacheIter = iter;
-		is_outdated = (CDateTime::Now() - entry.listing.m_firstListTime.GetTime()).GetSeconds() > CACHE_TIMEOUT;
-		return true;
+		if (sit == m_serverList.end()) {
+			sit = CreateServerEntry(server);
+		}
+		// Being the most recently used entry, pruning won't remove it again
+		iter = Insert(sit, listing);
+		Prune();
+	}
+	else {
+		UpdateLru(iter);
 	}
 
-	return false;
+	const CCacheEntry &entry = *iter;
+
+	if (!allowUnsureEntries && entry.listing.get_unsure_flags())
+		return false;
+
+	cacheIter = iter;
+	is_outdated = (CDateTime::Now() - entry.listing.m_firstListTime.GetTime()).GetSeconds() > CACHE_TIMEOUT;
+	return true;
+}
+
+void CDirectoryCache::FindNoCase(std::vector<tCacheIter> & cacheIters, tServerIter const& sit, const CServerPath &path)
+{
+	auto range = sit->paths.equal_range(HashPathNoCase(path));
+	for (auto it = range.first; it != range.second; ++it) {
+		if (!path.CmpNoCase(it->second->listing.path)) {
+			cacheIters.push_back(it->second);
+		}
+	}
 }
 
 bool CDirectoryCache::DoesExist(const CServer &server, const CServerPath &path, int &hasUnsureEntries, bool &is_outdated)
 {
 	scoped_lock lock(mutex_);
 
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end())
-		return false;
-
 	tCacheIter iter;
-	if (Lookup(iter, sit, path, true, is_outdated)) {
+	if (Lookup(iter, server, path, true, is_outdated)) {
 		hasUnsureEntries = iter->listing.get_unsure_flags();
 		return true;
 	}
@@ -110,15 +733,9 @@ bool CDirectoryCache::LookupFile(CDirentry &entry, const CServer &server, const
 {
 	scoped_lock lock(mutex_);
 
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end()) {
-		dirDidExist = false;
-		return false;
-	}
-
 	tCacheIter iter;
 	bool unused;
-	if (!Lookup(iter, sit, path, true, unused)) {
+	if (!Lookup(iter, server, path, true, unused)) {
 		dirDidExist = false;
 		return false;
 	}
@@ -143,36 +760,24 @@ bool CDirectoryCache::LookupFile(CDirentry &entry, const CServer &server, const
 	return false;
 }
 
-CDirectoryCache::CCacheEntry& CDirectoryCache::CCacheEntry::operator=(const CDirectoryCache::CCacheEntry &a)
-{
-	lruIt = a.lruIt;
-	listing = a.listing;
-	modificationTime = a.modificationTime;
-
-	return *this;
-}
-
-CDirectoryCache::CCacheEntry::CCacheEntry(const CDirectoryCache::CCacheEntry &entry)
-	: lruIt()
-{
-	listing = entry.listing;
-	modificationTime = entry.modificationTime;
-}
-
 bool CDirectoryCache::InvalidateFile(const CServer &server, const CServerPath &path, const wxString& filename, bool *wasDir /*=false*/)
 {
 	scoped_lock lock(mutex_);
 
+	if (disk_) {
+		disk_->Remove(GetServerKey(server), path);
+	}
+
 	tServerIter sit = GetServerEntry(server);
 	if (sit == m_serverList.end())
 		return false;
 
-	for (tCacheIter iter = sit->cacheList.begin(); iter != sit->cacheList.end(); ++iter) {
+	std::vector<tCacheIter> iters;
+	FindNoCase(iters, sit, path);
+	for (auto const& iter : iters) {
 		CCacheEntry &entry = *iter;
-		if (path.CmpNoCase(entry.listing.path))
-			continue;
 
-		UpdateLru(sit, iter);
+		UpdateLru(iter);
 
 		for (unsigned int i = 0; i < entry.listing.GetCount(); i++) {
 			if (!filename.CmpNoCase(((const CCacheEntry&)entry).listing[i].name)) {
@@ -192,20 +797,24 @@ bool CDirectoryCache::UpdateFile(const CServer &server, const CServerPath &path,
 {
 	scoped_lock lock(mutex_);
 
+	if (disk_) {
+		disk_->Remove(GetServerKey(server), path);
+	}
+
 	tServerIter sit = GetServerEntry(server);
 	if (sit == m_serverList.end())
 		return false;
 
 	bool updated = false;
 
-	for (tCacheIter iter = sit->cacheList.begin(); iter != sit->cacheList.end(); ++iter)
+	std::vector<tCacheIter> iters;
+	FindNoCase(iters, sit, path);
+	for (auto const& iter : iters)
 	{
 		CCacheEntry &entry = *iter;
 		const CCacheEntry &cEntry = *iter;
-		if (path.CmpNoCase(entry.listing.path))
-			continue;
 
-		UpdateLru(sit, iter);
+		UpdateLru(iter);
 
 		bool matchCase = false;
 		unsigned int i;
@@ -256,7 +865,7 @@ bool CDirectoryCache::UpdateFile(const CServer &server, const CServerPath &path,
 				break;
 			}
 
-			++m_totalFileCount;
+			UpdateSize(iter);
 		}
 		else
 			entry.listing.m_flags |= CDirectoryListing::unsure_unknown;
@@ -272,36 +881,28 @@ bool CDirectoryCache::RemoveFile(const CServer &server, const CServerPath &path,
 {
 	scoped_lock lock(mutex_);
 
+	if (disk_) {
+		disk_->Remove(GetServerKey(server), path);
+	}
+
 	tServerIter sit = GetServerEntry(server);
 	if (sit == m_serverList.end())
 		return false;
 
-	for (tCacheIter iter = sit->cacheList.begin(); iter != sit->cacheList.end(); ++iter)
+	std::vector<tCacheIter> iters;
+	FindNoCase(iters, sit, path);
+	for (auto const& iter : iters)
 	{
 		const CCacheEntry &entry = *iter;
-		if (path.CmpNoCase(entry.listing.path))
-			continue;
 
-		UpdateLru(sit, iter);
+		UpdateLru(iter);
 
-		bool matchCase = false;
-		for (unsigned int i = 0; i < entry.listing.GetCount(); i++)
+		int const i = entry.listing.FindFile_CmpCase(filename);
+		if (i >= 0)
 		{
-			if (entry.listing[i].name == filename)
-				matchCase = true;
-		}
-
-		if (matchCase)
-		{
-			unsigned int i;
-			for (i = 0; i < entry.listing.GetCount(); i++)
-				if (entry.listing[i].name == filename)
-					break;
-			wxASSERT(i != entry.listing.GetCount());
-
 			CDirectoryListing& listing = iter->listing;
 			listing.RemoveEntry(i); // This does set m_hasUnsureEntries
-			--m_totalFileCount;
+			UpdateSize(iter);
 		}
 		else
 		{
@@ -322,25 +923,24 @@ void CDirectoryCache::InvalidateServer(const CServer& server)
 {
 	scoped_lock lock(mutex_);
 
-	for (auto iter = m_serverList.begin(); iter != m_serverList.end(); ++iter)
-	{
-		if (iter->server != server)
-			continue;
+	if (disk_) {
+		disk_->RemoveServer(GetServerKey(server));
+	}
 
-		for (tCacheIter cit = iter->cacheList.begin(); cit != iter->cacheList.end(); ++cit)
-		{
-			tLruList::iterator* lruIt = (tLruList::iterator*)cit->lruIt;
-			if (lruIt)
-			{
-				m_leastRecentlyUsedList.erase(*lruIt);
-				delete lruIt;
-			}
+	tServerIter sit = GetServerEntry(server);
+	if (sit == m_serverList.end())
+		return;
 
-			m_totalFileCount -= cit->listing.GetCount();
-		}
+	// Erasing the last entry of a server also erases the server entry,
+	// sit must not be used once erasing has started.
+	std::vector<tCacheIter> cacheIters;
+	cacheIters.reserve(sit->paths.size());
+	for (auto const& path : sit->paths) {
+		cacheIters.push_back(path.second);
+	}
 
-		m_serverList.erase(iter);
-		break;
+	for (auto const& cit : cacheIters) {
+		Erase(cit);
 	}
 }
 
@@ -348,13 +948,9 @@ bool CDirectoryCache::GetChangeTime(CMonotonicTime& time, const CServer &server,
 {
 	scoped_lock lock(mutex_);
 
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end())
-		return false;
-
 	tCacheIter iter;
 	bool unused;
-	if (Lookup(iter, sit, path, true, unused)) {
+	if (Lookup(iter, server, path, true, unused)) {
 		time = iter->modificationTime;
 		return true;
 	}
@@ -369,28 +965,30 @@ void CDirectoryCache::RemoveDir(const CServer& server, const CServerPath& path,
 	// TODO: This is not 100% foolproof and may not work properly
 	// Perhaps just throw away the complete cache?
 
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end())
-		return;
-
 	CServerPath absolutePath = path;
 	if (!absolutePath.AddSegment(filename))
 		absolutePath.clear();
 
-	for (tCacheIter iter = sit->cacheList.begin(); iter != sit->cacheList.end(); ) {
-		CCacheEntry &entry = *iter;
+	if (disk_ && !absolutePath.empty()) {
+		disk_->RemoveDir(GetServerKey(server), absolutePath);
+	}
+
+	tServerIter sit = GetServerEntry(server);
+	if (sit == m_serverList.end())
+		return;
+
+	if (!absolutePath.empty()) {
 		// Delete exact matches and subdirs
-		if (!absolutePath.empty() && (entry.listing.path == absolutePath || absolutePath.IsParentOf(entry.listing.path, true))) {
-			m_totalFileCount -= entry.listing.GetCount();
-			tLruList::iterator* lruIt = (tLruList::iterator*)iter->lruIt;
-			if (lruIt) {
-				m_leastRecentlyUsedList.erase(*lruIt);
-				delete lruIt;
+		std::vector<tCacheIter> iters;
+		for (auto const& it : sit->paths) {
+			CDirectoryListing const& listing = it.second->listing;
+			if (listing.path == absolutePath || absolutePath.IsParentOf(listing.path, true)) {
+				iters.push_back(it.second);
 			}
-			sit->cacheList.erase(iter++);
 		}
-		else {
-			++iter;
+
+		for (auto const& iter : iters) {
+			Erase(iter);
 		}
 	}
 
@@ -401,13 +999,9 @@ void CDirectoryCache::Rename(const CServer& server, const CServerPath& pathFrom,
 {
 	scoped_lock lock(mutex_);
 
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end())
-		return;
-
 	tCacheIter iter;
 	bool is_outdated = false;
-	bool found = Lookup(iter, sit, pathFrom, true, is_outdated);
+	bool found = Lookup(iter, server, pathFrom, true, is_outdated);
 	if (found)
 	{
 		CDirectoryListing& listing = iter->listing;
@@ -434,6 +1028,7 @@ void CDirectoryCache::Rename(const CServer& server, const CServerPath& pathFrom,
 					listing[i].flags |= CDirentry::flag_unsure;
 					listing.m_flags |= CDirectoryListing::unsure_unknown;
 					listing.ClearFindMap();
+					UpdateSize(iter);
 				}
 			}
 			return;
@@ -484,33 +1079,60 @@ CDirectoryCache::tServerIter CDirectoryCache::GetServerEntry(const CServer& serv
 	return iter;
 }
 
-void CDirectoryCache::UpdateLru(tServerIter const& sit, tCacheIter const& cit)
+CDirectoryCache::tCacheIter CDirectoryCache::Insert(tServerIter const& sit, CDirectoryListing const& listing)
 {
-	tLruList::iterator* lruIt = (tLruList::iterator*)cit->lruIt;
-	if (lruIt) {
-		m_leastRecentlyUsedList.splice(m_leastRecentlyUsedList.end(), m_leastRecentlyUsedList, *lruIt);
-		**lruIt = std::make_pair(sit, cit);
+	tCacheIter const iter = m_cacheList.emplace(m_cacheList.end(), listing, *sit);
+	sit->paths.emplace(HashPathNoCase(listing.path), iter);
+
+	iter->size = EstimateSize(listing);
+	m_totalSize += iter->size;
+
+	return iter;
+}
+
+void CDirectoryCache::Erase(tCacheIter const& iter)
+{
+	CServerEntry & serverEntry = *iter->server;
+
+	auto range = serverEntry.paths.equal_range(HashPathNoCase(iter->listing.path));
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second == iter) {
+			serverEntry.paths.erase(it);
+			break;
+		}
+	}
+
+	m_totalSize -= iter->size;
+	m_cacheList.erase(iter);
+
+	if (serverEntry.paths.empty()) {
+		for (tServerIter sit = m_serverList.begin(); sit != m_serverList.end(); ++sit) {
+			if (&*sit == &serverEntry) {
+				m_serverList.erase(sit);
+				break;
+			}
+		}
 	}
-	else
-		cit->lruIt = (void*)new tLruList::iterator(m_leastRecentlyUsedList.emplace(m_leastRecentlyUsedList.end(), sit, cit));
 }
 
-void CDirectoryCache::Prune()
+void CDirectoryCache::UpdateLru(tCacheIter const& cit)
 {
-	while ((m_leastRecentlyUsedList.size() > 50000) ||
-		(m_totalFileCount > 1000000 && m_leastRecentlyUsedList.size() > 1000) ||
-		(m_totalFileCount > 5000000 && m_leastRecentlyUsedList.size() > 100))
-	{
-		tFullEntryPosition pos = m_leastRecentlyUsedList.front();
-		tLruList::iterator* lruIt = (tLruList::iterator*)pos.second->lruIt;
-		delete lruIt;
+	m_cacheList.splice(m_cacheList.end(), m_cacheList, cit);
+}
 
-		m_totalFileCount -= pos.second->listing.GetCount();
+void CDirectoryCache::UpdateSize(tCacheIter const& cit)
+{
+	m_totalSize -= cit->size;
+	cit->size = EstimateSize(cit->listing);
+	m_totalSize += cit->size;
+}
 
-		pos.first->cacheList.erase(pos.second);
-		if (pos.first->cacheList.empty())
-			m_serverList.erase(pos.first);
+void CDirectoryCache::Prune()
+{
+	int64_t const limit = static_cast<int64_t>(options_.GetOptionVal(OPTION_CACHE_SIZE_LIMIT)) * 1024 * 1024;
 
-		m_leastRecentlyUsedList.pop_front();
+	// Always keep the most recently used listing, even if it alone exceeds the limit
+	while (m_totalSize > limit && m_cacheList.size() > 1) {
+		Erase(m_cacheList.begin());
 	}
 }
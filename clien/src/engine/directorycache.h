@@ -16,8 +16,13 @@ version.
 
 #include <mutex.h>
 
+#include <memory>
+#include <unordered_map>
+
 const int CACHE_TIMEOUT = 1800; // In seconds
 
+class COptionsBase;
+
 class CDirectoryCache final
 {
 public:
@@ -28,7 +33,7 @@ public:
 		dir
 	};
 
-	CDirectoryCache();
+	explicit CDirectoryCache(COptionsBase& options);
 	~CDirectoryCache();
 
 	CDirectoryCache(CDirectoryCache const&) = delete;
@@ -47,37 +52,42 @@ public:
 	void Rename(const CServer& server, const CServerPath& pathFrom, const wxString& fileFrom, const CServerPath& pathTo, const wxString& fileTo);
 
 protected:
+	class CServerEntry;
 
 	class CCacheEntry final
 	{
 	public:
-		CCacheEntry() : lruIt() { };
-		CCacheEntry(const CCacheEntry &entry);
-		explicit CCacheEntry(CDirectoryListing const& l)
+		CCacheEntry(CDirectoryListing const& l, CServerEntry& s)
 			: listing(l)
 			, modificationTime(CMonotonicTime::Now())
-			, lruIt()
+			, server(&s)
 		{}
-		~CCacheEntry() { };
 
 		CDirectoryListing listing;
 		CMonotonicTime modificationTime;
 
-		CCacheEntry& operator=(const CCacheEntry &a);
+		CServerEntry* server;
 
-		void* lruIt; // void* to break cyclic declaration dependency
+		// Estimated number of bytes used by this entry
+		int64_t size{};
 	};
 
+	// All cached listings of all servers, least recently used first
+	typedef std::list<CCacheEntry> tCacheList;
+	typedef tCacheList::iterator tCacheIter;
+
+	// Maps case-insensitive hashes of paths to the entries
+	typedef std::unordered_multimap<size_t, tCacheIter> tPathIndex;
+
 	class CServerEntry final
 	{
 	public:
-		CServerEntry() {}
 		explicit CServerEntry(CServer const& s)
 			: server(s)
 		{}
 
 		CServer server;
-		std::list<CCacheEntry> cacheList;
+		tPathIndex paths;
 	};
 
 	typedef std::list<CServerEntry>::iterator tServerIter;
@@ -85,24 +95,33 @@ protected:
 	tServerIter CreateServerEntry(const CServer& server);
 	tServerIter GetServerEntry(const CServer& server);
 
-	typedef std::list<CCacheEntry>::iterator tCacheIter;
-	typedef std::list<CCacheEntry>::const_iterator tCacheConstIter;
+	// Finds an exact match, loading it from the disk cache if needed.
+	bool Lookup(tCacheIter &cacheIter, const CServer& server, const CServerPath &path, bool allowUnsureEntries, bool& is_outdated);
+
+	// Fills cacheIters with all entries of the server whose paths match case-insensitively
+	void FindNoCase(std::vector<tCacheIter> & cacheIters, tServerIter const& sit, const CServerPath &path);
+
+	tCacheIter Insert(tServerIter const& sit, CDirectoryListing const& listing);
+	void Erase(tCacheIter const& iter);
 
-	bool Lookup(tCacheIter &cacheIter, tServerIter &sit, const CServerPath &path, bool allowUnsureEntries, bool& is_outdated);
+	void UpdateLru(tCacheIter const& cit);
+	void UpdateSize(tCacheIter const& cit);
+
+	void Prune();
+
+	COptionsBase& options_;
 
 	mutex mutex_;
 
 	std::list<CServerEntry> m_serverList;
 
-	void UpdateLru(tServerIter const& sit, tCacheIter const& cit);
-
-	void Prune();
+	tCacheList m_cacheList;
 
-	typedef std::pair<tServerIter, tCacheIter> tFullEntryPosition;
-	typedef std::list<tFullEntryPosition> tLruList;
-	tLruList m_leastRecentlyUsedList;
+	int64_t m_totalSize{};
 
-	int64_t m_totalFileCount{};
+	// Optional persistent tier, consulted on cache misses and written on destruction
+	class CDiskCache;
+	std::unique_ptr<CDiskCache> disk_;
 };
 
 #endif
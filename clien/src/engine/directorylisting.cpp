@@ -10,7 +10,7 @@ CDirectoryListing::CDirectoryListing(const CDirectoryListing& listing)
 	: path(listing.path)
 	, m_firstListTime(listing.m_firstListTime)
 	, m_flags(listing.m_flags)
-	, m_entries(listing.m_entries), m_searchmap_case(listing.m_searchmap_case), m_searchmap_nocase(listing.m_searchmap_nocase)
+	, m_entries(listing.m_entries), m_index(listing.m_index)
 	, m_entryCount(listing.m_entryCount)
 {
 }
@@ -30,8 +30,7 @@ CDirectoryListing& CDirectoryListing::operator=(const CDirectoryListing &a)
 
 	m_firstListTime = a.m_firstListTime;
 
-	m_searchmap_case = a.m_searchmap_case;
-	m_searchmap_nocase = a.m_searchmap_nocase;
+	m_index = a.m_index;
 
 	return *this;
 }
@@ -81,19 +80,14 @@ void CDirectoryListing::SetCount(unsigned int count)
 	if (count == m_entryCount)
 		return;
 
-	const unsigned int old_count = m_entryCount;
-
 	if (!count)
 	{
+		m_index.clear();
 		m_entryCount = 0;
 		return;
 	}
 
-	if (count < old_count)
-	{
-		m_searchmap_case.clear();
-		m_searchmap_nocase.clear();
-	}
+	m_index.clear();
 
 	m_entries.Get().resize(count);
 
@@ -134,8 +128,7 @@ void CDirectoryListing::Assign(std::deque<CRefcountObject<CDirentry>> &entries)
 		own_entries.emplace_back(std::move(entry));
 	}
 
-	m_searchmap_case.clear();
-	m_searchmap_nocase.clear();
+	m_index.clear();
 }
 
 bool CDirectoryListing::RemoveEntry(unsigned int index)
@@ -143,8 +136,7 @@ bool CDirectoryListing::RemoveEntry(unsigned int index)
 	if (index >= GetCount())
 		return false;
 
-	m_searchmap_case.clear();
-	m_searchmap_nocase.clear();
+	m_index.clear();
 
 	std::vector<CRefcountObject<CDirentry> >& entries = m_entries.Get();
 	std::vector<CRefcountObject<CDirentry> >::iterator iter = entries.begin() + index;
@@ -166,82 +158,140 @@ void CDirectoryListing::GetFilenames(std::vector<wxString> &names) const
 		names.push_back((*m_entries)[i]->name);
 }
 
-int CDirectoryListing::FindFile_CmpCase(const wxString& name) const
+namespace {
+// FNV-1a over the UTF-16/UTF-32 code units of the name
+unsigned int const hash_offset = 2166136261u;
+unsigned int const hash_prime = 16777619u;
+
+inline unsigned int HashName(const wxString& name)
 {
-	if (!m_entryCount)
-		return -1;
+	unsigned int hash = hash_offset;
+	const wxChar* p = name.c_str();
+	for (size_t i = 0; i < name.size(); ++i) {
+		hash = (hash ^ static_cast<unsigned int>(p[i])) * hash_prime;
+	}
+	return hash;
+}
 
-	if (!m_searchmap_case)
-		m_searchmap_case.Get();
+inline void HashNameBoth(const wxString& name, unsigned int& hash_case, unsigned int& hash_nocase)
+{
+	hash_case = hash_offset;
+	hash_nocase = hash_offset;
+	const wxChar* p = name.c_str();
+	for (size_t i = 0; i < name.size(); ++i) {
+		wxChar const c = p[i];
+		hash_case = (hash_case ^ static_cast<unsigned int>(c)) * hash_prime;
+		hash_nocase = (hash_nocase ^ static_cast<unsigned int>(static_cast<wxChar>(wxTolower(c)))) * hash_prime;
+	}
+}
 
-	// Search map
-	std::multimap<wxString, unsigned int>::const_iterator iter = m_searchmap_case->find(name);
-	if (iter != m_searchmap_case->end())
-		return iter->second;
+inline unsigned int HashNameNoCase(const wxString& name)
+{
+	unsigned int hash = hash_offset;
+	const wxChar* p = name.c_str();
+	for (size_t i = 0; i < name.size(); ++i) {
+		hash = (hash ^ static_cast<unsigned int>(static_cast<wxChar>(wxTolower(p[i])))) * hash_prime;
+	}
+	return hash;
+}
 
-	unsigned int i = m_searchmap_case->size();
-	if (i == m_entryCount)
-		return -1;
+// Same as comparing lowercased copies of both strings, without the copies
+bool EqualNoCase(const wxString& a, const wxString& b)
+{
+	size_t const len = a.size();
+	if (len != b.size())
+		return false;
 
-	std::multimap<wxString, unsigned int>& searchmap_case = m_searchmap_case.Get();
+	const wxChar* pa = a.c_str();
+	const wxChar* pb = b.c_str();
+	for (size_t i = 0; i < len; ++i) {
+		if (pa[i] != pb[i] && static_cast<wxChar>(wxTolower(pa[i])) != static_cast<wxChar>(wxTolower(pb[i])))
+			return false;
+	}
+	return true;
+}
+}
 
-	// Build map if not yet complete
-	std::vector<CRefcountObject<CDirentry> >::const_iterator entry_iter = m_entries->begin() + i;
-	for (; entry_iter != m_entries->end(); ++entry_iter, ++i)
-	{
-		const wxString& entry_name = (*entry_iter)->name;
-		searchmap_case.insert(std::pair<const wxString, unsigned int>(entry_name, i));
+void CDirectoryListing::CNameIndex::Build(std::vector<CRefcountObject<CDirentry> > const& entries, unsigned int count)
+{
+	count_ = count;
+
+	// Keep the load factor at or below 50% so that probe sequences stay short.
+	unsigned int size = 16;
+	while (size < count_ * 2)
+		size *= 2;
+	mask_ = size - 1;
+
+	case_.assign(size, bucket{0, 0});
+	nocase_.assign(size, bucket{0, 0});
+
+	// Entries are inserted in ascending order. Linear probing thus always
+	// yields the lowest index amongst entries with equal names first.
+	for (unsigned int i = 0; i < count_; ++i) {
+		unsigned int hash_case, hash_nocase;
+		HashNameBoth(entries[i]->name, hash_case, hash_nocase);
+
+		unsigned int pos = hash_case & mask_;
+		while (case_[pos].index)
+			pos = (pos + 1) & mask_;
+		case_[pos] = bucket{hash_case, i + 1};
+
+		pos = hash_nocase & mask_;
+		while (nocase_[pos].index)
+			pos = (pos + 1) & mask_;
+		nocase_[pos] = bucket{hash_nocase, i + 1};
+	}
+}
 
-		if (entry_name == name)
-			return i;
+int CDirectoryListing::CNameIndex::Find(std::vector<CRefcountObject<CDirentry> > const& entries, const wxString& name, bool cmpCase) const
+{
+	if (cmpCase) {
+		unsigned int const hash = HashName(name);
+		for (unsigned int pos = hash & mask_; case_[pos].index; pos = (pos + 1) & mask_) {
+			bucket const& b = case_[pos];
+			if (b.hash == hash && entries[b.index - 1]->name == name)
+				return b.index - 1;
+		}
+	}
+	else {
+		unsigned int const hash = HashNameNoCase(name);
+		for (unsigned int pos = hash & mask_; nocase_[pos].index; pos = (pos + 1) & mask_) {
+			bucket const& b = nocase_[pos];
+			if (b.hash == hash && EqualNoCase(entries[b.index - 1]->name, name))
+				return b.index - 1;
+		}
 	}
 
-	// Map is complete, item not in it
 	return -1;
 }
 
-int CDirectoryListing::FindFile_CmpNoCase(wxString name) const
+int CDirectoryListing::FindFile_CmpCase(const wxString& name) const
 {
 	if (!m_entryCount)
 		return -1;
 
-	if (!m_searchmap_nocase)
-		m_searchmap_nocase.Get();
-
-	name.MakeLower();
+	if (!m_index || m_index->GetCount() != m_entryCount) {
+		m_index.clear();
+		m_index.Get().Build(*m_entries, m_entryCount);
+	}
 
-	// Search map
-	std::multimap<wxString, unsigned int>::const_iterator iter = m_searchmap_nocase->find(name);
-	if (iter != m_searchmap_nocase->end())
-		return iter->second;
+	return m_index->Find(*m_entries, name, true);
+}
 
-	unsigned int i = m_searchmap_nocase->size();
-	if (i == m_entryCount)
+int CDirectoryListing::FindFile_CmpNoCase(const wxString& name) const
+{
+	if (!m_entryCount)
 		return -1;
 
-	std::multimap<wxString, unsigned int>& searchmap_nocase = m_searchmap_nocase.Get();
-
-	// Build map if not yet complete
-	std::vector<CRefcountObject<CDirentry> >::const_iterator entry_iter = m_entries->begin() + i;
-	for (; entry_iter != m_entries->end(); ++entry_iter, ++i)
-	{
-		wxString entry_name = (*entry_iter)->name;
-		entry_name.MakeLower();
-		searchmap_nocase.insert(std::pair<const wxString, unsigned int>(entry_name, i));
-
-		if (entry_name == name)
-			return i;
+	if (!m_index || m_index->GetCount() != m_entryCount) {
+		m_index.clear();
+		m_index.Get().Build(*m_entries, m_entryCount);
 	}
 
-	// Map is complete, item not in it
-	return -1;
+	return m_index->Find(*m_entries, name, false);
 }
 
 void CDirectoryListing::ClearFindMap()
 {
-	if (!m_searchmap_case)
-		return;
-
-	m_searchmap_case.clear();
-	m_searchmap_nocase.clear();
+	m_index.clear();
 }
@@ -46,6 +46,7 @@ class CFileZillaEngineContext::Impl final
 public:
 	Impl(COptionsBase& options)
 		: limiter_(loop_, options)
+		, directory_cache_(options)
 		, optionChangeHandler_(options, loop_)
 	{
 		CLogging::UpdateLogLevel(options);
@@ -35,7 +35,7 @@ bool CFile::Open(wxString const& f, mode m, disposition d)
 	}
 
 	DWORD shareMode = FILE_SHARE_READ;
-	if (m == read) {
+	if (m == read || d == shared) {
 		shareMode |= FILE_SHARE_WRITE;
 	}
 
@@ -119,9 +119,20 @@ bool CFile::Opened() const
 	return hFile_ != INVALID_HANDLE_VALUE;
 }
 
+bool CFile::SetDirect(bool direct)
+{
+	// FILE_FLAG_NO_BUFFERING can only be set when opening the file
+	return !direct;
+}
+
+void CFile::DropCache(wxFileOffset, wxFileOffset)
+{
+}
+
 #else
 
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
 bool CFile::Open(wxString const& f, mode m, disposition d)
@@ -142,7 +153,9 @@ bool CFile::Open(wxString const& f, mode m, disposition d)
 
 #if HAVE_POSIX_FADVISE
 	if (fd_ != -1) {
-		(void)posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL | POSIX_FADV_NOREUSE);
+		// The advice values are no flags, they cannot be combined
+		(void)posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+		(void)posix_fadvise(fd_, 0, 0, POSIX_FADV_NOREUSE);
 	}
 #endif
 
@@ -228,4 +241,40 @@ bool CFile::Opened() const
 	return fd_ != -1;
 }
 
+bool CFile::SetDirect(bool direct)
+{
+#if defined(O_DIRECT)
+	int flags = fcntl(fd_, F_GETFL);
+	if (flags == -1) {
+		return false;
+	}
+
+	if (direct) {
+		flags |= O_DIRECT;
+	}
+	else {
+		flags &= ~O_DIRECT;
+	}
+	return fcntl(fd_, F_SETFL, flags) == 0;
+#elif defined(F_NOCACHE)
+	return fcntl(fd_, F_NOCACHE, direct ? 1 : 0) != -1;
+#else
+	return !direct;
+#endif
+}
+
+void CFile::DropCache(wxFileOffset offset, wxFileOffset len)
+{
+#if HAVE_SYNC_FILE_RANGE
+	// Dirty pages cannot be evicted, write them back first
+	(void)sync_file_range(fd_, offset, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+#if HAVE_POSIX_FADVISE
+	(void)posix_fadvise(fd_, offset, len, POSIX_FADV_DONTNEED);
+#else
+	(void)offset;
+	(void)len;
+#endif
+}
+
 #endif
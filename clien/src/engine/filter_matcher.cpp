@@ -0,0 +1,528 @@
+#include <filezilla.h>
+#include "filter_matcher.h"
+
+#include <wx/regex.h>
+
+#ifndef __WXMSW__
+#include <sys/stat.h>
+#endif
+
+#include <deque>
+
+CFilterCondition::CFilterCondition()
+{
+	type = filter_name;
+	condition = 0;
+	matchCase = true;
+	value = 0;
+}
+
+CFilter::CFilter()
+{
+	matchType = all;
+	filterDirs = true;
+	filterFiles = true;
+
+	// Filenames on Windows ignore case
+#ifdef __WXMSW__
+	matchCase = false;
+#else
+	matchCase = true;
+#endif
+}
+
+bool CFilter::HasConditionOfType(enum t_filterType type) const
+{
+	for (std::vector<CFilterCondition>::const_iterator iter = filters.begin(); iter != filters.end(); ++iter)
+	{
+		if (iter->type == type)
+			return true;
+	}
+
+	return false;
+}
+
+bool CFilter::IsLocalFilter() const
+{
+	 return HasConditionOfType(filter_attributes) || HasConditionOfType(filter_permissions);
+}
+
+void CStringMatcher::Add(kind k, wxString const& pattern, size_t id)
+{
+	t_pattern p;
+	p.k = k;
+	p.length = pattern.length();
+	p.id = id;
+	patterns_.push_back(p);
+	values_.push_back(pattern);
+
+	transitions_.clear();
+}
+
+int CStringMatcher::Symbol(wxUint32 c) const
+{
+	if (c < 128)
+		return ascii_[c];
+
+	if (foldCase_) {
+		c = static_cast<wxUint32>(wxTolower(wxUniChar(c)).GetValue());
+		if (c < 128)
+			return ascii_[c];
+	}
+
+	auto it = symbols_.find(c);
+	return (it != symbols_.end()) ? it->second : 0;
+}
+
+void CStringMatcher::Compile(bool foldCase)
+{
+	emptyPatterns_.clear();
+	symbols_.clear();
+	std::fill(ascii_, ascii_ + 128, 0);
+	symbolCount_ = 1;
+	foldCase_ = false;
+	transitions_.clear();
+	outputs_.clear();
+	outputLinks_.clear();
+
+	// Number the characters of the patterns
+	for (auto const& value : values_) {
+		for (wxString::const_iterator it = value.begin(); it != value.end(); ++it) {
+			wxUint32 const c = static_cast<wxUint32>((*it).GetValue());
+			if (c < 128) {
+				if (!ascii_[c])
+					ascii_[c] = symbolCount_++;
+			}
+			else if (symbols_.find(c) == symbols_.end())
+				symbols_[c] = symbolCount_++;
+		}
+	}
+
+	// Uppercase characters get the symbols of their lowercase forms, the
+	// same way wxString::Lower folds them.
+	if (foldCase) {
+		int folded[128];
+		for (wxUint32 c = 0; c < 128; ++c)
+			folded[c] = Symbol(static_cast<wxUint32>(wxTolower(wxUniChar(c)).GetValue()));
+		std::copy(folded, folded + 128, ascii_);
+		foldCase_ = true;
+	}
+
+	// Build the trie, -1 for missing transitions
+	transitions_.assign(symbolCount_, -1);
+	outputs_.resize(1);
+	for (size_t i = 0; i < patterns_.size(); ++i) {
+		if (!patterns_[i].length) {
+			emptyPatterns_.push_back(i);
+			continue;
+		}
+
+		int state = 0;
+		wxString const& value = values_[i];
+		for (wxString::const_iterator it = value.begin(); it != value.end(); ++it) {
+			int const symbol = Symbol(static_cast<wxUint32>((*it).GetValue()));
+			int next = transitions_[state * symbolCount_ + symbol];
+			if (next == -1) {
+				next = static_cast<int>(outputs_.size());
+				transitions_[state * symbolCount_ + symbol] = next;
+				transitions_.resize(transitions_.size() + symbolCount_, -1);
+				outputs_.resize(outputs_.size() + 1);
+			}
+			state = next;
+		}
+		outputs_[state].push_back(i);
+	}
+
+	// Breadth-first, each state gets the transitions of its longest proper
+	// suffix in the trie for the characters it has no transition of its own.
+	std::vector<int> fail(outputs_.size());
+	outputLinks_.assign(outputs_.size(), 0);
+
+	std::deque<int> queue;
+	for (int symbol = 0; symbol < symbolCount_; ++symbol) {
+		int & next = transitions_[symbol];
+		if (next == -1)
+			next = 0;
+		else
+			queue.push_back(next);
+	}
+
+	while (!queue.empty()) {
+		int const state = queue.front();
+		queue.pop_front();
+
+		for (int symbol = 0; symbol < symbolCount_; ++symbol) {
+			int & next = transitions_[state * symbolCount_ + symbol];
+			int const fallback = transitions_[fail[state] * symbolCount_ + symbol];
+			if (next == -1)
+				next = fallback;
+			else {
+				fail[next] = fallback;
+				outputLinks_[next] = outputs_[fallback].empty() ? outputLinks_[fallback] : fallback;
+				queue.push_back(next);
+			}
+		}
+	}
+}
+
+void CStringMatcher::Match(wxString const& text, std::vector<char>& hits) const
+{
+	size_t const length = text.length();
+
+	for (auto const& i : emptyPatterns_) {
+		t_pattern const& p = patterns_[i];
+		if (p.k != kind::equals || !length)
+			hits[p.id] = 1;
+	}
+
+	// Nothing but the start state
+	if (outputs_.size() < 2)
+		return;
+
+	int state = 0;
+	size_t end = 0;
+	for (wxString::const_iterator it = text.begin(); it != text.end(); ++it) {
+		++end;
+		state = transitions_[state * symbolCount_ + Symbol(static_cast<wxUint32>((*it).GetValue()))];
+
+		int out = outputs_[state].empty() ? outputLinks_[state] : state;
+		while (out) {
+			for (auto const& i : outputs_[out]) {
+				t_pattern const& p = patterns_[i];
+				bool const atStart = end == p.length;
+				switch (p.k)
+				{
+				case kind::contains:
+					hits[p.id] = 1;
+					break;
+				case kind::equals:
+					if (atStart && end == length)
+						hits[p.id] = 1;
+					break;
+				case kind::begins:
+					if (atStart)
+						hits[p.id] = 1;
+					break;
+				case kind::ends:
+					if (end == length)
+						hits[p.id] = 1;
+					break;
+				}
+			}
+			out = outputLinks_[out];
+		}
+	}
+}
+
+namespace {
+size_t const npos = static_cast<size_t>(-1);
+
+enum class t_nameCondition
+{
+	contains = 0,
+	equals = 1,
+	begins = 2,
+	ends = 3,
+	regex = 4,
+	not_contains = 5
+};
+
+int MatcherIndex(CFilter const& filter, CFilterCondition const& condition)
+{
+	return (condition.type == filter_path ? 2 : 0) + (filter.matchCase ? 0 : 1);
+}
+}
+
+// The name and path of the entry being filtered. Each is run through the
+// matchers at most once, no matter how many conditions look at it.
+class CFilterMatcher::CSubjects final
+{
+public:
+	CSubjects(CFilterMatcher const& owner, wxString const& name, wxString const& path)
+		: owner_(owner)
+		, name_(name)
+		, path_(path)
+		, hits_(owner.hitCount_)
+	{
+	}
+
+	bool Hit(int matcher, size_t hit)
+	{
+		if (!ran_[matcher]) {
+			ran_[matcher] = true;
+			owner_.matchers_[matcher].Match(Original(matcher >= 2), hits_);
+		}
+		return hits_[hit] != 0;
+	}
+
+	wxString const& Original(bool path) const { return path ? path_ : name_; }
+
+private:
+	CFilterMatcher const& owner_;
+	wxString const& name_;
+	wxString const& path_;
+
+	std::vector<char> hits_;
+	bool ran_[4]{};
+};
+
+CFilterMatcher::CFilterMatcher()
+{
+}
+
+CFilterMatcher::CFilterMatcher(std::vector<CFilter> const& filters)
+	: filters_(filters)
+{
+	refs_.resize(filters_.size());
+	for (size_t i = 0; i < filters_.size(); ++i) {
+		CFilter const& filter = filters_[i];
+		auto & refs = refs_[i];
+		refs.resize(filter.filters.size(), npos);
+
+		for (size_t j = 0; j < filter.filters.size(); ++j) {
+			CFilterCondition const& condition = filter.filters[j];
+			if (condition.type != filter_name && condition.type != filter_path)
+				continue;
+
+			t_nameCondition const c = static_cast<t_nameCondition>(condition.condition);
+			if (c == t_nameCondition::regex) {
+				// Without subexpressions, matching does not touch the compiled
+				// expression and can be done from several threads at once.
+				std::unique_ptr<wxRegEx> regex(new wxRegEx(condition.strValue, wxRE_DEFAULT | wxRE_NOSUB));
+				if (!regex->IsValid()) {
+					valid_ = false;
+					continue;
+				}
+				refs[j] = regexes_.size();
+				regexes_.push_back(std::move(regex));
+				continue;
+			}
+
+			CStringMatcher::kind k;
+			switch (c)
+			{
+			case t_nameCondition::contains:
+			case t_nameCondition::not_contains:
+				k = CStringMatcher::kind::contains;
+				break;
+			case t_nameCondition::equals:
+				k = CStringMatcher::kind::equals;
+				break;
+			case t_nameCondition::begins:
+				k = CStringMatcher::kind::begins;
+				break;
+			case t_nameCondition::ends:
+				k = CStringMatcher::kind::ends;
+				break;
+			default:
+				continue;
+			}
+
+			refs[j] = hitCount_++;
+			matchers_[MatcherIndex(filter, condition)].Add(k, filter.matchCase ? condition.strValue : condition.strValue.Lower(), refs[j]);
+		}
+	}
+
+	for (int i = 0; i < 4; ++i) {
+		matchers_[i].Compile((i & 1) != 0);
+	}
+}
+
+CFilterMatcher::~CFilterMatcher()
+{
+}
+
+bool CFilterMatcher::Filtered(wxString const& name, wxString const& path, bool dir, wxLongLong size, int attributes, CDateTime const& date) const
+{
+	if (filters_.empty())
+		return false;
+
+	CSubjects subjects(*this, name, path);
+	for (size_t i = 0; i < filters_.size(); ++i) {
+		if (FilteredByFilter(i, subjects, dir, size, attributes, date))
+			return true;
+	}
+
+	return false;
+}
+
+bool CFilterMatcher::FilteredByFilter(size_t index, CSubjects& subjects, bool dir, wxLongLong size, int attributes, CDateTime const& date) const
+{
+	CFilter const& filter = filters_[index];
+
+	if (dir && !filter.filterDirs)
+		return false;
+	else if (!dir && !filter.filterFiles)
+		return false;
+
+	for (size_t j = 0; j < filter.filters.size(); ++j)
+	{
+		bool match = false;
+		const CFilterCondition& condition = filter.filters[j];
+
+		switch (condition.type)
+		{
+		case filter_name:
+		case filter_path:
+			{
+				size_t const ref = refs_[index][j];
+				if (ref == npos)
+					break;
+
+				t_nameCondition const c = static_cast<t_nameCondition>(condition.condition);
+				if (c == t_nameCondition::regex)
+					match = regexes_[ref]->Matches(subjects.Original(condition.type == filter_path));
+				else {
+					match = subjects.Hit(MatcherIndex(filter, condition), ref);
+					if (c == t_nameCondition::not_contains)
+						match = !match;
+				}
+			}
+			break;
+		case filter_size:
+			if (size == -1)
+				continue;
+			switch (condition.condition)
+			{
+			case 0:
+				if (size > condition.value)
+					match = true;
+				break;
+			case 1:
+				if (size == condition.value)
+					match = true;
+				break;
+			case 2:
+				if (size != condition.value)
+					match = true;
+				break;
+			case 3:
+				if (size < condition.value)
+					match = true;
+				break;
+			}
+			break;
+		case filter_attributes:
+#ifndef __WXMSW__
+			continue;
+#else
+			if (!attributes)
+				continue;
+
+			{
+				int flag = 0;
+				switch (condition.condition)
+				{
+				case 0:
+					flag = FILE_ATTRIBUTE_ARCHIVE;
+					break;
+				case 1:
+					flag = FILE_ATTRIBUTE_COMPRESSED;
+					break;
+				case 2:
+					flag = FILE_ATTRIBUTE_ENCRYPTED;
+					break;
+				case 3:
+					flag = FILE_ATTRIBUTE_HIDDEN;
+					break;
+				case 4:
+					flag = FILE_ATTRIBUTE_READONLY;
+					break;
+				case 5:
+					flag = FILE_ATTRIBUTE_SYSTEM;
+					break;
+				}
+
+				int set = (flag & attributes) ? 1 : 0;
+				if (set == condition.value)
+					match = true;
+			}
+#endif //__WXMSW__
+			break;
+		case filter_permissions:
+#ifdef __WXMSW__
+			continue;
+#else
+			if (attributes == -1)
+				continue;
+
+			{
+				int flag = 0;
+				switch (condition.condition)
+				{
+				case 0:
+					flag = S_IRUSR;
+					break;
+				case 1:
+					flag = S_IWUSR;
+					break;
+				case 2:
+					flag = S_IXUSR;
+					break;
+				case 3:
+					flag = S_IRGRP;
+					break;
+				case 4:
+					flag = S_IWGRP;
+					break;
+				case 5:
+					flag = S_IXGRP;
+					break;
+				case 6:
+					flag = S_IROTH;
+					break;
+				case 7:
+					flag = S_IWOTH;
+					break;
+				case 8:
+					flag = S_IXOTH;
+					break;
+				}
+
+				int set = (flag & attributes) ? 1 : 0;
+				if (set == condition.value)
+					match = true;
+			}
+#endif //__WXMSW__
+			break;
+		case filter_date:
+			if (date.IsValid()) {
+				int cmp = date.Compare( condition.date );
+				switch (condition.condition)
+				{
+				case 0: // Before
+					match = cmp < 0;
+					break;
+				case 1: // Equals
+					match = cmp == 0;
+					break;
+				case 2: // Not equals
+					match = cmp != 0;
+					break;
+				case 3: // After
+					match = cmp > 0;
+					break;
+				}
+			}
+			break;
+		default:
+			wxFAIL_MSG(_T("Unhandled filter type"));
+			break;
+		}
+		if (match) {
+			if (filter.matchType == CFilter::any)
+				return true;
+			else if (filter.matchType == CFilter::none)
+				return false;
+		}
+		else {
+			if (filter.matchType == CFilter::all)
+				return false;
+		}
+	}
+
+	if (filter.matchType != CFilter::any || filter.filters.empty())
+		return true;
+
+	return false;
+}
@@ -2187,9 +2187,17 @@ int CFtpControlSocket::FileTransfer(const wxString localFile, const CServerPath
 		return FZ_REPLY_ERROR;
 	}
 
+	if (!download && transferSettings.HasRange()) {
+		ResetOperation(FZ_REPLY_SYNTAXERROR);
+		return FZ_REPLY_ERROR;
+	}
+
 	if (download) {
 		wxString filename = remotePath.FormatFilename(remoteFile);
-		LogMessage(MessageType::Status, _("Starting download of %s"), filename);
+		if (transferSettings.HasRange())
+			LogMessage(MessageType::Status, _("Starting download of %s, bytes %s to %s"), filename, wxLongLong(transferSettings.rangeOffset).ToString(), wxLongLong(transferSettings.rangeOffset + transferSettings.rangeLength - 1).ToString());
+		else
+			LogMessage(MessageType::Status, _("Starting download of %s"), filename);
 	}
 	else {
 		LogMessage(MessageType::Status, _("Starting upload of %s"), localFile);
@@ -2551,7 +2559,29 @@ int CFtpControlSocket::FileTransferSend()
 				// Potentially racy
 				bool didExist = wxFile::Exists(pData->localFile);
 
-				if (pData->resume) {
+				if (pData->transferSettings.HasRange()) {
+					CreateLocalDir(pData->localFile);
+
+					// Other ranges of the file may be written by other connections at the same time
+					if (!pFile->Open(pData->localFile, CFile::write, CFile::shared)) {
+						LogMessage(MessageType::Error, _("Failed to open \"%s\" for writing"), pData->localFile);
+						ResetOperation(FZ_REPLY_ERROR);
+						return FZ_REPLY_ERROR;
+					}
+
+					pData->fileDidExist = didExist;
+
+					if (pFile->Seek(pData->transferSettings.rangeOffset, CFile::begin) != pData->transferSettings.rangeOffset) {
+						LogMessage(MessageType::Error, _("Could not seek to offset %s within file"), wxLongLong(pData->transferSettings.rangeOffset).ToString());
+						ResetOperation(FZ_REPLY_ERROR);
+						return FZ_REPLY_ERROR;
+					}
+					pData->localFileSize = pData->transferSettings.rangeOffset;
+					pData->resumeOffset = pData->transferSettings.rangeOffset;
+
+					engine_.transfer_status_.Init(pData->transferSettings.rangeLength, 0, false);
+				}
+				else if (pData->resume) {
 					if (!pFile->Open(pData->localFile, CFile::write, CFile::existing)) {
 						LogMessage(MessageType::Error, _("Failed to open \"%s\" for appending/writing"), pData->localFile);
 						ResetOperation(FZ_REPLY_ERROR);
@@ -2594,14 +2624,33 @@ int CFtpControlSocket::FileTransferSend()
 					pData->localFileSize = 0;
 				}
 
-				if (pData->resume)
+				if (pData->transferSettings.HasRange()) {
+					// Already set up above
+				}
+				else if (pData->resume) {
 					pData->resumeOffset = pData->localFileSize;
-				else
+					engine_.transfer_status_.Init(pData->remoteFileSize, startOffset, false);
+				}
+				else {
 					pData->resumeOffset = 0;
+					engine_.transfer_status_.Init(pData->remoteFileSize, startOffset, false);
+				}
 
-				engine_.transfer_status_.Init(pData->remoteFileSize, startOffset, false);
-
-				if (engine_.GetOptions().GetOptionVal(OPTION_PREALLOCATE_SPACE)) {
+				if (pData->transferSettings.HasRange()) {
+					// Extend the file to its final size if no other range did so yet.
+					// Never shrink it, other connections may already have written beyond.
+					if (engine_.GetOptions().GetOptionVal(OPTION_PREALLOCATE_SPACE) && pData->remoteFileSize > 0 && pFile->Length() < pData->remoteFileSize) {
+						wxFileOffset oldPos = pFile->Seek(0, CFile::current);
+						if (oldPos != -1) {
+							if (pFile->Seek(pData->remoteFileSize, CFile::begin) == pData->remoteFileSize) {
+								if (!pFile->Truncate())
+									LogMessage(MessageType::Debug_Warning, _T("Could not preallocate the file"));
+							}
+							pFile->Seek(oldPos, CFile::begin);
+						}
+					}
+				}
+				else if (engine_.GetOptions().GetOptionVal(OPTION_PREALLOCATE_SPACE)) {
 					// Try to preallocate the file in order to reduce fragmentation
 					wxFileOffset sizeToPreallocate = pData->remoteFileSize - startOffset;
 					if (sizeToPreallocate > 0) {
@@ -2674,8 +2723,8 @@ int CFtpControlSocket::FileTransferSend()
 				wxFileOffset len = pFile->Length();
 				engine_.transfer_status_.Init(len, startOffset, false);
 			}
-			pData->pIOThread = new CIOThread;
-			if (!pData->pIOThread->Create(std::move(pFile), !pData->download, pData->binary)) {
+			pData->pIOThread = new CIOThread(engine_.GetOptions());
+			if (!pData->pIOThread->Create(std::move(pFile), !pData->download, pData->binary, pData->download ? pData->remoteFileSize : -1, !pData->transferSettings.HasRange())) {
 				// CIOThread will delete pFile
 				delete pData->pIOThread;
 				pData->pIOThread = 0;
@@ -2683,11 +2732,16 @@ int CFtpControlSocket::FileTransferSend()
 				ResetOperation(FZ_REPLY_ERROR);
 				return FZ_REPLY_ERROR;
 			}
+			if (pData->pIOThread->Simulated()) {
+				LogMessage(MessageType::Status, _("Simulating file access, no data gets read from or written to \"%s\""), pData->localFile);
+			}
 		}
 
 		m_pTransferSocket = new CTransferSocket(engine_, *this, pData->download ? TransferMode::download : TransferMode::upload);
 		m_pTransferSocket->m_binaryMode = pData->transferSettings.binary;
 		m_pTransferSocket->SetIOThread(pData->pIOThread);
+		if (pData->download && pData->transferSettings.HasRange())
+			m_pTransferSocket->SetReceiveLimit(pData->transferSettings.rangeLength);
 
 		if (pData->download)
 			cmd = _T("RETR ");
@@ -4050,7 +4104,11 @@ int CFtpControlSocket::TransferParseResponse()
 			pData->opState = rawtransfer_waittransfer;
 		break;
 	case rawtransfer_waitfinish:
-		if (code != 2 && code != 3) {
+		if (code != 2 && code != 3 && m_pTransferSocket && m_pTransferSocket->ReceiveLimitReached()) {
+			LogMessage(MessageType::Debug_Info, _T("Server aborted transfer after the requested range got received"));
+			pData->opState = rawtransfer_waitsocket;
+		}
+		else if (code != 2 && code != 3) {
 			if (pData->pOldData->transferEndReason == TransferEndReason::successful)
 				pData->pOldData->transferEndReason = TransferEndReason::transfer_command_failure;
 			error = true;
@@ -4059,7 +4117,7 @@ int CFtpControlSocket::TransferParseResponse()
 			pData->opState = rawtransfer_waitsocket;
 		break;
 	case rawtransfer_waittransfer:
-		if (code != 2 && code != 3) {
+		if (code != 2 && code != 3 && !(m_pTransferSocket && m_pTransferSocket->ReceiveLimitReached())) {
 			if (pData->pOldData->transferEndReason == TransferEndReason::successful)
 				pData->pOldData->transferEndReason = TransferEndReason::transfer_command_failure;
 			error = true;
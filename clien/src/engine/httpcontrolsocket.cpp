@@ -486,6 +486,8 @@ int CHttpControlSocket::DoInternalConnect()
 
 	delete m_pBackend;
 	m_pBackend = new CSocketBackend(this, *m_pSocket, engine_.GetRateLimiter());
+	if (m_pCurrentServer)
+		engine_.GetRateLimiter().SetServer(m_pBackend, *m_pCurrentServer);
 
 	int res = m_pSocket->Connect(pData->host, pData->port);
 	if (!res)
@@ -5,21 +5,44 @@
 
 #include <wx/log.h>
 
-CIOThread::CIOThread()
+#include <errno.h>
+
+namespace {
+// Size of the file regions for which the page cache gets dropped at once
+wxFileOffset const drop_window = 16 * 1024 * 1024;
+}
+
+CIOThread::buffer::buffer(unsigned int size)
+	: size_(size)
+{
+	// Aligned so that the buffers can be used for direct IO
+	size_t const alignment = CFile::direct_io_alignment;
+	raw_ = new char[size + alignment - 1];
+	data_ = raw_ + (alignment - reinterpret_cast<uintptr_t>(raw_) % alignment) % alignment;
+}
+
+CIOThread::buffer::~buffer()
+{
+	delete [] raw_;
+}
+
+CIOThread::CIOThread(COptionsBase& options)
 	: wxThread(wxTHREAD_JOINABLE)
+	, options_(options)
 {
-	m_buffers[0] = new char[BUFFERSIZE*BUFFERCOUNT];
-	for (unsigned int i = 0; i < BUFFERCOUNT; ++i) {
-		m_buffers[i] = m_buffers[0] + BUFFERSIZE * i;
-		m_bufferLens[i] = 0;
-	}
 }
 
 CIOThread::~CIOThread()
 {
 	Close();
 
-	delete [] m_buffers[0];
+	delete m_appBuffer;
+	for (auto b : m_filled) {
+		delete b;
+	}
+	for (auto b : m_free) {
+		delete b;
+	}
 }
 
 void CIOThread::Close()
@@ -27,14 +50,14 @@ void CIOThread::Close()
 	if (m_pFile) {
 		// The file might have been preallocated and the transfer stopped before being completed
 		// so always truncate the file to the actually written size before closing it.
-		if (!m_read)
+		if (!m_read && m_truncate)
 			m_pFile->Truncate();
 
 		m_pFile.reset();
 	}
 }
 
-bool CIOThread::Create(std::unique_ptr<CFile> && pFile, bool read, bool binary)
+bool CIOThread::Create(std::unique_ptr<CFile> && pFile, bool read, bool binary, wxFileOffset size, bool truncate)
 {
 	wxASSERT(pFile);
 
@@ -43,20 +66,45 @@ bool CIOThread::Create(std::unique_ptr<CFile> && pFile, bool read, bool binary)
 	m_pFile = std::move(pFile);
 	m_read = read;
 	m_binary = binary;
+	m_truncate = truncate;
+
+	int const maxCount = options_.GetOptionVal(OPTION_IO_BUFFER_COUNT);
+	m_maxCount = std::max(MIN_BUFFERCOUNT, std::min(64, maxCount));
+	m_targetCount = std::min(static_cast<unsigned int>(INITIAL_BUFFERCOUNT), m_maxCount);
+
+	// Only use powers of two, this keeps all buffer sizes multiples of the direct IO alignment
+	int64_t const maxSize = static_cast<int64_t>(options_.GetOptionVal(OPTION_IO_BUFFER_SIZE)) * 1024;
+	m_maxSize = MIN_BUFFERSIZE;
+	while (m_maxSize < 16 * 1024 * 1024 && m_maxSize * 2 <= maxSize) {
+		m_maxSize *= 2;
+	}
+	m_targetSize = std::min(static_cast<unsigned int>(INITIAL_BUFFERSIZE), m_maxSize);
+
+	m_rateStart = CMonotonicClock::now();
+	m_rateBytes = 0;
 
+	m_fileOffset = m_pFile->Seek(0, CFile::current);
+	m_droppedOffset = m_fileOffset;
 	if (read) {
-		m_curAppBuf = BUFFERCOUNT - 1;
-		m_curThreadBuf = 0;
+		size = m_pFile->Length();
+	}
+
+	m_simulate = options_.GetOptionVal(OPTION_IO_SIMULATE) != 0;
+	if (m_simulate) {
+		m_simulatedSize = read ? size : 0;
 	}
 	else {
-		m_curAppBuf = -1;
-		m_curThreadBuf = 0;
+		// Keep large files from evicting everything else from the page cache.
+		int64_t const threshold = static_cast<int64_t>(options_.GetOptionVal(OPTION_IO_DIRECT_THRESHOLD)) * 1024 * 1024;
+		if (threshold > 0 && size >= threshold && m_fileOffset != -1) {
+			// In ASCII mode the amount of data per read or write varies, direct IO needs aligned sizes
+			if (binary && !(m_fileOffset % CFile::direct_io_alignment)) {
+				m_direct = m_pFile->SetDirect(true);
+			}
+			m_dropCache = !m_direct;
+		}
 	}
 
-#ifdef SIMULATE_IO
-	size_ = m_pFile->Length();
-#endif
-
 	m_running = true;
 	wxThread::Create();
 	wxThread::Run();
@@ -67,14 +115,23 @@ bool CIOThread::Create(std::unique_ptr<CFile> && pFile, bool read, bool binary)
 wxThread::ExitCode CIOThread::Entry()
 {
 	if (m_read) {
+		scoped_lock l(m_mutex);
 		while (m_running) {
-			int len = ReadFromFile(m_buffers[m_curThreadBuf], BUFFERSIZE);
+			buffer* b = GetFreeBuffer();
+			if (!b) {
+				m_threadWaiting = true;
+				m_condition.wait(l);
+				continue;
+			}
 
-			scoped_lock l(m_mutex);
+			l.unlock();
+			int len = ReadFromFile(b->data_, b->size_);
+			l.lock();
 
 			if (m_appWaiting) {
 				if (!m_evtHandler) {
 					m_running = false;
+					ReleaseBuffer(b);
 					break;
 				}
 				m_appWaiting = false;
@@ -84,41 +141,25 @@ wxThread::ExitCode CIOThread::Entry()
 			if (len == wxInvalidOffset) {
 				m_error = true;
 				m_running = false;
+				ReleaseBuffer(b);
 				break;
 			}
 
-			m_bufferLens[m_curThreadBuf] = len;
-
 			if (!len) {
 				m_running = false;
+				ReleaseBuffer(b);
 				break;
 			}
 
-			++m_curThreadBuf %= BUFFERCOUNT;
-			if (m_curThreadBuf == m_curAppBuf) {
-				if (!m_running)
-					break;
-
-				m_threadWaiting = true;
-				if (m_running)
-					m_condition.wait(l);
-			}
+			b->len_ = len;
+			m_filled.push_back(b);
 		}
 	}
 	else {
 		scoped_lock l(m_mutex);
-		while (m_curAppBuf == -1) {
-			if (!m_running) {
-				return 0;
-			}
-			else {
-				m_threadWaiting = true;
-				m_condition.wait(l);
-			}
-		}
-
 		for (;;) {
-			while (m_curThreadBuf == m_curAppBuf) {
+			// Pending buffers get written even after Destroy got called
+			while (m_filled.empty()) {
 				if (!m_running) {
 					return 0;
 				}
@@ -126,10 +167,15 @@ wxThread::ExitCode CIOThread::Entry()
 				m_condition.wait(l);
 			}
 
+			buffer* b = m_filled.front();
+			m_filled.pop_front();
+
 			l.unlock();
-			bool writeSuccessful = WriteToFile(m_buffers[m_curThreadBuf], BUFFERSIZE);
+			bool writeSuccessful = WriteToFile(b->data_, b->len_);
 			l.lock();
 
+			ReleaseBuffer(b);
+
 			if (!writeSuccessful) {
 				m_error = true;
 				m_running = false;
@@ -146,14 +192,72 @@ wxThread::ExitCode CIOThread::Entry()
 
 			if (m_error)
 				break;
-
-			++m_curThreadBuf %= BUFFERCOUNT;
 		}
 	}
 
 	return 0;
 }
 
+CIOThread::buffer* CIOThread::GetFreeBuffer()
+{
+	while (!m_free.empty()) {
+		buffer* b = m_free.front();
+		m_free.pop_front();
+		if (b->size_ == m_targetSize) {
+			return b;
+		}
+		delete b;
+		--m_bufferCount;
+	}
+
+	if (m_bufferCount >= m_targetCount) {
+		return 0;
+	}
+
+	++m_bufferCount;
+	return new buffer(m_targetSize);
+}
+
+void CIOThread::ReleaseBuffer(buffer* b)
+{
+	if (m_bufferCount > m_targetCount || b->size_ != m_targetSize) {
+		delete b;
+		--m_bufferCount;
+	}
+	else {
+		m_free.push_back(b);
+	}
+}
+
+void CIOThread::Adapt(unsigned int len)
+{
+	m_rateBytes += len;
+
+	CMonotonicClock const now = CMonotonicClock::now();
+	int64_t const elapsed = now - m_rateStart;
+	if (elapsed < 1000) {
+		return;
+	}
+
+	int64_t const rate = m_rateBytes * 1000 / elapsed;
+	m_rateStart = now;
+	m_rateBytes = 0;
+
+	// Each buffer should hold about 30ms worth of data, keeping the number
+	// of handoffs between the threads low on fast transfers...
+	unsigned int size = MIN_BUFFERSIZE;
+	while (size * 2 <= m_maxSize && size < rate / 32) {
+		size *= 2;
+	}
+
+	// ...while all buffers together should be able to absorb about a quarter
+	// second of stalls on either side.
+	int64_t const count = (rate / 4 + size - 1) / size;
+
+	m_targetSize = size;
+	m_targetCount = static_cast<unsigned int>(std::max(static_cast<int64_t>(MIN_BUFFERCOUNT), std::min(static_cast<int64_t>(m_maxCount), count)));
+}
+
 int CIOThread::GetNextWriteBuffer(char** pBuffer)
 {
 	wxASSERT(!m_destroyed);
@@ -163,27 +267,28 @@ int CIOThread::GetNextWriteBuffer(char** pBuffer)
 	if (m_error)
 		return IO_Error;
 
-	if (m_curAppBuf == -1) {
-		m_curAppBuf = 0;
-		*pBuffer = m_buffers[0];
-		return IO_Success;
+	if (m_appBuffer) {
+		m_appBuffer->len_ = m_appBuffer->size_;
+		Adapt(m_appBuffer->len_);
+		m_filled.push_back(m_appBuffer);
+		m_appBuffer = 0;
+
+		if (m_threadWaiting) {
+			m_condition.signal(l);
+			m_threadWaiting = false;
+		}
 	}
 
-	int newBuf = (m_curAppBuf + 1) % BUFFERCOUNT;
-	if (newBuf == m_curThreadBuf) {
+	buffer* b = GetFreeBuffer();
+	if (!b) {
 		m_appWaiting = true;
 		return IO_Again;
 	}
 
-	if (m_threadWaiting) {
-		m_condition.signal(l);
-		m_threadWaiting = false;
-	}
-
-	m_curAppBuf = newBuf;
-	*pBuffer = m_buffers[newBuf];
+	m_appBuffer = b;
+	*pBuffer = b->data_;
 
-	return IO_Success;
+	return b->size_;
 }
 
 bool CIOThread::Finalize(int len)
@@ -195,7 +300,7 @@ bool CIOThread::Finalize(int len)
 
 	Destroy();
 
-	if (m_curAppBuf == -1)
+	if (!m_appBuffer)
 		return true;
 
 	if (m_error)
@@ -204,7 +309,14 @@ bool CIOThread::Finalize(int len)
 	if (!len)
 		return true;
 
-	if (!WriteToFile(m_buffers[m_curAppBuf], len))
+	if (m_direct) {
+		// The last chunk usually isn't of aligned size.
+		m_direct = false;
+		if (!m_pFile->SetDirect(false))
+			return false;
+	}
+
+	if (!WriteToFile(m_appBuffer->data_, len))
 		return false;
 
 #ifndef __WXMSW__
@@ -222,11 +334,19 @@ int CIOThread::GetNextReadBuffer(char** pBuffer)
 	wxASSERT(!m_destroyed);
 	wxASSERT(m_read);
 
-	int newBuf = (m_curAppBuf + 1) % BUFFERCOUNT;
-
 	scoped_lock l(m_mutex);
 
-	if (newBuf == m_curThreadBuf) {
+	if (m_appBuffer) {
+		ReleaseBuffer(m_appBuffer);
+		m_appBuffer = 0;
+
+		if (m_threadWaiting) {
+			m_condition.signal(l);
+			m_threadWaiting = false;
+		}
+	}
+
+	if (m_filled.empty()) {
 		if (m_error)
 			return IO_Error;
 		else if (!m_running)
@@ -237,15 +357,14 @@ int CIOThread::GetNextReadBuffer(char** pBuffer)
 		}
 	}
 
-	if (m_threadWaiting) {
-		m_condition.signal(l);
-		m_threadWaiting = false;
-	}
+	buffer* b = m_filled.front();
+	m_filled.pop_front();
+	m_appBuffer = b;
+	Adapt(b->len_);
 
-	*pBuffer = m_buffers[newBuf];
-	m_curAppBuf = newBuf;
+	*pBuffer = b->data_;
 
-	return m_bufferLens[newBuf];
+	return b->len_;
 }
 
 void CIOThread::Destroy()
@@ -268,13 +387,11 @@ void CIOThread::Destroy()
 
 int CIOThread::ReadFromFile(char* pBuffer, int maxLen)
 {
-#ifdef SIMULATE_IO
-	if (size_ < 0) {
-		return 0;
+	if (m_simulate) {
+		int len = static_cast<int>(std::min(static_cast<wxFileOffset>(maxLen), m_simulatedSize));
+		m_simulatedSize -= len;
+		return len;
 	}
-	size_ -= maxLen;
-	return maxLen;
-#endif
 
 	// In binary mode, no conversion has to be done.
 	// Also, under Windows the native newline format is already identical
@@ -282,7 +399,21 @@ int CIOThread::ReadFromFile(char* pBuffer, int maxLen)
 #ifndef __WXMSW__
 	if (m_binary)
 #endif
-		return m_pFile->Read(pBuffer, maxLen);
+	{
+		int len = m_pFile->Read(pBuffer, maxLen);
+		if (len == -1 && m_direct && wxSysErrorCode() == EINVAL) {
+			// Filesystem doesn't support direct IO after all
+			m_direct = false;
+			m_dropCache = true;
+			if (m_pFile->SetDirect(false)) {
+				len = m_pFile->Read(pBuffer, maxLen);
+			}
+		}
+		if (len > 0) {
+			OnTransferred(len);
+		}
+		return len;
+	}
 
 #ifndef __WXMSW__
 
@@ -294,6 +425,7 @@ int CIOThread::ReadFromFile(char* pBuffer, int maxLen)
 	int len = m_pFile->Read(r, readLen);
 	if (!len || len == wxInvalidOffset)
 		return len;
+	OnTransferred(len);
 
 	const char* const end = r + len;
 	char* w = pBuffer;
@@ -320,9 +452,10 @@ int CIOThread::ReadFromFile(char* pBuffer, int maxLen)
 
 bool CIOThread::WriteToFile(char* pBuffer, int len)
 {
-#ifdef SIMULATE_IO
-	return true;
-#endif
+	if (m_simulate) {
+		return true;
+	}
+
 	// In binary mode, no conversion has to be done.
 	// Also, under Windows the native newline format is already identical
 	// to the newline format of the FTP protocol
@@ -367,11 +500,21 @@ bool CIOThread::DoWrite(const char* pBuffer, int len)
 {
 	int written = m_pFile->Write(pBuffer, len);
 	if (written == len) {
+		OnTransferred(len);
 		return true;
 	}
 
 	int code = wxSysErrorCode();
 
+	if (written == -1 && m_direct && code == EINVAL) {
+		// Filesystem doesn't support direct IO after all
+		m_direct = false;
+		m_dropCache = true;
+		if (m_pFile->SetDirect(false)) {
+			return DoWrite(pBuffer, len);
+		}
+	}
+
 	const wxString error = wxSysErrorMsg(code);
 
 	scoped_lock locker(m_mutex);
@@ -380,6 +523,18 @@ bool CIOThread::DoWrite(const char* pBuffer, int len)
 	return false;
 }
 
+void CIOThread::OnTransferred(int len)
+{
+	m_fileOffset += len;
+
+	// Lag one window behind so that write-back of recently written data
+	// can happen asynchronously.
+	if (m_dropCache && m_fileOffset - m_droppedOffset >= 2 * drop_window) {
+		m_pFile->DropCache(m_droppedOffset, drop_window);
+		m_droppedOffset += drop_window;
+	}
+}
+
 wxString CIOThread::GetError()
 {
 	scoped_lock locker(m_mutex);
@@ -3,14 +3,17 @@
 
 #include <wx/file.h>
 #include "event_loop.h"
+#include "timeex.h"
 
-#define BUFFERCOUNT 5
-#define BUFFERSIZE 128*1024
+#include <deque>
 
-// Does not actually read from or write to file
-// Useful for benchmarks to avoid IO bottleneck
-// skewing results
-//#define SIMULATE_IO
+// Buffer count and size adapt to the observed throughput, within the limits
+// given by OPTION_IO_BUFFER_COUNT and OPTION_IO_BUFFER_SIZE.
+#define MIN_BUFFERCOUNT 2
+#define MIN_BUFFERSIZE 64*1024
+
+#define INITIAL_BUFFERCOUNT 4
+#define INITIAL_BUFFERSIZE 128*1024
 
 struct io_thread_event_type{};
 typedef CEvent<io_thread_event_type> CIOThreadEvent;
@@ -23,13 +26,18 @@ enum IORet
 };
 
 class CFile;
+class COptionsBase;
 class CIOThread final : protected wxThread
 {
 public:
-	CIOThread();
+	explicit CIOThread(COptionsBase& options);
 	virtual ~CIOThread();
 
-	bool Create(std::unique_ptr<CFile> && pFile, bool read, bool binary);
+	// size is the expected total size of the file after the transfer
+	// if known, it is used to decide whether to bypass the page cache.
+	// When writing, the file gets truncated to the written data on close
+	// unless truncate is false, e.g. if only a range of the file is written.
+	bool Create(std::unique_ptr<CFile> && pFile, bool read, bool binary, wxFileOffset size = -1, bool truncate = true);
 	virtual void Destroy(); // Only call that might be blocking
 
 	// Call before first call to one of the GetNext*Buffer functions
@@ -45,40 +53,88 @@ public:
 	//                buffersize else
 	int GetNextReadBuffer(char** pBuffer);
 
-	// Gets next write buffer
+	// Gets next write buffer. The previous buffer, if any, is
+	// considered to be completely filled.
 	// Return value: IO_Again if it would block
 	//               IO_Error on error
-	//               IO_Success else
+	//               size of the buffer else
 	int GetNextWriteBuffer(char** pBuffer);
 
+	// Writes the first len bytes of the current write buffer
 	bool Finalize(int len);
 
 	wxString GetError();
 
+	// If set, no data is actually read from or written to the file.
+	// Useful for benchmarks to avoid IO bottleneck skewing results.
+	bool Simulated() const { return m_simulate; }
+
 protected:
+	struct buffer final
+	{
+		explicit buffer(unsigned int size);
+		~buffer();
+
+		buffer(buffer const&) = delete;
+		buffer& operator=(buffer const&) = delete;
+
+		char* data_;
+		unsigned int size_;
+		unsigned int len_{};
+
+	private:
+		char* raw_;
+	};
+
 	void Close();
 
 	virtual ExitCode Entry();
 
+	// Returns a buffer of the current target size, 0 if the buffer count limit is reached.
+	buffer* GetFreeBuffer();
+
+	// Returns the buffer to the pool or frees it if the pool is to be shrunk
+	void ReleaseBuffer(buffer* b);
+
+	// Adjusts target buffer size and count, called on each buffer handed to the application
+	void Adapt(unsigned int len);
+
 	int ReadFromFile(char* pBuffer, int maxLen);
 	bool WriteToFile(char* pBuffer, int len);
 	bool DoWrite(const char* pBuffer, int len);
 
+	// Called after len bytes have been read from or written to the file
+	void OnTransferred(int len);
+
+	COptionsBase& options_;
+
 	CEventHandler* m_evtHandler{};
 
 	bool m_read{};
 	bool m_binary{};
+	bool m_truncate{true};
 	std::unique_ptr<CFile> m_pFile;
 
-	char* m_buffers[BUFFERCOUNT];
-	unsigned int m_bufferLens[BUFFERCOUNT];
+	// Protected by mutex.
+	// Buffers ready for the consumer: The application when reading, the thread when writing
+	std::deque<buffer*> m_filled;
+	std::deque<buffer*> m_free;
+	unsigned int m_bufferCount{};
+
+	// The buffer currently owned by the application
+	buffer* m_appBuffer{};
+
+	unsigned int m_targetCount{INITIAL_BUFFERCOUNT};
+	unsigned int m_targetSize{INITIAL_BUFFERSIZE};
+	unsigned int m_maxCount{};
+	unsigned int m_maxSize{};
+
+	CMonotonicClock m_rateStart;
+	int64_t m_rateBytes{};
 
 	mutex m_mutex;
 	condition m_condition;
 
-	int m_curAppBuf{};
-	int m_curThreadBuf{};
-
 	bool m_error{};
 	bool m_running{};
 	bool m_threadWaiting{};
@@ -90,9 +146,14 @@ protected:
 
 	wxString m_error_description;
 
-#ifdef SIMULATE_IO
-	wxFileOffset size_{};
-#endif
+	// Page cache handling of large files
+	bool m_direct{};
+	bool m_dropCache{};
+	wxFileOffset m_fileOffset{};
+	wxFileOffset m_droppedOffset{};
+
+	bool m_simulate{};
+	wxFileOffset m_simulatedSize{};
 };
 
 #endif //__IOTHREAD_H__
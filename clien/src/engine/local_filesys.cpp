@@ -7,6 +7,11 @@
 #include <wx/filename.h>
 #include <wx/msgdlg.h>
 
+#ifndef __WXMSW__
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
 #ifdef __WXMSW__
 const wxChar CLocalFileSystem::path_separator = '\\';
 #else
@@ -19,6 +24,39 @@ int64_t make_int64_t(T hi, T lo)
 {
 	return (static_cast<int64_t>(hi) << 32) + static_cast<int64_t>(lo);
 }
+
+#ifndef __WXMSW__
+CLocalFileSystem::local_fileType GetFileInfoFromStat(struct stat const& buf, int64_t* size, CDateTime* modificationTime, int* mode)
+{
+	if (modificationTime)
+		*modificationTime = CDateTime(wxDateTime(buf.st_mtime), CDateTime::seconds);
+
+	if (mode)
+		*mode = buf.st_mode & 0x777;
+
+	if (S_ISDIR(buf.st_mode)) {
+		if (size)
+			*size = -1;
+		return CLocalFileSystem::dir;
+	}
+
+	if (size)
+		*size = buf.st_size;
+
+	return CLocalFileSystem::file;
+}
+
+CLocalFileSystem::local_fileType GetFileInfoFailed(int64_t* size, CDateTime* modificationTime, int* mode)
+{
+	if (size)
+		*size = -1;
+	if (mode)
+		*mode = -1;
+	if (modificationTime)
+		*modificationTime = CDateTime();
+	return CLocalFileSystem::unknown;
+}
+#endif
 }
 
 CLocalFileSystem::~CLocalFileSystem()
@@ -297,13 +335,7 @@ CLocalFileSystem::local_fileType CLocalFileSystem::GetFileInfo(const char* path,
 	if (result)
 	{
 		isLink = false;
-		if (size)
-			*size = -1;
-		if (mode)
-			*mode = -1;
-		if (modificationTime)
-			*modificationTime = CDateTime();
-		return unknown;
+		return GetFileInfoFailed(size, modificationTime, mode);
 	}
 
 #ifdef S_ISLNK
@@ -312,37 +344,44 @@ CLocalFileSystem::local_fileType CLocalFileSystem::GetFileInfo(const char* path,
 		isLink = true;
 		int result = stat(path, &buf);
 		if (result)
-		{
-			if (size)
-				*size = -1;
-			if (mode)
-				*mode = -1;
-			if (modificationTime)
-				*modificationTime = CDateTime();
-			return unknown;
-		}
+			return GetFileInfoFailed(size, modificationTime, mode);
 	}
 	else
 #endif
 		isLink = false;
 
-	if (modificationTime)
-		*modificationTime = CDateTime(wxDateTime(buf.st_mtime), CDateTime::seconds);
+	return GetFileInfoFromStat(buf, size, modificationTime, mode);
+}
 
-	if (mode)
-		*mode = buf.st_mode & 0x777;
+CLocalFileSystem::local_fileType CLocalFileSystem::GetEntryInfo(const char* name, bool &isLink, int64_t* size, CDateTime* modificationTime, int* mode)
+{
+#if HAVE_FSTATAT && HAVE_DIRFD
+	// Relative to the directory being enumerated, saves building the full
+	// path and the kernel resolving it again for every entry
+	int const fd = dirfd(m_dir);
 
-	if (S_ISDIR(buf.st_mode))
+	struct stat buf;
+	if (fstatat(fd, name, &buf, AT_SYMLINK_NOFOLLOW))
 	{
-		if (size)
-			*size = -1;
-		return dir;
+		isLink = false;
+		return GetFileInfoFailed(size, modificationTime, mode);
 	}
 
-	if (size)
-		*size = buf.st_size;
+	if (S_ISLNK(buf.st_mode))
+	{
+		isLink = true;
+		if (fstatat(fd, name, &buf, 0))
+			return GetFileInfoFailed(size, modificationTime, mode);
+	}
+	else
+		isLink = false;
 
-	return file;
+	return GetFileInfoFromStat(buf, size, modificationTime, mode);
+#else
+	AllocPathBuffer(name);
+	strcpy(m_file_part, name);
+	return GetFileInfo(m_raw_path, isLink, size, modificationTime, mode);
+#endif
 }
 #endif
 
@@ -426,11 +465,11 @@ bool CLocalFileSystem::BeginFindFiles(wxString path, bool dirs_only)
 	if (!m_dir)
 		return false;
 
-	const wxCharBuffer p = path.fn_str();
-	const int len = strlen(p);
+#if !(HAVE_FSTATAT && HAVE_DIRFD)
+	const int len = strlen(s);
 	m_raw_path = new char[len + 2048 + 2];
 	m_buffer_length = len + 2048 + 2;
-	strcpy(m_raw_path, p);
+	strcpy(m_raw_path, s);
 	if (len > 1)
 	{
 		m_raw_path[len] = '/';
@@ -438,6 +477,7 @@ bool CLocalFileSystem::BeginFindFiles(wxString path, bool dirs_only)
 	}
 	else
 		m_file_part = m_raw_path + len;
+#endif
 
 	return true;
 #endif
@@ -499,12 +539,10 @@ bool CLocalFileSystem::GetNextFile(wxString& name)
 
 		if (m_dirs_only) {
 #if HAVE_STRUCT_DIRENT_D_TYPE
-			if (entry->d_type == DT_LNK)
+			if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN)
 			{
 				bool wasLink;
-				AllocPathBuffer(entry->d_name);
-				strcpy(m_file_part, entry->d_name);
-				if (GetFileInfo(m_raw_path, wasLink, 0, 0, 0) != dir)
+				if (GetEntryInfo(entry->d_name, wasLink, 0, 0, 0) != dir)
 					continue;
 			}
 			else if (entry->d_type != DT_DIR)
@@ -512,9 +550,7 @@ bool CLocalFileSystem::GetNextFile(wxString& name)
 #else
 			// Solaris doesn't have d_type
 			bool wasLink;
-			AllocPathBuffer(entry->d_name);
-			strcpy(m_file_part, entry->d_name);
-			if (GetFileInfo(m_raw_path, wasLink, 0, 0, 0) != dir)
+			if (GetEntryInfo(entry->d_name, wasLink, 0, 0, 0) != dir)
 				continue;
 #endif
 		}
@@ -629,9 +665,7 @@ bool CLocalFileSystem::GetNextFile(wxString& name, bool &isLink, bool &is_dir, i
 		{
 			if (entry->d_type == DT_LNK)
 			{
-				AllocPathBuffer(entry->d_name);
-				strcpy(m_file_part, entry->d_name);
-				local_fileType type = GetFileInfo(m_raw_path, isLink, size, modificationTime, mode);
+				local_fileType type = GetEntryInfo(entry->d_name, isLink, size, modificationTime, mode);
 				if (type != dir)
 					continue;
 
@@ -639,14 +673,21 @@ bool CLocalFileSystem::GetNextFile(wxString& name, bool &isLink, bool &is_dir, i
 				is_dir = true;
 				return true;
 			}
-			else if (entry->d_type != DT_DIR)
+			else if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)
 				continue;
 		}
+
+		if (!size && !modificationTime && !mode && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN)
+		{
+			// The type is all the caller wants and the directory entry already has it
+			isLink = false;
+			is_dir = entry->d_type == DT_DIR;
+			name = wxString(entry->d_name, *wxConvFileName);
+			return true;
+		}
 #endif
 
-		AllocPathBuffer(entry->d_name);
-		strcpy(m_file_part, entry->d_name);
-		local_fileType type = GetFileInfo(m_raw_path, isLink, size, modificationTime, mode);
+		local_fileType type = GetEntryInfo(entry->d_name, isLink, size, modificationTime, mode);
 
 		if (type == unknown) // Happens for example in case of permission denied
 		{
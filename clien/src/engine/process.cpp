@@ -84,6 +84,7 @@ public:
 	~Impl()
 	{
 		Kill();
+		ResetHandle(outputClosed_);
 	}
 
 	Impl(Impl const&) = delete;
@@ -105,6 +106,17 @@ public:
 			return false;
 		}
 
+		if (outputClosed_ == INVALID_HANDLE_VALUE) {
+			HANDLE event = CreateEvent(0, TRUE, FALSE, 0);
+			if (!event) {
+				return false;
+			}
+			outputClosed_ = event;
+		}
+		else {
+			ResetEvent(outputClosed_);
+		}
+
 		STARTUPINFO si{};
 		si.cb = sizeof(si);
 		si.dwFlags = STARTF_USESTDHANDLES;
@@ -135,7 +147,11 @@ public:
 	{
 		if (process_ != INVALID_HANDLE_VALUE) {
 			in_.reset();
-			if (WaitForSingleObject(process_, 500) == WAIT_TIMEOUT) {
+
+			// A process may keep running on its own after closing its output,
+			// like fzsftp does while other instances share its connection.
+			HANDLE handles[] = { process_, outputClosed_ };
+			if (WaitForMultipleObjects(2, handles, FALSE, 500) == WAIT_TIMEOUT) {
 				TerminateProcess(process_, 0);
 			}
 			ResetHandle(process_);
@@ -148,6 +164,9 @@ public:
 	{
 		DWORD read = 0;
 		BOOL res = ReadFile(out_.read_, buffer, len, &read, 0);
+		if (!res || !read) {
+			SetEvent(outputClosed_);
+		}
 		if (!res) {
 			return -1;
 		}
@@ -180,6 +199,9 @@ private:
 
 	HANDLE process_{INVALID_HANDLE_VALUE};
 
+	// Set once reading the output fails
+	HANDLE outputClosed_{INVALID_HANDLE_VALUE};
+
 	Pipe in_;
 	Pipe out_;
 	Pipe err_;
@@ -187,6 +209,8 @@ private:
 
 #else
 
+#include <wx/tokenzr.h>
+
 #include <errno.h>
 #include <signal.h>
 #include <sys/wait.h>
@@ -269,6 +293,20 @@ public:
 			return false;
 		}
 
+		// Arguments are separated by spaces, none of them contains any.
+		// Build argv before forking, the child must not allocate.
+		std::vector<std::string> argStrings;
+		argStrings.push_back(std::string(cmd.mb_str()));
+		wxStringTokenizer tokens(args, _T(" "), wxTOKEN_STRTOK);
+		while (tokens.HasMoreTokens()) {
+			argStrings.push_back(std::string(tokens.GetNextToken().mb_str()));
+		}
+		std::vector<char*> argv;
+		for (auto & arg : argStrings) {
+			argv.push_back(&arg[0]);
+		}
+		argv.push_back(0);
+
 		int pid = fork();
 		if (pid < 0) {
 			return false;
@@ -290,7 +328,7 @@ public:
 			}
 
 			// Execute process
-			execl(cmd, args, (char*)0); // noreturn on success
+			execv(argv[0], &argv[0]); // noreturn on success
 
 			_exit(-1);
 		}
@@ -312,12 +350,25 @@ public:
 		in_.reset();
 
 		if (pid_ != -1) {
-			kill(pid_, SIGTERM);
-
+			// Give the process a chance to exit on its own once its input is
+			// closed. fzsftp sharing its connection with other instances
+			// hands it to a detached copy of itself and exits.
 			int ret;
-			do {
+			for (int i = 0; i < 50; ++i) {
+				while ((ret = waitpid(pid_, 0, WNOHANG)) == -1 && errno == EINTR);
+				if (ret) {
+					break;
+				}
+				wxMilliSleep(10);
+			}
+
+			if (!ret) {
+				kill(pid_, SIGTERM);
+
+				do {
+				}
+				while((ret = waitpid(pid_, 0, 0)) == -1 && errno == EINTR);
 			}
-			while((ret = waitpid(pid_, 0, 0)) == -1 && errno == EINTR);
 
 			(void)ret;
 
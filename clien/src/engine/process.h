@@ -23,6 +23,8 @@ public:
 	// args must be properly quoted
 	bool Execute(wxString const& cmd, wxString const& args);
 
+	// Closes the input of the process. Terminates the process unless it exits
+	// or closes its output shortly after.
 	void Kill();
 
 	// Blocking function. Returns Number of bytes read, 0 on EOF, -1 on error.
@@ -3,18 +3,105 @@
 
 #include "event_loop.h"
 
-static int const tickDelay = 250;
+#include <algorithm>
+
+namespace {
+// Bounds of the time between distributions while objects are waiting
+int const minInterval = 10;
+int const maxInterval = 250;
+
+// Waiting objects should get at least this many tokens per distribution
+int64_t const quantum = 16 * 1024;
+
+// Limits the tokens accrued after longer periods without distribution
+int64_t const maxElapsed = 60 * 1000;
+
+// Splits the budget among the entries proportionally to their weights without
+// exceeding their caps. Shares not needed by capped entries are given to the
+// others. A negative budget is unlimited.
+std::vector<int64_t> Share(int64_t budget, std::vector<int64_t> const& caps, std::vector<int64_t> const& weights)
+{
+	if (budget < 0) {
+		return caps;
+	}
+
+	std::vector<int64_t> ret(caps.size());
+
+	std::vector<size_t> open;
+	int64_t openWeight{};
+	for (size_t i = 0; i < caps.size(); ++i) {
+		if (caps[i] > 0 && weights[i] > 0) {
+			open.push_back(i);
+			openWeight += weights[i];
+		}
+	}
+
+	while (budget > 0 && !open.empty()) {
+		std::vector<size_t> unsaturated;
+		int64_t unsaturatedWeight{};
+		int64_t spent{};
+
+		for (auto const& i : open) {
+			int64_t const share = budget / openWeight * weights[i] + budget % openWeight * weights[i] / openWeight;
+			int64_t const room = caps[i] - ret[i];
+			if (share >= room) {
+				ret[i] = caps[i];
+				spent += room;
+			}
+			else {
+				ret[i] += share;
+				spent += share;
+				unsaturated.push_back(i);
+				unsaturatedWeight += weights[i];
+			}
+		}
+		budget -= spent;
+
+		if (unsaturated.size() == open.size()) {
+			// Nothing got saturated, only rounding leftovers remain
+			for (auto const& i : unsaturated) {
+				if (!budget) {
+					break;
+				}
+				++ret[i];
+				--budget;
+			}
+			break;
+		}
+
+		open.swap(unsaturated);
+		openWeight = unsaturatedWeight;
+	}
+
+	return ret;
+}
+
+int64_t LowerLimit(int64_t a, int64_t b)
+{
+	if (!a) {
+		return b;
+	}
+	if (!b) {
+		return a;
+	}
+	return std::min(a, b);
+}
+}
 
 CRateLimiter::CRateLimiter(CEventLoop& loop, COptionsBase& options)
 	: CEventHandler(loop)
 	, options_(options)
+	, scheduler_(new CRateScheduler)
+	, m_start(CMonotonicClock::now())
 {
 	RegisterOption(OPTION_SPEEDLIMIT_ENABLE);
 	RegisterOption(OPTION_SPEEDLIMIT_INBOUND);
 	RegisterOption(OPTION_SPEEDLIMIT_OUTBOUND);
+	RegisterOption(OPTION_SPEEDLIMIT_BURSTTOLERANCE);
+	RegisterOption(OPTION_SPEEDLIMIT_TRANSFER_INBOUND);
+	RegisterOption(OPTION_SPEEDLIMIT_TRANSFER_OUTBOUND);
 
-	m_tokenDebt[0] = 0;
-	m_tokenDebt[1] = 0;
+	UpdateLimits();
 }
 
 CRateLimiter::~CRateLimiter()
@@ -24,165 +111,113 @@ CRateLimiter::~CRateLimiter()
 
 int64_t CRateLimiter::GetLimit(rate_direction direction) const
 {
-	int64_t ret{};
-	if (options_.GetOptionVal(OPTION_SPEEDLIMIT_ENABLE) != 0) {
-		ret = static_cast<int64_t>(options_.GetOptionVal(OPTION_SPEEDLIMIT_INBOUND + direction)) * 1024;
-	}
+	return static_cast<int64_t>(options_.GetOptionVal(OPTION_SPEEDLIMIT_INBOUND + direction)) * 1024;
+}
 
-	return ret;
+int64_t CRateLimiter::GetTransferLimit(rate_direction direction) const
+{
+	return static_cast<int64_t>(options_.GetOptionVal(OPTION_SPEEDLIMIT_TRANSFER_INBOUND + direction)) * 1024;
+}
+
+void CRateLimiter::UpdateLimits()
+{
+	scheduler_->Enable(options_.GetOptionVal(OPTION_SPEEDLIMIT_ENABLE) != 0);
+	scheduler_->SetBurstTime(GetBurstTime());
+	for (int i = 0; i < 2; ++i) {
+		auto const direction = static_cast<rate_direction>(i);
+		scheduler_->SetLimit(direction, GetLimit(direction));
+		scheduler_->SetObjectLimit(direction, GetTransferLimit(direction));
+	}
 }
 
 void CRateLimiter::AddObject(CRateLimiterObject* pObject)
 {
 	scoped_lock lock(sync_);
 
-	m_objectList.push_back(pObject);
+	pObject->m_limiter = this;
+	scheduler_->Add(pObject);
+}
 
-	for (int i = 0; i < 2; ++i) {
-		int64_t limit = GetLimit(static_cast<rate_direction>(i));
-		if (limit > 0) {
-			int64_t tokens = limit / (1000 / tickDelay);
-
-			tokens /= m_objectList.size();
-			if (m_tokenDebt[i] > 0) {
-				if (tokens >= m_tokenDebt[i]) {
-					tokens -= m_tokenDebt[i];
-					m_tokenDebt[i] = 0;
-				}
-				else {
-					tokens = 0;
-					m_tokenDebt[i] -= tokens;
-				}
-			}
+void CRateLimiter::RemoveObject(CRateLimiterObject* pObject)
+{
+	scoped_lock lock(sync_);
 
-			pObject->m_bytesAvailable[i] = tokens;
+	scheduler_->Remove(pObject);
+	pObject->m_limiter = 0;
 
-			if (!m_timer)
-				m_timer = AddTimer(tickDelay, false);
-		}
-		else {
-			pObject->m_bytesAvailable[i] = -1;
-		}
+	for (int i = 0; i < 2; ++i) {
+		m_wakeupList[i].erase(std::remove(m_wakeupList[i].begin(), m_wakeupList[i].end(), pObject), m_wakeupList[i].end());
 	}
 }
 
-void CRateLimiter::RemoveObject(CRateLimiterObject* pObject)
+void CRateLimiter::SetServer(CRateLimiterObject* pObject, CServer const& server)
 {
 	scoped_lock lock(sync_);
 
-	for (auto iter = m_objectList.begin(); iter != m_objectList.end(); ++iter) {
-		if (*iter == pObject) {
-			for (int i = 0; i < 2; ++i) {
-				// If an object already used up some of its assigned tokens, add them to m_tokenDebt,
-				// so that newly created objects get less initial tokens.
-				// That ensures that rapidly adding and removing objects does not exceed the rate
-				int64_t limit = GetLimit(static_cast<rate_direction>(i));
-				int64_t tokens = limit / (1000 / tickDelay);
-				tokens /= m_objectList.size();
-				if ((*iter)->m_bytesAvailable[i] < tokens)
-					m_tokenDebt[i] += tokens - (*iter)->m_bytesAvailable[i];
-			}
-			m_objectList.erase(iter);
-			break;
-		}
+	int64_t const limits[2] = { static_cast<int64_t>(server.GetInboundSpeedLimit()) * 1024, static_cast<int64_t>(server.GetOutboundSpeedLimit()) * 1024 };
+	if (!limits[inbound] && !limits[outbound]) {
+		// No need for a separate class
+		scheduler_->SetClass(pObject, wxString());
+		return;
 	}
 
+	wxString const name = server.FormatServer(true);
 	for (int i = 0; i < 2; ++i) {
-		for (auto iter = m_wakeupList[i].begin(); iter != m_wakeupList[i].end(); ++iter) {
-			if (*iter == pObject) {
-				m_wakeupList[i].erase(iter);
-				break;
-			}
-		}
+		scheduler_->SetClassLimit(name, static_cast<rate_direction>(i), limits[i]);
 	}
+	scheduler_->SetClass(pObject, name);
 }
 
-void CRateLimiter::OnTimer(timer_id)
+void CRateLimiter::OnWait()
 {
 	scoped_lock lock(sync_);
+	if (!m_timer && !m_waitEventPending) {
+		m_waitEventPending = true;
+		SendEvent<CRateLimitWaitEvent>();
+	}
+}
 
-	int64_t const limits[2] = { GetLimit(inbound), GetLimit(outbound) };
+void CRateLimiter::Distribute()
+{
+	int64_t elapsed = (CMonotonicClock::now() - m_start) - m_accounted;
+	m_accounted += elapsed;
+	if (elapsed > maxElapsed) {
+		elapsed = maxElapsed;
+	}
 
 	for (int i = 0; i < 2; ++i) {
-		m_tokenDebt[i] = 0;
-
-		if (m_objectList.empty())
-			continue;
+		auto const objects = scheduler_->Distribute(static_cast<rate_direction>(i), elapsed);
+		m_wakeupList[i].insert(m_wakeupList[i].end(), objects.begin(), objects.end());
+	}
+}
 
-		if (limits[i] == 0) {
-			for (auto iter = m_objectList.begin(); iter != m_objectList.end(); ++iter) {
-				(*iter)->m_bytesAvailable[i] = -1;
-				if ((*iter)->m_waiting[i])
-					m_wakeupList[i].push_back(*iter);
-			}
-			continue;
+void CRateLimiter::ScheduleDistribution(scoped_lock & l)
+{
+	while (!m_timer) {
+		int const interval = scheduler_->GetInterval();
+		if (interval < 0) {
+			break;
 		}
 
-		int64_t tokens = (limits[i] * tickDelay) / 1000;
-		int64_t maxTokens = tokens * GetBucketSize();
-
-		// Get amount of tokens for each object
-		int64_t tokensPerObject = tokens / m_objectList.size();
-
-		if (tokensPerObject == 0)
-			tokensPerObject = 1;
-		tokens = 0;
-
-		// This list will hold all objects which didn't reach maxTokens
-		std::list<CRateLimiterObject*> unsaturatedObjects;
-
-		for (auto iter = m_objectList.begin(); iter != m_objectList.end(); ++iter) {
-			if ((*iter)->m_bytesAvailable[i] == -1) {
-				wxASSERT(!(*iter)->m_waiting[i]);
-				(*iter)->m_bytesAvailable[i] = tokensPerObject;
-				unsaturatedObjects.push_back(*iter);
-			}
-			else {
-				(*iter)->m_bytesAvailable[i] += tokensPerObject;
-				if ((*iter)->m_bytesAvailable[i] > maxTokens)
-				{
-					tokens += (*iter)->m_bytesAvailable[i] - maxTokens;
-					(*iter)->m_bytesAvailable[i] = maxTokens;
-				}
-				else
-					unsaturatedObjects.push_back(*iter);
-
-				if ((*iter)->m_waiting[i])
-					m_wakeupList[i].push_back(*iter);
-			}
+		int64_t const since = (CMonotonicClock::now() - m_start) - m_accounted;
+		if (since < interval) {
+			m_timer = AddTimer(static_cast<int>(interval - since), true);
+			break;
 		}
 
-		// If there are any left-over tokens (in case of objects with a rate below the limit)
-		// assign to the unsaturated sources
-		while (tokens != 0 && !unsaturatedObjects.empty()) {
-			tokensPerObject = tokens / unsaturatedObjects.size();
-			if (tokensPerObject == 0)
-				break;
-			tokens = 0;
-
-			std::list<CRateLimiterObject*> objects;
-			objects.swap(unsaturatedObjects);
-
-			for (auto iter = objects.begin(); iter != objects.end(); ++iter) {
-				(*iter)->m_bytesAvailable[i] += tokensPerObject;
-				if ((*iter)->m_bytesAvailable[i] > maxTokens) {
-					tokens += (*iter)->m_bytesAvailable[i] - maxTokens;
-					(*iter)->m_bytesAvailable[i] = maxTokens;
-				}
-				else
-					unsaturatedObjects.push_back(*iter);
-			}
-		}
+		Distribute();
+		WakeupWaitingObjects(l);
 	}
+}
 
-	WakeupWaitingObjects(lock);
+void CRateLimiter::OnTimer(timer_id)
+{
+	scoped_lock lock(sync_);
 
-	if (m_objectList.empty() || (limits[inbound] == 0 && limits[outbound] == 0)) {
-		if (m_timer) {
-			StopTimer(m_timer);
-			m_timer = 0;
-		}
-	}
+	m_timer = 0;
+	Distribute();
+	WakeupWaitingObjects(lock);
+	ScheduleDistribution(lock);
 }
 
 void CRateLimiter::WakeupWaitingObjects(scoped_lock & l)
@@ -190,12 +225,9 @@ void CRateLimiter::WakeupWaitingObjects(scoped_lock & l)
 	for (int i = 0; i < 2; ++i) {
 		while (!m_wakeupList[i].empty()) {
 			CRateLimiterObject* pObject = m_wakeupList[i].front();
-			m_wakeupList[i].pop_front();
-			if (!pObject->m_waiting[i])
-				continue;
+			m_wakeupList[i].erase(m_wakeupList[i].begin());
 
-			wxASSERT(pObject->m_bytesAvailable != 0);
-			pObject->m_waiting[i] = false;
+			wxASSERT(pObject->m_bytesAvailable[i] != 0);
 
 			l.unlock(); // Do not hold while executing callback
 			pObject->OnRateAvailable((rate_direction)i);
@@ -204,24 +236,19 @@ void CRateLimiter::WakeupWaitingObjects(scoped_lock & l)
 	}
 }
 
-int CRateLimiter::GetBucketSize() const
+int CRateLimiter::GetBurstTime() const
 {
 	const int burst_tolerance = options_.GetOptionVal(OPTION_SPEEDLIMIT_BURSTTOLERANCE);
 
-	int bucket_size = 1000 / tickDelay;
 	switch (burst_tolerance)
 	{
 	case 1:
-		bucket_size *= 2;
-		break;
+		return 2000;
 	case 2:
-		bucket_size *= 5;
-		break;
+		return 5000;
 	default:
-		break;
+		return 1000;
 	}
-
-	return bucket_size;
 }
 
 void CRateLimiter::operator()(CEventBase const& ev)
@@ -229,16 +256,34 @@ void CRateLimiter::operator()(CEventBase const& ev)
 	if (Dispatch<CTimerEvent>(ev, this, &CRateLimiter::OnTimer)) {
 		return;
 	}
+	if (Dispatch<CRateLimitWaitEvent>(ev, this, &CRateLimiter::OnWaitEvent)) {
+		return;
+	}
 	Dispatch<CRateLimitChangedEvent>(ev, this, &CRateLimiter::OnRateChanged);
 }
 
+void CRateLimiter::OnWaitEvent()
+{
+	scoped_lock lock(sync_);
+	m_waitEventPending = false;
+	ScheduleDistribution(lock);
+}
+
 void CRateLimiter::OnRateChanged()
 {
 	scoped_lock lock(sync_);
-	if (GetLimit(inbound) > 0 || GetLimit(outbound) > 0) {
-		if (!m_timer)
-			m_timer = AddTimer(tickDelay, false);
+
+	// Account the time so far with the old limits
+	Distribute();
+	UpdateLimits();
+
+	// Objects which became unlimited get woken up right away
+	for (int i = 0; i < 2; ++i) {
+		auto const objects = scheduler_->Distribute(static_cast<rate_direction>(i), 0);
+		m_wakeupList[i].insert(m_wakeupList[i].end(), objects.begin(), objects.end());
 	}
+	WakeupWaitingObjects(lock);
+	ScheduleDistribution(lock);
 }
 
 void CRateLimiter::OnOptionsChanged(changed_options_t const&)
@@ -246,27 +291,234 @@ void CRateLimiter::OnOptionsChanged(changed_options_t const&)
 	SendEvent<CRateLimitChangedEvent>();
 }
 
+CRateScheduler::CRateScheduler()
+{
+	// The default class is never limited
+	classes_[wxString()];
+}
+
+void CRateScheduler::SetClassLimit(wxString const& name, direction d, int64_t limit)
+{
+	classes_[name].buckets[d].limit = limit;
+}
+
+void CRateScheduler::Add(CRateLimiterObject* pObject)
+{
+	rate_class & c = classes_[pObject->m_rateClass];
+	c.objects.push_back(pObject);
+
+	for (int i = 0; i < 2; ++i) {
+		// New objects get their first tokens in the next distribution
+		pObject->m_bytesAvailable[i] = GetEffectiveLimit(c, static_cast<direction>(i)) ? 0 : -1;
+		pObject->m_used[i] = 0;
+		pObject->m_remainder[i] = 0;
+	}
+}
+
+void CRateScheduler::Remove(CRateLimiterObject* pObject)
+{
+	auto it = classes_.find(pObject->m_rateClass);
+	if (it == classes_.end()) {
+		return;
+	}
+
+	auto & objects = it->second.objects;
+	objects.erase(std::remove(objects.begin(), objects.end(), pObject), objects.end());
+	if (objects.empty() && !it->first.empty()) {
+		classes_.erase(it);
+	}
+}
+
+void CRateScheduler::SetClass(CRateLimiterObject* pObject, wxString const& name)
+{
+	if (pObject->m_rateClass == name) {
+		return;
+	}
+
+	Remove(pObject);
+	pObject->m_rateClass = name;
+	rate_class & c = classes_[name];
+	c.objects.push_back(pObject);
+
+	for (int i = 0; i < 2; ++i) {
+		auto const d = static_cast<direction>(i);
+		if (pObject->m_bytesAvailable[d] < 0 && GetEffectiveLimit(c, d)) {
+			pObject->m_bytesAvailable[d] = 0;
+		}
+	}
+}
+
+int64_t CRateScheduler::Accrue(int64_t limit, int64_t& remainder, int64_t elapsed) const
+{
+	if (!enabled_ || !limit) {
+		remainder = 0;
+		return -1;
+	}
+
+	int64_t const tokens = limit * elapsed + remainder;
+	remainder = tokens % 1000;
+	return tokens / 1000;
+}
+
+int64_t CRateScheduler::GetEffectiveLimit(rate_class const& c, direction d) const
+{
+	if (!enabled_) {
+		return 0;
+	}
+
+	return LowerLimit(LowerLimit(limit_[d].limit, c.buckets[d].limit), objectLimit_[d]);
+}
+
+std::vector<CRateLimiterObject*> CRateScheduler::Distribute(direction d, int64_t elapsed)
+{
+	std::vector<CRateLimiterObject*> wakeup;
+
+	int64_t const budget = Accrue(limit_[d].limit, limit_[d].remainder, elapsed);
+
+	// First determine how many tokens each object can take, this is
+	// limited by the size of its bucket and its own limit.
+	std::vector<std::vector<int64_t>> wants;
+	std::vector<int64_t> classCaps;
+	std::vector<int64_t> classWeights;
+	wants.reserve(classes_.size());
+	classCaps.reserve(classes_.size());
+	classWeights.reserve(classes_.size());
+
+	for (auto & it : classes_) {
+		rate_class & c = it.second;
+		int64_t const classBudget = Accrue(c.buckets[d].limit, c.buckets[d].remainder, elapsed);
+		int64_t const limit = GetEffectiveLimit(c, d);
+
+		std::vector<int64_t> objectWants;
+		objectWants.reserve(c.objects.size());
+		int64_t demand{};
+		int64_t weight{};
+
+		for (auto pObject : c.objects) {
+			int64_t want{};
+			int64_t const own = Accrue(objectLimit_[d], pObject->m_remainder[d], elapsed);
+			if (!limit) {
+				pObject->m_bytesAvailable[d] = -1;
+				if (pObject->m_waiting[d]) {
+					pObject->m_waiting[d] = false;
+					wakeup.push_back(pObject);
+				}
+			}
+			else {
+				if (pObject->m_bytesAvailable[d] < 0) {
+					pObject->m_bytesAvailable[d] = 0;
+				}
+
+				// Objects which did not run out of tokens only get their used
+				// tokens replaced, the rest of their share goes to the others
+				int64_t const size = std::max(limit * burstTime_ / 1000, int64_t(1));
+				want = std::max(size - pObject->m_bytesAvailable[d], int64_t(0));
+				if (pObject->m_bytesAvailable[d] > 0) {
+					want = std::min(want, pObject->m_used[d]);
+				}
+				if (own >= 0) {
+					want = std::min(want, own);
+				}
+			}
+
+			objectWants.push_back(want);
+			if (want) {
+				demand += want;
+				++weight;
+			}
+		}
+
+		classCaps.push_back((classBudget < 0) ? demand : std::min(demand, classBudget));
+		classWeights.push_back(weight);
+		wants.push_back(std::move(objectWants));
+	}
+
+	// Each class gets a share proportional to the number of objects wanting tokens
+	std::vector<int64_t> const classShares = Share(budget, classCaps, classWeights);
+
+	size_t i = 0;
+	for (auto & it : classes_) {
+		auto const& objects = it.second.objects;
+		std::vector<int64_t> const shares = Share(classShares[i], wants[i], std::vector<int64_t>(objects.size(), 1));
+
+		for (size_t j = 0; j < objects.size(); ++j) {
+			CRateLimiterObject & object = *objects[j];
+			if (object.m_bytesAvailable[d] < 0) {
+				continue;
+			}
+
+			object.m_bytesAvailable[d] += shares[j];
+			object.m_used[d] = 0;
+			if (object.m_waiting[d] && object.m_bytesAvailable[d] > 0) {
+				object.m_waiting[d] = false;
+				wakeup.push_back(&object);
+			}
+		}
+		++i;
+	}
+
+	return wakeup;
+}
+
+int CRateScheduler::GetInterval() const
+{
+	int64_t fastest{};
+	for (auto const& it : classes_) {
+		for (int i = 0; i < 2; ++i) {
+			auto const d = static_cast<direction>(i);
+			int64_t const limit = GetEffectiveLimit(it.second, d);
+			if (!limit) {
+				continue;
+			}
+			for (auto const& pObject : it.second.objects) {
+				if (pObject->m_waiting[d]) {
+					fastest = std::max(fastest, limit);
+					break;
+				}
+			}
+		}
+	}
+
+	if (!fastest) {
+		return -1;
+	}
+
+	int64_t const interval = quantum * 1000 / fastest;
+	return static_cast<int>(std::min(std::max(interval, int64_t(minInterval)), int64_t(maxInterval)));
+}
+
 CRateLimiterObject::CRateLimiterObject()
 {
 	for (int i = 0; i < 2; ++i) {
 		m_waiting[i] = false;
 		m_bytesAvailable[i] = -1;
+		m_used[i] = 0;
+		m_remainder[i] = 0;
 	}
 }
 
 void CRateLimiterObject::UpdateUsage(CRateLimiter::rate_direction direction, int usedBytes)
 {
+	if (m_bytesAvailable[direction] < 0) {
+		// Became unlimited in the meantime
+		return;
+	}
+
 	wxASSERT(usedBytes <= m_bytesAvailable[direction]);
 	if (usedBytes > m_bytesAvailable[direction])
 		m_bytesAvailable[direction] = 0;
 	else
 		m_bytesAvailable[direction] -= usedBytes;
+	m_used[direction] += usedBytes;
 }
 
 void CRateLimiterObject::Wait(CRateLimiter::rate_direction direction)
 {
 	wxASSERT(m_bytesAvailable[direction] == 0);
 	m_waiting[direction] = true;
+	if (m_limiter) {
+		m_limiter->OnWait();
+	}
 }
 
 bool CRateLimiterObject::IsWaiting(CRateLimiter::rate_direction direction) const
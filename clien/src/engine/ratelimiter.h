@@ -2,14 +2,31 @@
 #define __RATELIMITER_H__
 
 #include <option_change_event_handler.h>
+#include "timeex.h"
+
+#include <map>
+#include <memory>
 
 class COptionsBase;
+class CServer;
 
 class CRateLimiterObject;
-
-// This class implements a simple rate limiter based on the Token Bucket algorithm.
+class CRateScheduler;
+
+// This class implements a rate limiter based on the Token Bucket algorithm.
+//
+// Tokens accrue in a global bucket according to the time elapsed and flow
+// through per-server rate classes to the individual objects, each of the three
+// levels can have its own limit. Objects only get tokens to replace the ones
+// they used or to continue if they are waiting, so shares left unused by idle
+// or slow objects go to the others in the same distribution.
+//
+// Instead of running on a fixed interval, distributions are scheduled once an
+// object runs out of tokens.
 class CRateLimiter final : protected CEventHandler, COptionChangeEventHandler
 {
+	friend class CRateLimiterObject;
+
 public:
 	CRateLimiter(CEventLoop& loop, COptionsBase& options);
 	~CRateLimiter();
@@ -23,19 +40,26 @@ public:
 	void AddObject(CRateLimiterObject* pObject);
 	void RemoveObject(CRateLimiterObject* pObject);
 
+	// Puts the object into the rate class of the given server, which is
+	// limited by the server's speed limits.
+	void SetServer(CRateLimiterObject* pObject, CServer const& server);
+
 protected:
 	int64_t GetLimit(rate_direction direction) const;
+	int64_t GetTransferLimit(rate_direction direction) const;
 
-	int GetBucketSize() const;
+	int GetBurstTime() const;
 
-	std::list<CRateLimiterObject*> m_objectList;
-	std::list<CRateLimiterObject*> m_wakeupList[2];
+	void UpdateLimits();
 
-	timer_id m_timer{};
+	// Called by objects that ran out of tokens
+	void OnWait();
 
-	int64_t m_tokenDebt[2];
+	// Hands out the tokens accrued since the previous distribution
+	void Distribute();
 
-	COptionsBase& options_;
+	// Arms the timer for the next distribution if there are waiting objects
+	void ScheduleDistribution(scoped_lock & l);
 
 	void WakeupWaitingObjects(scoped_lock & l);
 
@@ -44,16 +68,95 @@ protected:
 	void operator()(CEventBase const& ev);
 	void OnTimer(timer_id id);
 	void OnRateChanged();
+	void OnWaitEvent();
+
+	COptionsBase& options_;
+
+	std::unique_ptr<CRateScheduler> scheduler_;
+
+	std::vector<CRateLimiterObject*> m_wakeupList[2];
+
+	timer_id m_timer{};
+	bool m_waitEventPending{};
+
+	// Time of the previous distribution is m_start + m_accounted
+	CMonotonicClock m_start;
+	int64_t m_accounted{};
 
 	mutex sync_;
 };
 
+// The bookkeeping of CRateLimiter without any locking or timers, so that it
+// can be driven by a simulated clock.
+// All limits are in bytes per second, 0 means unlimited.
+class CRateScheduler final
+{
+public:
+	typedef CRateLimiter::rate_direction direction;
+
+	CRateScheduler();
+
+	// If disabled, all objects are unlimited
+	void Enable(bool enable) { enabled_ = enable; }
+
+	void SetLimit(direction d, int64_t limit) { limit_[d].limit = limit; }
+	void SetClassLimit(wxString const& name, direction d, int64_t limit);
+	void SetObjectLimit(direction d, int64_t limit) { objectLimit_[d] = limit; }
+
+	// The longest time span worth of tokens an object can accumulate
+	void SetBurstTime(int ms) { burstTime_ = ms; }
+
+	void Add(CRateLimiterObject* pObject);
+	void Remove(CRateLimiterObject* pObject);
+
+	// Moves the object into the given class, the empty name being the default class
+	void SetClass(CRateLimiterObject* pObject, wxString const& name);
+
+	// Hands out the tokens accrued over the elapsed milliseconds. Returns the
+	// waiting objects which can continue, they are no longer marked as waiting.
+	std::vector<CRateLimiterObject*> Distribute(direction d, int64_t elapsed);
+
+	// Milliseconds after the previous distribution at which waiting objects
+	// will get a worthwhile amount of tokens, -1 if no object is waiting.
+	int GetInterval() const;
+
+private:
+	struct bucket final
+	{
+		int64_t limit{};
+		int64_t remainder{};
+	};
+
+	struct rate_class final
+	{
+		bucket buckets[2];
+		std::vector<CRateLimiterObject*> objects;
+	};
+
+	// Returns the tokens a bucket with the given limit accrues over the elapsed
+	// milliseconds, -1 if unlimited. The remainder keeps track of the fractions.
+	int64_t Accrue(int64_t limit, int64_t& remainder, int64_t elapsed) const;
+
+	int64_t GetEffectiveLimit(rate_class const& c, direction d) const;
+
+	bool enabled_{true};
+	bucket limit_[2];
+	int64_t objectLimit_[2]{};
+	int burstTime_{1000};
+
+	std::map<wxString, rate_class> classes_;
+};
+
 struct ratelimit_changed_event_type{};
 typedef CEvent<ratelimit_changed_event_type> CRateLimitChangedEvent;
 
+struct ratelimit_wait_event_type{};
+typedef CEvent<ratelimit_wait_event_type> CRateLimitWaitEvent;
+
 class CRateLimiterObject
 {
 	friend class CRateLimiter;
+	friend class CRateScheduler;
 
 public:
 	CRateLimiterObject();
@@ -71,6 +174,15 @@ protected:
 private:
 	bool m_waiting[2];
 	int64_t m_bytesAvailable[2];
+
+	// Tokens used since the previous distribution
+	int64_t m_used[2];
+
+	// Fractional tokens of the per-object limit
+	int64_t m_remainder[2];
+
+	wxString m_rateClass;
+	CRateLimiter* m_limiter{};
 };
 
 #endif //__RATELIMITER_H__
@@ -286,6 +286,8 @@ CServer& CServer::operator=(const CServer &op)
 	m_timezoneOffset = op.m_timezoneOffset;
 	m_pasvMode = op.m_pasvMode;
 	m_maximumMultipleConnections = op.m_maximumMultipleConnections;
+	m_speedLimit[0] = op.m_speedLimit[0];
+	m_speedLimit[1] = op.m_speedLimit[1];
 	m_encodingType = op.m_encodingType;
 	m_customEncoding = op.m_customEncoding;
 	m_postLoginCommands = op.m_postLoginCommands;
@@ -341,7 +343,7 @@ bool CServer::operator==(const CServer &op) const
 	if (m_bypassProxy != op.m_bypassProxy)
 		return false;
 
-	// Do not compare number of allowed multiple connections
+	// Do not compare number of allowed multiple connections and speed limits
 
 	return true;
 }
@@ -432,7 +434,7 @@ bool CServer::operator<(const CServer &op) const
 	else if (m_bypassProxy > op.m_bypassProxy)
 		return false;
 
-	// Do not compare number of allowed multiple connections
+	// Do not compare number of allowed multiple connections and speed limits
 
 	return false;
 }
@@ -479,7 +481,7 @@ bool CServer::EqualsNoPass(const CServer &op) const
 	if (m_bypassProxy != op.m_bypassProxy)
 		return false;
 
-	// Do not compare number of allowed multiple connections
+	// Do not compare number of allowed multiple connections and speed limits
 
 	return true;
 }
@@ -612,6 +614,22 @@ int CServer::MaximumMultipleConnections() const
 	return m_maximumMultipleConnections;
 }
 
+void CServer::SetSpeedLimits(int inbound, int outbound)
+{
+	m_speedLimit[0] = (inbound > 0) ? inbound : 0;
+	m_speedLimit[1] = (outbound > 0) ? outbound : 0;
+}
+
+int CServer::GetInboundSpeedLimit() const
+{
+	return m_speedLimit[0];
+}
+
+int CServer::GetOutboundSpeedLimit() const
+{
+	return m_speedLimit[1];
+}
+
 wxString CServer::FormatHost(bool always_omit_port /*=false*/) const
 {
 	wxString host = m_host;
@@ -660,6 +678,8 @@ void CServer::Initialize()
 	m_timezoneOffset = 0;
 	m_pasvMode = MODE_DEFAULT;
 	m_maximumMultipleConnections = 0;
+	m_speedLimit[0] = 0;
+	m_speedLimit[1] = 0;
 	m_encodingType = ENCODING_AUTO;
 	m_customEncoding.clear();
 	m_bypassProxy = false;
@@ -10,13 +10,14 @@
 #include "proxy.h"
 #include "servercapabilities.h"
 #include "sftpcontrolsocket.h"
+#include "sftpsharedquota.h"
 
 #include <wx/filename.h>
 #include <wx/log.h>
 #include <wx/tokenzr.h>
 #include <wx/txtstrm.h>
 
-#define FZSFTP_PROTOCOL_VERSION 2
+#define FZSFTP_PROTOCOL_VERSION 5
 
 struct sftp_event_type;
 typedef CEvent<sftp_event_type> CSftpEvent;
@@ -43,15 +44,17 @@ enum filetransferStates
 	filetransfer_chmtime
 };
 
-struct sftp_message
+// Messages from fzsftp travel in a ring of preallocated slots. The text
+// buffers of the slots get swapped with the one of the reader, so once
+// they have grown to size, passing on messages allocates nothing.
+struct sftp_message final
 {
-	sftpEvent type;
-	wxString text;
-	union
-	{
-		sftpRequestTypes reqType;
-		int value;
-	};
+	sftpEvent type{sftpEvent::Unknown};
+	sftpRequestTypes reqType{sftpReqUnknown};
+	int value{};
+
+	// As received, in the server's encoding
+	std::string text;
 };
 
 class CSftpInputThread final : public wxThread
@@ -59,17 +62,10 @@ class CSftpInputThread final : public wxThread
 public:
 	CSftpInputThread(CSftpControlSocket* pOwner, CProcess& process)
 		: wxThread(wxTHREAD_JOINABLE), process_(process),
-		  m_pOwner(pOwner)
+		  m_pOwner(pOwner), ring_(ring_size), buffer_(buffer_size)
 	{
 	}
 
-	virtual ~CSftpInputThread()
-	{
-		scoped_lock l(m_sync);
-		for (auto iter = m_sftpMessages.begin(); iter != m_sftpMessages.end(); ++iter)
-			delete *iter;
-	}
-
 	bool Init()
 	{
 		if (Create() != wxTHREAD_NO_ERROR)
@@ -80,206 +76,241 @@ public:
 		return true;
 	}
 
-	void GetMessages(std::list<sftp_message*>& messages)
+	// Moves the oldest message into the given one, returns false if there is none.
+	bool PopMessage(sftp_message& message)
+	{
+		scoped_lock l(m_sync);
+		if (!count_) {
+			return false;
+		}
+
+		sftp_message& slot = ring_[head_];
+		message.type = slot.type;
+		message.reqType = slot.reqType;
+		message.value = slot.value;
+		message.text.swap(slot.text);
+
+		head_ = (head_ + 1) % ring_size;
+		if (count_-- == ring_size) {
+			// Reader might be waiting for a free slot
+			m_cond.signal(l);
+		}
+		return true;
+	}
+
+	// Wakes up the thread if it is waiting for a free slot, must be called
+	// before waiting for the thread.
+	void Stop()
 	{
 		scoped_lock l(m_sync);
-		messages.swap(m_sftpMessages);
+		quit_ = true;
+		m_cond.signal(l);
 	}
 
 protected:
+	// Enough to not stall fzsftp during bursts of listing entries
+	static size_t const ring_size = 256;
+
+	static size_t const buffer_size = 64 * 1024;
+
+	// Longer texts get truncated
+	static size_t const max_text = 4096;
 
-	void SendMessage(sftp_message* message)
+	sftp_message* Reserve()
 	{
-		bool sendEvent;
+		scoped_lock l(m_sync);
+		while (count_ == ring_size && !quit_) {
+			m_cond.wait(l);
+		}
+		if (quit_) {
+			return 0;
+		}
 
+		// Only the consumer touches the slots between head_ and head_ + count_
+		return &ring_[(head_ + count_) % ring_size];
+	}
+
+	void Commit()
+	{
+		bool sendEvent;
 		{
 			scoped_lock l(m_sync);
-			sendEvent = m_sftpMessages.empty();
-			m_sftpMessages.push_back(message);
+			sendEvent = !count_++;
 		}
 
 		if (sendEvent)
 			m_pOwner->SendEvent<CSftpEvent>();
 	}
 
-	int ReadNumber(bool &error)
+	// Makes sure at least len bytes are buffered
+	bool Fill(size_t len)
 	{
-		int number = 0;
+		if (end_ - pos_ >= len) {
+			return true;
+		}
 
-		while(true) {
-			char c;
-			int read = process_.Read(&c, 1);
-			if (read != 1) {
+		if (pos_) {
+			memmove(&buffer_[0], &buffer_[pos_], end_ - pos_);
+			end_ -= pos_;
+			pos_ = 0;
+		}
+
+		while (end_ < len) {
+			int read = process_.Read(&buffer_[end_], buffer_size - end_);
+			if (read <= 0) {
 				if (!read)
 					m_pOwner->LogMessage(MessageType::Debug_Warning, _T("Unexpected EOF."));
 				else
 					m_pOwner->LogMessage(MessageType::Debug_Warning, _T("Uknown input stream error"));
-				error = true;
-				return 0;
-			}
-
-			if (c == '\n')
-				break;
-			else if (c >= '0' && c <= '9') {
-				number *= 10;
-				number += c - '0';
+				return false;
 			}
+			end_ += read;
 		}
-		return number;
+
+		return true;
 	}
 
-	wxString ReadLine(bool &error)
+	uint32_t ReadNumber()
 	{
-		int len = 0;
-		const int buffersize = 4096;
-		char buffer[buffersize];
+		unsigned char const* p = reinterpret_cast<unsigned char const*>(&buffer_[pos_]);
+		pos_ += 4;
+		return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+	}
 
-		while(true) {
-			char c;
-			int read = process_.Read(&c, 1);
-			if (read != 1) {
-				if (!read)
-					m_pOwner->LogMessage(MessageType::Debug_Warning, _T("Unexpected EOF."));
-				else
-					m_pOwner->LogMessage(MessageType::Debug_Warning, _T("Uknown input stream error"));
-				error = true;
-				return wxString();
+	// Reads the payload into text, truncating it to max_text
+	bool ReadPayload(uint32_t len, std::string& text)
+	{
+		text.clear();
+		while (len) {
+			if (!Fill(1)) {
+				return false;
 			}
+			size_t chunk = std::min(static_cast<size_t>(len), end_ - pos_);
+			if (text.size() < max_text) {
+				text.append(&buffer_[pos_], std::min(chunk, max_text - text.size()));
+			}
+			pos_ += chunk;
+			len -= chunk;
+		}
+		return true;
+	}
 
-			if (c == '\n')
-				break;
+	static uint32_t GetNumber(std::string const& s, size_t pos)
+	{
+		unsigned char const* p = reinterpret_cast<unsigned char const*>(s.c_str()) + pos;
+		return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+	}
 
-			if (len == buffersize - 1) {
-				// Cap string length
-				continue;
-			}
+	wxString ConvToLocal(char const* s, size_t len, bool & error)
+	{
+		std::string const str(s, len);
+		wxString const ret = m_pOwner->ConvToLocal(str.c_str(), len + 1);
+		if (len && ret.empty()) {
+			m_pOwner->LogMessage(MessageType::Error, _T("Failed to convert reply to local character set."));
+			error = true;
+		}
+		return ret;
+	}
 
-			buffer[len++] = c;
+	// Handles a request of fzsftp, returns false on malformed input
+	bool ProcessRequest(sftp_message& message)
+	{
+		std::string const& payload = message.text;
+		if (payload.empty()) {
+			return false;
 		}
 
-		while (len && buffer[len - 1] == '\r')
-			--len;
+		int const requestType = static_cast<unsigned char>(payload[0]);
+		if (requestType == sftpReqHostkey || requestType == sftpReqHostkeyChanged) {
+			if (payload.size() < 9) {
+				return false;
+			}
+			uint32_t const hostLen = GetNumber(payload, 1);
+			if (payload.size() < 9 + static_cast<size_t>(hostLen)) {
+				return false;
+			}
+			int const port = static_cast<int>(GetNumber(payload, 5 + hostLen));
 
-		buffer[len] = 0;
+			bool error = false;
+			wxString const host = ConvToLocal(payload.c_str() + 5, hostLen, error);
+			wxString const fingerprint = ConvToLocal(payload.c_str() + 9 + hostLen, payload.size() - 9 - hostLen, error);
+			if (error) {
+				return false;
+			}
 
-		const wxString line = m_pOwner->ConvToLocal(buffer, len + 1);
-		if (len && line.empty()) {
-			m_pOwner->LogMessage(MessageType::Error, _T("Failed to convert reply to local character set."));
-			error = true;
+			m_pOwner->SendAsyncRequest(new CHostKeyNotification(host, port, fingerprint, requestType == sftpReqHostkeyChanged));
+		}
+		else if (requestType == sftpReqPassword) {
+			message.reqType = sftpReqPassword;
+			message.text.erase(0, 1);
+			Commit();
 		}
 
-		return line;
+		return true;
 	}
 
 	virtual ExitCode Entry()
 	{
-		bool error = false;
-		while (!error) {
-			char readType = 0;
-			int read = process_.Read(&readType, 1);
-			if (read != 1)
+		while (true) {
+			if (!Fill(5)) {
 				break;
+			}
 
-			readType -= '0';
+			int const readType = static_cast<unsigned char>(buffer_[pos_++]);
+			uint32_t const len = ReadNumber();
 
 			sftpEvent eventType = sftpEvent::Unknown;
-			if( readType >= 0 && readType <= static_cast<char>(sftpEvent::max) ) {
+			if (readType <= static_cast<int>(sftpEvent::max)) {
 				eventType = static_cast<sftpEvent>(readType);
 			}
 
-			switch(eventType)
-			{
-			case sftpEvent::Reply:
-			case sftpEvent::Listentry:
-			case sftpEvent::RequestPreamble:
-			case sftpEvent::RequestInstruction:
-			case sftpEvent::Done:
-			case sftpEvent::Error:
-			case sftpEvent::Verbose:
-			case sftpEvent::Status:
-			case sftpEvent::KexAlgorithm:
-			case sftpEvent::KexHash:
-			case sftpEvent::CipherClientToServer:
-			case sftpEvent::CipherServerToClient:
-			case sftpEvent::MacClientToServer:
-			case sftpEvent::MacServerToClient:
-			case sftpEvent::Hostkey:
-				{
-					sftp_message* message = new sftp_message;
-					message->type = eventType;
-					message->text = ReadLine(error);
-					if (error) {
-						delete message;
-						goto loopexit;
-					}
-					SendMessage(message);
+			if (eventType == sftpEvent::Unknown || eventType == sftpEvent::Close) {
+				m_pOwner->LogMessage(MessageType::Debug_Info, _T("Unknown eventType: %d"), readType);
+				std::string ignored;
+				if (!ReadPayload(len, ignored)) {
+					break;
 				}
+				continue;
+			}
+
+			sftp_message* message = Reserve();
+			if (!message) {
 				break;
-			case sftpEvent::Request:
-				{
-					const wxString& line = ReadLine(error);
-					if (error || line.empty())
-						goto loopexit;
-					int requestType = line[0] - '0';
-					if (requestType == sftpReqHostkey || requestType == sftpReqHostkeyChanged) {
-						const wxString& strPort = ReadLine(error);
-						if (error)
-							goto loopexit;
-						long port = 0;
-						if (!strPort.ToLong(&port))
-							goto loopexit;
-						const wxString& fingerprint = ReadLine(error);
-						if (error)
-							goto loopexit;
-
-						m_pOwner->SendAsyncRequest(new CHostKeyNotification(line.Mid(1), port, fingerprint, requestType == sftpReqHostkeyChanged));
-					}
-					else if (requestType == sftpReqPassword)
-					{
-						sftp_message* message = new sftp_message;
-						message->type = eventType;
-						message->reqType = sftpReqPassword;
-						message->text = line.Mid(1);
-						SendMessage(message);
-					}
-				}
+			}
+			message->type = eventType;
+			if (!ReadPayload(len, message->text)) {
 				break;
-			case sftpEvent::Recv:
-			case sftpEvent::Send:
-			case sftpEvent::UsedQuotaRecv:
-			case sftpEvent::UsedQuotaSend:
-				{
-					sftp_message* message = new sftp_message;
-					message->type = eventType;
-					SendMessage(message);
-				}
+			}
+
+			bool valid = true;
+			switch (eventType)
+			{
+			case sftpEvent::Request:
+				valid = ProcessRequest(*message);
 				break;
+			case sftpEvent::Done:
 			case sftpEvent::Transfer:
-				{
-					sftp_message* message = new sftp_message;
-					message->type = eventType;
-					message->value = ReadNumber(error);
-					if (error) {
-						delete message;
-						goto loopexit;
+				if (message->text.size() != 4) {
+					valid = false;
+				}
+				else {
+					message->value = static_cast<int>(GetNumber(message->text, 0));
+					message->text.clear();
+					if (eventType == sftpEvent::Done || message->value) {
+						Commit();
 					}
-					if (!message->value)
-						delete message;
-					else
-						SendMessage(message);
 				}
 				break;
 			default:
-				{
-					char tmp[2];
-					tmp[0] = static_cast<char>(eventType) + '0';
-					tmp[1] = 0;
-					m_pOwner->LogMessage(MessageType::Debug_Info, _T("Unknown eventType: %s"), tmp);
-				}
+				Commit();
+				break;
+			}
+
+			if (!valid) {
+				m_pOwner->LogMessage(MessageType::Debug_Warning, _T("Malformed message of type %d from fzsftp"), readType);
 				break;
 			}
 		}
-loopexit:
 
 		m_pOwner->SendEvent<CTerminateEvent>();
 		return reinterpret_cast<ExitCode>(Close());
@@ -293,8 +324,17 @@ loopexit:
 	CProcess& process_;
 	CSftpControlSocket* m_pOwner;
 
-	std::list<sftp_message*> m_sftpMessages;
+	std::vector<sftp_message> ring_;
+	size_t head_{};
+	size_t count_{};
+	bool quit_{};
 	mutex m_sync;
+	condition m_cond;
+
+	// Read from the process but not yet parsed are the bytes from pos_ to end_
+	std::vector<char> buffer_;
+	size_t pos_{};
+	size_t end_{};
 };
 
 class CSftpDeleteOpData : public COpData
@@ -404,13 +444,28 @@ int CSftpControlSocket::Connect(const CServer &server)
 	m_pProcess = new CProcess();
 
 	engine_.GetRateLimiter().AddObject(this);
+	engine_.GetRateLimiter().SetServer(this, *m_pCurrentServer);
 
 	wxString executable = engine_.GetOptions().GetOption(OPTION_FZSFTP_EXECUTABLE);
 	if (executable.empty())
 		executable = _T("fzsftp");
 	LogMessage(MessageType::Debug_Verbose, _T("Going to execute %s"), executable);
 
-	if (!m_pProcess->Execute(executable, _T("-v"))) {
+	wxString args = _T("-v -binary");
+	int const compression = engine_.GetOptions().GetOptionVal(OPTION_SFTP_COMPRESSION);
+	if (compression > 0)
+		args += wxString::Format(_T(" -compresslevel %d"), compression);
+
+	if (engine_.GetOptions().GetOptionVal(OPTION_SFTP_CONNECTION_SHARING))
+		args += _T(" -share");
+
+	m_sharedQuota.reset(new CSftpSharedQuota);
+	if (m_sharedQuota->Create())
+		args += _T(" -quotashm ") + m_sharedQuota->GetName();
+	else
+		m_sharedQuota.reset();
+
+	if (!m_pProcess->Execute(executable, args)) {
 		LogMessage(MessageType::Debug_Warning, _T("Could not create process: %s"), wxSysErrorMsg());
 		DoClose();
 		return FZ_REPLY_ERROR;
@@ -575,41 +630,47 @@ void CSftpControlSocket::OnSftpEvent()
 	if (!m_pInputThread)
 		return;
 
-	std::list<sftp_message*> messages;
-	m_pInputThread->GetMessages(messages);
-	for (auto iter = messages.begin(); iter != messages.end(); ++iter) {
-		if (!m_pInputThread) {
-			delete *iter;
-			continue;
-		}
+	if (!m_sftpMessage)
+		m_sftpMessage.reset(new sftp_message);
 
-		sftp_message* message = *iter;
+	while (m_pInputThread && m_pInputThread->PopMessage(*m_sftpMessage)) {
+		sftp_message const* message = m_sftpMessage.get();
+
+		wxString text;
+		if (!message->text.empty()) {
+			text = ConvToLocal(message->text.c_str(), message->text.size() + 1);
+			if (text.empty()) {
+				LogMessage(MessageType::Error, _T("Failed to convert reply to local character set."));
+				DoClose();
+				return;
+			}
+		}
 
 		switch (message->type)
 		{
 		case sftpEvent::Reply:
-			LogMessageRaw(MessageType::Response, message->text);
-			ProcessReply(true, message->text);
+			LogMessageRaw(MessageType::Response, text);
+			ProcessReply(true, text);
 			break;
 		case sftpEvent::Status:
-			LogMessageRaw(MessageType::Status, message->text);
+			LogMessageRaw(MessageType::Status, text);
 			break;
 		case sftpEvent::Error:
-			LogMessageRaw(MessageType::Error, message->text);
+			LogMessageRaw(MessageType::Error, text);
 			break;
 		case sftpEvent::Verbose:
-			LogMessageRaw(MessageType::Debug_Info, message->text);
+			LogMessageRaw(MessageType::Debug_Info, text);
 			break;
 		case sftpEvent::Done:
 			{
-				ProcessReply(message->text == _T("1"));
+				ProcessReply(message->value == 1);
 				break;
 			}
 		case sftpEvent::RequestPreamble:
-			m_requestPreamble = message->text;
+			m_requestPreamble = text;
 			break;
 		case sftpEvent::RequestInstruction:
-			m_requestInstruction = message->text;
+			m_requestInstruction = text;
 			break;
 		case sftpEvent::Request:
 			switch(message->reqType)
@@ -628,8 +689,8 @@ void CSftpControlSocket::OnSftpEvent()
 						challenge += m_requestPreamble + _T("\n");
 					if (!m_requestInstruction.empty())
 						challenge += m_requestInstruction + _T("\n");
-					if (message->text != _T("Password:"))
-						challenge += message->text;
+					if (text != _T("Password:"))
+						challenge += text;
 					CInteractiveLoginNotification *pNotification = new CInteractiveLoginNotification(challenge);
 					pNotification->server = *m_pCurrentServer;
 
@@ -639,7 +700,7 @@ void CSftpControlSocket::OnSftpEvent()
 				{
 					CSftpConnectOpData *pData = static_cast<CSftpConnectOpData*>(m_pCurOpData);
 
-					const wxString newChallenge = m_requestPreamble + _T("\n") + m_requestInstruction + message->text;
+					const wxString newChallenge = m_requestPreamble + _T("\n") + m_requestInstruction + text;
 
 					if (pData->pLastChallenge)
 					{
@@ -649,9 +710,6 @@ void CSftpControlSocket::OnSftpEvent()
 						else
 							LogMessage(MessageType::Error, _("Server sent an additional login prompt. You need to use the interactive login type."));
 						DoClose(FZ_REPLY_CRITICALERROR | FZ_REPLY_PASSWORDFAILED);
-
-						for (;iter != messages.end(); ++iter)
-							delete *iter;
 						return;
 					}
 
@@ -669,7 +727,7 @@ void CSftpControlSocket::OnSftpEvent()
 			}
 			break;
 		case sftpEvent::Listentry:
-			ListParseEntry(message->text);
+			ListParseEntry(text);
 			break;
 		case sftpEvent::Transfer:
 			{
@@ -706,31 +764,33 @@ void CSftpControlSocket::OnSftpEvent()
 			OnQuotaRequest(CRateLimiter::outbound);
 			break;
 		case sftpEvent::KexAlgorithm:
-			m_sftpEncryptionDetails.kexAlgorithm = message->text;
+			m_sftpEncryptionDetails.kexAlgorithm = text;
 			break;
 		case sftpEvent::KexHash:
-			m_sftpEncryptionDetails.kexHash = message->text;
+			m_sftpEncryptionDetails.kexHash = text;
 			break;
 		case sftpEvent::CipherClientToServer:
-			m_sftpEncryptionDetails.cipherClientToServer = message->text;
+			m_sftpEncryptionDetails.cipherClientToServer = text;
 			break;
 		case sftpEvent::CipherServerToClient:
-			m_sftpEncryptionDetails.cipherServerToClient = message->text;
+			m_sftpEncryptionDetails.cipherServerToClient = text;
 			break;
 		case sftpEvent::MacClientToServer:
-			m_sftpEncryptionDetails.macClientToServer = message->text;
+			m_sftpEncryptionDetails.macClientToServer = text;
 			break;
 		case sftpEvent::MacServerToClient:
-			m_sftpEncryptionDetails.macServerToClient = message->text;
+			m_sftpEncryptionDetails.macServerToClient = text;
 			break;
 		case sftpEvent::Hostkey:
-			m_sftpEncryptionDetails.hostKey = message->text;
+			m_sftpEncryptionDetails.hostKey = text;
+			break;
+		case sftpEvent::PipelineStats:
+			LogMessageRaw(MessageType::Debug_Info, _T("Transfer pipeline: ") + text);
 			break;
 		default:
 			wxFAIL_MSG(_T("given notification codes not handled"));
 			break;
 		}
-		delete message;
 	}
 }
 
@@ -1547,9 +1607,17 @@ int CSftpControlSocket::FileTransfer(const wxString localFile, const CServerPath
 		return FZ_REPLY_ERROR;
 	}
 
+	if (!download && transferSettings.HasRange()) {
+		ResetOperation(FZ_REPLY_SYNTAXERROR);
+		return FZ_REPLY_ERROR;
+	}
+
 	if (download) {
 		wxString filename = remotePath.FormatFilename(remoteFile);
-		LogMessage(MessageType::Status, _("Starting download of %s"), filename);
+		if (transferSettings.HasRange())
+			LogMessage(MessageType::Status, _("Starting download of %s, bytes %s to %s"), filename, wxLongLong(transferSettings.rangeOffset).ToString(), wxLongLong(transferSettings.rangeOffset + transferSettings.rangeLength - 1).ToString());
+		else
+			LogMessage(MessageType::Status, _("Starting download of %s"), filename);
 	}
 	else {
 		LogMessage(MessageType::Status, _("Starting upload of %s"), localFile);
@@ -1734,11 +1802,29 @@ int CSftpControlSocket::FileTransferSend()
 	if (pData->opState == filetransfer_transfer)
 	{
 		wxString cmd;
-		if (pData->resume)
-			cmd = _T("re");
-		if (pData->download)
+		if (pData->download && pData->transferSettings.HasRange())
+		{
+			CreateLocalDir(pData->localFile);
+
+			engine_.transfer_status_.Init(pData->transferSettings.rangeLength, 0, false);
+			cmd = wxString::Format(_T("getrange %s %s "), wxLongLong(pData->transferSettings.rangeOffset).ToString(), wxLongLong(pData->transferSettings.rangeLength).ToString());
+			cmd += QuoteFilename(pData->remotePath.FormatFilename(pData->remoteFile, !pData->tryAbsolutePath)) + _T(" ");
+
+			wxString localFile = QuoteFilename(pData->localFile);
+			wxString logstr = cmd;
+			logstr += localFile;
+			LogMessageRaw(MessageType::Command, logstr);
+
+			if (!AddToStream(cmd) || !AddToStream(localFile + _T("\n"), true)) {
+				ResetOperation(FZ_REPLY_ERROR);
+				return FZ_REPLY_ERROR;
+			}
+		}
+		else if (pData->download)
 		{
-			if (!pData->resume)
+			if (pData->resume)
+				cmd = _T("re");
+			else
 				CreateLocalDir(pData->localFile);
 
 			engine_.transfer_status_.Init(pData->remoteFileSize, pData->resume ? pData->localFileSize : 0, false);
@@ -1756,6 +1842,9 @@ int CSftpControlSocket::FileTransferSend()
 			}
 		}
 		else {
+			if (pData->resume)
+				cmd = _T("re");
+
 			engine_.transfer_status_.Init(pData->localFileSize, pData->resume ? pData->remoteFileSize : 0, false);
 			cmd += _T("put ");
 
@@ -1909,10 +1998,11 @@ int CSftpControlSocket::DoClose(int nErrorCode /*=FZ_REPLY_DISCONNECTED*/)
 	}
 
 	if (m_pInputThread) {
-		wxThread* pThread = m_pInputThread;
+		CSftpInputThread* pThread = m_pInputThread;
 		m_pInputThread = 0;
 
 		if (pThread) {
+			pThread->Stop();
 			pThread->Wait(wxTHREAD_WAIT_BLOCK);
 			delete pThread;
 		}
@@ -1921,6 +2011,7 @@ int CSftpControlSocket::DoClose(int nErrorCode /*=FZ_REPLY_DISCONNECTED*/)
 		delete m_pProcess;
 		m_pProcess = 0;
 	}
+	m_sharedQuota.reset();
 	return CControlSocket::DoClose(nErrorCode);
 }
 
@@ -2608,13 +2699,24 @@ void CSftpControlSocket::OnQuotaRequest(CRateLimiter::rate_direction direction)
 			b = INT_MAX;
 		else
 			b = bytes;
-		AddToStream(wxString::Format(_T("-%d%d,%d\n"), (int)direction, b, engine_.GetOptions().GetOptionVal(OPTION_SPEEDLIMIT_INBOUND + static_cast<int>(direction))));
+		int const limit = engine_.GetOptions().GetOptionVal(OPTION_SPEEDLIMIT_INBOUND + static_cast<int>(direction));
+		if (m_sharedQuota)
+			m_sharedQuota->Grant(direction, b, limit);
+		else
+			AddToStream(wxString::Format(_T("-%d%d,%d\n"), (int)direction, b, limit));
 		UpdateUsage(direction, b);
 	}
-	else if (bytes == 0)
+	else if (bytes == 0) {
+		if (m_sharedQuota)
+			m_sharedQuota->SetLimited(direction);
 		Wait(direction);
-	else if (bytes < 0)
-		AddToStream(wxString::Format(_T("-%d-\n"), (int)direction));
+	}
+	else if (bytes < 0) {
+		if (m_sharedQuota)
+			m_sharedQuota->SetUnlimited(direction);
+		else
+			AddToStream(wxString::Format(_T("-%d-\n"), (int)direction));
+	}
 }
 
 
@@ -4,6 +4,8 @@
 #include "ControlSocket.h"
 #include <wx/process.h>
 
+#include <memory>
+
 enum class sftpEvent {
 	Unknown = -1,
 	Reply = 0,
@@ -28,8 +30,9 @@ enum class sftpEvent {
 	MacClientToServer,
 	MacServerToClient,
 	Hostkey,
+	PipelineStats,
 
-	max = Hostkey
+	max = PipelineStats
 };
 
 enum sftpRequestTypes
@@ -42,6 +45,8 @@ enum sftpRequestTypes
 
 class CProcess;
 class CSftpInputThread;
+class CSftpSharedQuota;
+struct sftp_message;
 
 class CSftpControlSocket final : public CControlSocket, public CRateLimiterObject
 {
@@ -125,6 +130,12 @@ protected:
 	CProcess* m_pProcess{};
 	CSftpInputThread* m_pInputThread{};
 
+	// Null if quota gets sent over the pipe
+	std::unique_ptr<CSftpSharedQuota> m_sharedQuota;
+
+	// Receives the messages of the input thread
+	std::unique_ptr<sftp_message> m_sftpMessage;
+
 	virtual void operator()(CEventBase const& ev);
 	void OnSftpEvent();
 	void OnTerminate();
@@ -0,0 +1,145 @@
+#include <filezilla.h>
+#include "sftpsharedquota.h"
+
+#if defined(HAVE_LINUX_FUTEX_H) && defined(HAVE_SHM_OPEN)
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <climits>
+
+// Must match the layout in src/putty/fzsftp.c
+namespace {
+uint32_t const shared_quota_version = 1;
+
+uint32_t const shared_quota_unlimited = 0x1;
+uint32_t const shared_quota_requested = 0x2;
+}
+
+struct sftp_shared_quota_direction final
+{
+	int64_t available;
+	int32_t limit;
+	uint32_t state;
+	uint32_t wakeup;
+	uint32_t padding[11];
+};
+
+struct sftp_shared_quota final
+{
+	uint32_t version;
+	uint32_t padding[15];
+	sftp_shared_quota_direction d[2];
+};
+
+CSftpSharedQuota::~CSftpSharedQuota()
+{
+	if (quota_) {
+		munmap(quota_, sizeof(sftp_shared_quota));
+	}
+	if (!name_.empty()) {
+		// In case fzsftp never got to open it
+		shm_unlink(name_.mb_str());
+	}
+}
+
+bool CSftpSharedQuota::Create()
+{
+	static std::atomic<int> counter{};
+
+	int fd = -1;
+	for (int i = 0; i < 10 && fd == -1; ++i) {
+		name_ = wxString::Format(_T("/fzsftp-%d-%d"), static_cast<int>(getpid()), ++counter);
+		fd = shm_open(name_.mb_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	}
+	if (fd == -1) {
+		name_.clear();
+		return false;
+	}
+
+	void* p = MAP_FAILED;
+	if (!ftruncate(fd, sizeof(sftp_shared_quota))) {
+		p = mmap(0, sizeof(sftp_shared_quota), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+
+	if (p == MAP_FAILED) {
+		shm_unlink(name_.mb_str());
+		name_.clear();
+		return false;
+	}
+
+	// Fresh shared memory is zeroed, so fzsftp starts out without any tokens
+	quota_ = static_cast<sftp_shared_quota*>(p);
+	__atomic_store_n(&quota_->version, shared_quota_version, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+void CSftpSharedQuota::Grant(CRateLimiter::rate_direction direction, int bytes, int limit)
+{
+	sftp_shared_quota_direction& d = quota_->d[direction];
+	__atomic_store_n(&d.limit, limit, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&d.available, bytes, __ATOMIC_RELEASE);
+
+	// Once the request is cleared, fzsftp must see the tokens
+	__atomic_fetch_and(&d.state, ~(shared_quota_unlimited | shared_quota_requested), __ATOMIC_RELEASE);
+	Wakeup(direction);
+}
+
+void CSftpSharedQuota::SetUnlimited(CRateLimiter::rate_direction direction)
+{
+	sftp_shared_quota_direction& d = quota_->d[direction];
+	__atomic_store_n(&d.limit, -1, __ATOMIC_RELAXED);
+
+	uint32_t state = __atomic_load_n(&d.state, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&d.state, &state, (state | shared_quota_unlimited) & ~shared_quota_requested, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+	}
+	Wakeup(direction);
+}
+
+void CSftpSharedQuota::SetLimited(CRateLimiter::rate_direction direction)
+{
+	__atomic_fetch_and(&quota_->d[direction].state, ~shared_quota_unlimited, __ATOMIC_RELEASE);
+}
+
+void CSftpSharedQuota::Wakeup(CRateLimiter::rate_direction direction)
+{
+	uint32_t* wakeup = &quota_->d[direction].wakeup;
+	__atomic_fetch_add(wakeup, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, wakeup, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+}
+
+#else
+
+CSftpSharedQuota::~CSftpSharedQuota()
+{
+}
+
+bool CSftpSharedQuota::Create()
+{
+	return false;
+}
+
+void CSftpSharedQuota::Grant(CRateLimiter::rate_direction, int, int)
+{
+}
+
+void CSftpSharedQuota::SetUnlimited(CRateLimiter::rate_direction)
+{
+}
+
+void CSftpSharedQuota::SetLimited(CRateLimiter::rate_direction)
+{
+}
+
+void CSftpSharedQuota::Wakeup(CRateLimiter::rate_direction)
+{
+}
+
+#endif
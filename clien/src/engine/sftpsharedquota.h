@@ -0,0 +1,41 @@
+#ifndef FZ_SFTPSHAREDQUOTA_HEADER
+#define FZ_SFTPSHAREDQUOTA_HEADER
+
+#include "ratelimiter.h"
+
+struct sftp_shared_quota;
+
+// Hands out the rate limit quota to fzsftp through shared memory instead of
+// its input pipe. fzsftp takes from the granted tokens on its own and only
+// sends a quota request if it is about to run out, it then waits on a futex
+// until the next grant. Only supported on Linux.
+class CSftpSharedQuota final
+{
+public:
+	CSftpSharedQuota() = default;
+	~CSftpSharedQuota();
+
+	CSftpSharedQuota(CSftpSharedQuota const&) = delete;
+	CSftpSharedQuota& operator=(CSftpSharedQuota const&) = delete;
+
+	// Returns false if shared memory is not available
+	bool Create();
+
+	// To be passed to fzsftp, which removes the name once it has opened it.
+	wxString GetName() const { return name_; }
+
+	// Both answer the pending quota request of fzsftp
+	void Grant(CRateLimiter::rate_direction direction, int bytes, int limit);
+	void SetUnlimited(CRateLimiter::rate_direction direction);
+
+	// Leaves the request pending until the next grant
+	void SetLimited(CRateLimiter::rate_direction direction);
+
+private:
+	void Wakeup(CRateLimiter::rate_direction direction);
+
+	sftp_shared_quota* quota_{};
+	wxString name_;
+};
+
+#endif
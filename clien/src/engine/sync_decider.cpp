@@ -0,0 +1,77 @@
+#include <filezilla.h>
+#include "sync_decider.h"
+
+CSyncDecider::CSyncDecider(t_rules const& rules)
+	: m_rules(rules)
+{
+}
+
+void CSyncDecider::PlanFile(t_plan& plan, CDirectoryComparison::result res, t_transfer const& local, t_transfer const& remote, CLocalPath const& localDir) const
+{
+	bool download = false;
+	bool upload = false;
+
+	switch (res)
+	{
+	case CDirectoryComparison::result::left_only:
+		if (m_rules.dir != direction::download)
+			upload = true;
+		else if (m_rules.delete_orphans)
+			plan.localDeletes.push_back(localDir.GetPath() + local.localName);
+		break;
+	case CDirectoryComparison::result::right_only:
+		if (m_rules.dir != direction::upload)
+			download = true;
+		else if (m_rules.delete_orphans)
+			plan.remoteDeletes.push_back(remote.remoteName);
+		break;
+	case CDirectoryComparison::result::different:
+		// Sizes alone don't tell which one is right
+		if (m_rules.dir == direction::both)
+			plan.conflicts.push_back(remote);
+		download = m_rules.dir == direction::download;
+		upload = m_rules.dir == direction::upload;
+		break;
+	case CDirectoryComparison::result::left_newer:
+		download = m_rules.dir == direction::download;
+		upload = !download;
+		break;
+	case CDirectoryComparison::result::right_newer:
+		upload = m_rules.dir == direction::upload;
+		download = !upload;
+		break;
+	default:
+		break;
+	}
+
+	if (download)
+		plan.downloads.push_back(remote);
+	else if (upload) {
+		// Keep the name the file already has on the server
+		t_transfer transfer = local;
+		if (!remote.remoteName.empty())
+			transfer.remoteName = remote.remoteName;
+		plan.uploads.push_back(transfer);
+	}
+}
+
+void CSyncDecider::PlanDirectory(t_plan& plan, CDirectoryComparison::result res, t_transfer const& local, t_transfer const& remote, CLocalPath const& localDir) const
+{
+	switch (res)
+	{
+	case CDirectoryComparison::result::left_only:
+		if (m_rules.dir != direction::download)
+			plan.folderUploads.push_back(local);
+		else if (m_rules.delete_orphans)
+			plan.localDeletes.push_back(localDir.GetPath() + local.localName);
+		break;
+	case CDirectoryComparison::result::right_only:
+		// Removing whole directories from the server is left to the user
+		if (m_rules.dir != direction::upload)
+			plan.subdirs.push_back(remote);
+		break;
+	default:
+		plan.subdirs.push_back(remote);
+		break;
+	}
+}
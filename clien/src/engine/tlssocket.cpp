@@ -29,6 +29,8 @@ CTlsSocket::CTlsSocket(CEventHandler* pEvtHandler, CSocket* pSocket, CControlSoc
 {
 	wxASSERT(pSocket);
 	m_pSocketBackend = new CSocketBackend(this, *m_pSocket, m_pOwner->GetEngine().GetRateLimiter());
+	if (m_pOwner->GetCurrentServer())
+		m_pOwner->GetEngine().GetRateLimiter().SetServer(m_pSocketBackend, *m_pOwner->GetCurrentServer());
 
 	m_implicitTrustedCert.data = 0;
 	m_implicitTrustedCert.size = 0;
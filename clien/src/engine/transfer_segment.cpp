@@ -0,0 +1,62 @@
+#include <filezilla.h>
+#include "transfer_segment.h"
+
+#include <sqlite3.h>
+
+namespace {
+enum column
+{
+	col_offset,
+	col_length,
+	col_done,
+	col_index,
+	col_count,
+	col_size,
+	col_failed
+};
+
+int64_t GetColumnInt64(sqlite3_stmt* statement, int index, int64_t def)
+{
+	if (sqlite3_column_type(statement, index) == SQLITE_NULL)
+		return def;
+	return sqlite3_column_int64(statement, index);
+}
+}
+
+bool BindTransferSegment(sqlite3_stmt* statement, int first, CTransferSegment const* segment)
+{
+	if (!segment) {
+		for (int i = 0; i < transfer_segment_columns::count; ++i) {
+			if (sqlite3_bind_null(statement, first + i) != SQLITE_OK)
+				return false;
+		}
+		return true;
+	}
+
+	return sqlite3_bind_int64(statement, first + col_offset, segment->offset) == SQLITE_OK &&
+		sqlite3_bind_int64(statement, first + col_length, segment->length) == SQLITE_OK &&
+		sqlite3_bind_int64(statement, first + col_done, segment->done) == SQLITE_OK &&
+		sqlite3_bind_int(statement, first + col_index, segment->index) == SQLITE_OK &&
+		sqlite3_bind_int(statement, first + col_count, segment->count) == SQLITE_OK &&
+		sqlite3_bind_int64(statement, first + col_size, segment->size) == SQLITE_OK &&
+		sqlite3_bind_int(statement, first + col_failed, segment->failed ? 1 : 0) == SQLITE_OK;
+}
+
+bool ParseTransferSegment(sqlite3_stmt* statement, int first, CTransferSegment& segment)
+{
+	segment = CTransferSegment();
+
+	int64_t const segmentCount = GetColumnInt64(statement, first + col_count, 0);
+	int64_t const segmentLength = GetColumnInt64(statement, first + col_length, 0);
+	if (segmentCount <= 1 || segmentLength <= 0)
+		return false;
+
+	segment.offset = GetColumnInt64(statement, first + col_offset, 0);
+	segment.length = segmentLength;
+	segment.done = GetColumnInt64(statement, first + col_done, 0);
+	segment.index = static_cast<int>(GetColumnInt64(statement, first + col_index, 0));
+	segment.count = static_cast<int>(segmentCount);
+	segment.size = GetColumnInt64(statement, first + col_size, -1);
+	segment.failed = GetColumnInt64(statement, first + col_failed, 0) != 0;
+	return true;
+}
@@ -273,7 +273,11 @@ void CTransferSocket::OnReceive()
 			if (!CheckGetNextWriteBuffer())
 				return;
 
-			numread = m_pBackend->Read(m_pTransferBuffer, m_transferBufferLen, error);
+			int toRead = m_transferBufferLen;
+			if (m_receiveLimit >= 0 && m_receiveLimit < toRead) {
+				toRead = static_cast<int>(m_receiveLimit);
+			}
+			numread = m_pBackend->Read(m_pTransferBuffer, toRead, error);
 			if (numread <= 0) {
 				break;
 			}
@@ -287,6 +291,15 @@ void CTransferSocket::OnReceive()
 
 			m_pTransferBuffer += numread;
 			m_transferBufferLen -= numread;
+
+			if (m_receiveLimit > 0) {
+				m_receiveLimit -= numread;
+				if (!m_receiveLimit) {
+					controlSocket_.LogMessage(MessageType::Debug_Info, _T("Received requested range, closing data connection"));
+					FinalizeWrite();
+					return;
+				}
+			}
 		}
 
 		if (numread < 0) {
@@ -623,7 +636,8 @@ bool CTransferSocket::CheckGetNextWriteBuffer()
 			return false;
 		}
 
-		m_transferBufferLen = BUFFERSIZE;
+		m_transferBufferLen = res;
+		m_transferBufferSize = res;
 	}
 
 	return true;
@@ -673,7 +687,7 @@ void CTransferSocket::OnIOThreadEvent()
 
 void CTransferSocket::FinalizeWrite()
 {
-	bool res = ioThread_->Finalize(BUFFERSIZE - m_transferBufferLen);
+	bool res = ioThread_->Finalize(m_transferBufferSize - m_transferBufferLen);
 	if (m_transferEndReason != TransferEndReason::none)
 		return;
 
@@ -749,8 +763,11 @@ bool CTransferSocket::InitBackend()
 		if (!InitTls(controlSocket_.m_pTlsSocket))
 			return false;
 	}
-	else
+	else {
 		m_pBackend = new CSocketBackend(this, *m_pSocket, engine_.GetRateLimiter());
+		if (controlSocket_.GetCurrentServer())
+			engine_.GetRateLimiter().SetServer(m_pBackend, *controlSocket_.GetCurrentServer());
+	}
 
 	return true;
 }
@@ -38,6 +38,12 @@ public:
 
 	void SetIOThread(CIOThread* ioThread) { ioThread_ = ioThread; }
 
+	// Downloads: Stop receiving after the given number of bytes. The
+	// connection gets closed, the server will usually report the transfer
+	// as aborted.
+	void SetReceiveLimit(int64_t limit) { m_receiveLimit = limit; }
+	bool ReceiveLimitReached() const { return !m_receiveLimit; }
+
 protected:
 	bool CheckGetNextWriteBuffer();
 	bool CheckGetNextReadBuffer();
@@ -81,6 +87,9 @@ protected:
 
 	char *m_pTransferBuffer{};
 	int m_transferBufferLen{};
+	int m_transferBufferSize{}; // Size of the current write buffer
+
+	int64_t m_receiveLimit{-1}; // Remaining bytes to receive, -1 if unlimited
 
 	// Set to true if OnClose got called
 	// We now have to read all available data in the socket, ignoring any
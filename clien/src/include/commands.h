@@ -149,9 +149,20 @@ public:
 	public:
 		t_transferSettings()
 			: binary(true)
+			, rangeOffset(-1)
+			, rangeLength(-1)
 		{}
 
 		bool binary;
+
+		// Downloads only: If set, transfer only the given range of the
+		// remote file and write it at the same offset into the local file.
+		// The local file is neither truncated nor checked for existence,
+		// other ranges of it may be written concurrently.
+		int64_t rangeOffset;
+		int64_t rangeLength;
+
+		bool HasRange() const { return rangeOffset >= 0 && rangeLength > 0; }
 	};
 
 	// For uploads, set download to false.
@@ -0,0 +1,125 @@
+#ifndef __DIRECTORY_COMPARISON_H__
+#define __DIRECTORY_COMPARISON_H__
+
+#include <unordered_map>
+
+// Compares the entries of two directories, independent of how and whether
+// they are displayed. Entries are joined on their normalized name through a
+// hash table, neither side needs to be sorted.
+//
+// Once compared, single entries can be added, changed or removed. Only the
+// affected pairs get compared again, TakeChanges returns those whose result
+// changed.
+//
+// Nothing in here touches the UI. An instance can be used from any thread,
+// but only by one thread at a time.
+class CDirectoryComparison final
+{
+public:
+	enum class side
+	{
+		left,
+		right
+	};
+
+	enum class mode
+	{
+		// Files of different size are different
+		size,
+
+		// The newer file is flagged, dates within the threshold are equal
+		date
+	};
+
+	enum class result
+	{
+		equal,
+		different,
+		left_newer,
+		right_newer,
+		left_only,
+		right_only
+	};
+
+	struct entry
+	{
+		wxString name;
+		bool dir{};
+		int64_t size{-1};
+		CDateTime time;
+	};
+
+	static size_t const npos = static_cast<size_t>(-1);
+
+	// A pair of joined entries, identified by their index on either side.
+	// For entries that only exist on one side, the other index is npos.
+	struct match
+	{
+		size_t left{npos};
+		size_t right{npos};
+		result res{result::equal};
+	};
+
+	CDirectoryComparison(mode m, wxTimeSpan const& threshold, bool case_sensitive);
+
+	// Replaces all entries of one side, the index of each entry is its
+	// position in the passed vector. Pending changes are discarded.
+	void Set(side s, std::vector<entry> && entries);
+
+	// Adds an entry or replaces the entry of the same name and type.
+	// Returns the index of the entry.
+	size_t Update(side s, entry const& e);
+
+	// Returns false if there is no such entry. The index of a removed entry
+	// is not reused.
+	bool Remove(side s, wxString const& name, bool dir);
+
+	// Returns npos if there is no such entry
+	size_t Find(side s, wxString const& name, bool dir) const;
+
+	entry const& Get(side s, size_t index) const { return sides_[static_cast<int>(s)].items[index].e; }
+
+	// The match the entry is part of
+	match GetMatch(side s, size_t index) const;
+
+	// All matches, first those with an entry on the left side in order of
+	// the left entries, followed by the entries only on the right side.
+	std::vector<match> GetMatches() const;
+
+	// The matches whose result changed through calls to Update and Remove
+	// since the last call. Removing an entry reports the entry it was
+	// joined with, now on its own.
+	std::vector<match> TakeChanges();
+
+protected:
+	struct t_item
+	{
+		entry e;
+
+		// Index of the joined entry on the other side
+		size_t other{npos};
+		bool removed{};
+	};
+
+	struct t_side
+	{
+		std::vector<t_item> items;
+		std::unordered_map<wxString, size_t, wxStringHash> index;
+	};
+
+	wxString Key(wxString const& name, bool dir) const;
+	result Compare(entry const& left, entry const& right) const;
+
+	t_side& Own(side s) { return sides_[static_cast<int>(s)]; }
+	t_side& Other(side s) { return sides_[1 - static_cast<int>(s)]; }
+
+	mode const mode_;
+	wxTimeSpan const threshold_;
+	bool const case_sensitive_;
+
+	t_side sides_[2];
+
+	std::vector<match> changes_;
+};
+
+#endif //__DIRECTORY_COMPARISON_H__
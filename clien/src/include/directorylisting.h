@@ -4,7 +4,7 @@
 #include "optional.h"
 #include "timeex.h"
 
-#include <map>
+#include <vector>
 
 class CDirentry
 {
@@ -79,8 +79,9 @@ public:
 	void SetCount(unsigned int count);
 	unsigned int GetCount() const { return m_entryCount; }
 
+	// Both return the lowest index of a matching entry, or -1 if not found.
 	int FindFile_CmpCase(const wxString& name) const;
-	int FindFile_CmpNoCase(wxString name) const;
+	int FindFile_CmpNoCase(const wxString& name) const;
 
 	void ClearFindMap();
 
@@ -129,10 +130,33 @@ public:
 
 protected:
 
+	// Open-addressing hash index over the entry names. Built lazily in a
+	// single pass over all entries and shared between copies of a listing.
+	class CNameIndex final
+	{
+	public:
+		void Build(std::vector<CRefcountObject<CDirentry> > const& entries, unsigned int count);
+
+		int Find(std::vector<CRefcountObject<CDirentry> > const& entries, const wxString& name, bool cmpCase) const;
+
+		unsigned int GetCount() const { return count_; }
+
+	private:
+		struct bucket
+		{
+			unsigned int hash;
+			unsigned int index; // Entry index plus one, 0 marks an empty bucket
+		};
+
+		std::vector<bucket> case_;
+		std::vector<bucket> nocase_;
+		unsigned int mask_{};
+		unsigned int count_{};
+	};
+
 	CRefcountObject_Uninitialized<std::vector<CRefcountObject<CDirentry> > > m_entries;
 
-	mutable CRefcountObject_Uninitialized<std::multimap<wxString, unsigned int> > m_searchmap_case;
-	mutable CRefcountObject_Uninitialized<std::multimap<wxString, unsigned int> > m_searchmap_nocase;
+	mutable CRefcountObject_Uninitialized<CNameIndex> m_index;
 
 	unsigned int m_entryCount;
 };
@@ -16,7 +16,8 @@ public:
 	enum disposition
 	{
 		existing, // Keep existing data
-		truncate  // Truncate file
+		truncate, // Truncate file
+		shared    // Keep existing data, allow other writers to open the file at the same time
 	};
 
 	CFile();
@@ -57,6 +58,17 @@ public:
 	// Returns number of bytes written or -1 on error
 	ssize_t Write(void const* buf, size_t count);
 
+	// Bypass the page cache. While enabled, buffers, counts and file offsets
+	// of reads and writes need to be multiples of direct_io_alignment.
+	// Returns false if not supported
+	bool SetDirect(bool direct);
+
+	// Writes back the given range and evicts it from the page cache.
+	// No-op on platforms not supporting it.
+	void DropCache(wxFileOffset offset, wxFileOffset len);
+
+	static size_t const direct_io_alignment = 4096;
+
 protected:
 #ifdef __WXMSW__
 	HANDLE hFile_{INVALID_HANDLE_VALUE};
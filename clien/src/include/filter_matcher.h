@@ -0,0 +1,176 @@
+#ifndef __FILTER_MATCHER_H__
+#define __FILTER_MATCHER_H__
+
+#include <memory>
+#include <unordered_map>
+
+class wxRegEx;
+
+enum t_filterType
+{
+	filter_name = 0x01,
+	filter_size = 0x02,
+	filter_attributes = 0x04,
+	filter_permissions = 0x08,
+	filter_path = 0x10,
+	filter_date = 0x20,
+	filter_time = 0x40,
+#ifdef __WXMSW__
+	filter_meta = filter_attributes,
+	filter_foreign = filter_permissions,
+#else
+	filter_meta = filter_permissions,
+	filter_foreign = filter_attributes
+#endif
+};
+
+class CFilterCondition
+{
+public:
+	CFilterCondition();
+
+	enum t_filterType type;
+	int condition;
+
+	wxString strValue; // All other types
+	wxLongLong value; // If type is size
+	CDateTime date; // If type is date
+	bool matchCase;
+};
+
+class CFilter
+{
+public:
+	enum t_matchType
+	{
+		all,
+		any,
+		none
+	};
+
+	CFilter();
+
+	wxString name;
+
+	bool filterFiles;
+	bool filterDirs;
+	enum t_matchType matchType;
+	bool matchCase;
+
+	std::vector<CFilterCondition> filters;
+
+	bool HasConditionOfType(enum t_filterType type) const;
+	bool IsLocalFilter() const;
+};
+
+// Finds any number of literal patterns in a string in a single pass over
+// the string, using an Aho-Corasick automaton. The transitions are stored
+// as a table over the characters occurring in the patterns, all other
+// characters lead back to the start. If case gets folded, the table maps
+// each character to the symbol of its lowercase form, so the text need not
+// be folded before matching.
+class CStringMatcher final
+{
+public:
+	enum class kind
+	{
+		contains,
+		equals,
+		begins,
+		ends
+	};
+
+	// The id is the index of the hit reported by Match.
+	// Invalidates the automaton until the next call to Compile.
+	void Add(kind k, wxString const& pattern, size_t id);
+
+	// If folding case, the patterns have to be in lowercase already.
+	void Compile(bool foldCase = false);
+
+	bool empty() const { return patterns_.empty(); }
+
+	// Sets hits[id] for the patterns found in the text. Leaves the other
+	// hits untouched, they have to be cleared by the caller.
+	void Match(wxString const& text, std::vector<char>& hits) const;
+
+protected:
+	int Symbol(wxUint32 c) const;
+
+	struct t_pattern
+	{
+		kind k;
+		size_t length;
+		size_t id;
+	};
+	std::vector<t_pattern> patterns_;
+	std::vector<wxString> values_;
+
+	// Patterns of zero length are not part of the automaton
+	std::vector<size_t> emptyPatterns_;
+
+	// Symbol 0 stands for all characters not in any pattern
+	int ascii_[128]{};
+	std::unordered_map<wxUint32, int> symbols_;
+	int symbolCount_{1};
+	bool foldCase_{};
+
+	// Row of symbolCount_ entries for each state, state 0 is the start
+	std::vector<int> transitions_;
+
+	// Patterns ending in a state, and the next shorter suffix of it with
+	// patterns ending there, 0 if there is none.
+	std::vector<std::vector<size_t>> outputs_;
+	std::vector<int> outputLinks_;
+};
+
+// A list of filters compiled for filtering many entries. The literal name
+// and path conditions of all filters are matched in at most one pass over
+// the name and path each for case-sensitive and case-insensitive filters.
+// Regular expressions are only evaluated if the result depends on them.
+//
+// Once constructed, an instance can be used from any number of threads.
+class CFilterMatcher final
+{
+public:
+	// Filters nothing
+	CFilterMatcher();
+
+	explicit CFilterMatcher(std::vector<CFilter> const& filters);
+	~CFilterMatcher();
+
+	CFilterMatcher(CFilterMatcher const&) = delete;
+	CFilterMatcher& operator=(CFilterMatcher const&) = delete;
+
+	// False if a regular expression is invalid. Such conditions never match.
+	bool IsValid() const { return valid_; }
+
+	bool empty() const { return filters_.empty(); }
+
+	std::vector<CFilter> const& GetFilters() const { return filters_; }
+
+	// Whether any of the filters matches the entry.
+	// Note: Under non-windows, attributes are permissions
+	bool Filtered(wxString const& name, wxString const& path, bool dir, wxLongLong size, int attributes, CDateTime const& date) const;
+
+protected:
+	class CSubjects;
+
+	bool FilteredByFilter(size_t index, CSubjects& subjects, bool dir, wxLongLong size, int attributes, CDateTime const& date) const;
+
+	std::vector<CFilter> filters_;
+
+	// For each condition of each filter, the index of its hit for literal
+	// name and path conditions and of its regular expression for regex
+	// conditions, npos otherwise.
+	std::vector<std::vector<size_t>> refs_;
+
+	// Name and path, each case-sensitive and case-insensitive
+	CStringMatcher matchers_[4];
+	size_t hitCount_{};
+
+	std::vector<std::unique_ptr<wxRegEx>> regexes_;
+
+	bool valid_{true};
+};
+
+#endif //__FILTER_MATCHER_H__
@@ -62,6 +62,9 @@ protected:
 
 #ifndef __WXMSW__
 	static local_fileType GetFileInfo(const char* path, bool &isLink, int64_t* size, CDateTime* modificationTime, int* mode);
+
+	// Like GetFileInfo, for an entry of the directory being enumerated
+	local_fileType GetEntryInfo(const char* name, bool &isLink, int64_t* size, CDateTime* modificationTime, int* mode);
 	void AllocPathBuffer(const char* file);  // Ensures m_raw_path is large enough to hold path and filename
 #endif
 
@@ -8,7 +8,7 @@
 class COptions;
 
 enum {
-	changed_options_size = 128
+	changed_options_size = 256
 };
 
 typedef std::bitset<changed_options_size> changed_options_t;
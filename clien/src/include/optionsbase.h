@@ -59,6 +59,8 @@ enum engineOptions
 	OPTION_FTP_PROXY_CUSTOMLOGINSEQUENCE,
 
 	OPTION_SFTP_KEYFILES,
+	OPTION_SFTP_COMPRESSION,	// zlib level of SSH compression, 0 to disable
+	OPTION_SFTP_CONNECTION_SHARING,	// fzsftp instances to the same server share one SSH connection
 
 	OPTION_PROXY_TYPE,
 	OPTION_PROXY_HOST,
@@ -74,6 +76,18 @@ enum engineOptions
 	OPTION_SIZE_USETHOUSANDSEP,
 	OPTION_SIZE_DECIMALPLACES,
 
+	OPTION_CACHE_SIZE_LIMIT,	// Memory budget of the directory cache in MiB
+	OPTION_CACHE_PERSISTENT,	// Keep directory listings across sessions
+	OPTION_CACHE_FILE,			// File holding the persistent directory cache
+
+	OPTION_IO_BUFFER_COUNT,		// Upper limit of file IO buffers per transfer
+	OPTION_IO_BUFFER_SIZE,		// Upper limit of the size of each file IO buffer in KiB
+	OPTION_IO_DIRECT_THRESHOLD,	// Files of at least this many MiB bypass the page cache, 0 to disable
+	OPTION_IO_SIMULATE,			// Benchmark mode: Don't actually read or write local files. Never saved, set by --simulate-io
+
+	OPTION_SPEEDLIMIT_TRANSFER_INBOUND,		// Speed limits in KiB/s for each individual connection,
+	OPTION_SPEEDLIMIT_TRANSFER_OUTBOUND,	// 0 for no per-connection limit
+
 	OPTIONS_ENGINE_NUM
 };
 
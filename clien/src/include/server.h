@@ -85,6 +85,11 @@ public:
 	int MaximumMultipleConnections() const;
 	bool GetBypassProxy() const;
 
+	// Speed limits in KiB/s shared by all connections to this server, 0 if unlimited.
+	// These apply in addition to the global speed limits.
+	int GetInboundSpeedLimit() const;
+	int GetOutboundSpeedLimit() const;
+
 	// Return true if URL could be parsed correctly, false otherwise.
 	// If parsing fails, pError is filled with the reason and the CServer instance may be left an undefined state.
 	bool ParseUrl(wxString host, unsigned int port, wxString user, wxString pass, wxString &error, CServerPath &path);
@@ -106,6 +111,7 @@ public:
 	bool SetTimezoneOffset(int minutes);
 	void SetPasvMode(PasvMode pasvMode);
 	void MaximumMultipleConnections(int maximum);
+	void SetSpeedLimits(int inbound, int outbound);
 
 	wxString FormatHost(bool always_omit_port = false) const;
 	wxString FormatServer(const bool always_include_prefix = false) const;
@@ -160,6 +166,7 @@ protected:
 	int m_timezoneOffset;
 	PasvMode m_pasvMode;
 	int m_maximumMultipleConnections;
+	int m_speedLimit[2];
 	CharsetEncoding m_encodingType;
 	wxString m_customEncoding;
 	wxString m_name;
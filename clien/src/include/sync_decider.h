@@ -0,0 +1,78 @@
+#ifndef __SYNC_DECIDER_H__
+#define __SYNC_DECIDER_H__
+
+#include "directory_comparison.h"
+#include "local_path.h"
+
+// Decides what to do about a pair of compared entries when synchronizing
+// two directories. Knows nothing about how the directories are read or
+// filtered, that is up to the CSyncPlanner of the interface.
+class CSyncDecider
+{
+public:
+	enum class direction
+	{
+		// Local directory becomes a copy of the remote one
+		download,
+
+		// Remote directory becomes a copy of the local one
+		upload,
+
+		// Missing and outdated files get copied either way. Never deletes.
+		both
+	};
+
+	struct t_rules
+	{
+		direction dir{direction::both};
+
+		// Compare modification times instead of sizes
+		bool compare_date{};
+		wxTimeSpan threshold;
+
+		// Delete files and directories only existing in the target
+		bool delete_orphans{};
+	};
+
+	struct t_transfer
+	{
+		wxString localName;
+		wxString remoteName;
+		int64_t size{-1};
+	};
+
+	struct t_plan
+	{
+		std::vector<t_transfer> downloads;
+		std::vector<t_transfer> uploads;
+
+		// Local directories missing on the server, uploaded as a whole
+		std::vector<t_transfer> folderUploads;
+
+		// Remote directories to be synchronized next
+		std::vector<t_transfer> subdirs;
+
+		// Names of remote files
+		std::list<wxString> remoteDeletes;
+
+		// Full paths of local files and directories
+		std::list<wxString> localDeletes;
+
+		// Files of different size on both sides if synchronizing both ways.
+		// Neither side can be told to be right, they are left alone.
+		std::vector<t_transfer> conflicts;
+	};
+
+	explicit CSyncDecider(t_rules const& rules);
+
+	// Entries only existing on one side have an empty name on the other.
+	void PlanFile(t_plan& plan, CDirectoryComparison::result res, t_transfer const& local, t_transfer const& remote, CLocalPath const& localDir) const;
+	void PlanDirectory(t_plan& plan, CDirectoryComparison::result res, t_transfer const& local, t_transfer const& remote, CLocalPath const& localDir) const;
+
+	t_rules const& GetRules() const { return m_rules; }
+
+protected:
+	t_rules const m_rules;
+};
+
+#endif //__SYNC_DECIDER_H__
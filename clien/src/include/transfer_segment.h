@@ -0,0 +1,37 @@
+#ifndef __TRANSFER_SEGMENT_H__
+#define __TRANSFER_SEGMENT_H__
+
+struct sqlite3_stmt;
+
+// Large downloads can be split into segments, each transferred
+// by its own item over a separate connection.
+struct CTransferSegment final
+{
+	int64_t offset{}; // Position of the segment within the file
+	int64_t length{};
+	int64_t done{};   // Bytes at the start of the segment already written to the local file
+	int64_t current{}; // Progress of the running transfer, not yet accounted for in done
+	int index{};
+	int count{};
+	int64_t size{-1}; // Size of the whole file
+	bool failed{};     // Another segment of the file failed, the file stays incomplete
+
+	int64_t Remaining() const { return length - done; }
+};
+
+// A segment is stored in seven consecutive columns of the queue database:
+// offset, length, done, index, count, size of the whole file and failed.
+// The progress of the running transfer is not stored.
+namespace transfer_segment_columns {
+int const count = 7;
+}
+
+// Binds the segment to the parameters starting at the given index, all of
+// them to NULL if there is no segment.
+bool BindTransferSegment(sqlite3_stmt* statement, int first, CTransferSegment const* segment);
+
+// Reads the segment from the columns of the current row starting at the
+// given index. Returns false if the row holds no usable segment.
+bool ParseTransferSegment(sqlite3_stmt* statement, int first, CTransferSegment& segment);
+
+#endif //__TRANSFER_SEGMENT_H__
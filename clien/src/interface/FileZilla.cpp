@@ -267,6 +267,10 @@ bool CFileZillaApp::OnInit()
 
 	COptions::Init();
 
+	// Not part of the settings, so it cannot stay enabled by accident
+	if (m_pCommandLine && m_pCommandLine->HasSwitch(CCommandLine::simulate_io))
+		COptions::Get()->SetOption(OPTION_IO_SIMULATE, 1);
+
 	InitLocale();
 
 #ifndef _DEBUG
@@ -1385,7 +1385,7 @@ void CLocalListView::RefreshFile(const wxString& file)
 		if (IsComparing())
 		{
 			// Sort order doesn't change
-			RefreshComparison();
+			RefreshComparison(data.name, data.dir, data.size, data.time);
 		}
 		else
 		{
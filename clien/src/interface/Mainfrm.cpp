@@ -31,6 +31,7 @@
 #include "export.h"
 #include "import.h"
 #include "recursive_operation.h"
+#include "sync_planner.h"
 #include <wx/tokenzr.h>
 #include "edithandler.h"
 #include "inputdialog.h"
@@ -165,6 +166,9 @@ BEGIN_EVENT_TABLE(CMainFrame, wxNavigationEnabled<wxFrame>)
 	EVT_MENU(XRCID("ID_COMPARE_SIZE"), CMainFrame::OnDropdownComparisonMode)
 	EVT_MENU(XRCID("ID_COMPARE_DATE"), CMainFrame::OnDropdownComparisonMode)
 	EVT_MENU(XRCID("ID_COMPARE_HIDEIDENTICAL"), CMainFrame::OnDropdownComparisonHide)
+	EVT_MENU(XRCID("ID_SYNCHRONIZE_DOWNLOAD"), CMainFrame::OnSynchronize)
+	EVT_MENU(XRCID("ID_SYNCHRONIZE_UPLOAD"), CMainFrame::OnSynchronize)
+	EVT_MENU(XRCID("ID_SYNCHRONIZE_BOTH"), CMainFrame::OnSynchronize)
 	EVT_TOOL(XRCID("ID_TOOLBAR_SYNCHRONIZED_BROWSING"), CMainFrame::OnSyncBrowse)
 #ifdef __WXMAC__
 	EVT_CHILD_FOCUS(CMainFrame::OnChildFocused)
@@ -2343,6 +2347,66 @@ void CMainFrame::OnDropdownComparisonHide(wxCommandEvent& event)
 		pComparisonManager->CompareListings();
 }
 
+void CMainFrame::OnSynchronize(wxCommandEvent& event)
+{
+	CState* pState = CContextManager::Get()->GetCurrentContext();
+	if (!pState)
+		return;
+
+	const CServerPath remotePath = pState->GetRemotePath();
+	if (!pState->IsRemoteConnected() || remotePath.empty()) {
+		wxBell();
+		return;
+	}
+
+	if (!pState->IsRemoteIdle()) {
+		wxMessageBoxEx(_("Cannot synchronize directories while another remote operation is in progress."), _("Synchronize directories"), wxICON_EXCLAMATION);
+		return;
+	}
+
+	const CLocalPath localPath = pState->GetLocalDir();
+	if (!localPath.IsWriteable()) {
+		wxBell();
+		return;
+	}
+
+	// A file hidden on one side only would look like an orphan on the other
+	CFilterManager filter;
+	if (filter.HasActiveFilters() && !filter.HasSameLocalAndRemoteFilters()) {
+		wxMessageBoxEx(_("Cannot synchronize directories, different filters for local and remote directories are enabled"), _("Synchronize directories"), wxICON_EXCLAMATION);
+		return;
+	}
+
+	CSyncPlanner::t_rules rules;
+	if (event.GetId() == XRCID("ID_SYNCHRONIZE_DOWNLOAD"))
+		rules.dir = CSyncPlanner::direction::download;
+	else if (event.GetId() == XRCID("ID_SYNCHRONIZE_UPLOAD"))
+		rules.dir = CSyncPlanner::direction::upload;
+
+	// Same rules as the directory comparison
+	rules.compare_date = COptions::Get()->GetOptionVal(OPTION_COMPARISONMODE) != 0;
+	rules.threshold = wxTimeSpan::Minutes(COptions::Get()->GetOptionVal(OPTION_COMPARISON_THRESHOLD));
+
+	if (rules.dir != CSyncPlanner::direction::both) {
+		wxString msg;
+		if (rules.dir == CSyncPlanner::direction::download)
+			msg = wxString::Format(_("Also delete local files and directories that do not exist in '%s' on the server?"), remotePath.GetPath());
+		else
+			msg = wxString::Format(_("Also delete files on the server that do not exist in '%s'?"), localPath.GetPath());
+		const int res = wxMessageBoxEx(msg, _("Synchronize directories"), wxICON_QUESTION | wxYES_NO | wxCANCEL);
+		if (res == wxCANCEL)
+			return;
+		rules.delete_orphans = res == wxYES;
+	}
+
+	CRecursiveOperation* pRecursiveOperation = pState->GetRecursiveOperationHandler();
+	wxASSERT(pRecursiveOperation);
+
+	pRecursiveOperation->SetSyncPlanner(new CSyncPlanner(rules, filter.GetActiveFilters(true), filter.GetActiveFilters(false)));
+	pRecursiveOperation->AddDirectoryToVisit(remotePath, _T(""), localPath);
+	pRecursiveOperation->StartRecursiveOperation(CRecursiveOperation::recursive_synchronize, remotePath, filter.GetActiveFilters(false), true);
+}
+
 void CMainFrame::ProcessCommandLine()
 {
 	const CCommandLine* pCommandLine = wxGetApp().GetCommandLine();
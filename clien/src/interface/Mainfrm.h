@@ -70,6 +70,7 @@ public:
 	bool ConnectToSite(CSiteManagerItemData_Site & data, bool newTab = false);
 
 	CFileZillaEngineContext& GetEngineContext() { return m_engineContext; }
+	CAsyncRequestQueue* GetAsyncRequestQueue() { return m_pAsyncRequestQueue; }
 protected:
 	void FixTabOrder();
 
@@ -149,6 +150,7 @@ protected:
 	void OnToolbarComparisonDropdown(wxCommandEvent& event);
 	void OnDropdownComparisonMode(wxCommandEvent& event);
 	void OnDropdownComparisonHide(wxCommandEvent& event);
+	void OnSynchronize(wxCommandEvent& event);
 	void OnSyncBrowse(wxCommandEvent& event);
 #ifdef __WXMAC__
 	void OnChildFocused(wxChildFocusEvent& event);
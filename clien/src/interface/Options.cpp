@@ -95,6 +95,8 @@ static const t_Option options[OPTIONS_NUM] =
 	{ "FTP Proxy password", string, _T(""), normal },
 	{ "FTP Proxy login sequence", string, _T(""), normal },
 	{ "SFTP keyfiles", string, _T(""), normal },
+	{ "SFTP compression level", number, _T("0"), normal },
+	{ "SFTP connection sharing", number, _T("0"), normal },
 	{ "Proxy type", number, _T("0"), normal },
 	{ "Proxy host", string, _T(""), normal },
 	{ "Proxy port", number, _T("0"), normal },
@@ -106,6 +108,15 @@ static const t_Option options[OPTIONS_NUM] =
 	{ "Size format", number, _T("0"), normal },
 	{ "Size thousands separator", number, _T("1"), normal },
 	{ "Size decimal places", number, _T("1"), normal },
+	{ "Directory cache size limit", number, _T("64"), normal },
+	{ "Persistent directory cache", number, _T("0"), normal },
+	{ "Directory cache file", string, _T(""), internal },
+	{ "IO buffer count", number, _T("16"), normal },
+	{ "IO buffer size", number, _T("1024"), normal },
+	{ "Direct IO threshold", number, _T("0"), normal },
+	{ "Simulate file IO", number, _T("0"), internal },
+	{ "Speedlimit per transfer inbound", number, _T("0"), normal },
+	{ "Speedlimit per transfer outbound", number, _T("0"), normal },
 
 	// Interface settings
 	{ "Number of Transfers", number, _T("2"), normal },
@@ -189,6 +200,10 @@ static const t_Option options[OPTIONS_NUM] =
 	{ "Show Site Manager on startup", number, _T("0"), normal },
 	{ "Prompt password change", number, _T("0"), normal },
 	{ "Persistent Choices", number, _T("0"), normal },
+	{ "Download segments", number, _T("1"), normal },
+	{ "Download segment threshold", number, _T("256"), normal },
+	{ "Recursive listing connections", number, _T("0"), normal },
+	{ "Folder scan threads", number, _T("4"), normal },
 
 	// Default/internal options
 	{ "Config Location", string, _T(""), default_only },
@@ -456,6 +471,8 @@ int COptions::Validate(unsigned int nID, int value)
 		break;
 	case OPTION_SPEEDLIMIT_INBOUND:
 	case OPTION_SPEEDLIMIT_OUTBOUND:
+	case OPTION_SPEEDLIMIT_TRANSFER_INBOUND:
+	case OPTION_SPEEDLIMIT_TRANSFER_OUTBOUND:
 		if (value < 0)
 			value = 0;
 		break;
@@ -463,11 +480,31 @@ int COptions::Validate(unsigned int nID, int value)
 		if (value < 0 || value > 2)
 			value = 0;
 		break;
+	case OPTION_SFTP_COMPRESSION:
+		if (value < 0 || value > 9)
+			value = 0;
+		break;
 	case OPTION_FILELIST_DIRSORT:
 	case OPTION_FILELIST_NAMESORT:
 		if (value < 0 || value > 2)
 			value = 0;
 		break;
+	case OPTION_DOWNLOAD_SEGMENTS:
+		if (value < 1 || value > 10)
+			value = 1;
+		break;
+	case OPTION_DOWNLOAD_SEGMENT_THRESHOLD:
+		if (value < 1)
+			value = 256;
+		break;
+	case OPTION_RECURSIVE_LISTING_CONNECTIONS:
+		if (value < 0 || value > 10)
+			value = 0;
+		break;
+	case OPTION_FOLDERSCAN_THREADS:
+		if (value < 1 || value > 32)
+			value = 4;
+		break;
 	case OPTION_SOCKET_BUFFERSIZE_RECV:
 		if (value != -1 && (value < 4096 || value > 4096 * 1024))
 			value = -1;
@@ -488,6 +525,22 @@ int COptions::Validate(unsigned int nID, int value)
 		if (value < 0 || value > 3)
 			value = 0;
 		break;
+	case OPTION_CACHE_SIZE_LIMIT:
+		if (value < 1 || value > 4096)
+			value = 64;
+		break;
+	case OPTION_IO_BUFFER_COUNT:
+		if (value < 2 || value > 64)
+			value = 16;
+		break;
+	case OPTION_IO_BUFFER_SIZE:
+		if (value < 64 || value > 16384)
+			value = 1024;
+		break;
+	case OPTION_IO_DIRECT_THRESHOLD:
+		if (value < 0)
+			value = 0;
+		break;
 	case OPTION_MESSAGELOG_POSITION:
 		if (value < 0 || value > 2)
 			value = 0;
@@ -863,6 +916,9 @@ CLocalPath COptions::InitSettingsDir()
 		wxFileName::Mkdir( p.GetPath(), 0700, wxPATH_MKDIR_FULL );
 
 	SetOption(OPTION_DEFAULT_SETTINGSDIR, p.GetPath());
+	if (!p.empty()) {
+		SetOption(OPTION_CACHE_FILE, p.GetPath() + _T("dircache.dat"));
+	}
 
 	return p;
 }
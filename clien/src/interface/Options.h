@@ -92,6 +92,10 @@ enum interfaceOptions
 	OPTION_INTERFACE_SITEMANAGER_ON_STARTUP,
 	OPTION_PROMPTPASSWORDSAVE,
 	OPTION_PERSISTENT_CHOICES,
+	OPTION_DOWNLOAD_SEGMENTS,
+	OPTION_DOWNLOAD_SEGMENT_THRESHOLD,
+	OPTION_RECURSIVE_LISTING_CONNECTIONS,
+	OPTION_FOLDERSCAN_THREADS,
 
 	// Default/internal options
 	OPTION_DEFAULT_SETTINGSDIR, // guaranteed to be (back)slash-terminated
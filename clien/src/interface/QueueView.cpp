@@ -27,6 +27,10 @@
 #include "auto_ascii_files.h"
 #include "dragdropmanager.h"
 #include "drop_target_ex.h"
+
+#include <atomic>
+#include <deque>
+
 #if WITH_LIBDBUS
 #include "../dbus/desktop_notification.h"
 #endif
@@ -173,6 +177,15 @@ DEFINE_EVENT_TYPE(fzEVT_FOLDERTHREAD_FILES)
 DECLARE_EVENT_TYPE(fzEVT_ASKFORPASSWORD, -1)
 DEFINE_EVENT_TYPE(fzEVT_ASKFORPASSWORD)
 
+namespace {
+// Number of files loaded at once from the saved queue
+int const stored_files_page_size = 1000;
+
+// Scanned entries not yet passed on to the queue. Scanning ahead stops
+// beyond this, except for the directory the queue is waiting for.
+size_t const folder_scan_ahead_entries = 100000;
+}
+
 BEGIN_EVENT_TABLE(CQueueView, CQueueViewBase)
 EVT_FZ_NOTIFICATION(wxID_ANY, CQueueView::OnEngineEvent)
 EVT_COMMAND(wxID_ANY, fzEVT_FOLDERTHREAD_COMPLETE, CQueueView::OnFolderThreadComplete)
@@ -211,11 +224,64 @@ END_EVENT_TABLE()
 
 class CFolderProcessingThread final : public wxThread
 {
-	struct t_internalDirPair
+	// A directory found during the scan. Directories get scanned in parallel,
+	// but are passed on to the queue in the order a sequential scan visits them.
+	struct t_scanDir
 	{
+		t_scanDir() = default;
+		t_scanDir(t_scanDir const&) = delete;
+		t_scanDir& operator=(t_scanDir const&) = delete;
+
+		~t_scanDir()
+		{
+			for (auto entry : entries)
+				delete entry;
+		}
+
 		CLocalPath localPath;
 		CServerPath remotePath;
+
+		enum {
+			pending,
+			scanning,
+			scanned
+		} state{pending};
+
+		bool opened{};
+
+		// Entries passing the filters in enumeration order, including directories
+		std::vector<t_newEntry*> entries;
+		std::vector<std::unique_ptr<t_scanDir>> subdirs;
+
+		// Position in m_scanQueue while pending
+		std::list<t_scanDir*>::iterator queued;
+	};
+
+	class CWorker final : public wxThread
+	{
+	public:
+		CWorker(CFolderProcessingThread& owner)
+			: wxThread(wxTHREAD_JOINABLE)
+			, m_owner(owner)
+		{
+		}
+
+	protected:
+		friend class CFolderProcessingThread;
+
+		// Guarded by m_owner.m_scanSync
+		condition m_condition;
+		bool m_waiting{};
+
+		ExitCode Entry()
+		{
+			m_owner.ScanDirectories(*this);
+			return 0;
+		}
+
+		CFolderProcessingThread& m_owner;
 	};
+
 public:
 	CFolderProcessingThread(CQueueView* pOwner, CFolderScanItem* pFolderItem)
 		: wxThread(wxTHREAD_JOINABLE) {
@@ -227,18 +293,29 @@ public:
 		m_throttleWait = false;
 		m_processing_entries = false;
 
-		t_internalDirPair* pair = new t_internalDirPair;
-		pair->localPath = pFolderItem->GetLocalPath();
-		pair->remotePath = pFolderItem->GetRemotePath();
-		m_dirsToCheck.push_back(pair);
+		std::unique_ptr<t_scanDir> dir(new t_scanDir);
+		dir->localPath = pFolderItem->GetLocalPath();
+		dir->remotePath = pFolderItem->GetRemotePath();
+		m_scanQueue.push_back(dir.get());
+		dir->queued = m_scanQueue.begin();
+		m_order.push_back(std::move(dir));
+
+		// Filtering happens during the scan so that the workers know which
+		// directories to descend into. All threads share the compiled filters.
+		m_filters = CFilterManager::GetActiveFilters(true);
+
+		int const threads = COptions::Get()->GetOptionVal(OPTION_FOLDERSCAN_THREADS);
+		for (int i = 1; i < threads; ++i)
+			m_workers.push_back(new CWorker(*this));
 	}
 
 	virtual ~CFolderProcessingThread()
 	{
+		// Workers have been joined in Entry, unless the thread never ran
+		for (auto worker : m_workers)
+			delete worker;
 		for (auto iter = m_entryList.begin(); iter != m_entryList.end(); ++iter)
 			delete *iter;
-		for (auto iter = m_dirsToCheck.begin(); iter != m_dirsToCheck.end(); ++iter)
-			delete *iter;
 	}
 
 	void GetFiles(std::list<CFolderProcessingEntry*> &entryList)
@@ -264,28 +341,6 @@ public:
 		CServerPath remotePath;
 	};
 
-	void ProcessDirectory(const CLocalPath& localPath, CServerPath const& remotePath, const wxString& name)
-	{
-		scoped_lock locker(m_sync);
-
-		t_internalDirPair* pair = new t_internalDirPair;
-
-		{
-			pair->localPath = localPath;
-			pair->localPath.AddSegment(name);
-
-			pair->remotePath = remotePath;
-			pair->remotePath.AddSegment(name);
-		}
-
-		m_dirsToCheck.push_back(pair);
-
-		if (m_threadWaiting) {
-			m_threadWaiting = false;
-			m_condition.signal(locker);
-		}
-	}
-
 	void CheckFinished()
 	{
 		scoped_lock locker(m_sync);
@@ -293,7 +348,7 @@ public:
 
 		m_processing_entries = false;
 
-		if (m_threadWaiting && (!m_dirsToCheck.empty() || m_entryList.empty())) {
+		if (m_threadWaiting) {
 			m_threadWaiting = false;
 			m_condition.signal(locker);
 		}
@@ -351,70 +406,215 @@ protected:
 
 		wxASSERT(!m_pFolderItem->Download());
 
+		for (auto iter = m_workers.begin(); iter != m_workers.end(); ) {
+			CWorker* worker = *iter;
+			if (worker->Create() != wxTHREAD_NO_ERROR || worker->Run() != wxTHREAD_NO_ERROR) {
+				// Fewer threads just mean a slower scan
+				delete worker;
+				iter = m_workers.erase(iter);
+			}
+			else
+				++iter;
+		}
+
+		bool const complete = PassOnDirectories();
+
+		{
+			scoped_lock l(m_scanSync);
+			m_quit = true;
+			WakeWorkers(l);
+		}
+		for (auto worker : m_workers) {
+			worker->Wait(wxTHREAD_WAIT_BLOCK);
+			delete worker;
+		}
+		m_workers.clear();
+
+		while (complete && !TestDestroy() && !m_pFolderItem->m_remove) {
+			scoped_lock l(m_sync);
+			if (!m_didSendEvent && !m_entryList.empty()) {
+				m_didSendEvent = true;
+				l.unlock();
+				m_pOwner->QueueEvent(new wxCommandEvent(fzEVT_FOLDERTHREAD_FILES, wxID_ANY));
+				continue;
+			}
+
+			if (!m_didSendEvent && !m_processing_entries) {
+				break;
+			}
+			m_threadWaiting = true;
+			m_condition.wait(l);
+		}
+
+		m_pOwner->QueueEvent(new wxCommandEvent(fzEVT_FOLDERTHREAD_COMPLETE, wxID_ANY));
+		return 0;
+	}
+
+	// Passes scanned directories on in order. The thread scans the next
+	// directory itself if no worker has picked it up yet.
+	// Returns false if the scan got aborted.
+	bool PassOnDirectories()
+	{
 		CLocalFileSystem localFileSystem;
 
 		while (!TestDestroy() && !m_pFolderItem->m_remove) {
-			scoped_lock l(m_sync);
-			if (m_dirsToCheck.empty()) {
-				if (!m_didSendEvent && !m_entryList.empty()) {
-					m_didSendEvent = true;
-					l.unlock();
-					m_pOwner->QueueEvent(new wxCommandEvent(fzEVT_FOLDERTHREAD_FILES, wxID_ANY));
-					continue;
-				}
+			scoped_lock l(m_scanSync);
+			if (m_order.empty())
+				return true;
 
-				if (!m_didSendEvent && !m_processing_entries) {
-					break;
-				}
-				m_threadWaiting = true;
-				m_condition.wait(l);
-				if (m_dirsToCheck.empty()) {
-					break;
-				}
+			t_scanDir& front = *m_order.front();
+			if (front.state == t_scanDir::pending) {
+				TakeDirectory(front);
+				l.unlock();
+				ScanDirectory(front, localFileSystem);
+				l.lock();
+				FinishDirectory(l, front);
+			}
+			else if (front.state == t_scanDir::scanning) {
+				m_waitingForScan = true;
+				m_scanCondition.wait(l);
 				continue;
 			}
 
-			const t_internalDirPair *pair = m_dirsToCheck.front();
-			m_dirsToCheck.pop_front();
+			std::unique_ptr<t_scanDir> dir = std::move(m_order.front());
+			m_order.pop_front();
+			for (auto & subdir : dir->subdirs)
+				m_order.push_back(std::move(subdir));
+			dir->subdirs.clear();
 
+			m_buffered -= dir->entries.size();
+			WakeWorkers(l);
 			l.unlock();
 
-			if (!localFileSystem.BeginFindFiles(pair->localPath.GetPath(), false)) {
-				delete pair;
+			if (!dir->opened)
+				continue;
+
+			t_dirPair* pair = new t_dirPair;
+			pair->localPath = dir->localPath;
+			pair->remotePath = dir->remotePath;
+			AddEntry(pair);
+
+			for (auto entry : dir->entries)
+				AddEntry(entry);
+			dir->entries.clear();
+		}
+
+		return false;
+	}
+
+	void ScanDirectories(CWorker& worker)
+	{
+		CLocalFileSystem localFileSystem;
+
+		scoped_lock l(m_scanSync);
+		while (!m_quit) {
+			t_scanDir* dir = NextDirectory();
+			if (!dir) {
+				worker.m_waiting = true;
+				worker.m_condition.wait(l);
 				continue;
 			}
 
-			t_dirPair* pair2 = new t_dirPair;
-			pair2->localPath = pair->localPath;
-			pair2->remotePath = pair->remotePath;
-			AddEntry(pair2);
+			TakeDirectory(*dir);
+			l.unlock();
+			ScanDirectory(*dir, localFileSystem);
+			l.lock();
+			FinishDirectory(l, *dir);
+		}
+	}
+
+	// Directories get scanned in the order they have been found. Beyond the
+	// scan-ahead limit only the one holding up the queue gets scanned.
+	t_scanDir* NextDirectory()
+	{
+		if (m_buffered >= folder_scan_ahead_entries) {
+			if (!m_order.empty() && m_order.front()->state == t_scanDir::pending)
+				return m_order.front().get();
+			return 0;
+		}
 
-			t_newEntry* entry = new t_newEntry;
+		if (m_scanQueue.empty())
+			return 0;
 
-			wxString name;
-			bool is_link;
-			bool is_dir;
-			while (localFileSystem.GetNextFile(name, is_link, is_dir, &entry->size, &entry->time, &entry->attributes)) {
-				if (is_link)
-					continue;
+		return m_scanQueue.front();
+	}
 
-				entry->name = name;
-				entry->dir = is_dir;
+	void TakeDirectory(t_scanDir& dir)
+	{
+		wxASSERT(dir.state == t_scanDir::pending);
+		m_scanQueue.erase(dir.queued);
+		dir.state = t_scanDir::scanning;
+	}
 
-				AddEntry(entry);
+	void FinishDirectory(scoped_lock& l, t_scanDir& dir)
+	{
+		dir.state = t_scanDir::scanned;
+		m_buffered += dir.entries.size();
 
-				entry = new t_newEntry;
-			}
-			delete entry;
+		for (auto const& subdir : dir.subdirs) {
+			m_scanQueue.push_back(subdir.get());
+			subdir->queued = --m_scanQueue.end();
+		}
+		if (!dir.subdirs.empty())
+			WakeWorkers(l);
 
-			delete pair;
+		if (m_waitingForScan && !m_order.empty() && m_order.front().get() == &dir) {
+			m_waitingForScan = false;
+			m_scanCondition.signal(l);
 		}
+	}
 
-		m_pOwner->QueueEvent(new wxCommandEvent(fzEVT_FOLDERTHREAD_COMPLETE, wxID_ANY));
-		return 0;
+	void WakeWorkers(scoped_lock& l)
+	{
+		for (auto worker : m_workers) {
+			if (worker->m_waiting) {
+				worker->m_waiting = false;
+				worker->m_condition.signal(l);
+			}
+		}
 	}
 
-	std::list<t_internalDirPair*> m_dirsToCheck;
+	// Called without holding m_scanSync, the directory is owned by the calling
+	// thread while scanning.
+	void ScanDirectory(t_scanDir& dir, CLocalFileSystem& localFileSystem)
+	{
+		if (!localFileSystem.BeginFindFiles(dir.localPath.GetPath(), false))
+			return;
+
+		dir.opened = true;
+
+		wxString const path = dir.localPath.GetPath();
+
+		t_newEntry* entry = new t_newEntry;
+
+		wxString name;
+		bool is_link;
+		bool is_dir;
+		while (!m_quit && localFileSystem.GetNextFile(name, is_link, is_dir, &entry->size, &entry->time, &entry->attributes)) {
+			if (is_link)
+				continue;
+
+			if (m_filters->Filtered(name, path, is_dir, entry->size, entry->attributes, entry->time))
+				continue;
+
+			entry->name = name;
+			entry->dir = is_dir;
+
+			if (is_dir) {
+				std::unique_ptr<t_scanDir> subdir(new t_scanDir);
+				subdir->localPath = dir.localPath;
+				subdir->localPath.AddSegment(name);
+				subdir->remotePath = dir.remotePath;
+				subdir->remotePath.AddSegment(name);
+				dir.subdirs.push_back(std::move(subdir));
+			}
+
+			dir.entries.push_back(entry);
+
+			entry = new t_newEntry;
+		}
+		delete entry;
+	}
 
 	// Access has to be guarded by m_sync
 	std::list<CFolderProcessingEntry*> m_entryList;
@@ -428,6 +628,27 @@ protected:
 	bool m_throttleWait;
 	bool m_didSendEvent;
 	bool m_processing_entries;
+
+	// Shared by this thread and the workers
+	std::shared_ptr<CFilterMatcher const> m_filters;
+
+	// Scanning state, guarded by m_scanSync
+	mutex m_scanSync;
+	condition m_scanCondition;
+	bool m_waitingForScan{};
+	std::atomic<bool> m_quit{};
+
+	// In the order the directories are passed on. A directory's subdirectories
+	// get appended once it has been passed on, so this is breadth-first just
+	// like a sequential scan.
+	std::deque<std::unique_ptr<t_scanDir>> m_order;
+
+	// Pending directories in the order they have been found
+	std::list<t_scanDir*> m_scanQueue;
+
+	size_t m_buffered{};
+
+	std::vector<CWorker*> m_workers;
 };
 
 CQueueView::CQueueView(CQueue* parent, int index, CMainFrame* pMainFrame, CAsyncRequestQueue *pAsyncRequestQueue)
@@ -496,7 +717,7 @@ bool CQueueView::QueueFile(const bool queueOnly, const bool download,
 						   const wxString& sourceFile, const wxString& targetFile,
 						   const CLocalPath& localPath, const CServerPath& remotePath,
 						   const CServer& server, const wxLongLong size, enum CEditHandler::fileType edit,
-						   QueuePriority priority)
+						   QueuePriority priority, CFileExistsNotification::OverwriteAction defaultFileExistsAction)
 {
 	CServerItem* pServerItem = CreateServerItem(server);
 
@@ -523,6 +744,7 @@ bool CQueueView::QueueFile(const bool queueOnly, const bool download,
 		fileItem->m_edit = edit;
 		if (edit != CEditHandler::none)
 			fileItem->m_onetime_action = CFileExistsNotification::overwrite;
+		fileItem->m_defaultFileExistsAction = defaultFileExistsAction;
 	}
 
 	fileItem->SetPriorityRaw(priority);
@@ -681,6 +903,10 @@ void CQueueView::ProcessNotification(t_EngineData* pEngineData, std::unique_ptr<
 				{
 					CFileItem* pItem = (CFileItem*)pEngineData->pItem;
 					pItem->set_made_progress(true);
+
+					auto& segment = pItem->GetSegment();
+					if (segment && status.currentOffset > 0)
+						segment->current = status.currentOffset;
 				}
 				pEngineData->pStatusLineCtrl->SetTransferStatus(status);
 			}
@@ -804,6 +1030,22 @@ bool CQueueView::TryStartNextTransfer()
 		t_EngineData* pEngineData = 0;
 		CServerItem* currentServerItem = *iter;
 
+		// Cheap check first, finding the idle child takes constant time.
+		// Servers with nothing better to transfer than the current best match
+		// are skipped before looking for an engine.
+		CFileItem* peekItem = currentServerItem->GetIdleChild(m_activeMode == 1, wantedDirection);
+		if (!peekItem && m_activeMode == 2 && StoredFilesInNextPage(*currentServerItem, wantedDirection)) {
+			// Load no more than a page, and only if a transfer can be started
+			if (!CanStartTransfer(*currentServerItem, pEngineData))
+				continue;
+			LoadStoredFiles(*currentServerItem);
+			peekItem = currentServerItem->GetIdleChild(false, wantedDirection);
+		}
+		if (!peekItem)
+			continue;
+		if (bestMatch.fileItem && peekItem->GetPriority() <= bestMatch.fileItem->GetPriority())
+			continue;
+
 		if (!CanStartTransfer(*currentServerItem, pEngineData))
 			continue;
 
@@ -854,6 +1096,9 @@ bool CQueueView::TryStartNextTransfer()
 			return false;
 	}
 
+	if (bestMatch.fileItem->GetType() == QueueItemType::File)
+		SplitIntoSegments(*bestMatch.serverItem, *bestMatch.fileItem);
+
 	// Now we have both inactive engine and file.
 	// Assign the file to the engine.
 
@@ -929,6 +1174,197 @@ bool CQueueView::TryStartNextTransfer()
 	return true;
 }
 
+void CQueueView::SplitIntoSegments(CServerItem& serverItem, CFileItem& fileItem)
+{
+	if (!fileItem.Download() || fileItem.Ascii() || fileItem.GetSegment() || fileItem.m_edit != CEditHandler::none)
+		return;
+
+	CServer const& server = serverItem.GetServer();
+	switch (server.GetProtocol())
+	{
+	case FTP:
+	case FTPS:
+	case FTPES:
+	case INSECURE_FTP:
+	case SFTP:
+		break;
+	default:
+		return;
+	}
+
+	int count = COptions::Get()->GetOptionVal(OPTION_DOWNLOAD_SEGMENTS);
+	count = std::min(count, COptions::Get()->GetOptionVal(OPTION_NUMTRANSFERS));
+	if (server.MaximumMultipleConnections())
+		count = std::min(count, server.MaximumMultipleConnections());
+	if (count < 2)
+		return;
+
+	int64_t const size = fileItem.GetSize().GetValue();
+	int64_t const threshold = static_cast<int64_t>(COptions::Get()->GetOptionVal(OPTION_DOWNLOAD_SEGMENT_THRESHOLD)) * 1024 * 1024;
+	if (size < threshold || size < count)
+		return;
+
+	// Existing files go through the usual overwrite/resume handling
+	if (wxFileName::FileExists(fileItem.GetLocalPath().GetPath() + fileItem.GetLocalFile()))
+		return;
+
+	// Keep segment boundaries aligned, the local file gets written at these offsets
+	int64_t const alignment = 1024 * 1024;
+	int64_t length = (size + count - 1) / count;
+	length = (length + alignment - 1) / alignment * alignment;
+	count = static_cast<int>((size + length - 1) / length);
+	if (count < 2)
+		return;
+
+	// Store the rows of all segments next to each other, the segments
+	// of a file get loaded together. UpdateItemSize stores the item again.
+	m_queue_storage.RemoveFile(fileItem);
+
+	CFileItem::t_segment segment;
+	segment.length = length;
+	segment.count = count;
+	segment.size = size;
+	fileItem.SetSegment(segment);
+	UpdateItemSize(&fileItem, length);
+
+	wxString const file = fileItem.GetLocalPath().GetPath() + fileItem.GetLocalFile();
+	m_segmentedFiles.erase(file);
+	AddSegment(serverItem, fileItem);
+
+	std::vector<CFileItem*> segmentItems;
+	for (int i = 1; i < count; ++i) {
+		segment.index = i;
+		segment.offset = length * i;
+		segment.length = std::min(length, size - segment.offset);
+
+		CFileItem* item = new CFileItem(&serverItem, fileItem.queued(), true,
+			fileItem.GetSourceFile(), fileItem.GetTargetFile(),
+			fileItem.GetLocalPath(), fileItem.GetRemotePath(), segment.length);
+		item->SetPriorityRaw(fileItem.GetPriority());
+		item->m_defaultFileExistsAction = fileItem.m_defaultFileExistsAction;
+		item->SetSegment(segment);
+		InsertItem(&serverItem, item);
+		segmentItems.push_back(item);
+	}
+
+	// Start the other segments next rather than after the remaining queue
+	for (auto iter = segmentItems.rbegin(); iter != segmentItems.rend(); ++iter)
+		serverItem.QueueFirst(*iter);
+
+	CommitChanges();
+}
+
+void CQueueView::AddSegment(CServerItem& serverItem, CFileItem& item)
+{
+	auto& segment = item.GetSegment();
+	wxString const file = item.GetLocalPath().GetPath() + item.GetLocalFile();
+
+	auto it = m_segmentedFiles.find(file);
+	if (it == m_segmentedFiles.end()) {
+		it = m_segmentedFiles.emplace(file, t_segmentedFile()).first;
+
+		// The failed segments of a previous session are gone
+		if (segment->failed)
+			it->second.failed.insert(-1);
+	}
+
+	t_segmentedFile& segmentedFile = it->second;
+	segmentedFile.pending.insert(segment->index);
+	if (segmentedFile.failed.erase(segment->index) && segmentedFile.failed.empty())
+		FlagFailedSegments(serverItem, file, false);
+	else if (segment->failed != !segmentedFile.failed.empty()) {
+		segment->failed = !segmentedFile.failed.empty();
+		serverItem.StoreChild(item);
+	}
+}
+
+void CQueueView::RemoveSegment(CFileItem const& item)
+{
+	auto const& segment = item.GetSegment();
+	wxString const file = item.GetLocalPath().GetPath() + item.GetLocalFile();
+
+	auto it = m_segmentedFiles.find(file);
+	if (it == m_segmentedFiles.end() || !it->second.pending.erase(segment->index))
+		return;
+
+	// Failed or removed before it got transferred
+	bool const first = it->second.failed.empty();
+	it->second.failed.insert(segment->index);
+	if (first)
+		FlagFailedSegments(*static_cast<CServerItem*>(item.GetTopLevelItem()), file, true);
+}
+
+void CQueueView::FlagFailedSegments(CServerItem& serverItem, wxString const& file, bool failed)
+{
+	// Kept in the queue, the file stays incomplete even after a restart
+	CQueueItem* pItem;
+	for (unsigned int i = 0; (pItem = serverItem.GetChild(i, false)); ++i) {
+		if (pItem->GetType() != QueueItemType::File)
+			continue;
+
+		CFileItem* pFileItem = static_cast<CFileItem*>(pItem);
+		auto& segment = pFileItem->GetSegment();
+		if (!segment || segment->failed == failed)
+			continue;
+		if (pFileItem->GetLocalPath().GetPath() + pFileItem->GetLocalFile() != file)
+			continue;
+
+		segment->failed = failed;
+		serverItem.StoreChild(*pFileItem);
+	}
+}
+
+CQueueView::ResetReason CQueueView::FinishSegment(CFileItem& item)
+{
+	auto& segment = item.GetSegment();
+	wxString const file = item.GetLocalPath().GetPath() + item.GetLocalFile();
+
+	auto it = m_segmentedFiles.find(file);
+	if (it == m_segmentedFiles.end())
+		return success;
+
+	t_segmentedFile& segmentedFile = it->second;
+	segmentedFile.pending.erase(segment->index);
+
+	// Only the last segment reports the file
+	if (!segmentedFile.pending.empty())
+		return remove;
+
+	if (segmentedFile.failed.empty()) {
+		if (segment->size < 0 || CLocalFileSystem::GetSize(file) == segment->size) {
+			m_segmentedFiles.erase(it);
+			return success;
+		}
+
+		// Something else changed the file, transfer the segment again if requeued
+		segment->done = 0;
+	}
+
+	// Moving it to the failed transfers keeps the file incomplete
+	segmentedFile.pending.insert(segment->index);
+	item.SetStatusMessage(CFileItem::incomplete);
+	return failure;
+}
+
+namespace {
+// Accounts the progress of the last transfer command of a segment
+void CommitSegmentProgress(CFileItem& item)
+{
+	auto& segment = item.GetSegment();
+	if (segment) {
+		segment->done = std::min(segment->length, segment->done + segment->current);
+		segment->current = 0;
+	}
+}
+
+// Whether the rows of further segments of the file follow in the storage
+bool SegmentsFollow(CFileItem const& item)
+{
+	auto const& segment = item.GetSegment();
+	return segment && segment->index + 1 < segment->count;
+}
+}
+
 void CQueueView::ProcessReply(t_EngineData* pEngineData, COperationNotification const& notification)
 {
 	if (notification.nReplyCode & FZ_REPLY_DISCONNECTED &&
@@ -1021,6 +1457,7 @@ void CQueueView::ProcessReply(t_EngineData* pEngineData, COperationNotification
 			ResetEngine(*pEngineData, reset);
 			return;
 		}
+		CommitSegmentProgress(*pEngineData->pItem);
 		if (replyCode == FZ_REPLY_OK) {
 			ResetEngine(*pEngineData, success);
 			return;
@@ -1124,7 +1561,7 @@ void CQueueView::ProcessReply(t_EngineData* pEngineData, COperationNotification
 	SendNextCommand(*pEngineData);
 }
 
-void CQueueView::ResetEngine(t_EngineData& data, const enum ResetReason reason)
+void CQueueView::ResetEngine(t_EngineData& data, enum ResetReason reason)
 {
 	if (!data.active)
 		return;
@@ -1157,6 +1594,9 @@ void CQueueView::ResetEngine(t_EngineData& data, const enum ResetReason reason)
 			SaveSetItemCount(m_itemCount);
 
 			CFileItem* const pFileItem = (CFileItem*)data.pItem;
+			CommitSegmentProgress(*pFileItem);
+			if (reason == success && pFileItem->GetSegment())
+				reason = FinishSegment(*pFileItem);
 			if (pFileItem->Download()) {
 				const std::vector<CState*> *pStates = CContextManager::Get()->GetAllStates();
 				for (std::vector<CState*>::const_iterator iter = pStates->begin(); iter != pStates->end(); ++iter)
@@ -1198,8 +1638,10 @@ void CQueueView::ResetEngine(t_EngineData& data, const enum ResetReason reason)
 		}
 
 		if (reason == reset) {
+			CServerItem* pServerItem = static_cast<CServerItem*>(data.pItem->GetTopLevelItem());
 			if (!data.pItem->queued())
-				static_cast<CServerItem*>(data.pItem->GetTopLevelItem())->QueueImmediateFile(data.pItem);
+				pServerItem->QueueImmediateFile(data.pItem);
+			pServerItem->StoreChild(*data.pItem);
 		}
 		else if (reason == failure) {
 			if (data.pItem->GetType() == QueueItemType::File || data.pItem->GetType() == QueueItemType::Folder) {
@@ -1237,6 +1679,8 @@ void CQueueView::ResetEngine(t_EngineData& data, const enum ResetReason reason)
 				RemoveItem(data.pItem, true);
 		}
 		else if (reason == retry) {
+			// Error count and progress of segments
+			static_cast<CServerItem*>(data.pItem->GetTopLevelItem())->StoreChild(*data.pItem);
 		}
 		else
 			RemoveItem(data.pItem, true);
@@ -1289,8 +1733,16 @@ bool CQueueView::RemoveItem(CQueueItem* item, bool destroy, bool updateItemCount
 				DisplayQueueSize();
 			wxASSERT(m_totalQueueSize >= 0);
 		}
+
+		if (pFileItem->GetSegment())
+			RemoveSegment(*pFileItem);
 	}
 
+	// Keep the server if it has files which are not loaded yet
+	CServerItem* pServerItem = static_cast<CServerItem*>(item->GetTopLevelItem());
+	if (item->GetParent() == pServerItem && !pServerItem->m_storedFiles.empty() && !pServerItem->GetChild(1, false))
+		LoadStoredFiles(*pServerItem);
+
 	bool didRemoveParent = CQueueViewBase::RemoveItem(item, destroy, updateItemCount, updateSelections);
 
 	UpdateStatusLinePositions();
@@ -1392,6 +1844,17 @@ void CQueueView::SendNextCommand(t_EngineData& engineData)
 
 			CFileTransferCommand::t_transferSettings transferSettings;
 			transferSettings.binary = !fileItem->Ascii();
+
+			auto& segment = fileItem->GetSegment();
+			if (segment) {
+				if (segment->Remaining() <= 0) {
+					ResetEngine(engineData, success);
+					return;
+				}
+				segment->current = 0;
+				transferSettings.rangeOffset = segment->offset + segment->done;
+				transferSettings.rangeLength = segment->Remaining();
+			}
 			int res = engineData.pEngine->Execute(CFileTransferCommand(fileItem->GetLocalPath().GetPath() + fileItem->GetLocalFile(), fileItem->GetRemotePath(),
 												fileItem->GetRemoteFile(), fileItem->Download(), transferSettings));
 			wxASSERT((res & FZ_REPLY_BUSY) != FZ_REPLY_BUSY);
@@ -1765,7 +2228,6 @@ int CQueueView::QueueFiles(const std::list<CFolderProcessingEntry*> &entryList,
 
 	int added = 0;
 
-	CFilterManager filters;
 	for (std::list<CFolderProcessingEntry*>::const_iterator iter = entryList.begin(); iter != entryList.end(); ++iter)
 	{
 		const CFolderProcessingEntry* entry = *iter;
@@ -1783,16 +2245,12 @@ int CQueueView::QueueFiles(const std::list<CFolderProcessingEntry*> &entryList,
 			delete entry;
 		}
 		else {
+			// Already filtered by the scan, which also descends into directories
 			const t_newEntry* entry = (const t_newEntry*)*iter;
-			if (filters.FilenameFiltered(entry->name, pFolderScanItem->m_current_local_path.GetPath(), entry->dir, entry->size, true, entry->attributes, entry->time)) {
-				delete entry;
-				continue;
-			}
 
 			pFolderScanItem->m_dir_is_empty = false;
 
 			if (entry->dir) {
-				m_pFolderProcessingThread->ProcessDirectory(pFolderScanItem->m_current_local_path, pFolderScanItem->m_current_remote_path, entry->name);
 				delete entry;
 				continue;
 			}
@@ -1819,6 +2277,15 @@ int CQueueView::QueueFiles(const std::list<CFolderProcessingEntry*> &entryList,
 	return added;
 }
 
+CServerItem* CQueueView::CreateServerItem(const CServer& server)
+{
+	CServerItem* pItem = CQueueViewBase::CreateServerItem(server);
+	if (m_queue_storage.JournalActive())
+		pItem->SetStorage(&m_queue_storage);
+
+	return pItem;
+}
+
 void CQueueView::SaveQueue()
 {
 	// Kiosk mode 2 doesn't save queue
@@ -1829,6 +2296,14 @@ void CQueueView::SaveQueue()
 	// just as extra precaution. Better 'save' than sorry.
 	CInterProcessMutex mutex(MUTEX_QUEUE);
 
+	// Everything has been written already unless the journal failed
+	if (m_queue_storage.JournalActive() && m_queue_storage.StopJournal())
+		return;
+
+	// Saving the whole queue replaces the rows of the files not loaded yet
+	for (auto const& pServerItem : m_serverList)
+		LoadStoredFiles(*pServerItem, true);
+
 	if (!m_queue_storage.SaveQueue(m_serverList))
 	{
 		wxString msg = wxString::Format(_("An error occurred saving the transfer queue to \"%s\".\nSome queue items might not have been saved."), m_queue_storage.GetDatabaseFilename());
@@ -1875,6 +2350,11 @@ void CQueueView::LoadQueue()
 
 	bool error = false;
 
+	// Instead of saving the whole queue on exit, the loaded rows are kept
+	// and changes get written as they happen.
+	bool const kiosk_mode = COptions::Get()->GetOptionVal(OPTION_DEFAULT_KIOSKMODE) == 2;
+	bool const journal = !kiosk_mode && m_queue_storage.CanJournal();
+
 	if (!m_queue_storage.BeginTransaction())
 		error = true;
 	else
@@ -1887,16 +2367,62 @@ void CQueueView::LoadQueue()
 			m_insertionCount = 0;
 			CServerItem *pServerItem = CreateServerItem(server);
 
+			// With the journal, the files stay in the database. Only the first
+			// page gets loaded now, the others once they are needed.
 			CFileItem* fileItem = 0;
 			int64_t fileId;
-			for (fileId = m_queue_storage.GetFile(&fileItem, id); fileItem; fileId = m_queue_storage.GetFile(&fileItem, 0))
-			{
-				fileItem->SetParent(pServerItem);
-				fileItem->SetPriority(fileItem->GetPriority());
-				InsertItem(pServerItem, fileItem);
+			int64_t lastId = 0;
+			int64_t maxId = std::numeric_limits<int64_t>::max();
+			if (journal) {
+				// Files the journal adds to the row later on are loaded already
+				maxId = m_queue_storage.GetLastFile(id);
+				if (maxId < 0)
+					error = true;
+			}
+			int loaded = 0;
+			int limit = journal ? stored_files_page_size : -1;
+			for (;;) {
+				CFileItem* lastItem = 0;
+				for (fileId = m_queue_storage.GetFile(&fileItem, id, lastId, limit, maxId); fileItem; fileId = m_queue_storage.GetFile(&fileItem, 0))
+				{
+					fileItem->SetParent(pServerItem);
+					fileItem->SetPriority(fileItem->GetPriority());
+					InsertItem(pServerItem, fileItem);
+					if (journal)
+						m_queue_storage.Adopt(*fileItem, fileId);
+					lastId = fileId;
+					lastItem = fileItem;
+					++loaded;
+				}
+				if (fileId < 0)
+					error = true;
+
+				// The segments of a file are loaded together
+				if (error || !lastItem || limit < 0 || !SegmentsFollow(*lastItem))
+					break;
+				limit = 1;
+			}
+
+			if (journal && loaded) {
+				if (!m_queue_storage.Adopt(*pServerItem, id))
+					error = true;
+
+				if (loaded >= stored_files_page_size) {
+					CServerItem::t_storedFiles stored;
+					stored.server = id;
+					stored.last = lastId;
+					stored.max = maxId;
+					if (!m_queue_storage.GetFileSummary(id, lastId, maxId, stored.count, stored.size, stored.unknownSize))
+						error = true;
+					if (stored.count > 0) {
+						pServerItem->m_storedFiles.push_back(stored);
+						m_totalQueueSize += stored.size;
+						m_filesWithUnknownSize += static_cast<int>(stored.unknownSize);
+						m_fileCount += static_cast<int>(stored.count);
+						m_fileCountChanged = true;
+					}
+				}
 			}
-			if (fileId < 0)
-				error = true;
 
 			if (!pServerItem->GetChild(0))
 			{
@@ -1908,17 +2434,23 @@ void CQueueView::LoadQueue()
 		if (id < 0)
 			error = true;
 
-		if (COptions::Get()->GetOptionVal(OPTION_DEFAULT_KIOSKMODE) != 2)
-			if (!m_queue_storage.Clear())
+		if (!kiosk_mode)
+			if (!m_queue_storage.Clear(!journal))
 				error = true;
 
 		if (!m_queue_storage.EndTransaction())
 			error = true;
 
-		if (!m_queue_storage.Vacuum())
+		// Would block other instances writing their journal
+		if (!journal && !m_queue_storage.Vacuum())
 			error = true;
 	}
 
+	if (journal && m_queue_storage.StartJournal(m_serverList)) {
+		for (auto const& pServerItem : m_serverList)
+			pServerItem->SetStorage(&m_queue_storage);
+	}
+
 	m_insertionStart = -1;
 	m_insertionCount = 0;
 	CommitChanges();
@@ -1986,6 +2518,21 @@ void CQueueView::ImportQueue(TiXmlElement* pElement, bool updateSelections)
 					fileItem->SetAscii(!binary);
 					fileItem->SetPriorityRaw(QueuePriority(priority));
 					fileItem->m_errorCount = errorCount;
+
+					int segmentCount = GetTextElementInt(pFile, "SegmentCount");
+					wxLongLong segmentLength = GetTextElementLongLong(pFile, "SegmentLength", -1);
+					if (download && segmentCount > 1 && segmentLength > 0) {
+						CFileItem::t_segment segment;
+						segment.offset = GetTextElementLongLong(pFile, "SegmentOffset").GetValue();
+						segment.length = segmentLength.GetValue();
+						segment.done = GetTextElementLongLong(pFile, "SegmentDone").GetValue();
+						segment.index = GetTextElementInt(pFile, "SegmentIndex");
+						segment.count = segmentCount;
+						segment.size = GetTextElementLongLong(pFile, "SegmentFileSize", -1).GetValue();
+						segment.failed = GetTextElementInt(pFile, "SegmentFailed") != 0;
+						fileItem->SetSegment(segment);
+					}
+
 					InsertItem(pServerItem, fileItem);
 
 					if (overwrite_action > 0 && overwrite_action < CFileExistsNotification::ACTION_COUNT)
@@ -2054,6 +2601,125 @@ void CQueueView::OnPostScroll()
 {
 	if (GetTopItem() != m_lastTopItem)
 		UpdateStatusLinePositions();
+
+	// Load more files of a server once its last loaded file comes into view
+	int const bottom = GetTopItem() + GetCountPerPage();
+	for (auto const& pServerItem : m_serverList) {
+		if (pServerItem->m_storedFiles.empty())
+			continue;
+
+		int const last = GetItemIndex(pServerItem) + pServerItem->GetChildrenCount(true);
+		if (last > bottom + GetCountPerPage())
+			continue;
+
+		LoadStoredFiles(*pServerItem);
+		RefreshListOnly(false);
+		break;
+	}
+}
+
+void CQueueView::CountStoredFiles(CServerItem const& serverItem, bool add)
+{
+	for (auto const& stored : serverItem.m_storedFiles) {
+		int64_t const sign = add ? 1 : -1;
+		m_totalQueueSize += sign * stored.size;
+		m_filesWithUnknownSize += static_cast<int>(sign * stored.unknownSize);
+		m_fileCount += static_cast<int>(sign * stored.count);
+		m_fileCountChanged = true;
+	}
+}
+
+void CQueueView::LoadStoredFiles(CServerItem& serverItem, bool all)
+{
+	if (serverItem.m_storedFiles.empty())
+		return;
+
+	CountStoredFiles(serverItem, false);
+
+	// The files are in the storage already
+	bool const journal = m_queue_storage.JournalActive();
+	if (journal)
+		serverItem.SetStorage(0);
+
+	bool error = false;
+	do {
+		CServerItem::t_storedFiles& stored = serverItem.m_storedFiles.front();
+
+		CFileItem* fileItem = 0;
+		int64_t fileId;
+		int loaded = 0;
+		int limit = all ? -1 : stored_files_page_size;
+		for (;;) {
+			CFileItem* lastItem = 0;
+			for (fileId = m_queue_storage.GetFile(&fileItem, stored.server, stored.last, limit, stored.max); fileItem; fileId = m_queue_storage.GetFile(&fileItem, 0))
+			{
+				m_queue_storage.Adopt(*fileItem, fileId);
+				fileItem->SetParent(&serverItem);
+				InsertItem(&serverItem, fileItem);
+
+				stored.last = fileId;
+				--stored.count;
+				if (fileItem->GetSize() < 0)
+					--stored.unknownSize;
+				else
+					stored.size -= fileItem->GetSize().GetValue();
+				lastItem = fileItem;
+				++loaded;
+			}
+			if (fileId < 0)
+				error = true;
+
+			// The segments of a file are loaded together
+			if (error || !lastItem || limit < 0 || !SegmentsFollow(*lastItem))
+				break;
+			limit = 1;
+		}
+
+		if (all || error || loaded < stored_files_page_size || stored.count <= 0)
+			serverItem.m_storedFiles.erase(serverItem.m_storedFiles.begin());
+		else
+			break;
+	} while (all && !serverItem.m_storedFiles.empty());
+
+	if (journal)
+		serverItem.SetStorage(&m_queue_storage);
+
+	CountStoredFiles(serverItem, true);
+	CommitChanges();
+
+	if (error) {
+		wxString file = CQueueStorage::GetDatabaseFilename();
+		wxString msg = wxString::Format(_("An error occurred loading the transfer queue from \"%s\".\nSome queue items might not have been restored."), file);
+		wxMessageBoxEx(msg, _("Error loading queue"), wxICON_ERROR);
+	}
+}
+
+bool CQueueView::StoredFilesInNextPage(CServerItem const& serverItem, TransferDirection direction)
+{
+	if (serverItem.m_storedFiles.empty())
+		return false;
+
+	if (direction == TransferDirection::both)
+		return true;
+
+	// The pages hold files of both directions
+	auto const& stored = serverItem.m_storedFiles.front();
+	return m_queue_storage.HasFile(stored.server, stored.last, stored.max, stored_files_page_size, direction == TransferDirection::download);
+}
+
+void CQueueView::RemoveStoredFiles(CServerItem& serverItem)
+{
+	if (serverItem.m_storedFiles.empty())
+		return;
+
+	CountStoredFiles(serverItem, false);
+
+	for (auto const& stored : serverItem.m_storedFiles)
+		m_queue_storage.RemoveStoredFiles(stored.server, stored.last, stored.max);
+	serverItem.m_storedFiles.clear();
+
+	DisplayQueueSize();
+	DisplayNumberQueuedFiles();
 }
 
 void CQueueView::OnContextMenu(wxContextMenuEvent&)
@@ -2183,6 +2849,7 @@ void CQueueView::RemoveAll()
 	m_itemCount = 0;
 	for (auto iter = m_serverList.begin(); iter != m_serverList.end(); ++iter)
 	{
+		RemoveStoredFiles(**iter);
 		if ((*iter)->TryRemoveAll())
 			delete *iter;
 		else
@@ -2337,6 +3004,8 @@ bool CQueueView::StopItem(CFileItem* item)
 
 bool CQueueView::StopItem(CServerItem* pServerItem)
 {
+	RemoveStoredFiles(*pServerItem);
+
 	std::list<CQueueItem*> items;
 	for (unsigned int i = 0; i < pServerItem->GetChildrenCount(false); i++)
 		items.push_back(pServerItem->GetChild(i, false));
@@ -2518,6 +3187,7 @@ void CQueueView::OnSetDefaultFileExistsAction(wxCommandEvent &)
 						break;
 					pFileItem->m_defaultFileExistsAction = uploadAction;
 				}
+				static_cast<CServerItem*>(pFileItem->GetTopLevelItem())->StoreChild(*pFileItem);
 			}
 			break;
 		case QueueItemType::Server:
@@ -2688,6 +3358,10 @@ void CQueueView::UpdateItemSize(CFileItem* pItem, wxLongLong size)
 {
 	wxASSERT(pItem);
 
+	// The size reported during the transfer of a segment is that of the remaining range
+	if (pItem->GetSegment() && size != pItem->GetSegment()->length)
+		return;
+
 	const wxLongLong oldSize = pItem->GetSize();
 	if (size == oldSize)
 		return;
@@ -2712,6 +3386,10 @@ void CQueueView::UpdateItemSize(CFileItem* pItem, wxLongLong size)
 
 	pItem->SetSize(size);
 
+	CServerItem* pServerItem = static_cast<CServerItem*>(pItem->GetTopLevelItem());
+	if (pServerItem)
+		pServerItem->StoreChild(*pItem);
+
 	DisplayQueueSize();
 }
 
@@ -2770,6 +3448,9 @@ void CQueueView::InsertItem(CServerItem* pServerItem, CQueueItem* pItem)
 			m_filesWithUnknownSize++;
 		else if (size > 0)
 			m_totalQueueSize += size.GetValue();
+
+		if (pFileItem->GetSegment())
+			AddSegment(*pServerItem, *pFileItem);
 	}
 }
 
@@ -2966,7 +3647,8 @@ void CQueueView::ActionAfter(bool warned /*=false*/)
 			continue;
 
 		if (pRecursiveOperationHandler->GetOperationMode() == CRecursiveOperation::recursive_download ||
-			pRecursiveOperationHandler->GetOperationMode() == CRecursiveOperation::recursive_download_flatten)
+			pRecursiveOperationHandler->GetOperationMode() == CRecursiveOperation::recursive_download_flatten ||
+			pRecursiveOperationHandler->GetOperationMode() == CRecursiveOperation::recursive_synchronize)
 		{
 			return;
 		}
@@ -7,6 +7,7 @@
 #include <libfilezilla.h>
 #include <option_change_event_handler.h>
 
+#include <map>
 #include <set>
 #include <wx/progdlg.h>
 
@@ -125,7 +126,8 @@ public:
 		const wxString& localFile, const wxString& remoteFile,
 		const CLocalPath& localPath, const CServerPath& remotePath,
 		const CServer& server, const wxLongLong size, enum CEditHandler::fileType edit = CEditHandler::none,
-		QueuePriority priority = QueuePriority::normal);
+		QueuePriority priority = QueuePriority::normal,
+		CFileExistsNotification::OverwriteAction defaultFileExistsAction = CFileExistsNotification::unknown);
 
 	void QueueFile_Finish(const bool start); // Need to be called after QueueFile
 	bool QueueFiles(const bool queueOnly, const CLocalPath& localPath, const CRemoteDataObject& dataObject);
@@ -151,6 +153,8 @@ public:
 
 	virtual void InsertItem(CServerItem* pServerItem, CQueueItem* pItem);
 
+	virtual CServerItem* CreateServerItem(const CServer& server);
+
 	virtual void CommitChanges();
 
 	void WriteToFile(TiXmlElement* pElement) const;
@@ -184,6 +188,23 @@ protected:
 	// whether it is allowed to start another transfer on that server item
 	bool CanStartTransfer(const CServerItem& server_item, struct t_EngineData *&pEngineData);
 
+	// Called from TryStartNextTransfer(), splits large downloads into
+	// segments that get transferred concurrently
+	void SplitIntoSegments(CServerItem& serverItem, CFileItem& fileItem);
+
+	// The segments of a file are tracked by the local file they write to.
+	// A file only counts as transferred once all of its segments succeeded.
+	struct t_segmentedFile
+	{
+		std::set<int> pending; // Segments in the queue
+		std::set<int> failed;  // Segments failed or removed, -1 if lost in a previous session
+	};
+	std::map<wxString, t_segmentedFile> m_segmentedFiles;
+
+	void AddSegment(CServerItem& serverItem, CFileItem& item);
+	void RemoveSegment(CFileItem const& item);
+	void FlagFailedSegments(CServerItem& serverItem, wxString const& file, bool failed);
+
 	bool ProcessFolderItems(int type = -1);
 	void ProcessUploadFolderItems();
 
@@ -201,7 +222,11 @@ protected:
 
 	enum ActionAfterState GetActionAfterState() const;
 
-	void ResetEngine(t_EngineData& data, const enum ResetReason reason);
+	void ResetEngine(t_EngineData& data, enum ResetReason reason);
+
+	// Called from ResetEngine() once a segment has been transferred, returns
+	// the reason to reset the engine with for the file as a whole.
+	enum ResetReason FinishSegment(CFileItem& item);
 	void DeleteEngines();
 
 	virtual bool RemoveItem(CQueueItem* item, bool destroy, bool updateItemCount = true, bool updateSelections = true);
@@ -218,6 +243,12 @@ protected:
 	void DisplayQueueSize();
 	void SaveQueue();
 
+	// Files of the saved queue not loaded yet, see CServerItem::m_storedFiles
+	void LoadStoredFiles(CServerItem& serverItem, bool all = false);
+	bool StoredFilesInNextPage(CServerItem const& serverItem, TransferDirection direction);
+	void RemoveStoredFiles(CServerItem& serverItem);
+	void CountStoredFiles(CServerItem const& serverItem, bool add);
+
 	bool IsActionAfter(enum ActionAfterState);
 	void ActionAfter(bool warned = false);
 #if defined(__WXMSW__) || defined(__WXMAC__)
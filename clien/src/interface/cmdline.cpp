@@ -17,6 +17,7 @@ CCommandLine::CCommandLine(int argc, wxChar** argv)
 	m_parser.AddSwitch(_T(""), _T("verbose"), _("Verbose log messages from wxWidgets"));
 	m_parser.AddSwitch(_T("v"), _T("version"), _("Print version information to stdout and exit"));
 	m_parser.AddSwitch(_T(""), _T("debug-startup"), _("Print diagnostic information related to startup of FileZilla"));
+	m_parser.AddSwitch(_T(""), _T("simulate-io"), _("Benchmark mode: Transfer files without reading or writing any local files"));
 	wxString str = _T("<");
 	str += _("FTP URL");
 	str += _T(">");
@@ -39,6 +40,8 @@ bool CCommandLine::HasSwitch(enum CCommandLine::t_switches s) const
 		return m_parser.Found(_T("v"));
 	else if (s == debug_startup)
 		return m_parser.Found(_T("debug-startup"));
+	else if (s == simulate_io)
+		return m_parser.Found(_T("simulate-io"));
 
 	return false;
 }
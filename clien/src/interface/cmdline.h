@@ -11,7 +11,8 @@ public:
 		sitemanager,
 		close,
 		version,
-		debug_startup
+		debug_startup,
+		simulate_io
 	};
 
 	enum t_option
@@ -625,7 +625,7 @@ template<class CFileData> void CFileListCtrl<CFileData>::OnExitComparisonMode()
 	RefreshListOnly();
 }
 
-template<class CFileData> void CFileListCtrl<CFileData>::CompareAddFile(t_fileEntryFlags flags)
+template<class CFileData> void CFileListCtrl<CFileData>::CompareAddFile(t_fileEntryFlags flags, size_t index)
 {
 	if (flags == fill)
 	{
@@ -633,10 +633,21 @@ template<class CFileData> void CFileListCtrl<CFileData>::CompareAddFile(t_fileEn
 		return;
 	}
 
-	int index = m_originalIndexMapping[m_comparisonIndex];
-	m_fileData[index].comparison_flags = flags;
+	unsigned int const dataIndex = m_originalIndexMapping[index];
+	m_fileData[dataIndex].comparison_flags = flags;
 
-	m_indexMapping.push_back(index);
+	m_indexMapping.push_back(dataIndex);
+}
+
+template<class CFileData> void CFileListCtrl<CFileData>::CompareUpdateFile(t_fileEntryFlags flags, size_t index)
+{
+	if (index >= m_originalIndexMapping.size())
+		return;
+
+	m_fileData[m_originalIndexMapping[index]].comparison_flags = flags;
+
+	// Virtual list, only visible rows get repainted
+	RefreshListOnly(false);
 }
 
 template<class CFileData> void CFileListCtrl<CFileData>::ComparisonRememberSelections()
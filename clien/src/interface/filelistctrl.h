@@ -496,7 +496,8 @@ protected:
 	virtual void ScrollTopItem(int item);
 	virtual void OnPostScroll();
 	virtual void OnExitComparisonMode();
-	virtual void CompareAddFile(t_fileEntryFlags flags);
+	virtual void CompareAddFile(t_fileEntryFlags flags, size_t index);
+	virtual void CompareUpdateFile(t_fileEntryFlags flags, size_t index);
 
 	int m_comparisonIndex;
 
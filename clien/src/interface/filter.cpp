@@ -10,13 +10,12 @@
 #include "state.h"
 #include "xmlfunctions.h"
 
-#include <wx/regex.h>
-
 bool CFilterManager::m_loaded = false;
 std::vector<CFilter> CFilterManager::m_globalFilters;
 std::vector<CFilterSet> CFilterManager::m_globalFilterSets;
 unsigned int CFilterManager::m_globalCurrentFilterSet = 0;
 bool CFilterManager::m_filters_disabled = false;
+std::shared_ptr<CFilterMatcher const> CFilterManager::m_activeFilters[2];
 
 BEGIN_EVENT_TABLE(CFilterDialog, wxDialogEx)
 EVT_BUTTON(XRCID("wxID_OK"), CFilterDialog::OnOkOrApply)
@@ -35,44 +34,6 @@ EVT_BUTTON(XRCID("ID_REMOTE_ENABLEALL"), CFilterDialog::OnChangeAll)
 EVT_BUTTON(XRCID("ID_REMOTE_DISABLEALL"), CFilterDialog::OnChangeAll)
 END_EVENT_TABLE()
 
-CFilterCondition::CFilterCondition()
-{
-	type = filter_name;
-	condition = 0;
-	matchCase = true;
-	value = 0;
-}
-
-CFilter::CFilter()
-{
-	matchType = all;
-	filterDirs = true;
-	filterFiles = true;
-
-	// Filenames on Windows ignore case
-#ifdef __WXMSW__
-	matchCase = false;
-#else
-	matchCase = true;
-#endif
-}
-
-bool CFilter::HasConditionOfType(enum t_filterType type) const
-{
-	for (std::vector<CFilterCondition>::const_iterator iter = filters.begin(); iter != filters.end(); ++iter)
-	{
-		if (iter->type == type)
-			return true;
-	}
-
-	return false;
-}
-
-bool CFilter::IsLocalFilter() const
-{
-	 return HasConditionOfType(filter_attributes) || HasConditionOfType(filter_permissions);
-}
-
 CFilterDialog::CFilterDialog()
 	: m_shiftClick()
 	, m_pMainFrame()
@@ -112,9 +73,9 @@ bool CFilterDialog::Create(CMainFrame* parent)
 void CFilterDialog::OnOkOrApply(wxCommandEvent& event)
 {
 	m_globalFilters = m_filters;
-	CompileRegexes();
 	m_globalFilterSets = m_filterSets;
 	m_globalCurrentFilterSet = m_currentFilterSet;
+	InvalidateActiveFilters();
 
 	SaveFilters();
 
@@ -141,7 +102,6 @@ void CFilterDialog::OnEdit(wxCommandEvent& event)
 
 	m_filters = dlg.GetFilters();
 	m_filterSets = dlg.GetFilterSets();
-	CompileRegexes();
 
 	DisplayFilters();
 }
@@ -573,302 +533,7 @@ bool CFilterManager::FilenameFiltered(const wxString& name, const wxString& path
 	if (m_filters_disabled)
 		return false;
 
-	wxASSERT(m_globalCurrentFilterSet < m_globalFilterSets.size());
-
-	const CFilterSet& set = m_globalFilterSets[m_globalCurrentFilterSet];
-
-	// Check active filters
-	for (unsigned int i = 0; i < m_globalFilters.size(); ++i) {
-		if (local) {
-			if (set.local[i])
-				if (FilenameFilteredByFilter(m_globalFilters[i], name, path, dir, size, attributes, date))
-					return true;
-		}
-		else {
-			if (set.remote[i])
-				if (FilenameFilteredByFilter(m_globalFilters[i], name, path, dir, size, attributes, date))
-					return true;
-		}
-	}
-
-	return false;
-}
-
-bool CFilterManager::FilenameFiltered(const std::list<CFilter> &filters, const wxString& name, const wxString& path, bool dir, wxLongLong size, bool local, int attributes, CDateTime const& date) const
-{
-	for( auto const& filter : filters ) {
-		if (FilenameFilteredByFilter(filter, name, path, dir, size, attributes, date))
-			return true;
-	}
-
-	return false;
-}
-
-static bool StringMatch(const wxString& subject, const wxString& filter, int condition, bool matchCase, std::shared_ptr<const wxRegEx> const& pRegEx)
-{
-	bool match = false;
-
-	switch (condition)
-	{
-	case 0:
-		if (matchCase) {
-			if (subject.Contains(filter))
-				match = true;
-		}
-		else {
-			if (subject.Lower().Contains(filter.Lower()))
-				match = true;
-		}
-		break;
-	case 1:
-		if (matchCase) {
-			if (subject == filter)
-				match = true;
-		}
-		else {
-			if (!subject.CmpNoCase(filter))
-				match = true;
-		}
-		break;
-	case 2:
-		{
-			const wxString& left = subject.Left(filter.Len());
-			if (matchCase) {
-				if (left == filter)
-					match = true;
-			}
-			else {
-				if (!left.CmpNoCase(filter))
-					match = true;
-			}
-		}
-		break;
-	case 3:
-		{
-			const wxString& right = subject.Right(filter.Len());
-			if (matchCase) {
-				if (right == filter)
-					match = true;
-			}
-			else {
-				if (!right.CmpNoCase(filter))
-					match = true;
-			}
-		}
-		break;
-	case 4:
-		wxASSERT(pRegEx);
-		if (pRegEx && pRegEx->Matches(subject))
-			match = true;
-		break;
-	case 5:
-		if (matchCase) {
-			if (!subject.Contains(filter))
-				match = true;
-		}
-		else {
-			if (!subject.Lower().Contains(filter.Lower()))
-				match = true;
-		}
-		break;
-	}
-
-	return match;
-}
-
-bool CFilterManager::FilenameFilteredByFilter(const CFilter& filter, const wxString& name, const wxString& path, bool dir, wxLongLong size, int attributes, CDateTime const& date)
-{
-	if (dir && !filter.filterDirs)
-		return false;
-	else if (!dir && !filter.filterFiles)
-		return false;
-
-	for (std::vector<CFilterCondition>::const_iterator iter = filter.filters.begin(); iter != filter.filters.end(); ++iter)
-	{
-		bool match = false;
-		const CFilterCondition& condition = *iter;
-
-		switch (condition.type)
-		{
-		case filter_name:
-			match = StringMatch(name, condition.strValue, condition.condition, filter.matchCase, condition.pRegEx);
-			break;
-		case filter_path:
-			match = StringMatch(path, condition.strValue, condition.condition, filter.matchCase, condition.pRegEx);
-			break;
-		case filter_size:
-			if (size == -1)
-				continue;
-			switch (condition.condition)
-			{
-			case 0:
-				if (size > condition.value)
-					match = true;
-				break;
-			case 1:
-				if (size == condition.value)
-					match = true;
-				break;
-			case 2:
-				if (size != condition.value)
-					match = true;
-				break;
-			case 3:
-				if (size < condition.value)
-					match = true;
-				break;
-			}
-			break;
-		case filter_attributes:
-#ifndef __WXMSW__
-			continue;
-#else
-			if (!attributes)
-				continue;
-
-			{
-				int flag = 0;
-				switch (condition.condition)
-				{
-				case 0:
-					flag = FILE_ATTRIBUTE_ARCHIVE;
-					break;
-				case 1:
-					flag = FILE_ATTRIBUTE_COMPRESSED;
-					break;
-				case 2:
-					flag = FILE_ATTRIBUTE_ENCRYPTED;
-					break;
-				case 3:
-					flag = FILE_ATTRIBUTE_HIDDEN;
-					break;
-				case 4:
-					flag = FILE_ATTRIBUTE_READONLY;
-					break;
-				case 5:
-					flag = FILE_ATTRIBUTE_SYSTEM;
-					break;
-				}
-
-				int set = (flag & attributes) ? 1 : 0;
-				if (set == condition.value)
-					match = true;
-			}
-#endif //__WXMSW__
-			break;
-		case filter_permissions:
-#ifdef __WXMSW__
-			continue;
-#else
-			if (attributes == -1)
-				continue;
-
-			{
-				int flag = 0;
-				switch (condition.condition)
-				{
-				case 0:
-					flag = S_IRUSR;
-					break;
-				case 1:
-					flag = S_IWUSR;
-					break;
-				case 2:
-					flag = S_IXUSR;
-					break;
-				case 3:
-					flag = S_IRGRP;
-					break;
-				case 4:
-					flag = S_IWGRP;
-					break;
-				case 5:
-					flag = S_IXGRP;
-					break;
-				case 6:
-					flag = S_IROTH;
-					break;
-				case 7:
-					flag = S_IWOTH;
-					break;
-				case 8:
-					flag = S_IXOTH;
-					break;
-				}
-
-				int set = (flag & attributes) ? 1 : 0;
-				if (set == condition.value)
-					match = true;
-			}
-#endif //__WXMSW__
-			break;
-		case filter_date:
-			if (date.IsValid()) {
-				int cmp = date.Compare( condition.date );
-				switch (condition.condition)
-				{
-				case 0: // Before
-					match = cmp < 0;
-					break;
-				case 1: // Equals
-					match = cmp == 0;
-					break;
-				case 2: // Not equals
-					match = cmp != 0;
-					break;
-				case 3: // After
-					match = cmp > 0;
-					break;
-				}
-			}
-			break;
-		default:
-			wxFAIL_MSG(_T("Unhandled filter type"));
-			break;
-		}
-		if (match) {
-			if (filter.matchType == CFilter::any)
-				return true;
-			else if (filter.matchType == CFilter::none)
-				return false;
-		}
-		else {
-			if (filter.matchType == CFilter::all)
-				return false;
-		}
-	}
-
-	if (filter.matchType != CFilter::any || filter.filters.empty())
-		return true;
-
-	return false;
-}
-
-bool CFilterManager::CompileRegexes(CFilter& filter)
-{
-	for (auto iter = filter.filters.begin(); iter != filter.filters.end(); ++iter)
-	{
-		CFilterCondition& condition = *iter;
-		if ((condition.type == filter_name || condition.type == filter_path) && condition.condition == 4) {
-			condition.pRegEx = std::make_shared<wxRegEx>(condition.strValue);
-			if (!condition.pRegEx->IsValid()) {
-				condition.pRegEx.reset();
-				return false;
-			}
-		}
-		else
-			condition.pRegEx.reset();
-	}
-
-	return true;
-}
-
-bool CFilterManager::CompileRegexes()
-{
-	for (auto & filter : m_globalFilters) {
-		CompileRegexes(filter);
-	}
-	return true;
+	return GetActiveFilters(local)->Filtered(name, path, dir, size, attributes, date);
 }
 
 bool CFilterManager::LoadFilter(TiXmlElement* pElement, CFilter& filter)
@@ -957,6 +622,7 @@ void CFilterManager::LoadFilters()
 		return;
 
 	m_loaded = true;
+	InvalidateActiveFilters();
 
 	CInterProcessMutex mutex(MUTEX_FILTERS);
 
@@ -991,8 +657,6 @@ void CFilterManager::LoadFilters()
 		pFilter = pFilter->NextSiblingElement("Filter");
 	}
 
-	CompileRegexes();
-
 	TiXmlElement* pSets = pDocument->FirstChildElement("Sets");
 	if (!pSets)
 		return;
@@ -1038,26 +702,33 @@ void CFilterManager::ToggleFilters()
 		m_filters_disabled = true;
 }
 
-std::list<CFilter> CFilterManager::GetActiveFilters(bool local)
+std::shared_ptr<CFilterMatcher const> CFilterManager::GetActiveFilters(bool local)
 {
-	std::list<CFilter> filters;
+	if (!m_loaded)
+		LoadFilters();
 
-	if (m_filters_disabled)
-		return filters;
+	if (m_filters_disabled || m_globalFilterSets.empty()) {
+		static std::shared_ptr<CFilterMatcher const> const none = std::make_shared<CFilterMatcher>();
+		return none;
+	}
 
-	const CFilterSet& set = m_globalFilterSets[m_globalCurrentFilterSet];
+	auto & active = m_activeFilters[local ? 1 : 0];
+	if (!active) {
+		const CFilterSet& set = m_globalFilterSets[m_globalCurrentFilterSet];
 
-	// Check active filters
-	for (unsigned int i = 0; i < m_globalFilters.size(); ++i) {
-		if (local) {
-			if (set.local[i])
-				filters.push_back(m_globalFilters[i]);
-		}
-		else {
-			if (set.remote[i])
+		std::vector<CFilter> filters;
+		for (unsigned int i = 0; i < m_globalFilters.size(); ++i) {
+			if (local ? set.local[i] : set.remote[i])
 				filters.push_back(m_globalFilters[i]);
 		}
+		active = std::make_shared<CFilterMatcher>(filters);
 	}
 
-	return filters;
+	return active;
+}
+
+void CFilterManager::InvalidateActiveFilters()
+{
+	m_activeFilters[0].reset();
+	m_activeFilters[1].reset();
 }
@@ -2,68 +2,10 @@
 #define __FILTER_H__
 
 #include "dialogex.h"
-#include <wx/regex.h>
+#include "filter_matcher.h"
 
 #include <memory>
 
-enum t_filterType
-{
-	filter_name = 0x01,
-	filter_size = 0x02,
-	filter_attributes = 0x04,
-	filter_permissions = 0x08,
-	filter_path = 0x10,
-	filter_date = 0x20,
-	filter_time = 0x40,
-#ifdef __WXMSW__
-	filter_meta = filter_attributes,
-	filter_foreign = filter_permissions,
-#else
-	filter_meta = filter_permissions,
-	filter_foreign = filter_attributes
-#endif
-};
-
-class CFilterCondition
-{
-public:
-	CFilterCondition();
-
-	enum t_filterType type;
-	int condition;
-
-	wxString strValue; // All other types
-	wxLongLong value; // If type is size
-	CDateTime date; // If type is date
-	bool matchCase;
-	std::shared_ptr<wxRegEx> pRegEx;
-};
-
-class CFilter
-{
-public:
-	enum t_matchType
-	{
-		all,
-		any,
-		none
-	};
-
-	CFilter();
-
-	wxString name;
-
-	bool filterFiles;
-	bool filterDirs;
-	enum t_matchType matchType;
-	bool matchCase;
-
-	std::vector<CFilterCondition> filters;
-
-	bool HasConditionOfType(enum t_filterType type) const;
-	bool IsLocalFilter() const;
-};
-
 class CFilterSet
 {
 public:
@@ -80,22 +22,24 @@ public:
 
 	// Note: Under non-windows, attributes are permissions
 	bool FilenameFiltered(const wxString& name, const wxString& path, bool dir, wxLongLong size, bool local, int attributes, CDateTime const& date) const;
-	bool FilenameFiltered(const std::list<CFilter> &filters, const wxString& name, const wxString& path, bool dir, wxLongLong size, bool local, int attributes, CDateTime const& date) const;
-	static bool FilenameFilteredByFilter(const CFilter& filter, const wxString& name, const wxString& path, bool dir, wxLongLong size, int attributes, CDateTime const& date);
 	static bool HasActiveFilters(bool ignore_disabled = false);
 
 	bool HasSameLocalAndRemoteFilters() const;
 
 	static void ToggleFilters();
 
-	std::list<CFilter> GetActiveFilters(bool local);
-
-	static bool CompileRegexes(CFilter& filter);
+	// Compiled once for each change of the filters and shared, entries
+	// can be filtered with it from other threads.
+	static std::shared_ptr<CFilterMatcher const> GetActiveFilters(bool local);
 
 	static bool LoadFilter(TiXmlElement* pElement, CFilter& filter);
 
 protected:
-	static bool CompileRegexes();
+	// Call after changing the filters or filter sets
+	static void InvalidateActiveFilters();
+
+	// Remote and local
+	static std::shared_ptr<CFilterMatcher const> m_activeFilters[2];
 
 	static void LoadFilters();
 	static bool m_loaded;
@@ -62,6 +62,49 @@ void CComparableListing::RefreshComparison()
 	m_pComparisonManager->CompareListings();
 }
 
+void CComparableListing::RefreshComparison(wxString const& name, bool dir, int64_t size, CDateTime const& date)
+{
+	if (!m_pComparisonManager)
+		return;
+
+	if (!IsComparing())
+		return;
+
+	CDirectoryComparison::entry entry;
+	entry.name = name;
+	entry.dir = dir;
+	entry.size = size;
+	entry.time = date;
+	if (!m_pComparisonManager->UpdateFile(this, entry))
+		RefreshComparison();
+}
+
+namespace {
+std::vector<CDirectoryComparison::entry> GetEntries(CComparableListing& listing)
+{
+	std::vector<CDirectoryComparison::entry> entries;
+
+	wxString name;
+	bool dir = false;
+	wxLongLong size;
+	CDateTime date;
+	while (listing.GetNextFile(name, dir, size, date))
+	{
+		CDirectoryComparison::entry entry;
+		entry.name = name;
+		entry.dir = dir;
+		entry.size = size.GetValue();
+		entry.time = date;
+		entries.push_back(entry);
+
+		// Not every entry has a date
+		date = CDateTime();
+	}
+
+	return entries;
+}
+}
+
 bool CComparisonManager::CompareListings()
 {
 	if (!m_pLeft || !m_pRight)
@@ -102,101 +145,70 @@ bool CComparisonManager::CompareListings()
 	m_pLeft->StartComparison();
 	m_pRight->StartComparison();
 
-	wxString localFile, remoteFile;
-	bool localDir = false;
-	bool remoteDir = false;
-	wxLongLong localSize, remoteSize;
-	CDateTime localDate, remoteDate;
+#ifdef __WXMSW__
+	const bool case_sensitive = false;
+#else
+	const bool case_sensitive = true;
+#endif
+	m_comparison.reset(new CDirectoryComparison(mode ? CDirectoryComparison::mode::date : CDirectoryComparison::mode::size, threshold, case_sensitive));
+
+	std::vector<CDirectoryComparison::entry> leftEntries = GetEntries(*m_pLeft);
+	std::vector<CDirectoryComparison::entry> rightEntries = GetEntries(*m_pRight);
+	size_t const leftCount = leftEntries.size();
+	size_t const rightCount = rightEntries.size();
+	m_comparison->Set(CDirectoryComparison::side::left, std::move(leftEntries));
+	m_comparison->Set(CDirectoryComparison::side::right, std::move(rightEntries));
 
 	const int dirSortMode = COptions::Get()->GetOptionVal(OPTION_FILELIST_DIRSORT);
 
-	const bool hide_identical = COptions::Get()->GetOptionVal(OPTION_COMPARE_HIDEIDENTICAL) != 0;
+	m_hideIdentical = COptions::Get()->GetOptionVal(OPTION_COMPARE_HIDEIDENTICAL) != 0;
 
-	bool gotLocal = m_pLeft->GetNextFile(localFile, localDir, localSize, localDate);
-	bool gotRemote = m_pRight->GetNextFile(remoteFile, remoteDir, remoteSize, remoteDate);
+	// Which entries belong together has been decided already. Both listings
+	// are sorted the same way, walk them side by side to line up the rows.
+	m_displayedPairs.assign(leftCount, CDirectoryComparison::npos);
 
-	while (gotLocal && gotRemote)
+	size_t left = 0;
+	size_t right = 0;
+	while (left < leftCount && right < rightCount)
 	{
-		int cmp = CompareFiles(dirSortMode, localFile, remoteFile, localDir, remoteDir);
+		CDirectoryComparison::entry const& leftEntry = m_comparison->Get(CDirectoryComparison::side::left, left);
+		CDirectoryComparison::entry const& rightEntry = m_comparison->Get(CDirectoryComparison::side::right, right);
+
+		int cmp = CompareFiles(dirSortMode, leftEntry.name, rightEntry.name, leftEntry.dir, rightEntry.dir);
 		if (!cmp)
 		{
-			if (!mode)
+			CDirectoryComparison::match const m = m_comparison->GetMatch(CDirectoryComparison::side::left, left);
+			if (m.right == right)
 			{
-				const CComparableListing::t_fileEntryFlags flag = (localDir || localSize == remoteSize) ? CComparableListing::normal : CComparableListing::different;
-
-				if (!hide_identical || flag != CComparableListing::normal || localFile == _T(".."))
-				{
-					m_pLeft->CompareAddFile(flag);
-					m_pRight->CompareAddFile(flag);
-				}
+				m_displayedPairs[left] = right;
+				AddMatch(m);
+				++left;
+				++right;
+				continue;
 			}
-			else
-			{
-				if (!localDate.IsValid() || !remoteDate.IsValid())
-				{
-					if (!hide_identical || localDate.IsValid() || remoteDate.IsValid() || localFile == _T(".."))
-					{
-						const CComparableListing::t_fileEntryFlags flag = CComparableListing::normal;
-						m_pLeft->CompareAddFile(flag);
-						m_pRight->CompareAddFile(flag);
-					}
-				}
-				else
-				{
-					CComparableListing::t_fileEntryFlags localFlag, remoteFlag;
-
-					int cmp = localDate.Compare(remoteDate);
-					if( cmp < 0 )
-						localDate += threshold;
-					else if( cmp > 0 ) {
-						remoteDate += threshold;
-					}
-					int cmp2 = localDate.Compare(remoteDate);
-					if( cmp && cmp == -cmp2) {
-						cmp = 0;
-					}
-
-					localFlag = CComparableListing::normal;
-					remoteFlag = CComparableListing::normal;
-					if( cmp < 0 ) {
-						remoteFlag = CComparableListing::newer;
-					}
-					else if( cmp > 0 ) {
-						localFlag = CComparableListing::newer;
-					}
-					if (!hide_identical || localFlag != CComparableListing::normal || remoteFlag != CComparableListing::normal || localFile == _T(".."))
-					{
-						m_pLeft->CompareAddFile(localFlag);
-						m_pRight->CompareAddFile(remoteFlag);
-					}
-				}
-			}
-			gotLocal = m_pLeft->GetNextFile(localFile, localDir, localSize, localDate);
-			gotRemote = m_pRight->GetNextFile(remoteFile, remoteDir, remoteSize, remoteDate);
-			continue;
+
+			// Same name yet not the same entry, e.g. a file and a directory
+			// if directories are sorted inline.
+			cmp = -1;
 		}
 
 		if (cmp < 0) {
-			m_pLeft->CompareAddFile(CComparableListing::lonely);
-			m_pRight->CompareAddFile(CComparableListing::fill);
-			gotLocal = m_pLeft->GetNextFile(localFile, localDir, localSize, localDate);
+			m_pLeft->CompareAddFile(CComparableListing::lonely, left++);
+			m_pRight->CompareAddFile(CComparableListing::fill, CDirectoryComparison::npos);
 		}
 		else {
-			m_pLeft->CompareAddFile(CComparableListing::fill);
-			m_pRight->CompareAddFile(CComparableListing::lonely);
-			gotRemote = m_pRight->GetNextFile(remoteFile, remoteDir, remoteSize, remoteDate);
+			m_pLeft->CompareAddFile(CComparableListing::fill, CDirectoryComparison::npos);
+			m_pRight->CompareAddFile(CComparableListing::lonely, right++);
 		}
 	}
-	while (gotLocal) {
-		m_pLeft->CompareAddFile(CComparableListing::lonely);
-		m_pRight->CompareAddFile(CComparableListing::fill);
-		gotLocal = m_pLeft->GetNextFile(localFile, localDir, localSize, localDate);
+	while (left < leftCount) {
+		m_pLeft->CompareAddFile(CComparableListing::lonely, left++);
+		m_pRight->CompareAddFile(CComparableListing::fill, CDirectoryComparison::npos);
 	}
-	while (gotRemote)
+	while (right < rightCount)
 	{
-		m_pLeft->CompareAddFile(CComparableListing::fill);
-		m_pRight->CompareAddFile(CComparableListing::lonely);
-		gotRemote = m_pRight->GetNextFile(remoteFile, remoteDir, remoteSize, remoteDate);
+		m_pLeft->CompareAddFile(CComparableListing::fill, CDirectoryComparison::npos);
+		m_pRight->CompareAddFile(CComparableListing::lonely, right++);
 	}
 
 	m_pRight->FinishComparison();
@@ -205,6 +217,103 @@ bool CComparisonManager::CompareListings()
 	return true;
 }
 
+void CComparisonManager::GetFlags(CDirectoryComparison::result res, CComparableListing::t_fileEntryFlags& left, CComparableListing::t_fileEntryFlags& right)
+{
+	left = CComparableListing::normal;
+	right = CComparableListing::normal;
+
+	switch (res)
+	{
+	case CDirectoryComparison::result::different:
+		left = CComparableListing::different;
+		right = CComparableListing::different;
+		break;
+	case CDirectoryComparison::result::left_newer:
+		left = CComparableListing::newer;
+		break;
+	case CDirectoryComparison::result::right_newer:
+		right = CComparableListing::newer;
+		break;
+	case CDirectoryComparison::result::left_only:
+		left = CComparableListing::lonely;
+		break;
+	case CDirectoryComparison::result::right_only:
+		right = CComparableListing::lonely;
+		break;
+	default:
+		break;
+	}
+}
+
+bool CComparisonManager::IsHidden(CDirectoryComparison::match const& m) const
+{
+	if (!m_hideIdentical || m.res != CDirectoryComparison::result::equal)
+		return false;
+
+	CDirectoryComparison::entry const& left = m_comparison->Get(CDirectoryComparison::side::left, m.left);
+	if (left.name == _T(".."))
+		return false;
+
+	// In date mode, files only one of which has a date are not identical
+	// either, even if they are not flagged.
+	CDirectoryComparison::entry const& right = m_comparison->Get(CDirectoryComparison::side::right, m.right);
+	if (left.time.IsValid() != right.time.IsValid() && COptions::Get()->GetOptionVal(OPTION_COMPARISONMODE))
+		return false;
+
+	return true;
+}
+
+void CComparisonManager::AddMatch(CDirectoryComparison::match const& m)
+{
+	if (IsHidden(m))
+		return;
+
+	CComparableListing::t_fileEntryFlags leftFlag, rightFlag;
+	GetFlags(m.res, leftFlag, rightFlag);
+	m_pLeft->CompareAddFile(leftFlag, m.left);
+	m_pRight->CompareAddFile(rightFlag, m.right);
+}
+
+bool CComparisonManager::UpdateFile(CComparableListing* pListing, CDirectoryComparison::entry const& entry)
+{
+	if (!IsComparing() || !m_comparison)
+		return false;
+
+	// Hiding or showing entries changes the layout
+	if (m_hideIdentical)
+		return false;
+
+	CDirectoryComparison::side s;
+	if (pListing == m_pLeft)
+		s = CDirectoryComparison::side::left;
+	else if (pListing == m_pRight)
+		s = CDirectoryComparison::side::right;
+	else
+		return false;
+
+	size_t const index = m_comparison->Find(s, entry.name, entry.dir);
+	if (index == CDirectoryComparison::npos)
+		return false;
+
+	// Only pairs displayed next to each other can be updated in place
+	CDirectoryComparison::match const m = m_comparison->GetMatch(s, index);
+	if (m.left != CDirectoryComparison::npos && m.right != CDirectoryComparison::npos && m_displayedPairs[m.left] != m.right)
+		return false;
+
+	m_comparison->Update(s, entry);
+	for (auto const& change : m_comparison->TakeChanges())
+	{
+		CComparableListing::t_fileEntryFlags leftFlag, rightFlag;
+		GetFlags(change.res, leftFlag, rightFlag);
+		if (change.left != CDirectoryComparison::npos)
+			m_pLeft->CompareUpdateFile(leftFlag, change.left);
+		if (change.right != CDirectoryComparison::npos)
+			m_pRight->CompareUpdateFile(rightFlag, change.right);
+	}
+
+	return true;
+}
+
 int CComparisonManager::CompareFiles(const int dirSortMode, const wxString& local, const wxString& remote, bool localDir, bool remoteDir)
 {
 	switch (dirSortMode)
@@ -265,6 +374,9 @@ void CComparisonManager::ExitComparisonMode()
 		return;
 
 	m_isComparing = false;
+	m_comparison.reset();
+	m_displayedPairs.clear();
+
 	if (m_pLeft)
 		m_pLeft->OnExitComparisonMode();
 	if (m_pRight)
@@ -1,6 +1,10 @@
 #ifndef __LISTINGCOMPARISON_H__
 #define __LISTINGCOMPARISON_H__
 
+#include "directory_comparison.h"
+
+#include <memory>
+
 class CComparisonManager;
 class CComparableListing
 {
@@ -21,12 +25,22 @@ public:
 	virtual bool CanStartComparison(wxString* pError) = 0;
 	virtual void StartComparison() = 0;
 	virtual bool GetNextFile(wxString& name, bool &dir, wxLongLong &size, CDateTime& date) = 0;
-	virtual void CompareAddFile(t_fileEntryFlags flags) = 0;
+
+	// Index is the position of the entry as returned by GetNextFile,
+	// unused for fill.
+	virtual void CompareAddFile(t_fileEntryFlags flags, size_t index) = 0;
+
+	// Changes the flags of an entry already added
+	virtual void CompareUpdateFile(t_fileEntryFlags flags, size_t index) = 0;
 	virtual void FinishComparison() = 0;
 	virtual void ScrollTopItem(int item) = 0;
 	virtual void OnExitComparisonMode() = 0;
 
 	void RefreshComparison();
+
+	// Call if an entry has changed without changing its position in the
+	// listing. Falls back to RefreshComparison if need be.
+	void RefreshComparison(wxString const& name, bool dir, int64_t size, CDateTime const& date);
 	void ExitComparisonMode();
 
 	bool IsComparing() const;
@@ -58,9 +72,16 @@ public:
 
 	void SetListings(CComparableListing* pLeft, CComparableListing* pRight);
 
+	// Returns false if the listings need to be compared again
+	bool UpdateFile(CComparableListing* pListing, CDirectoryComparison::entry const& entry);
+
 protected:
 	int CompareFiles(const int dirSortMode, const wxString& local, const wxString& remote, bool localDir, bool remoteDir);
 
+	void AddMatch(CDirectoryComparison::match const& m);
+	bool IsHidden(CDirectoryComparison::match const& m) const;
+	static void GetFlags(CDirectoryComparison::result res, CComparableListing::t_fileEntryFlags& left, CComparableListing::t_fileEntryFlags& right);
+
 	CState* m_pState;
 
 	// Left/right, first/second, a/b, doesn't matter
@@ -68,6 +89,15 @@ protected:
 	CComparableListing* m_pRight;
 
 	bool m_isComparing;
+
+	// Kept between comparisons so that single changed entries can be
+	// compared again on their own.
+	std::unique_ptr<CDirectoryComparison> m_comparison;
+	bool m_hideIdentical{};
+
+	// For each entry on the left, the entry on the right it is displayed
+	// next to, if any.
+	std::vector<size_t> m_displayedPairs;
 };
 
 #endif //__LISTINGCOMPARISON_H__
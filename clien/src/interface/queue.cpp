@@ -1,6 +1,7 @@
 #include <filezilla.h>
 #include "Options.h"
 #include "queue.h"
+#include "queue_storage.h"
 #include "queueview_failed.h"
 #include "queueview_successful.h"
 #include "sizeformatting.h"
@@ -59,8 +60,8 @@ CQueueItem* CQueueItem::GetChild(unsigned int item, bool recursive /*=true*/)
 	{
 		// Index is cached
 		iter = m_children.begin() + m_removed_at_front;
-		iter += m_lookupCache[item].child;
-		item -= m_lookupCache[item].index;
+		iter += (*m_lookupCache)[item].child;
+		item -= (*m_lookupCache)[item].index;
 		if (!item)
 			return *iter;
 		else
@@ -78,10 +79,10 @@ CQueueItem* CQueueItem::GetChild(unsigned int item, bool recursive /*=true*/)
 	else
 	{
 		// Start with loop with the last cached item index
-		iter += m_lookupCache[m_maxCachedIndex].child + 1;
+		iter += (*m_lookupCache)[m_maxCachedIndex].child + 1;
 		item -= m_maxCachedIndex + 1;
 		index = m_maxCachedIndex + 1;
-		child = m_lookupCache[m_maxCachedIndex].child + 1;
+		child = (*m_lookupCache)[m_maxCachedIndex].child + 1;
 	}
 
 	for (; iter != m_children.end(); ++iter, ++child)
@@ -92,12 +93,16 @@ CQueueItem* CQueueItem::GetChild(unsigned int item, bool recursive /*=true*/)
 		unsigned int count = (*iter)->GetChildrenCount(true);
 		if (item > count)
 		{
-			if (m_maxCachedIndex == -1 && m_lookupCache.size() < (unsigned int)m_visibleOffspring)
-				m_lookupCache.resize(m_visibleOffspring);
+			if (m_maxCachedIndex == -1) {
+				if (!m_lookupCache)
+					m_lookupCache = CSparseOptional<std::vector<t_cacheItem>>(std::vector<t_cacheItem>());
+				if (m_lookupCache->size() < (unsigned int)m_visibleOffspring)
+					m_lookupCache->resize(m_visibleOffspring);
+			}
 			for (unsigned int k = index; k <= index + count; k++)
 			{
-				m_lookupCache[k].child = child;
-				m_lookupCache[k].index = index;
+				(*m_lookupCache)[k].child = child;
+				(*m_lookupCache)[k].index = index;
 			}
 			m_maxCachedIndex = index + count;
 			item -= count + 1;
@@ -271,12 +276,31 @@ int CQueueItem::GetItemIndex() const
 	return index + pParent->GetItemIndex();
 }
 
+namespace {
+std::unique_ptr<char[]> PackNames(wxString const& sourceFile, wxString const& targetFile)
+{
+	wxScopedCharBuffer const source = sourceFile.utf8_str();
+	wxScopedCharBuffer const target = targetFile.utf8_str();
+	size_t const sourceLen = sourceFile.empty() ? 0 : source.length();
+	size_t const targetLen = targetFile.empty() ? 0 : target.length();
+
+	std::unique_ptr<char[]> names(new char[sourceLen + targetLen + 2]);
+	if (sourceLen)
+		memcpy(names.get(), source.data(), sourceLen);
+	names[sourceLen] = 0;
+	if (targetLen)
+		memcpy(names.get() + sourceLen + 1, target.data(), targetLen);
+	names[sourceLen + targetLen + 1] = 0;
+
+	return names;
+}
+}
+
 CFileItem::CFileItem(CServerItem* parent, bool queued, bool download,
 					 const wxString& sourceFile, const wxString& targetFile,
 					 const CLocalPath& localPath, const CServerPath& remotePath, wxLongLong size)
 	: CQueueItem(parent)
-	, m_sourceFile(sourceFile)
-	, m_targetFile(targetFile.empty() ? CSparseOptional<wxString>() : CSparseOptional<wxString>(targetFile))
+	, m_names(PackNames(sourceFile, targetFile))
 	, m_localPath(localPath)
 	, m_remotePath(remotePath)
 	, m_size(size)
@@ -300,8 +324,11 @@ void CFileItem::SetPriority(QueuePriority priority)
 	{
 		CServerItem* parent = static_cast<CServerItem*>(m_parent);
 		parent->SetChildPriority(this, m_priority, priority);
+		m_priority = priority;
+		parent->StoreChild(*this);
 	}
-	m_priority = priority;
+	else
+		m_priority = priority;
 }
 
 void CFileItem::SetPriorityRaw(QueuePriority priority)
@@ -320,12 +347,16 @@ void CFileItem::SetActive(const bool active)
 	{
 		AddChild(new CStatusItem);
 		flags |= flag_active;
+		if (m_parent)
+			static_cast<CServerItem*>(m_parent)->SetChildActive(this, true);
 	}
 	else if (!active && IsActive())
 	{
 		CQueueItem* pItem = GetChild(0, false);
 		RemoveChild(pItem);
 		flags &= ~flag_active;
+		if (m_parent)
+			static_cast<CServerItem*>(m_parent)->SetChildActive(this, false);
 	}
 }
 
@@ -349,6 +380,17 @@ void CFileItem::SaveItem(TiXmlElement* pElement) const
 	AddTextElementRaw(file, "DataType", Ascii() ? "0" : "1");
 	if (m_defaultFileExistsAction != CFileExistsNotification::unknown)
 		AddTextElement(file, "OverwriteAction", m_defaultFileExistsAction);
+	if (m_segment) {
+		AddTextElement(file, "SegmentOffset", wxLongLong(m_segment->offset).ToString());
+		AddTextElement(file, "SegmentLength", wxLongLong(m_segment->length).ToString());
+		AddTextElement(file, "SegmentDone", wxLongLong(m_segment->done).ToString());
+		AddTextElement(file, "SegmentIndex", m_segment->index);
+		AddTextElement(file, "SegmentCount", m_segment->count);
+		if (m_segment->size >= 0)
+			AddTextElement(file, "SegmentFileSize", wxLongLong(m_segment->size).ToString());
+		if (m_segment->failed)
+			AddTextElement(file, "SegmentFailed", 1);
+	}
 }
 
 bool CFileItem::TryRemoveAll()
@@ -360,12 +402,29 @@ bool CFileItem::TryRemoveAll()
 	return false;
 }
 
+wxString CFileItem::GetSourceFile() const
+{
+	return wxString::FromUTF8(m_names.get());
+}
+
+wxString CFileItem::GetTargetFile() const
+{
+	return wxString::FromUTF8(m_names.get() + strlen(m_names.get()) + 1);
+}
+
+wxString CFileItem::GetTargetOrSourceFile() const
+{
+	char const* target = m_names.get() + strlen(m_names.get()) + 1;
+	return wxString::FromUTF8(*target ? target : m_names.get());
+}
+
 void CFileItem::SetTargetFile(wxString const& file)
 {
-	if (!file.empty() && file != m_sourceFile)
-		m_targetFile = CSparseOptional<wxString>(file);
-	else
-		m_targetFile.clear();
+	wxString const source = GetSourceFile();
+	m_names = PackNames(source, file != source ? file : wxString());
+
+	if (m_parent)
+		static_cast<CServerItem*>(m_parent)->StoreChild(*this);
 }
 
 void CFileItem::SetStatusMessage(CFileItem::Status status)
@@ -389,7 +448,8 @@ wxString const& CFileItem::GetStatusMessage() const
 		_("Could not write to local file"),
 		_("Could not start transfer"),
 		_("Transferring"),
-		_("Creating directory")
+		_("Creating directory"),
+		_("Local file incomplete")
 	};
 
 	return statusTexts[m_status];
@@ -423,10 +483,52 @@ void CFolderItem::SaveItem(TiXmlElement* pElement) const
 
 void CFolderItem::SetActive(const bool active)
 {
+	if (active == IsActive())
+		return;
+
 	if (active)
 		flags |= flag_active;
 	else
 		flags &= ~flag_active;
+
+	if (m_parent)
+		static_cast<CServerItem*>(m_parent)->SetChildActive(this, active);
+}
+
+void CIdleFileList::push_front(CFileItem* pItem)
+{
+	pItem->m_prevIdle = 0;
+	pItem->m_nextIdle = m_first;
+	if (m_first)
+		m_first->m_prevIdle = pItem;
+	else
+		m_last = pItem;
+	m_first = pItem;
+}
+
+void CIdleFileList::push_back(CFileItem* pItem)
+{
+	pItem->m_prevIdle = m_last;
+	pItem->m_nextIdle = 0;
+	if (m_last)
+		m_last->m_nextIdle = pItem;
+	else
+		m_first = pItem;
+	m_last = pItem;
+}
+
+void CIdleFileList::remove(CFileItem* pItem)
+{
+	if (pItem->m_prevIdle)
+		pItem->m_prevIdle->m_nextIdle = pItem->m_nextIdle;
+	else
+		m_first = pItem->m_nextIdle;
+	if (pItem->m_nextIdle)
+		pItem->m_nextIdle->m_prevIdle = pItem->m_prevIdle;
+	else
+		m_last = pItem->m_prevIdle;
+	pItem->m_prevIdle = 0;
+	pItem->m_nextIdle = 0;
 }
 
 CServerItem::CServerItem(const CServer& server)
@@ -437,6 +539,8 @@ CServerItem::CServerItem(const CServer& server)
 
 CServerItem::~CServerItem()
 {
+	if (m_storage)
+		m_storage->RemoveServer(*this);
 }
 
 const CServer& CServerItem::GetServer() const
@@ -454,27 +558,71 @@ void CServerItem::AddChild(CQueueItem* pItem)
 	CQueueItem::AddChild(pItem);
 	if (pItem->GetType() == QueueItemType::File ||
 		pItem->GetType() == QueueItemType::Folder)
+	{
 		AddFileItemToList((CFileItem*)pItem);
+		StoreChild(*(CFileItem*)pItem);
+	}
 }
 
-void CServerItem::AddFileItemToList(CFileItem* pItem)
+void CServerItem::SetStorage(CQueueStorage* storage)
 {
-	if (!pItem)
+	if (m_storage == storage)
 		return;
 
-	m_fileList[pItem->queued() ? 0 : 1][static_cast<int>(pItem->GetPriority())].push_back(pItem);
+	m_storage = storage;
+	if (m_storage)
+		m_storage->StoreServer(*this);
 }
 
-void CServerItem::RemoveFileItemFromList(CFileItem* pItem)
+void CServerItem::StoreChild(CFileItem const& item)
 {
-	std::list<CFileItem*>& fileList = m_fileList[pItem->queued() ? 0 : 1][static_cast<int>(pItem->GetPriority())];
-	for (auto iter = fileList.begin(); iter != fileList.end(); ++iter) {
-		if (*iter == pItem) {
-			fileList.erase(iter);
-			return;
-		}
+	if (m_storage)
+		m_storage->StoreFile(*this, item);
+}
+
+int CServerItem::GetListIndex(bool queued, bool download, QueuePriority priority)
+{
+	return ((queued ? 0 : 2) + (download ? 0 : 1)) * static_cast<int>(QueuePriority::count) + static_cast<int>(priority);
+}
+
+void CServerItem::AddFileItemToList(CFileItem* pItem, bool front)
+{
+	if (!pItem || pItem->IsActive())
+		return;
+
+	AddFileItemToList(pItem, GetListIndex(pItem->queued(), pItem->Download(), pItem->GetPriority()), front);
+}
+
+void CServerItem::AddFileItemToList(CFileItem* pItem, int list, bool front)
+{
+	// Any previous links are stale, items requeued from the failed
+	// transfers are still in the lists of the old server item.
+	pItem->m_idleList = list;
+	if (front) {
+		pItem->m_idleSequence = --m_frontSequence;
+		m_idleLists[list].push_front(pItem);
+	}
+	else {
+		pItem->m_idleSequence = ++m_backSequence;
+		m_idleLists[list].push_back(pItem);
 	}
-	wxFAIL_MSG(_T("File item not deleted from m_fileList"));
+}
+
+void CServerItem::RemoveFileItemFromList(CFileItem* pItem)
+{
+	if (pItem->m_idleList < 0)
+		return;
+
+	m_idleLists[pItem->m_idleList].remove(pItem);
+	pItem->m_idleList = -1;
+}
+
+void CServerItem::SetChildActive(CFileItem* pItem, bool active)
+{
+	if (active)
+		RemoveFileItemFromList(pItem);
+	else if (pItem->m_idleList < 0)
+		AddFileItemToList(pItem, true);
 }
 
 void CServerItem::SetDefaultFileExistsAction(CFileExistsNotification::OverwriteAction action, const TransferDirection direction)
@@ -488,6 +636,7 @@ void CServerItem::SetDefaultFileExistsAction(CFileExistsNotification::OverwriteA
 			else if (direction == TransferDirection::download && !pFileItem->Download())
 				continue;
 			pFileItem->m_defaultFileExistsAction = action;
+			StoreChild(*pFileItem);
 		}
 		else if (pItem->GetType() == QueueItemType::FolderScan) {
 			if (direction == TransferDirection::download)
@@ -497,39 +646,28 @@ void CServerItem::SetDefaultFileExistsAction(CFileExistsNotification::OverwriteA
 	}
 }
 
-namespace {
-CFileItem* DoGetIdleChild(std::list<CFileItem*> const* fileList, TransferDirection direction)
+CFileItem* CServerItem::GetIdleChild(bool immediateOnly, TransferDirection direction)
 {
-	int i = 0;
-	for (i = static_cast<int>(QueuePriority::count) - 1; i >= 0; --i) {
-		for (auto const& item : fileList[i]) {
-			if (item->IsActive())
-				continue;
-
-			if (direction == TransferDirection::both)
-				return item;
-
-			if (direction == TransferDirection::download)
-			{
-				if (item->Download())
-					return item;
-			}
-			else if (!item->Download())
-				return item;
+	// Immediate items first
+	for (int queued = 0; queued < (immediateOnly ? 1 : 2); ++queued) {
+		for (int i = static_cast<int>(QueuePriority::count) - 1; i >= 0; --i) {
+			QueuePriority const priority = static_cast<QueuePriority>(i);
+
+			CFileItem* download = 0;
+			if (direction != TransferDirection::upload)
+				download = m_idleLists[GetListIndex(queued != 0, true, priority)].front();
+			CFileItem* upload = 0;
+			if (direction != TransferDirection::download)
+				upload = m_idleLists[GetListIndex(queued != 0, false, priority)].front();
+
+			if (download && (!upload || download->m_idleSequence < upload->m_idleSequence))
+				return download;
+			if (upload)
+				return upload;
 		}
 	}
 	return 0;
 }
-}
-
-CFileItem* CServerItem::GetIdleChild(bool immediateOnly, TransferDirection direction)
-{
-	CFileItem* item = DoGetIdleChild(m_fileList[1], direction);
-	if( !item && !immediateOnly ) {
-		item = DoGetIdleChild(m_fileList[0], direction);
-	}
-	return item;
-}
 
 bool CServerItem::RemoveChild(CQueueItem* pItem, bool destroy /*=true*/)
 {
@@ -540,6 +678,8 @@ bool CServerItem::RemoveChild(CQueueItem* pItem, bool destroy /*=true*/)
 	{
 		CFileItem* pFileItem = static_cast<CFileItem*>(pItem);
 		RemoveFileItemFromList(pFileItem);
+		if (m_storage && pFileItem->GetParent() == this)
+			m_storage->RemoveFile(*pFileItem);
 	}
 
 	return CQueueItem::RemoveChild(pItem, destroy);
@@ -548,21 +688,27 @@ bool CServerItem::RemoveChild(CQueueItem* pItem, bool destroy /*=true*/)
 void CServerItem::QueueImmediateFiles()
 {
 	for (int i = 0; i < static_cast<int>(QueuePriority::count); ++i) {
-		std::list<CFileItem*> activeList;
-		std::list<CFileItem*>& fileList = m_fileList[1][i];
-		for (std::list<CFileItem*>::reverse_iterator iter = fileList.rbegin(); iter != fileList.rend(); ++iter) {
-			CFileItem* item = *iter;
-			wxASSERT(!item->queued());
-			if (item->IsActive())
-				activeList.push_front(item);
+		QueuePriority const priority = static_cast<QueuePriority>(i);
+		CIdleFileList& downloads = m_idleLists[GetListIndex(false, true, priority)];
+		CIdleFileList& uploads = m_idleLists[GetListIndex(false, false, priority)];
+
+		// Move to the front of the queued items starting with the last one,
+		// keeping the order of downloads and uploads relative to each other.
+		while (!downloads.empty() || !uploads.empty()) {
+			CFileItem* item;
+			if (uploads.empty() || (!downloads.empty() && downloads.back()->m_idleSequence > uploads.back()->m_idleSequence))
+				item = downloads.back();
 			else
-			{
-				item->set_queued(true);
-				m_fileList[0][i].push_front(item);
-			}
+				item = uploads.back();
+			wxASSERT(!item->queued());
+
+			RemoveFileItemFromList(item);
+			item->set_queued(true);
+			AddFileItemToList(item, true);
 		}
-		fileList = activeList;
 	}
+
+	// Active immediate items get queued once they are reset
 }
 
 void CServerItem::QueueImmediateFile(CFileItem* pItem)
@@ -570,18 +716,18 @@ void CServerItem::QueueImmediateFile(CFileItem* pItem)
 	if (pItem->queued())
 		return;
 
-	std::list<CFileItem*>& fileList = m_fileList[1][static_cast<int>(pItem->GetPriority())];
-	for (auto iter = fileList.begin(); iter != fileList.end(); ++iter)
-	{
-		if (*iter != pItem)
-			continue;
+	RemoveFileItemFromList(pItem);
+	pItem->set_queued(true);
+	AddFileItemToList(pItem, true);
+}
 
-		pItem->set_queued(true);
-		fileList.erase(iter);
-		m_fileList[0][static_cast<int>(pItem->GetPriority())].push_front(pItem);
+void CServerItem::QueueFirst(CFileItem* pItem)
+{
+	if (pItem->m_idleList < 0)
 		return;
-	}
-	wxASSERT(false);
+
+	RemoveFileItemFromList(pItem);
+	AddFileItemToList(pItem, true);
 }
 
 void CServerItem::SaveItem(TiXmlElement* pElement) const
@@ -598,32 +744,29 @@ void CServerItem::SaveItem(TiXmlElement* pElement) const
 wxLongLong CServerItem::GetTotalSize(int& filesWithUnknownSize, int& queuedFiles, int& folderScanCount) const
 {
 	wxLongLong totalSize = 0;
-	for (int i = 0; i < static_cast<int>(QueuePriority::count); ++i)
-	{
-		for (int j = 0; j < 2; j++)
-		{
-			const std::list<CFileItem*>& fileList = m_fileList[j][i];
-			for (std::list<CFileItem*>::const_iterator iter = fileList.begin(); iter != fileList.end(); ++iter)
-			{
-				const CFileItem* item = *iter;
-				wxLongLong size = item->GetSize();
-				if (size >= 0)
-					totalSize += size;
-				else
-					filesWithUnknownSize++;
-			}
-		}
-	}
-
 	for (std::vector<CQueueItem*>::const_iterator iter = m_children.begin() + m_removed_at_front; iter != m_children.end(); ++iter)
 	{
 		if ((*iter)->GetType() == QueueItemType::File ||
 			(*iter)->GetType() == QueueItemType::Folder)
+		{
 			queuedFiles++;
+
+			wxLongLong size = static_cast<CFileItem const*>(*iter)->GetSize();
+			if (size >= 0)
+				totalSize += size;
+			else
+				filesWithUnknownSize++;
+		}
 		else if ((*iter)->GetType() == QueueItemType::FolderScan)
 			folderScanCount++;
 	}
 
+	for (auto const& stored : m_storedFiles) {
+		queuedFiles += static_cast<int>(stored.count);
+		totalSize += stored.size;
+		filesWithUnknownSize += static_cast<int>(stored.unknownSize);
+	}
+
 	return totalSize;
 }
 
@@ -639,6 +782,8 @@ bool CServerItem::TryRemoveAll()
 			if (pItem->GetType() == QueueItemType::File || pItem->GetType() == QueueItemType::Folder) {
 				CFileItem* pFileItem = static_cast<CFileItem*>(pItem);
 				RemoveFileItemFromList(pFileItem);
+				if (m_storage)
+					m_storage->RemoveFile(*pFileItem);
 			}
 			delete pItem;
 		}
@@ -664,14 +809,20 @@ void CServerItem::DetachChildren()
 {
 	wxASSERT(!m_activeCount);
 
+	if (m_storage) {
+		for (auto iter = m_children.begin() + m_removed_at_front; iter != m_children.end(); ++iter) {
+			if ((*iter)->GetType() == QueueItemType::File || (*iter)->GetType() == QueueItemType::Folder)
+				m_storage->RemoveFile(*static_cast<CFileItem*>(*iter));
+		}
+	}
+
 	m_children.clear();
 	m_visibleOffspring = 0;
 	m_maxCachedIndex = -1;
 	m_removed_at_front = 0;
 
-	for (int i = 0; i < 2; i++)
-		for (int j = 0; j < static_cast<int>(QueuePriority::count); j++)
-			m_fileList[i][j].clear();
+	for (auto & list : m_idleLists)
+		list.clear();
 }
 
 void CServerItem::SetPriority(QueuePriority priority)
@@ -683,30 +834,38 @@ void CServerItem::SetPriority(QueuePriority priority)
 			((CFileItem*)(*iter))->SetPriorityRaw(priority);
 		else
 			(*iter)->SetPriority(priority);
+
+		if ((*iter)->GetType() == QueueItemType::File)
+			StoreChild(*static_cast<CFileItem*>(*iter));
 	}
 
-	for (int i = 0; i < 2; ++i)
-		for (int j = 0; j < static_cast<int>(QueuePriority::count); ++j) {
-			if (j != static_cast<int>(priority))
-				m_fileList[i][static_cast<int>(priority)].splice(m_fileList[i][static_cast<int>(priority)].end(), m_fileList[i][j]);
+	// Append the items of the other priorities, keeping their sequence numbers
+	for (int queued = 0; queued < 2; ++queued) {
+		for (int download = 0; download < 2; ++download) {
+			int const target = GetListIndex(queued != 0, download != 0, priority);
+			for (int j = 0; j < static_cast<int>(QueuePriority::count); ++j) {
+				int const source = GetListIndex(queued != 0, download != 0, static_cast<QueuePriority>(j));
+				if (source == target)
+					continue;
+
+				while (!m_idleLists[source].empty()) {
+					CFileItem* item = m_idleLists[source].front();
+					m_idleLists[source].remove(item);
+					m_idleLists[target].push_back(item);
+					item->m_idleList = target;
+				}
+			}
 		}
+	}
 }
 
-void CServerItem::SetChildPriority(CFileItem* pItem, QueuePriority oldPriority, QueuePriority newPriority)
+void CServerItem::SetChildPriority(CFileItem* pItem, QueuePriority, QueuePriority newPriority)
 {
-	int i = pItem->queued() ? 0 : 1;
-
-	for (auto iter = m_fileList[i][static_cast<int>(oldPriority)].begin(); iter != m_fileList[i][static_cast<int>(oldPriority)].end(); ++iter)
-	{
-		if (*iter != pItem)
-			continue;
-
-		m_fileList[i][static_cast<int>(oldPriority)].erase(iter);
-		m_fileList[i][static_cast<int>(newPriority)].push_back(pItem);
+	if (pItem->m_idleList < 0)
 		return;
-	}
 
-	wxFAIL;
+	RemoveFileItemFromList(pItem);
+	AddFileItemToList(pItem, GetListIndex(pItem->queued(), pItem->Download(), newPriority), false);
 }
 
 CFolderScanItem::CFolderScanItem(CServerItem* parent, bool queued, bool download, const CLocalPath& localPath, const CServerPath& remotePath)
@@ -848,6 +1007,10 @@ wxString CQueueViewBase::OnGetItemText(CQueueItem* pItem, ColumnId column) const
 			switch (column)
 			{
 			case colLocalName:
+				if (pFileItem->GetSegment()) {
+					auto const& segment = *pFileItem->GetSegment();
+					return _T("  ") + pFileItem->GetLocalPath().GetPath() + pFileItem->GetLocalFile() + _T(" ") + wxString::Format(_("(part %d of %d)"), segment.index + 1, segment.count);
+				}
 				return _T("  ") + pFileItem->GetLocalPath().GetPath() + pFileItem->GetLocalFile();
 			case colDirection:
 				if (pFileItem->Download())
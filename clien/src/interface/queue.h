@@ -5,6 +5,7 @@
 #include "listctrlex.h"
 #include "edithandler.h"
 #include "optional.h"
+#include "transfer_segment.h"
 
 enum class QueuePriority : char {
 	lowest,
@@ -74,7 +75,8 @@ protected:
 		int index;
 		int child;
 	};
-	std::vector<t_cacheItem> m_lookupCache;
+	// Only allocated once needed, file items never need it.
+	CSparseOptional<std::vector<t_cacheItem>> m_lookupCache;
 
 	friend class CServerItem;
 
@@ -90,6 +92,27 @@ private:
 };
 
 class CFileItem;
+class CQueueStorage;
+
+// Intrusive list of idle file items, the links are kept in the items
+// themselves so that items can be unlinked in constant time.
+class CIdleFileList final
+{
+public:
+	CFileItem* front() const { return m_first; }
+	CFileItem* back() const { return m_last; }
+	bool empty() const { return !m_first; }
+
+	void push_front(CFileItem* pItem);
+	void push_back(CFileItem* pItem);
+	void remove(CFileItem* pItem);
+	void clear() { m_first = m_last = 0; }
+
+private:
+	CFileItem* m_first{};
+	CFileItem* m_last{};
+};
+
 class CServerItem : public CQueueItem
 {
 public:
@@ -121,18 +144,56 @@ public:
 
 	void SetChildPriority(CFileItem* pItem, QueuePriority oldPriority, QueuePriority newPriority);
 
+	// Takes active items out of the idle lists, items becoming idle again
+	// are put at the front.
+	void SetChildActive(CFileItem* pItem, bool active);
+
+	// Moves the item to the front of the idle items with the same priority
+	void QueueFirst(CFileItem* pItem);
+
+	// Changes to the server and its files get written to the storage
+	// from then on, until the item gets destroyed.
+	void SetStorage(CQueueStorage* storage);
+
+	// Call after changing an item in a way that gets saved in the queue
+	void StoreChild(CFileItem const& item);
+
+	// Files of the saved queue not loaded yet, one entry for each row of
+	// the server in the storage. They get loaded in pages as needed.
+	struct t_storedFiles final
+	{
+		int64_t server{}; // Row id of the server
+		int64_t last{};   // Id of the last file loaded
+		int64_t max{};    // Id of the last file of the row when the queue got loaded
+		int64_t count{};
+		int64_t size{};
+		int64_t unknownSize{}; // Files with unknown size and folders
+	};
+	std::vector<t_storedFiles> m_storedFiles;
+
 	int m_activeCount;
 
 protected:
-	void AddFileItemToList(CFileItem* pItem);
+	void AddFileItemToList(CFileItem* pItem, bool front = false);
+	void AddFileItemToList(CFileItem* pItem, int list, bool front);
 	void RemoveFileItemFromList(CFileItem* pItem);
 
+	static int GetListIndex(bool queued, bool download, QueuePriority priority);
+
 	CServer m_server;
 
-	// array of item lists, sorted by priority. Used by scheduler to find
-	// next file to transfer
-	// First index specifies whether the item is queued (0) or immediate (1)
-	std::list<CFileItem*> m_fileList[2][static_cast<int>(QueuePriority::count)];
+	// Lists of idle file items, used by the scheduler to find the next file
+	// to transfer. Indexed by GetListIndex, that is by whether the item is
+	// queued or immediate, by direction and by priority. Active items are not
+	// in any list.
+	CIdleFileList m_idleLists[2 * 2 * static_cast<int>(QueuePriority::count)];
+
+	// Sequence numbers for the items at the front and at the back of the lists,
+	// needed to pick the older item if both directions are wanted.
+	int64_t m_frontSequence{};
+	int64_t m_backSequence{};
+
+	CQueueStorage* m_storage{};
 };
 
 struct t_EngineData;
@@ -150,10 +211,10 @@ public:
 	void SetPriorityRaw(QueuePriority priority);
 	QueuePriority GetPriority() const;
 
-	const wxString& GetLocalFile() const { return !Download() ? GetSourceFile() : (m_targetFile ? *m_targetFile : m_sourceFile); }
-	const wxString& GetRemoteFile() const { return Download() ? GetSourceFile() : (m_targetFile ? *m_targetFile : m_sourceFile); }
-	const wxString& GetSourceFile() const { return m_sourceFile; }
-	CSparseOptional<wxString> const& GetTargetFile() const { return m_targetFile; }
+	wxString GetLocalFile() const { return Download() ? GetTargetOrSourceFile() : GetSourceFile(); }
+	wxString GetRemoteFile() const { return Download() ? GetSourceFile() : GetTargetOrSourceFile(); }
+	wxString GetSourceFile() const;
+	wxString GetTargetFile() const; // Empty if there is no separate target name
 	const CLocalPath& GetLocalPath() const { return m_localPath; }
 	const CServerPath& GetRemotePath() const { return m_remotePath; }
 	const wxLongLong& GetSize() const { return m_size; }
@@ -204,7 +265,8 @@ public:
 		local_file_unwriteable,
 		could_not_start,
 		transferring,
-		creating_dir
+		creating_dir,
+		incomplete
 	};
 
 	wxString const& GetStatusMessage() const;
@@ -229,6 +291,9 @@ protected:
 	char flags{};
 	Status m_status{};
 
+	// Index of the idle list of the parent server item the item is in, -1 if none
+	signed char m_idleList{-1};
+
 public:
 	t_EngineData* m_pEngineData{};
 
@@ -254,12 +319,33 @@ public:
 		}
 	}
 
+	typedef CTransferSegment t_segment;
+
+	CSparseOptional<t_segment> const& GetSegment() const { return m_segment; }
+	CSparseOptional<t_segment>& GetSegment() { return m_segment; }
+	void SetSegment(t_segment const& segment) { m_segment = CSparseOptional<t_segment>(segment); }
+
 protected:
-	wxString const m_sourceFile;
-	CSparseOptional<wxString> m_targetFile;
+	wxString GetTargetOrSourceFile() const;
+
+	// Source and target name in a single allocation, both UTF-8 encoded
+	// and null-terminated. The target name is empty if it is the same as
+	// the source name.
+	std::unique_ptr<char[]> m_names;
+
 	CLocalPath const m_localPath;
 	CServerPath const m_remotePath;
 	wxLongLong m_size;
+	CSparseOptional<t_segment> m_segment;
+
+private:
+	friend class CIdleFileList;
+	friend class CServerItem;
+
+	// Links and position in the idle lists of the parent server item
+	CFileItem* m_prevIdle{};
+	CFileItem* m_nextIdle{};
+	int64_t m_idleSequence{};
 };
 
 class CFolderItem : public CFileItem
@@ -341,7 +427,7 @@ public:
 	virtual ~CQueueViewBase();
 
 	// Gets item for given server or creates new if it doesn't exist
-	CServerItem* CreateServerItem(const CServer& server);
+	virtual CServerItem* CreateServerItem(const CServer& server);
 
 	virtual void InsertItem(CServerItem* pServerItem, CQueueItem* pItem);
 	virtual bool RemoveItem(CQueueItem* pItem, bool destroy, bool updateItemCount = true, bool updateSelections = true);
@@ -3,8 +3,11 @@
 #include "Options.h"
 #include "queue.h"
 
+#include "mutex.h"
+
 #include <sqlite3.h>
 #include <wx/wx.h>
+#include <wx/snglinst.h>
 
 #include <unordered_map>
 
@@ -48,7 +51,10 @@ namespace server_table_column_names
 		encoding,
 		bypass_proxy,
 		post_login_commands,
-		name
+		name,
+		speed_limit_inbound,
+		speed_limit_outbound,
+		owner
 	};
 }
 
@@ -68,7 +74,10 @@ _column server_table_columns[] = {
 	{ _T("encoding"), Column_type::text, 0 },
 	{ _T("bypass_proxy"), Column_type::integer, 0 },
 	{ _T("post_login_commands"), Column_type::text, 0 },
-	{ _T("name"), Column_type::text, 0 }
+	{ _T("name"), Column_type::text, 0 },
+	{ _T("speed_limit_inbound"), Column_type::integer, 0 },
+	{ _T("speed_limit_outbound"), Column_type::integer, 0 },
+	{ _T("owner"), Column_type::text, 0 }
 };
 
 namespace file_table_column_names
@@ -86,8 +95,18 @@ namespace file_table_column_names
 		error_count,
 		priority,
 		ascii_file,
-		default_exists_action
+		default_exists_action,
+		segment_offset,
+		segment_length,
+		segment_done,
+		segment_index,
+		segment_count,
+		segment_file_size,
+		segment_failed
 	};
+
+	// Bound and read through BindTransferSegment and ParseTransferSegment
+	static_assert(segment_failed - segment_offset + 1 == transfer_segment_columns::count, "Segment columns out of sync");
 }
 
 _column file_table_columns[] = {
@@ -102,7 +121,14 @@ _column file_table_columns[] = {
 	{ _T("error_count"), Column_type::integer, 0 },
 	{ _T("priority"), Column_type::integer, 0 },
 	{ _T("ascii_file"), Column_type::integer, 0 },
-	{ _T("default_exists_action"), Column_type::integer, 0 }
+	{ _T("default_exists_action"), Column_type::integer, 0 },
+	{ _T("segment_offset"), Column_type::integer, 0 },
+	{ _T("segment_length"), Column_type::integer, 0 },
+	{ _T("segment_done"), Column_type::integer, 0 },
+	{ _T("segment_index"), Column_type::integer, 0 },
+	{ _T("segment_count"), Column_type::integer, 0 },
+	{ _T("segment_file_size"), Column_type::integer, 0 },
+	{ _T("segment_failed"), Column_type::integer, 0 }
 };
 
 namespace path_table_column_names
@@ -127,6 +153,41 @@ struct fast_equal
 	}
 };
 
+namespace {
+// How long changes are collected before they get written
+int const journal_delay_ms = 500;
+
+// Seconds between explicit WAL checkpoints
+int const checkpoint_interval = 60;
+
+// A change to the queue, with a copy of the changed item.
+// The keys identify queue items, they are never dereferenced.
+struct t_journalEntry final
+{
+	enum type : char {
+		server,
+		remove_server,
+		file,
+		remove_file,
+		adopt_file,
+		remove_stored_files
+	};
+
+	t_journalEntry(type t, void const* key, void const* serverKey = 0)
+		: type_(t), key_(key), serverKey_(serverKey)
+	{}
+
+	type type_;
+	void const* key_;
+	void const* serverKey_;
+	int64_t id_{}; // Row id for adopt_file and remove_stored_files
+	int64_t after_{}; // Files after this id for remove_stored_files...
+	int64_t max_{}; // ...up to this one
+	std::unique_ptr<CServer> server_;
+	std::unique_ptr<CFileItem> file_;
+};
+}
+
 class CQueueStorage::Impl
 {
 public:
@@ -152,18 +213,23 @@ public:
 	sqlite3_stmt* PrepareStatement(const wxString& query);
 	sqlite3_stmt* PrepareInsertStatement(const wxString& name, const _column*, unsigned int count);
 
-	bool SaveServer(const CServerItem& item);
-	bool SaveFile(wxLongLong server, const CFileItem& item);
-	bool SaveDirectory(wxLongLong server, const CFolderItem& item);
+	sqlite3_stmt* PrepareUpdateStatement(const wxString& name, const _column*, unsigned int count);
+
+	// Return the id of the new row, -1 on failure
+	int64_t SaveServer(const CServer& server, bool kiosk_mode, wxString const& owner);
+
+	// Statement is either the insert or the update statement of the files table
+	bool SaveFile(sqlite3_stmt* statement, int64_t server, const CFileItem& item);
+	bool SaveDirectory(sqlite3_stmt* statement, int64_t server, const CFolderItem& item);
+	bool Step(sqlite3_stmt* statement);
 
 	int64_t SaveLocalPath(const CLocalPath& path);
 	int64_t SaveRemotePath(const CServerPath& path);
 
-	void ReadLocalPaths();
-	void ReadRemotePaths();
-
-	const CLocalPath& GetLocalPath(int64_t id) const;
-	const CServerPath& GetRemotePath(int64_t id) const;
+	// Paths are looked up as needed, loading only parts of the queue
+	// doesn't need all of them.
+	const CLocalPath& GetLocalPath(int64_t id);
+	const CServerPath& GetRemotePath(int64_t id);
 
 	bool Bind(sqlite3_stmt* statement, int index, int value);
 	bool Bind(sqlite3_stmt* statement, int index, int64_t value);
@@ -180,7 +246,21 @@ public:
 
 	bool MigrateSchema();
 
+	// Ownership of rows by running instances
+	bool CreateOwner();
+	bool IsOwnerRunning(wxString const& owner) const;
+	void ReleaseStaleOwners();
+	bool RemoveOwnRows();
+
+	// Journal, the write functions are called on the journal thread
+	void AddJournalEntry(t_journalEntry && entry);
+	void JournalLoop();
+	void RemoveUnusedPaths();
+	bool WriteJournal(std::vector<t_journalEntry> & entries);
+	bool WriteJournalEntry(t_journalEntry const& entry);
+
 	sqlite3* db_;
+	std::string filename_;
 
 	sqlite3_stmt* insertServerQuery_;
 	sqlite3_stmt* insertFileQuery_;
@@ -192,6 +272,21 @@ public:
 	sqlite3_stmt* selectLocalPathQuery_;
 	sqlite3_stmt* selectRemotePathQuery_;
 
+	sqlite3_stmt* updateFileQuery_{};
+	sqlite3_stmt* deleteFileQuery_{};
+	sqlite3_stmt* deleteServerFilesQuery_{};
+	sqlite3_stmt* deleteServerQuery_{};
+	sqlite3_stmt* setOwnerQuery_{};
+	sqlite3_stmt* findLocalPathQuery_{};
+	sqlite3_stmt* findRemotePathQuery_{};
+	sqlite3_stmt* selectFileSummaryQuery_{};
+	sqlite3_stmt* selectLastFileQuery_{};
+	sqlite3_stmt* selectFileDirectionQuery_{};
+
+	// Serializes the use of the database connection by the journal thread
+	// and loading parts of the queue.
+	mutex dbSync_{false};
+
 #ifndef __WXMSW__
 	wxMBConvUTF16 utf16_;
 #endif
@@ -204,76 +299,118 @@ public:
 
 	std::map<int64_t, CLocalPath> reverseLocalPaths_;
 	std::map<int64_t, CServerPath> reverseRemotePaths_;
-};
 
+	// Identifies this instance in the owner column of the servers table.
+	// Other instances check whether the owner is still running through the
+	// instance checker.
+	wxString owner_;
+	std::unique_ptr<wxSingleInstanceChecker> instanceChecker_;
+
+	class CJournalThread;
+	CJournalThread* journalThread_{};
+
+	mutex journalSync_{false};
+	condition journalCondition_;
+	std::vector<t_journalEntry> journal_;
+	bool journalQuit_{};
+	sqlite3* cleanupDb_{}; // Connection used by RemoveUnusedPaths, to interrupt it on quit
+
+	// Only accessed by the journal thread once it is running
+	bool journalFailed_{};
+	bool kioskMode_{};
+	bool removeUnusedPaths_{};
+	wxDateTime lastCheckpoint_;
+	std::unordered_map<void const*, int64_t> serverIds_;
+	std::unordered_map<void const*, int64_t> fileIds_;
+};
 
-void CQueueStorage::Impl::ReadLocalPaths()
+class CQueueStorage::Impl::CJournalThread final : public wxThread
 {
-	if (!selectLocalPathQuery_)
-		return;
+public:
+	CJournalThread(Impl& impl)
+		: wxThread(wxTHREAD_JOINABLE)
+		, impl_(impl)
+	{
+	}
 
-	int res;
-	do
+protected:
+	virtual ExitCode Entry()
 	{
-		res = sqlite3_step(selectLocalPathQuery_);
-		if (res == SQLITE_ROW)
-		{
-			int64_t id = GetColumnInt64(selectLocalPathQuery_, path_table_column_names::id);
-			wxString localPathRaw = GetColumnText(selectLocalPathQuery_, path_table_column_names::path);
-			CLocalPath localPath;
-			if (id > 0 && !localPathRaw.empty() && localPath.SetPath(localPathRaw))
-				reverseLocalPaths_[id] = localPath;
-		}
+		impl_.JournalLoop();
+		return 0;
 	}
-	while (res == SQLITE_BUSY || res == SQLITE_ROW);
 
-	sqlite3_reset(selectLocalPathQuery_);
-}
+	Impl& impl_;
+};
 
 
-void CQueueStorage::Impl::ReadRemotePaths()
+const CLocalPath& CQueueStorage::Impl::GetLocalPath(int64_t id)
 {
-	if (!selectRemotePathQuery_)
-		return;
+	std::map<int64_t, CLocalPath>::const_iterator it = reverseLocalPaths_.find(id);
+	if (it != reverseLocalPaths_.end())
+		return it->second;
+
+	static const CLocalPath empty;
+	if (id <= 0 || !selectLocalPathQuery_)
+		return empty;
+
+	Bind(selectLocalPathQuery_, 1, id);
 
 	int res;
 	do
 	{
-		res = sqlite3_step(selectRemotePathQuery_);
-		if (res == SQLITE_ROW)
-		{
-			int64_t id = GetColumnInt64(selectRemotePathQuery_, path_table_column_names::id);
-			wxString remotePathRaw = GetColumnText(selectRemotePathQuery_, path_table_column_names::path);
-			CServerPath remotePath;
-			if (id > 0 && !remotePathRaw.empty() && remotePath.SetSafePath(remotePathRaw))
-				reverseRemotePaths_[id] = remotePath;
-		}
+		res = sqlite3_step(selectLocalPathQuery_);
 	}
-	while (res == SQLITE_BUSY || res == SQLITE_ROW);
+	while (res == SQLITE_BUSY);
 
-	sqlite3_reset(selectRemotePathQuery_);
-}
+	CLocalPath localPath;
+	if (res == SQLITE_ROW)
+	{
+		wxString localPathRaw = GetColumnText(selectLocalPathQuery_, path_table_column_names::path);
+		if (localPathRaw.empty() || !localPath.SetPath(localPathRaw))
+			localPath.clear();
+	}
+	sqlite3_reset(selectLocalPathQuery_);
 
+	if (localPath.empty())
+		return empty;
 
-const CLocalPath& CQueueStorage::Impl::GetLocalPath(int64_t id) const
-{
-	std::map<int64_t, CLocalPath>::const_iterator it = reverseLocalPaths_.find(id);
-	if (it != reverseLocalPaths_.end())
-		return it->second;
-
-	static const CLocalPath empty;
-	return empty;
+	return reverseLocalPaths_[id] = localPath;
 }
 
 
-const CServerPath& CQueueStorage::Impl::GetRemotePath(int64_t id) const
+const CServerPath& CQueueStorage::Impl::GetRemotePath(int64_t id)
 {
 	std::map<int64_t, CServerPath>::const_iterator it = reverseRemotePaths_.find(id);
 	if (it != reverseRemotePaths_.end())
 		return it->second;
 
 	static const CServerPath empty;
-	return empty;
+	if (id <= 0 || !selectRemotePathQuery_)
+		return empty;
+
+	Bind(selectRemotePathQuery_, 1, id);
+
+	int res;
+	do
+	{
+		res = sqlite3_step(selectRemotePathQuery_);
+	}
+	while (res == SQLITE_BUSY);
+
+	CServerPath remotePath;
+	if (res == SQLITE_ROW)
+	{
+		wxString remotePathRaw = GetColumnText(selectRemotePathQuery_, path_table_column_names::path);
+		if (remotePathRaw.empty() || !remotePath.SetSafePath(remotePathRaw))
+			remotePath.clear();
+	}
+	sqlite3_reset(selectRemotePathQuery_);
+
+	if (remotePath.empty())
+		return empty;
+
+	return reverseRemotePaths_[id] = remotePath;
 }
 
 
@@ -295,8 +432,34 @@ bool CQueueStorage::Impl::MigrateSchema()
 	if (sqlite3_exec(db_, "PRAGMA user_version", int_callback, &version, 0) != SQLITE_OK)
 		return false;
 
-	if (version < 1)
-		return sqlite3_exec(db_, "PRAGMA user_version = 1", 0, 0, 0) == SQLITE_OK;
+	if (version < 2) {
+		// Version 2 adds the segment columns to the files table. Errors are
+		// ignored, the table might not exist yet.
+		char const* const columns[] = { "segment_offset", "segment_length", "segment_done", "segment_index", "segment_count" };
+		for (auto const& column : columns) {
+			std::string query = std::string("ALTER TABLE files ADD COLUMN ") + column + " INTEGER";
+			sqlite3_exec(db_, query.c_str(), 0, 0, 0);
+		}
+	}
+
+	if (version < 3) {
+		// Version 3 adds the speed limits to the servers table
+		sqlite3_exec(db_, "ALTER TABLE servers ADD COLUMN speed_limit_inbound INTEGER", 0, 0, 0);
+		sqlite3_exec(db_, "ALTER TABLE servers ADD COLUMN speed_limit_outbound INTEGER", 0, 0, 0);
+	}
+
+	if (version < 4) {
+		// Version 4 adds the instance owning the rows of a server
+		sqlite3_exec(db_, "ALTER TABLE servers ADD COLUMN owner TEXT", 0, 0, 0);
+	}
+
+	if (version < 5) {
+		// Version 5 adds the size of the whole file and the failure of
+		// another segment to the segment columns
+		sqlite3_exec(db_, "ALTER TABLE files ADD COLUMN segment_file_size INTEGER", 0, 0, 0);
+		sqlite3_exec(db_, "ALTER TABLE files ADD COLUMN segment_failed INTEGER", 0, 0, 0);
+		return sqlite3_exec(db_, "PRAGMA user_version = 5", 0, 0, 0) == SQLITE_OK;
+	}
 
 	return true;
 }
@@ -317,9 +480,22 @@ int64_t CQueueStorage::Impl::SaveLocalPath(const CLocalPath& path)
 	if (it != localPaths_.end())
 		return it->second;
 
+	// Other instances might have stored the path already
+	Bind(findLocalPathQuery_, 1, path.GetPath());
+	int res;
+	do {
+		res = sqlite3_step(findLocalPathQuery_);
+	} while (res == SQLITE_BUSY);
+	if (res == SQLITE_ROW) {
+		int64_t id = GetColumnInt64(findLocalPathQuery_, 0);
+		sqlite3_reset(findLocalPathQuery_);
+		localPaths_[path.GetPath()] = id;
+		return id;
+	}
+	sqlite3_reset(findLocalPathQuery_);
+
 	Bind(insertLocalPathQuery_, path_table_column_names::path, path.GetPath());
 
-	int res;
 	do {
 		res = sqlite3_step(insertLocalPathQuery_);
 	} while (res == SQLITE_BUSY);
@@ -344,9 +520,21 @@ int64_t CQueueStorage::Impl::SaveRemotePath(const CServerPath& path)
 	if (it != remotePaths_.end())
 		return it->second;
 
+	Bind(findRemotePathQuery_, 1, safePath);
+	int res;
+	do {
+		res = sqlite3_step(findRemotePathQuery_);
+	} while (res == SQLITE_BUSY);
+	if (res == SQLITE_ROW) {
+		int64_t id = GetColumnInt64(findRemotePathQuery_, 0);
+		sqlite3_reset(findRemotePathQuery_);
+		remotePaths_[safePath] = id;
+		return id;
+	}
+	sqlite3_reset(findRemotePathQuery_);
+
 	Bind(insertRemotePathQuery_, path_table_column_names::path, safePath);
 
-	int res;
 	do {
 		res = sqlite3_step(insertRemotePathQuery_);
 	} while (res == SQLITE_BUSY);
@@ -410,6 +598,12 @@ void CQueueStorage::Impl::CreateTables()
 		if (sqlite3_exec(db_, query.ToUTF8(), 0, 0, 0) != SQLITE_OK)
 		{
 		}
+
+		// Covers the summary of the files not loaded yet
+		query = _T("CREATE INDEX IF NOT EXISTS server_size_index ON files (server, size)");
+		if (sqlite3_exec(db_, query.ToUTF8(), 0, 0, 0) != SQLITE_OK)
+		{
+		}
 	}
 
 	{
@@ -419,6 +613,11 @@ void CQueueStorage::Impl::CreateTables()
 		if (sqlite3_exec(db_, query.ToUTF8(), 0, 0, 0) != SQLITE_OK)
 		{
 		}
+
+		query = _T("CREATE INDEX IF NOT EXISTS local_path_index ON local_paths (path)");
+		if (sqlite3_exec(db_, query.ToUTF8(), 0, 0, 0) != SQLITE_OK)
+		{
+		}
 	}
 
 	{
@@ -428,6 +627,11 @@ void CQueueStorage::Impl::CreateTables()
 		if (sqlite3_exec(db_, query.ToUTF8(), 0, 0, 0) != SQLITE_OK)
 		{
 		}
+
+		query = _T("CREATE INDEX IF NOT EXISTS remote_path_index ON remote_paths (path)");
+		if (sqlite3_exec(db_, query.ToUTF8(), 0, 0, 0) != SQLITE_OK)
+		{
+		}
 	}
 }
 
@@ -457,6 +661,26 @@ sqlite3_stmt* CQueueStorage::Impl::PrepareInsertStatement(const wxString& name,
 }
 
 
+sqlite3_stmt* CQueueStorage::Impl::PrepareUpdateStatement(const wxString& name, const _column* columns, unsigned int count)
+{
+	if (!db_)
+		return 0;
+
+	// Same parameter indexes as the insert statement, followed by the id
+	wxString query = _T("UPDATE ") + name + _T(" SET ");
+	for (unsigned int i = 1; i < count; ++i)
+	{
+		if (i > 1)
+			query += _T(", ");
+		query += columns[i].name;
+		query += wxString(_T("=:")) + columns[i].name;
+	}
+	query += wxString(_T(" WHERE ")) + columns[0].name + _T("=:") + columns[0].name;
+
+	return PrepareStatement(query);
+}
+
+
 sqlite3_stmt* CQueueStorage::Impl::PrepareStatement(const wxString& query)
 {
 	sqlite3_stmt* ret = 0;
@@ -486,6 +710,19 @@ bool CQueueStorage::Impl::PrepareStatements()
 	if (!insertServerQuery_ || !insertFileQuery_ || !insertLocalPathQuery_ || !insertRemotePathQuery_)
 		return false;
 
+	updateFileQuery_ = PrepareUpdateStatement(_T("files"), file_table_columns, sizeof(file_table_columns) / sizeof(_column));
+	deleteFileQuery_ = PrepareStatement(_T("DELETE FROM files WHERE id=:id"));
+	deleteServerFilesQuery_ = PrepareStatement(_T("DELETE FROM files WHERE server=:server"));
+	deleteServerQuery_ = PrepareStatement(_T("DELETE FROM servers WHERE id=:id"));
+	setOwnerQuery_ = PrepareStatement(_T("UPDATE servers SET owner=:owner WHERE id=:id"));
+	findLocalPathQuery_ = PrepareStatement(_T("SELECT id FROM local_paths WHERE path=:path"));
+	findRemotePathQuery_ = PrepareStatement(_T("SELECT id FROM remote_paths WHERE path=:path"));
+	if (!updateFileQuery_ || !deleteFileQuery_ || !deleteServerFilesQuery_ || !deleteServerQuery_ ||
+		!setOwnerQuery_ || !findLocalPathQuery_ || !findRemotePathQuery_)
+	{
+		return false;
+	}
+
 	{
 		wxString query = _T("SELECT ");
 		for (unsigned int i = 0; i < (sizeof(server_table_columns) / sizeof(_column)); ++i)
@@ -495,7 +732,7 @@ bool CQueueStorage::Impl::PrepareStatements()
 			query += server_table_columns[i].name;
 		}
 
-		query += _T(" FROM servers ORDER BY id ASC");
+		query += _T(" FROM servers WHERE owner IS NULL ORDER BY id ASC");
 
 		if (!(selectServersQuery_ = PrepareStatement(query)))
 			return false;
@@ -510,23 +747,43 @@ bool CQueueStorage::Impl::PrepareStatements()
 			query += file_table_columns[i].name;
 		}
 
-		query += _T(" FROM files WHERE server=:server ORDER BY id ASC");
+		query += _T(" FROM files WHERE server=:server AND id>:after AND id<=:max ORDER BY id ASC LIMIT :limit");
 
 		if (!(selectFilesQuery_ = PrepareStatement(query)))
 			return false;
 	}
 
 	{
-		wxString query = _T("SELECT id, path FROM local_paths");
+		wxString query = _T("SELECT id, path FROM local_paths WHERE id=:id");
 		if (!(selectLocalPathQuery_ = PrepareStatement(query)))
 			return false;
 	}
 
 	{
-		wxString query = _T("SELECT id, path FROM remote_paths");
+		wxString query = _T("SELECT id, path FROM remote_paths WHERE id=:id");
 		if (!(selectRemotePathQuery_ = PrepareStatement(query)))
 			return false;
 	}
+
+	{
+		// Served from server_size_index alone
+		wxString query = _T("SELECT COUNT(*), SUM(size), COUNT(*) - COUNT(size) FROM files WHERE server=:server AND id>:after AND id<=:max");
+		if (!(selectFileSummaryQuery_ = PrepareStatement(query)))
+			return false;
+	}
+
+	{
+		wxString query = _T("SELECT MAX(id) FROM files WHERE server=:server");
+		if (!(selectLastFileQuery_ = PrepareStatement(query)))
+			return false;
+	}
+
+	{
+		// Looks at no more rows than the limit
+		wxString query = _T("SELECT 1 FROM (SELECT download FROM files WHERE server=:server AND id>:after AND id<=:max ORDER BY id ASC LIMIT :limit) WHERE download=:download LIMIT 1");
+		if (!(selectFileDirectionQuery_ = PrepareStatement(query)))
+			return false;
+	}
 	return true;
 }
 
@@ -579,12 +836,8 @@ bool CQueueStorage::Impl::BindNull(sqlite3_stmt* statement, int index)
 }
 
 
-bool CQueueStorage::Impl::SaveServer(const CServerItem& item)
+int64_t CQueueStorage::Impl::SaveServer(const CServer& server, bool kiosk_mode, wxString const& owner)
 {
-	bool kiosk_mode = COptions::Get()->GetOptionVal(OPTION_DEFAULT_KIOSKMODE) != 0;
-
-	const CServer& server = item.GetServer();
-
 	Bind(insertServerQuery_, server_table_column_names::host, server.GetHost());
 	Bind(insertServerQuery_, server_table_column_names::port, static_cast<int>(server.GetPort()));
 	Bind(insertServerQuery_, server_table_column_names::protocol, static_cast<int>(server.GetProtocol()));
@@ -680,116 +933,116 @@ bool CQueueStorage::Impl::SaveServer(const CServerItem& item)
 	else
 		BindNull(insertServerQuery_, server_table_column_names::name);
 
+	if (server.GetInboundSpeedLimit())
+		Bind(insertServerQuery_, server_table_column_names::speed_limit_inbound, server.GetInboundSpeedLimit());
+	else
+		BindNull(insertServerQuery_, server_table_column_names::speed_limit_inbound);
+	if (server.GetOutboundSpeedLimit())
+		Bind(insertServerQuery_, server_table_column_names::speed_limit_outbound, server.GetOutboundSpeedLimit());
+	else
+		BindNull(insertServerQuery_, server_table_column_names::speed_limit_outbound);
+
+	if (!owner.empty())
+		Bind(insertServerQuery_, server_table_column_names::owner, owner);
+	else
+		BindNull(insertServerQuery_, server_table_column_names::owner);
+
+	if (!Step(insertServerQuery_))
+		return -1;
+
+	return sqlite3_last_insert_rowid(db_);
+}
+
+
+bool CQueueStorage::Impl::Step(sqlite3_stmt* statement)
+{
 	int res;
 	do {
-		res = sqlite3_step(insertServerQuery_);
+		res = sqlite3_step(statement);
 	} while (res == SQLITE_BUSY);
 
-	sqlite3_reset(insertServerQuery_);
-
-	bool ret = res == SQLITE_DONE;
-	if (ret)
-	{
-		sqlite3_int64 serverId = sqlite3_last_insert_rowid(db_);
-		Bind(insertFileQuery_, file_table_column_names::server, static_cast<int64_t>(serverId));
+	sqlite3_reset(statement);
 
-		const std::vector<CQueueItem*>& children = item.GetChildren();
-		for (std::vector<CQueueItem*>::const_iterator it = children.begin() + item.GetRemovedAtFront(); it != children.end(); ++it)
-		{
-			CQueueItem* item = *it;
-			if (item->GetType() == QueueItemType::File)
-				ret &= SaveFile(serverId, *static_cast<CFileItem*>(item));
-			else if (item->GetType() == QueueItemType::Folder)
-				ret &= SaveDirectory(serverId, *static_cast<CFolderItem*>(item));
-		}
-	}
-	return ret;
+	return res == SQLITE_DONE;
 }
 
 
-bool CQueueStorage::Impl::SaveFile(wxLongLong server, const CFileItem& file)
+bool CQueueStorage::Impl::SaveFile(sqlite3_stmt* statement, int64_t server, const CFileItem& file)
 {
 	if (file.m_edit != CEditHandler::none)
 		return true;
 
-	Bind(insertFileQuery_, file_table_column_names::source_file, file.GetSourceFile());
-	auto const& targetFile = file.GetTargetFile();
-	if (targetFile)
-		Bind(insertFileQuery_, file_table_column_names::target_file, *targetFile);
+	Bind(statement, file_table_column_names::server, server);
+	Bind(statement, file_table_column_names::source_file, file.GetSourceFile());
+	wxString const targetFile = file.GetTargetFile();
+	if (!targetFile.empty())
+		Bind(statement, file_table_column_names::target_file, targetFile);
 	else
-		BindNull(insertFileQuery_, file_table_column_names::target_file);
+		BindNull(statement, file_table_column_names::target_file);
 
 	int64_t localPathId = SaveLocalPath(file.GetLocalPath());
 	int64_t remotePathId = SaveRemotePath(file.GetRemotePath());
 	if (localPathId == -1 || remotePathId == -1)
 		return false;
 
-	Bind(insertFileQuery_, file_table_column_names::local_path, localPathId);
-	Bind(insertFileQuery_, file_table_column_names::remote_path, remotePathId);
+	Bind(statement, file_table_column_names::local_path, localPathId);
+	Bind(statement, file_table_column_names::remote_path, remotePathId);
 
-	Bind(insertFileQuery_, file_table_column_names::download, file.Download() ? 1 : 0);
+	Bind(statement, file_table_column_names::download, file.Download() ? 1 : 0);
 	if (file.GetSize() != -1)
-		Bind(insertFileQuery_, file_table_column_names::size, static_cast<int64_t>(file.GetSize().GetValue()));
+		Bind(statement, file_table_column_names::size, static_cast<int64_t>(file.GetSize().GetValue()));
 	else
-		BindNull(insertFileQuery_, file_table_column_names::size);
+		BindNull(statement, file_table_column_names::size);
 	if (file.m_errorCount)
-		Bind(insertFileQuery_, file_table_column_names::error_count, file.m_errorCount);
+		Bind(statement, file_table_column_names::error_count, file.m_errorCount);
 	else
-		BindNull(insertFileQuery_, file_table_column_names::error_count);
-	Bind(insertFileQuery_, file_table_column_names::priority, static_cast<int>(file.GetPriority()));
-	Bind(insertFileQuery_, file_table_column_names::ascii_file, file.Ascii() ? 1 : 0);
+		BindNull(statement, file_table_column_names::error_count);
+	Bind(statement, file_table_column_names::priority, static_cast<int>(file.GetPriority()));
+	Bind(statement, file_table_column_names::ascii_file, file.Ascii() ? 1 : 0);
 
 	if (file.m_defaultFileExistsAction != CFileExistsNotification::unknown)
-		Bind(insertFileQuery_, file_table_column_names::default_exists_action, file.m_defaultFileExistsAction);
+		Bind(statement, file_table_column_names::default_exists_action, file.m_defaultFileExistsAction);
 	else
-		BindNull(insertFileQuery_, file_table_column_names::default_exists_action);
-
-	int res;
-	do {
-		res = sqlite3_step(insertFileQuery_);
-	} while (res == SQLITE_BUSY);
+		BindNull(statement, file_table_column_names::default_exists_action);
 
-	sqlite3_reset(insertFileQuery_);
+	auto const& segment = file.GetSegment();
+	BindTransferSegment(statement, file_table_column_names::segment_offset, segment ? &*segment : 0);
 
-	return res == SQLITE_DONE;
+	return Step(statement);
 }
 
 
-bool CQueueStorage::Impl::SaveDirectory(wxLongLong server, const CFolderItem& directory)
+bool CQueueStorage::Impl::SaveDirectory(sqlite3_stmt* statement, int64_t server, const CFolderItem& directory)
 {
+	Bind(statement, file_table_column_names::server, server);
 	if (directory.Download())
-		BindNull(insertFileQuery_, file_table_column_names::source_file);
+		BindNull(statement, file_table_column_names::source_file);
 	else
-		Bind(insertFileQuery_, file_table_column_names::source_file, directory.GetSourceFile());
-	BindNull(insertFileQuery_, file_table_column_names::target_file);
+		Bind(statement, file_table_column_names::source_file, directory.GetSourceFile());
+	BindNull(statement, file_table_column_names::target_file);
 
 	int64_t localPathId = directory.Download() ? SaveLocalPath(directory.GetLocalPath()) : -1;
 	int64_t remotePathId = directory.Download() ? -1 : SaveRemotePath(directory.GetRemotePath());
 	if (localPathId == -1 && remotePathId == -1)
 		return false;
 
-	Bind(insertFileQuery_, file_table_column_names::local_path, localPathId);
-	Bind(insertFileQuery_, file_table_column_names::remote_path, remotePathId);
+	Bind(statement, file_table_column_names::local_path, localPathId);
+	Bind(statement, file_table_column_names::remote_path, remotePathId);
 
-	Bind(insertFileQuery_, file_table_column_names::download, directory.Download() ? 1 : 0);
-	BindNull(insertFileQuery_, file_table_column_names::size);
+	Bind(statement, file_table_column_names::download, directory.Download() ? 1 : 0);
+	BindNull(statement, file_table_column_names::size);
 	if (directory.m_errorCount)
-		Bind(insertFileQuery_, file_table_column_names::error_count, directory.m_errorCount);
+		Bind(statement, file_table_column_names::error_count, directory.m_errorCount);
 	else
-		BindNull(insertFileQuery_, file_table_column_names::error_count);
-	Bind(insertFileQuery_, file_table_column_names::priority, static_cast<int>(directory.GetPriority()));
-	BindNull(insertFileQuery_, file_table_column_names::ascii_file);
+		BindNull(statement, file_table_column_names::error_count);
+	Bind(statement, file_table_column_names::priority, static_cast<int>(directory.GetPriority()));
+	BindNull(statement, file_table_column_names::ascii_file);
 
-	BindNull(insertFileQuery_, file_table_column_names::default_exists_action);
+	BindNull(statement, file_table_column_names::default_exists_action);
 
-	int res;
-	do {
-		res = sqlite3_step(insertFileQuery_);
-	} while (res == SQLITE_BUSY);
-
-	sqlite3_reset(insertFileQuery_);
+	BindTransferSegment(statement, file_table_column_names::segment_offset, 0);
 
-	return res == SQLITE_DONE;
+	return Step(statement);
 }
 
 
@@ -906,6 +1159,9 @@ int64_t CQueueStorage::Impl::ParseServerFromRow(CServer& server)
 		return INVALID_DATA;
 	server.MaximumMultipleConnections(maximumMultipleConnections);
 
+	server.SetSpeedLimits(GetColumnInt(selectServersQuery_, server_table_column_names::speed_limit_inbound),
+		GetColumnInt(selectServersQuery_, server_table_column_names::speed_limit_outbound));
+
 	wxString encodingType = GetColumnText(selectServersQuery_, server_table_column_names::encoding);
 	if (encodingType.empty() || encodingType == _T("Auto"))
 		server.SetEncodingType(ENCODING_AUTO);
@@ -1001,6 +1257,10 @@ int64_t CQueueStorage::Impl::ParseFileFromRow(CFileItem** pItem)
 
 		if (overwrite_action > 0 && overwrite_action < CFileExistsNotification::ACTION_COUNT)
 			fileItem->m_defaultFileExistsAction = (CFileExistsNotification::OverwriteAction)overwrite_action;
+
+		CFileItem::t_segment segment;
+		if (download && ParseTransferSegment(selectFilesQuery_, file_table_column_names::segment_offset, segment))
+			fileItem->SetSegment(segment);
 	}
 
 	return GetColumnInt64(selectFilesQuery_, file_table_column_names::id);
@@ -1009,20 +1269,37 @@ int64_t CQueueStorage::Impl::ParseFileFromRow(CFileItem** pItem)
 CQueueStorage::CQueueStorage()
 : d_(new Impl)
 {
-	int ret = sqlite3_open(GetDatabaseFilename().ToUTF8(), &d_->db_ );
+	d_->filename_ = GetDatabaseFilename().ToUTF8().data();
+	int ret = sqlite3_open(d_->filename_.c_str(), &d_->db_ );
 	if (ret != SQLITE_OK)
 		d_->db_ = 0;
 
 	if (sqlite3_exec(d_->db_, "PRAGMA encoding=\"UTF-16le\"", 0, 0, 0) == SQLITE_OK)
 	{
+		// Other instances might be writing their journal
+		sqlite3_busy_timeout(d_->db_, 5000);
+
 		d_->MigrateSchema();
 		d_->CreateTables();
 		d_->PrepareStatements();
+		d_->CreateOwner();
 	}
 }
 
 CQueueStorage::~CQueueStorage()
 {
+	StopJournal();
+
+	sqlite3_finalize(d_->updateFileQuery_);
+	sqlite3_finalize(d_->deleteFileQuery_);
+	sqlite3_finalize(d_->deleteServerFilesQuery_);
+	sqlite3_finalize(d_->deleteServerQuery_);
+	sqlite3_finalize(d_->setOwnerQuery_);
+	sqlite3_finalize(d_->findLocalPathQuery_);
+	sqlite3_finalize(d_->findRemotePathQuery_);
+	sqlite3_finalize(d_->selectFileSummaryQuery_);
+	sqlite3_finalize(d_->selectLastFileQuery_);
+	sqlite3_finalize(d_->selectFileDirectionQuery_);
 	sqlite3_finalize(d_->insertServerQuery_);
 	sqlite3_finalize(d_->insertFileQuery_);
 	sqlite3_finalize(d_->insertLocalPathQuery_);
@@ -1039,10 +1316,29 @@ bool CQueueStorage::SaveQueue(std::vector<CServerItem*> const& queue)
 {
 	d_->ClearCaches();
 
+	bool const kiosk_mode = COptions::Get()->GetOptionVal(OPTION_DEFAULT_KIOSKMODE) != 0;
+
 	bool ret = true;
 	if (sqlite3_exec(d_->db_, "BEGIN TRANSACTION", 0, 0, 0) == SQLITE_OK) {
-		for (std::vector<CServerItem*>::const_iterator it = queue.begin(); it != queue.end(); ++it)
-			ret &= d_->SaveServer(**it);
+		// Rows still owned if the journal could not be written
+		ret &= d_->RemoveOwnRows();
+
+		for (std::vector<CServerItem*>::const_iterator it = queue.begin(); it != queue.end(); ++it) {
+			CServerItem const& item = **it;
+			int64_t const serverId = d_->SaveServer(item.GetServer(), kiosk_mode, wxString());
+			if (serverId <= 0) {
+				ret = false;
+				continue;
+			}
+
+			const std::vector<CQueueItem*>& children = item.GetChildren();
+			for (auto child = children.begin() + item.GetRemovedAtFront(); child != children.end(); ++child) {
+				if ((*child)->GetType() == QueueItemType::File)
+					ret &= d_->SaveFile(d_->insertFileQuery_, serverId, *static_cast<CFileItem*>(*child));
+				else if ((*child)->GetType() == QueueItemType::Folder)
+					ret &= d_->SaveDirectory(d_->insertFileQuery_, serverId, *static_cast<CFolderItem*>(*child));
+			}
+		}
 
 		// Even on previous failure, we want to at least try to commit the data we have so far
 		ret &= sqlite3_exec(d_->db_, "END TRANSACTION", 0, 0, 0) == SQLITE_OK;
@@ -1063,8 +1359,7 @@ int64_t CQueueStorage::GetServer(CServer& server, bool fromBeginning)
 	{
 		if (fromBeginning)
 		{
-			d_->ReadLocalPaths();
-			d_->ReadRemotePaths();
+			d_->ReleaseStaleOwners();
 			sqlite3_reset(d_->selectServersQuery_);
 		}
 
@@ -1105,17 +1400,22 @@ int64_t CQueueStorage::GetServer(CServer& server, bool fromBeginning)
 }
 
 
-int64_t CQueueStorage::GetFile(CFileItem** pItem, int64_t server)
+int64_t CQueueStorage::GetFile(CFileItem** pItem, int64_t server, int64_t after, int limit, int64_t max)
 {
 	int64_t ret = -1;
 	*pItem = 0;
 
+	scoped_lock l(d_->dbSync_);
+
 	if (d_->selectFilesQuery_)
 	{
 		if (server > 0)
 		{
 			sqlite3_reset(d_->selectFilesQuery_);
 			sqlite3_bind_int64(d_->selectFilesQuery_, 1, server);
+			sqlite3_bind_int64(d_->selectFilesQuery_, 2, after);
+			sqlite3_bind_int64(d_->selectFilesQuery_, 3, max);
+			sqlite3_bind_int(d_->selectFilesQuery_, 4, limit);
 		}
 
 		for (;;)
@@ -1154,23 +1454,112 @@ int64_t CQueueStorage::GetFile(CFileItem** pItem, int64_t server)
 	return ret;
 }
 
-bool CQueueStorage::Clear()
+bool CQueueStorage::GetFileSummary(int64_t server, int64_t after, int64_t max, int64_t& count, int64_t& size, int64_t& unknownSize)
 {
-	if (!d_->db_)
+	count = 0;
+	size = 0;
+	unknownSize = 0;
+
+	scoped_lock l(d_->dbSync_);
+
+	sqlite3_stmt* statement = d_->selectFileSummaryQuery_;
+	if (!statement)
 		return false;
 
-	if (sqlite3_exec(d_->db_, "DELETE FROM files", 0, 0, 0) != SQLITE_OK)
+	d_->Bind(statement, 1, server);
+	d_->Bind(statement, 2, after);
+	d_->Bind(statement, 3, max);
+
+	int res;
+	do
+	{
+		res = sqlite3_step(statement);
+	}
+	while (res == SQLITE_BUSY);
+
+	if (res == SQLITE_ROW)
+	{
+		count = d_->GetColumnInt64(statement, 0);
+		size = d_->GetColumnInt64(statement, 1);
+		unknownSize = d_->GetColumnInt64(statement, 2);
+	}
+	sqlite3_reset(statement);
+
+	return res == SQLITE_ROW;
+}
+
+int64_t CQueueStorage::GetLastFile(int64_t server)
+{
+	scoped_lock l(d_->dbSync_);
+
+	sqlite3_stmt* statement = d_->selectLastFileQuery_;
+	if (!statement)
+		return -1;
+
+	d_->Bind(statement, 1, server);
+
+	int res;
+	do
+	{
+		res = sqlite3_step(statement);
+	}
+	while (res == SQLITE_BUSY);
+
+	int64_t ret = -1;
+	if (res == SQLITE_ROW)
+		ret = d_->GetColumnInt64(statement, 0);
+	sqlite3_reset(statement);
+
+	return ret;
+}
+
+bool CQueueStorage::HasFile(int64_t server, int64_t after, int64_t max, int limit, bool download)
+{
+	scoped_lock l(d_->dbSync_);
+
+	sqlite3_stmt* statement = d_->selectFileDirectionQuery_;
+	if (!statement)
 		return false;
 
-	if (sqlite3_exec(d_->db_, "DELETE FROM servers", 0, 0, 0) != SQLITE_OK)
+	d_->Bind(statement, 1, server);
+	d_->Bind(statement, 2, after);
+	d_->Bind(statement, 3, max);
+	d_->Bind(statement, 4, limit);
+	d_->Bind(statement, 5, download ? 1 : 0);
+
+	int res;
+	do
+	{
+		res = sqlite3_step(statement);
+	}
+	while (res == SQLITE_BUSY);
+
+	sqlite3_reset(statement);
+
+	return res == SQLITE_ROW;
+}
+
+bool CQueueStorage::Clear(bool removeUnusedPaths)
+{
+	if (!d_->db_)
 		return false;
 
-	if (sqlite3_exec(d_->db_, "DELETE FROM local_paths", 0, 0, 0) != SQLITE_OK)
+	if (sqlite3_exec(d_->db_, "DELETE FROM files WHERE server NOT IN (SELECT id FROM servers WHERE owner IS NOT NULL)", 0, 0, 0) != SQLITE_OK)
 		return false;
 
-	if (sqlite3_exec(d_->db_, "DELETE FROM remote_paths", 0, 0, 0) != SQLITE_OK)
+	if (sqlite3_exec(d_->db_, "DELETE FROM servers WHERE owner IS NULL", 0, 0, 0) != SQLITE_OK)
 		return false;
 
+	if (removeUnusedPaths) {
+		if (sqlite3_exec(d_->db_, "DELETE FROM local_paths WHERE id NOT IN (SELECT local_path FROM files WHERE local_path IS NOT NULL)", 0, 0, 0) != SQLITE_OK)
+			return false;
+
+		if (sqlite3_exec(d_->db_, "DELETE FROM remote_paths WHERE id NOT IN (SELECT remote_path FROM files WHERE remote_path IS NOT NULL)", 0, 0, 0) != SQLITE_OK)
+			return false;
+	}
+	else
+		d_->removeUnusedPaths_ = true;
+
 	d_->ClearCaches();
 
 	return true;
@@ -1185,7 +1574,9 @@ wxString CQueueStorage::GetDatabaseFilename()
 
 bool CQueueStorage::BeginTransaction()
 {
-	return sqlite3_exec(d_->db_, "BEGIN TRANSACTION", 0, 0, 0) == SQLITE_OK;
+	// Immediate, loading also claims the rows. In WAL mode a deferred
+	// transaction could not be upgraded if another instance wrote in between.
+	return sqlite3_exec(d_->db_, "BEGIN IMMEDIATE TRANSACTION", 0, 0, 0) == SQLITE_OK;
 }
 
 bool CQueueStorage::EndTransaction()
@@ -1197,3 +1588,498 @@ bool CQueueStorage::Vacuum()
 {
 	return sqlite3_exec(d_->db_, "VACUUM", 0, 0, 0) == SQLITE_OK;
 }
+
+namespace {
+wxString GetOwnerLockName(wxString const& owner)
+{
+	return _T("FileZilla queue ") + owner;
+}
+
+wxString GetOwnerLockDir()
+{
+	return COptions::Get()->GetOption(OPTION_DEFAULT_SETTINGSDIR);
+}
+
+// Copies the data that gets stored, the copy can be used by the journal thread
+CFileItem* CopyItem(CFileItem const& item)
+{
+	CFileItem* copy;
+	if (item.GetType() == QueueItemType::Folder) {
+		if (item.Download())
+			copy = new CFolderItem(0, true, item.GetLocalPath());
+		else
+			copy = new CFolderItem(0, true, item.GetRemotePath(), item.GetTargetFile());
+	}
+	else {
+		copy = new CFileItem(0, true, item.Download(), item.GetSourceFile(), item.GetTargetFile(),
+			item.GetLocalPath(), item.GetRemotePath(), item.GetSize());
+		copy->SetAscii(item.Ascii());
+		copy->m_defaultFileExistsAction = item.m_defaultFileExistsAction;
+		if (item.GetSegment())
+			copy->SetSegment(*item.GetSegment());
+	}
+	copy->SetPriorityRaw(item.GetPriority());
+	copy->m_errorCount = item.m_errorCount;
+
+	return copy;
+}
+}
+
+bool CQueueStorage::Impl::CreateOwner()
+{
+	wxString const owner = wxString::Format(_T("%lu-%s"), wxGetProcessId(), wxDateTime::UNow().GetValue().ToString());
+
+	instanceChecker_.reset(new wxSingleInstanceChecker);
+	if (!instanceChecker_->Create(GetOwnerLockName(owner), GetOwnerLockDir()) || instanceChecker_->IsAnotherRunning()) {
+		instanceChecker_.reset();
+		return false;
+	}
+
+	owner_ = owner;
+	return true;
+}
+
+bool CQueueStorage::Impl::IsOwnerRunning(wxString const& owner) const
+{
+	if (owner == owner_)
+		return true;
+
+	// If the owner is gone, this takes over its lock until the checker is destroyed
+	wxSingleInstanceChecker checker;
+	if (!checker.Create(GetOwnerLockName(owner), GetOwnerLockDir()))
+		return true;
+
+	return checker.IsAnotherRunning();
+}
+
+void CQueueStorage::Impl::ReleaseStaleOwners()
+{
+	sqlite3_stmt* statement = PrepareStatement(_T("SELECT DISTINCT owner FROM servers WHERE owner IS NOT NULL"));
+	if (!statement)
+		return;
+
+	std::vector<wxString> owners;
+	int res;
+	do {
+		res = sqlite3_step(statement);
+		if (res == SQLITE_ROW)
+			owners.push_back(GetColumnText(statement, 0));
+	} while (res == SQLITE_BUSY || res == SQLITE_ROW);
+	sqlite3_finalize(statement);
+
+	if (owners.empty())
+		return;
+
+	statement = PrepareStatement(_T("UPDATE servers SET owner=NULL WHERE owner=:owner"));
+	if (!statement)
+		return;
+
+	// Rows of crashed instances are loaded like any other
+	for (auto const& owner : owners) {
+		if (IsOwnerRunning(owner))
+			continue;
+
+		Bind(statement, 1, owner);
+		Step(statement);
+	}
+	sqlite3_finalize(statement);
+}
+
+bool CQueueStorage::Impl::RemoveOwnRows()
+{
+	if (owner_.empty())
+		return true;
+
+	sqlite3_stmt* statement = PrepareStatement(_T("DELETE FROM files WHERE server IN (SELECT id FROM servers WHERE owner=:owner)"));
+	if (!statement)
+		return false;
+	Bind(statement, 1, owner_);
+	bool ret = Step(statement);
+	sqlite3_finalize(statement);
+
+	statement = PrepareStatement(_T("DELETE FROM servers WHERE owner=:owner"));
+	if (!statement)
+		return false;
+	Bind(statement, 1, owner_);
+	ret &= Step(statement);
+	sqlite3_finalize(statement);
+
+	return ret;
+}
+
+void CQueueStorage::Impl::AddJournalEntry(t_journalEntry && entry)
+{
+	scoped_lock l(journalSync_);
+	bool const wakeup = journal_.empty();
+	journal_.push_back(std::move(entry));
+	if (wakeup)
+		journalCondition_.signal(l);
+}
+
+void CQueueStorage::Impl::JournalLoop()
+{
+	std::vector<t_journalEntry> entries;
+
+	scoped_lock l(journalSync_);
+	for (;;) {
+		if (journal_.empty() && entries.empty()) {
+			if (journalQuit_)
+				break;
+			if (removeUnusedPaths_) {
+				// Skipped when loading the queue, see Clear()
+				removeUnusedPaths_ = false;
+				l.unlock();
+				RemoveUnusedPaths();
+				l.lock();
+				continue;
+			}
+			journalCondition_.wait(l);
+			continue;
+		}
+
+		if (!journalQuit_) {
+			// Collect further changes, writing them in a single transaction
+			// is a lot cheaper. Also retries after failures.
+			journalCondition_.wait(l, journal_delay_ms);
+		}
+
+		for (auto & entry : journal_)
+			entries.push_back(std::move(entry));
+		journal_.clear();
+		bool const quit = journalQuit_;
+
+		l.unlock();
+		bool const written = WriteJournal(entries);
+		l.lock();
+
+		if (written || quit) {
+			if (!written)
+				journalFailed_ = true;
+			entries.clear();
+		}
+	}
+}
+
+void CQueueStorage::Impl::RemoveUnusedPaths()
+{
+	// Uses a connection of its own, loading parts of the queue through the
+	// main connection doesn't have to wait for this.
+	sqlite3* db = 0;
+	if (sqlite3_open(filename_.c_str(), &db) != SQLITE_OK) {
+		sqlite3_close(db);
+		return;
+	}
+	sqlite3_busy_timeout(db, 5000);
+
+	{
+		scoped_lock l(journalSync_);
+		if (journalQuit_) {
+			sqlite3_close(db);
+			return;
+		}
+		cleanupDb_ = db;
+	}
+
+	if (sqlite3_exec(db, "DELETE FROM local_paths WHERE id NOT IN (SELECT local_path FROM files WHERE local_path IS NOT NULL)", 0, 0, 0) == SQLITE_OK)
+		sqlite3_exec(db, "DELETE FROM remote_paths WHERE id NOT IN (SELECT remote_path FROM files WHERE remote_path IS NOT NULL)", 0, 0, 0);
+
+	{
+		scoped_lock l(journalSync_);
+		cleanupDb_ = 0;
+	}
+	sqlite3_close(db);
+}
+
+bool CQueueStorage::Impl::WriteJournal(std::vector<t_journalEntry> & entries)
+{
+	if (journalFailed_)
+		return true;
+
+	scoped_lock l(dbSync_);
+
+	// Nothing has been changed if this fails, it gets tried again later.
+	if (sqlite3_exec(db_, "BEGIN IMMEDIATE TRANSACTION", 0, 0, 0) != SQLITE_OK)
+		return false;
+
+	// Other instances remove paths no longer in use when loading. The
+	// paths of the stored files are still in use, so the caches used
+	// for loading stay valid.
+	localPaths_.clear();
+	remotePaths_.clear();
+
+	bool failed = false;
+	for (auto const& entry : entries) {
+		if (!WriteJournalEntry(entry)) {
+			failed = true;
+			break;
+		}
+	}
+
+	if (failed || sqlite3_exec(db_, "COMMIT TRANSACTION", 0, 0, 0) != SQLITE_OK) {
+		// The ids assigned in this transaction are invalid now. Give up,
+		// the whole queue gets saved on exit instead.
+		sqlite3_exec(db_, "ROLLBACK TRANSACTION", 0, 0, 0);
+		journalFailed_ = true;
+		return true;
+	}
+
+	wxDateTime const now = wxDateTime::UNow();
+	if (!lastCheckpoint_.IsValid() || (now - lastCheckpoint_).GetSeconds() >= checkpoint_interval) {
+		sqlite3_wal_checkpoint_v2(db_, 0, SQLITE_CHECKPOINT_PASSIVE, 0, 0);
+		lastCheckpoint_ = now;
+	}
+
+	return true;
+}
+
+bool CQueueStorage::Impl::WriteJournalEntry(t_journalEntry const& entry)
+{
+	switch (entry.type_) {
+	case t_journalEntry::server:
+		if (serverIds_.find(entry.key_) == serverIds_.end()) {
+			int64_t const id = SaveServer(*entry.server_, kioskMode_, owner_);
+			if (id <= 0)
+				return false;
+			serverIds_[entry.key_] = id;
+		}
+		break;
+	case t_journalEntry::remove_server:
+		{
+			auto it = serverIds_.find(entry.key_);
+			if (it != serverIds_.end()) {
+				Bind(deleteServerFilesQuery_, 1, it->second);
+				Step(deleteServerFilesQuery_);
+				Bind(deleteServerQuery_, 1, it->second);
+				Step(deleteServerQuery_);
+				serverIds_.erase(it);
+			}
+		}
+		break;
+	case t_journalEntry::file:
+		{
+			auto server = serverIds_.find(entry.serverKey_);
+			if (server == serverIds_.end())
+				return false;
+
+			auto it = fileIds_.find(entry.key_);
+			if (it != fileIds_.end()) {
+				// The id follows the parameters of the other columns
+				Bind(updateFileQuery_, static_cast<int>(sizeof(file_table_columns) / sizeof(_column)), it->second);
+				bool updated;
+				if (entry.file_->GetType() == QueueItemType::Folder)
+					updated = SaveDirectory(updateFileQuery_, server->second, *static_cast<CFolderItem*>(entry.file_.get()));
+				else
+					updated = SaveFile(updateFileQuery_, server->second, *entry.file_);
+				if (updated && sqlite3_changes(db_))
+					break;
+
+				// Row is gone, e.g. together with its server
+				fileIds_.erase(it);
+			}
+
+			bool inserted;
+			if (entry.file_->GetType() == QueueItemType::Folder)
+				inserted = SaveDirectory(insertFileQuery_, server->second, *static_cast<CFolderItem*>(entry.file_.get()));
+			else
+				inserted = SaveFile(insertFileQuery_, server->second, *entry.file_);
+			if (!inserted)
+				return false;
+			fileIds_[entry.key_] = sqlite3_last_insert_rowid(db_);
+		}
+		break;
+	case t_journalEntry::remove_file:
+		{
+			auto it = fileIds_.find(entry.key_);
+			if (it != fileIds_.end()) {
+				Bind(deleteFileQuery_, 1, it->second);
+				Step(deleteFileQuery_);
+				fileIds_.erase(it);
+			}
+		}
+		break;
+	case t_journalEntry::adopt_file:
+		fileIds_[entry.key_] = entry.id_;
+		break;
+	case t_journalEntry::remove_stored_files:
+		{
+			sqlite3_stmt* statement = PrepareStatement(_T("DELETE FROM files WHERE server=:server AND id>:after AND id<=:max"));
+			if (!statement)
+				return false;
+			Bind(statement, 1, entry.id_);
+			Bind(statement, 2, entry.after_);
+			Bind(statement, 3, entry.max_);
+			bool ret = Step(statement);
+			sqlite3_finalize(statement);
+			return ret;
+		}
+	}
+
+	return true;
+}
+
+bool CQueueStorage::CanJournal() const
+{
+	return !d_->owner_.empty() && d_->updateFileQuery_;
+}
+
+bool CQueueStorage::Adopt(CServerItem const& server, int64_t id)
+{
+	if (!CanJournal())
+		return false;
+
+	// The same server can be in the database more than once. Changed files
+	// get moved to the first row, the other rows stay owned until they are
+	// empty. Their files might not all be loaded yet.
+	d_->serverIds_.emplace(&server, id);
+
+	d_->Bind(d_->setOwnerQuery_, 1, d_->owner_);
+	d_->Bind(d_->setOwnerQuery_, 2, id);
+	return d_->Step(d_->setOwnerQuery_);
+}
+
+void CQueueStorage::Adopt(CFileItem const& file, int64_t id)
+{
+	if (!CanJournal())
+		return;
+
+	if (d_->journalThread_) {
+		t_journalEntry entry(t_journalEntry::adopt_file, &file);
+		entry.id_ = id;
+		d_->AddJournalEntry(std::move(entry));
+	}
+	else
+		d_->fileIds_[&file] = id;
+}
+
+void CQueueStorage::RemoveStoredFiles(int64_t server, int64_t after, int64_t max)
+{
+	if (!d_->journalThread_)
+		return;
+
+	t_journalEntry entry(t_journalEntry::remove_stored_files, 0);
+	entry.id_ = server;
+	entry.after_ = after;
+	entry.max_ = max;
+	d_->AddJournalEntry(std::move(entry));
+}
+
+bool CQueueStorage::StartJournal(std::vector<CServerItem*> const& queue)
+{
+	if (d_->journalThread_ || !CanJournal())
+		return false;
+
+	// Readers don't block the writer and vice versa
+	sqlite3_exec(d_->db_, "PRAGMA journal_mode=WAL", 0, 0, 0);
+	sqlite3_exec(d_->db_, "PRAGMA synchronous=NORMAL", 0, 0, 0);
+
+	d_->kioskMode_ = COptions::Get()->GetOptionVal(OPTION_DEFAULT_KIOSKMODE) != 0;
+	d_->journalQuit_ = false;
+	d_->journalFailed_ = false;
+
+	for (auto const& server : queue) {
+		if (d_->serverIds_.find(server) == d_->serverIds_.end()) {
+			t_journalEntry entry(t_journalEntry::server, server);
+			entry.server_.reset(new CServer(server->GetServer()));
+			d_->AddJournalEntry(std::move(entry));
+		}
+
+		const std::vector<CQueueItem*>& children = server->GetChildren();
+		for (auto child = children.begin() + server->GetRemovedAtFront(); child != children.end(); ++child) {
+			if ((*child)->GetType() != QueueItemType::File && (*child)->GetType() != QueueItemType::Folder)
+				continue;
+
+			CFileItem const& file = *static_cast<CFileItem const*>(*child);
+			if (d_->fileIds_.find(&file) == d_->fileIds_.end() && file.m_edit == CEditHandler::none) {
+				t_journalEntry entry(t_journalEntry::file, &file, server);
+				entry.file_.reset(CopyItem(file));
+				d_->AddJournalEntry(std::move(entry));
+			}
+		}
+	}
+
+	d_->journalThread_ = new Impl::CJournalThread(*d_);
+	if (d_->journalThread_->Create() != wxTHREAD_NO_ERROR || d_->journalThread_->Run() != wxTHREAD_NO_ERROR) {
+		delete d_->journalThread_;
+		d_->journalThread_ = 0;
+		d_->journal_.clear();
+		return false;
+	}
+
+	return true;
+}
+
+bool CQueueStorage::StopJournal()
+{
+	if (!d_->journalThread_)
+		return false;
+
+	{
+		scoped_lock l(d_->journalSync_);
+		d_->journalQuit_ = true;
+		if (d_->cleanupDb_)
+			sqlite3_interrupt(d_->cleanupDb_);
+		d_->journalCondition_.signal(l);
+	}
+
+	d_->journalThread_->Wait(wxTHREAD_WAIT_BLOCK);
+	delete d_->journalThread_;
+	d_->journalThread_ = 0;
+
+	d_->serverIds_.clear();
+	d_->fileIds_.clear();
+
+	if (!d_->journalFailed_) {
+		// Hand the queue over to the next instance
+		sqlite3_stmt* statement = d_->PrepareStatement(_T("UPDATE servers SET owner=NULL WHERE owner=:owner"));
+		if (statement) {
+			d_->Bind(statement, 1, d_->owner_);
+			if (!d_->Step(statement))
+				d_->journalFailed_ = true;
+			sqlite3_finalize(statement);
+		}
+		else
+			d_->journalFailed_ = true;
+	}
+
+	// Keep the write-ahead log from lingering around
+	sqlite3_wal_checkpoint_v2(d_->db_, 0, SQLITE_CHECKPOINT_TRUNCATE, 0, 0);
+
+	return !d_->journalFailed_;
+}
+
+bool CQueueStorage::JournalActive() const
+{
+	return d_->journalThread_ != 0;
+}
+
+void CQueueStorage::StoreServer(CServerItem const& server)
+{
+	if (!d_->journalThread_)
+		return;
+
+	t_journalEntry entry(t_journalEntry::server, &server);
+	entry.server_.reset(new CServer(server.GetServer()));
+	d_->AddJournalEntry(std::move(entry));
+}
+
+void CQueueStorage::RemoveServer(CServerItem const& server)
+{
+	if (d_->journalThread_)
+		d_->AddJournalEntry(t_journalEntry(t_journalEntry::remove_server, &server));
+}
+
+void CQueueStorage::StoreFile(CServerItem const& server, CFileItem const& file)
+{
+	if (!d_->journalThread_ || file.m_edit != CEditHandler::none)
+		return;
+
+	t_journalEntry entry(t_journalEntry::file, &file, &server);
+	entry.file_.reset(CopyItem(file));
+	d_->AddJournalEntry(std::move(entry));
+}
+
+void CQueueStorage::RemoveFile(CFileItem const& file)
+{
+	if (d_->journalThread_)
+		d_->AddJournalEntry(t_journalEntry(t_journalEntry::remove_file, &file));
+}
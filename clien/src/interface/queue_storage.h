@@ -1,6 +1,7 @@
 #ifndef __QUEUE_STORAGE_H__
 #define __QUEUE_STORAGE_H__
 
+#include <limits>
 #include <vector>
 
 class CFileItem;
@@ -24,7 +25,10 @@ public:
 	// Call after finishing loading
 	bool EndTransaction();
 
-	bool Clear(); // Also clears caches
+	// Removes everything not owned by a running instance. Also clears caches.
+	// Removing the paths no longer in use takes a while on large queues,
+	// without removeUnusedPaths it is left to the journal once it is idle.
+	bool Clear(bool removeUnusedPaths = true);
 
 	bool Vacuum();
 
@@ -33,10 +37,54 @@ public:
 	// > 0 = server id
 	//   0 = No server
 	// < 0 = failure.
+	// Servers owned by other running instances are skipped.
 	int64_t GetServer(CServer& server, bool fromBeginning);
 	CServer GetNextServer();
 
-	int64_t GetFile(CFileItem** pItem, int64_t server);
+	// Pass the server id to start reading its files, 0 to continue.
+	// Reads the files after the given file id up to and including max,
+	// at most limit files unless limit is negative.
+	int64_t GetFile(CFileItem** pItem, int64_t server, int64_t after = 0, int limit = -1, int64_t max = std::numeric_limits<int64_t>::max());
+
+	// Number and total size of the files of a server in the given range of file ids.
+	// Files and folders with unknown size are counted in unknownSize.
+	bool GetFileSummary(int64_t server, int64_t after, int64_t max, int64_t& count, int64_t& size, int64_t& unknownSize);
+
+	// Id of the last file of a server, 0 if it has none, -1 on error.
+	// Files added later through the journal get higher ids.
+	int64_t GetLastFile(int64_t server);
+
+	// Whether the next limit files in the given range of file ids contain
+	// a download, or an upload if download is false.
+	bool HasFile(int64_t server, int64_t after, int64_t max, int limit, bool download);
+
+	// Incremental saving of the queue.
+	//
+	// Loaded rows stay in the database and get owned by this instance through
+	// Adopt, other instances then no longer load them. Once the journal is
+	// started, changes to the queue get written in batches by a background
+	// thread. StopJournal writes the outstanding changes and releases the
+	// ownership so that the next instance loads the queue.
+	bool CanJournal() const;
+	bool Adopt(CServerItem const& server, int64_t id);
+	void Adopt(CFileItem const& file, int64_t id);
+
+	// Adds the items not stored yet, e.g. those imported from queue.xml
+	bool StartJournal(std::vector<CServerItem*> const& queue);
+
+	// Returns false if the journal could not be written, the queue
+	// needs to be saved through SaveQueue then.
+	bool StopJournal();
+	bool JournalActive() const;
+
+	// Do nothing unless the journal is active
+	void StoreServer(CServerItem const& server);
+	void RemoveServer(CServerItem const& server);
+	void StoreFile(CServerItem const& server, CFileItem const& file); // Adds or updates
+	void RemoveFile(CFileItem const& file);
+
+	// Removes the files of a server row not loaded yet, those in the given range of file ids
+	void RemoveStoredFiles(int64_t server, int64_t after, int64_t max);
 
 	static wxString GetDatabaseFilename();
 
@@ -0,0 +1,191 @@
+#include <filezilla.h>
+#include "recursive_listing_pool.h"
+#include "Mainfrm.h"
+#include "StatusView.h"
+#include "asyncrequestqueue.h"
+
+BEGIN_EVENT_TABLE(CRecursiveListingPool, wxEvtHandler)
+EVT_FZ_NOTIFICATION(wxID_ANY, CRecursiveListingPool::OnEngineEvent)
+END_EVENT_TABLE()
+
+CRecursiveListingPool::CRecursiveListingPool(CRecursiveOperation& operation, CMainFrame& mainFrame, CServer const& server, int connections)
+	: operation_(operation)
+	, mainFrame_(mainFrame)
+	, server_(server)
+	, connections_(connections)
+{
+	for (auto& connection : connections_) {
+		connection.engine = new CFileZillaEngine(mainFrame_.GetEngineContext());
+		connection.engine->Init(this);
+
+		// Connect right away so that the first directories can be listed
+		// as soon as the operation discovers them
+		Connect(connection);
+	}
+}
+
+CRecursiveListingPool::~CRecursiveListingPool()
+{
+	for (auto& connection : connections_) {
+		mainFrame_.GetAsyncRequestQueue()->ClearPending(connection.engine);
+		delete connection.engine;
+	}
+}
+
+bool CRecursiveListingPool::List(CRecursiveOperation::CNewDir const& dir)
+{
+	for (auto& connection : connections_) {
+		if (connection.state != connection_state::idle) {
+			continue;
+		}
+
+		connection.dir = dir;
+		connection.has_dir = true;
+		if (connection.engine->IsConnected()) {
+			if (StartListing(connection)) {
+				return true;
+			}
+		}
+		else if (Connect(connection)) {
+			// Gets listed once connected
+			return true;
+		}
+		connection.has_dir = false;
+	}
+
+	return false;
+}
+
+bool CRecursiveListingPool::Idle() const
+{
+	for (auto const& connection : connections_) {
+		if (connection.state == connection_state::connecting || connection.state == connection_state::listing) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool CRecursiveListingPool::Connect(t_connection& connection)
+{
+	int res = connection.engine->Execute(CConnectCommand(server_));
+	if (res != FZ_REPLY_WOULDBLOCK) {
+		connection.state = connection_state::failed;
+		return false;
+	}
+
+	connection.state = connection_state::connecting;
+	return true;
+}
+
+bool CRecursiveListingPool::StartListing(t_connection& connection)
+{
+	wxASSERT(connection.has_dir);
+
+	CRecursiveOperation::CNewDir const& dir = connection.dir;
+	int res = connection.engine->Execute(CListCommand(dir.parent, dir.subdir, dir.link ? LIST_FLAG_LINK : 0));
+	if (res != FZ_REPLY_WOULDBLOCK) {
+		connection.state = connection_state::idle;
+		return false;
+	}
+
+	connection.listing_path.clear();
+	connection.state = connection_state::listing;
+	return true;
+}
+
+void CRecursiveListingPool::OnEngineEvent(wxFzEvent& event)
+{
+	t_connection* connection{};
+	for (auto& c : connections_) {
+		if (c.engine == event.engine_) {
+			connection = &c;
+			break;
+		}
+	}
+	if (!connection) {
+		return;
+	}
+
+	std::weak_ptr<bool> alive = alive_;
+
+	std::unique_ptr<CNotification> notification;
+	while (!alive.expired() && (notification = connection->engine->GetNextNotification())) {
+		ProcessNotification(*connection, std::move(notification));
+	}
+}
+
+void CRecursiveListingPool::ProcessNotification(t_connection& connection, std::unique_ptr<CNotification> && notification)
+{
+	switch (notification->GetID())
+	{
+	case nId_logmsg:
+		mainFrame_.GetStatusView()->AddToLog(static_cast<CLogmsgNotification&>(*notification.get()));
+		break;
+	case nId_listing:
+		connection.listing_path = static_cast<CDirectoryListingNotification const&>(*notification.get()).GetPath();
+		break;
+	case nId_asyncrequest:
+		mainFrame_.GetAsyncRequestQueue()->AddRequest(connection.engine, unique_static_cast<CAsyncRequestNotification>(std::move(notification)));
+		break;
+	case nId_operation:
+		ProcessOperation(connection, static_cast<COperationNotification const&>(*notification.get()));
+		break;
+	default:
+		break;
+	}
+}
+
+void CRecursiveListingPool::ProcessOperation(t_connection& connection, COperationNotification const& operation)
+{
+	// Calls into the operation have to come last, they may destroy the pool.
+	if (connection.state == connection_state::connecting) {
+		if (operation.nReplyCode != FZ_REPLY_OK) {
+			connection.state = connection_state::failed;
+			if (connection.has_dir) {
+				connection.has_dir = false;
+				operation_.ReturnDirectory(connection.dir);
+			}
+			else {
+				operation_.NextOperation();
+			}
+			return;
+		}
+
+		if (connection.has_dir) {
+			if (StartListing(connection)) {
+				return;
+			}
+			connection.has_dir = false;
+			operation_.ReturnDirectory(connection.dir);
+			return;
+		}
+
+		connection.state = connection_state::idle;
+		operation_.NextOperation();
+	}
+	else if (connection.state == connection_state::listing) {
+		connection.state = connection_state::idle;
+		connection.has_dir = false;
+
+		if (operation.nReplyCode == FZ_REPLY_OK) {
+			CDirectoryListing listing;
+			if (!connection.listing_path.empty() &&
+				connection.engine->CacheLookup(connection.listing_path, listing) == FZ_REPLY_OK &&
+				!listing.failed())
+			{
+				operation_.ProcessPoolListing(listing, connection.dir);
+			}
+			else {
+				operation_.PoolListingFailed(connection.dir, FZ_REPLY_ERROR);
+			}
+		}
+		else if (operation.nReplyCode & FZ_REPLY_LINKNOTDIR) {
+			operation_.PoolLinkIsNotDir(connection.dir);
+		}
+		else {
+			operation_.PoolListingFailed(connection.dir, operation.nReplyCode);
+		}
+	}
+}
@@ -0,0 +1,71 @@
+#ifndef __RECURSIVE_LISTING_POOL_H__
+#define __RECURSIVE_LISTING_POOL_H__
+
+#include "recursive_operation.h"
+
+#include <memory>
+#include <vector>
+
+class CMainFrame;
+
+// Lists the directories of a recursive operation over a number of additional
+// connections to the server of the operation. Each connection lists one
+// directory at a time, the results are handed back to the operation which in
+// turn hands out the next directories.
+class CRecursiveListingPool final : public wxEvtHandler
+{
+public:
+	CRecursiveListingPool(CRecursiveOperation& operation, CMainFrame& mainFrame, CServer const& server, int connections);
+	virtual ~CRecursiveListingPool();
+
+	CRecursiveListingPool(CRecursiveListingPool const&) = delete;
+	CRecursiveListingPool& operator=(CRecursiveListingPool const&) = delete;
+
+	// Returns false if no connection is available to list the directory
+	bool List(CRecursiveOperation::CNewDir const& dir);
+
+	// True if no connection is connecting or listing.
+	bool Idle() const;
+
+private:
+	enum class connection_state
+	{
+		connecting,
+		idle,
+		listing,
+		failed
+	};
+
+	struct t_connection
+	{
+		CFileZillaEngine* engine{};
+		connection_state state{connection_state::failed};
+
+		bool has_dir{};
+		CRecursiveOperation::CNewDir dir;
+
+		// As reported by the engine, may differ from the requested path
+		CServerPath listing_path;
+	};
+
+	bool Connect(t_connection& connection);
+	bool StartListing(t_connection& connection);
+
+	void OnEngineEvent(wxFzEvent& event);
+	void ProcessNotification(t_connection& connection, std::unique_ptr<CNotification> && notification);
+	void ProcessOperation(t_connection& connection, COperationNotification const& operation);
+
+	CRecursiveOperation& operation_;
+	CMainFrame& mainFrame_;
+	CServer const server_;
+
+	std::vector<t_connection> connections_;
+
+	// The operation may destroy the pool while handling the results,
+	// notification processing holds a weak reference to notice.
+	std::shared_ptr<bool> alive_{std::make_shared<bool>(true)};
+
+	DECLARE_EVENT_TABLE()
+};
+
+#endif //__RECURSIVE_LISTING_POOL_H__
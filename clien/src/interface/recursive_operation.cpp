@@ -6,6 +6,9 @@
 #include "Options.h"
 #include "queue.h"
 #include "local_filesys.h"
+#include "loginmanager.h"
+#include "recursive_listing_pool.h"
+#include "sync_planner.h"
 
 CRecursiveOperation::CNewDir::CNewDir()
 {
@@ -25,11 +28,15 @@ CRecursiveOperation::CRecursiveOperation(CState* pState)
 
 CRecursiveOperation::~CRecursiveOperation()
 {
+	DestroyListingPool();
+
 	if (m_pChmodDlg)
 	{
 		m_pChmodDlg->Destroy();
 		m_pChmodDlg = 0;
 	}
+
+	delete m_pSyncPlanner;
 }
 
 void CRecursiveOperation::OnStateChange(CState* pState, enum t_statechange_notifications notification, const wxString&, const void* data2)
@@ -47,7 +54,7 @@ void CRecursiveOperation::OnStateChange(CState* pState, enum t_statechange_notif
 	}
 }
 
-void CRecursiveOperation::StartRecursiveOperation(enum OperationMode mode, const CServerPath& startDir, const std::list<CFilter>& filters, bool allowParent /*=false*/, const CServerPath& finalDir /*=CServerPath()*/)
+void CRecursiveOperation::StartRecursiveOperation(enum OperationMode mode, const CServerPath& startDir, std::shared_ptr<CFilterMatcher const> const& filters, bool allowParent /*=false*/, const CServerPath& finalDir /*=CServerPath()*/)
 {
 	wxCHECK_RET(m_operationMode == recursive_none, _T("StartRecursiveOperation called with m_operationMode != recursive_none"));
 	wxCHECK_RET(m_pState->IsRemoteConnected(), _T("StartRecursiveOperation while disconnected"));
@@ -56,7 +63,10 @@ void CRecursiveOperation::StartRecursiveOperation(enum OperationMode mode, const
 	if (mode == recursive_chmod && !m_pChmodDlg)
 		return;
 
-	if ((mode == recursive_download || mode == recursive_addtoqueue || mode == recursive_download_flatten || mode == recursive_addtoqueue_flatten) && !m_pQueue)
+	if ((mode == recursive_download || mode == recursive_addtoqueue || mode == recursive_download_flatten || mode == recursive_addtoqueue_flatten || mode == recursive_synchronize) && !m_pQueue)
+		return;
+
+	if (mode == recursive_synchronize && !m_pSyncPlanner)
 		return;
 
 	if (m_dirsToVisit.empty())
@@ -79,9 +89,50 @@ void CRecursiveOperation::StartRecursiveOperation(enum OperationMode mode, const
 
 	m_filters = filters;
 
+	CreateListingPool();
+
 	NextOperation();
 }
 
+void CRecursiveOperation::CreateListingPool()
+{
+	// Deleting needs the directories to be removed after their contents, and
+	// the search collects the listings from the primary connection
+	if (m_operationMode == recursive_delete || m_operationMode == recursive_list)
+		return;
+
+	int connections = COptions::Get()->GetOptionVal(OPTION_RECURSIVE_LISTING_CONNECTIONS);
+	if (connections <= 0)
+		return;
+
+	const CServer* pServer = m_pState->GetServer();
+	if (!pServer)
+		return;
+
+	CServer server = *pServer;
+	if (server.MaximumMultipleConnections())
+	{
+		// Leave room for the primary connection
+		connections = std::min(connections, server.MaximumMultipleConnections() - 1);
+		if (connections <= 0)
+			return;
+	}
+
+	// Additional connections must not prompt the user again
+	if (server.GetLogonType() == INTERACTIVE)
+		return;
+	if (server.GetLogonType() == ASK && !CLoginManager::Get().GetPassword(server, true))
+		return;
+
+	m_pListingPool = new CRecursiveListingPool(*this, *m_pState->GetMainFrame(), server, connections);
+}
+
+void CRecursiveOperation::DestroyListingPool()
+{
+	delete m_pListingPool;
+	m_pListingPool = 0;
+}
+
 void CRecursiveOperation::AddDirectoryToVisit(const CServerPath& path, const wxString& subdir, const CLocalPath& localDir /*=CLocalPath()*/, bool is_link /*=false*/)
 {
 	CNewDir dirToVisit;
@@ -107,6 +158,19 @@ bool CRecursiveOperation::NextOperation()
 	if (m_operationMode == recursive_none)
 		return false;
 
+	if (m_pListingPool)
+	{
+		while (!m_dirsToVisit.empty() && m_pListingPool->List(m_dirsToVisit.front()))
+			m_dirsToVisit.pop_front();
+
+		if (!m_pListingPool->Idle())
+			return true;
+
+		// Either all directories have been listed, or none of the additional
+		// connections is usable. Remaining directories get listed sequentially.
+		DestroyListingPool();
+	}
+
 	while (!m_dirsToVisit.empty())
 	{
 		const CNewDir& dirToVisit = m_dirsToVisit.front();
@@ -122,8 +186,15 @@ bool CRecursiveOperation::NextOperation()
 		return true;
 	}
 
+	std::list<wxString> syncConflicts;
+	syncConflicts.swap(m_syncConflicts);
+
 	StopRecursiveOperation();
 	m_pState->m_pCommandQueue->ProcessCommand(new CListCommand(m_finalDir));
+
+	if (!syncConflicts.empty())
+		ReportSyncConflicts(syncConflicts);
+
 	return false;
 }
 
@@ -168,6 +239,12 @@ void CRecursiveOperation::ProcessDirectoryListing(const CDirectoryListing* pDire
 	if (m_operationMode == recursive_none)
 		return;
 
+	if (m_pListingPool)
+	{
+		// Directories are listed by the pool
+		return;
+	}
+
 	if (pDirectoryListing->failed())
 	{
 		// Ignore this.
@@ -186,12 +263,32 @@ void CRecursiveOperation::ProcessDirectoryListing(const CDirectoryListing* pDire
 	CNewDir dir = m_dirsToVisit.front();
 	m_dirsToVisit.pop_front();
 
-	if (!BelowRecursionRoot(pDirectoryListing->path, dir))
+	HandleListing(*pDirectoryListing, dir);
+
+	NextOperation();
+}
+
+void CRecursiveOperation::ProcessPoolListing(const CDirectoryListing& listing, CNewDir dir)
+{
+	if (m_operationMode == recursive_none)
+		return;
+
+	if (!m_pState->IsRemoteConnected())
 	{
-		NextOperation();
+		StopRecursiveOperation();
 		return;
 	}
 
+	HandleListing(listing, dir);
+
+	NextOperation();
+}
+
+void CRecursiveOperation::HandleListing(const CDirectoryListing& listing, CNewDir& dir)
+{
+	if (!BelowRecursionRoot(listing.path, dir))
+		return;
+
 	if (m_operationMode == recursive_delete && dir.doVisit && !dir.subdir.empty())
 	{
 		// After recursing into directory to delete its contents, delete directory itself
@@ -202,22 +299,22 @@ void CRecursiveOperation::ProcessDirectoryListing(const CDirectoryListing* pDire
 	}
 
 	if (dir.link && !dir.recurse)
-	{
-		NextOperation();
 		return;
-	}
 
 	// Check if we have already visited the directory
-	if (!m_visitedDirs.insert(pDirectoryListing->path).second)
+	if (!m_visitedDirs.insert(listing.path).second)
+		return;
+
+	if (m_operationMode == recursive_synchronize)
 	{
-		NextOperation();
+		Synchronize(listing, dir);
 		return;
 	}
 
 	const CServer* pServer = m_pState->GetServer();
 	wxASSERT(pServer);
 
-	if (!pDirectoryListing->GetCount())
+	if (!listing.GetCount())
 	{
 		if (m_operationMode == recursive_download)
 		{
@@ -231,27 +328,25 @@ void CRecursiveOperation::ProcessDirectoryListing(const CDirectoryListing* pDire
 		}
 	}
 
-	CFilterManager filter;
-
 	// Is operation restricted to a single child?
 	bool restrict = !dir.restrict.empty();
 
 	std::list<wxString> filesToDelete;
 
-	const wxString path = pDirectoryListing->path.GetPath();
+	const wxString path = listing.path.GetPath();
 
 	bool added = false;
 
-	for (int i = pDirectoryListing->GetCount() - 1; i >= 0; --i)
+	for (int i = listing.GetCount() - 1; i >= 0; --i)
 	{
-		const CDirentry& entry = (*pDirectoryListing)[i];
+		const CDirentry& entry = listing[i];
 
 		if (restrict)
 		{
 			if (entry.name != dir.restrict)
 				continue;
 		}
-		else if (filter.FilenameFiltered(m_filters, entry.name, path, entry.is_dir(), entry.size, false, 0, entry.time))
+		else if (m_filters && m_filters->Filtered(entry.name, path, entry.is_dir(), entry.size, 0, entry.time))
 			continue;
 
 		if (entry.is_dir() && (!entry.is_link() || m_operationMode != recursive_delete))
@@ -259,7 +354,7 @@ void CRecursiveOperation::ProcessDirectoryListing(const CDirectoryListing* pDire
 			if (dir.recurse)
 			{
 				CNewDir dirToVisit;
-				dirToVisit.parent = pDirectoryListing->path;
+				dirToVisit.parent = listing.path;
 				dirToVisit.subdir = entry.name;
 				dirToVisit.localDir = dir.localDir;
 				dirToVisit.start_dir = dir.start_dir;
@@ -282,11 +377,11 @@ void CRecursiveOperation::ProcessDirectoryListing(const CDirectoryListing* pDire
 			case recursive_download_flatten:
 				{
 					wxString localFile = CQueueView::ReplaceInvalidCharacters(entry.name);
-					if (pDirectoryListing->path.GetType() == VMS && COptions::Get()->GetOptionVal(OPTION_STRIP_VMS_REVISION))
+					if (listing.path.GetType() == VMS && COptions::Get()->GetOptionVal(OPTION_STRIP_VMS_REVISION))
 						localFile = StripVMSRevision(localFile);
 					m_pQueue->QueueFile(m_operationMode == recursive_addtoqueue, true,
 						entry.name, (entry.name == localFile) ? wxString() : localFile,
-						dir.localDir, pDirectoryListing->path, *pServer, entry.size);
+						dir.localDir, listing.path, *pServer, entry.size);
 					added = true;
 				}
 				break;
@@ -294,11 +389,11 @@ void CRecursiveOperation::ProcessDirectoryListing(const CDirectoryListing* pDire
 			case recursive_addtoqueue_flatten:
 				{
 					wxString localFile = CQueueView::ReplaceInvalidCharacters(entry.name);
-					if (pDirectoryListing->path.GetType() == VMS && COptions::Get()->GetOptionVal(OPTION_STRIP_VMS_REVISION))
+					if (listing.path.GetType() == VMS && COptions::Get()->GetOptionVal(OPTION_STRIP_VMS_REVISION))
 						localFile = StripVMSRevision(localFile);
 					m_pQueue->QueueFile(true, true,
 						entry.name, (entry.name == localFile) ? wxString() : localFile,
-						dir.localDir, pDirectoryListing->path, *pServer, entry.size);
+						dir.localDir, listing.path, *pServer, entry.size);
 					added = true;
 				}
 				break;
@@ -320,7 +415,7 @@ void CRecursiveOperation::ProcessDirectoryListing(const CDirectoryListing* pDire
 				char permissions[9];
 				bool res = m_pChmodDlg->ConvertPermissions(*entry.permissions, permissions);
 				wxString newPerms = m_pChmodDlg->GetPermissions(res ? permissions : 0, entry.is_dir());
-				m_pState->m_pCommandQueue->ProcessCommand(new CChmodCommand(pDirectoryListing->path, entry.name, newPerms));
+				m_pState->m_pCommandQueue->ProcessCommand(new CChmodCommand(listing.path, entry.name, newPerms));
 			}
 		}
 	}
@@ -328,9 +423,69 @@ void CRecursiveOperation::ProcessDirectoryListing(const CDirectoryListing* pDire
 		m_pQueue->QueueFile_Finish(m_operationMode != recursive_addtoqueue && m_operationMode != recursive_addtoqueue_flatten);
 
 	if (m_operationMode == recursive_delete && !filesToDelete.empty())
-		m_pState->m_pCommandQueue->ProcessCommand(new CDeleteCommand(pDirectoryListing->path, filesToDelete));
+		m_pState->m_pCommandQueue->ProcessCommand(new CDeleteCommand(listing.path, filesToDelete));
+}
 
-	NextOperation();
+void CRecursiveOperation::Synchronize(const CDirectoryListing& listing, const CNewDir& dir)
+{
+	const CServer* pServer = m_pState->GetServer();
+	wxASSERT(pServer);
+
+	const CSyncPlanner::t_plan plan = m_pSyncPlanner->Plan(listing, dir.localDir);
+
+	for (auto const& file : plan.conflicts)
+		m_syncConflicts.push_back(listing.path.FormatFilename(file.remoteName));
+
+	for (auto iter = plan.subdirs.rbegin(); iter != plan.subdirs.rend(); ++iter)
+	{
+		CNewDir dirToVisit;
+		dirToVisit.parent = listing.path;
+		dirToVisit.subdir = iter->remoteName;
+		dirToVisit.localDir = dir.localDir;
+		dirToVisit.localDir.AddSegment(iter->localName);
+		dirToVisit.start_dir = dir.start_dir;
+		m_dirsToVisit.push_front(dirToVisit);
+	}
+
+	if (!listing.GetCount() && m_pSyncPlanner->GetRules().dir != CSyncPlanner::direction::upload)
+	{
+		wxFileName::Mkdir(dir.localDir.GetPath(), 0777, wxPATH_MKDIR_FULL);
+		m_pState->RefreshLocalFile(dir.localDir.GetPath());
+	}
+
+	// The plan only contains files known to differ, overwrite them without asking
+	for (auto const& file : plan.downloads)
+	{
+		m_pQueue->QueueFile(false, true, file.remoteName, (file.remoteName == file.localName) ? wxString() : file.localName,
+			dir.localDir, listing.path, *pServer, file.size, CEditHandler::none, QueuePriority::normal, CFileExistsNotification::overwrite);
+	}
+	for (auto const& file : plan.uploads)
+	{
+		m_pQueue->QueueFile(false, false, file.localName, (file.localName == file.remoteName) ? wxString() : file.remoteName,
+			dir.localDir, listing.path, *pServer, file.size, CEditHandler::none, QueuePriority::normal, CFileExistsNotification::overwrite);
+	}
+	if (!plan.downloads.empty() || !plan.uploads.empty())
+		m_pQueue->QueueFile_Finish(true);
+
+	for (auto const& folder : plan.folderUploads)
+	{
+		CLocalPath localPath = dir.localDir;
+		localPath.AddSegment(folder.localName);
+		CServerPath remotePath = listing.path;
+		if (remotePath.AddSegment(folder.remoteName))
+			m_pQueue->QueueFolder(false, false, localPath, remotePath, *pServer);
+	}
+
+	if (!plan.remoteDeletes.empty())
+		m_pState->m_pCommandQueue->ProcessCommand(new CDeleteCommand(listing.path, plan.remoteDeletes));
+
+	if (!plan.localDeletes.empty())
+	{
+		// Confirmed when starting the operation
+		CLocalFileSystem::RecursiveDelete(plan.localDeletes, 0);
+		if (dir.localDir == m_pState->GetLocalDir())
+			m_pState->RefreshLocal();
+	}
 }
 
 void CRecursiveOperation::SetChmodDialog(CChmodDialog* pChmodDialog)
@@ -350,6 +505,7 @@ void CRecursiveOperation::StopRecursiveOperation()
 		m_operationMode = recursive_none;
 		m_pState->NotifyHandlers(STATECHANGE_REMOTE_IDLE);
 	}
+	DestroyListingPool();
 	m_dirsToVisit.clear();
 	m_visitedDirs.clear();
 
@@ -358,11 +514,39 @@ void CRecursiveOperation::StopRecursiveOperation()
 		m_pChmodDlg->Destroy();
 		m_pChmodDlg = 0;
 	}
+
+	delete m_pSyncPlanner;
+	m_pSyncPlanner = 0;
+	m_syncConflicts.clear();
+}
+
+void CRecursiveOperation::ReportSyncConflicts(std::list<wxString> const& files)
+{
+	int const max_shown = 10;
+
+	wxString msg = wxString::Format(wxPLURAL("%d file differs in size between the local and the remote directory and has been left alone:", "%d files differ in size between the local and the remote directory and have been left alone:", static_cast<int>(files.size())), static_cast<int>(files.size()));
+	msg += _T("\n");
+
+	int shown = 0;
+	for (auto const& file : files) {
+		if (shown++ == max_shown)
+			break;
+		msg += _T("\n") + file;
+	}
+	if (static_cast<int>(files.size()) > max_shown) {
+		int const more = static_cast<int>(files.size()) - max_shown;
+		msg += _T("\n") + wxString::Format(wxPLURAL("... and %d more file", "... and %d more files", more), more);
+	}
+
+	msg += _T("\n\n");
+	msg += _("Synchronize in one direction to overwrite either side.");
+
+	wxMessageBoxEx(msg, _("Synchronize directories"), wxICON_INFORMATION);
 }
 
 void CRecursiveOperation::ListingFailed(int error)
 {
-	if (m_operationMode == recursive_none)
+	if (m_operationMode == recursive_none || m_pListingPool)
 		return;
 
 	if( (error & FZ_REPLY_CANCELED) == FZ_REPLY_CANCELED) {
@@ -377,6 +561,23 @@ void CRecursiveOperation::ListingFailed(int error)
 
 	CNewDir dir = m_dirsToVisit.front();
 	m_dirsToVisit.pop_front();
+	RetryDirectory(dir, error);
+
+	NextOperation();
+}
+
+void CRecursiveOperation::PoolListingFailed(CNewDir dir, int error)
+{
+	if (m_operationMode == recursive_none)
+		return;
+
+	RetryDirectory(dir, error);
+
+	NextOperation();
+}
+
+void CRecursiveOperation::RetryDirectory(CNewDir dir, int error)
+{
 	if ((error & FZ_REPLY_CRITICALERROR) != FZ_REPLY_CRITICALERROR && !dir.second_try)
 	{
 		// Retry, could have been a temporary socket creating failure
@@ -384,10 +585,27 @@ void CRecursiveOperation::ListingFailed(int error)
 		dir.second_try = true;
 		m_dirsToVisit.push_front(dir);
 	}
+}
+
+void CRecursiveOperation::ReturnDirectory(CNewDir dir)
+{
+	if (m_operationMode == recursive_none)
+		return;
+
+	// The connection supposed to list it could not be established, does not count as a try
+	m_dirsToVisit.push_front(dir);
 
 	NextOperation();
 }
 
+void CRecursiveOperation::SetSyncPlanner(CSyncPlanner* pSyncPlanner)
+{
+	wxASSERT(pSyncPlanner);
+
+	delete m_pSyncPlanner;
+	m_pSyncPlanner = pSyncPlanner;
+}
+
 void CRecursiveOperation::SetQueue(CQueueView* pQueue)
 {
 	m_pQueue = pQueue;
@@ -405,7 +623,7 @@ bool CRecursiveOperation::ChangeOperationMode(enum OperationMode mode)
 
 void CRecursiveOperation::LinkIsNotDir()
 {
-	if (m_operationMode == recursive_none)
+	if (m_operationMode == recursive_none || m_pListingPool)
 		return;
 
 	wxASSERT(!m_dirsToVisit.empty());
@@ -415,12 +633,26 @@ void CRecursiveOperation::LinkIsNotDir()
 	CNewDir dir = m_dirsToVisit.front();
 	m_dirsToVisit.pop_front();
 
+	HandleLinkIsNotDir(dir);
+
+	NextOperation();
+}
+
+void CRecursiveOperation::PoolLinkIsNotDir(CNewDir dir)
+{
+	if (m_operationMode == recursive_none)
+		return;
+
+	HandleLinkIsNotDir(dir);
+
+	NextOperation();
+}
+
+void CRecursiveOperation::HandleLinkIsNotDir(const CNewDir& dir)
+{
 	const CServer* pServer = m_pState->GetServer();
 	if (!pServer)
-	{
-		NextOperation();
 		return;
-	}
 
 	if (m_operationMode == recursive_delete)
 	{
@@ -430,10 +662,8 @@ void CRecursiveOperation::LinkIsNotDir()
 			files.push_back(dir.subdir);
 			m_pState->m_pCommandQueue->ProcessCommand(new CDeleteCommand(dir.parent, files));
 		}
-		NextOperation();
-		return;
 	}
-	else if (m_operationMode != recursive_list )
+	else if (m_operationMode != recursive_list && m_operationMode != recursive_synchronize)
 	{
 		CLocalPath localPath = dir.localDir;
 		wxString localFile = dir.subdir;
@@ -442,6 +672,4 @@ void CRecursiveOperation::LinkIsNotDir()
 		m_pQueue->QueueFile(m_operationMode == recursive_addtoqueue || m_operationMode == recursive_addtoqueue_flatten, true, dir.subdir, (dir.subdir == localFile) ? wxString() : localFile, localPath, dir.parent, *pServer, -1);
 		m_pQueue->QueueFile_Finish(m_operationMode != recursive_addtoqueue);
 	}
-
-	NextOperation();
 }
@@ -7,6 +7,8 @@
 
 class CChmodDialog;
 class CQueueView;
+class CRecursiveListingPool;
+class CSyncPlanner;
 
 class CRecursiveOperation : public CStateEventHandler
 {
@@ -23,10 +25,11 @@ public:
 		recursive_addtoqueue_flatten,
 		recursive_delete,
 		recursive_chmod,
-		recursive_list
+		recursive_list,
+		recursive_synchronize
 	};
 
-	void StartRecursiveOperation(enum OperationMode mode, const CServerPath& startDir, const std::list<CFilter> &filters, bool allowParent = false, const CServerPath& finalDir = CServerPath());
+	void StartRecursiveOperation(enum OperationMode mode, const CServerPath& startDir, std::shared_ptr<CFilterMatcher const> const& filters, bool allowParent = false, const CServerPath& finalDir = CServerPath());
 	void StopRecursiveOperation();
 
 	void AddDirectoryToVisit(const CServerPath& path, const wxString& subdir, const CLocalPath& localDir = CLocalPath(), bool is_link = false);
@@ -37,6 +40,9 @@ public:
 	// Needed for recursive_chmod
 	void SetChmodDialog(CChmodDialog* pChmodDialog);
 
+	// Needed for recursive_synchronize, takes ownership
+	void SetSyncPlanner(CSyncPlanner* pSyncPlanner);
+
 	void ListingFailed(int error);
 	void LinkIsNotDir();
 
@@ -79,6 +85,22 @@ protected:
 
 	bool BelowRecursionRoot(const CServerPath& path, CNewDir &dir);
 
+	// Shared by the primary connection and the listing pool
+	void HandleListing(const CDirectoryListing& listing, CNewDir& dir);
+	void HandleLinkIsNotDir(const CNewDir& dir);
+	void Synchronize(const CDirectoryListing& listing, const CNewDir& dir);
+	void ReportSyncConflicts(std::list<wxString> const& files);
+	void RetryDirectory(CNewDir dir, int error);
+
+	// Called by the listing pool
+	void ProcessPoolListing(const CDirectoryListing& listing, CNewDir dir);
+	void PoolListingFailed(CNewDir dir, int error);
+	void PoolLinkIsNotDir(CNewDir dir);
+	void ReturnDirectory(CNewDir dir);
+
+	void CreateListingPool();
+	void DestroyListingPool();
+
 	CServerPath m_startDir;
 	CServerPath m_finalDir;
 	std::set<CServerPath> m_visitedDirs;
@@ -89,11 +111,21 @@ protected:
 	// Needed for recursive_chmod
 	CChmodDialog* m_pChmodDlg{};
 
+	// Needed for recursive_synchronize
+	CSyncPlanner* m_pSyncPlanner{};
+
+	// Full remote paths of files skipped as they differ on both sides
+	std::list<wxString> m_syncConflicts;
+
 	CQueueView* m_pQueue{};
 
-	std::list<CFilter> m_filters;
+	std::shared_ptr<CFilterMatcher const> m_filters;
+
+	// Lists directories over additional connections, see OPTION_RECURSIVE_LISTING_CONNECTIONS
+	CRecursiveListingPool* m_pListingPool{};
 
 	friend class CCommandQueue;
+	friend class CRecursiveListingPool;
 };
 
 #endif //__RECURSIVE_OPERATION_H__
@@ -47,7 +47,8 @@ private:
 	virtual bool CanStartComparison(wxString*) { return false; }
 	virtual void StartComparison() {}
 	virtual bool GetNextFile(wxString&, bool &, wxLongLong &, CDateTime&) { return false; }
-	virtual void CompareAddFile(CComparableListing::t_fileEntryFlags) {}
+	virtual void CompareAddFile(CComparableListing::t_fileEntryFlags, size_t) {}
+	virtual void CompareUpdateFile(CComparableListing::t_fileEntryFlags, size_t) {}
 	virtual void FinishComparison() {}
 	virtual void ScrollTopItem(int) {}
 	virtual void OnExitComparisonMode() {}
@@ -305,7 +306,7 @@ void CSearchDialog::ProcessDirectoryListing()
 {
 	std::shared_ptr<CDirectoryListing> listing = m_pState->GetRemoteDir();
 
-	if (!listing || listing->failed())
+	if (!listing || listing->failed() || !m_search_matcher)
 		return;
 
 	// Do not process same directory multiple times
@@ -321,7 +322,7 @@ void CSearchDialog::ProcessDirectoryListing()
 	for (unsigned int i = 0; i < listing->GetCount(); ++i) {
 		const CDirentry& entry = (*listing)[i];
 
-		if (!CFilterManager::FilenameFilteredByFilter(m_search_filter, entry.name, listing->path.GetPath(), entry.is_dir(), entry.size, 0, entry.time))
+		if (!m_search_matcher->Filtered(entry.name, listing->path.GetPath(), entry.is_dir(), entry.size, 0, entry.time))
 			continue;
 
 		CSearchFileData data;
@@ -373,13 +374,14 @@ void CSearchDialog::OnSearch(wxCommandEvent& event)
 		return;
 	}
 	m_search_filter = GetFilter();
-	if (!CFilterManager::CompileRegexes(m_search_filter)) {
-		wxMessageBoxEx(_("Invalid regular expression in search conditions."), _("Remote file search"), wxICON_EXCLAMATION);
-		return;
-	}
 	m_search_filter.matchCase = xrc_call(*this, "ID_CASE", &wxCheckBox::GetValue);
 	m_search_filter.filterFiles = xrc_call(*this, "ID_FIND_FILES", &wxCheckBox::GetValue);
 	m_search_filter.filterDirs = xrc_call(*this, "ID_FIND_DIRS", &wxCheckBox::GetValue);
+	m_search_matcher = std::make_shared<CFilterMatcher>(std::vector<CFilter>(1, m_search_filter));
+	if (!m_search_matcher->IsValid()) {
+		wxMessageBoxEx(_("Invalid regular expression in search conditions."), _("Remote file search"), wxICON_EXCLAMATION);
+		return;
+	}
 
 	// Delete old results
 	m_results->ClearSelection();
@@ -394,8 +396,8 @@ void CSearchDialog::OnSearch(wxCommandEvent& event)
 	// Start
 	m_searching = true;
 	m_pState->GetRecursiveOperationHandler()->AddDirectoryToVisitRestricted(path, _T(""), true);
-	std::list<CFilter> filters; // Empty, recurse into everything
-	m_pState->GetRecursiveOperationHandler()->StartRecursiveOperation(CRecursiveOperation::recursive_list, path, filters, true);
+	// No filters, recurse into everything
+	m_pState->GetRecursiveOperationHandler()->StartRecursiveOperation(CRecursiveOperation::recursive_list, path, nullptr, true);
 }
 
 void CSearchDialog::OnStop(wxCommandEvent& event)
@@ -653,8 +655,8 @@ void CSearchDialog::OnDownload(wxCommandEvent&)
 			target_path.AddSegment(dir.GetLastSegment());
 
 		m_pState->GetRecursiveOperationHandler()->AddDirectoryToVisit(dir, _T(""), target_path, false);
-		std::list<CFilter> filters; // Empty, recurse into everything
-		m_pState->GetRecursiveOperationHandler()->StartRecursiveOperation(mode, dir, filters, true, m_original_dir);
+		// No filters, recurse into everything
+		m_pState->GetRecursiveOperationHandler()->StartRecursiveOperation(mode, dir, nullptr, true, m_original_dir);
 	}
 }
 
@@ -759,8 +761,8 @@ void CSearchDialog::OnDelete(wxCommandEvent&)
 			path = path.GetParent();
 		}
 
-		std::list<CFilter> filters; // Empty, recurse into everything
-		m_pState->GetRecursiveOperationHandler()->StartRecursiveOperation(CRecursiveOperation::recursive_delete, path, filters, !path.HasParent(), m_original_dir);
+		// No filters, recurse into everything
+		m_pState->GetRecursiveOperationHandler()->StartRecursiveOperation(CRecursiveOperation::recursive_delete, path, nullptr, !path.HasParent(), m_original_dir);
 	}
 }
 
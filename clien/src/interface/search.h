@@ -36,6 +36,7 @@ protected:
 	CWindowStateManager* m_pWindowStateManager{};
 
 	CFilter m_search_filter;
+	std::shared_ptr<CFilterMatcher const> m_search_matcher; // Compiled when the search starts
 
 	bool m_searching{};
 
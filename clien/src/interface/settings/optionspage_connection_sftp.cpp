@@ -52,6 +52,19 @@ bool COptionsPageConnectionSFTP::LoadPage()
 
 	bool failure = false;
 
+	// The choices are levels 1, 6 and 9, custom levels go to the closest one
+	int const level = m_pOptions->GetOptionVal(OPTION_SFTP_COMPRESSION);
+	int compression = 0;
+	if (level >= 8)
+		compression = 3;
+	else if (level >= 4)
+		compression = 2;
+	else if (level > 0)
+		compression = 1;
+	SetChoice(XRCID("ID_SFTP_COMPRESSION"), compression, failure);
+
+	SetCheckFromOption(XRCID("ID_SFTP_SHARE_CONNECTIONS"), OPTION_SFTP_CONNECTION_SHARING, failure);
+
 	SetCtrlState();
 
 	return !failure;
@@ -71,6 +84,13 @@ bool COptionsPageConnectionSFTP::SavePage()
 		m_pOptions->SetOption(OPTION_SFTP_KEYFILES, keyFiles);
 	}
 
+	int const levels[] = { 0, 1, 6, 9 };
+	int const compression = GetChoice(XRCID("ID_SFTP_COMPRESSION"));
+	if (compression >= 0 && compression < 4)
+		m_pOptions->SetOption(OPTION_SFTP_COMPRESSION, levels[compression]);
+
+	SetOptionFromCheck(XRCID("ID_SFTP_SHARE_CONNECTIONS"), OPTION_SFTP_CONNECTION_SHARING);
+
 	if (m_pProcess) {
 		m_pProcess->CloseOutput();
 		m_pProcess->Detach();
@@ -119,6 +119,8 @@ public:
 	const CServer* GetServer() const;
 	wxString GetTitle() const;
 
+	CMainFrame* GetMainFrame() const { return m_pMainFrame; }
+
 	void RefreshLocal();
 	void RefreshLocalFile(wxString file);
 	void LocalDirCreated(const CLocalPath& path);
@@ -0,0 +1,108 @@
+#include <filezilla.h>
+#include "sync_planner.h"
+#include "local_filesys.h"
+#include "Options.h"
+#include "QueueView.h"
+
+// Defined in RemoteListView.cpp
+extern wxString StripVMSRevision(const wxString& name);
+
+CSyncPlanner::CSyncPlanner(t_rules const& rules, std::shared_ptr<CFilterMatcher const> const& localFilters, std::shared_ptr<CFilterMatcher const> const& remoteFilters)
+	: CSyncDecider(rules)
+	, m_localFilters(localFilters)
+	, m_remoteFilters(remoteFilters)
+{
+}
+
+CSyncPlanner::t_plan CSyncPlanner::Plan(CDirectoryListing const& listing, CLocalPath const& localDir) const
+{
+	t_plan plan;
+
+	// Remote names are joined by the local name they would get on download
+	std::vector<CDirectoryComparison::entry> remoteEntries;
+	std::vector<t_transfer> remoteFiles;
+	std::vector<bool> remoteLinks;
+
+	const wxString remotePath = listing.path.GetPath();
+	const bool stripVMS = listing.path.GetType() == VMS && COptions::Get()->GetOptionVal(OPTION_STRIP_VMS_REVISION);
+
+	for (size_t i = 0; i < listing.GetCount(); ++i) {
+		const CDirentry& entry = listing[i];
+		if (m_remoteFilters->Filtered(entry.name, remotePath, entry.is_dir(), entry.size, 0, entry.time))
+			continue;
+
+		t_transfer file;
+		file.remoteName = entry.name;
+		file.localName = CQueueView::ReplaceInvalidCharacters(entry.name);
+		if (stripVMS)
+			file.localName = StripVMSRevision(file.localName);
+		file.size = entry.size.GetValue();
+
+		CDirectoryComparison::entry e;
+		e.name = file.localName;
+		e.dir = entry.is_dir();
+		e.size = file.size;
+		e.time = entry.time;
+
+		remoteEntries.push_back(e);
+		remoteFiles.push_back(file);
+		remoteLinks.push_back(entry.is_link());
+	}
+
+	std::vector<CDirectoryComparison::entry> localEntries;
+	std::vector<bool> localLinks;
+
+	CLocalFileSystem fs;
+	if (fs.BeginFindFiles(localDir.GetPath(), false)) {
+		CDirectoryComparison::entry e;
+		bool isLink;
+		int attributes;
+		while (fs.GetNextFile(e.name, isLink, e.dir, &e.size, &e.time, &attributes)) {
+			if (m_localFilters->Filtered(e.name, localDir.GetPath(), e.dir, e.size, attributes, e.time))
+				continue;
+
+			localEntries.push_back(e);
+			localLinks.push_back(isLink);
+		}
+	}
+
+#ifdef __WXMSW__
+	const bool case_sensitive = false;
+#else
+	const bool case_sensitive = true;
+#endif
+	CDirectoryComparison comparison(m_rules.compare_date ? CDirectoryComparison::mode::date : CDirectoryComparison::mode::size, m_rules.threshold, case_sensitive);
+	comparison.Set(CDirectoryComparison::side::left, std::move(localEntries));
+	comparison.Set(CDirectoryComparison::side::right, std::move(remoteEntries));
+
+	for (auto const& m : comparison.GetMatches()) {
+		t_transfer local;
+		t_transfer remote;
+		bool dir = false;
+		bool link = false;
+
+		if (m.left != CDirectoryComparison::npos) {
+			CDirectoryComparison::entry const& e = comparison.Get(CDirectoryComparison::side::left, m.left);
+			local.localName = e.name;
+			local.remoteName = e.name;
+			local.size = e.size;
+			dir = e.dir;
+			link = localLinks[m.left];
+		}
+		if (m.right != CDirectoryComparison::npos) {
+			remote = remoteFiles[m.right];
+			dir = comparison.Get(CDirectoryComparison::side::right, m.right).dir;
+			link = link || remoteLinks[m.right];
+		}
+
+		if (!dir)
+			PlanFile(plan, m.res, local, remote, localDir);
+		else if (!link) {
+			// Links to directories are not followed, the target may be
+			// anywhere, even above the directory being synchronized.
+			PlanDirectory(plan, m.res, local, remote, localDir);
+		}
+	}
+
+	return plan;
+}
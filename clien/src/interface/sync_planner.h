@@ -0,0 +1,23 @@
+#ifndef __SYNC_PLANNER_H__
+#define __SYNC_PLANNER_H__
+
+#include "sync_decider.h"
+#include "filter.h"
+
+// Decides what needs to be transferred or deleted to bring a local and a
+// remote directory in sync. Works on one pair of directories at a time,
+// the recursive operation walks both trees and queues each plan right away.
+class CSyncPlanner final : public CSyncDecider
+{
+public:
+	CSyncPlanner(t_rules const& rules, std::shared_ptr<CFilterMatcher const> const& localFilters, std::shared_ptr<CFilterMatcher const> const& remoteFilters);
+
+	// Reads the local directory, it need not exist.
+	t_plan Plan(CDirectoryListing const& listing, CLocalPath const& localDir) const;
+
+protected:
+	std::shared_ptr<CFilterMatcher const> const m_localFilters;
+	std::shared_ptr<CFilterMatcher const> const m_remoteFilters;
+};
+
+#endif //__SYNC_PLANNER_H__
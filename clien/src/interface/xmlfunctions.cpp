@@ -577,6 +577,8 @@ bool GetServer(TiXmlElement *node, CServer& server)
 	int maximumMultipleConnections = GetTextElementInt(node, "MaximumMultipleConnections");
 	server.MaximumMultipleConnections(maximumMultipleConnections);
 
+	server.SetSpeedLimits(GetTextElementInt(node, "SpeedLimitInbound"), GetTextElementInt(node, "SpeedLimitOutbound"));
+
 	wxString encodingType = GetTextElement(node, "EncodingType");
 	if (encodingType == _T("Auto"))
 		server.SetEncodingType(ENCODING_AUTO);
@@ -675,6 +677,10 @@ void SetServer(TiXmlElement *node, const CServer& server)
 		break;
 	}
 	AddTextElement(node, "MaximumMultipleConnections", server.MaximumMultipleConnections());
+	if (server.GetInboundSpeedLimit())
+		AddTextElement(node, "SpeedLimitInbound", server.GetInboundSpeedLimit());
+	if (server.GetOutboundSpeedLimit())
+		AddTextElement(node, "SpeedLimitOutbound", server.GetOutboundSpeedLimit());
 
 	switch (server.GetEncodingType())
 	{
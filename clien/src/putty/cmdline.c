@@ -455,6 +455,27 @@ int cmdline_process_param(char *p, char *value, int need_save, Conf *conf)
 	conf_set_int(conf, CONF_compression, 1);
     }
 
+    if (!strcmp(p, "-share")) {
+	RETURN(1);
+	UNAVAILABLE_IN(TOOLTYPE_NONNETWORK);
+	SAVEABLE(0);
+	conf_set_int(conf, CONF_ssh_connection_sharing, 1);
+    }
+
+    if (!strcmp(p, "-compresslevel")) {
+	int level;
+	RETURN(2);
+	UNAVAILABLE_IN(TOOLTYPE_NONNETWORK);
+	SAVEABLE(0);
+	level = atoi(value);
+	if (level < 1 || level > 9) {
+	    cmdline_error("compression level must be between 1 and 9");
+	    return ret;
+	}
+	conf_set_int(conf, CONF_compression, 1);
+	conf_set_int(conf, CONF_compression_level, level);
+    }
+
     if (!strcmp(p, "-1")) {
 	RETURN(1);
 	UNAVAILABLE_IN(TOOLTYPE_NONNETWORK);
@@ -1,9 +1,59 @@
 #include "putty.h"
 #include "misc.h"
 
+#ifdef _WINDOWS
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+/*
+ * Messages to FileZilla are either text lines, a type digit followed
+ * by the text, or binary frames: the type as one byte, the length of
+ * the payload as 32-bit big-endian number, and the payload. Text is
+ * the default so fzsftp can be used by hand, FileZilla itself asks
+ * for binary frames with -binary.
+ *
+ * The payload of text messages is the text, the one of fznotify1 a
+ * 32-bit big-endian number, and the one of requests the request type
+ * as one byte followed by the fields of the request.
+ */
+static int binary_framing = 0;
+
+void fzprintf_set_binary(void)
+{
+#ifdef _WINDOWS
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    binary_framing = 1;
+}
+
+static void write_frame_header(sftpEventTypes type, int len)
+{
+    unsigned char header[5];
+    header[0] = (unsigned char)type;
+    PUT_32BIT_MSB_FIRST(header + 1, len);
+    fwrite(header, 1, 5, stdout);
+}
+
+static void write_message(sftpEventTypes type, const char* str, int len)
+{
+    if (binary_framing) {
+	write_frame_header(type, len);
+	fwrite(str, 1, len, stdout);
+    }
+    else {
+	fputc((char)type + '0', stdout);
+	fwrite(str, 1, len, stdout);
+	fputc('\n', stdout);
+    }
+}
+
 int fznotify(sftpEventTypes type)
 {
-    fprintf(stdout, "%c", (int)type + '0');
+    if (binary_framing)
+	write_frame_header(type, 0);
+    else
+	fprintf(stdout, "%c", (int)type + '0');
     fflush(stdout);
     return 0;
 }
@@ -19,7 +69,7 @@ int fzprintf(sftpEventTypes type, const char* fmt, ...)
 	sfree(str);
 	va_end(ap);
 
-	fprintf(stdout, "%c\n", (int)type + '0');
+	write_message(type, "", 0);
 	fflush(stdout);
 
 	return 0;
@@ -32,8 +82,7 @@ int fzprintf(sftpEventTypes type, const char* fmt, ...)
 	{
 	    if (p != s)
 	    {
-		*p = 0;
-		fprintf(stdout, "%c%s\n", (int)type + '0', s);
+		write_message(type, s, p - s);
 		s = p + 1;
 	    }
 	    else
@@ -42,11 +91,7 @@ int fzprintf(sftpEventTypes type, const char* fmt, ...)
 	else if (!*p)
 	{
 	    if (p != s)
-	    {
-		*p = 0;
-		fprintf(stdout, "%c%s\n", (int)type + '0', s);
-		s = p + 1;
-	    }
+		write_message(type, s, p - s);
 	    break;
 	}
 	p++;
@@ -60,14 +105,13 @@ int fzprintf(sftpEventTypes type, const char* fmt, ...)
     return 0;
 }
 
-int fzprintf_raw_untrusted(sftpEventTypes type, const char* fmt, ...)
+/*
+ * Joins the lines of text that did not come from us into one, to be
+ * sent as a single message.
+ */
+static char* join_untrusted_lines(char* str)
 {
-    va_list ap;
-    char* str, *p, *s;
-    va_start(ap, fmt);
-    str = dupvprintf(fmt, ap);
-    p = str;
-    s = str;
+    char *p = str, *s = str;
     while (*p)
     {
 	if (*p == '\r')
@@ -84,8 +128,18 @@ int fzprintf_raw_untrusted(sftpEventTypes type, const char* fmt, ...)
     while (s != str && *(s - 1) == ' ')
 	s--;
     *s = 0;
+
+    return str;
+}
+
+int fzprintf_raw_untrusted(sftpEventTypes type, const char* fmt, ...)
+{
+    va_list ap;
+    char* str;
+    va_start(ap, fmt);
+    str = join_untrusted_lines(dupvprintf(fmt, ap));
     if (*str)
-	fprintf(stdout, "%c%s\n", (int)type + '0', str);
+	write_message(type, str, strlen(str));
 
     sfree(str);
 
@@ -96,19 +150,43 @@ int fzprintf_raw_untrusted(sftpEventTypes type, const char* fmt, ...)
     return 0;
 }
 
-int fzprintf_raw(sftpEventTypes type, const char* fmt, ...)
+int fzrequest_password(const char* prompt)
 {
-    va_list ap;
-    char* str ;
-    va_start(ap, fmt);
-    str = dupvprintf(fmt, ap);
+    char* str = join_untrusted_lines(dupstr(prompt));
+    int len = strlen(str);
 
-    fputc((char)type + '0', stdout);
-    fputs(str, stdout);
+    if (binary_framing) {
+	write_frame_header(sftpRequest, 1 + len);
+	fputc(sftpReqPassword, stdout);
+	fwrite(str, 1, len, stdout);
+    }
+    else
+	fprintf(stdout, "%c%d%s\n", (int)sftpRequest + '0', (int)sftpReqPassword, str);
 
     sfree(str);
 
-    va_end(ap);
+    fflush(stdout);
+
+    return 0;
+}
+
+int fzrequest_hostkey(enum sftpRequestTypes type, const char* host, int port, const char* fingerprint)
+{
+    if (binary_framing) {
+	unsigned char buf[4];
+	int hostlen = strlen(host), fplen = strlen(fingerprint);
+
+	write_frame_header(sftpRequest, 1 + 4 + hostlen + 4 + fplen);
+	fputc(type, stdout);
+	PUT_32BIT_MSB_FIRST(buf, hostlen);
+	fwrite(buf, 1, 4, stdout);
+	fwrite(host, 1, hostlen, stdout);
+	PUT_32BIT_MSB_FIRST(buf, port);
+	fwrite(buf, 1, 4, stdout);
+	fwrite(fingerprint, 1, fplen, stdout);
+    }
+    else
+	fprintf(stdout, "%c%d%s\n%d\n%s\n", (int)sftpRequest + '0', (int)type, host, port, fingerprint);
 
     fflush(stdout);
 
@@ -117,8 +195,14 @@ int fzprintf_raw(sftpEventTypes type, const char* fmt, ...)
 
 int fznotify1(sftpEventTypes type, int data)
 {
-    fprintf(stdout, "%c%d\n", (int)type + '0', data);
+    if (binary_framing) {
+	unsigned char buf[4];
+	write_frame_header(type, 4);
+	PUT_32BIT_MSB_FIRST(buf, data);
+	fwrite(buf, 1, 4, stdout);
+    }
+    else
+	fprintf(stdout, "%c%d\n", (int)type + '0', data);
     fflush(stdout);
     return 0;
 }
-
@@ -1,4 +1,4 @@
-#define FZSFTP_PROTOCOL_VERSION 2
+#define FZSFTP_PROTOCOL_VERSION 5
 
 typedef enum
 {
@@ -24,7 +24,8 @@ typedef enum
     sftpCipherServerToClient,
     sftpMacClientToServer,
     sftpMacServerToClient,
-    sftpHostkey
+    sftpHostkey,
+    sftpPipelineStats /* payload: statistics of the request pipeline of a finished transfer */
 } sftpEventTypes;
 
 enum sftpRequestTypes
@@ -35,8 +36,10 @@ enum sftpRequestTypes
     sftpReqUnknown
 };
 
+void fzprintf_set_binary(void);
 int fznotify(sftpEventTypes type);
 int fzprintf(sftpEventTypes type, const char* p, ...);
-int fzprintf_raw(sftpEventTypes type, const char* p, ...);
 int fzprintf_raw_untrusted(sftpEventTypes type, const char* p, ...);
+int fzrequest_password(const char* prompt);
+int fzrequest_hostkey(enum sftpRequestTypes type, const char* host, int port, const char* fingerprint);
 int fznotify1(sftpEventTypes type, int data);
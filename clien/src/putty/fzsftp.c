@@ -11,7 +11,152 @@ int limit[2] = { 0, 0 };
 
 char* input_pushback = 0;
 
+static int filezilla_gone = 0;
+
+#ifdef FZ_SHARED_QUOTA
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+
+/*
+ * Instead of sending quota requests and grants over the pipes, FileZilla
+ * can hand out the tokens of its rate limiter through shared memory. We
+ * only tell FileZilla when we are about to run out and, if we did, wait
+ * on the wakeup counter until it has granted more.
+ *
+ * Must match the layout in src/engine/sftpsharedquota.cpp
+ */
+#define SHARED_QUOTA_VERSION 1
+
+#define SHARED_QUOTA_UNLIMITED 0x1 /* Tokens are not needed */
+#define SHARED_QUOTA_REQUESTED 0x2 /* Set by us, cleared by FileZilla once it has answered */
+
+struct shared_quota_direction {
+    int64_t available;	/* Added to by FileZilla, what we use gets subtracted */
+    int32_t limit;	/* Speed limit for CurrentSpeedLimit */
+    uint32_t state;
+    uint32_t wakeup;	/* Futex word, incremented by FileZilla after each answer */
+    uint32_t padding[11];
+};
+
+struct shared_quota {
+    uint32_t version;
+    uint32_t padding[15];
+    struct shared_quota_direction d[2];
+};
+
+static struct shared_quota* shared_quota = 0;
+static int unlimited_uses[2] = { 0, 0 };
+
+int OpenSharedQuota(const char* name)
+{
+    void* p;
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1)
+	return 0;
+
+    p = mmap(0, sizeof(struct shared_quota), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    /* The name is no longer needed once both sides have it mapped */
+    shm_unlink(name);
+
+    if (p == MAP_FAILED)
+	return 0;
+
+    shared_quota = (struct shared_quota*)p;
+    if (__atomic_load_n(&shared_quota->version, __ATOMIC_ACQUIRE) != SHARED_QUOTA_VERSION) {
+	munmap(p, sizeof(struct shared_quota));
+	shared_quota = 0;
+	return 0;
+    }
+
+    return 1;
+}
+
+static void RequestSharedQuotaUpdate(int i)
+{
+    /* Only one request at a time, FileZilla would answer the others late */
+    uint32_t state = __atomic_fetch_or(&shared_quota->d[i].state, SHARED_QUOTA_REQUESTED, __ATOMIC_ACQ_REL);
+    if (!(state & SHARED_QUOTA_REQUESTED))
+	fznotify(sftpUsedQuotaRecv + i);
+}
+
+static void WaitSharedQuota(int i, uint32_t wakeup)
+{
+    struct timespec timeout;
+    struct pollfd pfd;
+
+    timeout.tv_sec = 1;
+    timeout.tv_nsec = 0;
+    if (syscall(SYS_futex, &shared_quota->d[i].wakeup, FUTEX_WAIT, wakeup, &timeout, 0, 0) == 0 || errno != ETIMEDOUT)
+	return;
+
+    /* Nobody would ever wake us if FileZilla went away */
+    pfd.fd = 0;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR)) && !(pfd.revents & POLLIN))
+	FileZillaGone();
+}
+
+static int RequestSharedQuota(int i, int bytes)
+{
+    struct shared_quota_direction* d = &shared_quota->d[i];
+
+    while (1) {
+	uint32_t wakeup = __atomic_load_n(&d->wakeup, __ATOMIC_ACQUIRE);
+	uint32_t state = __atomic_load_n(&d->state, __ATOMIC_ACQUIRE);
+	int64_t available;
+
+	if (state & SHARED_QUOTA_UNLIMITED) {
+	    /* Limits might have been enabled in the meantime */
+	    if (++unlimited_uses[i] > 100) {
+		unlimited_uses[i] = 0;
+		RequestSharedQuotaUpdate(i);
+	    }
+	    return bytes;
+	}
+
+	available = __atomic_load_n(&d->available, __ATOMIC_ACQUIRE);
+	if (available > 0) {
+	    /* Ask for more before running out so we do not have to wait */
+	    if (available <= bytes) {
+		RequestSharedQuotaUpdate(i);
+		return (int)available;
+	    }
+	    return bytes;
+	}
+
+	RequestSharedQuotaUpdate(i);
+	WaitSharedQuota(i, wakeup);
+	if (filezilla_gone)
+	    return bytes;
+    }
+}
+
+static void UpdateSharedQuota(int i, int bytes)
+{
+    struct shared_quota_direction* d = &shared_quota->d[i];
+    int64_t available = __atomic_load_n(&d->available, __ATOMIC_RELAXED);
+    int64_t left;
+
+    if (__atomic_load_n(&d->state, __ATOMIC_ACQUIRE) & SHARED_QUOTA_UNLIMITED)
+	return;
+
+    do {
+	left = available > bytes ? available - bytes : 0;
+    } while (!__atomic_compare_exchange_n(&d->available, &available, left, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+}
+#endif
+
 #ifndef _WINDOWS
+#include <signal.h>
 #include <unistd.h>
 
 char *input_buf = 0;
@@ -39,7 +184,10 @@ static int ReadQuotas(int i)
 
 	r = ReadFile(hin, buffer, 20, &read, 0);
 	if (!r || read == 0)
-	    fatalbox("ReadFile failed in ReadQuotas");
+	{
+	    FileZillaGone();
+	    break;
+	}
 	buffer[read] = 0;
 
 	if (buffer[0] != '-')
@@ -62,7 +210,7 @@ static int ReadQuotas(int i)
 	line = read_input_line(1, &error);
 	if (line == NULL || error)
 	{
-	    fatalbox("read_input_line failed in ReadQuotas");
+	    FileZillaGone();
 	    break;
 	}
 
@@ -83,6 +231,14 @@ static int ReadQuotas(int i)
 
 int RequestQuota(int i, int bytes)
 {
+    if (filezilla_gone)
+	return bytes;
+
+#ifdef FZ_SHARED_QUOTA
+    if (shared_quota)
+	return RequestSharedQuota(i, bytes);
+#endif
+
     if (bytesAvailable[i] < -100)
 	bytesAvailable[i] = 0;
     else if (bytesAvailable[i] < 0)
@@ -98,6 +254,8 @@ int RequestQuota(int i, int bytes)
     if (bytesAvailable[i] == 0)
     {
 	ReadQuotas(i);
+	if (filezilla_gone)
+	    return bytes;
     }
 
     if (bytesAvailable[i] < 0 || bytesAvailable[i] > bytes)
@@ -108,6 +266,16 @@ int RequestQuota(int i, int bytes)
 
 void UpdateQuota(int i, int bytes)
 {
+    if (filezilla_gone)
+	return;
+
+#ifdef FZ_SHARED_QUOTA
+    if (shared_quota) {
+	UpdateSharedQuota(i, bytes);
+	return;
+    }
+#endif
+
     if (bytesAvailable[i] < 0)
 	return;
 
@@ -117,6 +285,34 @@ void UpdateQuota(int i, int bytes)
 	bytesAvailable[i] = 0;
 }
 
+/*
+ * Once FileZilla has closed our input nobody hands out quota anymore,
+ * everything we still send or receive goes unlimited.
+ */
+void FileZillaGone(void)
+{
+    if (filezilla_gone)
+	return;
+    filezilla_gone = 1;
+
+#ifndef _WINDOWS
+    /* Writing to the pipe it closed must not kill us */
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+#ifdef FZ_SHARED_QUOTA
+    if (shared_quota) {
+	munmap(shared_quota, sizeof(struct shared_quota));
+	shared_quota = 0;
+    }
+#endif
+}
+
+int IsFileZillaGone(void)
+{
+    return filezilla_gone;
+}
+
 int ProcessQuotaCmd(const char* line)
 {
     int direction = 0, number, pos;
@@ -323,5 +519,9 @@ int fz_timer_check(_fztimer *timer)
 
 int CurrentSpeedLimit(int direction)
 {
+#ifdef FZ_SHARED_QUOTA
+    if (shared_quota)
+	return __atomic_load_n(&shared_quota->d[direction].limit, __ATOMIC_RELAXED);
+#endif
     return limit[direction];
 }
@@ -4,6 +4,11 @@
 int ProcessQuotaCmd(const char* line);
 int RequestQuota(int i, int bytes);
 void UpdateQuota(int i, int bytes);
+
+/* Called once FileZilla has closed our input, releases the quota */
+void FileZillaGone(void);
+int IsFileZillaGone(void);
+
 char* get_input_pushback(void);
 int has_input_pushback(void);
 #ifndef _WINDOWS
@@ -12,6 +17,13 @@ char* read_input_line(int force, int* error);
 
 int CurrentSpeedLimit(int direction);
 
+#if defined(HAVE_LINUX_FUTEX_H) && defined(HAVE_SHM_OPEN)
+#define FZ_SHARED_QUOTA 1
+
+/* Takes the quota from the shared memory FileZilla created */
+int OpenSharedQuota(const char* name);
+#endif
+
 #ifdef _WINDOWS
 #include <windows.h>
 typedef FILETIME _fztimer;
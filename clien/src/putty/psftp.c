@@ -32,6 +32,7 @@ const char *const appname = "PSFTP";
 static int psftp_connect(char *userhost, char *user, int portnumber);
 static int do_sftp_init(void);
 void do_sftp_cleanup();
+static void linger_for_downstreams(void);
 
 /* ----------------------------------------------------------------------
  * sftp client state.
@@ -42,6 +43,7 @@ static Backend *back;
 static void *backhandle;
 static Conf *conf;
 int sent_eof = FALSE;
+static int lingering = FALSE;
 
 /* ----------------------------------------------------------------------
  * Manage sending requests and waiting for replies.
@@ -277,7 +279,13 @@ static void not_connected(void)
 /* ----------------------------------------------------------------------
  * The meat of the `get' and `put' commands.
  */
-int sftp_get_file(char *fname, char *outfname, int recurse, int restart)
+/*
+ * If range is not NULL, only range[1] bytes starting at offset
+ * range[0] are downloaded and written at the same offset into the
+ * local file. The local file is not truncated.
+ */
+int sftp_get_file(char *fname, char *outfname, int recurse, int restart,
+		  uint64 *range)
 {
     struct fxp_handle *fh;
     struct sftp_packet *pktin;
@@ -429,7 +437,8 @@ int sftp_get_file(char *fname, char *outfname, int recurse, int restart)
 		
 		nextfname = dupcat(fname, "/", ournames[i]->filename, NULL);
                 nextoutfname = dir_file_cat(outfname, ournames[i]->filename);
-		ret = sftp_get_file(nextfname, nextoutfname, recurse, restart);
+		ret = sftp_get_file(nextfname, nextoutfname, recurse, restart,
+				    NULL);
 		restart = FALSE;       /* after first partial file, do full */
 		sfree(nextoutfname);
 		sfree(nextfname);
@@ -468,7 +477,9 @@ int sftp_get_file(char *fname, char *outfname, int recurse, int restart)
 	return 0;
     }
 
-    if (restart) {
+    if (range) {
+	file = open_shared_wfile(outfname);
+    } else if (restart) {
 	file = open_existing_wfile(outfname, NULL);
     } else {
 	file = open_new_file(outfname, GET_PERMISSIONS(attrs));
@@ -484,7 +495,23 @@ int sftp_get_file(char *fname, char *outfname, int recurse, int restart)
 	return 0;
     }
 
-    if (restart) {
+    if (range) {
+	char decbuf[30];
+	if (seek_file(file, range[0], FROM_START) == -1) {
+	    close_wfile(file);
+	    fzprintf(sftpError, "getrange: cannot seek in %s - file too large",
+		   outfname);
+	    req = fxp_close_send(fh);
+            pktin = sftp_wait_for_reply(req);
+	    fxp_close_recv(pktin, req);
+
+	    return 0;
+	}
+
+	offset = range[0];
+	uint64_decimal(offset, decbuf);
+	fzprintf(sftpStatus, "getrange: starting at file position %s", decbuf);
+    } else if (restart) {
 	char decbuf[30];
 	if (seek_file(file, uint64_make(0,0) , FROM_END) == -1) {
 	    close_wfile(file);
@@ -514,7 +541,10 @@ int sftp_get_file(char *fname, char *outfname, int recurse, int restart)
      * thus put up a progress bar.
      */
     ret = 1;
-    xfer = xfer_download_init(fh, offset);
+    if (range)
+	xfer = xfer_download_range_init(fh, offset, range[1]);
+    else
+	xfer = xfer_download_init(fh, offset);
     while (!xfer_done(xfer)) {
 	void *vbuf;
 	int ret, len;
@@ -556,7 +586,7 @@ int sftp_get_file(char *fname, char *outfname, int recurse, int restart)
 	}
 
 	if (fz_timer_check(&timer)) {
-	    fzprintf(sftpTransfer, "%d", winterval);
+	    fznotify1(sftpTransfer, winterval);
 	    winterval = 0;
 	}
 
@@ -584,6 +614,7 @@ int sftp_put_file(char *fname, char *outfname, int recurse, int restart)
     uint64 offset;
     RFile *file;
     int ret, err, eof;
+    char *buffer;
     struct fxp_attrs attrs;
     long permissions;
 
@@ -768,12 +799,12 @@ int sftp_put_file(char *fname, char *outfname, int recurse, int restart)
     ret = 1;
     xfer = xfer_upload_init(fh, offset);
     err = eof = 0;
+    buffer = snewn(xfer_upload_blocksize(xfer), char);
     while ((!err && !eof) || !xfer_done(xfer)) {
-        char buffer[4096*4];
 	int len, ret;
 
 	while (xfer_upload_ready(xfer) && !err && !eof) {
-	    len = read_from_file(file, buffer, sizeof(buffer));
+	    len = read_from_file(file, buffer, xfer_upload_blocksize(xfer));
 	    if (len == -1) {
 		fzprintf(sftpError, "error while reading local file");
 		err = 1;
@@ -801,6 +832,7 @@ int sftp_put_file(char *fname, char *outfname, int recurse, int restart)
 	}
     }
 
+    sfree(buffer);
     xfer_cleanup(xfer);
 
 cleanup:
@@ -1422,7 +1454,7 @@ int sftp_general_get(struct sftp_command *cmd, int restart, int multiple)
 	    else
 		outfname = stripslashes(origwfname, 0);
 
-	    ret = sftp_get_file(fname, outfname, recurse, restart);
+	    ret = sftp_get_file(fname, outfname, recurse, restart, NULL);
 
 	    sfree(fname);
 
@@ -1458,6 +1490,48 @@ int sftp_cmd_reget(struct sftp_command *cmd)
     return sftp_general_get(cmd, 1, 0);
 }
 
+/*
+ * Download a part of a file: getrange <offset> <length> <remote> <local>
+ * Used to download large files in several segments over multiple
+ * connections at the same time.
+ */
+int sftp_cmd_getrange(struct sftp_command *cmd)
+{
+    char *fname;
+    uint64 range[2];
+    int ret;
+
+    if (back == NULL) {
+	not_connected();
+	return 0;
+    }
+
+    if (cmd->nwords != 5) {
+	fzprintf(sftpError, "%s: expects offset, length, remote and local filename", cmd->words[0]);
+	return 0;
+    }
+
+    range[0] = uint64_from_decimal(cmd->words[1]);
+    range[1] = uint64_from_decimal(cmd->words[2]);
+    if (!range[1].hi && !range[1].lo) {
+	fzprintf(sftpError, "%s: invalid length", cmd->words[0]);
+	return 0;
+    }
+
+    fname = canonify(cmd->words[3], 0);
+    if (!fname) {
+	fzprintf(sftpError, "%s: canonify: %s", cmd->words[3], fxp_error());
+	return 0;
+    }
+
+    ret = sftp_get_file(fname, cmd->words[4], 0, 0, range);
+    sfree(fname);
+
+    if (ret != 0)
+	fznotify1(sftpDone, ret);
+    return ret;
+}
+
 /*
  * Send a file and store it at the remote end. We have three very
  * similar commands here. The basic one is `put'; `reput' differs
@@ -2342,6 +2416,14 @@ static struct sftp_cmd_lookup {
 	    "  If -r specified, recursively fetch a directory.\n",
 	    sftp_cmd_get
     },
+    {
+	"getrange", TRUE, "download a part of a file",
+	    " <offset> <length> <filename> <local-filename>\n"
+	    "  Downloads length bytes starting at offset of a file on the\n"
+	    "  server and writes them at the same offset into the local file.\n"
+	    "  The local file is created if needed, but never truncated.\n",
+	    sftp_cmd_getrange
+    },
     {
 	"keyfile", TRUE, "add a keyfile to use",
 	    " <filename>\n"
@@ -2703,6 +2785,17 @@ static int do_sftp_init(void)
 	return 1;		       /* failure */
     }
 
+    /*
+     * Find out how large our reads and writes may be.
+     */
+    if (fxp_supports_limits()) {
+	req = fxp_limits_send();
+	pktin = sftp_wait_for_reply(req);
+	if (!fxp_limits_recv(pktin, req))
+	    fzprintf(sftpVerbose, "Failed to query server limits: %s",
+		     fxp_error());
+    }
+
     /*
      * Find out where our home directory is.
      */
@@ -2803,6 +2896,18 @@ void do_sftp(int mode, int modeflags, char *batchfile)
 
 static int verbose = 0;
 
+/*
+ * FZ: If FileZilla went away while we were busy, the error most likely
+ * is the aborted operation. The connection itself may still be in use
+ * by downstreams.
+ */
+static void fatal_exit(void)
+{
+    if (IsFileZillaGone())
+	linger_for_downstreams();
+    cleanup_exit(1);
+}
+
 /*
  *  Print an error message and perform a fatal exit.
  */
@@ -2817,7 +2922,7 @@ void fatalbox(char *fmt, ...)
     fzprintf(sftpError, "%s", str);
     sfree(str);
 
-    cleanup_exit(1);
+    fatal_exit();
 }
 void modalfatalbox(char *fmt, ...)
 {
@@ -2830,7 +2935,7 @@ void modalfatalbox(char *fmt, ...)
     fzprintf(sftpError, "%s", str);
     sfree(str);
 
-    cleanup_exit(1);
+    fatal_exit();
 }
 void nonfatal(char *fmt, ...)
 {
@@ -2854,7 +2959,7 @@ void connection_fatal(void *frontend, char *fmt, ...)
     fzprintf(sftpError, str);
     sfree(str);
 
-    cleanup_exit(1);
+    fatal_exit();
 }
 
 void ldisc_echoedit_update(void *handle) { }
@@ -2976,6 +3081,9 @@ int sftp_recvdata(char *buf, int len)
     }
 
     while (outlen > 0) {
+	/* FZ: Nobody is waiting for the result anymore */
+	if (IsFileZillaGone() && !sent_eof)
+	    fatalbox("FileZilla went away");
 	if (back->exitcode(backhandle) >= 0 || ssh_sftp_loop_iteration() < 0)
 	    return 0;		       /* doom */
     }
@@ -3010,12 +3118,18 @@ static void usage(void)
     printf("  -1 -2     force use of particular SSH protocol version\n");
     printf("  -4 -6     force use of IPv4 or IPv6\n");
     printf("  -C        enable compression\n");
+    printf("  -compresslevel n\n");
+    printf("            enable compression at level n, 1 (fastest) to 9 (best)\n");
     printf("  -i key    private key file for user authentication\n");
     printf("  -noagent  disable use of Pageant\n");
     printf("  -hostkey aa:bb:cc:...\n");
     printf("            manually specify a host key (may be repeated)\n");
     printf("  -agent    enable use of Pageant\n");
     printf("  -batch    disable all interactive prompts\n");
+    printf("  -binary   send messages as binary frames instead of text lines\n");
+    printf("  -share    share the SSH connection with other instances\n");
+    printf("  -quotashm name\n");
+    printf("            take rate limit quota from the named shared memory\n");
     cleanup_exit(1);
 }
 
@@ -3325,8 +3439,47 @@ int psftp_init_utf8_locale()
 }
 #endif
 
-const int share_can_be_downstream = FALSE; // FZ: We're standalone
-const int share_can_be_upstream = FALSE;
+/*
+ * FZ: Connection sharing is only used between our own instances if
+ * FileZilla passes -share. Unlike PuTTY's psftp we may be upstream, as
+ * there is no PuTTY window to hold the connection. Closing the upstream
+ * would disconnect the downstreams, so once FileZilla is done with us
+ * we detach from it and keep the connection open until the last
+ * downstream has disconnected.
+ */
+const int share_can_be_downstream = TRUE;
+const int share_can_be_upstream = TRUE;
+
+static void linger_for_downstreams(void)
+{
+    if (lingering || back == NULL || back->exitcode(backhandle) >= 0 ||
+	ssh_share_downstreams(backhandle) <= 0)
+	return;
+
+    if (!ssh_sftp_detach())
+	return;
+
+    lingering = TRUE;
+    FileZillaGone();
+
+    /* Replies to requests we gave up on are discarded */
+    outptr = NULL;
+    outlen = 0;
+
+    if (!sent_eof) {
+	back->special(backhandle, TS_EOF);
+	sent_eof = TRUE;
+    }
+
+    /*
+     * Our channel closes, the connection stays open until the last
+     * downstream has disconnected.
+     */
+    while (back->exitcode(backhandle) < 0) {
+	if (ssh_sftp_loop_iteration() < 0)
+	    break;
+    }
+}
 
 /*
  * Main program. Parse arguments etc.
@@ -3340,6 +3493,12 @@ int psftp_main(int argc, char *argv[])
     int modeflags = 0;
     char *batchfile = NULL;
 
+    /* The framing of our messages applies from the very first one */
+    for (i = 1; i < argc; i++) {
+	if (!strcmp(argv[i], "-binary"))
+	    fzprintf_set_binary();
+    }
+
     fzprintf(sftpReply, "fzSftp started, protocol_version=%d", FZSFTP_PROTOCOL_VERSION);
 
 #ifndef _WINDOWS
@@ -3403,6 +3562,15 @@ int psftp_main(int argc, char *argv[])
 	    modeflags = modeflags | 1;
 	} else if (strcmp(argv[i], "-be") == 0) {
 	    modeflags = modeflags | 2;
+	} else if (strcmp(argv[i], "-binary") == 0) {
+	    /* Handled above */
+	} else if (strcmp(argv[i], "-quotashm") == 0 && i + 1 < argc) {
+#ifdef FZ_SHARED_QUOTA
+	    if (!OpenSharedQuota(argv[++i]))
+		cmdline_error("unable to open shared quota \"%s\"", argv[i]);
+#else
+	    cmdline_error("shared quota not supported on this platform");
+#endif
 	} else if (strcmp(argv[i], "--") == 0) {
 	    i++;
 	    break;
@@ -3446,6 +3614,8 @@ int psftp_main(int argc, char *argv[])
 
     do_sftp(mode, modeflags, batchfile);
 
+    linger_for_downstreams();
+
     if (back != NULL && back->connected(backhandle)) {
 	char ch;
 	back->special(backhandle, TS_EOF);
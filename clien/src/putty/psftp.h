@@ -34,6 +34,13 @@ void get_file_times(char *filename, unsigned long *mtime,
  */
 int ssh_sftp_loop_iteration(void);
 
+/*
+ * FZ: Stop using the pipes to FileZilla so that the process can keep
+ * running after FileZilla has stopped waiting for it. Returns FALSE if
+ * that is not possible.
+ */
+int ssh_sftp_detach(void);
+
 /*
  * Read a command line for PSFTP from standard input. Caller must
  * free.
@@ -91,6 +98,9 @@ RFile *open_existing_file(char *name, uint64 *size,
 			  unsigned long *mtime, unsigned long *atime,
                           long *perms);
 WFile *open_existing_wfile(char *name, uint64 *size);
+/* Opens for random access writing without truncating, creates the file
+ * if needed. Other processes may write to the same file concurrently. */
+WFile *open_shared_wfile(char *name);
 /* Returns <0 on error, 0 on eof, or number of bytes read, as usual */
 int read_from_file(RFile *f, void *buffer, int length);
 /* Closes and frees the RFile */
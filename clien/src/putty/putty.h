@@ -267,6 +267,7 @@ enum {
     CIPHER_AES,			       /* (SSH-2 only) */
     CIPHER_DES,
     CIPHER_ARCFOUR,
+    CIPHER_CHACHA20,		       /* (SSH-2 only) */
     CIPHER_MAX			       /* no. ciphers (inc warn) */
 };
 
@@ -680,6 +681,7 @@ void cleanup_exit(int);
     X(STR, NONE, remote_cmd2) /* fallback if remote_cmd fails; never loaded or saved */ \
     X(INT, NONE, nopty) \
     X(INT, NONE, compression) \
+    X(INT, NONE, compression_level) /* 1 (fastest) to 9 (best) */ \
     X(INT, INT, ssh_kexlist) \
     X(INT, NONE, ssh_rekey_time) /* in minutes */ \
     X(STR, NONE, ssh_rekey_data) /* string encoding e.g. "100K", "2M", "1G" */ \
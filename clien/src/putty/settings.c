@@ -11,6 +11,7 @@
 /* The cipher order given here is the default order. */
 static const struct keyvalwhere ciphernames[] = {
     { "aes",        CIPHER_AES,             -1, -1 },
+    { "chacha20",   CIPHER_CHACHA20,        CIPHER_AES, +1 },
     { "blowfish",   CIPHER_BLOWFISH,        -1, -1 },
     { "3des",       CIPHER_3DES,            -1, -1 },
     { "WARN",       CIPHER_WARN,            -1, -1 },
@@ -485,6 +486,7 @@ void save_open_settings(void *sesskey, Conf *conf)
     write_setting_s(sesskey, "LocalUserName", conf_get_str(conf, CONF_localusername));
     write_setting_i(sesskey, "NoPTY", conf_get_int(conf, CONF_nopty));
     write_setting_i(sesskey, "Compression", conf_get_int(conf, CONF_compression));
+    write_setting_i(sesskey, "CompressionLevel", conf_get_int(conf, CONF_compression_level));
     write_setting_i(sesskey, "TryAgent", conf_get_int(conf, CONF_tryagent));
     write_setting_i(sesskey, "AgentFwd", conf_get_int(conf, CONF_agentfwd));
     write_setting_i(sesskey, "GssapiFwd", conf_get_int(conf, CONF_gssapifwd));
@@ -761,6 +763,7 @@ void load_open_settings(void *sesskey, Conf *conf, int load_proxy_settings)
     gpps(sesskey, "LocalUserName", "", conf, CONF_localusername);
     gppi(sesskey, "NoPTY", 0, conf, CONF_nopty);
     gppi(sesskey, "Compression", 0, conf, CONF_compression);
+    gppi(sesskey, "CompressionLevel", 6, conf, CONF_compression_level);
     gppi(sesskey, "TryAgent", 1, conf, CONF_tryagent);
     gppi(sesskey, "AgentFwd", 0, conf, CONF_agentfwd);
     gppi(sesskey, "ChangeUsername", 0, conf, CONF_change_username);
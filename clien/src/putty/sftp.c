@@ -8,15 +8,13 @@
 #include <assert.h>
 #include <limits.h>
 
+#include "putty.h"
 #include "misc.h"
 #include "int64.h"
 #include "tree234.h"
 #include "ssh.h"
 #include "sftp.h"
 
-#include "fzprintf.h"
-#include "fzsftp.h"
-
 struct sftp_packet {
     char *data;
     unsigned length, maxlen;
@@ -27,6 +25,13 @@ struct sftp_packet {
 static const char *fxp_error_message;
 static int fxp_errtype;
 
+/*
+ * Set if the server announced the limits@openssh.com extension, and
+ * the limits it reported, 0 where it didn't say.
+ */
+static int fxp_has_limits;
+static unsigned long fxp_max_packet, fxp_max_read, fxp_max_write;
+
 static void fxp_internal_error(char *msg);
 
 /* ----------------------------------------------------------------------
@@ -496,16 +501,75 @@ int fxp_init(void)
 	return 0;
     }
     /*
-     * In principle, this packet might also contain extension-
-     * string pairs. We should work through them and look for any
-     * we recognise. In practice we don't currently do so because
-     * we know we don't recognise _any_.
+     * The packet might also contain extension-string pairs, look
+     * for the ones we recognise.
      */
+    {
+	char *name, *data;
+	int namelen, datalen;
+
+	fxp_has_limits = 0;
+	while (sftp_pkt_getstring(pktin, &name, &namelen) &&
+	       sftp_pkt_getstring(pktin, &data, &datalen)) {
+	    if (namelen == 18 && !memcmp(name, "limits@openssh.com", 18))
+		fxp_has_limits = 1;
+	}
+    }
     sftp_pkt_free(pktin);
 
     return 1;
 }
 
+int fxp_supports_limits(void)
+{
+    return fxp_has_limits;
+}
+
+/*
+ * Ask for the server's limits on packet and read/write sizes.
+ */
+struct sftp_request *fxp_limits_send(void)
+{
+    struct sftp_request *req = sftp_alloc_request();
+    struct sftp_packet *pktout;
+
+    pktout = sftp_pkt_init(SSH_FXP_EXTENDED);
+    sftp_pkt_adduint32(pktout, req->id);
+    sftp_pkt_addstring(pktout, "limits@openssh.com");
+    sftp_send(pktout);
+
+    return req;
+}
+
+int fxp_limits_recv(struct sftp_packet *pktin, struct sftp_request *req)
+{
+    sfree(req);
+
+    if (pktin->type == SSH_FXP_EXTENDED_REPLY) {
+	unsigned long limits[8];
+	int i;
+
+	/* Four uint64: packet, read and write length, open handles */
+	for (i = 0; i < 8; i++) {
+	    if (!sftp_pkt_getuint32(pktin, &limits[i])) {
+		fxp_internal_error("malformed limits@openssh.com reply");
+		sftp_pkt_free(pktin);
+		return 0;
+	    }
+	}
+	/* Anything beyond 32 bits is as good as unlimited here */
+	fxp_max_packet = limits[0] ? ULONG_MAX : limits[1];
+	fxp_max_read = limits[2] ? ULONG_MAX : limits[3];
+	fxp_max_write = limits[4] ? ULONG_MAX : limits[5];
+	sftp_pkt_free(pktin);
+	return 1;
+    } else {
+	fxp_got_status(pktin);
+	sftp_pkt_free(pktin);
+	return 0;
+    }
+}
+
 /*
  * Canonify a pathname.
  */
@@ -1122,36 +1186,123 @@ struct req {
     char *buffer;
     int len, retlen, complete;
     uint64 offset;
+    unsigned long sent;
     struct req *next, *prev;
 };
 
+/*
+ * The amount of outstanding data adapts to the link. It starts with a
+ * few requests, so that small files don't cause a burst of pointless
+ * reads, and grows like TCP slow start while replies arrive as fast as
+ * the first ones did. Once requests take noticeably longer than the
+ * quickest round trip seen, they are only queueing up at the server or
+ * in buffers along the way, and the window stops growing, or shrinks
+ * if the latency keeps rising.
+ */
+#define XFER_BLOCKSIZE 32768		/* which every server must accept */
+#define XFER_MAX_BLOCKSIZE 262144
+#define XFER_INITIAL_BLOCKS 8
+#define XFER_MIN_BLOCKS 4
+#define XFER_MAX_WINDOW (16 * 1048576)
+/* Latency in ms on top of twice the base round trip counting as queueing */
+#define XFER_QUEUEING_SLACK 5
+
 struct fxp_xfer {
-    uint64 offset, furthestdata, filesize;
+    uint64 offset, furthestdata, filesize, end;
     int req_totalsize, req_maxsize, eof, err;
+    int blocksize, slow_start, growth;
+    unsigned long min_rtt, srtt;
     struct fxp_handle *fh;
     struct req *head, *tail;
     _fztimer send_timer;
     int sent_interval;
+    /* Statistics reported at the end */
+    int requests, peak_window;
+    unsigned long start_time;
+    uint64 done_bytes;
 };
 
-static struct fxp_xfer *xfer_init(struct fxp_handle *fh, uint64 offset)
+static struct fxp_xfer *xfer_init(struct fxp_handle *fh, uint64 offset,
+				  unsigned long max_len)
 {
     struct fxp_xfer *xfer = snew(struct fxp_xfer);
 
     xfer->fh = fh;
     xfer->offset = offset;
     xfer->head = xfer->tail = NULL;
+
+    xfer->blocksize = XFER_BLOCKSIZE;
+    if (max_len > XFER_BLOCKSIZE) {
+	xfer->blocksize = max_len < XFER_MAX_BLOCKSIZE ?
+	    (int)max_len : XFER_MAX_BLOCKSIZE;
+	/* Leave room for the packet header and the handle */
+	if (fxp_max_packet &&
+	    fxp_max_packet < (unsigned long)xfer->blocksize + 1024)
+	    xfer->blocksize = fxp_max_packet > XFER_BLOCKSIZE + 1024 ?
+		(int)(fxp_max_packet - 1024) : XFER_BLOCKSIZE;
+    }
     xfer->req_totalsize = 0;
-    xfer->req_maxsize = 1048576*4;
+    xfer->req_maxsize = XFER_INITIAL_BLOCKS * xfer->blocksize;
+    xfer->slow_start = TRUE;
+    xfer->growth = 0;
+    xfer->min_rtt = ULONG_MAX;
+    xfer->srtt = 0;
+
     xfer->err = 0;
     xfer->filesize = uint64_make(ULONG_MAX, ULONG_MAX);
+    xfer->end = uint64_make(ULONG_MAX, ULONG_MAX);
     xfer->furthestdata = uint64_make(0, 0);
     fz_timer_init(&xfer->send_timer);
     xfer->sent_interval = 0;
 
+    xfer->requests = 0;
+    xfer->peak_window = xfer->req_maxsize;
+    xfer->start_time = GETTICKCOUNT();
+    xfer->done_bytes = uint64_make(0, 0);
+
     return xfer;
 }
 
+/*
+ * Called for each successful reply, full being whether the window
+ * was the limit on outstanding data when it arrived.
+ */
+static void xfer_adapt(struct fxp_xfer *xfer, struct req *rr, int full)
+{
+    unsigned long rtt = GETTICKCOUNT() - rr->sent;
+    int queueing;
+
+    if (rtt < xfer->min_rtt)
+	xfer->min_rtt = rtt;
+    xfer->srtt = xfer->srtt ? (7 * xfer->srtt + rtt) / 8 : rtt;
+
+    if (!full)
+	return;
+
+    queueing = xfer->srtt > 2 * xfer->min_rtt + XFER_QUEUEING_SLACK;
+    if (xfer->slow_start && !queueing) {
+	xfer->req_maxsize += rr->len;
+    } else {
+	/* From now on, one block per window's worth of replies */
+	xfer->slow_start = FALSE;
+	xfer->growth += rr->len;
+	if (xfer->growth >= xfer->req_maxsize) {
+	    xfer->growth = 0;
+	    if (!queueing)
+		xfer->req_maxsize += xfer->blocksize;
+	    else if (rtt > xfer->srtt)
+		xfer->req_maxsize -= xfer->blocksize;
+	}
+    }
+
+    if (xfer->req_maxsize > XFER_MAX_WINDOW)
+	xfer->req_maxsize = XFER_MAX_WINDOW;
+    if (xfer->req_maxsize < XFER_MIN_BLOCKS * xfer->blocksize)
+	xfer->req_maxsize = XFER_MIN_BLOCKS * xfer->blocksize;
+    if (xfer->req_maxsize > xfer->peak_window)
+	xfer->peak_window = xfer->req_maxsize;
+}
+
 int xfer_done(struct fxp_xfer *xfer)
 {
     /*
@@ -1171,6 +1322,12 @@ void xfer_download_queue(struct fxp_xfer *xfer)
 	struct req *rr;
 	struct sftp_request *req;
 
+	if (uint64_compare(xfer->offset, xfer->end) >= 0) {
+	    /* Requested range fully queued, treat as end of file */
+	    xfer->eof = TRUE;
+	    break;
+	}
+
 	rr = snew(struct req);
 	rr->offset = xfer->offset;
 	rr->complete = 0;
@@ -1184,10 +1341,17 @@ void xfer_download_queue(struct fxp_xfer *xfer)
 	xfer->tail = rr;
 	rr->next = NULL;
 
-	rr->len = 32768;
+	rr->len = xfer->blocksize;
+	{
+	    uint64 left = uint64_subtract(xfer->end, xfer->offset);
+	    if (!left.hi && left.lo < (unsigned long)rr->len)
+		rr->len = (int)left.lo;
+	}
 	rr->buffer = snewn(rr->len, char);
+	rr->sent = GETTICKCOUNT();
 	sftp_register(req = fxp_read_send(xfer->fh, rr->offset, rr->len));
 	fxp_set_userdata(req, rr);
+	xfer->requests++;
 
 	xfer->offset = uint64_add32(xfer->offset, rr->len);
 	xfer->req_totalsize += rr->len;
@@ -1200,8 +1364,20 @@ void xfer_download_queue(struct fxp_xfer *xfer)
 
 struct fxp_xfer *xfer_download_init(struct fxp_handle *fh, uint64 offset)
 {
-    struct fxp_xfer *xfer = xfer_init(fh, offset);
+    struct fxp_xfer *xfer = xfer_init(fh, offset, fxp_max_read);
+
+    xfer->eof = FALSE;
+    xfer_download_queue(xfer);
+
+    return xfer;
+}
+
+struct fxp_xfer *xfer_download_range_init(struct fxp_handle *fh, uint64 offset,
+					  uint64 length)
+{
+    struct fxp_xfer *xfer = xfer_init(fh, offset, fxp_max_read);
 
+    xfer->end = uint64_add(offset, length);
     xfer->eof = FALSE;
     xfer_download_queue(xfer);
 
@@ -1244,6 +1420,11 @@ int xfer_download_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
     }
 
     rr->complete = 1;
+    if (rr->retlen > 0) {
+	xfer_adapt(xfer, rr,
+		   xfer->req_totalsize + xfer->blocksize > xfer->req_maxsize);
+	xfer->done_bytes = uint64_add32(xfer->done_bytes, rr->retlen);
+    }
 
     /*
      * Special case: if we have received fewer bytes than we
@@ -1341,7 +1522,7 @@ int xfer_download_data(struct fxp_xfer *xfer, void **buf, int *len)
 
 struct fxp_xfer *xfer_upload_init(struct fxp_handle *fh, uint64 offset)
 {
-    struct fxp_xfer *xfer = xfer_init(fh, offset);
+    struct fxp_xfer *xfer = xfer_init(fh, offset, fxp_max_write);
 
     /*
      * We set `eof' to 1 because this will cause xfer_done() to
@@ -1356,6 +1537,14 @@ struct fxp_xfer *xfer_upload_init(struct fxp_handle *fh, uint64 offset)
     return xfer;
 }
 
+/*
+ * The amount of data the caller should pass to each xfer_upload_data.
+ */
+int xfer_upload_blocksize(struct fxp_xfer *xfer)
+{
+    return xfer->blocksize;
+}
+
 int xfer_upload_ready(struct fxp_xfer *xfer)
 {
     if (xfer->req_totalsize < xfer->req_maxsize)
@@ -1384,8 +1573,10 @@ void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len)
 
     rr->len = len;
     rr->buffer = NULL;
+    rr->sent = GETTICKCOUNT();
     sftp_register(req = fxp_write_send(xfer->fh, buffer, rr->offset, len));
     fxp_set_userdata(req, rr);
+    xfer->requests++;
 
     xfer->offset = uint64_add32(xfer->offset, rr->len);
     xfer->req_totalsize += rr->len;
@@ -1418,6 +1609,12 @@ int xfer_upload_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
     printf("write request %p has returned [%d]\n", rr, ret);
 #endif
 
+    if (ret) {
+	xfer_adapt(xfer, rr,
+		   xfer->req_totalsize + xfer->blocksize > xfer->req_maxsize);
+	xfer->done_bytes = uint64_add32(xfer->done_bytes, rr->len);
+    }
+
     /*
      * Remove this one from the queue.
      */
@@ -1435,7 +1632,7 @@ int xfer_upload_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
     xfer->sent_interval += rr->len;
     if (fz_timer_check(&xfer->send_timer)) {
 	/* The data we sent is the data we earlier read from file */
-	fzprintf(sftpTransfer, "%d", xfer->sent_interval);
+	fznotify1(sftpTransfer, xfer->sent_interval);
 	xfer->sent_interval = 0;
     }
     sfree(rr);
@@ -1449,7 +1646,19 @@ int xfer_upload_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
 void xfer_cleanup(struct fxp_xfer *xfer)
 {
     if (xfer->sent_interval > 0) {
-	fzprintf(sftpTransfer, "%d", xfer->sent_interval);
+	fznotify1(sftpTransfer, xfer->sent_interval);
+    }
+    if (xfer->requests) {
+	char bytes[40];
+	unsigned long elapsed = GETTICKCOUNT() - xfer->start_time;
+
+	uint64_decimal(xfer->done_bytes, bytes);
+	fzprintf(sftpPipelineStats,
+		 "%s bytes in %lu ms, %d requests of up to %d bytes, "
+		 "up to %d bytes outstanding, round trip %lu ms (min %lu ms)",
+		 bytes, elapsed, xfer->requests, xfer->blocksize,
+		 xfer->peak_window, xfer->srtt,
+		 xfer->min_rtt == ULONG_MAX ? 0 : xfer->min_rtt);
     }
     struct req *rr;
     while (xfer->head) {
@@ -121,6 +121,15 @@ int fxp_error_type(void);
  */
 int fxp_init(void);
 
+/*
+ * The limits@openssh.com extension, which tells how much data the
+ * server accepts in a single read or write. The transfers below size
+ * their requests accordingly once the reply has been processed.
+ */
+int fxp_supports_limits(void);
+struct sftp_request *fxp_limits_send(void);
+int fxp_limits_recv(struct sftp_packet *pktin, struct sftp_request *req);
+
 /*
  * Canonify a pathname. Concatenate the two given path elements
  * with a separating slash, unless the second is NULL.
@@ -249,11 +258,15 @@ struct sftp_packet *sftp_recv(void);
 struct fxp_xfer;
 
 struct fxp_xfer *xfer_download_init(struct fxp_handle *fh, uint64 offset);
+/* As above, but stops after length bytes */
+struct fxp_xfer *xfer_download_range_init(struct fxp_handle *fh, uint64 offset,
+					  uint64 length);
 void xfer_download_queue(struct fxp_xfer *xfer);
 int xfer_download_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin);
 int xfer_download_data(struct fxp_xfer *xfer, void **buf, int *len);
 
 struct fxp_xfer *xfer_upload_init(struct fxp_handle *fh, uint64 offset);
+int xfer_upload_blocksize(struct fxp_xfer *xfer);
 int xfer_upload_ready(struct fxp_xfer *xfer);
 void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len);
 int xfer_upload_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin);
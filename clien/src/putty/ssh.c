@@ -378,8 +378,14 @@ static void ssh_channel_destroy(struct ssh_channel *c);
  *    ensure that the server never has any need to throttle its end
  *    of the connection), so we set this high as well.
  * 
- *  - OUR_V2_WINSIZE is the maximum window size we present on SSH-2
- *    channels.
+ *  - OUR_V2_WINSIZE is the initial window size we present on SSH-2
+ *    channels. Whenever the remote end runs out of window within a
+ *    round trip, the window is doubled, so that it grows towards the
+ *    bandwidth-delay product of the connection.
+ *
+ *  - OUR_V2_WINBUDGET is how much the windows of all channels of a
+ *    connection may grow in total, bounding the data we may have to
+ *    buffer.
  *
  *  - OUR_V2_BIGWIN is the window size we advertise for the only
  *    channel in a simple connection.  It must be <= INT_MAX.
@@ -388,7 +394,9 @@ static void ssh_channel_destroy(struct ssh_channel *c);
  *    to the remote side. This actually has nothing to do with the
  *    size of the _packet_, but is instead a limit on the amount
  *    of data we're willing to receive in a single SSH2 channel
- *    data message.
+ *    data message. It's large enough for an SFTP read reply of
+ *    32768 bytes, the most common server-side limit, to arrive in
+ *    one message.
  *
  *  - OUR_V2_PACKETLIMIT is actually the maximum size of SSH
  *    _packet_ we're prepared to cope with.  It must be a multiple
@@ -398,8 +406,9 @@ static void ssh_channel_destroy(struct ssh_channel *c);
 #define SSH1_BUFFER_LIMIT 32768
 #define SSH_MAX_BACKLOG 32768
 #define OUR_V2_WINSIZE 16384
+#define OUR_V2_WINBUDGET 0x1000000
 #define OUR_V2_BIGWIN 0x7fffffff
-#define OUR_V2_MAXPKT 0x4000UL
+#define OUR_V2_MAXPKT 0x8400UL
 #define OUR_V2_PACKETLIMIT 0x9000UL
 
 const static struct ssh_signkey *hostkey_algs[] = {
@@ -408,7 +417,8 @@ const static struct ssh_signkey *hostkey_algs[] = {
 };
 
 const static struct ssh_mac *macs[] = {
-    &ssh_hmac_sha256, &ssh_hmac_sha1, &ssh_hmac_sha1_96, &ssh_hmac_md5
+    &ssh_hmac_sha256, &ssh_hmac_sha512,
+    &ssh_hmac_sha1, &ssh_hmac_sha1_96, &ssh_hmac_md5
 };
 const static struct ssh_mac *buggymacs[] = {
     &ssh_hmac_sha1_buggy, &ssh_hmac_sha1_96_buggy, &ssh_hmac_md5
@@ -418,6 +428,10 @@ static void *ssh_comp_none_init(void)
 {
     return NULL;
 }
+static void *ssh_comp_none_compress_init(int level)
+{
+    return NULL;
+}
 static void ssh_comp_none_cleanup(void *handle)
 {
 }
@@ -432,13 +446,12 @@ static int ssh_comp_none_disable(void *handle)
 }
 const static struct ssh_compress ssh_comp_none = {
     "none", NULL,
-    ssh_comp_none_init, ssh_comp_none_cleanup, ssh_comp_none_block,
+    ssh_comp_none_compress_init, ssh_comp_none_cleanup, ssh_comp_none_block,
     ssh_comp_none_init, ssh_comp_none_cleanup, ssh_comp_none_block,
     ssh_comp_none_disable, NULL
 };
-extern const struct ssh_compress ssh_zlib;
 const static struct ssh_compress *compressions[] = {
-    &ssh_zlib, &ssh_comp_none
+    &ssh_zlib_default, &ssh_comp_none
 };
 
 enum {				       /* channel types */
@@ -544,6 +557,12 @@ struct ssh_channel {
 	     * last data packet or window adjust ack.
 	     */
 	    int remlocwin;
+	    /*
+	     * Set if the remote end ran out of window since the last
+	     * winadj acknowledgement. wingrowth is the part of locmaxwin
+	     * taken from the connection's window budget.
+	     */
+	    int window_exhausted, wingrowth;
 	    /*
 	     * These store the list of channel requests that haven't
 	     * been acked.
@@ -765,6 +784,7 @@ struct ssh_tag {
     const struct ssh2_cipher *cscipher, *sccipher;
     void *cs_cipher_ctx, *sc_cipher_ctx;
     const struct ssh_mac *csmac, *scmac;
+    int csmac_etm, scmac_etm;
     void *cs_mac_ctx, *sc_mac_ctx;
     const struct ssh_compress *cscomp, *sccomp;
     void *cs_comp_ctx, *sc_comp_ctx;
@@ -837,6 +857,7 @@ struct ssh_tag {
     int conn_throttle_count;
     int overall_bufsize;
     int throttled_all;
+    int winbudget;
     int v1_stdout_throttling;
     unsigned long v2_outgoing_sequence;
 
@@ -933,6 +954,12 @@ struct ssh_tag {
     unsigned long next_rekey, last_rekey;
     char *deferred_rekey_reason;    /* points to STATIC string; don't free */
 
+    /*
+     * FZ: Start of the connection setup and of its current phase, for
+     * ssh_handshake_phase.
+     */
+    unsigned long handshake_start, handshake_phase;
+
     /*
      * Fully qualified host name, which we need if doing GSSAPI.
      */
@@ -961,6 +988,20 @@ static void logeventf(Ssh ssh, const char *fmt, ...)
     sfree(buf);
 }
 
+/*
+ * FZ: Report how long a phase of the initial connection setup took.
+ * Handshakes to many servers are dominated by one of name lookup,
+ * round trips or key exchange arithmetic, this tells which.
+ */
+static void ssh_handshake_phase(Ssh ssh, const char *phase)
+{
+    unsigned long now = GETTICKCOUNT();
+
+    fzprintf(sftpVerbose, "%s took %lu ms, %lu ms since connecting", phase,
+             now - ssh->handshake_phase, now - ssh->handshake_start);
+    ssh->handshake_phase = now;
+}
+
 static void bomb_out(Ssh ssh, char *text)
 {
     ssh_do_close(ssh, FALSE);
@@ -1503,9 +1544,10 @@ static struct Packet *ssh1_rdpkt(Ssh ssh, unsigned char **data, int *datalen)
     if (ssh->v1_compressing) {
 	unsigned char *decompblk;
 	int decomplen;
-	if (!zlib_decompress_block(ssh->sc_comp_ctx,
-				   st->pktin->body - 1, st->pktin->length + 1,
-				   &decompblk, &decomplen)) {
+	if (!ssh_zlib_default.decompress(ssh->sc_comp_ctx,
+					 st->pktin->body - 1,
+					 st->pktin->length + 1,
+					 &decompblk, &decomplen)) {
 	    bombout(("Zlib decompression encountered invalid data"));
 	    ssh_free_packet(st->pktin);
 	    crStop(NULL);
@@ -1707,7 +1749,7 @@ static struct Packet *ssh2_rdpkt(Ssh ssh, unsigned char **data, int *datalen)
     st->maclen = ssh->scmac ? ssh->scmac->len : 0;
 
     if (ssh->sccipher && (ssh->sccipher->flags & SSH_CIPHER_IS_CBC) &&
-	ssh->scmac) {
+	ssh->scmac && !ssh->scmac_etm) {
 	/*
 	 * When dealing with a CBC-mode cipher, we want to avoid the
 	 * possibility of an attacker's tweaking the ciphertext stream
@@ -1773,6 +1815,70 @@ static struct Packet *ssh2_rdpkt(Ssh ssh, unsigned char **data, int *datalen)
 	st->pktin->data = sresize(st->pktin->data,
 				  st->pktin->maxlen + APIEXTRA,
 				  unsigned char);
+    } else if (ssh->scmac && ssh->scmac_etm) {
+	/*
+	 * Encrypt-then-MAC, as used by the authenticated ciphers:
+	 * The packet length is sent in the clear and the MAC covers
+	 * the ciphertext, so the whole packet can be verified before
+	 * anything gets decrypted.
+	 */
+	st->pktin->data = snewn(4 + APIEXTRA, unsigned char);
+
+	for (st->i = 0; st->i < 4; st->i++) {
+	    while ((*datalen) == 0)
+		crReturn(NULL);
+	    st->pktin->data[st->i] = *(*data)++;
+	    (*datalen)--;
+	}
+
+	if (ssh->sccipher &&
+	    (ssh->sccipher->flags & SSH_CIPHER_SEPARATE_LENGTH)) {
+	    /* Decrypt a copy, the MAC covers the encrypted length */
+	    unsigned char len[4];
+	    memcpy(len, st->pktin->data, 4);
+	    ssh->sccipher->decrypt_length(ssh->sc_cipher_ctx, len, 4,
+					  st->incoming_sequence);
+	    st->len = toint(GET_32BIT(len));
+	} else
+	    st->len = toint(GET_32BIT(st->pktin->data));
+	if (st->len < 0 || st->len > OUR_V2_PACKETLIMIT ||
+	    st->len % st->cipherblk != 0) {
+	    bombout(("Incoming packet length field was garbled"));
+	    ssh_free_packet(st->pktin);
+	    crStop(NULL);
+	}
+
+	st->packetlen = st->len + 4;
+	st->pktin->maxlen = st->packetlen + st->maclen;
+	st->pktin->data = sresize(st->pktin->data,
+				  st->pktin->maxlen + APIEXTRA,
+				  unsigned char);
+
+	/* Read the rest of the packet a chunk at a time. */
+	for (st->i = 4; st->i < st->packetlen + st->maclen;) {
+	    int chunk;
+	    while ((*datalen) == 0)
+		crReturn(NULL);
+	    chunk = st->packetlen + st->maclen - st->i;
+	    if (chunk > *datalen)
+		chunk = *datalen;
+	    memcpy(st->pktin->data + st->i, *data, chunk);
+	    *data += chunk;
+	    *datalen -= chunk;
+	    st->i += chunk;
+	}
+
+	if (!ssh->scmac->verify(ssh->sc_mac_ctx, st->pktin->data,
+				st->packetlen, st->incoming_sequence)) {
+	    bombout(("Incorrect MAC received on packet"));
+	    ssh_free_packet(st->pktin);
+	    crStop(NULL);
+	}
+
+	if (ssh->sccipher)
+	    ssh->sccipher->decrypt(ssh->sc_cipher_ctx,
+				   st->pktin->data + 4, st->len);
+	PUT_32BIT(st->pktin->data, st->len);
     } else {
 	st->pktin->data = snewn(st->cipherblk + APIEXTRA, unsigned char);
 
@@ -1823,12 +1929,17 @@ static struct Packet *ssh2_rdpkt(Ssh ssh, unsigned char **data, int *datalen)
 	/*
 	 * Read and decrypt the remainder of the packet.
 	 */
-	for (st->i = st->cipherblk; st->i < st->packetlen + st->maclen;
-	     st->i++) {
+	for (st->i = st->cipherblk; st->i < st->packetlen + st->maclen;) {
+	    int chunk;
 	    while ((*datalen) == 0)
 		crReturn(NULL);
-	    st->pktin->data[st->i] = *(*data)++;
-	    (*datalen)--;
+	    chunk = st->packetlen + st->maclen - st->i;
+	    if (chunk > *datalen)
+		chunk = *datalen;
+	    memcpy(st->pktin->data + st->i, *data, chunk);
+	    *data += chunk;
+	    *datalen -= chunk;
+	    st->i += chunk;
 	}
 	/* Decrypt everything _except_ the MAC. */
 	if (ssh->sccipher)
@@ -1986,9 +2097,9 @@ static int s_wrpkt_prepare(Ssh ssh, struct Packet *pkt, int *offset_p)
     if (ssh->v1_compressing) {
 	unsigned char *compblk;
 	int complen;
-	zlib_compress_block(ssh->cs_comp_ctx,
-			    pkt->data + 12, pkt->length - 12,
-			    &compblk, &complen);
+	ssh_zlib_default.compress(ssh->cs_comp_ctx,
+				  pkt->data + 12, pkt->length - 12,
+				  &compblk, &complen);
 	ssh_pkt_ensure(pkt, complen + 2);   /* just in case it's got bigger */
 	memcpy(pkt->data + 12, compblk, complen);
 	sfree(compblk);
@@ -2287,7 +2398,7 @@ static struct Packet *ssh2_pkt_init(int pkt_type)
  */
 static int ssh2_pkt_construct(Ssh ssh, struct Packet *pkt)
 {
-    int cipherblk, maclen, padding, i;
+    int cipherblk, maclen, padding, unencrypted_prefix, i;
 
     if (ssh->logctx)
         ssh2_log_outgoing_packet(ssh, pkt);
@@ -2321,17 +2432,20 @@ static int ssh2_pkt_construct(Ssh ssh, struct Packet *pkt)
 
     /*
      * Add padding. At least four bytes, and must also bring total
-     * length (minus MAC) up to a multiple of the block size.
+     * length (minus MAC, and minus the length field if it is sent in
+     * the clear) up to a multiple of the block size.
      * If pkt->forcepad is set, make sure the packet is at least that size
      * after padding.
      */
     cipherblk = ssh->cscipher ? ssh->cscipher->blksize : 8;  /* block size */
     cipherblk = cipherblk < 8 ? 8 : cipherblk;	/* or 8 if blksize < 8 */
+    unencrypted_prefix = (ssh->csmac && ssh->csmac_etm) ? 4 : 0;
     padding = 4;
     if (pkt->length + padding < pkt->forcepad)
 	padding = pkt->forcepad - pkt->length;
     padding +=
-	(cipherblk - (pkt->length + padding) % cipherblk) % cipherblk;
+	(cipherblk - (pkt->length - unencrypted_prefix + padding) % cipherblk)
+	% cipherblk;
     assert(padding <= 255);
     maclen = ssh->csmac ? ssh->csmac->len : 0;
     ssh2_pkt_ensure(pkt, pkt->length + padding + maclen);
@@ -2339,16 +2453,29 @@ static int ssh2_pkt_construct(Ssh ssh, struct Packet *pkt)
     for (i = 0; i < padding; i++)
 	pkt->data[pkt->length + i] = random_byte();
     PUT_32BIT(pkt->data, pkt->length + padding - 4);
-    if (ssh->csmac)
+    if (ssh->csmac && ssh->csmac_etm) {
+	/* Encrypt everything but the length, then MAC the ciphertext */
+	if (ssh->cscipher &&
+	    (ssh->cscipher->flags & SSH_CIPHER_SEPARATE_LENGTH))
+	    ssh->cscipher->encrypt_length(ssh->cs_cipher_ctx, pkt->data, 4,
+					  ssh->v2_outgoing_sequence);
+	if (ssh->cscipher)
+	    ssh->cscipher->encrypt(ssh->cs_cipher_ctx, pkt->data + 4,
+				   pkt->length + padding - 4);
 	ssh->csmac->generate(ssh->cs_mac_ctx, pkt->data,
 			     pkt->length + padding,
 			     ssh->v2_outgoing_sequence);
+    } else {
+	if (ssh->csmac)
+	    ssh->csmac->generate(ssh->cs_mac_ctx, pkt->data,
+				 pkt->length + padding,
+				 ssh->v2_outgoing_sequence);
+	if (ssh->cscipher)
+	    ssh->cscipher->encrypt(ssh->cs_cipher_ctx,
+				   pkt->data, pkt->length + padding);
+    }
     ssh->v2_outgoing_sequence++;       /* whether or not we MACed */
 
-    if (ssh->cscipher)
-	ssh->cscipher->encrypt(ssh->cs_cipher_ctx,
-			       pkt->data, pkt->length + padding);
-
     pkt->encrypted_len = pkt->length + padding;
 
     /* Ready-to-send packet starts at pkt->data. We return length. */
@@ -3100,6 +3227,7 @@ static int do_ssh_init(Ssh ssh, unsigned char c)
     s->vstring[s->vslen] = 0;
     s->vstring[strcspn(s->vstring, "\015\012")] = '\0';/* remove EOL chars */
     logeventf(ssh, "Server version: %s", s->vstring);
+    ssh_handshake_phase(ssh, "Connection and version exchange");
     ssh_detect_bugs(ssh, s->vstring);
 
     /*
@@ -3237,6 +3365,7 @@ static int do_ssh_connection_init(Ssh ssh, unsigned char c)
     s->vstring[s->vslen] = 0;
     s->vstring[strcspn(s->vstring, "\015\012")] = '\0';/* remove EOL chars */
     logeventf(ssh, "Server version: %s", s->vstring);
+    ssh_handshake_phase(ssh, "Connection and version exchange");
     ssh_detect_bugs(ssh, s->vstring);
 
     /*
@@ -3508,9 +3637,8 @@ void ssh_connshare_log(Ssh ssh, int event, const char *logtext,
         /* Also we should mention this in the console window to avoid
          * confusing users as to why this window doesn't behave the
          * usual way. */
-        if ((flags & FLAG_VERBOSE) || (flags & FLAG_INTERACTIVE)) {
-            c_write_str(ssh,"Reusing a shared connection to this server.\r\n");
-        }
+        /* FZ: Tell FileZilla instead, our stderr goes nowhere */
+        fzprintf(sftpStatus, "Reusing a shared connection to this server.");
     } else if (event == SHARE_UPSTREAM) {
         /* In this case, 'logtext' is a local endpoint address too */
         logeventf(ssh, "Sharing this connection at %s", logtext);
@@ -3618,6 +3746,8 @@ static const char *connect_to_host(Ssh ssh, char *host, int port,
 
     ssh->fn = &fn_table;               /* make 'ssh' usable as a Plug */
 
+    ssh->handshake_start = ssh->handshake_phase = GETTICKCOUNT();
+
     /*
      * Try connection-sharing, in case that means we don't open a
      * socket after all. ssh_connection_sharing_init will connect to a
@@ -3659,6 +3789,7 @@ static const char *connect_to_host(Ssh ssh, char *host, int port,
             return err;
         }
         ssh->fullhostname = dupstr(*realhost);   /* save in case of GSSAPI */
+        ssh_handshake_phase(ssh, "Host name lookup");
 
         ssh->s = new_connection(addr, *realhost, port,
                                 0, 1, nodelay, keepalive,
@@ -4087,6 +4218,8 @@ static int do_ssh1_login(Ssh ssh, unsigned char *in, int inlen,
 	    } else if (next_cipher == CIPHER_AES) {
 		/* XXX Probably don't need to mention this. */
 		logevent("AES not supported in SSH-1, skipping");
+	    } else if (next_cipher == CIPHER_CHACHA20) {
+		logevent("ChaCha20 not supported in SSH-1, skipping");
 	    } else {
 		switch (next_cipher) {
 		  case CIPHER_3DES:     s->cipher_type = SSH_CIPHER_3DES;
@@ -6023,7 +6156,9 @@ static void do_ssh1_connection(Ssh ssh, unsigned char *in, int inlen,
     }
 
     if (conf_get_int(ssh->conf, CONF_compression)) {
-	send_packet(ssh, SSH1_CMSG_REQUEST_COMPRESSION, PKT_INT, 6, PKT_END);
+	send_packet(ssh, SSH1_CMSG_REQUEST_COMPRESSION,
+		    PKT_INT, conf_get_int(ssh->conf, CONF_compression_level),
+		    PKT_END);
 	do {
 	    crReturnV;
 	} while (!pktin);
@@ -6036,10 +6171,13 @@ static void do_ssh1_connection(Ssh ssh, unsigned char *in, int inlen,
 	}
 	logevent("Started compression");
 	ssh->v1_compressing = TRUE;
-	ssh->cs_comp_ctx = zlib_compress_init();
-	logevent("Initialised zlib (RFC1950) compression");
-	ssh->sc_comp_ctx = zlib_decompress_init();
-	logevent("Initialised zlib (RFC1950) decompression");
+	ssh->cs_comp_ctx = ssh_zlib_default.compress_init(
+	    conf_get_int(ssh->conf, CONF_compression_level));
+	logeventf(ssh, "Initialised %s compression",
+		  ssh_zlib_default.text_name);
+	ssh->sc_comp_ctx = ssh_zlib_default.decompress_init();
+	logeventf(ssh, "Initialised %s decompression",
+		  ssh_zlib_default.text_name);
     }
 
     /*
@@ -6245,15 +6383,20 @@ static void ssh2_pkt_addstring_commasep(struct Packet *pkt, const char *data)
 
 /*
  * SSH-2 key creation method.
- * (Currently assumes 2 lots of any hash are sufficient to generate
- * keys/IVs for any cipher/MAC. SSH2_MKKEY_ITERS documents this assumption.)
+ * Generates at least keylen bytes, in whole lots of the hash length.
+ * SSH2_MKKEY_MAXLEN is the longest key any cipher/MAC needs.
  */
-#define SSH2_MKKEY_ITERS (2)
+#define SSH2_MKKEY_MAXLEN (64)	       /* chacha20-poly1305 */
+#define SSH2_MKKEY_SPACE (SSH2_MKKEY_MAXLEN + SSH2_KEX_MAX_HASH_LEN)
 static void ssh2_mkkey(Ssh ssh, Bignum K, unsigned char *H, char chr,
-		       unsigned char *keyspace)
+		       unsigned char *keyspace, int keylen)
 {
     const struct ssh_hash *h = ssh->kex->hash;
     void *s;
+    int offset;
+
+    assert(keylen <= SSH2_MKKEY_MAXLEN);
+
     /* First hlen bytes. */
     s = h->init();
     if (!(ssh->remote_bugs & BUG_SSH2_DERIVEKEY))
@@ -6262,13 +6405,15 @@ static void ssh2_mkkey(Ssh ssh, Bignum K, unsigned char *H, char chr,
     h->bytes(s, &chr, 1);
     h->bytes(s, ssh->v2_session_id, ssh->v2_session_id_len);
     h->final(s, keyspace);
-    /* Next hlen bytes. */
-    s = h->init();
-    if (!(ssh->remote_bugs & BUG_SSH2_DERIVEKEY))
-	hash_mpint(h, s, K);
-    h->bytes(s, H, h->hlen);
-    h->bytes(s, keyspace, h->hlen);
-    h->final(s, keyspace + h->hlen);
+    /* Each further lot hashes all the bytes so far. */
+    for (offset = h->hlen; offset < keylen; offset += h->hlen) {
+	s = h->init();
+	if (!(ssh->remote_bugs & BUG_SSH2_DERIVEKEY))
+	    hash_mpint(h, s, K);
+	h->bytes(s, H, h->hlen);
+	h->bytes(s, keyspace, offset);
+	h->final(s, keyspace + offset);
+    }
 }
 
 /*
@@ -6291,6 +6436,7 @@ static void do_ssh2_transport(Ssh ssh, void *vin, int inlen,
 	const struct ssh2_cipher *sccipher_tobe;
 	const struct ssh_mac *csmac_tobe;
 	const struct ssh_mac *scmac_tobe;
+	int csmac_etm_tobe, scmac_etm_tobe;
 	const struct ssh_compress *cscomp_tobe;
 	const struct ssh_compress *sccomp_tobe;
 	char *hostkeydata, *sigdata, *rsakeydata, *keystr, *fingerprint;
@@ -6398,6 +6544,9 @@ static void do_ssh2_transport(Ssh ssh, void *vin, int inlen,
 	      case CIPHER_ARCFOUR:
 		s->preferred_ciphers[s->n_preferred_ciphers++] = &ssh2_arcfour;
 		break;
+	      case CIPHER_CHACHA20:
+		s->preferred_ciphers[s->n_preferred_ciphers++] = &ssh2_ccp;
+		break;
 	      case CIPHER_WARN:
 		/* Flag for later. Don't bother if it's the last in
 		 * the list. */
@@ -6412,7 +6561,7 @@ static void do_ssh2_transport(Ssh ssh, void *vin, int inlen,
 	 * Set up preferred compression.
 	 */
 	if (conf_get_int(ssh->conf, CONF_compression))
-	    s->preferred_comp = &ssh_zlib;
+	    s->preferred_comp = &ssh_zlib_default;
 	else
 	    s->preferred_comp = &ssh_comp_none;
 
@@ -6471,9 +6620,16 @@ static void do_ssh2_transport(Ssh ssh, void *vin, int inlen,
 		    ssh2_pkt_addstring_commasep(s->pktout, c->list[j]->name);
 	    }
 	}
-	/* List MAC algorithms (client->server then server->client). */
+	/*
+	 * List MAC algorithms (client->server then server->client),
+	 * preferring the encrypt-then-MAC variants.
+	 */
 	for (j = 0; j < 2; j++) {
 	    ssh2_pkt_addstring_start(s->pktout);
+	    for (i = 0; i < s->nmacs; i++)
+		if (s->maclist[i]->etm_name)
+		    ssh2_pkt_addstring_commasep(s->pktout,
+						s->maclist[i]->etm_name);
 	    for (i = 0; i < s->nmacs; i++)
 		ssh2_pkt_addstring_commasep(s->pktout, s->maclist[i]->name);
 	}
@@ -6535,6 +6691,7 @@ static void do_ssh2_transport(Ssh ssh, void *vin, int inlen,
 	s->sccipher_tobe = NULL;
 	s->csmac_tobe = NULL;
 	s->scmac_tobe = NULL;
+	s->csmac_etm_tobe = s->scmac_etm_tobe = FALSE;
 	s->cscomp_tobe = NULL;
 	s->sccomp_tobe = NULL;
 	s->warn_kex = s->warn_cscipher = s->warn_sccipher = FALSE;
@@ -6650,10 +6807,22 @@ static void do_ssh2_transport(Ssh ssh, void *vin, int inlen,
             bombout(("KEXINIT packet was incomplete"));
             crStopV;
         }
-	for (i = 0; i < s->nmacs; i++) {
-	    if (in_commasep_string(s->maclist[i]->name, str, len)) {
-		s->csmac_tobe = s->maclist[i];
-		break;
+	if (s->cscipher_tobe->required_mac) {
+	    /* Authenticated ciphers ignore the MAC negotiation */
+	    s->csmac_tobe = s->cscipher_tobe->required_mac;
+	    s->csmac_etm_tobe = !!(s->csmac_tobe->etm_name);
+	} else {
+	    /* The order matches the one of our KEXINIT */
+	    for (i = 0; i < s->nmacs && !s->csmac_tobe; i++) {
+		if (s->maclist[i]->etm_name &&
+		    in_commasep_string(s->maclist[i]->etm_name, str, len)) {
+		    s->csmac_tobe = s->maclist[i];
+		    s->csmac_etm_tobe = TRUE;
+		}
+	    }
+	    for (i = 0; i < s->nmacs && !s->csmac_tobe; i++) {
+		if (in_commasep_string(s->maclist[i]->name, str, len))
+		    s->csmac_tobe = s->maclist[i];
 	    }
 	}
 	ssh_pkt_getstring(pktin, &str, &len);    /* server->client mac */
@@ -6661,10 +6830,22 @@ static void do_ssh2_transport(Ssh ssh, void *vin, int inlen,
             bombout(("KEXINIT packet was incomplete"));
             crStopV;
         }
-	for (i = 0; i < s->nmacs; i++) {
-	    if (in_commasep_string(s->maclist[i]->name, str, len)) {
-		s->scmac_tobe = s->maclist[i];
-		break;
+	if (s->sccipher_tobe->required_mac) {
+	    /* Authenticated ciphers ignore the MAC negotiation */
+	    s->scmac_tobe = s->sccipher_tobe->required_mac;
+	    s->scmac_etm_tobe = !!(s->scmac_tobe->etm_name);
+	} else {
+	    /* The order matches the one of our KEXINIT */
+	    for (i = 0; i < s->nmacs && !s->scmac_tobe; i++) {
+		if (s->maclist[i]->etm_name &&
+		    in_commasep_string(s->maclist[i]->etm_name, str, len)) {
+		    s->scmac_tobe = s->maclist[i];
+		    s->scmac_etm_tobe = TRUE;
+		}
+	    }
+	    for (i = 0; i < s->nmacs && !s->scmac_tobe; i++) {
+		if (in_commasep_string(s->maclist[i]->name, str, len))
+		    s->scmac_tobe = s->maclist[i];
 	    }
 	}
 	ssh_pkt_getstring(pktin, &str, &len);  /* client->server compression */
@@ -6919,20 +7100,13 @@ static void do_ssh2_transport(Ssh ssh, void *vin, int inlen,
         }
     } else if (ssh->kex->main_type == KEXTYPE_ECDH) {
 
-        fzprintf(sftpKexAlgorithm, "ECDH");
+        fzprintf(sftpKexAlgorithm, ssh->kex->ecdh->text_name);
         fzprintf(sftpKexHash, ssh->kex->hash->text_name);
-        logeventf(ssh, "Doing ECDH key exchange with hash %s",
-                  ssh->kex->hash->text_name);
+        logeventf(ssh, "Doing %s key exchange with hash %s",
+                  ssh->kex->ecdh->text_name, ssh->kex->hash->text_name);
         ssh->pkt_kctx = SSH2_PKTCTX_ECDHKEX;
 
-        s->eckey = NULL;
-        if (!strcmp(ssh->kex->name, "ecdh-sha2-nistp256")) {
-            s->eckey = ssh_ecdhkex_newkey(ec_p256());
-        } else if (!strcmp(ssh->kex->name, "ecdh-sha2-nistp384")) {
-            s->eckey = ssh_ecdhkex_newkey(ec_p384());
-        } else if (!strcmp(ssh->kex->name, "ecdh-sha2-nistp521")) {
-            s->eckey = ssh_ecdhkex_newkey(ec_p521());
-        }
+        s->eckey = ssh->kex->ecdh->newkey(ssh->kex->ecdh);
         if (!s->eckey) {
             bombout(("Unable to generate key for ECDH"));
             crStopV;
@@ -6941,9 +7115,10 @@ static void do_ssh2_transport(Ssh ssh, void *vin, int inlen,
         {
             char *publicPoint;
             int publicPointLength;
-            publicPoint = ssh_ecdhkex_getpublic(s->eckey, &publicPointLength);
+            publicPoint = ssh->kex->ecdh->getpublic(s->eckey,
+                                                    &publicPointLength);
             if (!publicPoint) {
-                ssh_ecdhkex_freekey(s->eckey);
+                ssh->kex->ecdh->freekey(s->eckey);
                 bombout(("Unable to encode public key for ECDH"));
                 crStopV;
             }
@@ -6957,7 +7132,7 @@ static void do_ssh2_transport(Ssh ssh, void *vin, int inlen,
 
         crWaitUntilV(pktin);
         if (pktin->type != SSH2_MSG_KEX_ECDH_REPLY) {
-            ssh_ecdhkex_freekey(s->eckey);
+            ssh->kex->ecdh->freekey(s->eckey);
             bombout(("expected ECDH reply packet from server"));
             crStopV;
         }
@@ -6969,9 +7144,10 @@ static void do_ssh2_transport(Ssh ssh, void *vin, int inlen,
         {
             char *publicPoint;
             int publicPointLength;
-            publicPoint = ssh_ecdhkex_getpublic(s->eckey, &publicPointLength);
+            publicPoint = ssh->kex->ecdh->getpublic(s->eckey,
+                                                    &publicPointLength);
             if (!publicPoint) {
-                ssh_ecdhkex_freekey(s->eckey);
+                ssh->kex->ecdh->freekey(s->eckey);
                 bombout(("Unable to encode public key for ECDH hash"));
                 crStopV;
             }
@@ -6985,9 +7161,9 @@ static void do_ssh2_transport(Ssh ssh, void *vin, int inlen,
             int keylen;
             ssh_pkt_getstring(pktin, &keydata, &keylen);
             hash_string(ssh->kex->hash, ssh->exhash, keydata, keylen);
-            s->K = ssh_ecdhkex_getkey(s->eckey, keydata, keylen);
+            s->K = ssh->kex->ecdh->getkey(s->eckey, keydata, keylen);
             if (!s->K) {
-                ssh_ecdhkex_freekey(s->eckey);
+                ssh->kex->ecdh->freekey(s->eckey);
                 bombout(("point received in ECDH was not valid"));
                 crStopV;
             }
@@ -6995,7 +7171,7 @@ static void do_ssh2_transport(Ssh ssh, void *vin, int inlen,
 
         ssh_pkt_getstring(pktin, &s->sigdata, &s->siglen);
 
-        ssh_ecdhkex_freekey(s->eckey);
+        ssh->kex->ecdh->freekey(s->eckey);
     } else {
 	fzprintf(sftpKexAlgorithm, "RSA");
 	fzprintf(sftpKexHash, ssh->kex->hash->text_name);
@@ -7121,6 +7297,8 @@ static void do_ssh2_transport(Ssh ssh, void *vin, int inlen,
 
     s->keystr = ssh->hostkey->fmtkey(s->hkey);
     if (!s->got_session_id) {
+        ssh_handshake_phase(ssh, "Key exchange");
+
         /*
          * Authenticate remote host: verify host key. (We've already
          * checked the signature of the exchange hash.)
@@ -7161,6 +7339,7 @@ static void do_ssh2_transport(Ssh ssh, void *vin, int inlen,
             }
         }
         sfree(s->fingerprint);
+        ssh_handshake_phase(ssh, "Host key verification");
         /*
          * Save this host key, to check against the one presented in
          * subsequent rekeys.
@@ -7214,31 +7393,29 @@ static void do_ssh2_transport(Ssh ssh, void *vin, int inlen,
     if (ssh->cs_mac_ctx)
 	ssh->csmac->free_context(ssh->cs_mac_ctx);
     ssh->csmac = s->csmac_tobe;
-    ssh->cs_mac_ctx = ssh->csmac->make_context();
+    ssh->csmac_etm = s->csmac_etm_tobe;
+    ssh->cs_mac_ctx = ssh->csmac->make_context(ssh->cs_cipher_ctx);
 
     if (ssh->cs_comp_ctx)
 	ssh->cscomp->compress_cleanup(ssh->cs_comp_ctx);
     ssh->cscomp = s->cscomp_tobe;
-    ssh->cs_comp_ctx = ssh->cscomp->compress_init();
+    ssh->cs_comp_ctx = ssh->cscomp->compress_init(
+	conf_get_int(ssh->conf, CONF_compression_level));
 
     /*
      * Set IVs on client-to-server keys. Here we use the exchange
      * hash from the _first_ key exchange.
      */
     {
-	unsigned char keyspace[SSH2_KEX_MAX_HASH_LEN * SSH2_MKKEY_ITERS];
-	assert(sizeof(keyspace) >= ssh->kex->hash->hlen * SSH2_MKKEY_ITERS);
-	ssh2_mkkey(ssh,s->K,s->exchange_hash,'C',keyspace);
-	assert((ssh->cscipher->keylen+7) / 8 <=
-	       ssh->kex->hash->hlen * SSH2_MKKEY_ITERS);
+	unsigned char keyspace[SSH2_MKKEY_SPACE];
+	ssh2_mkkey(ssh,s->K,s->exchange_hash,'C',keyspace,
+		   (ssh->cscipher->keylen+7) / 8);
 	ssh->cscipher->setkey(ssh->cs_cipher_ctx, keyspace);
-	ssh2_mkkey(ssh,s->K,s->exchange_hash,'A',keyspace);
-	assert(ssh->cscipher->blksize <=
-	       ssh->kex->hash->hlen * SSH2_MKKEY_ITERS);
+	ssh2_mkkey(ssh,s->K,s->exchange_hash,'A',keyspace,
+		   ssh->cscipher->blksize);
 	ssh->cscipher->setiv(ssh->cs_cipher_ctx, keyspace);
-	ssh2_mkkey(ssh,s->K,s->exchange_hash,'E',keyspace);
-	assert(ssh->csmac->len <=
-	       ssh->kex->hash->hlen * SSH2_MKKEY_ITERS);
+	ssh2_mkkey(ssh,s->K,s->exchange_hash,'E',keyspace,
+		   ssh->csmac->len);
 	ssh->csmac->setkey(ssh->cs_mac_ctx, keyspace);
 	smemclr(keyspace, sizeof(keyspace));
     }
@@ -7247,8 +7424,10 @@ static void do_ssh2_transport(Ssh ssh, void *vin, int inlen,
     fzprintf(sftpMacClientToServer, ssh->csmac->text_name);
     logeventf(ssh, "Initialised %.200s client->server encryption",
 	      ssh->cscipher->text_name);
-    logeventf(ssh, "Initialised %.200s client->server MAC algorithm",
-	      ssh->csmac->text_name);
+    logeventf(ssh, "Initialised %.200s client->server MAC algorithm%s",
+	      ssh->csmac->text_name,
+	      ssh->csmac_etm && !ssh->cscipher->required_mac ?
+	      " (in ETM mode)" : "");
     if (ssh->cscomp->text_name)
 	logeventf(ssh, "Initialised %s compression",
 		  ssh->cscomp->text_name);
@@ -7282,7 +7461,8 @@ static void do_ssh2_transport(Ssh ssh, void *vin, int inlen,
     if (ssh->sc_mac_ctx)
 	ssh->scmac->free_context(ssh->sc_mac_ctx);
     ssh->scmac = s->scmac_tobe;
-    ssh->sc_mac_ctx = ssh->scmac->make_context();
+    ssh->scmac_etm = s->scmac_etm_tobe;
+    ssh->sc_mac_ctx = ssh->scmac->make_context(ssh->sc_cipher_ctx);
 
     if (ssh->sc_comp_ctx)
 	ssh->sccomp->decompress_cleanup(ssh->sc_comp_ctx);
@@ -7294,19 +7474,15 @@ static void do_ssh2_transport(Ssh ssh, void *vin, int inlen,
      * hash from the _first_ key exchange.
      */
     {
-	unsigned char keyspace[SSH2_KEX_MAX_HASH_LEN * SSH2_MKKEY_ITERS];
-	assert(sizeof(keyspace) >= ssh->kex->hash->hlen * SSH2_MKKEY_ITERS);
-	ssh2_mkkey(ssh,s->K,s->exchange_hash,'D',keyspace);
-	assert((ssh->sccipher->keylen+7) / 8 <=
-	       ssh->kex->hash->hlen * SSH2_MKKEY_ITERS);
+	unsigned char keyspace[SSH2_MKKEY_SPACE];
+	ssh2_mkkey(ssh,s->K,s->exchange_hash,'D',keyspace,
+		   (ssh->sccipher->keylen+7) / 8);
 	ssh->sccipher->setkey(ssh->sc_cipher_ctx, keyspace);
-	ssh2_mkkey(ssh,s->K,s->exchange_hash,'B',keyspace);
-	assert(ssh->sccipher->blksize <=
-	       ssh->kex->hash->hlen * SSH2_MKKEY_ITERS);
+	ssh2_mkkey(ssh,s->K,s->exchange_hash,'B',keyspace,
+		   ssh->sccipher->blksize);
 	ssh->sccipher->setiv(ssh->sc_cipher_ctx, keyspace);
-	ssh2_mkkey(ssh,s->K,s->exchange_hash,'F',keyspace);
-	assert(ssh->scmac->len <=
-	       ssh->kex->hash->hlen * SSH2_MKKEY_ITERS);
+	ssh2_mkkey(ssh,s->K,s->exchange_hash,'F',keyspace,
+		   ssh->scmac->len);
 	ssh->scmac->setkey(ssh->sc_mac_ctx, keyspace);
 	smemclr(keyspace, sizeof(keyspace));
     }
@@ -7314,8 +7490,10 @@ static void do_ssh2_transport(Ssh ssh, void *vin, int inlen,
     fzprintf(sftpMacServerToClient, ssh->scmac->text_name);
     logeventf(ssh, "Initialised %.200s server->client encryption",
 	      ssh->sccipher->text_name);
-    logeventf(ssh, "Initialised %.200s server->client MAC algorithm",
-	      ssh->scmac->text_name);
+    logeventf(ssh, "Initialised %.200s server->client MAC algorithm%s",
+	      ssh->scmac->text_name,
+	      ssh->scmac_etm && !ssh->sccipher->required_mac ?
+	      " (in ETM mode)" : "");
     if (ssh->sccomp->text_name)
 	logeventf(ssh, "Initialised %s decompression",
 		  ssh->sccomp->text_name);
@@ -7534,6 +7712,8 @@ static void ssh2_channel_init(struct ssh_channel *c)
     c->throttling_conn = FALSE;
     c->v.v2.locwindow = c->v.v2.locmaxwin = c->v.v2.remlocwin =
 	ssh_is_simple(ssh) ? OUR_V2_BIGWIN : OUR_V2_WINSIZE;
+    c->v.v2.window_exhausted = FALSE;
+    c->v.v2.wingrowth = 0;
     c->v.v2.chanreq_head = NULL;
     c->v.v2.throttle_state = UNTHROTTLED;
     bufchain_init(&c->v.v2.outbuffer);
@@ -7658,8 +7838,14 @@ static void ssh2_set_window(struct ssh_channel *c, int newwin)
 	 * This is only necessary if we're opening the window wide.
 	 * If we're not, then throughput is being constrained by
 	 * something other than the maximum window size anyway.
+	 *
+	 * FZ: Nor once we have sent EOF. The other end may close the
+	 * channel before it answers, and an answer for a channel that
+	 * is gone would take the connection down, including the
+	 * channels of connection sharing downstreams.
 	 */
 	if (newwin == c->v.v2.locmaxwin &&
+	    !(c->closes & CLOSES_SENT_EOF) &&
             !(ssh->remote_bugs & BUG_CHOKES_ON_WINADJ)) {
 	    up = snew(unsigned);
 	    *up = newwin - c->v.v2.locwindow;
@@ -7722,6 +7908,22 @@ static void ssh2_handle_winadj_response(struct ssh_channel *c,
 
     c->v.v2.remlocwin += *sizep;
     sfree(sizep);
+
+    /*
+     * If the remote end ran out of window during the round trip of
+     * this request, the window is smaller than the bandwidth-delay
+     * product. Doubling it gets there within a few round trips, as
+     * far as the budget allows.
+     */
+    if (c->v.v2.window_exhausted) {
+	Ssh ssh = c->ssh;
+	int grow = min(c->v.v2.locmaxwin, ssh->winbudget);
+
+	c->v.v2.locmaxwin += grow;
+	c->v.v2.wingrowth += grow;
+	ssh->winbudget -= grow;
+	c->v.v2.window_exhausted = FALSE;
+    }
     /*
      * winadj messages are only sent when the window is fully open, so
      * if we get an ack of one, we know any pending unthrottle is
@@ -7857,11 +8059,11 @@ static void ssh2_msg_channel_data(Ssh ssh, struct Packet *pktin)
 	/*
 	 * If it looks like the remote end hit the end of its window,
 	 * and we didn't want it to do that, think about using a
-	 * larger window.
+	 * larger window once the next winadj is acknowledged.
 	 */
 	if (c->v.v2.remlocwin <= 0 && c->v.v2.throttle_state == UNTHROTTLED &&
-	    c->v.v2.locmaxwin < 0x40000000)
-	    c->v.v2.locmaxwin += OUR_V2_WINSIZE;
+	    ssh->winbudget > 0 && c->v.v2.locmaxwin <= OUR_V2_WINBUDGET)
+	    c->v.v2.window_exhausted = TRUE;
 	/*
 	 * If we are not buffering too much data,
 	 * enlarge the window again at the remote side.
@@ -7957,6 +8159,7 @@ static void ssh_channel_destroy(struct ssh_channel *c)
     if (ssh->version == 2) {
         bufchain_clear(&c->v.v2.outbuffer);
 	assert(c->v.v2.chanreq_head == NULL);
+	ssh->winbudget += c->v.v2.wingrowth;
     }
     sfree(c);
 
@@ -9330,6 +9533,7 @@ static void do_ssh2_authconn(Ssh ssh, unsigned char *in, int inlen,
 	    }
 	    if (pktin->type == SSH2_MSG_USERAUTH_SUCCESS) {
 		logevent("Access granted");
+		ssh_handshake_phase(ssh, "Authentication");
 		s->we_are_in = s->userauth_success = TRUE;
 		break;
 	    }
@@ -11001,8 +11205,10 @@ static const char *ssh_init(void *frontend_handle, void **backend_handle,
     ssh->sccipher = NULL;
     ssh->sc_cipher_ctx = NULL;
     ssh->csmac = NULL;
+    ssh->csmac_etm = FALSE;
     ssh->cs_mac_ctx = NULL;
     ssh->scmac = NULL;
+    ssh->scmac_etm = FALSE;
     ssh->sc_mac_ctx = NULL;
     ssh->cscomp = NULL;
     ssh->cs_comp_ctx = NULL;
@@ -11045,6 +11251,7 @@ static const char *ssh_init(void *frontend_handle, void **backend_handle,
     ssh->v_s = NULL;
     ssh->mainchan = NULL;
     ssh->throttled_all = 0;
+    ssh->winbudget = OUR_V2_WINBUDGET;
     ssh->v1_stdout_throttling = 0;
     ssh->queue = NULL;
     ssh->queuelen = ssh->queuesize = 0;
@@ -11132,13 +11339,13 @@ static void ssh_free(void *handle)
 	if (ssh->cscomp)
 	    ssh->cscomp->compress_cleanup(ssh->cs_comp_ctx);
 	else
-	    zlib_compress_cleanup(ssh->cs_comp_ctx);
+	    ssh_zlib_default.compress_cleanup(ssh->cs_comp_ctx);
     }
     if (ssh->sc_comp_ctx) {
 	if (ssh->sccomp)
 	    ssh->sccomp->decompress_cleanup(ssh->sc_comp_ctx);
 	else
-	    zlib_decompress_cleanup(ssh->sc_comp_ctx);
+	    ssh_zlib_default.decompress_cleanup(ssh->sc_comp_ctx);
     }
     if (ssh->kex_ctx)
 	dh_cleanup(ssh->kex_ctx);
@@ -11740,6 +11947,16 @@ extern int ssh_fallback_cmd(void *handle)
     return ssh->fallback_cmd;
 }
 
+/*
+ * FZ: The number of connection sharing downstreams currently using our
+ * connection, psftp must not close it while there are any.
+ */
+int ssh_share_downstreams(void *handle)
+{
+    Ssh ssh = (Ssh) handle;
+    return ssh->connshare ? share_ndownstreams(ssh->connshare) : 0;
+}
+
 Backend ssh_backend = {
     ssh_init,
     ssh_free,
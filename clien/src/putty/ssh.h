@@ -181,6 +181,21 @@ void ssh_ecdhkex_freekey(void *key);
 char *ssh_ecdhkex_getpublic(void *key, int *len);
 Bignum ssh_ecdhkex_getkey(void *key, char *remoteKey, int remoteKeyLen);
 
+/*
+ * The curve-specific part of an ECDH key exchange. The NIST curves
+ * share the functions above and differ in their curve, Curve25519
+ * has its own implementation.
+ */
+struct ssh_ecdhkex {
+    void *(*newkey)(const struct ssh_ecdhkex *alg);
+    void (*freekey)(void *key);
+    char *(*getpublic)(void *key, int *len);
+    Bignum (*getkey)(void *key, char *remoteKey, int remoteKeyLen);
+    struct ec_curve *(*curve)(void);   /* NULL for Curve25519 */
+    const char *text_name;
+};
+extern const struct ssh_ecdhkex ssh_ecdhkex_x25519;
+
 /*
  * Helper function for k generation in DSA, reused in ECDSA
  */
@@ -208,7 +223,7 @@ void MD5Update(struct MD5Context *context, unsigned char const *buf,
 void MD5Final(unsigned char digest[16], struct MD5Context *context);
 void MD5Simple(void const *p, unsigned len, unsigned char output[16]);
 
-void *hmacmd5_make_context(void);
+void *hmacmd5_make_context(void *cipher_ctx);
 void hmacmd5_free_context(void *handle);
 void hmacmd5_key(void *handle, void const *key, int len);
 void hmacmd5_do_hmac(void *handle, unsigned char const *blk, int len,
@@ -276,7 +291,15 @@ struct ssh2_cipher {
     int keylen;
     unsigned int flags;
 #define SSH_CIPHER_IS_CBC	1
+#define SSH_CIPHER_SEPARATE_LENGTH	2
     char *text_name;
+    /* Set for authenticated ciphers which come with their own MAC */
+    const struct ssh_mac *required_mac;
+    /* For SSH_CIPHER_SEPARATE_LENGTH, called before the packet body */
+    void (*encrypt_length) (void *, unsigned char *blk, int len,
+			    unsigned long seq);
+    void (*decrypt_length) (void *, unsigned char *blk, int len,
+			    unsigned long seq);
 };
 
 struct ssh2_ciphers {
@@ -285,7 +308,8 @@ struct ssh2_ciphers {
 };
 
 struct ssh_mac {
-    void *(*make_context)(void);
+    /* Passes in the cipher context, for MACs tied to a cipher */
+    void *(*make_context)(void *cipher_ctx);
     void (*free_context)(void *);
     void (*setkey) (void *, unsigned char *key);
     /* whole-packet operations */
@@ -296,7 +320,8 @@ struct ssh_mac {
     void (*bytes) (void *, unsigned char const *, int);
     void (*genresult) (void *, unsigned char *);
     int (*verresult) (void *, unsigned char const *);
-    char *name;
+    /* If etm_name is set, the MAC is computed over the ciphertext */
+    char *name, *etm_name;
     int len;
     char *text_name;
 };
@@ -316,6 +341,8 @@ struct ssh_kex {
     const unsigned char *pdata, *gdata; /* NULL means group exchange */
     int plen, glen;
     const struct ssh_hash *hash;
+    /* For ECDH */
+    const struct ssh_ecdhkex *ecdh;
 };
 
 struct ssh_kexes {
@@ -348,7 +375,8 @@ struct ssh_compress {
     /* For zlib@openssh.com: if non-NULL, this name will be considered once
      * userauth has completed successfully. */
     char *delayed_name;
-    void *(*compress_init) (void);
+    /* level is 1 (fastest) to 9 (best), backends may ignore it */
+    void *(*compress_init) (int level);
     void (*compress_cleanup) (void *);
     int (*compress) (void *, unsigned char *block, int len,
 		     unsigned char **outblock, int *outlen);
@@ -375,6 +403,7 @@ extern const struct ssh_cipher ssh_blowfish_ssh1;
 extern const struct ssh2_ciphers ssh2_3des;
 extern const struct ssh2_ciphers ssh2_des;
 extern const struct ssh2_ciphers ssh2_aes;
+extern const struct ssh2_ciphers ssh2_ccp;
 extern const struct ssh2_ciphers ssh2_blowfish;
 extern const struct ssh2_ciphers ssh2_arcfour;
 extern const struct ssh_hash ssh_sha1;
@@ -397,6 +426,7 @@ extern const struct ssh_mac ssh_hmac_sha1_buggy;
 extern const struct ssh_mac ssh_hmac_sha1_96;
 extern const struct ssh_mac ssh_hmac_sha1_96_buggy;
 extern const struct ssh_mac ssh_hmac_sha256;
+extern const struct ssh_mac ssh_hmac_sha512;
 
 void *aes_make_context(void);
 void aes_free_context(void *handle);
@@ -419,6 +449,9 @@ extern char sshver[];
  */
 extern int ssh_fallback_cmd(void *handle);
 
+/* FZ: Number of connection sharing downstreams using our connection */
+int ssh_share_downstreams(void *handle);
+
 #ifndef MSCRYPTOAPI
 void SHATransform(word32 * digest, word32 * data);
 #endif
@@ -686,9 +719,18 @@ void invent_firstbits(unsigned *one, unsigned *two);
 
 
 /*
- * zlib compression.
+ * zlib compression. ssh_zlib is our own implementation below,
+ * ssh_zlib_deflate uses the zlib library if it was available at
+ * build time.
  */
-void *zlib_compress_init(void);
+extern const struct ssh_compress ssh_zlib;
+#ifdef HAVE_ZLIB
+extern const struct ssh_compress ssh_zlib_deflate;
+#define ssh_zlib_default ssh_zlib_deflate
+#else
+#define ssh_zlib_default ssh_zlib
+#endif
+void *zlib_compress_init(int level);
 void zlib_compress_cleanup(void *);
 void *zlib_decompress_init(void);
 void zlib_decompress_cleanup(void *);
@@ -25,6 +25,10 @@
  * GET_32BIT_LSB_FIRST for GET_32BIT_MSB_FIRST, I could create an
  * implementation that worked internally little-endian and gave the
  * same answers at the same speed.
+ *
+ * On x86 CPUs with the AES-NI instructions, the block cipher and the
+ * GCM hash run on dedicated instructions instead, chosen at runtime.
+ * The table-driven code remains the reference implementation.
  */
 
 #include <assert.h>
@@ -32,6 +36,29 @@
 
 #include "ssh.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || \
+     (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define AES_NI_AVAILABLE
+#define AES_NI_FUNC __attribute__((target("aes,pclmul,ssse3")))
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+#elif defined(_MSC_VER) && _MSC_VER >= 1600 && \
+    (defined(_M_X64) || defined(_M_IX86))
+#define AES_NI_AVAILABLE
+#define AES_NI_FUNC
+#include <intrin.h>
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+#endif
+
+#if defined(_MSC_VER) && _MSC_VER < 1800
+typedef unsigned __int64 gcm_u64;
+#else
+typedef unsigned long long gcm_u64;
+#endif
+
 #define MAX_NR 14		       /* max no of rounds */
 #define MAX_NK 8		       /* max no of words in input key */
 #define MAX_NB 8		       /* max no of words in cipher blk */
@@ -47,6 +74,16 @@ struct AESContext {
     void (*decrypt) (AESContext * ctx, word32 * block);
     word32 iv[MAX_NB];
     int Nb, Nr;
+
+    /* Round keys as byte strings for AES-NI, if ni is set */
+    int ni;
+    unsigned char ni_keys[(MAX_NR + 1) * 16];
+    unsigned char ni_invkeys[(MAX_NR + 1) * 16];
+
+    /* GCM: Hash key, its multiplication table and the nonce */
+    unsigned char gcm_h[16];
+    gcm_u64 gcm_hl[16], gcm_hh[16];
+    unsigned char gcm_iv[12];
 };
 
 static const unsigned char Sbox[256] = {
@@ -921,6 +958,338 @@ static void aes_decrypt_nb_8(AESContext * ctx, word32 * block)
 #undef LASTWORD
 
 
+#ifdef AES_NI_AVAILABLE
+
+/*
+ * AES-NI implementation. The round keys come from the portable key
+ * schedule below, stored as the byte strings the instructions work
+ * on. CBC encryption is inherently serial, everything else processes
+ * four blocks at a time to keep the pipeline of the AES unit busy.
+ */
+
+static int aes_ni_enabled = -1;
+
+static int aes_ni_supported(void)
+{
+    if (aes_ni_enabled < 0) {
+	unsigned int ecx;
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	ecx = info[2];
+#else
+	unsigned int eax, ebx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+	    ecx = 0;
+#endif
+	/* AES-NI, PCLMULQDQ and SSSE3 */
+	aes_ni_enabled = (ecx & (1 << 25)) && (ecx & (1 << 1)) &&
+	    (ecx & (1 << 9));
+    }
+    return aes_ni_enabled;
+}
+
+#define BSWAP32(x) ( ((x) >> 24) | (((x) >> 8) & 0xFF00) | \
+		     (((x) & 0xFF00) << 8) | ((x) << 24) )
+
+/* Loads a block given as big-endian words like in ctx->iv */
+#define NI_LOAD_WORDS(w) _mm_set_epi32((int)BSWAP32((w)[3]), \
+				       (int)BSWAP32((w)[2]), \
+				       (int)BSWAP32((w)[1]), \
+				       (int)BSWAP32((w)[0]))
+
+static AES_NI_FUNC void aes_ni_setup(AESContext * ctx)
+{
+    int i;
+
+    memset(ctx->ni_keys, 0, sizeof(ctx->ni_keys));
+    memset(ctx->ni_invkeys, 0, sizeof(ctx->ni_invkeys));
+    for (i = 0; i < (ctx->Nr + 1) * 4; i++)
+	PUT_32BIT_MSB_FIRST(ctx->ni_keys + 4 * i, ctx->keysched[i]);
+
+    /* The equivalent inverse cipher needs InvMixColumns on the inner keys */
+    memcpy(ctx->ni_invkeys, ctx->ni_keys + ctx->Nr * 16, 16);
+    for (i = 1; i < ctx->Nr; i++) {
+	__m128i k = _mm_loadu_si128((const __m128i *)
+				    (ctx->ni_keys + (ctx->Nr - i) * 16));
+	_mm_storeu_si128((__m128i *)(ctx->ni_invkeys + i * 16),
+			 _mm_aesimc_si128(k));
+    }
+    memcpy(ctx->ni_invkeys + ctx->Nr * 16, ctx->ni_keys, 16);
+}
+
+static AES_NI_FUNC void aes_ni_load_keys(const unsigned char *keys, __m128i *k)
+{
+    int i;
+    for (i = 0; i <= MAX_NR; i++)
+	k[i] = _mm_loadu_si128((const __m128i *)(keys + i * 16));
+}
+
+static AES_NI_FUNC __m128i aes_ni_encrypt_block(__m128i b, const __m128i *k,
+						int Nr)
+{
+    int i;
+    b = _mm_xor_si128(b, k[0]);
+    for (i = 1; i < Nr; i++)
+	b = _mm_aesenc_si128(b, k[i]);
+    return _mm_aesenclast_si128(b, k[Nr]);
+}
+
+/*
+ * Four blocks in parallel. The blocks are kept in separate variables
+ * so that they stay in registers.
+ */
+#define NI_ROUNDS4(op, oplast) do { \
+    b0 = _mm_xor_si128(b0, k[0]); b1 = _mm_xor_si128(b1, k[0]); \
+    b2 = _mm_xor_si128(b2, k[0]); b3 = _mm_xor_si128(b3, k[0]); \
+    for (r = 1; r < Nr; r++) { \
+	b0 = op(b0, k[r]); b1 = op(b1, k[r]); \
+	b2 = op(b2, k[r]); b3 = op(b3, k[r]); \
+    } \
+    b0 = oplast(b0, k[Nr]); b1 = oplast(b1, k[Nr]); \
+    b2 = oplast(b2, k[Nr]); b3 = oplast(b3, k[Nr]); \
+} while (0)
+
+static AES_NI_FUNC void aes_ni_store_iv(AESContext * ctx, __m128i iv)
+{
+    unsigned char b[16];
+    int i;
+    _mm_storeu_si128((__m128i *)b, iv);
+    for (i = 0; i < 4; i++)
+	ctx->iv[i] = GET_32BIT_MSB_FIRST(b + 4 * i);
+}
+
+static AES_NI_FUNC void aes_ni_encrypt_cbc(unsigned char *blk, int len,
+					   AESContext * ctx)
+{
+    __m128i k[MAX_NR + 1], iv;
+
+    aes_ni_load_keys(ctx->ni_keys, k);
+    iv = NI_LOAD_WORDS(ctx->iv);
+
+    while (len > 0) {
+	iv = _mm_xor_si128(iv, _mm_loadu_si128((const __m128i *)blk));
+	iv = aes_ni_encrypt_block(iv, k, ctx->Nr);
+	_mm_storeu_si128((__m128i *)blk, iv);
+	blk += 16;
+	len -= 16;
+    }
+
+    aes_ni_store_iv(ctx, iv);
+}
+
+static AES_NI_FUNC void aes_ni_decrypt_cbc(unsigned char *blk, int len,
+					   AESContext * ctx)
+{
+    __m128i k[MAX_NR + 1], iv, b0, b1, b2, b3, c0, c1, c2, c3;
+    __m128i *p = (__m128i *)blk;
+    int r, Nr = ctx->Nr;
+
+    aes_ni_load_keys(ctx->ni_invkeys, k);
+    iv = NI_LOAD_WORDS(ctx->iv);
+
+    for (; len >= 64; len -= 64, p += 4) {
+	b0 = c0 = _mm_loadu_si128(p);
+	b1 = c1 = _mm_loadu_si128(p + 1);
+	b2 = c2 = _mm_loadu_si128(p + 2);
+	b3 = c3 = _mm_loadu_si128(p + 3);
+	NI_ROUNDS4(_mm_aesdec_si128, _mm_aesdeclast_si128);
+	_mm_storeu_si128(p, _mm_xor_si128(b0, iv));
+	_mm_storeu_si128(p + 1, _mm_xor_si128(b1, c0));
+	_mm_storeu_si128(p + 2, _mm_xor_si128(b2, c1));
+	_mm_storeu_si128(p + 3, _mm_xor_si128(b3, c2));
+	iv = c3;
+    }
+
+    for (; len > 0; len -= 16, p++) {
+	b0 = c0 = _mm_loadu_si128(p);
+	b0 = _mm_xor_si128(b0, k[0]);
+	for (r = 1; r < Nr; r++)
+	    b0 = _mm_aesdec_si128(b0, k[r]);
+	b0 = _mm_aesdeclast_si128(b0, k[Nr]);
+	_mm_storeu_si128(p, _mm_xor_si128(b0, iv));
+	iv = c0;
+    }
+
+    aes_ni_store_iv(ctx, iv);
+}
+
+/*
+ * Counter mode. ctr[] holds the big-endian counter words, only the
+ * last `ctrwords' of them get incremented. The counter is kept in
+ * local variables, going through memory would stall on every block.
+ */
+static AES_NI_FUNC void aes_ni_ctr(unsigned char *blk, int len,
+				   AESContext * ctx, word32 *ctr, int ctrwords)
+{
+    __m128i k[MAX_NR + 1], b0, b1, b2, b3;
+    __m128i *p = (__m128i *)blk;
+    word32 c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+    int r, Nr = ctx->Nr;
+
+#define NI_NEXT_CTR(b) do { \
+    b = _mm_set_epi32((int)BSWAP32(c3), (int)BSWAP32(c2), \
+		      (int)BSWAP32(c1), (int)BSWAP32(c0)); \
+    c3 = (c3 + 1) & 0xffffffff; \
+    if (!c3 && ctrwords > 1) { \
+	c2 = (c2 + 1) & 0xffffffff; \
+	if (!c2) { \
+	    c1 = (c1 + 1) & 0xffffffff; \
+	    if (!c1) \
+		c0 = (c0 + 1) & 0xffffffff; \
+	} \
+    } \
+} while (0)
+
+    aes_ni_load_keys(ctx->ni_keys, k);
+
+    for (; len >= 64; len -= 64, p += 4) {
+	NI_NEXT_CTR(b0);
+	NI_NEXT_CTR(b1);
+	NI_NEXT_CTR(b2);
+	NI_NEXT_CTR(b3);
+	NI_ROUNDS4(_mm_aesenc_si128, _mm_aesenclast_si128);
+	_mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), b0));
+	_mm_storeu_si128(p + 1, _mm_xor_si128(_mm_loadu_si128(p + 1), b1));
+	_mm_storeu_si128(p + 2, _mm_xor_si128(_mm_loadu_si128(p + 2), b2));
+	_mm_storeu_si128(p + 3, _mm_xor_si128(_mm_loadu_si128(p + 3), b3));
+    }
+
+    for (; len > 0; len -= 16, p++) {
+	NI_NEXT_CTR(b0);
+	b0 = aes_ni_encrypt_block(b0, k, Nr);
+	_mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), b0));
+    }
+
+#undef NI_NEXT_CTR
+
+    ctr[0] = c0;
+    ctr[1] = c1;
+    ctr[2] = c2;
+    ctr[3] = c3;
+}
+
+static AES_NI_FUNC void aes_ni_encrypt_bytes(AESContext * ctx,
+					     unsigned char *blk)
+{
+    __m128i k[MAX_NR + 1];
+    aes_ni_load_keys(ctx->ni_keys, k);
+    _mm_storeu_si128((__m128i *)blk,
+		     aes_ni_encrypt_block(_mm_loadu_si128((__m128i *)blk),
+					  k, ctx->Nr));
+}
+
+/*
+ * Multiplication in GF(2^128) for GHASH using carry-less multiplies,
+ * on operands with their bytes reversed, following Intel's white paper
+ * "Intel Carry-Less Multiplication Instruction and its Usage for
+ * Computing the GCM Mode". The reduction is linear, so the products of
+ * several blocks get summed up and reduced once.
+ */
+static AES_NI_FUNC void gcm_ni_clmul(__m128i a, __m128i b,
+				     __m128i *lo, __m128i *hi)
+{
+    __m128i t3, t4, t5, t6;
+
+    t3 = _mm_clmulepi64_si128(a, b, 0x00);
+    t4 = _mm_clmulepi64_si128(a, b, 0x10);
+    t5 = _mm_clmulepi64_si128(a, b, 0x01);
+    t6 = _mm_clmulepi64_si128(a, b, 0x11);
+
+    t4 = _mm_xor_si128(t4, t5);
+    t5 = _mm_slli_si128(t4, 8);
+    t4 = _mm_srli_si128(t4, 8);
+    *lo = _mm_xor_si128(*lo, _mm_xor_si128(t3, t5));
+    *hi = _mm_xor_si128(*hi, _mm_xor_si128(t6, t4));
+}
+
+static AES_NI_FUNC __m128i gcm_ni_reduce(__m128i t3, __m128i t6)
+{
+    __m128i t2, t4, t5, t7, t8, t9;
+
+    /* Shift the 256-bit product left by one bit */
+    t7 = _mm_srli_epi32(t3, 31);
+    t8 = _mm_srli_epi32(t6, 31);
+    t3 = _mm_slli_epi32(t3, 1);
+    t6 = _mm_slli_epi32(t6, 1);
+    t9 = _mm_srli_si128(t7, 12);
+    t8 = _mm_slli_si128(t8, 4);
+    t7 = _mm_slli_si128(t7, 4);
+    t3 = _mm_or_si128(t3, t7);
+    t6 = _mm_or_si128(t6, t8);
+    t6 = _mm_or_si128(t6, t9);
+
+    /* Reduce modulo x^128 + x^7 + x^2 + x + 1 */
+    t7 = _mm_slli_epi32(t3, 31);
+    t8 = _mm_slli_epi32(t3, 30);
+    t9 = _mm_slli_epi32(t3, 25);
+    t7 = _mm_xor_si128(t7, t8);
+    t7 = _mm_xor_si128(t7, t9);
+    t8 = _mm_srli_si128(t7, 4);
+    t7 = _mm_slli_si128(t7, 12);
+    t3 = _mm_xor_si128(t3, t7);
+
+    t2 = _mm_srli_epi32(t3, 1);
+    t4 = _mm_srli_epi32(t3, 2);
+    t5 = _mm_srli_epi32(t3, 7);
+    t2 = _mm_xor_si128(t2, t4);
+    t2 = _mm_xor_si128(t2, t5);
+    t2 = _mm_xor_si128(t2, t8);
+    t3 = _mm_xor_si128(t3, t2);
+    return _mm_xor_si128(t6, t3);
+}
+
+static AES_NI_FUNC __m128i gcm_ni_mult(__m128i a, __m128i b)
+{
+    __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+    gcm_ni_clmul(a, b, &lo, &hi);
+    return gcm_ni_reduce(lo, hi);
+}
+
+static AES_NI_FUNC void gcm_ni_ghash(AESContext * ctx, unsigned char *x,
+				     const unsigned char *data, int len)
+{
+    const __m128i rev = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+				     8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i h[4], y, d, lo, hi;
+    int i;
+
+    h[0] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)ctx->gcm_h),
+			    rev);
+    y = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)x), rev);
+
+    if (len >= 64) {
+	/* Four blocks at a time with the powers of H */
+	for (i = 1; i < 4; i++)
+	    h[i] = gcm_ni_mult(h[i - 1], h[0]);
+	while (len >= 64) {
+	    lo = hi = _mm_setzero_si128();
+	    for (i = 0; i < 4; i++) {
+		d = _mm_loadu_si128((const __m128i *)(data + 16 * i));
+		d = _mm_shuffle_epi8(d, rev);
+		if (i == 0)
+		    d = _mm_xor_si128(d, y);
+		gcm_ni_clmul(d, h[3 - i], &lo, &hi);
+	    }
+	    y = gcm_ni_reduce(lo, hi);
+	    data += 64;
+	    len -= 64;
+	}
+    }
+
+    while (len > 0) {
+	d = _mm_loadu_si128((const __m128i *)data);
+	y = gcm_ni_mult(_mm_xor_si128(y, _mm_shuffle_epi8(d, rev)), h[0]);
+	data += 16;
+	len -= 16;
+    }
+
+    _mm_storeu_si128((__m128i *)x, _mm_shuffle_epi8(y, rev));
+}
+
+#endif /* AES_NI_AVAILABLE */
+
+
 /*
  * Set up an AESContext. `keylen' and `blocklen' are measured in
  * bytes; each can be either 16 (128-bit), 24 (192-bit), or 32
@@ -1013,6 +1382,14 @@ static void aes_setup(AESContext * ctx, int blocklen,
 	    ctx->invkeysched[i * ctx->Nb + j] = temp;
 	}
     }
+
+    ctx->ni = 0;
+#ifdef AES_NI_AVAILABLE
+    if (ctx->Nb == 4 && aes_ni_supported()) {
+	aes_ni_setup(ctx);
+	ctx->ni = 1;
+    }
+#endif
 }
 
 static void aes_encrypt(AESContext * ctx, word32 * block)
@@ -1032,6 +1409,13 @@ static void aes_encrypt_cbc(unsigned char *blk, int len, AESContext * ctx)
 
     assert((len & 15) == 0);
 
+#ifdef AES_NI_AVAILABLE
+    if (ctx->ni) {
+	aes_ni_encrypt_cbc(blk, len, ctx);
+	return;
+    }
+#endif
+
     memcpy(iv, ctx->iv, sizeof(iv));
 
     while (len > 0) {
@@ -1054,6 +1438,13 @@ static void aes_decrypt_cbc(unsigned char *blk, int len, AESContext * ctx)
 
     assert((len & 15) == 0);
 
+#ifdef AES_NI_AVAILABLE
+    if (ctx->ni) {
+	aes_ni_decrypt_cbc(blk, len, ctx);
+	return;
+    }
+#endif
+
     memcpy(iv, ctx->iv, sizeof(iv));
 
     while (len > 0) {
@@ -1078,6 +1469,13 @@ static void aes_sdctr(unsigned char *blk, int len, AESContext *ctx)
 
     assert((len & 15) == 0);
 
+#ifdef AES_NI_AVAILABLE
+    if (ctx->ni) {
+	aes_ni_ctr(blk, len, ctx, ctx->iv, 4);
+	return;
+    }
+#endif
+
     memcpy(iv, ctx->iv, sizeof(iv));
 
     while (len > 0) {
@@ -1097,6 +1495,206 @@ static void aes_sdctr(unsigned char *blk, int len, AESContext *ctx)
     memcpy(ctx->iv, iv, sizeof(iv));
 }
 
+static void aes_encrypt_bytes(AESContext * ctx, unsigned char *blk)
+{
+    word32 b[4];
+    int i;
+
+#ifdef AES_NI_AVAILABLE
+    if (ctx->ni) {
+	aes_ni_encrypt_bytes(ctx, blk);
+	return;
+    }
+#endif
+
+    for (i = 0; i < 4; i++)
+	b[i] = GET_32BIT_MSB_FIRST(blk + 4 * i);
+    aes_encrypt(ctx, b);
+    for (i = 0; i < 4; i++)
+	PUT_32BIT_MSB_FIRST(blk + 4 * i, b[i]);
+    smemclr(b, sizeof(b));
+}
+
+/*
+ * AES-GCM as specified for SSH in RFC 5647, under the names OpenSSH
+ * gave it. The 96-bit nonce comes from the key exchange and its last
+ * 64 bits count the packets. The packet length is sent in the clear
+ * and authenticated as associated data, the GCM tag takes the place
+ * of the MAC.
+ *
+ * The portable GHASH uses Shoup's 4-bit tables; with PCLMULQDQ the
+ * multiplication is done by the CPU.
+ */
+
+static const gcm_u64 gcm_last4[16] = {
+    0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+    0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+};
+
+static void gcm_setup(AESContext * ctx)
+{
+    gcm_u64 vh, vl;
+    int i, j;
+
+    /* The hash key is the encryption of the zero block */
+    memset(ctx->gcm_h, 0, 16);
+    aes_encrypt_bytes(ctx, ctx->gcm_h);
+
+    vh = ((gcm_u64)GET_32BIT_MSB_FIRST(ctx->gcm_h) << 32) |
+	GET_32BIT_MSB_FIRST(ctx->gcm_h + 4);
+    vl = ((gcm_u64)GET_32BIT_MSB_FIRST(ctx->gcm_h + 8) << 32) |
+	GET_32BIT_MSB_FIRST(ctx->gcm_h + 12);
+
+    ctx->gcm_hl[0] = ctx->gcm_hh[0] = 0;
+    ctx->gcm_hl[8] = vl;
+    ctx->gcm_hh[8] = vh;
+    for (i = 4; i > 0; i >>= 1) {
+	gcm_u64 t = (vl & 1) * 0xe1000000U;
+	vl = (vh << 63) | (vl >> 1);
+	vh = (vh >> 1) ^ (t << 32);
+	ctx->gcm_hl[i] = vl;
+	ctx->gcm_hh[i] = vh;
+    }
+    for (i = 2; i <= 8; i *= 2) {
+	for (j = 1; j < i; j++) {
+	    ctx->gcm_hh[i + j] = ctx->gcm_hh[i] ^ ctx->gcm_hh[j];
+	    ctx->gcm_hl[i + j] = ctx->gcm_hl[i] ^ ctx->gcm_hl[j];
+	}
+    }
+}
+
+/* x = x * H */
+static void gcm_mult(AESContext * ctx, unsigned char *x)
+{
+    gcm_u64 zh, zl;
+    int i, lo, hi, rem;
+
+    lo = x[15] & 0xf;
+    zh = ctx->gcm_hh[lo];
+    zl = ctx->gcm_hl[lo];
+
+    for (i = 15; i >= 0; i--) {
+	lo = x[i] & 0xf;
+	hi = (x[i] >> 4) & 0xf;
+
+	if (i != 15) {
+	    rem = (int)(zl & 0xf);
+	    zl = (zh << 60) | (zl >> 4);
+	    zh = (zh >> 4) ^ (gcm_last4[rem] << 48);
+	    zh ^= ctx->gcm_hh[lo];
+	    zl ^= ctx->gcm_hl[lo];
+	}
+
+	rem = (int)(zl & 0xf);
+	zl = (zh << 60) | (zl >> 4);
+	zh = (zh >> 4) ^ (gcm_last4[rem] << 48);
+	zh ^= ctx->gcm_hh[hi];
+	zl ^= ctx->gcm_hl[hi];
+    }
+
+    PUT_32BIT_MSB_FIRST(x, (word32)(zh >> 32));
+    PUT_32BIT_MSB_FIRST(x + 4, (word32)zh);
+    PUT_32BIT_MSB_FIRST(x + 8, (word32)(zl >> 32));
+    PUT_32BIT_MSB_FIRST(x + 12, (word32)zl);
+}
+
+/* Hashes len bytes, a multiple of the block size, into x */
+static void gcm_ghash(AESContext * ctx, unsigned char *x,
+		      const unsigned char *data, int len)
+{
+    int i;
+
+    assert((len & 15) == 0);
+
+#ifdef AES_NI_AVAILABLE
+    if (ctx->ni) {
+	gcm_ni_ghash(ctx, x, data, len);
+	return;
+    }
+#endif
+
+    while (len > 0) {
+	for (i = 0; i < 16; i++)
+	    x[i] ^= data[i];
+	gcm_mult(ctx, x);
+	data += 16;
+	len -= 16;
+    }
+}
+
+/* Counter mode starting at the block after the one masking the tag */
+static void gcm_ctr(AESContext * ctx, unsigned char *blk, int len)
+{
+    word32 ctr[4], b[4], tmp;
+    int i;
+
+    assert((len & 15) == 0);
+
+    for (i = 0; i < 3; i++)
+	ctr[i] = GET_32BIT_MSB_FIRST(ctx->gcm_iv + 4 * i);
+    ctr[3] = 2;
+
+#ifdef AES_NI_AVAILABLE
+    if (ctx->ni) {
+	aes_ni_ctr(blk, len, ctx, ctr, 1);
+	return;
+    }
+#endif
+
+    while (len > 0) {
+	memcpy(b, ctr, sizeof(b));
+	aes_encrypt(ctx, b);
+	for (i = 0; i < 4; i++) {
+	    tmp = GET_32BIT_MSB_FIRST(blk + 4 * i);
+	    PUT_32BIT_MSB_FIRST(blk + 4 * i, tmp ^ b[i]);
+	}
+	ctr[3] = (ctr[3] + 1) & 0xffffffff;
+	blk += 16;
+	len -= 16;
+    }
+}
+
+/*
+ * Computes the tag of a packet: The first four bytes are the length
+ * field, authenticated but not encrypted, the rest is ciphertext.
+ */
+static void gcm_tag(AESContext * ctx, unsigned char *blk, int len,
+		    unsigned char *tag)
+{
+    unsigned char b[16];
+    int i;
+
+    memset(tag, 0, 16);
+
+    memset(b, 0, 16);
+    memcpy(b, blk, 4);
+    gcm_ghash(ctx, tag, b, 16);
+    gcm_ghash(ctx, tag, blk + 4, len - 4);
+
+    /* Bit lengths of associated data and ciphertext */
+    memset(b, 0, 16);
+    PUT_32BIT_MSB_FIRST(b + 4, 4 * 8);
+    PUT_32BIT_MSB_FIRST(b + 8, (word32)((unsigned)(len - 4) >> 29));
+    PUT_32BIT_MSB_FIRST(b + 12, (word32)((unsigned)(len - 4) << 3));
+    gcm_ghash(ctx, tag, b, 16);
+
+    memcpy(b, ctx->gcm_iv, 12);
+    PUT_32BIT_MSB_FIRST(b + 12, 1);
+    aes_encrypt_bytes(ctx, b);
+    for (i = 0; i < 16; i++)
+	tag[i] ^= b[i];
+    smemclr(b, sizeof(b));
+}
+
+/* Increments the 64-bit invocation counter in the nonce */
+static void gcm_next_iv(AESContext * ctx)
+{
+    int i;
+    for (i = 11; i >= 4; i--)
+	if (++ctx->gcm_iv[i] != 0)
+	    break;
+}
+
 void *aes_make_context(void)
 {
     return snew(AESContext);
@@ -1151,6 +1749,91 @@ static void aes_ssh2_sdctr(void *handle, unsigned char *blk, int len)
     aes_sdctr(blk, len, ctx);
 }
 
+static void aes_gcm_iv(void *handle, unsigned char *iv)
+{
+    AESContext *ctx = (AESContext *)handle;
+    memcpy(ctx->gcm_iv, iv, 12);
+}
+
+static void aes128_gcm_key(void *handle, unsigned char *key)
+{
+    AESContext *ctx = (AESContext *)handle;
+    aes_setup(ctx, 16, key, 16);
+    gcm_setup(ctx);
+}
+
+static void aes256_gcm_key(void *handle, unsigned char *key)
+{
+    AESContext *ctx = (AESContext *)handle;
+    aes_setup(ctx, 16, key, 32);
+    gcm_setup(ctx);
+}
+
+/*
+ * Encryption happens before the tag is generated, which moves on to
+ * the next nonce. Decryption follows the verification of the tag.
+ */
+static void aes_gcm_encrypt(void *handle, unsigned char *blk, int len)
+{
+    AESContext *ctx = (AESContext *)handle;
+    gcm_ctr(ctx, blk, len);
+}
+
+static void aes_gcm_decrypt(void *handle, unsigned char *blk, int len)
+{
+    AESContext *ctx = (AESContext *)handle;
+    gcm_ctr(ctx, blk, len);
+    gcm_next_iv(ctx);
+}
+
+/* The GCM MAC shares its state with the cipher */
+static void *aes_gcm_mac_make_context(void *cipher_ctx)
+{
+    return cipher_ctx;
+}
+
+static void aes_gcm_mac_free_context(void *handle)
+{
+}
+
+static void aes_gcm_mac_key(void *handle, unsigned char *key)
+{
+}
+
+static void aes_gcm_mac_generate(void *handle, unsigned char *blk, int len,
+				 unsigned long seq)
+{
+    AESContext *ctx = (AESContext *)handle;
+    gcm_tag(ctx, blk, len, blk + len);
+    gcm_next_iv(ctx);
+}
+
+static int aes_gcm_mac_verify(void *handle, unsigned char *blk, int len,
+			      unsigned long seq)
+{
+    AESContext *ctx = (AESContext *)handle;
+    unsigned char correct[16], diff = 0;
+    int i;
+
+    gcm_tag(ctx, blk, len, correct);
+    for (i = 0; i < 16; i++)
+	diff |= correct[i] ^ blk[len + i];
+    return diff == 0;
+}
+
+/*
+ * Never negotiated, the GCM ciphers imply it. Setting etm_name selects
+ * the packet layout with the length in the clear.
+ */
+static const struct ssh_mac ssh_aes_gcm_mac = {
+    aes_gcm_mac_make_context, aes_gcm_mac_free_context, aes_gcm_mac_key,
+    aes_gcm_mac_generate, aes_gcm_mac_verify,
+    NULL, NULL, NULL, NULL,
+    NULL, "aes-gcm@openssh.com",
+    16,
+    "AES-GCM"
+};
+
 void aes256_encrypt_pubkey(unsigned char *key, unsigned char *blk, int len)
 {
     AESContext ctx;
@@ -1169,6 +1852,20 @@ void aes256_decrypt_pubkey(unsigned char *key, unsigned char *blk, int len)
     smemclr(&ctx, sizeof(ctx));
 }
 
+static const struct ssh2_cipher ssh_aes128_gcm = {
+    aes_make_context, aes_free_context, aes_gcm_iv, aes128_gcm_key,
+    aes_gcm_encrypt, aes_gcm_decrypt,
+    "aes128-gcm@openssh.com",
+    16, 128, 0, "AES-128 GCM", &ssh_aes_gcm_mac
+};
+
+static const struct ssh2_cipher ssh_aes256_gcm = {
+    aes_make_context, aes_free_context, aes_gcm_iv, aes256_gcm_key,
+    aes_gcm_encrypt, aes_gcm_decrypt,
+    "aes256-gcm@openssh.com",
+    16, 256, 0, "AES-256 GCM", &ssh_aes_gcm_mac
+};
+
 static const struct ssh2_cipher ssh_aes128_ctr = {
     aes_make_context, aes_free_context, aes_iv, aes128_key,
     aes_ssh2_sdctr, aes_ssh2_sdctr,
@@ -1219,11 +1916,13 @@ static const struct ssh2_cipher ssh_rijndael_lysator = {
 };
 
 static const struct ssh2_cipher *const aes_list[] = {
+    &ssh_aes256_gcm,
     &ssh_aes256_ctr,
     &ssh_aes256,
     &ssh_rijndael_lysator,
     &ssh_aes192_ctr,
     &ssh_aes192,
+    &ssh_aes128_gcm,
     &ssh_aes128_ctr,
     &ssh_aes128,
 };
@@ -1232,3 +1931,350 @@ const struct ssh2_ciphers ssh2_aes = {
     sizeof(aes_list) / sizeof(*aes_list),
     aes_list
 };
+
+#ifdef TESTAES
+
+/*
+ * Known-answer tests and a throughput benchmark:
+ *
+ * gcc -O2 -DTESTAES -o fzaesbench sshaes.c misc.c conf.c tree234.c unix/uxmisc.c -I. -I unix
+ *
+ * or `make fzaesbench'. The accelerated code is checked against the
+ * portable implementation on random data, the MB/s are per core.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+void modalfatalbox(char *p, ...)
+{
+    va_list ap;
+    fprintf(stderr, "FATAL ERROR: ");
+    va_start(ap, p);
+    vfprintf(stderr, p, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static int passes, fails;
+
+static void check(const char *what, const unsigned char *got,
+		  const char *expected_hex, int len)
+{
+    unsigned char expected[64];
+    int i;
+
+    for (i = 0; i < len; i++) {
+	unsigned int b;
+	sscanf(expected_hex + 2 * i, "%2x", &b);
+	expected[i] = (unsigned char)b;
+    }
+    if (memcmp(got, expected, len)) {
+	printf("FAIL: %s\n", what);
+	fails++;
+    } else
+	passes++;
+}
+
+static void unhex(unsigned char *out, const char *hex)
+{
+    unsigned int b;
+    while (*hex) {
+	sscanf(hex, "%2x", &b);
+	*out++ = (unsigned char)b;
+	hex += 2;
+    }
+}
+
+/* Sets up a key with or without the accelerated code */
+static void test_key(AESContext * ctx, void (*setkey) (void *, unsigned char *),
+		     unsigned char *key, int ni)
+{
+#ifdef AES_NI_AVAILABLE
+    int supported = aes_ni_supported();
+    aes_ni_enabled = ni && supported;
+    setkey(ctx, key);
+    aes_ni_enabled = supported;
+#else
+    setkey(ctx, key);
+#endif
+}
+
+static void test_block(const char *name, void (*setkey) (void *, unsigned char *),
+		       const char *key_hex, const char *ct_hex, int ni)
+{
+    AESContext ctx;
+    unsigned char key[32], blk[16], zero[16];
+
+    unhex(key, key_hex);
+    unhex(blk, "00112233445566778899aabbccddeeff");
+    memset(zero, 0, 16);
+
+    test_key(&ctx, setkey, key, ni);
+    aes_iv(&ctx, zero);
+    aes_encrypt_cbc(blk, 16, &ctx);
+    check(name, blk, ct_hex, 16);
+    aes_iv(&ctx, zero);
+    aes_decrypt_cbc(blk, 16, &ctx);
+    check(name, blk, "00112233445566778899aabbccddeeff", 16);
+}
+
+/* GCM with arbitrary associated data, as in the test vectors of the spec */
+static void test_gcm(const char *name, void (*setkey) (void *, unsigned char *),
+		     const char *key_hex, const char *iv_hex,
+		     const char *pt_hex, const char *aad_hex,
+		     const char *ct_hex, const char *tag_hex, int ni)
+{
+    AESContext ctx;
+    unsigned char key[32], iv[12], buf[64], aad[32], b[16], tag[16];
+    int ptlen = strlen(pt_hex) / 2, aadlen = strlen(aad_hex) / 2, i;
+
+    unhex(key, key_hex);
+    unhex(iv, iv_hex);
+    memset(buf, 0, sizeof(buf));
+    unhex(buf, pt_hex);
+    memset(aad, 0, sizeof(aad));
+    unhex(aad, aad_hex);
+
+    test_key(&ctx, setkey, key, ni);
+    aes_gcm_iv(&ctx, iv);
+    gcm_ctr(&ctx, buf, (ptlen + 15) & ~15);
+    check(name, buf, ct_hex, ptlen);
+
+    memset(buf + ptlen, 0, sizeof(buf) - ptlen);
+    memset(tag, 0, 16);
+    gcm_ghash(&ctx, tag, aad, (aadlen + 15) & ~15);
+    gcm_ghash(&ctx, tag, buf, (ptlen + 15) & ~15);
+    memset(b, 0, 16);
+    PUT_32BIT_MSB_FIRST(b + 4, aadlen * 8);
+    PUT_32BIT_MSB_FIRST(b + 12, ptlen * 8);
+    gcm_ghash(&ctx, tag, b, 16);
+    memcpy(b, iv, 12);
+    PUT_32BIT_MSB_FIRST(b + 12, 1);
+    aes_encrypt_bytes(&ctx, b);
+    for (i = 0; i < 16; i++)
+	tag[i] ^= b[i];
+    check(name, tag, tag_hex, 16);
+}
+
+static unsigned long rng_state = 1;
+
+static void random_fill(unsigned char *buf, int len)
+{
+    while (len-- > 0) {
+	rng_state = rng_state * 1103515245 + 12345;
+	*buf++ = (unsigned char)(rng_state >> 16);
+    }
+}
+
+/*
+ * Runs a cipher through the SSH-2 interface with each implementation
+ * and compares the results, each decrypting what the other encrypted.
+ * Several packets in a row check that the IVs are kept in step.
+ */
+static void test_cross(const struct ssh2_cipher *cipher)
+{
+    enum { LEN = 4 + 1024 };
+    const struct ssh_mac *mac = cipher->required_mac;
+    unsigned char key[32], iv[16], plain[LEN];
+    unsigned char buf[2][LEN + 16];
+    void *enc[2], *dec[2], *encmac[2], *decmac[2];
+    int i, j, failed;
+
+    random_fill(key, sizeof(key));
+    random_fill(iv, sizeof(iv));
+
+    for (i = 0; i < 2; i++) {
+	enc[i] = cipher->make_context();
+	test_key(enc[i], cipher->setkey, key, i);
+	cipher->setiv(enc[i], iv);
+	dec[i] = cipher->make_context();
+	test_key(dec[i], cipher->setkey, key, i);
+	cipher->setiv(dec[i], iv);
+	if (mac) {
+	    encmac[i] = mac->make_context(enc[i]);
+	    decmac[i] = mac->make_context(dec[i]);
+	}
+    }
+
+    for (j = 0; j < 3; j++) {
+	random_fill(plain, sizeof(plain));
+	failed = 0;
+
+	for (i = 0; i < 2; i++) {
+	    memcpy(buf[i], plain, LEN);
+	    if (mac) {
+		/* SSH packet layout with the length in the clear */
+		cipher->encrypt(enc[i], buf[i] + 4, LEN - 4);
+		mac->generate(encmac[i], buf[i], LEN, j);
+	    } else
+		cipher->encrypt(enc[i], buf[i] + 4, LEN - 4);
+	}
+	if (memcmp(buf[0], buf[1], mac ? LEN + 16 : LEN))
+	    failed = 1;
+
+	for (i = 0; i < 2 && !failed; i++) {
+	    if (mac) {
+		buf[i][LEN - 1] ^= 1;
+		if (mac->verify(decmac[1 - i], buf[i], LEN, j))
+		    failed = 1;
+		buf[i][LEN - 1] ^= 1;
+		if (!mac->verify(decmac[1 - i], buf[i], LEN, j))
+		    failed = 1;
+		cipher->decrypt(dec[1 - i], buf[i] + 4, LEN - 4);
+	    } else
+		cipher->decrypt(dec[1 - i], buf[i] + 4, LEN - 4);
+	    if (memcmp(buf[i], plain, LEN))
+		failed = 1;
+	}
+
+	if (failed) {
+	    printf("FAIL: %s, packet %d\n", cipher->name, j);
+	    fails++;
+	} else
+	    passes++;
+    }
+
+    for (i = 0; i < 2; i++) {
+	if (mac) {
+	    mac->free_context(encmac[i]);
+	    mac->free_context(decmac[i]);
+	}
+	cipher->free_context(enc[i]);
+	cipher->free_context(dec[i]);
+    }
+}
+
+/* MB/s of encrypting and, if needed, authenticating 32 KiB packets */
+static double benchmark(const struct ssh2_cipher *cipher, int ni)
+{
+    enum { LEN = 32768 };
+    static unsigned char buf[4 + LEN + 16];
+    unsigned char key[32], iv[16];
+    void *ctx, *mac = NULL;
+    clock_t start, elapsed;
+    long bytes = 0;
+
+    random_fill(key, sizeof(key));
+    random_fill(iv, sizeof(iv));
+    random_fill(buf, sizeof(buf));
+
+    ctx = cipher->make_context();
+    test_key(ctx, cipher->setkey, key, ni);
+    cipher->setiv(ctx, iv);
+    if (cipher->required_mac)
+	mac = cipher->required_mac->make_context(ctx);
+
+    start = clock();
+    do {
+	int i;
+	for (i = 0; i < 64; i++) {
+	    if (mac) {
+		cipher->encrypt(ctx, buf + 4, LEN);
+		cipher->required_mac->generate(mac, buf, 4 + LEN, 0);
+	    } else
+		cipher->encrypt(ctx, buf, LEN);
+	}
+	bytes += 64L * LEN;
+	elapsed = clock() - start;
+    } while (elapsed < CLOCKS_PER_SEC / 2);
+
+    cipher->free_context(ctx);
+    return (double)bytes / 1000000 / ((double)elapsed / CLOCKS_PER_SEC);
+}
+
+int main(void)
+{
+    int ni, i, have_ni = 0;
+
+#ifdef AES_NI_AVAILABLE
+    have_ni = aes_ni_supported();
+#endif
+
+    for (ni = 0; ni <= have_ni; ni++) {
+	/* FIPS-197, appendix C */
+	test_block("AES-128", aes128_key, "000102030405060708090a0b0c0d0e0f",
+		   "69c4e0d86a7b0430d8cdb78070b4c55a", ni);
+	test_block("AES-192", aes192_key,
+		   "000102030405060708090a0b0c0d0e0f1011121314151617",
+		   "dda97ca4864cdfe06eaf70a0ec0d7191", ni);
+	test_block("AES-256", aes256_key,
+		   "000102030405060708090a0b0c0d0e0f"
+		   "101112131415161718191a1b1c1d1e1f",
+		   "8ea2b7ca516745bfeafc49904b496089", ni);
+
+	/* The GCM specification, test cases 2, 3, 4, 14 and 16 */
+	test_gcm("GCM 2", aes128_gcm_key, "00000000000000000000000000000000",
+		 "000000000000000000000000",
+		 "00000000000000000000000000000000", "",
+		 "0388dace60b6a392f328c2b971b2fe78",
+		 "ab6e47d42cec13bdf53a67b21257bddf", ni);
+	test_gcm("GCM 3", aes128_gcm_key, "feffe9928665731c6d6a8f9467308308",
+		 "cafebabefacedbaddecaf888",
+		 "d9313225f88406e5a55909c5aff5269a"
+		 "86a7a9531534f7da2e4c303d8a318a72"
+		 "1c3c0c95956809532fcf0e2449a6b525"
+		 "b16aedf5aa0de657ba637b391aafd255", "",
+		 "42831ec2217774244b7221b784d0d49c"
+		 "e3aa212f2c02a4e035c17e2329aca12e"
+		 "21d514b25466931c7d8f6a5aac84aa05"
+		 "1ba30b396a0aac973d58e091473f5985",
+		 "4d5c2af327cd64a62cf35abd2ba6fab4", ni);
+	test_gcm("GCM 4", aes128_gcm_key, "feffe9928665731c6d6a8f9467308308",
+		 "cafebabefacedbaddecaf888",
+		 "d9313225f88406e5a55909c5aff5269a"
+		 "86a7a9531534f7da2e4c303d8a318a72"
+		 "1c3c0c95956809532fcf0e2449a6b525"
+		 "b16aedf5aa0de657ba637b39",
+		 "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+		 "42831ec2217774244b7221b784d0d49c"
+		 "e3aa212f2c02a4e035c17e2329aca12e"
+		 "21d514b25466931c7d8f6a5aac84aa05"
+		 "1ba30b396a0aac973d58e091",
+		 "5bc94fbc3221a5db94fae95ae7121a47", ni);
+	test_gcm("GCM 14", aes256_gcm_key,
+		 "00000000000000000000000000000000"
+		 "00000000000000000000000000000000",
+		 "000000000000000000000000",
+		 "00000000000000000000000000000000", "",
+		 "cea7403d4d606b6e074ec5d3baf39d18",
+		 "d0d1c8a799996bf0265b98b5d48ab919", ni);
+	test_gcm("GCM 16", aes256_gcm_key,
+		 "feffe9928665731c6d6a8f9467308308"
+		 "feffe9928665731c6d6a8f9467308308",
+		 "cafebabefacedbaddecaf888",
+		 "d9313225f88406e5a55909c5aff5269a"
+		 "86a7a9531534f7da2e4c303d8a318a72"
+		 "1c3c0c95956809532fcf0e2449a6b525"
+		 "b16aedf5aa0de657ba637b39",
+		 "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+		 "522dc1f099567d07f47f37a32a84427d"
+		 "643a8cdcbfe5c0c97598a2bd2555d1aa"
+		 "8cb08e48590dbb3da7b08b1056828838"
+		 "c5f61e6393ba7a0abcc9f662",
+		 "76fc6ece0f4e1768cddf8853bb2d551b", ni);
+    }
+
+    if (have_ni) {
+	for (i = 0; i < ssh2_aes.nciphers; i++)
+	    test_cross(ssh2_aes.list[i]);
+    }
+
+    printf("%d passed, %d failed\n", passes, fails);
+    if (fails)
+	return 1;
+
+    printf("\n%-28s %12s %12s\n", "cipher", "portable", "AES-NI");
+    for (i = 0; i < ssh2_aes.nciphers; i++) {
+	const struct ssh2_cipher *cipher = ssh2_aes.list[i];
+	printf("%-28s %7.1f MB/s", cipher->name, benchmark(cipher, 0));
+	if (have_ni)
+	    printf(" %7.1f MB/s", benchmark(cipher, 1));
+	printf("\n");
+    }
+
+    return 0;
+}
+
+#endif
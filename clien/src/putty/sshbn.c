@@ -52,6 +52,21 @@ typedef unsigned __int64 BignumDblInt;
     __asm mov r, edx \
     __asm mov q, eax \
 } while(0)
+#elif defined __GNUC__ && defined __SIZEOF_INT128__
+/* 64-bit architectures with a 128-bit integer type can do 64x64->128
+ * chunks at a time, which quarters the number of multiplications in
+ * Montgomery reduction compared to 32-bit words. */
+typedef unsigned long long BignumInt;
+typedef __uint128_t BignumDblInt;
+#define BIGNUM_INT_MASK  0xFFFFFFFFFFFFFFFFULL
+#define BIGNUM_TOP_BIT   0x8000000000000000ULL
+#define BIGNUM_INT_BITS  64
+#define MUL_WORD(w1, w2) ((BignumDblInt)w1 * w2)
+#define DIVMOD_WORD(q, r, hi, lo, w) do { \
+    BignumDblInt n = (((BignumDblInt)hi) << BIGNUM_INT_BITS) | lo; \
+    q = (BignumInt)(n / w); \
+    r = (BignumInt)(n % w); \
+} while (0)
 #elif defined _LP64
 /* 64-bit architectures can do 32x32->64 chunks at a time */
 typedef unsigned int BignumInt;
@@ -588,17 +603,30 @@ static void monty_reduce(BignumInt *x, const BignumInt *n,
      *  + hence we only need 0 <= x < rn to guarantee that 0 <= mn+x < 2rn
      *  + yielding 0 <= (mn+x)/r < 2n as required.
      */
-    if (!carry) {
+    {
+        /*
+         * Always do the subtraction into the scratch space and pick
+         * the result with a mask, so that neither the timing nor the
+         * memory access pattern depends on whether it was needed.
+         */
+        BignumDblInt borrow = 1;
+        BignumInt mask;
+
+        for (i = len; i-- > 0;) {
+            borrow += (BignumDblInt)x[len + i] + (n[i] ^ BIGNUM_INT_MASK);
+            tmp[i] = (BignumInt)borrow;
+            borrow >>= BIGNUM_INT_BITS;
+        }
+
+        /* t >= n iff the subtraction didn't borrow, or t overflowed r */
+        mask = -(BignumInt)((BignumInt)borrow | carry);
         for (i = 0; i < len; i++)
-            if (x[len + i] != n[i])
-                break;
+            x[len + i] = (tmp[i] & mask) | (x[len + i] & ~mask);
     }
-    if (carry || i >= len || x[len + i] > n[i])
-        internal_sub(x+len, n, x+len, len);
 }
 
 static void internal_add_shifted(BignumInt *number,
-				 unsigned n, int shift)
+				 BignumInt n, int shift)
 {
     int word = 1 + (shift / BIGNUM_INT_BITS);
     int bshift = shift % BIGNUM_INT_BITS;
@@ -629,8 +657,7 @@ static void internal_mod(BignumInt *a, int alen,
 			 BignumInt *m, int mlen,
 			 BignumInt *quot, int qshift)
 {
-    BignumInt m0, m1;
-    unsigned int h;
+    BignumInt m0, m1, h;
     int i, k;
 
     m0 = m[0];
@@ -642,7 +669,7 @@ static void internal_mod(BignumInt *a, int alen,
 
     for (i = 0; i <= alen - mlen; i++) {
 	BignumDblInt t;
-	unsigned int q, r, c, ai1;
+	BignumInt q, r, c, ai1;
 
 	if (i == 0) {
 	    h = 0;
@@ -697,7 +724,7 @@ static void internal_mod(BignumInt *a, int alen,
 	for (k = mlen - 1; k >= 0; k--) {
 	    t = MUL_WORD(q, m[k]);
 	    t += c;
-	    c = (unsigned)(t >> BIGNUM_INT_BITS);
+	    c = (BignumInt)(t >> BIGNUM_INT_BITS);
 	    if ((BignumInt) t > a[i + k])
 		c++;
 	    a[i + k] -= (BignumInt) t;
@@ -780,7 +807,7 @@ Bignum modpow_simple(Bignum base_in, Bignum exp, Bignum mod)
     /* Skip leading zero bits of exp. */
     i = 0;
     j = BIGNUM_INT_BITS-1;
-    while (i < (int)exp[0] && (exp[exp[0] - i] & (1 << j)) == 0) {
+    while (i < (int)exp[0] && (exp[exp[0] - i] & ((BignumInt)1 << j)) == 0) {
 	j--;
 	if (j < 0) {
 	    i++;
@@ -793,7 +820,7 @@ Bignum modpow_simple(Bignum base_in, Bignum exp, Bignum mod)
 	while (j >= 0) {
 	    internal_mul(a + mlen, a + mlen, b, mlen, scratch);
 	    internal_mod(b, mlen * 2, m, mlen, NULL, 0);
-	    if ((exp[exp[0] - i] & (1 << j)) != 0) {
+	    if ((exp[exp[0] - i] & ((BignumInt)1 << j)) != 0) {
 		internal_mul(b + mlen, n, a, mlen, scratch);
 		internal_mod(a, mlen * 2, m, mlen, NULL, 0);
 	    } else {
@@ -842,14 +869,28 @@ Bignum modpow_simple(Bignum base_in, Bignum exp, Bignum mod)
     return result;
 }
 
+/*
+ * Exponents up to this many bits are taken to be public ones, such as
+ * RSA's e, and get plain square-and-multiply. Longer ones are assumed
+ * to be secret and are processed in fixed windows of MODPOW_WINDOW
+ * bits, multiplying by a table entry for every window whether or not
+ * it is zero, and reading the whole table each time, so that neither
+ * the number of multiplications nor the memory access pattern depends
+ * on the exponent bits. With four bit windows that is still only one
+ * multiplication per four squarings, against one per two on average
+ * for square-and-multiply.
+ */
+#define MODPOW_PUBLIC_BITS 64
+#define MODPOW_WINDOW 4
+
 /*
  * Compute (base ^ exp) % mod. Uses the Montgomery multiplication
  * technique where possible, falling back to modpow_simple otherwise.
  */
 Bignum modpow(Bignum base_in, Bignum exp, Bignum mod)
 {
-    BignumInt *a, *b, *x, *n, *mninv, *scratch;
-    int len, scratchlen, i, j;
+    BignumInt *a, *b, *x, *n, *mninv, *scratch, *table, *w, *t;
+    int len, scratchlen, i, j, k, l, window, tablesize, started;
     Bignum base, base2, r, rn, inv, result;
 
     /*
@@ -919,43 +960,79 @@ Bignum modpow(Bignum base_in, Bignum exp, Bignum mod)
 
     a = snewn(2*len, BignumInt);
     b = snewn(2*len, BignumInt);
-    for (j = 0; j < len; j++)
+    for (j = 0; j < len; j++) {
+	a[j] = 0;
 	a[2*len - 1 - j] = (j < (int)rn[0] ? rn[j + 1] : 0);
+    }
     freebn(rn);
 
     /* Scratch space for multiplies */
     scratchlen = 3*len + mul_compute_scratch(len);
     scratch = snewn(scratchlen, BignumInt);
 
-    /* Skip leading zero bits of exp. */
-    i = 0;
-    j = BIGNUM_INT_BITS-1;
-    while (i < (int)exp[0] && (exp[exp[0] - i] & (1 << j)) == 0) {
-	j--;
-	if (j < 0) {
-	    i++;
-	    j = BIGNUM_INT_BITS-1;
-	}
+    /*
+     * Table of x^k for all k below 2^window, still in Montgomery
+     * representation, starting with the Montgomerified 1.
+     */
+    window = bignum_bitcount(exp) <= MODPOW_PUBLIC_BITS ? 1 : MODPOW_WINDOW;
+    tablesize = 1 << window;
+    table = snewn(tablesize * len, BignumInt);
+    w = snewn(len, BignumInt);
+    for (j = 0; j < len; j++) {
+	table[j] = a[len + j];
+	table[len + j] = x[j];
+    }
+    for (k = 2; k < tablesize; k++) {
+	internal_mul(table + (k-1) * len, x, b, len, scratch);
+	monty_reduce(b, n, mninv, scratch, len);
+	for (j = 0; j < len; j++)
+	    table[k * len + j] = b[len + j];
     }
 
-    /* Main computation */
-    while (i < (int)exp[0]) {
-	while (j >= 0) {
-	    internal_mul(a + len, a + len, b, len, scratch);
-            monty_reduce(b, n, mninv, scratch, len);
-	    if ((exp[exp[0] - i] & (1 << j)) != 0) {
-                internal_mul(b + len, x, a, len,  scratch);
-                monty_reduce(a, n, mninv, scratch, len);
+    /*
+     * Main computation, from the most significant window down. Until
+     * the first non-zero window a is still 1, so there's nothing to
+     * square yet; this only reveals the length of the exponent.
+     */
+    started = 0;
+    for (i = exp[0]; i > 0; i--) {
+	for (j = BIGNUM_INT_BITS - window; j >= 0; j -= window) {
+	    int bits = (int)(exp[i] >> j) & (tablesize - 1);
+
+	    if (started) {
+		for (k = 0; k < window; k++) {
+		    internal_mul(a + len, a + len, b, len, scratch);
+		    monty_reduce(b, n, mninv, scratch, len);
+		    t = a;
+		    a = b;
+		    b = t;
+		}
+	    } else if (!bits) {
+		continue;
+	    }
+	    started = 1;
+
+	    if (window == 1) {
+		/* Public exponent, skip the multiplication by 1 */
+		if (!bits)
+		    continue;
+		for (l = 0; l < len; l++)
+		    w[l] = x[l];
 	    } else {
-		BignumInt *t;
-		t = a;
-		a = b;
-		b = t;
+		for (l = 0; l < len; l++)
+		    w[l] = 0;
+		for (k = 0; k < tablesize; k++) {
+		    BignumInt mask = -(BignumInt)(k == bits);
+		    for (l = 0; l < len; l++)
+			w[l] |= table[k * len + l] & mask;
+		}
 	    }
-	    j--;
+	    internal_mul(a + len, w, b, len, scratch);
+	    monty_reduce(b, n, mninv, scratch, len);
+	    t = a;
+	    a = b;
+	    b = t;
 	}
-	i++;
-	j = BIGNUM_INT_BITS-1;
     }
 
     /*
@@ -984,6 +1061,10 @@ Bignum modpow(Bignum base_in, Bignum exp, Bignum mod)
     sfree(n);
     smemclr(x, len * sizeof(*x));
     sfree(x);
+    smemclr(table, tablesize * len * sizeof(*table));
+    sfree(table);
+    smemclr(w, len * sizeof(*w));
+    sfree(w);
 
     return result;
 }
@@ -1225,7 +1306,8 @@ Bignum bignum_from_bytes(const unsigned char *data, int nbytes)
 	result[i] = 0;
     for (i = nbytes; i--;) {
 	unsigned char byte = *data++;
-	result[1 + i / BIGNUM_INT_BYTES] |= byte << (8*i % BIGNUM_INT_BITS);
+	result[1 + i / BIGNUM_INT_BYTES] |=
+            (BignumInt)byte << (8*i % BIGNUM_INT_BITS);
     }
 
     while (result[0] > 1 && result[result[0]] == 0)
@@ -1354,7 +1436,7 @@ void bignum_set_bit(Bignum bn, int bitnum, int value)
 	abort();		       /* beyond the end */
     else {
 	int v = bitnum / BIGNUM_INT_BITS + 1;
-	int mask = 1 << (bitnum % BIGNUM_INT_BITS);
+	BignumInt mask = (BignumInt)1 << (bitnum % BIGNUM_INT_BITS);
 	if (value)
 	    bn[v] |= mask;
 	else
@@ -1433,7 +1515,9 @@ Bignum bignum_rshift(Bignum a, int shift)
 	for (i = 1; i <= (int)ret[0]; i++) {
 	    ai = ai1;
 	    ai1 = (i + shiftw + 1 <= (int)a[0] ? a[i + shiftw + 1] : 0);
-	    ret[i] = ((ai >> shiftb) | (ai1 << shiftbb)) & BIGNUM_INT_MASK;
+	    ret[i] = ai >> shiftb;
+	    if (shiftb)
+		ret[i] |= ai1 << shiftbb;
 	}
     }
 
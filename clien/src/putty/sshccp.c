@@ -0,0 +1,1001 @@
+/*
+ * ChaCha20-Poly1305 implementation for SSH-2
+ *
+ * Protocol spec:
+ *  http://cvsweb.openbsd.org/cgi-bin/cvsweb/src/usr.bin/ssh/PROTOCOL.chacha20poly1305?rev=1.2&content-type=text/x-cvsweb-markup
+ *
+ * ChaCha20 spec:
+ *  http://cr.yp.to/chacha/chacha-20080128.pdf
+ *
+ * Salsa20 spec:
+ *  http://cr.yp.to/snuffle/spec.pdf
+ *
+ * Poly1305-AES spec:
+ *  http://cr.yp.to/mac/poly1305-20050329.pdf
+ *
+ * The SSH cipher takes a 64-byte key. The second half keys the
+ * instance which encrypts the packet length, the first half the one
+ * for the rest of the packet. Both use the sequence number as nonce.
+ * The first 32 bytes of the keystream of the second instance are the
+ * Poly1305 key, the packet itself is encrypted from the second block
+ * on. The MAC covers the encrypted length and the ciphertext.
+ *
+ * The keystream is generated several blocks at a time with SSE2 or
+ * AVX2 where the CPU has them, decided at runtime. Poly1305 uses
+ * 26-bit limbs so that the products fit in 64 bits.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "ssh.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || \
+     (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define CHACHA_SIMD_AVAILABLE
+#define CHACHA_SSE2_FUNC __attribute__((target("sse2")))
+#define CHACHA_AVX2_FUNC __attribute__((target("avx2")))
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(_MSC_VER) && _MSC_VER >= 1700 && \
+    (defined(_M_X64) || defined(_M_IX86))
+#define CHACHA_SIMD_AVAILABLE
+#define CHACHA_SSE2_FUNC
+#define CHACHA_AVX2_FUNC
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER) && _MSC_VER < 1800
+typedef unsigned __int64 poly_u64;
+#else
+typedef unsigned long long poly_u64;
+#endif
+
+/* ChaCha20 */
+
+struct chacha20 {
+    /* Constants, key, 64-bit block counter and 64-bit nonce */
+    word32 state[16];
+    /* Keystream left over from a partially used block */
+    unsigned char current[64];
+    int currentIndex;
+};
+
+#define ROTL32(x, n) ((((x) << (n)) | ((x) >> (32 - (n)))) & 0xffffffff)
+
+#define QUARTERROUND(a, b, c, d) ( \
+    x[a] = (x[a] + x[b]) & 0xffffffff, x[d] = ROTL32(x[d] ^ x[a], 16), \
+    x[c] = (x[c] + x[d]) & 0xffffffff, x[b] = ROTL32(x[b] ^ x[c], 12), \
+    x[a] = (x[a] + x[b]) & 0xffffffff, x[d] = ROTL32(x[d] ^ x[a], 8), \
+    x[c] = (x[c] + x[d]) & 0xffffffff, x[b] = ROTL32(x[b] ^ x[c], 7))
+
+static void chacha20_advance(word32 *state, int blocks)
+{
+    word32 old = state[12];
+    state[12] = (state[12] + blocks) & 0xffffffff;
+    if (state[12] < old)
+	state[13] = (state[13] + 1) & 0xffffffff;
+}
+
+static void chacha20_block(const word32 *state, unsigned char *out)
+{
+    word32 x[16];
+    int i;
+
+    memcpy(x, state, sizeof(x));
+    for (i = 0; i < 10; i++) {
+	QUARTERROUND(0, 4, 8, 12);
+	QUARTERROUND(1, 5, 9, 13);
+	QUARTERROUND(2, 6, 10, 14);
+	QUARTERROUND(3, 7, 11, 15);
+	QUARTERROUND(0, 5, 10, 15);
+	QUARTERROUND(1, 6, 11, 12);
+	QUARTERROUND(2, 7, 8, 13);
+	QUARTERROUND(3, 4, 9, 14);
+    }
+    for (i = 0; i < 16; i++)
+	PUT_32BIT_LSB_FIRST(out + 4 * i, (x[i] + state[i]) & 0xffffffff);
+    smemclr(x, sizeof(x));
+}
+
+/*
+ * XORs the keystream of whole blocks into blk and advances the block
+ * counter. Returns the number of blocks processed, the vectorised
+ * versions leave the blocks not filling a full batch to the others.
+ */
+static int chacha20_xor_portable(word32 *state, unsigned char *blk,
+				 int blocks)
+{
+    unsigned char ks[64];
+    int i, n;
+
+    for (n = 0; n < blocks; n++) {
+	chacha20_block(state, ks);
+	for (i = 0; i < 64; i++)
+	    blk[i] ^= ks[i];
+	chacha20_advance(state, 1);
+	blk += 64;
+    }
+    smemclr(ks, sizeof(ks));
+    return blocks;
+}
+
+#ifdef CHACHA_SIMD_AVAILABLE
+
+/*
+ * The vectorised versions keep the same word of several consecutive
+ * blocks in each register and transpose the result at the end. They
+ * don't handle the carry into the high word of the block counter,
+ * which never happens within an SSH packet anyway.
+ */
+
+static int chacha_simd_level = -1;     /* 0 none, 1 SSE2, 2 AVX2 */
+
+static int chacha_simd_supported(void)
+{
+    if (chacha_simd_level < 0) {
+	unsigned int ecx1, edx1, ebx7 = 0;
+	int xcr0 = 0;
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] >= 7) {
+	    __cpuidex(info, 7, 0);
+	    ebx7 = info[1];
+	}
+	__cpuid(info, 1);
+	ecx1 = info[2];
+	edx1 = info[3];
+	if (ecx1 & (1 << 27))
+	    xcr0 = (int)_xgetbv(0);
+#else
+	unsigned int eax, ebx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx1, &edx1))
+	    ecx1 = edx1 = 0;
+	if (__get_cpuid_max(0, NULL) >= 7) {
+	    unsigned int ecx, edx;
+	    __cpuid_count(7, 0, eax, ebx7, ecx, edx);
+	}
+	if (ecx1 & (1 << 27)) {
+	    unsigned int lo, hi;
+	    __asm__ __volatile__ ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+	    xcr0 = (int)lo;
+	}
+#endif
+	chacha_simd_level = 0;
+	if (edx1 & (1 << 26))
+	    chacha_simd_level = 1;
+	/* AVX2, and the OS saving the YMM registers */
+	if ((ebx7 & (1 << 5)) && (ecx1 & (1 << 28)) && (xcr0 & 6) == 6)
+	    chacha_simd_level = 2;
+    }
+    return chacha_simd_level;
+}
+
+#define SSE2_ROTL(v, n) _mm_or_si128(_mm_slli_epi32(v, n), \
+				     _mm_srli_epi32(v, 32 - (n)))
+#define SSE2_QR(a, b, c, d) do { \
+    a = _mm_add_epi32(a, b); d = SSE2_ROTL(_mm_xor_si128(d, a), 16); \
+    c = _mm_add_epi32(c, d); b = SSE2_ROTL(_mm_xor_si128(b, c), 12); \
+    a = _mm_add_epi32(a, b); d = SSE2_ROTL(_mm_xor_si128(d, a), 8); \
+    c = _mm_add_epi32(c, d); b = SSE2_ROTL(_mm_xor_si128(b, c), 7); \
+} while (0)
+
+/* Transposes four registers of four words each */
+#define SSE2_TRANSPOSE(a, b, c, d) do { \
+    __m128i t0 = _mm_unpacklo_epi32(a, b), t1 = _mm_unpacklo_epi32(c, d); \
+    __m128i t2 = _mm_unpackhi_epi32(a, b), t3 = _mm_unpackhi_epi32(c, d); \
+    a = _mm_unpacklo_epi64(t0, t1); b = _mm_unpackhi_epi64(t0, t1); \
+    c = _mm_unpacklo_epi64(t2, t3); d = _mm_unpackhi_epi64(t2, t3); \
+} while (0)
+
+#define SSE2_XOR_OUT(p, v) \
+    _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), v))
+
+static CHACHA_SSE2_FUNC int chacha20_xor_sse2(word32 *state,
+					      unsigned char *blk, int blocks)
+{
+    __m128i x[16], in[16];
+    int i, n;
+
+    for (n = 0; n + 4 <= blocks; n += 4) {
+	__m128i *p = (__m128i *)blk;
+
+	if (state[12] > 0xffffffff - 4)
+	    break;
+
+	for (i = 0; i < 16; i++)
+	    in[i] = _mm_set1_epi32((int)state[i]);
+	in[12] = _mm_add_epi32(in[12], _mm_set_epi32(3, 2, 1, 0));
+	memcpy(x, in, sizeof(x));
+
+	for (i = 0; i < 10; i++) {
+	    SSE2_QR(x[0], x[4], x[8], x[12]);
+	    SSE2_QR(x[1], x[5], x[9], x[13]);
+	    SSE2_QR(x[2], x[6], x[10], x[14]);
+	    SSE2_QR(x[3], x[7], x[11], x[15]);
+	    SSE2_QR(x[0], x[5], x[10], x[15]);
+	    SSE2_QR(x[1], x[6], x[11], x[12]);
+	    SSE2_QR(x[2], x[7], x[8], x[13]);
+	    SSE2_QR(x[3], x[4], x[9], x[14]);
+	}
+	for (i = 0; i < 16; i++)
+	    x[i] = _mm_add_epi32(x[i], in[i]);
+
+	/* Word group i of block j goes to p[4 * j + i] */
+	for (i = 0; i < 16; i += 4) {
+	    SSE2_TRANSPOSE(x[i], x[i + 1], x[i + 2], x[i + 3]);
+	    SSE2_XOR_OUT(p + i / 4, x[i]);
+	    SSE2_XOR_OUT(p + 4 + i / 4, x[i + 1]);
+	    SSE2_XOR_OUT(p + 8 + i / 4, x[i + 2]);
+	    SSE2_XOR_OUT(p + 12 + i / 4, x[i + 3]);
+	}
+
+	chacha20_advance(state, 4);
+	blk += 4 * 64;
+    }
+
+    return n;
+}
+
+#define AVX2_ROTL(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), \
+					_mm256_srli_epi32(v, 32 - (n)))
+/* Rotations by whole bytes are a single shuffle */
+#define AVX2_QR(a, b, c, d) do { \
+    a = _mm256_add_epi32(a, b); \
+    d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot16); \
+    c = _mm256_add_epi32(c, d); b = AVX2_ROTL(_mm256_xor_si256(b, c), 12); \
+    a = _mm256_add_epi32(a, b); \
+    d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot8); \
+    c = _mm256_add_epi32(c, d); b = AVX2_ROTL(_mm256_xor_si256(b, c), 7); \
+} while (0)
+
+#define AVX2_TRANSPOSE(a, b, c, d) do { \
+    __m256i t0 = _mm256_unpacklo_epi32(a, b); \
+    __m256i t1 = _mm256_unpacklo_epi32(c, d); \
+    __m256i t2 = _mm256_unpackhi_epi32(a, b); \
+    __m256i t3 = _mm256_unpackhi_epi32(c, d); \
+    a = _mm256_unpacklo_epi64(t0, t1); b = _mm256_unpackhi_epi64(t0, t1); \
+    c = _mm256_unpacklo_epi64(t2, t3); d = _mm256_unpackhi_epi64(t2, t3); \
+} while (0)
+
+#define AVX2_XOR_OUT(p, v) \
+    _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), v))
+
+static CHACHA_AVX2_FUNC int chacha20_xor_avx2(word32 *state,
+					      unsigned char *blk, int blocks)
+{
+    __m256i x[16], in[16];
+    const __m256i rot16 = _mm256_set_epi8(
+	13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+	13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+    const __m256i rot8 = _mm256_set_epi8(
+	14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+	14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+    int i, j, n;
+
+    for (n = 0; n + 8 <= blocks; n += 8) {
+	__m256i *p = (__m256i *)blk;
+
+	if (state[12] > 0xffffffff - 8)
+	    break;
+
+	for (i = 0; i < 16; i++)
+	    in[i] = _mm256_set1_epi32((int)state[i]);
+	in[12] = _mm256_add_epi32(in[12],
+				  _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+	memcpy(x, in, sizeof(x));
+
+	for (i = 0; i < 10; i++) {
+	    AVX2_QR(x[0], x[4], x[8], x[12]);
+	    AVX2_QR(x[1], x[5], x[9], x[13]);
+	    AVX2_QR(x[2], x[6], x[10], x[14]);
+	    AVX2_QR(x[3], x[7], x[11], x[15]);
+	    AVX2_QR(x[0], x[5], x[10], x[15]);
+	    AVX2_QR(x[1], x[6], x[11], x[12]);
+	    AVX2_QR(x[2], x[7], x[8], x[13]);
+	    AVX2_QR(x[3], x[4], x[9], x[14]);
+	}
+	for (i = 0; i < 16; i++)
+	    x[i] = _mm256_add_epi32(x[i], in[i]);
+
+	/*
+	 * After transposing, x[i + j] holds word group i / 4 of blocks j
+	 * and j + 4 in its two halves. Pairs of groups make up the 32-byte
+	 * halves of a block.
+	 */
+	for (i = 0; i < 16; i += 4)
+	    AVX2_TRANSPOSE(x[i], x[i + 1], x[i + 2], x[i + 3]);
+	for (j = 0; j < 4; j++) {
+	    AVX2_XOR_OUT(p + 2 * j,
+			 _mm256_permute2x128_si256(x[j], x[4 + j], 0x20));
+	    AVX2_XOR_OUT(p + 2 * j + 1,
+			 _mm256_permute2x128_si256(x[8 + j], x[12 + j], 0x20));
+	    AVX2_XOR_OUT(p + 8 + 2 * j,
+			 _mm256_permute2x128_si256(x[j], x[4 + j], 0x31));
+	    AVX2_XOR_OUT(p + 8 + 2 * j + 1,
+			 _mm256_permute2x128_si256(x[8 + j], x[12 + j], 0x31));
+	}
+
+	chacha20_advance(state, 8);
+	blk += 8 * 64;
+    }
+
+    return n;
+}
+
+#endif /* CHACHA_SIMD_AVAILABLE */
+
+static void chacha20_xor_blocks(word32 *state, unsigned char *blk,
+				int blocks)
+{
+    int done = 0;
+
+#ifdef CHACHA_SIMD_AVAILABLE
+    int level = chacha_simd_supported();
+    if (level >= 2)
+	done += chacha20_xor_avx2(state, blk, blocks);
+    if (level >= 1)
+	done += chacha20_xor_sse2(state, blk + 64 * done, blocks - done);
+#endif
+
+    chacha20_xor_portable(state, blk + 64 * done, blocks - done);
+}
+
+static void chacha20_key(struct chacha20 *ctx, const unsigned char *key)
+{
+    int i;
+
+    /* "expand 32-byte k" */
+    ctx->state[0] = 0x61707865;
+    ctx->state[1] = 0x3320646e;
+    ctx->state[2] = 0x79622d32;
+    ctx->state[3] = 0x6b206574;
+    for (i = 0; i < 8; i++)
+	ctx->state[4 + i] = GET_32BIT_LSB_FIRST(key + 4 * i);
+    ctx->state[12] = ctx->state[13] = 0;
+    ctx->state[14] = ctx->state[15] = 0;
+    ctx->currentIndex = 64;
+}
+
+/* Sets the nonce and starts over at the given block */
+static void chacha20_iv(struct chacha20 *ctx, const unsigned char *iv,
+			word32 counter)
+{
+    ctx->state[12] = counter;
+    ctx->state[13] = 0;
+    ctx->state[14] = GET_32BIT_LSB_FIRST(iv);
+    ctx->state[15] = GET_32BIT_LSB_FIRST(iv + 4);
+    ctx->currentIndex = 64;
+}
+
+static void chacha20_encrypt(struct chacha20 *ctx, unsigned char *blk,
+			     int len)
+{
+    int blocks;
+
+    while (len > 0 && ctx->currentIndex < 64) {
+	*blk++ ^= ctx->current[ctx->currentIndex++];
+	len--;
+    }
+
+    blocks = len / 64;
+    if (blocks) {
+	chacha20_xor_blocks(ctx->state, blk, blocks);
+	blk += 64 * blocks;
+	len -= 64 * blocks;
+    }
+
+    if (len > 0) {
+	chacha20_block(ctx->state, ctx->current);
+	chacha20_advance(ctx->state, 1);
+	ctx->currentIndex = 0;
+	while (len-- > 0)
+	    *blk++ ^= ctx->current[ctx->currentIndex++];
+    }
+}
+
+/* Poly1305 */
+
+struct poly1305 {
+    word32 r[5], h[5], pad[4];
+    unsigned char buffer[16];
+    int bufferIndex;
+};
+
+static void poly1305_key(struct poly1305 *ctx, const unsigned char *key)
+{
+    /* r is clamped as the spec requires */
+    ctx->r[0] = GET_32BIT_LSB_FIRST(key) & 0x3ffffff;
+    ctx->r[1] = (GET_32BIT_LSB_FIRST(key + 3) >> 2) & 0x3ffff03;
+    ctx->r[2] = (GET_32BIT_LSB_FIRST(key + 6) >> 4) & 0x3ffc0ff;
+    ctx->r[3] = (GET_32BIT_LSB_FIRST(key + 9) >> 6) & 0x3f03fff;
+    ctx->r[4] = (GET_32BIT_LSB_FIRST(key + 12) >> 8) & 0x00fffff;
+
+    memset(ctx->h, 0, sizeof(ctx->h));
+
+    ctx->pad[0] = GET_32BIT_LSB_FIRST(key + 16);
+    ctx->pad[1] = GET_32BIT_LSB_FIRST(key + 20);
+    ctx->pad[2] = GET_32BIT_LSB_FIRST(key + 24);
+    ctx->pad[3] = GET_32BIT_LSB_FIRST(key + 28);
+
+    ctx->bufferIndex = 0;
+}
+
+/* h = (h + m) * r mod 2^130 - 5, for each 16-byte block m */
+static void poly1305_blocks(struct poly1305 *ctx, const unsigned char *m,
+			    int len, word32 hibit)
+{
+    const word32 r0 = ctx->r[0], r1 = ctx->r[1], r2 = ctx->r[2],
+	r3 = ctx->r[3], r4 = ctx->r[4];
+    const word32 s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    word32 h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2],
+	h3 = ctx->h[3], h4 = ctx->h[4];
+    poly_u64 d0, d1, d2, d3, d4;
+    word32 c;
+
+    while (len >= 16) {
+	h0 += GET_32BIT_LSB_FIRST(m) & 0x3ffffff;
+	h1 += (GET_32BIT_LSB_FIRST(m + 3) >> 2) & 0x3ffffff;
+	h2 += (GET_32BIT_LSB_FIRST(m + 6) >> 4) & 0x3ffffff;
+	h3 += (GET_32BIT_LSB_FIRST(m + 9) >> 6) & 0x3ffffff;
+	h4 += (GET_32BIT_LSB_FIRST(m + 12) >> 8) | hibit;
+
+	d0 = (poly_u64)h0 * r0 + (poly_u64)h1 * s4 + (poly_u64)h2 * s3 +
+	    (poly_u64)h3 * s2 + (poly_u64)h4 * s1;
+	d1 = (poly_u64)h0 * r1 + (poly_u64)h1 * r0 + (poly_u64)h2 * s4 +
+	    (poly_u64)h3 * s3 + (poly_u64)h4 * s2;
+	d2 = (poly_u64)h0 * r2 + (poly_u64)h1 * r1 + (poly_u64)h2 * r0 +
+	    (poly_u64)h3 * s4 + (poly_u64)h4 * s3;
+	d3 = (poly_u64)h0 * r3 + (poly_u64)h1 * r2 + (poly_u64)h2 * r1 +
+	    (poly_u64)h3 * r0 + (poly_u64)h4 * s4;
+	d4 = (poly_u64)h0 * r4 + (poly_u64)h1 * r3 + (poly_u64)h2 * r2 +
+	    (poly_u64)h3 * r1 + (poly_u64)h4 * r0;
+
+	c = (word32)(d0 >> 26); h0 = (word32)d0 & 0x3ffffff;
+	d1 += c; c = (word32)(d1 >> 26); h1 = (word32)d1 & 0x3ffffff;
+	d2 += c; c = (word32)(d2 >> 26); h2 = (word32)d2 & 0x3ffffff;
+	d3 += c; c = (word32)(d3 >> 26); h3 = (word32)d3 & 0x3ffffff;
+	d4 += c; c = (word32)(d4 >> 26); h4 = (word32)d4 & 0x3ffffff;
+	h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+	h1 += c;
+
+	m += 16;
+	len -= 16;
+    }
+
+    ctx->h[0] = h0;
+    ctx->h[1] = h1;
+    ctx->h[2] = h2;
+    ctx->h[3] = h3;
+    ctx->h[4] = h4;
+}
+
+static void poly1305_feed(struct poly1305 *ctx, const unsigned char *buf,
+			  int len)
+{
+    int n;
+
+    if (ctx->bufferIndex) {
+	n = 16 - ctx->bufferIndex;
+	if (n > len)
+	    n = len;
+	memcpy(ctx->buffer + ctx->bufferIndex, buf, n);
+	ctx->bufferIndex += n;
+	buf += n;
+	len -= n;
+	if (ctx->bufferIndex < 16)
+	    return;
+	poly1305_blocks(ctx, ctx->buffer, 16, 1 << 24);
+	ctx->bufferIndex = 0;
+    }
+
+    n = len & ~15;
+    poly1305_blocks(ctx, buf, n, 1 << 24);
+    memcpy(ctx->buffer, buf + n, len - n);
+    ctx->bufferIndex = len - n;
+}
+
+static void poly1305_finalise(struct poly1305 *ctx, unsigned char *mac)
+{
+    word32 h0, h1, h2, h3, h4, c, g0, g1, g2, g3, g4, mask;
+    poly_u64 f;
+
+    if (ctx->bufferIndex) {
+	/* The final partial block gets a one appended, not 2^128 */
+	ctx->buffer[ctx->bufferIndex] = 1;
+	memset(ctx->buffer + ctx->bufferIndex + 1, 0,
+	       15 - ctx->bufferIndex);
+	poly1305_blocks(ctx, ctx->buffer, 16, 0);
+    }
+
+    h0 = ctx->h[0]; h1 = ctx->h[1]; h2 = ctx->h[2];
+    h3 = ctx->h[3]; h4 = ctx->h[4];
+
+    c = h1 >> 26; h1 &= 0x3ffffff;
+    h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+    h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+    h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+
+    /* Subtract p if h >= p, without branching */
+    g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    g4 = (h4 + c - (1 << 26)) & 0xffffffff;
+
+    mask = ((g4 >> 31) - 1) & 0xffffffff;
+    g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+    mask = ~mask & 0xffffffff;
+    h0 = (h0 & mask) | g0;
+    h1 = (h1 & mask) | g1;
+    h2 = (h2 & mask) | g2;
+    h3 = (h3 & mask) | g3;
+    h4 = (h4 & mask) | g4;
+
+    h0 = (h0 | (h1 << 26)) & 0xffffffff;
+    h1 = ((h1 >> 6) | (h2 << 20)) & 0xffffffff;
+    h2 = ((h2 >> 12) | (h3 << 14)) & 0xffffffff;
+    h3 = ((h3 >> 18) | (h4 << 8)) & 0xffffffff;
+
+    /* Add the encrypted nonce, modulo 2^128 */
+    f = (poly_u64)h0 + ctx->pad[0];
+    PUT_32BIT_LSB_FIRST(mac, (word32)f);
+    f = (poly_u64)h1 + ctx->pad[1] + (f >> 32);
+    PUT_32BIT_LSB_FIRST(mac + 4, (word32)f);
+    f = (poly_u64)h2 + ctx->pad[2] + (f >> 32);
+    PUT_32BIT_LSB_FIRST(mac + 8, (word32)f);
+    f = (poly_u64)h3 + ctx->pad[3] + (f >> 32);
+    PUT_32BIT_LSB_FIRST(mac + 12, (word32)f);
+
+    smemclr(ctx, sizeof(*ctx));
+}
+
+/* SSH-2 wrapper */
+
+struct ccp_context {
+    struct chacha20 a_cipher;	       /* Used for the length */
+    struct chacha20 b_cipher;	       /* Used for everything else */
+    struct poly1305 mac;
+};
+
+static void *ccp_make_context(void)
+{
+    struct ccp_context *ctx = snew(struct ccp_context);
+    memset(ctx, 0, sizeof(*ctx));
+    return ctx;
+}
+
+static void ccp_free_context(void *vctx)
+{
+    struct ccp_context *ctx = (struct ccp_context *)vctx;
+    smemclr(ctx, sizeof(*ctx));
+    sfree(ctx);
+}
+
+static void ccp_iv(void *vctx, unsigned char *iv)
+{
+    /* The nonce is the sequence number, nothing to do here */
+}
+
+static void ccp_key(void *vctx, unsigned char *key)
+{
+    struct ccp_context *ctx = (struct ccp_context *)vctx;
+    chacha20_key(&ctx->a_cipher, key + 32);
+    chacha20_key(&ctx->b_cipher, key);
+}
+
+static void ccp_encrypt(void *vctx, unsigned char *blk, int len)
+{
+    struct ccp_context *ctx = (struct ccp_context *)vctx;
+    chacha20_encrypt(&ctx->b_cipher, blk, len);
+}
+
+/*
+ * Starts a packet: Sets the nonce of both instances and derives the
+ * Poly1305 key from block 0, the packet body starts at block 1.
+ */
+static void ccp_start_packet(struct ccp_context *ctx, unsigned long seq)
+{
+    unsigned char iv[8], polykey[64];
+
+    PUT_32BIT_MSB_FIRST(iv, 0);
+    PUT_32BIT_MSB_FIRST(iv + 4, seq);
+    chacha20_iv(&ctx->a_cipher, iv, 0);
+    chacha20_iv(&ctx->b_cipher, iv, 0);
+
+    memset(polykey, 0, sizeof(polykey));
+    chacha20_encrypt(&ctx->b_cipher, polykey, sizeof(polykey));
+    poly1305_key(&ctx->mac, polykey);
+    smemclr(polykey, sizeof(polykey));
+}
+
+static void ccp_length_op(void *vctx, unsigned char *blk, int len,
+			  unsigned long seq)
+{
+    struct ccp_context *ctx = (struct ccp_context *)vctx;
+    ccp_start_packet(ctx, seq);
+    chacha20_encrypt(&ctx->a_cipher, blk, len);
+}
+
+/* The Poly1305 MAC shares its state with the cipher */
+static void *poly_make_context(void *cipher_ctx)
+{
+    return cipher_ctx;
+}
+
+static void poly_free_context(void *vctx)
+{
+}
+
+static void poly_setkey(void *vctx, unsigned char *key)
+{
+}
+
+static void poly_generate(void *vctx, unsigned char *blk, int len,
+			  unsigned long seq)
+{
+    struct ccp_context *ctx = (struct ccp_context *)vctx;
+    poly1305_feed(&ctx->mac, blk, len);
+    poly1305_finalise(&ctx->mac, blk + len);
+}
+
+static int poly_verify(void *vctx, unsigned char *blk, int len,
+		       unsigned long seq)
+{
+    struct ccp_context *ctx = (struct ccp_context *)vctx;
+    unsigned char correct[16], diff = 0;
+    int i;
+
+    poly1305_feed(&ctx->mac, blk, len);
+    poly1305_finalise(&ctx->mac, correct);
+    for (i = 0; i < 16; i++)
+	diff |= correct[i] ^ blk[len + i];
+    smemclr(correct, sizeof(correct));
+    return diff == 0;
+}
+
+/*
+ * Never negotiated, chacha20-poly1305 implies it. Setting etm_name
+ * selects the packet layout which authenticates the ciphertext.
+ */
+static const struct ssh_mac ssh2_poly1305 = {
+    poly_make_context, poly_free_context, poly_setkey,
+    poly_generate, poly_verify,
+    NULL, NULL, NULL, NULL,
+    NULL, "poly1305@openssh.com",
+    16,
+    "Poly1305"
+};
+
+static const struct ssh2_cipher ssh2_chacha20_poly1305 = {
+    ccp_make_context, ccp_free_context, ccp_iv, ccp_key,
+    ccp_encrypt, ccp_encrypt,
+    "chacha20-poly1305@openssh.com",
+    1, 512, SSH_CIPHER_SEPARATE_LENGTH, "ChaCha20",
+    &ssh2_poly1305, ccp_length_op, ccp_length_op
+};
+
+static const struct ssh2_cipher *const ccp_list[] = {
+    &ssh2_chacha20_poly1305
+};
+
+const struct ssh2_ciphers ssh2_ccp = {
+    sizeof(ccp_list) / sizeof(*ccp_list),
+    ccp_list
+};
+
+#ifdef TESTCCP
+
+/*
+ * Known-answer tests and a loopback transfer through the SSH packet
+ * layer, each vectorised keystream against the portable one:
+ *
+ * gcc -O2 -DTESTCCP -o fzccptest sshccp.c misc.c conf.c tree234.c unix/uxmisc.c -I. -I unix
+ *
+ * or `make fzccptest'.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+void modalfatalbox(char *p, ...)
+{
+    va_list ap;
+    fprintf(stderr, "FATAL ERROR: ");
+    va_start(ap, p);
+    vfprintf(stderr, p, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static int passes, fails;
+
+static void unhex(unsigned char *out, const char *hex)
+{
+    unsigned int b;
+    while (*hex) {
+	sscanf(hex, "%2x", &b);
+	*out++ = (unsigned char)b;
+	hex += 2;
+    }
+}
+
+static void check(const char *what, const unsigned char *got,
+		  const char *expected_hex)
+{
+    unsigned char expected[256];
+    int len = strlen(expected_hex) / 2;
+
+    unhex(expected, expected_hex);
+    if (memcmp(got, expected, len)) {
+	printf("FAIL: %s\n", what);
+	fails++;
+    } else
+	passes++;
+}
+
+static void set_simd_level(int level)
+{
+#ifdef CHACHA_SIMD_AVAILABLE
+    chacha_simd_level = level;
+#endif
+}
+
+static int max_simd_level(void)
+{
+#ifdef CHACHA_SIMD_AVAILABLE
+    chacha_simd_level = -1;
+    return chacha_simd_supported();
+#else
+    return 0;
+#endif
+}
+
+static void test_chacha20(const char *name, const char *key_hex,
+			  const char *iv_hex, word32 counter,
+			  const char *plain, const char *expected_hex)
+{
+    struct chacha20 ctx;
+    unsigned char key[32], iv[8], buf[256];
+    int len = strlen(expected_hex) / 2, split;
+
+    unhex(key, key_hex);
+    unhex(iv, iv_hex);
+
+    /* In one go, then in pieces to exercise the partial blocks */
+    for (split = 0; split <= 1; split++) {
+	memset(buf, 0, sizeof(buf));
+	if (plain)
+	    memcpy(buf, plain, len);
+	chacha20_key(&ctx, key);
+	chacha20_iv(&ctx, iv, counter);
+	if (split) {
+	    chacha20_encrypt(&ctx, buf, 7);
+	    chacha20_encrypt(&ctx, buf + 7, 64);
+	    chacha20_encrypt(&ctx, buf + 71, len - 71);
+	} else
+	    chacha20_encrypt(&ctx, buf, len);
+	check(name, buf, expected_hex);
+    }
+}
+
+static void test_poly1305(const char *name, const char *key_hex,
+			  const char *msg, const char *expected_hex)
+{
+    struct poly1305 ctx;
+    unsigned char key[32], mac[16];
+
+    unhex(key, key_hex);
+    poly1305_key(&ctx, key);
+    poly1305_feed(&ctx, (const unsigned char *)msg, 5);
+    poly1305_feed(&ctx, (const unsigned char *)msg + 5, strlen(msg) - 5);
+    poly1305_finalise(&ctx, mac);
+    check(name, mac, expected_hex);
+}
+
+static unsigned long rng_state = 1;
+
+static void random_fill(unsigned char *buf, int len)
+{
+    while (len-- > 0) {
+	rng_state = rng_state * 1103515245 + 12345;
+	*buf++ = (unsigned char)(rng_state >> 16);
+    }
+}
+
+/*
+ * Sends data through the cipher the way ssh2_pkt_construct() and
+ * ssh2_rdpkt() do, with the sender and receiver using the given
+ * keystream implementations. Returns the number of bad packets.
+ */
+static int loopback(int sender_level, int receiver_level, int total)
+{
+    const struct ssh2_cipher *cipher = &ssh2_chacha20_poly1305;
+    const struct ssh_mac *mac = cipher->required_mac;
+    unsigned char key[64], *data, *received, *pkt;
+    void *tx, *rx, *txmac, *rxmac;
+    unsigned long seq = 0;
+    int sent = 0, bad = 0;
+
+    data = snewn(total, unsigned char);
+    received = snewn(total, unsigned char);
+    pkt = snewn(5 + 35000 + 255 + 16, unsigned char);
+    random_fill(key, sizeof(key));
+    random_fill(data, total);
+
+    tx = cipher->make_context();
+    rx = cipher->make_context();
+    cipher->setkey(tx, key);
+    cipher->setkey(rx, key);
+    txmac = mac->make_context(tx);
+    rxmac = mac->make_context(rx);
+
+    while (sent < total) {
+	unsigned char len[4];
+	int payload, padding, i;
+
+	random_fill(len, 2);
+	payload = (GET_16BIT_MSB_FIRST(len) % 32768) + 1;
+	if (payload > total - sent)
+	    payload = total - sent;
+	padding = 4 + (8 - (1 + payload + 4) % 8) % 8;
+
+	/* Sender */
+	set_simd_level(sender_level);
+	PUT_32BIT(pkt, 1 + payload + padding);
+	pkt[4] = padding;
+	memcpy(pkt + 5, data + sent, payload);
+	memset(pkt + 5 + payload, 0, padding);
+	cipher->encrypt_length(tx, pkt, 4, seq);
+	cipher->encrypt(tx, pkt + 4, 1 + payload + padding);
+	mac->generate(txmac, pkt, 5 + payload + padding, seq);
+
+	/* Receiver */
+	set_simd_level(receiver_level);
+	memcpy(len, pkt, 4);
+	cipher->decrypt_length(rx, len, 4, seq);
+	if (toint(GET_32BIT(len)) != 1 + payload + padding ||
+	    !mac->verify(rxmac, pkt, 5 + payload + padding, seq)) {
+	    bad++;
+	    break;
+	}
+	cipher->decrypt(rx, pkt + 4, 1 + payload + padding);
+	memcpy(received + sent, pkt + 5, payload);
+
+	/* Every so often, check a forgery gets caught */
+	if (seq % 16 == 0) {
+	    i = (int)(rng_state % (5 + payload + padding));
+	    cipher->encrypt_length(tx, pkt, 4, seq);
+	    cipher->encrypt(tx, pkt + 4, 1 + payload + padding);
+	    mac->generate(txmac, pkt, 5 + payload + padding, seq);
+	    pkt[i] ^= 0x40;
+	    memcpy(len, pkt, 4);
+	    cipher->decrypt_length(rx, len, 4, seq);
+	    if (mac->verify(rxmac, pkt, 5 + payload + padding, seq))
+		bad++;
+	}
+
+	sent += payload;
+	seq++;
+    }
+
+    if (memcmp(data, received, total))
+	bad++;
+
+    cipher->free_context(tx);
+    cipher->free_context(rx);
+    sfree(data);
+    sfree(received);
+    sfree(pkt);
+    return bad;
+}
+
+static double benchmark(int level)
+{
+    enum { LEN = 32768 };
+    static unsigned char buf[4 + LEN + 16];
+    const struct ssh2_cipher *cipher = &ssh2_chacha20_poly1305;
+    unsigned char key[64];
+    void *ctx, *mac;
+    clock_t start, elapsed;
+    long bytes = 0;
+    unsigned long seq = 0;
+
+    set_simd_level(level);
+    random_fill(key, sizeof(key));
+    ctx = cipher->make_context();
+    cipher->setkey(ctx, key);
+    mac = cipher->required_mac->make_context(ctx);
+
+    start = clock();
+    do {
+	int i;
+	for (i = 0; i < 64; i++) {
+	    PUT_32BIT(buf, LEN);
+	    cipher->encrypt_length(ctx, buf, 4, seq);
+	    cipher->encrypt(ctx, buf + 4, LEN);
+	    cipher->required_mac->generate(mac, buf, 4 + LEN, seq++);
+	}
+	bytes += 64L * LEN;
+	elapsed = clock() - start;
+    } while (elapsed < CLOCKS_PER_SEC / 2);
+
+    cipher->free_context(ctx);
+    return (double)bytes / 1000000 / ((double)elapsed / CLOCKS_PER_SEC);
+}
+
+int main(void)
+{
+    static const char *const level_names[] = { "portable", "SSE2", "AVX2" };
+    const char *const key0 =
+	"0000000000000000000000000000000000000000000000000000000000000000";
+    const char *const key1 =
+	"000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f";
+    const char *const sunscreen =
+	"Ladies and Gentlemen of the class of '99: If I could offer you "
+	"only one tip for the future, sunscreen would be it.";
+    int level, max_level = max_simd_level(), sender, receiver;
+
+    for (level = 0; level <= max_level; level++) {
+	set_simd_level(level);
+
+	/* RFC 7539, appendix A.1 test vectors 1 and 2 */
+	test_chacha20("ChaCha20 A.1 #1", key0, "0000000000000000", 0, NULL,
+		      "76b8e0ada0f13d90405d6ae55386bd28"
+		      "bdd219b8a08ded1aa836efcc8b770dc7"
+		      "da41597c5157488d7724e03fb8d84a37"
+		      "6a43b8f41518a11cc387b669b2ee6586"
+		      "9f07e7be5551387a98ba977c732d080d"
+		      "cb0f29a048e3656912c6533e32ee7aed"
+		      "29b721769ce64e43d57133b074d839d5"
+		      "31ed1f28510afb45ace10a1f4b794d6f");
+	/* RFC 7539, section 2.4.2, with its 96-bit nonce in our layout */
+	test_chacha20("ChaCha20 2.4.2", key1, "0000004a00000000", 1,
+		      sunscreen,
+		      "6e2e359a2568f98041ba0728dd0d6981"
+		      "e97e7aec1d4360c20a27afccfd9fae0b"
+		      "f91b65c5524733ab8f593dabcd62b357"
+		      "1639d624e65152ab8f530c359f0861d8"
+		      "07ca0dbf500d6a6156a38e088a22b65e"
+		      "52bc514d16ccf806818ce91ab7793736"
+		      "5af90bbf74a35be6b40b8eedf2785e42"
+		      "874d");
+
+	/* RFC 7539, section 2.5.2 */
+	test_poly1305("Poly1305 2.5.2",
+		      "85d6be7857556d337f4452fe42d506a8"
+		      "0103808afb0db2fd4abff6af4149f51b",
+		      "Cryptographic Forum Research Group",
+		      "a8061dc1305136c6c22b8baf0c0127a9");
+    }
+
+    for (sender = 0; sender <= max_level; sender++) {
+	for (receiver = 0; receiver <= max_level; receiver++) {
+	    if (loopback(sender, receiver, 4 * 1024 * 1024)) {
+		printf("FAIL: loopback from %s to %s\n",
+		       level_names[sender], level_names[receiver]);
+		fails++;
+	    } else
+		passes++;
+	}
+    }
+
+    printf("%d passed, %d failed\n", passes, fails);
+    if (fails)
+	return 1;
+
+    printf("\n%-30s", "chacha20-poly1305@openssh.com");
+    for (level = 0; level <= max_level; level++)
+	printf(" %s %.1f MB/s", level_names[level], benchmark(level));
+    printf("\n");
+
+    return 0;
+}
+
+#endif
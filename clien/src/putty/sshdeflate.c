@@ -0,0 +1,489 @@
+/*
+ * Zlib (RFC1950 / RFC1951) compression for SSH using the zlib
+ * library.
+ *
+ * This is a drop-in replacement for the compressor in sshzlib.c,
+ * used whenever the zlib library is available. It negotiates the
+ * same names, but produces dynamic Huffman blocks and searches
+ * matches properly, so it compresses better and faster than the
+ * static-tree compressor at every level but the very lowest.
+ *
+ * Every packet is terminated with a partial flush, like OpenSSH
+ * does, so that the peer can decompress each packet in full as soon
+ * as it arrives while the LZ77 window carries over from one packet
+ * to the next.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "putty.h"
+#include "ssh.h"
+
+#ifdef HAVE_ZLIB
+
+#include <zlib.h>
+
+/*
+ * Output buffers start at the input size plus a bit and grow as
+ * needed. The decompression side has no upper limit of its own, the
+ * packet layer rejects oversized payloads.
+ */
+#define DEFLATE_SLACK 64
+
+struct deflate_ctx {
+    z_stream s;
+    int level;
+    int comp_disabled;
+};
+
+static voidpf deflate_zalloc(voidpf opaque, uInt items, uInt size)
+{
+    return smalloc((size_t)items * size);
+}
+
+static void deflate_zfree(voidpf opaque, voidpf address)
+{
+    sfree(address);
+}
+
+static void *deflate_compress_init(int level)
+{
+    struct deflate_ctx *ctx = snew(struct deflate_ctx);
+
+    if (level < 1 || level > 9)
+	level = Z_DEFAULT_COMPRESSION;
+
+    memset(&ctx->s, 0, sizeof(ctx->s));
+    ctx->s.zalloc = deflate_zalloc;
+    ctx->s.zfree = deflate_zfree;
+    ctx->level = level;
+    ctx->comp_disabled = FALSE;
+
+    if (deflateInit(&ctx->s, level) != Z_OK)
+	fatalbox("Could not initialise zlib compression");
+
+    return ctx;
+}
+
+static void deflate_compress_cleanup(void *handle)
+{
+    struct deflate_ctx *ctx = (struct deflate_ctx *)handle;
+    deflateEnd(&ctx->s);
+    sfree(ctx);
+}
+
+/*
+ * Send the next block uncompressed, so that an IGNORE packet comes
+ * out at the length we want for it. This costs the stored block
+ * header, the byte the partial flush ends on, and the zlib header if
+ * nothing has been compressed yet.
+ */
+static int deflate_disable_compression(void *handle)
+{
+    struct deflate_ctx *ctx = (struct deflate_ctx *)handle;
+    int n;
+
+    ctx->comp_disabled = TRUE;
+
+    n = ctx->s.total_out ? 0 : 2;
+    n += 6;
+
+    return n;
+}
+
+static int deflate_compress_block(void *handle, unsigned char *block,
+				  int len, unsigned char **outblock,
+				  int *outlen)
+{
+    struct deflate_ctx *ctx = (struct deflate_ctx *)handle;
+    unsigned char *out;
+    int outsize, ret;
+
+    outsize = len + len / 1000 + DEFLATE_SLACK;
+    out = snewn(outsize, unsigned char);
+
+    ctx->s.next_out = out;
+    ctx->s.avail_out = outsize;
+
+    /*
+     * Switching levels flushes what the stream holds, so there must be
+     * room for that, but the new block must not be fed in yet.
+     */
+    if (ctx->comp_disabled)
+	deflateParams(&ctx->s, Z_NO_COMPRESSION, Z_DEFAULT_STRATEGY);
+
+    ctx->s.next_in = block;
+    ctx->s.avail_in = len;
+
+    while (1) {
+	ret = deflate(&ctx->s, Z_PARTIAL_FLUSH);
+	assert(ret == Z_OK || ret == Z_BUF_ERROR);
+	if (ctx->s.avail_out)
+	    break;
+
+	/* deflate filled the buffer, it might have more to say */
+	out = sresize(out, outsize * 2, unsigned char);
+	ctx->s.next_out = out + outsize;
+	ctx->s.avail_out = outsize;
+	outsize *= 2;
+    }
+
+    if (ctx->comp_disabled) {
+	deflateParams(&ctx->s, ctx->level, Z_DEFAULT_STRATEGY);
+	ctx->comp_disabled = FALSE;
+    }
+
+    *outblock = out;
+    *outlen = outsize - ctx->s.avail_out;
+    return 1;
+}
+
+static void *deflate_decompress_init(void)
+{
+    z_stream *s = snew(z_stream);
+
+    memset(s, 0, sizeof(*s));
+    s->zalloc = deflate_zalloc;
+    s->zfree = deflate_zfree;
+
+    if (inflateInit(s) != Z_OK)
+	fatalbox("Could not initialise zlib decompression");
+
+    return s;
+}
+
+static void deflate_decompress_cleanup(void *handle)
+{
+    z_stream *s = (z_stream *)handle;
+    inflateEnd(s);
+    sfree(s);
+}
+
+static int deflate_decompress_block(void *handle, unsigned char *block,
+				    int len, unsigned char **outblock,
+				    int *outlen)
+{
+    z_stream *s = (z_stream *)handle;
+    unsigned char *out;
+    int outsize, used, ret;
+
+    outsize = len * 4 + DEFLATE_SLACK;
+    out = snewn(outsize, unsigned char);
+    used = 0;
+
+    s->next_in = block;
+    s->avail_in = len;
+
+    while (1) {
+	s->next_out = out + used;
+	s->avail_out = outsize - used;
+	ret = inflate(s, Z_SYNC_FLUSH);
+	used = outsize - s->avail_out;
+
+	if (ret != Z_OK && ret != Z_BUF_ERROR) {
+	    /* Z_STREAM_END included, SSH never ends the stream */
+	    sfree(out);
+	    *outblock = NULL;
+	    *outlen = 0;
+	    return 0;
+	}
+	if (s->avail_out)
+	    break;
+
+	outsize *= 2;
+	out = sresize(out, outsize, unsigned char);
+    }
+
+    if (s->avail_in) {
+	/* Input left over with room to spare means inflate is stuck */
+	sfree(out);
+	*outblock = NULL;
+	*outlen = 0;
+	return 0;
+    }
+
+    *outblock = out;
+    *outlen = used;
+    return 1;
+}
+
+const struct ssh_compress ssh_zlib_deflate = {
+    "zlib",
+    "zlib@openssh.com", /* delayed version */
+    deflate_compress_init,
+    deflate_compress_cleanup,
+    deflate_compress_block,
+    deflate_decompress_init,
+    deflate_decompress_cleanup,
+    deflate_decompress_block,
+    deflate_disable_compression,
+    "zlib (RFC1950) using zlib " ZLIB_VERSION
+};
+
+#ifdef TESTZLIB
+
+/*
+ * Interoperability with the compressor in sshzlib.c in both
+ * directions, and a comparison of the two on directory listings and
+ * source text sent as SSH packets:
+ *
+ * gcc -O2 -DHAVE_ZLIB -DTESTZLIB -o fzzlibbench sshdeflate.c sshzlib.c misc.c conf.c tree234.c unix/uxmisc.c -I. -I unix -lz
+ *
+ * or `make fzzlibbench'.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+void modalfatalbox(char *p, ...)
+{
+    va_list ap;
+    fprintf(stderr, "FATAL ERROR: ");
+    va_start(ap, p);
+    vfprintf(stderr, p, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+void fatalbox(char *p, ...)
+{
+    va_list ap;
+    fprintf(stderr, "FATAL ERROR: ");
+    va_start(ap, p);
+    vfprintf(stderr, p, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+extern const struct ssh_compress ssh_zlib;
+
+static int passes, fails;
+
+#define PACKET_SIZE 32768
+
+/* A long `ls -l' style listing, as sent in SSH_FXP_NAME replies */
+static unsigned char *make_listing(int *len)
+{
+    static const char *const names[] = {
+	"report", "IMG_", "backup-", "index", "notes", "invoice_", "data"
+    };
+    static const char *const exts[] = {
+	".txt", ".jpg", ".tar.gz", ".html", ".md", ".pdf", ".csv"
+    };
+    static const char *const months[] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep"
+    };
+    int size = 4 << 20, used = 0, i = 0;
+    unsigned char *buf = snewn(size + 256, unsigned char);
+    unsigned long r = 12345;
+
+    while (used < size) {
+	r = r * 1103515245 + 12345;
+	used += sprintf((char *)buf + used,
+			"-rw-r--r--    1 user     group    %10lu %s %2lu %02lu:%02lu"
+			" %s%04d%s\n", (r >> 8) % 100000000,
+			months[(r >> 4) % 9], (r >> 12) % 28 + 1,
+			(r >> 16) % 24, (r >> 20) % 60,
+			names[i % 7], i, exts[(r >> 24) % 7]);
+	i++;
+    }
+    *len = size;
+    return buf;
+}
+
+/* Roughly like C source: indented, repetitive, but not too much */
+static unsigned char *make_text(int *len)
+{
+    static const char *const words[] = {
+	"if", "(ctx->s.avail_out)", "return", "int", "len", "=", "0;",
+	"while", "{", "}", "sfree(out);", "struct", "ssh_compress",
+	"*handle;", "for", "(i", "i++)", "unsigned", "char", "NULL;"
+    };
+    int size = 4 << 20, used = 0, col = 0, n;
+    unsigned char *buf = snewn(size + 64, unsigned char);
+    unsigned long r = 54321;
+
+    while (used < size) {
+	r = r * 1103515245 + 12345;
+	if (!col) {
+	    int indent = (r >> 8) % 3;
+	    while (indent--)
+		buf[used++] = '\t';
+	}
+	n = sprintf((char *)buf + used, "%s ", words[(r >> 12) % 20]);
+	used += n;
+	col += n;
+	if (col > 60 || !((r >> 20) % 7)) {
+	    buf[used++] = '\n';
+	    col = 0;
+	}
+    }
+    *len = size;
+    return buf;
+}
+
+/*
+ * Sends the data through the compressor one packet at a time and
+ * each packet through the decompressor straight away, as the SSH
+ * packet layer does, checking that every packet comes out whole.
+ */
+static int loopback(const struct ssh_compress *comp,
+		    const struct ssh_compress *decomp, int level,
+		    const unsigned char *data, int len, int *complen)
+{
+    void *c = comp->compress_init(level);
+    void *d = decomp->decompress_init();
+    int pos, ok = TRUE;
+
+    *complen = 0;
+    for (pos = 0; pos < len && ok; pos += PACKET_SIZE) {
+	int plen = len - pos < PACKET_SIZE ? len - pos : PACKET_SIZE;
+	unsigned char *cblk, *dblk;
+	int clen, dlen;
+
+	comp->compress(c, (unsigned char *)data + pos, plen, &cblk, &clen);
+	*complen += clen;
+	if (!decomp->decompress(d, cblk, clen, &dblk, &dlen))
+	    ok = FALSE;
+	else {
+	    if (dlen != plen || memcmp(dblk, data + pos, plen))
+		ok = FALSE;
+	    sfree(dblk);
+	}
+	sfree(cblk);
+    }
+
+    comp->compress_cleanup(c);
+    decomp->decompress_cleanup(d);
+    return ok;
+}
+
+static void check(const char *what, int ok)
+{
+    if (!ok) {
+	printf("FAIL: %s\n", what);
+	fails++;
+    } else
+	passes++;
+}
+
+static double benchmark(const struct ssh_compress *comp, int level,
+			const unsigned char *data, int len)
+{
+    void *c;
+    clock_t start, elapsed;
+    long long bytes = 0;
+    int pos;
+
+    start = clock();
+    do {
+	c = comp->compress_init(level);
+	for (pos = 0; pos < len; pos += PACKET_SIZE) {
+	    unsigned char *cblk;
+	    int clen;
+	    comp->compress(c, (unsigned char *)data + pos,
+			   len - pos < PACKET_SIZE ? len - pos : PACKET_SIZE,
+			   &cblk, &clen);
+	    sfree(cblk);
+	}
+	comp->compress_cleanup(c);
+	bytes += len;
+	elapsed = clock() - start;
+    } while (elapsed < CLOCKS_PER_SEC / 2);
+
+    return (double)bytes / 1000000 / ((double)elapsed / CLOCKS_PER_SEC);
+}
+
+static void test_disable(void)
+{
+    void *c = ssh_zlib_deflate.compress_init(6);
+    void *d = ssh_zlib_deflate.decompress_init();
+    unsigned char data[300], *cblk, *dblk;
+    int i, clen, dlen, adjust;
+
+    for (i = 0; i < (int)sizeof(data); i++)
+	data[i] = (unsigned char)(i * 7);
+
+    /* Uncompressed blocks cost exactly what we said they would */
+    for (i = 0; i < 3; i++) {
+	adjust = ssh_zlib_deflate.disable_compression(c);
+	ssh_zlib_deflate.compress(c, data, sizeof(data), &cblk, &clen);
+	check("disable_compression length", clen == (int)sizeof(data) + adjust);
+	check("disable_compression roundtrip",
+	      ssh_zlib_deflate.decompress(d, cblk, clen, &dblk, &dlen) &&
+	      dlen == sizeof(data) && !memcmp(dblk, data, dlen));
+	sfree(cblk);
+	sfree(dblk);
+    }
+
+    /* ...and compression is back on afterwards */
+    memset(data, 'a', sizeof(data));
+    ssh_zlib_deflate.compress(c, data, sizeof(data), &cblk, &clen);
+    check("compression restored", clen < 32);
+    sfree(cblk);
+
+    ssh_zlib_deflate.compress_cleanup(c);
+    ssh_zlib_deflate.decompress_cleanup(d);
+}
+
+static void test_corrupt(void)
+{
+    void *d = ssh_zlib_deflate.decompress_init();
+    unsigned char junk[] = { 0x78, 0x9c, 0xff, 0xff, 0xff, 0xff };
+    unsigned char *dblk;
+    int dlen;
+
+    check("corrupt input rejected",
+	  !ssh_zlib_deflate.decompress(d, junk, sizeof(junk), &dblk, &dlen));
+    ssh_zlib_deflate.decompress_cleanup(d);
+}
+
+int main(void)
+{
+    static const struct {
+	const char *name;
+	unsigned char *(*make)(int *);
+    } inputs[] = {
+	{ "listing", make_listing },
+	{ "text", make_text },
+    };
+    static const int levels[] = { 1, 6, 9 };
+    int i, j;
+
+    for (i = 0; i < 2; i++) {
+	int len, complen;
+	unsigned char *data = inputs[i].make(&len);
+	char what[64];
+
+	check("sshzlib -> zlib",
+	      loopback(&ssh_zlib, &ssh_zlib_deflate, 0, data, len, &complen));
+	printf("%-8s sshzlib:  %5.1f%% %6.1f MB/s\n", inputs[i].name,
+	       100.0 * complen / len, benchmark(&ssh_zlib, 0, data, len));
+
+	for (j = 0; j < 3; j++) {
+	    sprintf(what, "zlib level %d -> sshzlib", levels[j]);
+	    check(what, loopback(&ssh_zlib_deflate, &ssh_zlib, levels[j],
+				 data, len, &complen));
+	    sprintf(what, "zlib level %d -> zlib", levels[j]);
+	    check(what, loopback(&ssh_zlib_deflate, &ssh_zlib_deflate,
+				 levels[j], data, len, &complen));
+	    printf("%-8s level %d:  %5.1f%% %6.1f MB/s\n", inputs[i].name,
+		   levels[j], 100.0 * complen / len,
+		   benchmark(&ssh_zlib_deflate, levels[j], data, len));
+	}
+	sfree(data);
+    }
+
+    test_disable();
+    test_corrupt();
+
+    printf("%d passed, %d failed\n", passes, fails);
+    return fails != 0;
+}
+
+#endif
+
+#endif
@@ -2087,19 +2087,55 @@ void ssh_ecdhkex_freekey(void *key)
     ecdsa_freekey(key);
 }
 
+static void *ssh_ecdhkex_nist_newkey(const struct ssh_ecdhkex *alg)
+{
+    return ssh_ecdhkex_newkey(alg->curve());
+}
+
+static const struct ssh_ecdhkex ssh_ecdhkex_nistp256 = {
+    ssh_ecdhkex_nist_newkey, ssh_ecdhkex_freekey, ssh_ecdhkex_getpublic,
+    ssh_ecdhkex_getkey, ec_p256, "ECDH"
+};
+
+static const struct ssh_ecdhkex ssh_ecdhkex_nistp384 = {
+    ssh_ecdhkex_nist_newkey, ssh_ecdhkex_freekey, ssh_ecdhkex_getpublic,
+    ssh_ecdhkex_getkey, ec_p384, "ECDH"
+};
+
+static const struct ssh_ecdhkex ssh_ecdhkex_nistp521 = {
+    ssh_ecdhkex_nist_newkey, ssh_ecdhkex_freekey, ssh_ecdhkex_getpublic,
+    ssh_ecdhkex_getkey, ec_p521, "ECDH"
+};
+
+static const struct ssh_kex ssh_ec_kex_curve25519 = {
+    "curve25519-sha256", NULL, KEXTYPE_ECDH, NULL, NULL, 0, 0, &ssh_sha256,
+    &ssh_ecdhkex_x25519
+};
+
+static const struct ssh_kex ssh_ec_kex_curve25519_libssh = {
+    "curve25519-sha256@libssh.org", NULL, KEXTYPE_ECDH, NULL, NULL, 0, 0,
+    &ssh_sha256, &ssh_ecdhkex_x25519
+};
+
 static const struct ssh_kex ssh_ec_kex_nistp256 = {
-    "ecdh-sha2-nistp256", NULL, KEXTYPE_ECDH, NULL, NULL, 0, 0, &ssh_sha256
+    "ecdh-sha2-nistp256", NULL, KEXTYPE_ECDH, NULL, NULL, 0, 0, &ssh_sha256,
+    &ssh_ecdhkex_nistp256
 };
 
 static const struct ssh_kex ssh_ec_kex_nistp384 = {
-    "ecdh-sha2-nistp384", NULL, KEXTYPE_ECDH, NULL, NULL, 0, 0, &ssh_sha384
+    "ecdh-sha2-nistp384", NULL, KEXTYPE_ECDH, NULL, NULL, 0, 0, &ssh_sha384,
+    &ssh_ecdhkex_nistp384
 };
 
 static const struct ssh_kex ssh_ec_kex_nistp521 = {
-    "ecdh-sha2-nistp521", NULL, KEXTYPE_ECDH, NULL, NULL, 0, 0, &ssh_sha512
+    "ecdh-sha2-nistp521", NULL, KEXTYPE_ECDH, NULL, NULL, 0, 0, &ssh_sha512,
+    &ssh_ecdhkex_nistp521
 };
 
+/* Curve25519 first, it is by far the cheapest to compute */
 static const struct ssh_kex *const ec_kex_list[] = {
+    &ssh_ec_kex_curve25519,
+    &ssh_ec_kex_curve25519_libssh,
     &ssh_ec_kex_nistp256,
     &ssh_ec_kex_nistp384,
     &ssh_ec_kex_nistp521
@@ -2,10 +2,28 @@
  * SHA-256 algorithm as described at
  * 
  *   http://csrc.nist.gov/cryptval/shs.html
+ *
+ * Where the CPU has the SHA extensions, blocks are processed with
+ * those instead, decided at runtime.
  */
 
 #include "ssh.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || \
+     (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SHA_NI_AVAILABLE
+#define SHA_NI_FUNC __attribute__((target("sha,sse4.1,ssse3")))
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(_MSC_VER) && _MSC_VER >= 1900 && \
+    (defined(_M_X64) || defined(_M_IX86))
+#define SHA_NI_AVAILABLE
+#define SHA_NI_FUNC
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
 /* ----------------------------------------------------------------------
  * Core SHA256 algorithm: processes 16-word blocks into a message digest.
  */
@@ -19,6 +37,25 @@
 #define smallsigma0(x) ( ror((x),7) ^ ror((x),18) ^ shr((x),3) )
 #define smallsigma1(x) ( ror((x),17) ^ ror((x),19) ^ shr((x),10) )
 
+static const uint32 sha256_k[] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
 void SHA256_Core_Init(SHA256_State *s) {
     s->h[0] = 0x6a09e667;
     s->h[1] = 0xbb67ae85;
@@ -30,59 +67,162 @@ void SHA256_Core_Init(SHA256_State *s) {
     s->h[7] = 0x5be0cd19;
 }
 
-void SHA256_Block(SHA256_State *s, uint32 *block) {
-    uint32 w[80];
+static void SHA256_Blocks_portable(uint32 *hash, const unsigned char *p,
+				   int blocks)
+{
+    uint32 w[64];
     uint32 a,b,c,d,e,f,g,h;
-    static const int k[] = {
-        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
-        0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
-        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
-        0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
-        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
-        0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
-        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
-        0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
-        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
-        0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
-        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
-        0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
-        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
-        0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
-        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
-        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
-    };
-
+    const uint32 *k = sha256_k;
     int t;
 
-    for (t = 0; t < 16; t++)
-        w[t] = block[t];
+    for (; blocks > 0; blocks--, p += 64) {
+	/* Gather bytes big-endian into words */
+	for (t = 0; t < 16; t++)
+	    w[t] = GET_32BIT_MSB_FIRST(p + 4 * t);
 
-    for (t = 16; t < 64; t++)
-	w[t] = smallsigma1(w[t-2]) + w[t-7] + smallsigma0(w[t-15]) + w[t-16];
+	for (t = 16; t < 64; t++)
+	    w[t] = smallsigma1(w[t-2]) + w[t-7] + smallsigma0(w[t-15]) + w[t-16];
 
-    a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
-    e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+	a = hash[0]; b = hash[1]; c = hash[2]; d = hash[3];
+	e = hash[4]; f = hash[5]; g = hash[6]; h = hash[7];
 
-    for (t = 0; t < 64; t+=8) {
-        uint32 t1, t2;
+	for (t = 0; t < 64; t+=8) {
+	    uint32 t1, t2;
 
 #define ROUND(j,a,b,c,d,e,f,g,h) \
-	t1 = h + bigsigma1(e) + Ch(e,f,g) + k[j] + w[j]; \
-	t2 = bigsigma0(a) + Maj(a,b,c); \
-        d = d + t1; h = t1 + t2;
-
-	ROUND(t+0, a,b,c,d,e,f,g,h);
-	ROUND(t+1, h,a,b,c,d,e,f,g);
-	ROUND(t+2, g,h,a,b,c,d,e,f);
-	ROUND(t+3, f,g,h,a,b,c,d,e);
-	ROUND(t+4, e,f,g,h,a,b,c,d);
-	ROUND(t+5, d,e,f,g,h,a,b,c);
-	ROUND(t+6, c,d,e,f,g,h,a,b);
-	ROUND(t+7, b,c,d,e,f,g,h,a);
+	    t1 = h + bigsigma1(e) + Ch(e,f,g) + k[j] + w[j]; \
+	    t2 = bigsigma0(a) + Maj(a,b,c); \
+	    d = d + t1; h = t1 + t2;
+
+	    ROUND(t+0, a,b,c,d,e,f,g,h);
+	    ROUND(t+1, h,a,b,c,d,e,f,g);
+	    ROUND(t+2, g,h,a,b,c,d,e,f);
+	    ROUND(t+3, f,g,h,a,b,c,d,e);
+	    ROUND(t+4, e,f,g,h,a,b,c,d);
+	    ROUND(t+5, d,e,f,g,h,a,b,c);
+	    ROUND(t+6, c,d,e,f,g,h,a,b);
+	    ROUND(t+7, b,c,d,e,f,g,h,a);
+	}
+
+	hash[0] += a; hash[1] += b; hash[2] += c; hash[3] += d;
+	hash[4] += e; hash[5] += f; hash[6] += g; hash[7] += h;
     }
+}
+
+#ifdef SHA_NI_AVAILABLE
 
-    s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
-    s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+static int sha_ni_enabled = -1;
+
+static int sha_ni_supported(void)
+{
+    if (sha_ni_enabled < 0) {
+	unsigned int ecx1, ebx7 = 0;
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] >= 7) {
+	    __cpuidex(info, 7, 0);
+	    ebx7 = info[1];
+	}
+	__cpuid(info, 1);
+	ecx1 = info[2];
+#else
+	unsigned int eax, ebx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx1, &edx))
+	    ecx1 = 0;
+	if (__get_cpuid_max(0, NULL) >= 7) {
+	    unsigned int ecx;
+	    __cpuid_count(7, 0, eax, ebx7, ecx, edx);
+	}
+#endif
+	/* SHA extensions, SSE4.1 and SSSE3 */
+	sha_ni_enabled = (ebx7 & (1 << 29)) && (ecx1 & (1 << 19)) &&
+	    (ecx1 & (1 << 9));
+    }
+    return sha_ni_enabled;
+}
+
+/*
+ * Four rounds, with the message words plus constants in the low half
+ * of the register for the first two and the high half for the others
+ */
+#define NI_ROUNDS(m, j) ( \
+    tmp = _mm_add_epi32(m, _mm_loadu_si128((const __m128i *)(sha256_k + (j)))), \
+    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, tmp), \
+    tmp = _mm_shuffle_epi32(tmp, 0x0E), \
+    abef = _mm_sha256rnds2_epu32(abef, cdgh, tmp))
+
+/* Replaces the message words w0 with the ones four rounds after w3 */
+#define NI_SCHEDULE(w0, w1, w2, w3) ( \
+    w0 = _mm_sha256msg2_epu32( \
+	_mm_add_epi32(_mm_sha256msg1_epu32(w0, w1), \
+		      _mm_alignr_epi8(w3, w2, 4)), w3))
+
+static SHA_NI_FUNC void SHA256_Blocks_ni(uint32 *hash, const unsigned char *p,
+					 int blocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+					 0x0405060700010203ULL);
+    __m128i abef, cdgh, abef_save, cdgh_save, m0, m1, m2, m3, tmp;
+    int t;
+
+    /* The instructions want the state as ABEF and CDGH */
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)hash), 0xB1);
+    cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(hash + 4)),
+			     0x1B);
+    abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);
+
+    for (; blocks > 0; blocks--, p += 64) {
+	abef_save = abef;
+	cdgh_save = cdgh;
+
+	m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), bswap);
+	m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16)),
+			      bswap);
+	m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 32)),
+			      bswap);
+	m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 48)),
+			      bswap);
+
+	NI_ROUNDS(m0, 0);
+	NI_ROUNDS(m1, 4);
+	NI_ROUNDS(m2, 8);
+	NI_ROUNDS(m3, 12);
+	for (t = 16; t < 64; t += 16) {
+	    NI_SCHEDULE(m0, m1, m2, m3);
+	    NI_ROUNDS(m0, t);
+	    NI_SCHEDULE(m1, m2, m3, m0);
+	    NI_ROUNDS(m1, t + 4);
+	    NI_SCHEDULE(m2, m3, m0, m1);
+	    NI_ROUNDS(m2, t + 8);
+	    NI_SCHEDULE(m3, m0, m1, m2);
+	    NI_ROUNDS(m3, t + 12);
+	}
+
+	abef = _mm_add_epi32(abef, abef_save);
+	cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    }
+
+    /* Back to ABCD and EFGH */
+    tmp = _mm_shuffle_epi32(abef, 0x1B);
+    cdgh = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128((__m128i *)hash, _mm_blend_epi16(tmp, cdgh, 0xF0));
+    _mm_storeu_si128((__m128i *)(hash + 4), _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+#endif
+
+/* Processes the given number of 64-byte blocks */
+static void SHA256_Blocks(SHA256_State *s, const unsigned char *p, int blocks)
+{
+#ifdef SHA_NI_AVAILABLE
+    if (sha_ni_supported()) {
+	SHA256_Blocks_ni(s->h, p, blocks);
+	return;
+    }
+#endif
+    SHA256_Blocks_portable(s->h, p, blocks);
 }
 
 /* ----------------------------------------------------------------------
@@ -101,9 +241,8 @@ void SHA256_Init(SHA256_State *s) {
 
 void SHA256_Bytes(SHA256_State *s, const void *p, int len) {
     unsigned char *q = (unsigned char *)p;
-    uint32 wordblock[16];
     uint32 lenw = len;
-    int i;
+    int blocks;
 
     /*
      * Update the length field.
@@ -121,20 +260,18 @@ void SHA256_Bytes(SHA256_State *s, const void *p, int len) {
         /*
          * We must complete and process at least one block.
          */
-        while (s->blkused + len >= BLKSIZE) {
+        if (s->blkused) {
             memcpy(s->block + s->blkused, q, BLKSIZE - s->blkused);
             q += BLKSIZE - s->blkused;
             len -= BLKSIZE - s->blkused;
-            /* Now process the block. Gather bytes big-endian into words */
-            for (i = 0; i < 16; i++) {
-                wordblock[i] =
-                    ( ((uint32)s->block[i*4+0]) << 24 ) |
-                    ( ((uint32)s->block[i*4+1]) << 16 ) |
-                    ( ((uint32)s->block[i*4+2]) <<  8 ) |
-                    ( ((uint32)s->block[i*4+3]) <<  0 );
-            }
-            SHA256_Block(s, wordblock);
-            s->blkused = 0;
+            SHA256_Blocks(s, s->block, 1);
+        }
+        /* Whole blocks are processed straight from the input */
+        blocks = len / BLKSIZE;
+        if (blocks) {
+            SHA256_Blocks(s, q, blocks);
+            q += blocks * BLKSIZE;
+            len -= blocks * BLKSIZE;
         }
         memcpy(s->block, q, len);
         s->blkused = len;
@@ -223,7 +360,7 @@ const struct ssh_hash ssh_sha256 = {
  * HMAC wrapper on it.
  */
 
-static void *sha256_make_context(void)
+static void *sha256_make_context(void *cipher_ctx)
 {
     return snewn(3, SHA256_State);
 }
@@ -323,7 +460,7 @@ const struct ssh_mac ssh_hmac_sha256 = {
     sha256_generate, sha256_verify,
     hmacsha256_start, hmacsha256_bytes,
     hmacsha256_genresult, hmacsha256_verresult,
-    "hmac-sha2-256",
+    "hmac-sha2-256", "hmac-sha2-256-etm@openssh.com",
     32,
     "HMAC-SHA-256"
 };
@@ -377,3 +514,288 @@ int main(void) {
 }
 
 #endif
+
+#ifdef TESTMAC
+
+/*
+ * Known-answer tests of SHA-256 and SHA-512 and their HMACs, from
+ * FIPS 180-2 and RFC 4231, followed by a throughput benchmark of the
+ * SSH MACs on transfer-sized packets:
+ *
+ * gcc -O2 -DTESTMAC -o fzmacbench sshsh256.c sshsh512.c sshsha.c sshmd5.c misc.c conf.c tree234.c unix/uxmisc.c -I. -I unix
+ *
+ * or `make fzmacbench'.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+void modalfatalbox(char *p, ...)
+{
+    va_list ap;
+    fprintf(stderr, "FATAL ERROR: ");
+    va_start(ap, p);
+    vfprintf(stderr, p, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static int passes, fails;
+
+static void unhex(unsigned char *out, const char *hex)
+{
+    unsigned int b;
+    while (*hex) {
+	sscanf(hex, "%2x", &b);
+	*out++ = (unsigned char)b;
+	hex += 2;
+    }
+}
+
+static void check(const char *what, const unsigned char *got,
+		  const char *expected_hex)
+{
+    unsigned char expected[64];
+    int len = strlen(expected_hex) / 2;
+
+    unhex(expected, expected_hex);
+    if (memcmp(got, expected, len)) {
+	printf("FAIL: %s\n", what);
+	fails++;
+    } else
+	passes++;
+}
+
+static void set_sha_ni(int enabled)
+{
+#ifdef SHA_NI_AVAILABLE
+    sha_ni_enabled = enabled;
+#endif
+}
+
+static int sha_ni_present(void)
+{
+#ifdef SHA_NI_AVAILABLE
+    sha_ni_enabled = -1;
+    return sha_ni_supported();
+#else
+    return 0;
+#endif
+}
+
+/* A million times 'a', fed in uneven pieces */
+static void million_a(const struct ssh_hash *hash, unsigned char *out)
+{
+    static const char as[] =
+	"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+	"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+	"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa";
+    void *h = hash->init();
+    int done = 0;
+
+    while (done < 1000000) {
+	int n = 1 + done % (sizeof(as) - 1);
+	if (n > 1000000 - done)
+	    n = 1000000 - done;
+	hash->bytes(h, (void *)as, n);
+	done += n;
+    }
+    hash->final(h, out);
+}
+
+static void test_hash(const struct ssh_hash *hash, const char *name,
+		      const char *msg, const char *expected_hex)
+{
+    unsigned char out[64];
+    void *h = hash->init();
+
+    hash->bytes(h, (void *)msg, strlen(msg));
+    hash->final(h, out);
+    check(name, out, expected_hex);
+}
+
+static void test_hmac(const struct ssh_mac *mac, const char *name,
+		      const char *key, int keylen, const char *msg,
+		      const char *expected_hex)
+{
+    unsigned char keybuf[64], out[64];
+    void *ctx = mac->make_context(NULL);
+
+    /* Shorter keys are padded with zeroes by HMAC itself */
+    memset(keybuf, 0, sizeof(keybuf));
+    memcpy(keybuf, key, keylen);
+    mac->setkey(ctx, keybuf);
+    mac->start(ctx);
+    mac->bytes(ctx, (unsigned char const *)msg, strlen(msg));
+    mac->genresult(ctx, out);
+    check(name, out, expected_hex);
+    if (!mac->verresult(ctx, out)) {
+	printf("FAIL: %s verify\n", name);
+	fails++;
+    }
+    mac->free_context(ctx);
+}
+
+static unsigned long rng_state = 1;
+
+static void random_fill(unsigned char *buf, int len)
+{
+    while (len-- > 0) {
+	rng_state = rng_state * 1103515245 + 12345;
+	*buf++ = (unsigned char)(rng_state >> 16);
+    }
+}
+
+/* The SHA extensions must agree with the portable code on any split */
+static void cross_check(void)
+{
+    unsigned char data[1000], a[32], b[32];
+    int len, split;
+
+    random_fill(data, sizeof(data));
+    for (len = 0; len < (int)sizeof(data); len += 7) {
+	SHA256_State s;
+
+	split = len ? (int)(rng_state % len) : 0;
+
+	set_sha_ni(0);
+	SHA256_Init(&s);
+	SHA256_Bytes(&s, data, split);
+	SHA256_Bytes(&s, data + split, len - split);
+	SHA256_Final(&s, a);
+
+	set_sha_ni(1);
+	SHA256_Simple(data, len, b);
+
+	if (memcmp(a, b, 32)) {
+	    printf("FAIL: SHA-256 cross check at length %d\n", len);
+	    fails++;
+	    return;
+	}
+    }
+    passes++;
+}
+
+static double benchmark(const struct ssh_mac *mac)
+{
+    enum { LEN = 32768 };
+    static unsigned char buf[4 + LEN + 64];
+    unsigned char key[64];
+    void *ctx;
+    clock_t start, elapsed;
+    long bytes = 0;
+    unsigned long seq = 0;
+
+    random_fill(key, sizeof(key));
+    random_fill(buf, sizeof(buf));
+    ctx = mac->make_context(NULL);
+    mac->setkey(ctx, key);
+
+    start = clock();
+    do {
+	int i;
+	for (i = 0; i < 64; i++)
+	    mac->generate(ctx, buf, 4 + LEN, seq++);
+	bytes += 64L * (4 + LEN);
+	elapsed = clock() - start;
+    } while (elapsed < CLOCKS_PER_SEC / 2);
+
+    mac->free_context(ctx);
+    return (double)bytes / 1000000 / ((double)elapsed / CLOCKS_PER_SEC);
+}
+
+int main(void)
+{
+    static const char key1[20] = {
+	0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b,
+	0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b
+    };
+    const struct ssh_mac *const macs[] = {
+	&ssh_hmac_sha256, &ssh_hmac_sha512, &ssh_hmac_sha1, &ssh_hmac_md5
+    };
+    unsigned char out[64];
+    int ni, max_ni = sha_ni_present(), i;
+
+    for (ni = 0; ni <= max_ni; ni++) {
+	set_sha_ni(ni);
+
+	test_hash(&ssh_sha256, "SHA-256 one block", "abc",
+		  "ba7816bf8f01cfea414140de5dae2223"
+		  "b00361a396177a9cb410ff61f20015ad");
+	test_hash(&ssh_sha256, "SHA-256 two blocks",
+		  "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+		  "248d6a61d20638b8e5c026930c3e6039"
+		  "a33ce45964ff2167f6ecedd419db06c1");
+	million_a(&ssh_sha256, out);
+	check("SHA-256 long message", out,
+	      "cdc76e5c9914fb9281a1c7e284d73e67"
+	      "f1809a48a497200e046d39ccc7112cd0");
+
+	/* RFC 4231, test cases 1 and 2 */
+	test_hmac(&ssh_hmac_sha256, "HMAC-SHA-256 case 1", key1, 20,
+		  "Hi There",
+		  "b0344c61d8db38535ca8afceaf0bf12b"
+		  "881dc200c9833da726e9376c2e32cff7");
+	test_hmac(&ssh_hmac_sha256, "HMAC-SHA-256 case 2", "Jefe", 4,
+		  "what do ya want for nothing?",
+		  "5bdcc146bf60754e6a042426089575c7"
+		  "5a003f089d2739839dec58b964ec3843");
+    }
+
+    test_hash(&ssh_sha512, "SHA-512 one block", "abc",
+	      "ddaf35a193617abacc417349ae204131"
+	      "12e6fa4e89a97ea20a9eeee64b55d39a"
+	      "2192992a274fc1a836ba3c23a3feebbd"
+	      "454d4423643ce80e2a9ac94fa54ca49f");
+    test_hash(&ssh_sha512, "SHA-512 two blocks",
+	      "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+	      "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+	      "8e959b75dae313da8cf4f72814fc143f"
+	      "8f7779c6eb9f7fa17299aeadb6889018"
+	      "501d289e4900f7e4331b99dec4b5433a"
+	      "c7d329eeb6dd26545e96e55b874be909");
+    million_a(&ssh_sha512, out);
+    check("SHA-512 long message", out,
+	  "e718483d0ce769644e2e42c7bc15b463"
+	  "8e1f98b13b2044285632a803afa973eb"
+	  "de0ff244877ea60a4cb0432ce577c31b"
+	  "eb009c5c2c49aa2e4eadb217ad8cc09b");
+    test_hmac(&ssh_hmac_sha512, "HMAC-SHA-512 case 1", key1, 20,
+	      "Hi There",
+	      "87aa7cdea5ef619d4ff0b4241a1d6cb0"
+	      "2379f4e2ce4ec2787ad0b30545e17cde"
+	      "daa833b7d6b8a702038b274eaea3f4e4"
+	      "be9d914eeb61f1702e696c203a126854");
+    test_hmac(&ssh_hmac_sha512, "HMAC-SHA-512 case 2", "Jefe", 4,
+	      "what do ya want for nothing?",
+	      "164b7a7bfcf819e2e395fbe73b56e0a3"
+	      "87bd64222e831fd610270cd7ea250554"
+	      "9758bf75c05a994a6d034f65f8f0e6fd"
+	      "caeab1a34d4a6b4b636e070a38bce737");
+
+    if (max_ni)
+	cross_check();
+
+    printf("%d passed, %d failed\n", passes, fails);
+    if (fails)
+	return 1;
+
+    printf("\n");
+    for (i = 0; i < lenof(macs); i++) {
+	printf("%-16s", macs[i]->name);
+	if (macs[i] == &ssh_hmac_sha256) {
+	    for (ni = 0; ni <= max_ni; ni++) {
+		set_sha_ni(ni);
+		printf(" %s %.1f MB/s", ni ? "SHA-NI" : "portable",
+		       benchmark(macs[i]));
+	    }
+	} else
+	    printf(" %.1f MB/s", benchmark(macs[i]));
+	printf("\n");
+    }
+
+    return 0;
+}
+
+#endif
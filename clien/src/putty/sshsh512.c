@@ -13,6 +13,11 @@ typedef struct {
     int blkused;
     uint32 len[4];
 } SHA512_State;
+#define GET_32BIT_MSB_FIRST(cp) \
+  (((unsigned long)(unsigned char)(cp)[0] << 24) | \
+  ((unsigned long)(unsigned char)(cp)[1] << 16) | \
+  ((unsigned long)(unsigned char)(cp)[2] << 8) | \
+  ((unsigned long)(unsigned char)(cp)[3]))
 #else
 #include "ssh.h"
 #endif
@@ -20,42 +25,35 @@ typedef struct {
 #define BLKSIZE 128
 
 /*
- * Arithmetic implementations. Note that AND, XOR and NOT can
- * overlap destination with one source, but the others can't.
+ * The core works on native 64-bit words, which even 32-bit compilers
+ * handle better than a pair of 32-bit halves spelled out by hand. The
+ * state keeps PuTTY's uint64 so that its layout is unchanged.
  */
-#define add(r,x,y) ( r.lo = y.lo + x.lo, \
-		     r.hi = y.hi + x.hi + ((uint32)r.lo < (uint32)y.lo) )
-#define rorB(r,x,y) ( r.lo = ((uint32)x.hi >> ((y)-32)) | ((uint32)x.lo << (64-(y))), \
-		      r.hi = ((uint32)x.lo >> ((y)-32)) | ((uint32)x.hi << (64-(y))) )
-#define rorL(r,x,y) ( r.lo = ((uint32)x.lo >> (y)) | ((uint32)x.hi << (32-(y))), \
-		      r.hi = ((uint32)x.hi >> (y)) | ((uint32)x.lo << (32-(y))) )
-#define shrB(r,x,y) ( r.lo = (uint32)x.hi >> ((y)-32), r.hi = 0 )
-#define shrL(r,x,y) ( r.lo = ((uint32)x.lo >> (y)) | ((uint32)x.hi << (32-(y))), \
-		      r.hi = (uint32)x.hi >> (y) )
-#define putty_and(r,x,y) ( r.lo = x.lo & y.lo, r.hi = x.hi & y.hi )
-#define putty_xor(r,x,y) ( r.lo = x.lo ^ y.lo, r.hi = x.hi ^ y.hi )
-#define putty_not(r,x) ( r.lo = ~x.lo, r.hi = ~x.hi )
+#if defined(_MSC_VER) && _MSC_VER < 1800
+typedef unsigned __int64 sha512_word;
+#define SHA512_C(x) x##ui64
+#else
+typedef unsigned long long sha512_word;
+#define SHA512_C(x) x##ULL
+#endif
+
 #define INIT(h,l) { h, l }
-#define BUILD(r,h,l) ( r.hi = h, r.lo = l )
 #define EXTRACT(h,l,r) ( h = r.hi, l = r.lo )
 
+#define ror(x,y) ( ((x) >> (y)) | ((x) << (64-(y))) )
+#define shr(x,y) ( (x) >> (y) )
+#define Ch(x,y,z) ( ((x) & (y)) ^ (~(x) & (z)) )
+#define Maj(x,y,z) ( ((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)) )
+#define bigsigma0(x) ( ror((x),28) ^ ror((x),34) ^ ror((x),39) )
+#define bigsigma1(x) ( ror((x),14) ^ ror((x),18) ^ ror((x),41) )
+#define smallsigma0(x) ( ror((x),1) ^ ror((x),8) ^ shr((x),7) )
+#define smallsigma1(x) ( ror((x),19) ^ ror((x),61) ^ shr((x),6) )
+
 /* ----------------------------------------------------------------------
  * Core SHA512 algorithm: processes 16-doubleword blocks into a
  * message digest.
  */
 
-#define Ch(r,t,x,y,z) ( putty_not(t,x), putty_and(r,t,z), putty_and(t,x,y), putty_xor(r,r,t) )
-#define Maj(r,t,x,y,z) ( putty_and(r,x,y), putty_and(t,x,z), putty_xor(r,r,t), \
-			 putty_and(t,y,z), putty_xor(r,r,t) )
-#define bigsigma0(r,t,x) ( rorL(r,x,28), rorB(t,x,34), putty_xor(r,r,t), \
-			   rorB(t,x,39), putty_xor(r,r,t) )
-#define bigsigma1(r,t,x) ( rorL(r,x,14), rorL(t,x,18), putty_xor(r,r,t), \
-			   rorB(t,x,41), putty_xor(r,r,t) )
-#define smallsigma0(r,t,x) ( rorL(r,x,1), rorL(t,x,8), putty_xor(r,r,t), \
-			     shrL(t,x,7), putty_xor(r,r,t) )
-#define smallsigma1(r,t,x) ( rorL(r,x,19), rorB(t,x,61), putty_xor(r,r,t), \
-			     shrL(t,x,6), putty_xor(r,r,t) )
-
 static void SHA512_Core_Init(SHA512_State *s) {
     static const uint64 iv[] = {
 	INIT(0x6a09e667, 0xf3bcc908),
@@ -88,103 +86,96 @@ static void SHA384_Core_Init(SHA512_State *s) {
         s->h[i] = iv[i];
 }
 
-static void SHA512_Block(SHA512_State *s, uint64 *block) {
-    uint64 w[80];
-    uint64 a,b,c,d,e,f,g,h;
-    static const uint64 k[] = {
-	INIT(0x428a2f98, 0xd728ae22), INIT(0x71374491, 0x23ef65cd),
-	INIT(0xb5c0fbcf, 0xec4d3b2f), INIT(0xe9b5dba5, 0x8189dbbc),
-	INIT(0x3956c25b, 0xf348b538), INIT(0x59f111f1, 0xb605d019),
-	INIT(0x923f82a4, 0xaf194f9b), INIT(0xab1c5ed5, 0xda6d8118),
-	INIT(0xd807aa98, 0xa3030242), INIT(0x12835b01, 0x45706fbe),
-	INIT(0x243185be, 0x4ee4b28c), INIT(0x550c7dc3, 0xd5ffb4e2),
-	INIT(0x72be5d74, 0xf27b896f), INIT(0x80deb1fe, 0x3b1696b1),
-	INIT(0x9bdc06a7, 0x25c71235), INIT(0xc19bf174, 0xcf692694),
-	INIT(0xe49b69c1, 0x9ef14ad2), INIT(0xefbe4786, 0x384f25e3),
-	INIT(0x0fc19dc6, 0x8b8cd5b5), INIT(0x240ca1cc, 0x77ac9c65),
-	INIT(0x2de92c6f, 0x592b0275), INIT(0x4a7484aa, 0x6ea6e483),
-	INIT(0x5cb0a9dc, 0xbd41fbd4), INIT(0x76f988da, 0x831153b5),
-	INIT(0x983e5152, 0xee66dfab), INIT(0xa831c66d, 0x2db43210),
-	INIT(0xb00327c8, 0x98fb213f), INIT(0xbf597fc7, 0xbeef0ee4),
-	INIT(0xc6e00bf3, 0x3da88fc2), INIT(0xd5a79147, 0x930aa725),
-	INIT(0x06ca6351, 0xe003826f), INIT(0x14292967, 0x0a0e6e70),
-	INIT(0x27b70a85, 0x46d22ffc), INIT(0x2e1b2138, 0x5c26c926),
-	INIT(0x4d2c6dfc, 0x5ac42aed), INIT(0x53380d13, 0x9d95b3df),
-	INIT(0x650a7354, 0x8baf63de), INIT(0x766a0abb, 0x3c77b2a8),
-	INIT(0x81c2c92e, 0x47edaee6), INIT(0x92722c85, 0x1482353b),
-	INIT(0xa2bfe8a1, 0x4cf10364), INIT(0xa81a664b, 0xbc423001),
-	INIT(0xc24b8b70, 0xd0f89791), INIT(0xc76c51a3, 0x0654be30),
-	INIT(0xd192e819, 0xd6ef5218), INIT(0xd6990624, 0x5565a910),
-	INIT(0xf40e3585, 0x5771202a), INIT(0x106aa070, 0x32bbd1b8),
-	INIT(0x19a4c116, 0xb8d2d0c8), INIT(0x1e376c08, 0x5141ab53),
-	INIT(0x2748774c, 0xdf8eeb99), INIT(0x34b0bcb5, 0xe19b48a8),
-	INIT(0x391c0cb3, 0xc5c95a63), INIT(0x4ed8aa4a, 0xe3418acb),
-	INIT(0x5b9cca4f, 0x7763e373), INIT(0x682e6ff3, 0xd6b2b8a3),
-	INIT(0x748f82ee, 0x5defb2fc), INIT(0x78a5636f, 0x43172f60),
-	INIT(0x84c87814, 0xa1f0ab72), INIT(0x8cc70208, 0x1a6439ec),
-	INIT(0x90befffa, 0x23631e28), INIT(0xa4506ceb, 0xde82bde9),
-	INIT(0xbef9a3f7, 0xb2c67915), INIT(0xc67178f2, 0xe372532b),
-	INIT(0xca273ece, 0xea26619c), INIT(0xd186b8c7, 0x21c0c207),
-	INIT(0xeada7dd6, 0xcde0eb1e), INIT(0xf57d4f7f, 0xee6ed178),
-	INIT(0x06f067aa, 0x72176fba), INIT(0x0a637dc5, 0xa2c898a6),
-	INIT(0x113f9804, 0xbef90dae), INIT(0x1b710b35, 0x131c471b),
-	INIT(0x28db77f5, 0x23047d84), INIT(0x32caab7b, 0x40c72493),
-	INIT(0x3c9ebe0a, 0x15c9bebc), INIT(0x431d67c4, 0x9c100d4c),
-	INIT(0x4cc5d4be, 0xcb3e42b6), INIT(0x597f299c, 0xfc657e2a),
-	INIT(0x5fcb6fab, 0x3ad6faec), INIT(0x6c44198c, 0x4a475817),
-    };
+static const sha512_word sha512_k[] = {
+    SHA512_C(0x428a2f98d728ae22), SHA512_C(0x7137449123ef65cd),
+    SHA512_C(0xb5c0fbcfec4d3b2f), SHA512_C(0xe9b5dba58189dbbc),
+    SHA512_C(0x3956c25bf348b538), SHA512_C(0x59f111f1b605d019),
+    SHA512_C(0x923f82a4af194f9b), SHA512_C(0xab1c5ed5da6d8118),
+    SHA512_C(0xd807aa98a3030242), SHA512_C(0x12835b0145706fbe),
+    SHA512_C(0x243185be4ee4b28c), SHA512_C(0x550c7dc3d5ffb4e2),
+    SHA512_C(0x72be5d74f27b896f), SHA512_C(0x80deb1fe3b1696b1),
+    SHA512_C(0x9bdc06a725c71235), SHA512_C(0xc19bf174cf692694),
+    SHA512_C(0xe49b69c19ef14ad2), SHA512_C(0xefbe4786384f25e3),
+    SHA512_C(0x0fc19dc68b8cd5b5), SHA512_C(0x240ca1cc77ac9c65),
+    SHA512_C(0x2de92c6f592b0275), SHA512_C(0x4a7484aa6ea6e483),
+    SHA512_C(0x5cb0a9dcbd41fbd4), SHA512_C(0x76f988da831153b5),
+    SHA512_C(0x983e5152ee66dfab), SHA512_C(0xa831c66d2db43210),
+    SHA512_C(0xb00327c898fb213f), SHA512_C(0xbf597fc7beef0ee4),
+    SHA512_C(0xc6e00bf33da88fc2), SHA512_C(0xd5a79147930aa725),
+    SHA512_C(0x06ca6351e003826f), SHA512_C(0x142929670a0e6e70),
+    SHA512_C(0x27b70a8546d22ffc), SHA512_C(0x2e1b21385c26c926),
+    SHA512_C(0x4d2c6dfc5ac42aed), SHA512_C(0x53380d139d95b3df),
+    SHA512_C(0x650a73548baf63de), SHA512_C(0x766a0abb3c77b2a8),
+    SHA512_C(0x81c2c92e47edaee6), SHA512_C(0x92722c851482353b),
+    SHA512_C(0xa2bfe8a14cf10364), SHA512_C(0xa81a664bbc423001),
+    SHA512_C(0xc24b8b70d0f89791), SHA512_C(0xc76c51a30654be30),
+    SHA512_C(0xd192e819d6ef5218), SHA512_C(0xd69906245565a910),
+    SHA512_C(0xf40e35855771202a), SHA512_C(0x106aa07032bbd1b8),
+    SHA512_C(0x19a4c116b8d2d0c8), SHA512_C(0x1e376c085141ab53),
+    SHA512_C(0x2748774cdf8eeb99), SHA512_C(0x34b0bcb5e19b48a8),
+    SHA512_C(0x391c0cb3c5c95a63), SHA512_C(0x4ed8aa4ae3418acb),
+    SHA512_C(0x5b9cca4f7763e373), SHA512_C(0x682e6ff3d6b2b8a3),
+    SHA512_C(0x748f82ee5defb2fc), SHA512_C(0x78a5636f43172f60),
+    SHA512_C(0x84c87814a1f0ab72), SHA512_C(0x8cc702081a6439ec),
+    SHA512_C(0x90befffa23631e28), SHA512_C(0xa4506cebde82bde9),
+    SHA512_C(0xbef9a3f7b2c67915), SHA512_C(0xc67178f2e372532b),
+    SHA512_C(0xca273eceea26619c), SHA512_C(0xd186b8c721c0c207),
+    SHA512_C(0xeada7dd6cde0eb1e), SHA512_C(0xf57d4f7fee6ed178),
+    SHA512_C(0x06f067aa72176fba), SHA512_C(0x0a637dc5a2c898a6),
+    SHA512_C(0x113f9804bef90dae), SHA512_C(0x1b710b35131c471b),
+    SHA512_C(0x28db77f523047d84), SHA512_C(0x32caab7b40c72493),
+    SHA512_C(0x3c9ebe0a15c9bebc), SHA512_C(0x431d67c49c100d4c),
+    SHA512_C(0x4cc5d4becb3e42b6), SHA512_C(0x597f299cfc657e2a),
+    SHA512_C(0x5fcb6fab3ad6faec), SHA512_C(0x6c44198c4a475817),
+};
 
+static void SHA512_Blocks(SHA512_State *s, const unsigned char *p, int blocks)
+{
+    sha512_word w[80], hash[8];
+    sha512_word a,b,c,d,e,f,g,h;
+    const sha512_word *k = sha512_k;
     int t;
 
-    for (t = 0; t < 16; t++)
-        w[t] = block[t];
+    for (t = 0; t < 8; t++)
+	hash[t] = ((sha512_word)s->h[t].hi << 32) | s->h[t].lo;
 
-    for (t = 16; t < 80; t++) {
-	uint64 p, q, r, tmp;
-	smallsigma1(p, tmp, w[t-2]);
-	smallsigma0(q, tmp, w[t-15]);
-	add(r, p, q);
-	add(p, r, w[t-7]);
-	add(w[t], p, w[t-16]);
-    }
+    for (; blocks > 0; blocks--, p += BLKSIZE) {
+	/* Gather bytes big-endian into doublewords */
+	for (t = 0; t < 16; t++)
+	    w[t] = ((sha512_word)GET_32BIT_MSB_FIRST(p + 8 * t) << 32) |
+		GET_32BIT_MSB_FIRST(p + 8 * t + 4);
+
+	for (t = 16; t < 80; t++)
+	    w[t] = smallsigma1(w[t-2]) + w[t-7] + smallsigma0(w[t-15]) + w[t-16];
 
-    a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
-    e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+	a = hash[0]; b = hash[1]; c = hash[2]; d = hash[3];
+	e = hash[4]; f = hash[5]; g = hash[6]; h = hash[7];
 
-    for (t = 0; t < 80; t+=8) {
-        uint64 tmp, p, q, r;
+	for (t = 0; t < 80; t+=8) {
+	    sha512_word t1, t2;
 
 #define ROUND(j,a,b,c,d,e,f,g,h) \
-	bigsigma1(p, tmp, e); \
-	Ch(q, tmp, e, f, g); \
-	add(r, p, q); \
-	add(p, r, k[j]) ; \
-	add(q, p, w[j]); \
-	add(r, q, h); \
-	bigsigma0(p, tmp, a); \
-	Maj(tmp, q, a, b, c); \
-	add(q, tmp, p); \
-	add(p, r, d); \
-	d = p; \
-	add(h, q, r);
-
-	ROUND(t+0, a,b,c,d,e,f,g,h);
-	ROUND(t+1, h,a,b,c,d,e,f,g);
-	ROUND(t+2, g,h,a,b,c,d,e,f);
-	ROUND(t+3, f,g,h,a,b,c,d,e);
-	ROUND(t+4, e,f,g,h,a,b,c,d);
-	ROUND(t+5, d,e,f,g,h,a,b,c);
-	ROUND(t+6, c,d,e,f,g,h,a,b);
-	ROUND(t+7, b,c,d,e,f,g,h,a);
+	    t1 = h + bigsigma1(e) + Ch(e,f,g) + k[j] + w[j]; \
+	    t2 = bigsigma0(a) + Maj(a,b,c); \
+	    d = d + t1; h = t1 + t2;
+
+	    ROUND(t+0, a,b,c,d,e,f,g,h);
+	    ROUND(t+1, h,a,b,c,d,e,f,g);
+	    ROUND(t+2, g,h,a,b,c,d,e,f);
+	    ROUND(t+3, f,g,h,a,b,c,d,e);
+	    ROUND(t+4, e,f,g,h,a,b,c,d);
+	    ROUND(t+5, d,e,f,g,h,a,b,c);
+	    ROUND(t+6, c,d,e,f,g,h,a,b);
+	    ROUND(t+7, b,c,d,e,f,g,h,a);
+	}
+
+	hash[0] += a; hash[1] += b; hash[2] += c; hash[3] += d;
+	hash[4] += e; hash[5] += f; hash[6] += g; hash[7] += h;
     }
 
-    {
-	uint64 tmp;
-#define UPDATE(state, local) ( tmp = state, add(state, tmp, local) )
-	UPDATE(s->h[0], a); UPDATE(s->h[1], b);
-	UPDATE(s->h[2], c); UPDATE(s->h[3], d);
-	UPDATE(s->h[4], e); UPDATE(s->h[5], f);
-	UPDATE(s->h[6], g); UPDATE(s->h[7], h);
+    for (t = 0; t < 8; t++) {
+	s->h[t].hi = (unsigned long)(hash[t] >> 32);
+	s->h[t].lo = (unsigned long)(hash[t] & 0xffffffff);
     }
 }
 
@@ -212,9 +203,8 @@ void SHA384_Init(SHA512_State *s) {
 
 void SHA512_Bytes(SHA512_State *s, const void *p, int len) {
     unsigned char *q = (unsigned char *)p;
-    uint64 wordblock[16];
     uint32 lenw = len;
-    int i;
+    int i, blocks;
 
     /*
      * Update the length field.
@@ -234,25 +224,18 @@ void SHA512_Bytes(SHA512_State *s, const void *p, int len) {
         /*
          * We must complete and process at least one block.
          */
-        while (s->blkused + len >= BLKSIZE) {
+        if (s->blkused) {
             memcpy(s->block + s->blkused, q, BLKSIZE - s->blkused);
             q += BLKSIZE - s->blkused;
             len -= BLKSIZE - s->blkused;
-            /* Now process the block. Gather bytes big-endian into words */
-            for (i = 0; i < 16; i++) {
-		uint32 h, l;
-                h = ( ((uint32)s->block[i*8+0]) << 24 ) |
-                    ( ((uint32)s->block[i*8+1]) << 16 ) |
-                    ( ((uint32)s->block[i*8+2]) <<  8 ) |
-                    ( ((uint32)s->block[i*8+3]) <<  0 );
-                l = ( ((uint32)s->block[i*8+4]) << 24 ) |
-                    ( ((uint32)s->block[i*8+5]) << 16 ) |
-                    ( ((uint32)s->block[i*8+6]) <<  8 ) |
-                    ( ((uint32)s->block[i*8+7]) <<  0 );
-		BUILD(wordblock[i], h, l);
-            }
-            SHA512_Block(s, wordblock);
-            s->blkused = 0;
+            SHA512_Blocks(s, s->block, 1);
+        }
+        /* Whole blocks are processed straight from the input */
+        blocks = len / BLKSIZE;
+        if (blocks) {
+            SHA512_Blocks(s, q, blocks);
+            q += blocks * BLKSIZE;
+            len -= blocks * BLKSIZE;
         }
         memcpy(s->block, q, len);
         s->blkused = len;
@@ -378,6 +361,110 @@ static void sha384_final(void *handle, unsigned char *output)
 const struct ssh_hash ssh_sha384 = {
     sha384_init, sha512_bytes, sha384_final, 48, "SHA-384"
 };
+
+/* ----------------------------------------------------------------------
+ * The HMAC wrapper on SHA-512.
+ */
+
+static void *sha512_make_context(void *cipher_ctx)
+{
+    return snewn(3, SHA512_State);
+}
+
+static void sha512_free_context(void *handle)
+{
+    sfree(handle);
+}
+
+static void sha512_key(void *handle, unsigned char *key)
+{
+    SHA512_State *keys = (SHA512_State *)handle;
+    unsigned char foo[BLKSIZE];
+    int i;
+
+    memset(foo, 0x36, BLKSIZE);
+    for (i = 0; i < 64; i++)
+	foo[i] ^= key[i];
+    SHA512_Init(&keys[0]);
+    SHA512_Bytes(&keys[0], foo, BLKSIZE);
+
+    memset(foo, 0x5C, BLKSIZE);
+    for (i = 0; i < 64; i++)
+	foo[i] ^= key[i];
+    SHA512_Init(&keys[1]);
+    SHA512_Bytes(&keys[1], foo, BLKSIZE);
+
+    smemclr(foo, BLKSIZE);	       /* burn the evidence */
+}
+
+static void hmacsha512_start(void *handle)
+{
+    SHA512_State *keys = (SHA512_State *)handle;
+
+    keys[2] = keys[0];		      /* structure copy */
+}
+
+static void hmacsha512_bytes(void *handle, unsigned char const *blk, int len)
+{
+    SHA512_State *keys = (SHA512_State *)handle;
+    SHA512_Bytes(&keys[2], blk, len);
+}
+
+static void hmacsha512_genresult(void *handle, unsigned char *hmac)
+{
+    SHA512_State *keys = (SHA512_State *)handle;
+    SHA512_State s;
+    unsigned char intermediate[64];
+
+    s = keys[2];		       /* structure copy */
+    SHA512_Final(&s, intermediate);
+    s = keys[1];		       /* structure copy */
+    SHA512_Bytes(&s, intermediate, 64);
+    SHA512_Final(&s, hmac);
+}
+
+static void sha512_do_hmac(void *handle, unsigned char *blk, int len,
+			   unsigned long seq, unsigned char *hmac)
+{
+    unsigned char seqbuf[4];
+
+    PUT_32BIT_MSB_FIRST(seqbuf, seq);
+    hmacsha512_start(handle);
+    hmacsha512_bytes(handle, seqbuf, 4);
+    hmacsha512_bytes(handle, blk, len);
+    hmacsha512_genresult(handle, hmac);
+}
+
+static void sha512_generate(void *handle, unsigned char *blk, int len,
+			    unsigned long seq)
+{
+    sha512_do_hmac(handle, blk, len, seq, blk + len);
+}
+
+static int hmacsha512_verresult(void *handle, unsigned char const *hmac)
+{
+    unsigned char correct[64];
+    hmacsha512_genresult(handle, correct);
+    return !memcmp(correct, hmac, 64);
+}
+
+static int sha512_verify(void *handle, unsigned char *blk, int len,
+			 unsigned long seq)
+{
+    unsigned char correct[64];
+    sha512_do_hmac(handle, blk, len, seq, correct);
+    return !memcmp(correct, blk + len, 64);
+}
+
+const struct ssh_mac ssh_hmac_sha512 = {
+    sha512_make_context, sha512_free_context, sha512_key,
+    sha512_generate, sha512_verify,
+    hmacsha512_start, hmacsha512_bytes,
+    hmacsha512_genresult, hmacsha512_verresult,
+    "hmac-sha2-512", "hmac-sha2-512-etm@openssh.com",
+    64,
+    "HMAC-SHA-512"
+};
 #endif
 
 #ifdef TEST
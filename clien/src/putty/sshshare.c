@@ -138,6 +138,21 @@
 #include "tree234.h"
 #include "ssh.h"
 
+/*
+ * Largest message, including its length header, a downstream may
+ * send us. See the protocol description above.
+ */
+#define SHARE_MAX_MESSAGE 0x4010
+
+/*
+ * Maximum packet size we tell downstreams for the server's end of a
+ * channel, so that CHANNEL_DATA and CHANNEL_EXTENDED_DATA messages
+ * carrying that much data still fit into SHARE_MAX_MESSAGE. The
+ * server's own limit is typically 32K, which downstreams would
+ * otherwise use for their CHANNEL_DATA, e.g. when uploading.
+ */
+#define SHARE_MAX_DATA (SHARE_MAX_MESSAGE - 32)
+
 struct ssh_sharing_state {
     const struct plug_function_table *fn;
     /* the above variable absolutely *must* be the first in this structure */
@@ -165,7 +180,7 @@ struct ssh_sharing_connstate {
 
     int sent_verstring, got_verstring, curr_packetlen;
 
-    unsigned char recvbuf[0x4010];
+    unsigned char recvbuf[SHARE_MAX_MESSAGE];
     int recvlen;
 
     /*
@@ -1088,6 +1103,16 @@ void share_xchannel_failure(struct ssh_sharing_connstate *cs,
     share_dead_xchannel_respond(cs, xc);
 }
 
+/*
+ * Limit a maximum packet size field in a message to downstream to
+ * SHARE_MAX_DATA.
+ */
+static void share_limit_maxpkt(unsigned char *pkt, int pktlen, int pos)
+{
+    if (pos >= 0 && pos + 4 <= pktlen && GET_32BIT(pkt + pos) > SHARE_MAX_DATA)
+        PUT_32BIT(pkt + pos, SHARE_MAX_DATA);
+}
+
 void share_setup_x11_channel(void *csv, void *chanv,
                              unsigned upstream_id, unsigned server_id,
                              unsigned server_currwin, unsigned server_maxpkt,
@@ -1137,6 +1162,7 @@ void share_setup_x11_channel(void *csv, void *chanv,
     PUT_32BIT(pkt+7, server_id);
     PUT_32BIT(pkt+11, server_currwin);
     PUT_32BIT(pkt+15, server_maxpkt);
+    share_limit_maxpkt(pkt, pktlen, 15);
     PUT_32BIT(pkt+19, strlen(peer_addr));
     memcpy(pkt+23, peer_addr, strlen(peer_addr));
     PUT_32BIT(pkt+23+strlen(peer_addr), peer_port);
@@ -1204,6 +1230,8 @@ void share_got_pkt_from_server(void *csv, int type,
         server_id = GET_32BIT(pkt + id_pos);
         share_add_halfchannel(cs, server_id);
 
+        /* sender channel, initial window size, maximum packet size */
+        share_limit_maxpkt(pkt, pktlen, id_pos + 8);
         send_packet_to_downstream(cs, type, pkt, pktlen, NULL);
         break;
 
@@ -1229,6 +1257,11 @@ void share_got_pkt_from_server(void *csv, int type,
              * The normal case: this id refers to an open channel.
              */
             PUT_32BIT(pkt, chan->downstream_id);
+            if (type == SSH2_MSG_CHANNEL_OPEN_CONFIRMATION) {
+                /* recipient and sender channel, initial window size,
+                 * maximum packet size */
+                share_limit_maxpkt(pkt, pktlen, 12);
+            }
             send_packet_to_downstream(cs, type, pkt, pktlen, chan);
 
             /*
@@ -2120,3 +2153,279 @@ Socket ssh_connection_sharing_init(const char *host, int port,
 
     return NULL;
 }
+
+#ifdef TESTSHARE
+
+/*
+ * An upload over a shared connection: a downstream opens a session
+ * channel and sends its data in CHANNEL_DATA messages as large as the
+ * maximum packet size it has been told, all of which have to reach
+ * the server unchanged.
+ *
+ * gcc -O2 -DTESTSHARE -DNO_GSSAPI -o fzsharetest sshshare.c misc.c conf.c tree234.c unix/uxmisc.c -I. -I unix
+ *
+ * or `make fzsharetest'.
+ */
+
+#include <string.h>
+
+void modalfatalbox(char *p, ...)
+{
+    va_list ap;
+    fprintf(stderr, "FATAL ERROR: ");
+    va_start(ap, p);
+    vfprintf(stderr, p, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+const int share_can_be_downstream = TRUE;
+const int share_can_be_upstream = TRUE;
+
+#define TEST_UPSTREAM_ID 256
+#define TEST_SERVER_ID 200
+#define TEST_DOWNSTREAM_ID 7
+#define TEST_SERVER_MAXPKT 0x8000
+
+static struct {
+    int opened;                 /* CHANNEL_OPEN reached the server */
+    int bad_messages;           /* unexpected messages to the server */
+    unsigned char *data;        /* channel data the server received */
+    int datalen;
+} server;
+
+static unsigned char *to_downstream;
+static int to_downstream_len;
+
+/* Only the parts of the ssh backend connection sharing uses */
+
+void ssh_connshare_log(Ssh ssh, int event, const char *logtext,
+                       const char *ds_err, const char *us_err) {}
+unsigned ssh_alloc_sharing_channel(Ssh ssh, void *sharing_ctx)
+{
+    return TEST_UPSTREAM_ID;
+}
+void ssh_delete_sharing_channel(Ssh ssh, unsigned localid) {}
+int ssh_alloc_sharing_rportfwd(Ssh ssh, const char *shost, int sport,
+                               void *share_ctx) { return FALSE; }
+void ssh_sharing_queue_global_request(Ssh ssh, void *share_ctx) {}
+struct X11FakeAuth *ssh_sharing_add_x11_display(Ssh ssh, int authtype,
+                                                void *share_cs,
+                                                void *share_chan)
+{
+    return NULL;
+}
+void ssh_sharing_remove_x11_display(Ssh ssh, struct X11FakeAuth *auth) {}
+void ssh_sharing_downstream_connected(Ssh ssh, unsigned id) {}
+void ssh_sharing_downstream_disconnected(Ssh ssh, unsigned id) {}
+void ssh_sharing_logf(Ssh ssh, unsigned id, const char *logfmt, ...) {}
+int ssh_agent_forwarding_permitted(Ssh ssh) { return FALSE; }
+void *x11_make_greeting(int endian, int protomajor, int protominor,
+                        int auth_proto, const void *auth_data, int auth_len,
+                        const char *peer_ip, int peer_port,
+                        int *outlen)
+{
+    *outlen = 0;
+    return NULL;
+}
+int x11_identify_auth_proto(const char *proto) { return -1; }
+void *x11_dehexify(const char *hex, int *outlen) { return NULL; }
+int platform_ssh_share(const char *name, Conf *conf,
+                       Plug downplug, Plug upplug, Socket *sock,
+                       char **logtext, char **ds_err, char **us_err,
+                       int can_upstream, int can_downstream)
+{
+    return SHARE_NONE;
+}
+void platform_ssh_share_cleanup(const char *name) {}
+char *get_remote_username(Conf *conf) { return NULL; }
+
+void ssh_send_packet_from_downstream(Ssh ssh, unsigned id, int type,
+                                     const void *vpkt, int pktlen,
+                                     const char *additional_log_text)
+{
+    const unsigned char *pkt = (const unsigned char *)vpkt;
+    int len;
+
+    switch (type) {
+      case SSH2_MSG_CHANNEL_OPEN:
+        server.opened = TRUE;
+        break;
+      case SSH2_MSG_CHANNEL_DATA:
+        if (pktlen < 8 || GET_32BIT(pkt) != TEST_SERVER_ID) {
+            server.bad_messages++;
+            break;
+        }
+        len = toint(GET_32BIT(pkt + 4));
+        if (len != pktlen - 8 || len > TEST_SERVER_MAXPKT) {
+            server.bad_messages++;
+            break;
+        }
+        server.data = sresize(server.data, server.datalen + len,
+                              unsigned char);
+        memcpy(server.data + server.datalen, pkt + 8, len);
+        server.datalen += len;
+        break;
+      default:
+        server.bad_messages++;
+        break;
+    }
+}
+
+/* The downstream's end of its connection to the upstream */
+
+static Plug test_sk_plug(Socket s, Plug p) { return NULL; }
+static void test_sk_close(Socket s) {}
+static int test_sk_write(Socket s, const char *data, int len)
+{
+    to_downstream = sresize(to_downstream, to_downstream_len + len,
+                            unsigned char);
+    memcpy(to_downstream + to_downstream_len, data, len);
+    to_downstream_len += len;
+    return 0;
+}
+static int test_sk_write_oob(Socket s, const char *data, int len)
+{
+    return 0;
+}
+static void test_sk_write_eof(Socket s) {}
+static void test_sk_flush(Socket s) {}
+static void test_sk_set_frozen(Socket s, int is_frozen) {}
+static const char *test_sk_socket_error(Socket s) { return NULL; }
+
+static const struct socket_function_table test_socket_fn_table = {
+    test_sk_plug,
+    test_sk_close,
+    test_sk_write,
+    test_sk_write_oob,
+    test_sk_write_eof,
+    test_sk_flush,
+    test_sk_set_frozen,
+    test_sk_socket_error
+};
+static const struct socket_function_table *test_socket = &test_socket_fn_table;
+
+static Socket test_accept(accept_ctx_t ctx, Plug plug)
+{
+    return (Socket)&test_socket;
+}
+
+/* Sends a message to the upstream in pieces of odd sizes, until it
+ * disconnects the downstream */
+static void send_to_upstream(struct ssh_sharing_connstate *cs, int type,
+                             const unsigned char *payload, int len)
+{
+    unsigned char *msg = snewn(len + 5, unsigned char);
+    int pos, piece;
+
+    PUT_32BIT(msg, len + 1);
+    msg[4] = type;
+    memcpy(msg + 5, payload, len);
+    for (pos = 0; pos < len + 5 && cs->sock; pos += piece) {
+        piece = len + 5 - pos < 1000 ? len + 5 - pos : 1000;
+        share_receive((Plug)cs, 0, (char *)msg + pos, piece);
+    }
+    sfree(msg);
+}
+
+int main(void)
+{
+    static const char verstring[] =
+        "SSHCONNECTION@putty.projects.tartarus.org-2.0-fzsharetest\r\n";
+    struct ssh_sharing_state *sharestate;
+    struct ssh_sharing_connstate *cs;
+    unsigned char pkt[64], *data, *msg;
+    unsigned maxpkt;
+    int i, pos, len, total = 1024 * 1024 + 123;
+    accept_ctx_t ctx;
+    int fails = 0;
+
+    sharestate = snew(struct ssh_sharing_state);
+    sharestate->fn = NULL;
+    sharestate->sockname = NULL;
+    sharestate->listensock = NULL;
+    sharestate->connections = newtree234(share_connstate_cmp);
+    sharestate->nextid = 1;
+    sharestate->ssh = NULL;
+    sharestate->server_verstring = NULL;
+
+    ctx.p = NULL;
+    share_listen_accepting((Plug)sharestate, test_accept, ctx);
+    cs = (struct ssh_sharing_connstate *)index234(sharestate->connections, 0);
+    assert(cs);
+    share_activate(sharestate, "SSH-2.0-fzsharetest");
+    share_receive((Plug)cs, 0, (char *)verstring, sizeof(verstring) - 1);
+
+    /* Skip the upstream's version string */
+    msg = memchr(to_downstream, '\n', to_downstream_len);
+    assert(msg);
+    pos = msg + 1 - to_downstream;
+
+    /* Downstream opens a session channel... */
+    PUT_32BIT(pkt, 7);
+    memcpy(pkt + 4, "session", 7);
+    PUT_32BIT(pkt + 11, TEST_DOWNSTREAM_ID);
+    PUT_32BIT(pkt + 15, 0x10000);
+    PUT_32BIT(pkt + 19, 0x8400);
+    send_to_upstream(cs, SSH2_MSG_CHANNEL_OPEN, pkt, 23);
+    if (!server.opened) {
+        printf("FAIL: CHANNEL_OPEN did not reach the server\n");
+        fails++;
+    }
+
+    /* ...which the server confirms with its usual maximum packet size */
+    PUT_32BIT(pkt, TEST_UPSTREAM_ID);
+    PUT_32BIT(pkt + 4, TEST_SERVER_ID);
+    PUT_32BIT(pkt + 8, 0x200000);
+    PUT_32BIT(pkt + 12, TEST_SERVER_MAXPKT);
+    share_got_pkt_from_server(cs, SSH2_MSG_CHANNEL_OPEN_CONFIRMATION,
+                              pkt, 16);
+
+    assert(to_downstream_len - pos >= 21);
+    msg = to_downstream + pos;
+    assert(msg[4] == SSH2_MSG_CHANNEL_OPEN_CONFIRMATION);
+    assert(GET_32BIT(msg + 5) == TEST_DOWNSTREAM_ID);
+    maxpkt = GET_32BIT(msg + 17);
+    if (maxpkt + 9 + 4 > SHARE_MAX_MESSAGE) {
+        printf("FAIL: maximum packet size %u too large for sharing\n",
+               maxpkt);
+        fails++;
+    }
+
+    /* Upload, each CHANNEL_DATA as large as permitted */
+    data = snewn(total, unsigned char);
+    for (i = 0; i < total; i++)
+        data[i] = (unsigned char)(i * 7 + (i >> 11));
+    msg = snewn(maxpkt + 8, unsigned char);
+    for (pos = 0; pos < total && cs->sock; pos += len) {
+        len = total - pos < (int)maxpkt ? total - pos : (int)maxpkt;
+        PUT_32BIT(msg, TEST_SERVER_ID);
+        PUT_32BIT(msg + 4, len);
+        memcpy(msg + 8, data + pos, len);
+        send_to_upstream(cs, SSH2_MSG_CHANNEL_DATA, msg, len + 8);
+    }
+    sfree(msg);
+
+    /* The downstream's socket is gone if it got disconnected */
+    if (!cs->sock) {
+        printf("FAIL: downstream disconnected during the upload\n");
+        fails++;
+    }
+    if (server.bad_messages) {
+        printf("FAIL: %d bad messages reached the server\n",
+               server.bad_messages);
+        fails++;
+    }
+    if (server.datalen != total || memcmp(server.data, data, total)) {
+        printf("FAIL: server received %d of %d bytes or wrong data\n",
+               server.datalen, total);
+        fails++;
+    }
+    sfree(data);
+
+    printf("%s\n", fails ? "FAILED" : "PASSED");
+    return fails ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,729 @@
+/*
+ * Curve25519 key exchange for SSH-2
+ *
+ * Protocol spec:
+ *  https://tools.ietf.org/html/rfc8731
+ *  (previously curve25519-sha256@libssh.org)
+ *
+ * X25519 spec:
+ *  https://tools.ietf.org/html/rfc7748
+ *
+ * Unlike the NIST curves in sshecc.c this doesn't go through the
+ * generic bignum code. The field elements have a fixed size, so they
+ * are kept in five 51-bit limbs where the compiler has a 128-bit
+ * integer type to hold the products, or in sixteen 16-bit limbs in
+ * 64-bit integers otherwise. The scalar multiplication is a Montgomery
+ * ladder with a constant number of steps and conditional swaps done by
+ * masking, so its timing doesn't depend on the private key.
+ *
+ * Both sides send their 32-byte public value as a string. The shared
+ * secret K is the 32-byte X25519 result read as a big-endian number.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ssh.h"
+
+#if defined(__GNUC__) && defined(__SIZEOF_INT128__)
+#define X25519_RADIX51
+#endif
+
+#if defined(_MSC_VER) && _MSC_VER < 1800
+typedef unsigned __int64 x25519_u64;
+typedef __int64 x25519_i64;
+#else
+typedef unsigned long long x25519_u64;
+typedef long long x25519_i64;
+#endif
+
+#define X25519_LEN 32
+
+#ifdef X25519_RADIX51
+
+/* Field elements modulo 2^255-19, five limbs of 51 bits */
+
+typedef __uint128_t x25519_u128;
+typedef x25519_u64 fe[5];
+
+#define FE_MASK51 ((((x25519_u64)1) << 51) - 1)
+
+static void fe_0(fe h)
+{
+    h[0] = h[1] = h[2] = h[3] = h[4] = 0;
+}
+
+static void fe_1(fe h)
+{
+    h[0] = 1;
+    h[1] = h[2] = h[3] = h[4] = 0;
+}
+
+static void fe_copy(fe h, const fe f)
+{
+    memcpy(h, f, sizeof(fe));
+}
+
+static x25519_u64 load64_le(const unsigned char *p)
+{
+    return ((x25519_u64)p[0]) | ((x25519_u64)p[1] << 8) |
+	((x25519_u64)p[2] << 16) | ((x25519_u64)p[3] << 24) |
+	((x25519_u64)p[4] << 32) | ((x25519_u64)p[5] << 40) |
+	((x25519_u64)p[6] << 48) | ((x25519_u64)p[7] << 56);
+}
+
+static void store64_le(unsigned char *p, x25519_u64 v)
+{
+    int i;
+    for (i = 0; i < 8; i++)
+	p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void fe_frombytes(fe h, const unsigned char *s)
+{
+    /* The top bit is ignored, as RFC 7748 requires */
+    h[0] = load64_le(s) & FE_MASK51;
+    h[1] = (load64_le(s + 6) >> 3) & FE_MASK51;
+    h[2] = (load64_le(s + 12) >> 6) & FE_MASK51;
+    h[3] = (load64_le(s + 19) >> 1) & FE_MASK51;
+    h[4] = (load64_le(s + 24) >> 12) & FE_MASK51;
+}
+
+static void fe_carry(x25519_u64 *t)
+{
+    t[1] += t[0] >> 51; t[0] &= FE_MASK51;
+    t[2] += t[1] >> 51; t[1] &= FE_MASK51;
+    t[3] += t[2] >> 51; t[2] &= FE_MASK51;
+    t[4] += t[3] >> 51; t[3] &= FE_MASK51;
+    t[0] += 19 * (t[4] >> 51); t[4] &= FE_MASK51;
+}
+
+static void fe_tobytes(unsigned char *s, const fe f)
+{
+    x25519_u64 t[5];
+
+    fe_copy(t, f);
+    fe_carry(t);
+    fe_carry(t);
+
+    /*
+     * t is now below 2^255 but may still be at least p. Adding 19
+     * carries into bit 255 exactly if it is, so do that, then add
+     * 2^255-19 and drop bit 255: either way that leaves t mod p.
+     */
+    t[0] += 19;
+    fe_carry(t);
+    t[0] += FE_MASK51 + 1 - 19;
+    t[1] += FE_MASK51;
+    t[2] += FE_MASK51;
+    t[3] += FE_MASK51;
+    t[4] += FE_MASK51;
+    t[1] += t[0] >> 51; t[0] &= FE_MASK51;
+    t[2] += t[1] >> 51; t[1] &= FE_MASK51;
+    t[3] += t[2] >> 51; t[2] &= FE_MASK51;
+    t[4] += t[3] >> 51; t[3] &= FE_MASK51;
+    t[4] &= FE_MASK51;
+
+    store64_le(s, t[0] | (t[1] << 51));
+    store64_le(s + 8, (t[1] >> 13) | (t[2] << 38));
+    store64_le(s + 16, (t[2] >> 26) | (t[3] << 25));
+    store64_le(s + 24, (t[3] >> 39) | (t[4] << 12));
+
+    smemclr(t, sizeof(t));
+}
+
+static void fe_add(fe h, const fe f, const fe g)
+{
+    h[0] = f[0] + g[0];
+    h[1] = f[1] + g[1];
+    h[2] = f[2] + g[2];
+    h[3] = f[3] + g[3];
+    h[4] = f[4] + g[4];
+}
+
+/* Inputs below 2^53 per limb; adds 4p first so nothing underflows */
+static void fe_sub(fe h, const fe f, const fe g)
+{
+    h[0] = f[0] + 0x1FFFFFFFFFFFB4ULL - g[0];
+    h[1] = f[1] + 0x1FFFFFFFFFFFFCULL - g[1];
+    h[2] = f[2] + 0x1FFFFFFFFFFFFCULL - g[2];
+    h[3] = f[3] + 0x1FFFFFFFFFFFFCULL - g[3];
+    h[4] = f[4] + 0x1FFFFFFFFFFFFCULL - g[4];
+}
+
+static void fe_reduce128(fe h, x25519_u128 *t)
+{
+    x25519_u64 c;
+
+    t[1] += (x25519_u64)(t[0] >> 51);
+    t[2] += (x25519_u64)(t[1] >> 51);
+    t[3] += (x25519_u64)(t[2] >> 51);
+    t[4] += (x25519_u64)(t[3] >> 51);
+    c = (x25519_u64)(t[4] >> 51);
+
+    h[0] = ((x25519_u64)t[0] & FE_MASK51) + 19 * c;
+    h[1] = (x25519_u64)t[1] & FE_MASK51;
+    h[2] = (x25519_u64)t[2] & FE_MASK51;
+    h[3] = (x25519_u64)t[3] & FE_MASK51;
+    h[4] = (x25519_u64)t[4] & FE_MASK51;
+    h[1] += h[0] >> 51;
+    h[0] &= FE_MASK51;
+}
+
+/* Inputs below 2^54 per limb */
+static void fe_mul(fe h, const fe f, const fe g)
+{
+    x25519_u128 t[5];
+    x25519_u64 g1_19 = 19 * g[1], g2_19 = 19 * g[2];
+    x25519_u64 g3_19 = 19 * g[3], g4_19 = 19 * g[4];
+
+    t[0] = (x25519_u128)f[0] * g[0] + (x25519_u128)f[1] * g4_19 +
+	(x25519_u128)f[2] * g3_19 + (x25519_u128)f[3] * g2_19 +
+	(x25519_u128)f[4] * g1_19;
+    t[1] = (x25519_u128)f[0] * g[1] + (x25519_u128)f[1] * g[0] +
+	(x25519_u128)f[2] * g4_19 + (x25519_u128)f[3] * g3_19 +
+	(x25519_u128)f[4] * g2_19;
+    t[2] = (x25519_u128)f[0] * g[2] + (x25519_u128)f[1] * g[1] +
+	(x25519_u128)f[2] * g[0] + (x25519_u128)f[3] * g4_19 +
+	(x25519_u128)f[4] * g3_19;
+    t[3] = (x25519_u128)f[0] * g[3] + (x25519_u128)f[1] * g[2] +
+	(x25519_u128)f[2] * g[1] + (x25519_u128)f[3] * g[0] +
+	(x25519_u128)f[4] * g4_19;
+    t[4] = (x25519_u128)f[0] * g[4] + (x25519_u128)f[1] * g[3] +
+	(x25519_u128)f[2] * g[2] + (x25519_u128)f[3] * g[1] +
+	(x25519_u128)f[4] * g[0];
+
+    fe_reduce128(h, t);
+}
+
+static void fe_sq(fe h, const fe f)
+{
+    x25519_u128 t[5];
+    x25519_u64 f0_2 = 2 * f[0], f1_2 = 2 * f[1];
+    x25519_u64 f3_19 = 19 * f[3], f4_19 = 19 * f[4];
+
+    t[0] = (x25519_u128)f[0] * f[0] + (x25519_u128)f1_2 * f4_19 +
+	(x25519_u128)(2 * f[2]) * f3_19;
+    t[1] = (x25519_u128)f0_2 * f[1] + (x25519_u128)(2 * f[2]) * f4_19 +
+	(x25519_u128)f[3] * f3_19;
+    t[2] = (x25519_u128)f0_2 * f[2] + (x25519_u128)f[1] * f[1] +
+	(x25519_u128)(2 * f[3]) * f4_19;
+    t[3] = (x25519_u128)f0_2 * f[3] + (x25519_u128)f1_2 * f[2] +
+	(x25519_u128)f[4] * f4_19;
+    t[4] = (x25519_u128)f0_2 * f[4] + (x25519_u128)f1_2 * f[3] +
+	(x25519_u128)f[2] * f[2];
+
+    fe_reduce128(h, t);
+}
+
+/* h = f * (A-2)/4, the constant of the ladder's doubling formula */
+static void fe_mul_a24(fe h, const fe f)
+{
+    x25519_u128 t[5];
+    int i;
+
+    for (i = 0; i < 5; i++)
+	t[i] = (x25519_u128)f[i] * 121665;
+    fe_reduce128(h, t);
+}
+
+static void fe_cswap(fe f, fe g, x25519_u64 swap)
+{
+    x25519_u64 mask = -swap, x;
+    int i;
+
+    for (i = 0; i < 5; i++) {
+	x = mask & (f[i] ^ g[i]);
+	f[i] ^= x;
+	g[i] ^= x;
+    }
+}
+
+#else
+
+/*
+ * Field elements modulo 2^255-19, sixteen limbs of 16 bits held in
+ * signed 64-bit integers, so the products and their sums never
+ * overflow. Slower than the above, but needs nothing beyond C89 with
+ * a 64-bit type.
+ */
+
+typedef x25519_i64 fe[16];
+
+static void fe_0(fe h)
+{
+    int i;
+    for (i = 0; i < 16; i++)
+	h[i] = 0;
+}
+
+static void fe_1(fe h)
+{
+    fe_0(h);
+    h[0] = 1;
+}
+
+static void fe_copy(fe h, const fe f)
+{
+    memcpy(h, f, sizeof(fe));
+}
+
+static void fe_carry(fe h)
+{
+    x25519_i64 c;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+	h[i] += (x25519_i64)1 << 16;
+	c = h[i] >> 16;
+	if (i < 15)
+	    h[i + 1] += c - 1;
+	else
+	    h[0] += 38 * (c - 1);
+	h[i] -= c * ((x25519_i64)1 << 16);
+    }
+}
+
+static void fe_frombytes(fe h, const unsigned char *s)
+{
+    int i;
+    for (i = 0; i < 16; i++)
+	h[i] = s[2 * i] + ((x25519_i64)s[2 * i + 1] << 8);
+    h[15] &= 0x7fff;
+}
+
+static void fe_cswap(fe f, fe g, x25519_u64 swap)
+{
+    x25519_i64 mask = -(x25519_i64)swap, x;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+	x = mask & (f[i] ^ g[i]);
+	f[i] ^= x;
+	g[i] ^= x;
+    }
+}
+
+static void fe_tobytes(unsigned char *s, const fe f)
+{
+    fe t, m;
+    x25519_i64 b;
+    int i, j;
+
+    fe_copy(t, f);
+    fe_carry(t);
+    fe_carry(t);
+    fe_carry(t);
+
+    /* Subtract p twice, keeping the result whenever it didn't borrow */
+    for (j = 0; j < 2; j++) {
+	m[0] = t[0] - 0xffed;
+	for (i = 1; i < 15; i++) {
+	    m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+	    m[i - 1] &= 0xffff;
+	}
+	m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+	b = (m[15] >> 16) & 1;
+	m[14] &= 0xffff;
+	fe_cswap(t, m, 1 - b);
+    }
+
+    for (i = 0; i < 16; i++) {
+	s[2 * i] = (unsigned char)(t[i] & 0xff);
+	s[2 * i + 1] = (unsigned char)(t[i] >> 8);
+    }
+
+    smemclr(t, sizeof(t));
+    smemclr(m, sizeof(m));
+}
+
+static void fe_add(fe h, const fe f, const fe g)
+{
+    int i;
+    for (i = 0; i < 16; i++)
+	h[i] = f[i] + g[i];
+}
+
+static void fe_sub(fe h, const fe f, const fe g)
+{
+    int i;
+    for (i = 0; i < 16; i++)
+	h[i] = f[i] - g[i];
+}
+
+static void fe_mul(fe h, const fe f, const fe g)
+{
+    x25519_i64 t[31];
+    int i, j;
+
+    for (i = 0; i < 31; i++)
+	t[i] = 0;
+    for (i = 0; i < 16; i++)
+	for (j = 0; j < 16; j++)
+	    t[i + j] += f[i] * g[j];
+    for (i = 0; i < 15; i++)
+	t[i] += 38 * t[i + 16];
+    for (i = 0; i < 16; i++)
+	h[i] = t[i];
+    fe_carry(h);
+    fe_carry(h);
+}
+
+static void fe_sq(fe h, const fe f)
+{
+    fe_mul(h, f, f);
+}
+
+static void fe_mul_a24(fe h, const fe f)
+{
+    static const fe a24 = { 0xdb41, 1 };
+    fe_mul(h, f, a24);
+}
+
+#endif
+
+/* h = f^(p-2) = 1/f, with the usual chain of 254 squarings */
+static void fe_invert(fe h, const fe f)
+{
+    fe t0, t1, t2, t3;
+    int i;
+
+    fe_sq(t0, f);                                       /* 2 */
+    fe_sq(t1, t0);
+    fe_sq(t1, t1);                                      /* 8 */
+    fe_mul(t1, f, t1);                                  /* 9 */
+    fe_mul(t0, t0, t1);                                 /* 11 */
+    fe_sq(t2, t0);                                      /* 22 */
+    fe_mul(t1, t1, t2);                                 /* 2^5 - 1 */
+    fe_sq(t2, t1);
+    for (i = 1; i < 5; i++)
+	fe_sq(t2, t2);
+    fe_mul(t1, t2, t1);                                 /* 2^10 - 1 */
+    fe_sq(t2, t1);
+    for (i = 1; i < 10; i++)
+	fe_sq(t2, t2);
+    fe_mul(t2, t2, t1);                                 /* 2^20 - 1 */
+    fe_sq(t3, t2);
+    for (i = 1; i < 20; i++)
+	fe_sq(t3, t3);
+    fe_mul(t2, t3, t2);                                 /* 2^40 - 1 */
+    for (i = 0; i < 10; i++)
+	fe_sq(t2, t2);
+    fe_mul(t1, t2, t1);                                 /* 2^50 - 1 */
+    fe_sq(t2, t1);
+    for (i = 1; i < 50; i++)
+	fe_sq(t2, t2);
+    fe_mul(t2, t2, t1);                                 /* 2^100 - 1 */
+    fe_sq(t3, t2);
+    for (i = 1; i < 100; i++)
+	fe_sq(t3, t3);
+    fe_mul(t2, t3, t2);                                 /* 2^200 - 1 */
+    for (i = 0; i < 50; i++)
+	fe_sq(t2, t2);
+    fe_mul(t1, t2, t1);                                 /* 2^250 - 1 */
+    for (i = 0; i < 5; i++)
+	fe_sq(t1, t1);
+    fe_mul(h, t1, t0);                                  /* 2^255 - 21 */
+
+    smemclr(t0, sizeof(t0));
+    smemclr(t1, sizeof(t1));
+    smemclr(t2, sizeof(t2));
+    smemclr(t3, sizeof(t3));
+}
+
+/*
+ * out = scalar * point, all little-endian as on the wire. The scalar
+ * is clamped here as RFC 7748 requires.
+ */
+static void x25519(unsigned char *out, const unsigned char *scalar,
+		   const unsigned char *point)
+{
+    unsigned char e[X25519_LEN];
+    fe x1, x2, z2, x3, z3, a, aa, b, bb, ee, c, d, da, cb;
+    x25519_u64 swap = 0, bit;
+    int t;
+
+    memcpy(e, scalar, X25519_LEN);
+    e[0] &= 248;
+    e[31] &= 127;
+    e[31] |= 64;
+
+    fe_frombytes(x1, point);
+    fe_1(x2);
+    fe_0(z2);
+    fe_copy(x3, x1);
+    fe_1(z3);
+
+    for (t = 254; t >= 0; t--) {
+	bit = (e[t >> 3] >> (t & 7)) & 1;
+	swap ^= bit;
+	fe_cswap(x2, x3, swap);
+	fe_cswap(z2, z3, swap);
+	swap = bit;
+
+	fe_add(a, x2, z2);
+	fe_sq(aa, a);
+	fe_sub(b, x2, z2);
+	fe_sq(bb, b);
+	fe_sub(ee, aa, bb);
+	fe_add(c, x3, z3);
+	fe_sub(d, x3, z3);
+	fe_mul(da, d, a);
+	fe_mul(cb, c, b);
+
+	fe_add(x3, da, cb);
+	fe_sq(x3, x3);
+	fe_sub(z3, da, cb);
+	fe_sq(z3, z3);
+	fe_mul(z3, z3, x1);
+	fe_mul(x2, aa, bb);
+	fe_mul_a24(z2, ee);
+	fe_add(z2, z2, aa);
+	fe_mul(z2, z2, ee);
+    }
+    fe_cswap(x2, x3, swap);
+    fe_cswap(z2, z3, swap);
+
+    fe_invert(z2, z2);
+    fe_mul(x2, x2, z2);
+    fe_tobytes(out, x2);
+
+    smemclr(e, sizeof(e));
+    smemclr(x2, sizeof(x2));
+    smemclr(z2, sizeof(z2));
+    smemclr(x3, sizeof(x3));
+    smemclr(z3, sizeof(z3));
+    smemclr(a, sizeof(a));
+    smemclr(aa, sizeof(aa));
+    smemclr(b, sizeof(b));
+    smemclr(bb, sizeof(bb));
+    smemclr(ee, sizeof(ee));
+    smemclr(c, sizeof(c));
+    smemclr(d, sizeof(d));
+    smemclr(da, sizeof(da));
+    smemclr(cb, sizeof(cb));
+}
+
+/* Key exchange */
+
+struct x25519_key {
+    unsigned char privkey[X25519_LEN];
+    unsigned char pubkey[X25519_LEN];
+};
+
+static void *x25519_newkey(const struct ssh_ecdhkex *alg)
+{
+    static const unsigned char basepoint[X25519_LEN] = { 9 };
+    struct x25519_key *key = snew(struct x25519_key);
+    int i;
+
+    for (i = 0; i < X25519_LEN; i++)
+	key->privkey[i] = (unsigned char)random_byte();
+    x25519(key->pubkey, key->privkey, basepoint);
+
+    return key;
+}
+
+static void x25519_freekey(void *key)
+{
+    smemclr(key, sizeof(struct x25519_key));
+    sfree(key);
+}
+
+static char *x25519_getpublic(void *key, int *len)
+{
+    struct x25519_key *x = (struct x25519_key *)key;
+    char *ret = snewn(X25519_LEN, char);
+
+    memcpy(ret, x->pubkey, X25519_LEN);
+    *len = X25519_LEN;
+    return ret;
+}
+
+static Bignum x25519_getkey(void *key, char *remoteKey, int remoteKeyLen)
+{
+    struct x25519_key *x = (struct x25519_key *)key;
+    unsigned char shared[X25519_LEN], nonzero = 0;
+    Bignum ret;
+    int i;
+
+    if (remoteKeyLen != X25519_LEN)
+	return NULL;
+
+    x25519(shared, x->privkey, (const unsigned char *)remoteKey);
+
+    /*
+     * A point of small order gives an all-zero secret whatever our
+     * key is, and RFC 8731 says to abort then.
+     */
+    for (i = 0; i < X25519_LEN; i++)
+	nonzero |= shared[i];
+    if (!nonzero)
+	return NULL;
+
+    ret = bignum_from_bytes(shared, X25519_LEN);
+    smemclr(shared, sizeof(shared));
+    return ret;
+}
+
+const struct ssh_ecdhkex ssh_ecdhkex_x25519 = {
+    x25519_newkey, x25519_freekey, x25519_getpublic, x25519_getkey,
+    NULL, "Curve25519"
+};
+
+#ifdef TESTX25519
+
+/*
+ * Known-answer tests from RFC 7748 and a benchmark of the key
+ * exchange arithmetic:
+ *
+ * gcc -O2 -DTESTX25519 -o fzx25519test sshx25519.c sshbn.c misc.c conf.c tree234.c unix/uxmisc.c -I. -I unix
+ *
+ * or `make fzx25519test'.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+void modalfatalbox(char *p, ...)
+{
+    va_list ap;
+    fprintf(stderr, "FATAL ERROR: ");
+    va_start(ap, p);
+    vfprintf(stderr, p, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+int random_byte(void)
+{
+    return rand() & 0xFF;
+}
+
+static int passes, fails;
+
+static void unhex(unsigned char *out, const char *hex)
+{
+    unsigned int b;
+    while (*hex) {
+	sscanf(hex, "%2x", &b);
+	*out++ = (unsigned char)b;
+	hex += 2;
+    }
+}
+
+static void check(const char *what, const unsigned char *got,
+		  const char *expected_hex)
+{
+    unsigned char expected[X25519_LEN];
+
+    unhex(expected, expected_hex);
+    if (memcmp(got, expected, X25519_LEN)) {
+	printf("FAIL: %s\n", what);
+	fails++;
+    } else
+	passes++;
+}
+
+static double now(void)
+{
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned char k[X25519_LEN], u[X25519_LEN], out[X25519_LEN];
+    int i, n;
+    double start, elapsed;
+
+    /* RFC 7748 section 5.2 */
+    unhex(k, "a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4");
+    unhex(u, "e6db6867583030db3594c1a424b15f7c726624ec26b3353b10a903a6d0ab1c4c");
+    x25519(out, k, u);
+    check("RFC 7748 vector 1", out,
+	  "c3da55379de9c6908e94ea4df28d084f32eccf03491c71f754b4075577a28552");
+
+    unhex(k, "4b66e9d4d1b4673c5ad22691957d6af5c11b6421e0ea01d42ca4169e7918ba0d");
+    unhex(u, "e5210f12786811d3f4b7959d0538ae2c31dbe7106fc03c3efc4cd549c715a493");
+    x25519(out, k, u);
+    check("RFC 7748 vector 2", out,
+	  "95cbde9476e8907d7aade45cb4b873f88b595a68799fa152e6f8f7647aac7957");
+
+    /* Iterating k = x25519(k, u), u = old k, from k = u = 9 */
+    memset(k, 0, sizeof(k));
+    k[0] = 9;
+    memcpy(u, k, sizeof(u));
+    for (i = 1; i <= 1000; i++) {
+	x25519(out, k, u);
+	memcpy(u, k, sizeof(u));
+	memcpy(k, out, sizeof(k));
+	if (i == 1)
+	    check("RFC 7748 iteration 1", k,
+		  "422c8e7a6227d7bca1350b3e2bb7279f7897b87bb6854b783c60e80311ae3079");
+    }
+    check("RFC 7748 iteration 1000", k,
+	  "684cf59ba83309552800ef566f2f4d3c1c3887c49360e3875f2eb94d99532c51");
+
+    /* RFC 7748 section 6.1, both sides of a key exchange */
+    {
+	static const unsigned char basepoint[X25519_LEN] = { 9 };
+	unsigned char a[X25519_LEN], b[X25519_LEN];
+	unsigned char apub[X25519_LEN], bpub[X25519_LEN];
+	Bignum ka, kb;
+	struct x25519_key key;
+	unsigned char kbuf[X25519_LEN];
+
+	unhex(a, "77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a");
+	unhex(b, "5dab087e624a8a4b79e17f8b83800ee66f3bb1292618b6fd1c2f8b27ff88e0eb");
+	x25519(apub, a, basepoint);
+	check("RFC 7748 Alice public", apub,
+	      "8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a");
+	x25519(bpub, b, basepoint);
+	check("RFC 7748 Bob public", bpub,
+	      "de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f");
+
+	memcpy(key.privkey, a, X25519_LEN);
+	ka = x25519_getkey(&key, (char *)bpub, X25519_LEN);
+	memcpy(key.privkey, b, X25519_LEN);
+	kb = x25519_getkey(&key, (char *)apub, X25519_LEN);
+	for (i = 0; i < X25519_LEN; i++)
+	    kbuf[i] = bignum_byte(ka, X25519_LEN - 1 - i);
+	check("RFC 7748 shared secret", kbuf,
+	      "4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742");
+	if (bignum_cmp(ka, kb)) {
+	    printf("FAIL: shared secrets differ\n");
+	    fails++;
+	} else
+	    passes++;
+	freebn(ka);
+	freebn(kb);
+
+	/* A point of order 1 must be rejected */
+	memset(u, 0, sizeof(u));
+	if (x25519_getkey(&key, (char *)u, X25519_LEN)) {
+	    printf("FAIL: zero shared secret accepted\n");
+	    fails++;
+	} else
+	    passes++;
+    }
+
+    printf("passed %d failed %d total %d\n", passes, fails, passes + fails);
+
+    n = argc > 1 ? atoi(argv[1]) : 2000;
+    start = now();
+    for (i = 0; i < n; i++)
+	x25519(out, k, u);
+    elapsed = now() - start;
+#ifdef X25519_RADIX51
+    printf("radix 2^51: ");
+#else
+    printf("radix 2^16: ");
+#endif
+    printf("%.1f scalar multiplications per second\n", n / elapsed);
+
+    return fails != 0;
+}
+
+#endif
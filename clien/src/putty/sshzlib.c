@@ -608,7 +608,10 @@ static void zlib_match(struct LZ77Context *ectx, int distance, int len)
     }
 }
 
-void *zlib_compress_init(void)
+/*
+ * There is only the one way of compressing, so the level is ignored.
+ */
+void *zlib_compress_init(int level)
 {
     struct Outbuf *out;
     struct LZ77Context *ectx = snew(struct LZ77Context);
@@ -94,6 +94,7 @@ struct Socket_tag {
     SockAddrStep step;
 
     _fztimer send_timer, recv_timer;
+    int metered;		       /* FZ: takes from the rate limit quota */
     /*
      * We sometimes need pairs of Socket structures to be linked:
      * if we are listening on the same IPv6 and v4 port, for
@@ -500,6 +501,21 @@ static struct socket_function_table tcp_fn_table = {
     sk_tcp_socket_error
 };
 
+/*
+ * FZ: Shared SSH connections between our instances go over Unix
+ * sockets. Only the upstream's network connection takes from the
+ * quota, otherwise shared traffic would be counted twice.
+ */
+static int is_metered(int fd)
+{
+    union sockaddr_union su;
+    socklen_t addrlen = sizeof(su);
+
+    if (getsockname(fd, &su.sa, &addrlen) == 0 && su.sa.sa_family == AF_UNIX)
+	return 0;
+    return 1;
+}
+
 static Socket sk_tcp_accept(accept_ctx_t ctx, Plug plug)
 {
     int sockfd = ctx.i;
@@ -527,6 +543,7 @@ static Socket sk_tcp_accept(accept_ctx_t ctx, Plug plug)
     ret->connected = 1;
 
     ret->s = sockfd;
+    ret->metered = is_metered(sockfd);
     fz_timer_init(&ret->recv_timer);
     fz_timer_init(&ret->send_timer);
 
@@ -590,7 +607,7 @@ static int try_connect(Actual_Socket sock)
         }
     }
 
-    /*if (sock->nodelay)*/ {
+    /*if (sock->nodelay)*/ if (family != AF_UNIX) {
 	int b = TRUE;
 	if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY,
                        (void *) &b, sizeof(b)) < 0) {
@@ -779,6 +796,7 @@ Socket sk_new(SockAddr addr, int port, int privport, int oobinline,
     ret->keepalive = keepalive;
     ret->privport = privport;
     ret->port = port;
+    ret->metered = addr->superfamily != UNIX;
     fz_timer_init(&ret->recv_timer);
     fz_timer_init(&ret->send_timer);
 
@@ -826,6 +844,7 @@ Socket sk_newlistener(char *srcaddr, int port, Plug plug, int local_host_only, i
     ret->outgoingeof = EOF_NO;
     ret->incomingeof = FALSE;
     ret->listener = 1;
+    ret->metered = 0;
     ret->addr = NULL;
     ret->s = -1;
     fz_timer_init(&ret->recv_timer);
@@ -1105,7 +1124,7 @@ void try_send(Actual_Socket s)
 	    urgentflag = 0;
 	    bufchain_prefix(&s->output_data, &data, &len);
 	}
-	toSend = RequestQuota(1, len);
+	toSend = s->metered ? RequestQuota(1, len) : len;
 	nsent = send(s->s, data, toSend, urgentflag);
 	noise_ultralight(nsent);
 	if (nsent <= 0) {
@@ -1141,7 +1160,8 @@ void try_send(Actual_Socket s)
 		return;
 	    }
 	} else {
-	    UpdateQuota(1, nsent);
+	    if (s->metered)
+		UpdateQuota(1, nsent);
 	    if (fz_timer_check(&s->send_timer))
 		fznotify(sftpSend);
 	    if (s->sending_oob) {
@@ -1276,7 +1296,7 @@ static int net_select_result(int fd, int event)
 	     * data, which we will send to the back end with
 	     * type==2 (urgent data).
 	     */
-	    toRecv = RequestQuota(0, sizeof(buf));
+	    toRecv = s->metered ? RequestQuota(0, sizeof(buf)) : sizeof(buf);
 	    ret = recv(s->s, buf, toRecv, MSG_OOB);
 	    noise_ultralight(ret);
 	    if (ret <= 0) {
@@ -1284,7 +1304,8 @@ static int net_select_result(int fd, int event)
 				    ret == 0 ? "Internal networking trouble" :
 				    strerror(errno), errno, 0);
 	    } else {
-		UpdateQuota(0, ret);
+		if (s->metered)
+		    UpdateQuota(0, ret);
 		if (fz_timer_check(&s->recv_timer))
 		    fznotify(sftpRecv);
                 /*
@@ -1360,7 +1381,9 @@ static int net_select_result(int fd, int event)
 	} else
 	    atmark = 1;
 
-	toRecv = RequestQuota(0, s->oobpending ? 1 : sizeof(buf));
+	toRecv = s->oobpending ? 1 : sizeof(buf);
+	if (s->metered)
+	    toRecv = RequestQuota(0, toRecv);
 	ret = recv(s->s, buf, toRecv, 0);
 	noise_ultralight(ret);
 	if (ret < 0) {
@@ -1389,7 +1412,8 @@ static int net_select_result(int fd, int event)
             uxsel_tell(s);
 	    return plug_closing(s->plug, NULL, 0, 0);
 	} else {
-	    UpdateQuota(0, ret);
+	    if (s->metered)
+		UpdateQuota(0, ret);
 	    if (fz_timer_check(&s->recv_timer))
 		fznotify(sftpRecv);
             /*
@@ -1582,6 +1606,7 @@ Socket new_unix_listener(SockAddr listenaddr, Plug plug)
     ret->outgoingeof = EOF_NO;
     ret->incomingeof = FALSE;
     ret->listener = 1;
+    ret->metered = 0;
     ret->addr = listenaddr;
     ret->s = -1;
 
@@ -13,6 +13,7 @@
 #include <errno.h>
 #include <assert.h>
 #include <glob.h>
+#include <poll.h>
 #ifndef HAVE_NO_SYS_SELECT_H
 #include <sys/select.h>
 #endif
@@ -222,6 +223,22 @@ WFile *open_existing_wfile(char *name, uint64 *size)
     return ret;
 }
 
+WFile *open_shared_wfile(char *name)
+{
+    int fd;
+    WFile *ret;
+
+    fd = open(name, O_CREAT | O_WRONLY, 0666);
+    if (fd < 0)
+	return NULL;
+
+    ret = snew(WFile);
+    ret->fd = fd;
+    ret->name = dupstr(name);
+
+    return ret;
+}
+
 int write_to_file(WFile *f, void *buffer, int length)
 {
     char *p = (char *)buffer;
@@ -554,11 +571,27 @@ static int ssh_sftp_do_select(int include_stdin, int no_fds_ok)
     return FD_ISSET(0, &rset) ? 1 : 0;
 }
 
+/*
+ * FZ: While busy we do not read our input, but still have to notice if
+ * FileZilla closes it.
+ */
+static void check_input_closed(void)
+{
+    struct pollfd pfd;
+
+    pfd.fd = 0;
+    pfd.events = 0;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR)))
+	FileZillaGone();
+}
+
 /*
  * Wait for some network data and process it.
  */
 int ssh_sftp_loop_iteration(void)
 {
+    check_input_closed();
     return ssh_sftp_do_select(FALSE, FALSE);
 }
 
@@ -601,6 +634,29 @@ char *ssh_sftp_get_cmdline(char *prompt, int no_fds_ok)
     }
 }
 
+int ssh_sftp_detach(void)
+{
+    pid_t pid;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    /* FileZilla waits for its child to exit, a copy of it keeps going */
+    pid = fork();
+    if (pid < 0)
+	return FALSE;
+    if (pid > 0)
+	_exit(0);
+
+    setsid();
+    if (!freopen("/dev/null", "r", stdin) ||
+	!freopen("/dev/null", "w", stdout) ||
+	!freopen("/dev/null", "w", stderr))
+	_exit(1);
+
+    return TRUE;
+}
+
 void frontend_net_error_pending(void) {}
 
 /*
@@ -119,10 +119,10 @@ int verify_ssh_host_key(void *frontend, char *host, int port, char *keytype,
 	    fprintf(stderr, wrongmsg_batch, keytype, fingerprint);
             return 0;
 	}
-	fzprintf_raw(sftpRequest, "%d%s\n%d\n%s\n", (int)sftpReqHostkeyChanged, host, port, fingerprint);
+	fzrequest_hostkey(sftpReqHostkeyChanged, host, port, fingerprint);
     }
     if (ret == 1) {		       /* key was absent */
-	fzprintf_raw(sftpRequest, "%d%s\n%d\n%s\n", (int)sftpReqHostkey, host, port, fingerprint);
+	fzrequest_hostkey(sftpReqHostkey, host, port, fingerprint);
     }
 
     hin = GetStdHandle(STD_INPUT_HANDLE);
@@ -368,7 +368,7 @@ int console_get_userpass_input(prompts_t *p, unsigned char *in, int inlen)
 	//    newmode |= ENABLE_ECHO_INPUT;
 	SetConsoleMode(hin, newmode);
 
-	fzprintf_raw_untrusted(sftpRequest, "%d%s\n", (int)sftpReqPassword, pr->prompt);
+	fzrequest_password(pr->prompt);
 	
         len = 0;
         while (1) {
@@ -245,6 +245,27 @@ WFile *open_existing_wfile(char *name, uint64 *size)
     return ret;
 }
 
+WFile *open_shared_wfile(char *name)
+{
+    HANDLE h;
+    WFile *ret;
+
+    wchar_t* wname = utf8_to_wide(name);
+    if (!wname)
+	return NULL;
+
+    h = CreateFileW(wname, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		    NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    sfree(wname);
+    if (h == INVALID_HANDLE_VALUE)
+	return NULL;
+
+    ret = snew(WFile);
+    ret->h = h;
+
+    return ret;
+}
+
 int write_to_file(WFile *f, void *buffer, int length)
 {
     int ret;
@@ -707,6 +728,19 @@ int do_eventsel_loop(HANDLE other_event)
     return 0;
 }
 
+/*
+ * FZ: While busy we do not read our input, but still have to notice if
+ * FileZilla closes it.
+ */
+static void check_input_closed(void)
+{
+    DWORD avail;
+
+    if (!PeekNamedPipe(GetStdHandle(STD_INPUT_HANDLE), NULL, 0, NULL, &avail, NULL) &&
+	GetLastError() == ERROR_BROKEN_PIPE)
+	FileZillaGone();
+}
+
 /*
  * Wait for some network data and process it.
  *
@@ -718,6 +752,8 @@ int do_eventsel_loop(HANDLE other_event)
  */
 int ssh_sftp_loop_iteration(void)
 {
+    check_input_closed();
+
     if (p_WSAEventSelect == NULL) {
 	fd_set readfds;
 	int ret;
@@ -838,6 +874,23 @@ char *ssh_sftp_get_cmdline(char *prompt, int no_fds_ok)
     return ctx->line;
 }
 
+int ssh_sftp_detach(void)
+{
+    fflush(stdout);
+    fflush(stderr);
+
+    /*
+     * Closing our end of the pipes tells FileZilla not to wait for us,
+     * we keep running on our own.
+     */
+    if (!freopen("NUL", "r", stdin) ||
+	!freopen("NUL", "w", stdout) ||
+	!freopen("NUL", "w", stderr))
+	return FALSE;
+
+    return TRUE;
+}
+
 /* ----------------------------------------------------------------------
  * Main program. Parse arguments etc.
  */
@@ -0,0 +1,295 @@
+#include <filezilla.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include "directorycache.h"
+
+#include <wx/file.h>
+#include <wx/filename.h>
+
+#include <map>
+
+/*
+ * This testsuite asserts the correctness of the size-based eviction and
+ * of the persistent tier of the CDirectoryCache class.
+ */
+
+namespace {
+class COptionsStub final : public COptionsBase
+{
+public:
+	virtual int GetOptionVal(unsigned int nID) { return m_int[nID]; }
+	virtual wxString GetOption(unsigned int nID) { return m_string[nID]; }
+
+	virtual bool SetOption(unsigned int nID, int value) { m_int[nID] = value; return true; }
+	virtual bool SetOption(unsigned int nID, wxString const& value) { m_string[nID] = value; return true; }
+
+private:
+	std::map<unsigned int, int> m_int;
+	std::map<unsigned int, wxString> m_string;
+};
+}
+
+class CDirectoryCacheTest : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(CDirectoryCacheTest);
+	CPPUNIT_TEST(testEviction);
+	CPPUNIT_TEST(testPersist);
+	CPPUNIT_TEST(testCorrupt);
+	CPPUNIT_TEST(testTruncated);
+	CPPUNIT_TEST(testInvalidateServer);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp();
+	void tearDown();
+
+	void testEviction();
+	void testPersist();
+	void testCorrupt();
+	void testTruncated();
+	void testInvalidateServer();
+
+protected:
+	// Each entry uses roughly nameBytes of memory for its name on top of
+	// the fixed per-entry overhead.
+	static CDirectoryListing MakeListing(wxString const& path, unsigned int count, size_t nameBytes = 16);
+
+	bool IsCached(CDirectoryCache & cache, wxString const& path);
+
+	void WriteFile(std::string const& data);
+	std::string ReadFile();
+
+	COptionsStub m_options;
+	CServer m_server;
+	wxString m_file;
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(CDirectoryCacheTest);
+
+void CDirectoryCacheTest::setUp()
+{
+	m_file = wxFileName::CreateTempFileName(_T("fzcache"));
+	CPPUNIT_ASSERT(!m_file.empty());
+
+	m_options.SetOption(OPTION_CACHE_SIZE_LIMIT, 1);
+	m_options.SetOption(OPTION_CACHE_PERSISTENT, 0);
+	m_options.SetOption(OPTION_CACHE_FILE, wxString());
+
+	m_server = CServer(SFTP, DEFAULT, _T("example.com"), 22, _T("user"), _T("secret"));
+}
+
+void CDirectoryCacheTest::tearDown()
+{
+	if (!m_file.empty())
+		wxRemoveFile(m_file);
+}
+
+CDirectoryListing CDirectoryCacheTest::MakeListing(wxString const& path, unsigned int count, size_t nameBytes)
+{
+	wxString const padding(_T('x'), nameBytes / sizeof(wxChar));
+
+	std::deque<CRefcountObject<CDirentry>> entries;
+	for (unsigned int i = 0; i < count; ++i) {
+		CRefcountObject<CDirentry> entry;
+		entry.Get().name = wxString::Format(_T("%u_"), i) + padding;
+		entry.Get().size = i;
+		entry.Get().flags = (i % 2) ? CDirentry::flag_dir : 0;
+		entry.Get().permissions = CRefcountObject<wxString>(_T("rw-r--r--"));
+		entry.Get().ownerGroup = CRefcountObject<wxString>(_T("user group"));
+		entry.Get().time = CDateTime(2015, 4, 1, 12, 30, static_cast<int>(i % 60));
+		if (i == 1)
+			entry.Get().target = CSparseOptional<wxString>(_T("/target"));
+		entries.push_back(entry);
+	}
+
+	CDirectoryListing listing;
+	listing.path = CServerPath(path);
+	listing.m_firstListTime = CMonotonicTime::Now();
+	listing.Assign(entries);
+	return listing;
+}
+
+bool CDirectoryCacheTest::IsCached(CDirectoryCache & cache, wxString const& path)
+{
+	CDirectoryListing listing;
+	bool outdated = false;
+	return cache.Lookup(listing, m_server, CServerPath(path), true, outdated);
+}
+
+void CDirectoryCacheTest::WriteFile(std::string const& data)
+{
+	wxFile f;
+	CPPUNIT_ASSERT(f.Create(m_file, true));
+	CPPUNIT_ASSERT(f.Write(data.c_str(), data.size()) == data.size());
+}
+
+std::string CDirectoryCacheTest::ReadFile()
+{
+	wxFile f;
+	CPPUNIT_ASSERT(f.Open(m_file));
+	std::string data(static_cast<size_t>(f.Length()), '\0');
+	if (!data.empty())
+		CPPUNIT_ASSERT(f.Read(&data[0], data.size()) == static_cast<ssize_t>(data.size()));
+	return data;
+}
+
+void CDirectoryCacheTest::testEviction()
+{
+	CDirectoryCache cache(m_options);
+
+	// A large listing alone fits into the 1 MiB budget, but no two of them
+	cache.Store(MakeListing(_T("/a"), 10), m_server);
+	cache.Store(MakeListing(_T("/b"), 700, 800), m_server);
+	cache.Store(MakeListing(_T("/c"), 10), m_server);
+
+	// Makes /a more recently used than /b and /c
+	CPPUNIT_ASSERT(IsCached(cache, _T("/a")));
+
+	// Evicts the least recently used listings until within the budget
+	cache.Store(MakeListing(_T("/d"), 700, 800), m_server);
+	CPPUNIT_ASSERT(!IsCached(cache, _T("/b")));
+	CPPUNIT_ASSERT(IsCached(cache, _T("/c")));
+	CPPUNIT_ASSERT(IsCached(cache, _T("/a")));
+	CPPUNIT_ASSERT(IsCached(cache, _T("/d")));
+
+	// The most recently stored listing is kept even if it alone exceeds the budget
+	cache.Store(MakeListing(_T("/e"), 2000, 800), m_server);
+	CPPUNIT_ASSERT(IsCached(cache, _T("/e")));
+	CPPUNIT_ASSERT(!IsCached(cache, _T("/a")));
+	CPPUNIT_ASSERT(!IsCached(cache, _T("/d")));
+}
+
+void CDirectoryCacheTest::testPersist()
+{
+	m_options.SetOption(OPTION_CACHE_PERSISTENT, 1);
+	m_options.SetOption(OPTION_CACHE_FILE, m_file);
+	m_options.SetOption(OPTION_CACHE_SIZE_LIMIT, 16);
+
+	CDirectoryListing const original = MakeListing(_T("/dir"), 50);
+	{
+		CDirectoryCache cache(m_options);
+		cache.Store(original, m_server);
+		cache.Store(MakeListing(_T("/dir/sub"), 3), m_server);
+	}
+
+	CDirectoryCache cache(m_options);
+
+	CDirectoryListing listing;
+	bool outdated = true;
+	CPPUNIT_ASSERT(cache.Lookup(listing, m_server, original.path, true, outdated));
+	CPPUNIT_ASSERT(!outdated);
+	CPPUNIT_ASSERT(listing.path == original.path);
+	CPPUNIT_ASSERT_EQUAL(original.GetCount(), listing.GetCount());
+	for (unsigned int i = 0; i < listing.GetCount(); ++i) {
+		CPPUNIT_ASSERT(listing[i] == original[i]);
+	}
+	CPPUNIT_ASSERT(listing[1].target);
+	CPPUNIT_ASSERT(*listing[1].target == _T("/target"));
+
+	CPPUNIT_ASSERT(IsCached(cache, _T("/dir/sub")));
+	CPPUNIT_ASSERT(!IsCached(cache, _T("/other")));
+
+	// Listings of other servers stay separate, even if only the user differs
+	CServer other(SFTP, DEFAULT, _T("example.com"), 22, _T("other"));
+	CPPUNIT_ASSERT(!cache.Lookup(listing, other, original.path, true, outdated));
+}
+
+void CDirectoryCacheTest::testCorrupt()
+{
+	m_options.SetOption(OPTION_CACHE_PERSISTENT, 1);
+	m_options.SetOption(OPTION_CACHE_FILE, m_file);
+
+	{
+		CDirectoryCache cache(m_options);
+		cache.Store(MakeListing(_T("/dir"), 5), m_server);
+	}
+
+	std::string data = ReadFile();
+	CPPUNIT_ASSERT(data.size() > 12);
+
+	// Bad magic
+	data[0] = 'X';
+	WriteFile(data);
+	{
+		CDirectoryCache cache(m_options);
+		CPPUNIT_ASSERT(!IsCached(cache, _T("/dir")));
+	}
+
+	// A string in the record body claims to be longer than the record
+	{
+		CDirectoryCache cache(m_options);
+		cache.Store(MakeListing(_T("/dir"), 5), m_server);
+	}
+	data = ReadFile();
+	size_t const pos = data.find("rw-r--r--");
+	CPPUNIT_ASSERT(pos != std::string::npos);
+	data[pos - 4] = '\xff';
+	data[pos - 3] = '\xff';
+	WriteFile(data);
+	{
+		CDirectoryCache cache(m_options);
+		CPPUNIT_ASSERT(!IsCached(cache, _T("/dir")));
+	}
+
+	// An empty file is no cache at all
+	WriteFile(std::string());
+	{
+		CDirectoryCache cache(m_options);
+		CPPUNIT_ASSERT(!IsCached(cache, _T("/dir")));
+	}
+}
+
+void CDirectoryCacheTest::testTruncated()
+{
+	m_options.SetOption(OPTION_CACHE_PERSISTENT, 1);
+	m_options.SetOption(OPTION_CACHE_FILE, m_file);
+
+	{
+		CDirectoryCache cache(m_options);
+		cache.Store(MakeListing(_T("/old"), 5), m_server);
+		cache.Store(MakeListing(_T("/new"), 5), m_server);
+	}
+
+	// Most recently used listings are written first, cut into the last one
+	std::string const data = ReadFile();
+	WriteFile(data.substr(0, data.size() - 10));
+
+	{
+		CDirectoryCache cache(m_options);
+		CPPUNIT_ASSERT(IsCached(cache, _T("/new")));
+		CPPUNIT_ASSERT(!IsCached(cache, _T("/old")));
+	}
+
+	// Cut into the header
+	WriteFile(data.substr(0, 6));
+	{
+		CDirectoryCache cache(m_options);
+		CPPUNIT_ASSERT(!IsCached(cache, _T("/new")));
+	}
+}
+
+void CDirectoryCacheTest::testInvalidateServer()
+{
+	CDirectoryCache cache(m_options);
+
+	CServer other(SFTP, DEFAULT, _T("example.com"), 22, _T("other"));
+
+	cache.Store(MakeListing(_T("/a"), 3), m_server);
+	cache.Store(MakeListing(_T("/b"), 3), m_server);
+	cache.Store(MakeListing(_T("/c"), 3), m_server);
+	cache.Store(MakeListing(_T("/a"), 3), other);
+
+	// Removes the server entry along with its last listing
+	cache.InvalidateServer(m_server);
+	CPPUNIT_ASSERT(!IsCached(cache, _T("/a")));
+	CPPUNIT_ASSERT(!IsCached(cache, _T("/b")));
+	CPPUNIT_ASSERT(!IsCached(cache, _T("/c")));
+
+	CDirectoryListing listing;
+	bool outdated = false;
+	CPPUNIT_ASSERT(cache.Lookup(listing, other, CServerPath(_T("/a")), true, outdated));
+
+	// Nothing left to invalidate
+	cache.InvalidateServer(m_server);
+	cache.Store(MakeListing(_T("/a"), 3), m_server);
+	CPPUNIT_ASSERT(IsCached(cache, _T("/a")));
+}
@@ -0,0 +1,232 @@
+#include <filezilla.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include "directory_comparison.h"
+
+/*
+ * This testsuite asserts the correctness of the CDirectoryComparison class.
+ */
+
+class CDirectoryComparisonTest : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(CDirectoryComparisonTest);
+	CPPUNIT_TEST(testJoin);
+	CPPUNIT_TEST(testSize);
+	CPPUNIT_TEST(testDate);
+	CPPUNIT_TEST(testCase);
+	CPPUNIT_TEST(testUpdate);
+	CPPUNIT_TEST(testRemove);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+	void testJoin();
+	void testSize();
+	void testDate();
+	void testCase();
+	void testUpdate();
+	void testRemove();
+
+protected:
+	typedef CDirectoryComparison::side side;
+	typedef CDirectoryComparison::result result;
+
+	static CDirectoryComparison::entry Entry(wxString const& name, bool dir, int64_t size, CDateTime const& time = CDateTime())
+	{
+		CDirectoryComparison::entry e;
+		e.name = name;
+		e.dir = dir;
+		e.size = size;
+		e.time = time;
+		return e;
+	}
+
+	static CDateTime Time(int hour, int minute)
+	{
+		return CDateTime(2015, 4, 1, hour, minute);
+	}
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(CDirectoryComparisonTest);
+
+void CDirectoryComparisonTest::testJoin()
+{
+	CDirectoryComparison comparison(CDirectoryComparison::mode::size, wxTimeSpan(), true);
+
+	// Neither side is sorted
+	std::vector<CDirectoryComparison::entry> left;
+	left.push_back(Entry(_T("c"), false, 1));
+	left.push_back(Entry(_T("a"), false, 1));
+	left.push_back(Entry(_T("b"), true, -1));
+	left.push_back(Entry(_T("d"), false, 1));
+	comparison.Set(side::left, std::move(left));
+
+	std::vector<CDirectoryComparison::entry> right;
+	right.push_back(Entry(_T("e"), false, 1));
+	right.push_back(Entry(_T("b"), false, 1));
+	right.push_back(Entry(_T("a"), false, 1));
+	right.push_back(Entry(_T("c"), false, 1));
+	comparison.Set(side::right, std::move(right));
+
+	auto m = comparison.GetMatch(side::left, 0);
+	CPPUNIT_ASSERT_EQUAL(size_t(0), m.left);
+	CPPUNIT_ASSERT_EQUAL(size_t(3), m.right);
+	CPPUNIT_ASSERT(m.res == result::equal);
+
+	m = comparison.GetMatch(side::right, 2);
+	CPPUNIT_ASSERT_EQUAL(size_t(1), m.left);
+	CPPUNIT_ASSERT_EQUAL(size_t(2), m.right);
+
+	// A file and a directory of the same name don't match
+	CPPUNIT_ASSERT(comparison.GetMatch(side::left, 2).res == result::left_only);
+	CPPUNIT_ASSERT(comparison.GetMatch(side::right, 1).res == result::right_only);
+
+	auto const matches = comparison.GetMatches();
+	CPPUNIT_ASSERT_EQUAL(size_t(6), matches.size());
+	CPPUNIT_ASSERT(matches[3].res == result::left_only);
+	CPPUNIT_ASSERT_EQUAL(size_t(3), matches[3].left);
+	CPPUNIT_ASSERT(matches[4].res == result::right_only);
+	CPPUNIT_ASSERT_EQUAL(size_t(0), matches[4].right);
+	CPPUNIT_ASSERT(matches[5].res == result::right_only);
+	CPPUNIT_ASSERT_EQUAL(size_t(1), matches[5].right);
+}
+
+void CDirectoryComparisonTest::testSize()
+{
+	CDirectoryComparison comparison(CDirectoryComparison::mode::size, wxTimeSpan(), true);
+
+	std::vector<CDirectoryComparison::entry> left;
+	left.push_back(Entry(_T("same"), false, 10, Time(10, 0)));
+	left.push_back(Entry(_T("different"), false, 10));
+	left.push_back(Entry(_T("dir"), true, -1));
+	comparison.Set(side::left, std::move(left));
+
+	std::vector<CDirectoryComparison::entry> right;
+	right.push_back(Entry(_T("same"), false, 10, Time(12, 0)));
+	right.push_back(Entry(_T("different"), false, 11));
+	right.push_back(Entry(_T("dir"), true, 4096));
+	comparison.Set(side::right, std::move(right));
+
+	CPPUNIT_ASSERT(comparison.GetMatch(side::left, 0).res == result::equal);
+	CPPUNIT_ASSERT(comparison.GetMatch(side::left, 1).res == result::different);
+	CPPUNIT_ASSERT(comparison.GetMatch(side::left, 2).res == result::equal);
+}
+
+void CDirectoryComparisonTest::testDate()
+{
+	CDirectoryComparison comparison(CDirectoryComparison::mode::date, wxTimeSpan::Minutes(2), true);
+
+	std::vector<CDirectoryComparison::entry> left;
+	left.push_back(Entry(_T("newer"), false, 1, Time(10, 5)));
+	left.push_back(Entry(_T("older"), false, 1, Time(10, 0)));
+	left.push_back(Entry(_T("threshold"), false, 1, Time(10, 1)));
+	left.push_back(Entry(_T("nodate"), false, 1));
+	comparison.Set(side::left, std::move(left));
+
+	std::vector<CDirectoryComparison::entry> right;
+	right.push_back(Entry(_T("newer"), false, 2, Time(10, 0)));
+	right.push_back(Entry(_T("older"), false, 1, Time(10, 5)));
+	right.push_back(Entry(_T("threshold"), false, 1, Time(10, 0)));
+	right.push_back(Entry(_T("nodate"), false, 2, Time(10, 0)));
+	comparison.Set(side::right, std::move(right));
+
+	CPPUNIT_ASSERT(comparison.GetMatch(side::left, 0).res == result::left_newer);
+	CPPUNIT_ASSERT(comparison.GetMatch(side::left, 1).res == result::right_newer);
+	CPPUNIT_ASSERT(comparison.GetMatch(side::left, 2).res == result::equal);
+	CPPUNIT_ASSERT(comparison.GetMatch(side::left, 3).res == result::equal);
+}
+
+void CDirectoryComparisonTest::testCase()
+{
+	std::vector<CDirectoryComparison::entry> left;
+	left.push_back(Entry(_T("File"), false, 1));
+
+	std::vector<CDirectoryComparison::entry> right;
+	right.push_back(Entry(_T("file"), false, 1));
+
+	CDirectoryComparison sensitive(CDirectoryComparison::mode::size, wxTimeSpan(), true);
+	sensitive.Set(side::left, std::vector<CDirectoryComparison::entry>(left));
+	sensitive.Set(side::right, std::vector<CDirectoryComparison::entry>(right));
+	CPPUNIT_ASSERT(sensitive.GetMatch(side::left, 0).res == result::left_only);
+	CPPUNIT_ASSERT_EQUAL(CDirectoryComparison::npos, sensitive.Find(side::right, _T("FILE"), false));
+
+	CDirectoryComparison insensitive(CDirectoryComparison::mode::size, wxTimeSpan(), false);
+	insensitive.Set(side::left, std::move(left));
+	insensitive.Set(side::right, std::move(right));
+	CPPUNIT_ASSERT(insensitive.GetMatch(side::left, 0).res == result::equal);
+	CPPUNIT_ASSERT_EQUAL(size_t(0), insensitive.Find(side::right, _T("FILE"), false));
+}
+
+void CDirectoryComparisonTest::testUpdate()
+{
+	CDirectoryComparison comparison(CDirectoryComparison::mode::size, wxTimeSpan(), true);
+
+	std::vector<CDirectoryComparison::entry> left;
+	left.push_back(Entry(_T("a"), false, 1));
+	left.push_back(Entry(_T("b"), false, 1));
+	comparison.Set(side::left, std::move(left));
+
+	std::vector<CDirectoryComparison::entry> right;
+	right.push_back(Entry(_T("a"), false, 1));
+	comparison.Set(side::right, std::move(right));
+
+	CPPUNIT_ASSERT(comparison.TakeChanges().empty());
+
+	// Changing an entry only reports the pair it is part of
+	CPPUNIT_ASSERT_EQUAL(size_t(0), comparison.Update(side::right, Entry(_T("a"), false, 2)));
+	auto changes = comparison.TakeChanges();
+	CPPUNIT_ASSERT_EQUAL(size_t(1), changes.size());
+	CPPUNIT_ASSERT_EQUAL(size_t(0), changes[0].left);
+	CPPUNIT_ASSERT_EQUAL(size_t(0), changes[0].right);
+	CPPUNIT_ASSERT(changes[0].res == result::different);
+
+	// Changes not affecting the result aren't reported
+	comparison.Update(side::right, Entry(_T("a"), false, 3));
+	CPPUNIT_ASSERT(comparison.TakeChanges().empty());
+
+	// A new entry joins the lonely one
+	CPPUNIT_ASSERT_EQUAL(size_t(1), comparison.Update(side::right, Entry(_T("b"), false, 1)));
+	changes = comparison.TakeChanges();
+	CPPUNIT_ASSERT_EQUAL(size_t(1), changes.size());
+	CPPUNIT_ASSERT_EQUAL(size_t(1), changes[0].left);
+	CPPUNIT_ASSERT_EQUAL(size_t(1), changes[0].right);
+	CPPUNIT_ASSERT(changes[0].res == result::equal);
+
+	CPPUNIT_ASSERT(comparison.TakeChanges().empty());
+}
+
+void CDirectoryComparisonTest::testRemove()
+{
+	CDirectoryComparison comparison(CDirectoryComparison::mode::size, wxTimeSpan(), true);
+
+	std::vector<CDirectoryComparison::entry> left;
+	left.push_back(Entry(_T("a"), false, 1));
+	left.push_back(Entry(_T("b"), false, 1));
+	comparison.Set(side::left, std::move(left));
+
+	std::vector<CDirectoryComparison::entry> right;
+	right.push_back(Entry(_T("a"), false, 1));
+	comparison.Set(side::right, std::move(right));
+
+	CPPUNIT_ASSERT(!comparison.Remove(side::left, _T("a"), true));
+	CPPUNIT_ASSERT(comparison.Remove(side::left, _T("a"), false));
+	CPPUNIT_ASSERT_EQUAL(CDirectoryComparison::npos, comparison.Find(side::left, _T("a"), false));
+
+	auto const changes = comparison.TakeChanges();
+	CPPUNIT_ASSERT_EQUAL(size_t(1), changes.size());
+	CPPUNIT_ASSERT_EQUAL(CDirectoryComparison::npos, changes[0].left);
+	CPPUNIT_ASSERT_EQUAL(size_t(0), changes[0].right);
+	CPPUNIT_ASSERT(changes[0].res == result::right_only);
+
+	auto const matches = comparison.GetMatches();
+	CPPUNIT_ASSERT_EQUAL(size_t(2), matches.size());
+	CPPUNIT_ASSERT_EQUAL(size_t(1), matches[0].left);
+	CPPUNIT_ASSERT(matches[0].res == result::left_only);
+	CPPUNIT_ASSERT_EQUAL(size_t(0), matches[1].right);
+	CPPUNIT_ASSERT(matches[1].res == result::right_only);
+
+	// Indexes of removed entries are not reused
+	CPPUNIT_ASSERT_EQUAL(size_t(2), comparison.Update(side::left, Entry(_T("a"), false, 1)));
+	CPPUNIT_ASSERT(comparison.GetMatch(side::right, 0).res == result::equal);
+}
@@ -0,0 +1,75 @@
+#include <filezilla.h>
+
+#include <cstdio>
+
+/*
+ * Measures the name lookups of CDirectoryListing: a million lookups in a
+ * listing of 200000 entries, a quarter of which miss.
+ *
+ * Not part of the testsuite, build with `make directorylistingbenchmark`.
+ */
+
+namespace {
+unsigned int const entry_count = 200000;
+unsigned int const lookups = 1000000;
+
+CDirectoryListing MakeListing(std::vector<wxString> const& names)
+{
+	std::deque<CRefcountObject<CDirentry>> entries;
+	for (auto const& name : names) {
+		CRefcountObject<CDirentry> entry;
+		entry.Get().name = name;
+		entry.Get().flags = 0;
+		entries.push_back(entry);
+	}
+
+	CDirectoryListing listing;
+	listing.Assign(entries);
+	return listing;
+}
+}
+
+int main()
+{
+	std::vector<wxString> names;
+	names.reserve(entry_count);
+	for (unsigned int i = 0; i < entry_count; ++i) {
+		names.push_back(wxString::Format(_T("File_%u.dat"), i * 7919));
+	}
+
+	CMonotonicClock const assignStart = CMonotonicClock::now();
+	CDirectoryListing const listing = MakeListing(names);
+	printf("Listing of %u entries built in %d ms\n", entry_count, static_cast<int>(CMonotonicClock::now() - assignStart));
+
+	std::vector<wxString> queries;
+	queries.reserve(1024);
+	for (unsigned int i = 0; i < 1024; ++i) {
+		// Every fourth query misses, the others differ in case
+		if (i % 4)
+			queries.push_back(wxString::Format(_T("FILE_%u.DAT"), ((i * 193) % entry_count) * 7919));
+		else
+			queries.push_back(wxString::Format(_T("missing_%u"), i));
+	}
+
+	// The first lookup builds the index
+	listing.FindFile_CmpCase(queries[0]);
+
+	CMonotonicClock const start = CMonotonicClock::now();
+
+	unsigned int found = 0;
+	for (unsigned int i = 0; i < lookups; ++i) {
+		wxString const& query = queries[i % queries.size()];
+		if (listing.FindFile_CmpCase(query) >= 0 || listing.FindFile_CmpNoCase(query) >= 0)
+			++found;
+	}
+
+	int64_t const elapsed = CMonotonicClock::now() - start;
+	printf("%u lookups took %d ms, %u found\n", lookups, static_cast<int>(elapsed), found);
+
+	if (found != lookups / 4 * 3) {
+		printf("Expected %u to be found\n", lookups / 4 * 3);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,128 @@
+#include <filezilla.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+/*
+ * This testsuite asserts the correctness of the name lookup functions
+ * in CDirectoryListing.
+ */
+
+class CDirectoryListingTest : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(CDirectoryListingTest);
+	CPPUNIT_TEST(testFindCase);
+	CPPUNIT_TEST(testFindNoCase);
+	CPPUNIT_TEST(testModify);
+	CPPUNIT_TEST(testShared);
+	CPPUNIT_TEST(testLarge);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+	void testFindCase();
+	void testFindNoCase();
+	void testModify();
+	void testShared();
+	void testLarge();
+
+protected:
+	static CDirectoryListing MakeListing(std::vector<wxString> const& names);
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(CDirectoryListingTest);
+
+CDirectoryListing CDirectoryListingTest::MakeListing(std::vector<wxString> const& names)
+{
+	std::deque<CRefcountObject<CDirentry>> entries;
+	for (auto const& name : names) {
+		CRefcountObject<CDirentry> entry;
+		entry.Get().name = name;
+		entry.Get().flags = 0;
+		entries.push_back(entry);
+	}
+
+	CDirectoryListing listing;
+	listing.Assign(entries);
+	return listing;
+}
+
+void CDirectoryListingTest::testFindCase()
+{
+	CDirectoryListing const listing = MakeListing({_T("foo"), _T("Foo"), _T("bar"), _T("foo"), _T("")});
+
+	CPPUNIT_ASSERT_EQUAL(0, listing.FindFile_CmpCase(_T("foo")));
+	CPPUNIT_ASSERT_EQUAL(1, listing.FindFile_CmpCase(_T("Foo")));
+	CPPUNIT_ASSERT_EQUAL(2, listing.FindFile_CmpCase(_T("bar")));
+	CPPUNIT_ASSERT_EQUAL(4, listing.FindFile_CmpCase(_T("")));
+	CPPUNIT_ASSERT_EQUAL(-1, listing.FindFile_CmpCase(_T("FOO")));
+	CPPUNIT_ASSERT_EQUAL(-1, listing.FindFile_CmpCase(_T("baz")));
+
+	CDirectoryListing const empty;
+	CPPUNIT_ASSERT_EQUAL(-1, empty.FindFile_CmpCase(_T("foo")));
+}
+
+void CDirectoryListingTest::testFindNoCase()
+{
+	CDirectoryListing const listing = MakeListing({_T("bar"), _T("Foo"), _T("foo"), _T("BÄZ")});
+
+	CPPUNIT_ASSERT_EQUAL(1, listing.FindFile_CmpNoCase(_T("foo")));
+	CPPUNIT_ASSERT_EQUAL(1, listing.FindFile_CmpNoCase(_T("FOO")));
+	CPPUNIT_ASSERT_EQUAL(0, listing.FindFile_CmpNoCase(_T("BAR")));
+	CPPUNIT_ASSERT_EQUAL(3, listing.FindFile_CmpNoCase(_T("bäz")));
+	CPPUNIT_ASSERT_EQUAL(-1, listing.FindFile_CmpNoCase(_T("fo")));
+	CPPUNIT_ASSERT_EQUAL(-1, listing.FindFile_CmpNoCase(_T("fooo")));
+}
+
+void CDirectoryListingTest::testModify()
+{
+	CDirectoryListing listing = MakeListing({_T("a"), _T("b"), _T("c")});
+	CPPUNIT_ASSERT_EQUAL(2, listing.FindFile_CmpCase(_T("c")));
+
+	CPPUNIT_ASSERT(listing.RemoveEntry(0));
+	CPPUNIT_ASSERT_EQUAL(-1, listing.FindFile_CmpCase(_T("a")));
+	CPPUNIT_ASSERT_EQUAL(1, listing.FindFile_CmpCase(_T("c")));
+
+	listing[0].name = _T("x");
+	listing.ClearFindMap();
+	CPPUNIT_ASSERT_EQUAL(-1, listing.FindFile_CmpNoCase(_T("b")));
+	CPPUNIT_ASSERT_EQUAL(0, listing.FindFile_CmpNoCase(_T("X")));
+
+	listing.SetCount(3);
+	listing[2].name = _T("d");
+	CPPUNIT_ASSERT_EQUAL(2, listing.FindFile_CmpCase(_T("d")));
+}
+
+void CDirectoryListingTest::testShared()
+{
+	CDirectoryListing const original = MakeListing({_T("a"), _T("b")});
+	CPPUNIT_ASSERT_EQUAL(1, original.FindFile_CmpCase(_T("b")));
+
+	// Modifying a copy must not affect lookups in the original
+	CDirectoryListing copy = original;
+	copy.RemoveEntry(0);
+	CPPUNIT_ASSERT_EQUAL(0, copy.FindFile_CmpCase(_T("b")));
+	CPPUNIT_ASSERT_EQUAL(1, original.FindFile_CmpCase(_T("b")));
+	CPPUNIT_ASSERT_EQUAL(0, original.FindFile_CmpCase(_T("a")));
+}
+
+void CDirectoryListingTest::testLarge()
+{
+	// Enough entries for plenty of collisions in the index
+	unsigned int const entry_count = 200000;
+
+	std::vector<wxString> names;
+	names.reserve(entry_count);
+	for (unsigned int i = 0; i < entry_count; ++i) {
+		names.push_back(wxString::Format(_T("File_%u.dat"), i * 7919));
+	}
+	CDirectoryListing const listing = MakeListing(names);
+
+	for (unsigned int i = 0; i < 1024; ++i) {
+		unsigned int const index = (i * 193) % entry_count;
+		CPPUNIT_ASSERT_EQUAL(static_cast<int>(index), listing.FindFile_CmpCase(names[index]));
+		CPPUNIT_ASSERT_EQUAL(-1, listing.FindFile_CmpCase(names[index].Upper()));
+		CPPUNIT_ASSERT_EQUAL(static_cast<int>(index), listing.FindFile_CmpNoCase(names[index].Upper()));
+		CPPUNIT_ASSERT_EQUAL(-1, listing.FindFile_CmpNoCase(wxString::Format(_T("missing_%u"), i)));
+	}
+}
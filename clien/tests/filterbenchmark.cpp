@@ -0,0 +1,262 @@
+#include <filezilla.h>
+#include "filter_matcher.h"
+
+#include <wx/regex.h>
+
+#include <cstdio>
+#include <memory>
+
+/*
+ * Filters a million generated names with fifty filters, once through
+ * CFilterMatcher and once evaluating each condition on its own the way
+ * filters used to be applied, and compares the results and times.
+ *
+ * Not part of the testsuite, build with `make filterbenchmark`.
+ */
+
+namespace {
+size_t const name_count = 1000000;
+size_t const filter_count = 50;
+
+wxChar const* const words[] = {
+	_T("report"), _T("Backup"), _T("image"), _T("DATA"), _T("thumbs"), _T("index"), _T("cache"), _T("Readme"),
+	_T("build"), _T("temp"), _T("archive"), _T("photo"), _T("\u00fcbersicht"), _T("log"), _T("draft"), _T("final")
+};
+
+wxChar const* const extensions[] = {
+	_T(".txt"), _T(".JPG"), _T(".png"), _T(".tmp"), _T(".bak"), _T(".o"), _T(".cpp"), _T(".h"),
+	_T(".log"), _T(".zip"), _T(".tar.gz"), _T(".DS_Store"), _T(".pdf"), _T("~"), _T(".swp"), _T(".html")
+};
+
+// Deterministic, so that all runs filter the same names
+unsigned int Random(unsigned int& state)
+{
+	state = state * 1103515245u + 12345u;
+	return (state >> 16) & 0x7fff;
+}
+
+CFilterCondition Condition(t_filterType type, int condition, wxString const& value)
+{
+	CFilterCondition c;
+	c.type = type;
+	c.condition = condition;
+	c.strValue = value;
+	return c;
+}
+
+std::vector<CFilter> Filters()
+{
+	std::vector<CFilter> filters;
+
+	unsigned int state = 42;
+	for (size_t i = 0; filters.size() < filter_count; ++i) {
+		CFilter filter;
+		filter.name = wxString::Format(_T("Filter %d"), static_cast<int>(i));
+		filter.matchCase = (i % 3) != 0;
+		filter.filterDirs = (i % 5) != 0;
+
+		wxString const word = words[Random(state) % 16];
+		wxString const extension = extensions[Random(state) % 16];
+		switch (i % 10)
+		{
+		case 0:
+		case 1:
+		case 2:
+			filter.filters.push_back(Condition(filter_name, 3, extension));
+			break;
+		case 3:
+			filter.filters.push_back(Condition(filter_name, 0, word));
+			break;
+		case 4:
+			filter.matchType = CFilter::any;
+			filter.filters.push_back(Condition(filter_name, 2, word));
+			filter.filters.push_back(Condition(filter_name, 1, word + extension));
+			break;
+		case 5:
+			filter.filters.push_back(Condition(filter_name, 3, extension));
+			filter.filters.push_back(Condition(filter_path, 0, word));
+			break;
+		case 6:
+			filter.matchType = CFilter::none;
+			filter.filters.push_back(Condition(filter_name, 5, word.Left(3)));
+			filter.filters.push_back(Condition(filter_name, 0, _T("_")));
+			break;
+		case 7:
+			filter.filters.push_back(Condition(filter_name, 0, word.Mid(1, 3)));
+			filter.filters.push_back(Condition(filter_name, 3, extension));
+			break;
+		case 8:
+			filter.filters.push_back(Condition(filter_name, 4, _T("^") + word + _T("_[0-9]+\\.")));
+			break;
+		case 9:
+			filter.matchType = CFilter::any;
+			filter.filters.push_back(Condition(filter_path, 2, _T("/") + word));
+			filter.filters.push_back(Condition(filter_name, 1, word));
+			break;
+		}
+		filters.push_back(filter);
+	}
+
+	return filters;
+}
+
+struct t_entry
+{
+	wxString name;
+	wxString path;
+	bool dir;
+};
+
+std::vector<t_entry> Entries()
+{
+	std::vector<t_entry> entries;
+	entries.reserve(name_count);
+
+	unsigned int state = 4711;
+	for (size_t i = 0; i < name_count; ++i) {
+		t_entry entry;
+		entry.dir = Random(state) % 8 == 0;
+		entry.name = words[Random(state) % 16];
+		entry.name += wxString::Format(_T("_%d"), static_cast<int>(Random(state) % 1000));
+		if (!entry.dir)
+			entry.name += extensions[Random(state) % 16];
+		entry.path = _T("/");
+		entry.path += words[Random(state) % 16];
+		entry.path += _T("/");
+		entry.path += words[Random(state) % 16];
+		entries.push_back(entry);
+	}
+
+	return entries;
+}
+
+// Evaluates every condition by itself, folding case and compiling
+// regular expressions ahead of time like the compiled matcher does.
+class CReference final
+{
+public:
+	explicit CReference(std::vector<CFilter> const& filters)
+		: filters_(filters)
+	{
+		for (auto & filter : filters_) {
+			for (auto & condition : filter.filters) {
+				if (condition.condition == 4)
+					regexes_.emplace_back(new wxRegEx(condition.strValue, wxRE_DEFAULT | wxRE_NOSUB));
+				else {
+					regexes_.emplace_back();
+					if (!filter.matchCase)
+						condition.strValue = condition.strValue.Lower();
+				}
+			}
+		}
+	}
+
+	bool Filtered(t_entry const& entry) const
+	{
+		size_t regex = 0;
+		for (auto const& filter : filters_) {
+			size_t const first = regex;
+			regex += filter.filters.size();
+
+			if (entry.dir ? !filter.filterDirs : !filter.filterFiles)
+				continue;
+
+			bool filtered = filter.matchType != CFilter::any;
+			for (size_t i = 0; i < filter.filters.size(); ++i) {
+				CFilterCondition const& condition = filter.filters[i];
+				wxString const& original = condition.type == filter_path ? entry.path : entry.name;
+				wxString const value = filter.matchCase ? original : original.Lower();
+
+				bool match = false;
+				switch (condition.condition)
+				{
+				case 0:
+					match = value.find(condition.strValue) != wxString::npos;
+					break;
+				case 1:
+					match = value == condition.strValue;
+					break;
+				case 2:
+					match = value.StartsWith(condition.strValue);
+					break;
+				case 3:
+					match = value.EndsWith(condition.strValue);
+					break;
+				case 4:
+					match = regexes_[first + i]->Matches(original);
+					break;
+				case 5:
+					match = value.find(condition.strValue) == wxString::npos;
+					break;
+				}
+
+				if (match && filter.matchType == CFilter::any) {
+					filtered = true;
+					break;
+				}
+				if (match ? filter.matchType == CFilter::none : filter.matchType == CFilter::all) {
+					filtered = false;
+					break;
+				}
+			}
+			if (filtered)
+				return true;
+		}
+
+		return false;
+	}
+
+private:
+	std::vector<CFilter> filters_;
+	std::vector<std::unique_ptr<wxRegEx>> regexes_;
+};
+
+template<typename F>
+int64_t Run(char const* name, std::vector<t_entry> const& entries, std::vector<char>& results, F const& filtered)
+{
+	CMonotonicClock const start = CMonotonicClock::now();
+
+	size_t count = 0;
+	for (size_t i = 0; i < entries.size(); ++i) {
+		results[i] = filtered(entries[i]) ? 1 : 0;
+		count += results[i];
+	}
+
+	int64_t const elapsed = CMonotonicClock::now() - start;
+	printf("%-10s %6d ms  %6.0f ns/entry  %u filtered\n", name, static_cast<int>(elapsed), elapsed * 1e6 / entries.size(), static_cast<unsigned int>(count));
+	return elapsed;
+}
+}
+
+int main()
+{
+	std::vector<CFilter> const filters = Filters();
+	std::vector<t_entry> const entries = Entries();
+
+	printf("%u entries, %u filters\n", static_cast<unsigned int>(entries.size()), static_cast<unsigned int>(filters.size()));
+
+	CReference const reference(filters);
+	std::vector<char> expected(entries.size());
+	int64_t const referenceTime = Run("reference", entries, expected, [&](t_entry const& e) { return reference.Filtered(e); });
+
+	CFilterMatcher const matcher(filters);
+	if (!matcher.IsValid()) {
+		printf("Invalid filters\n");
+		return 1;
+	}
+	std::vector<char> results(entries.size());
+	int64_t const matcherTime = Run("compiled", entries, results, [&](t_entry const& e) {
+		return matcher.Filtered(e.name, e.path, e.dir, -1, -1, CDateTime());
+	});
+
+	for (size_t i = 0; i < entries.size(); ++i) {
+		if (results[i] != expected[i]) {
+			printf("Mismatch for %s/%s\n", static_cast<char const*>(entries[i].path.utf8_str()), static_cast<char const*>(entries[i].name.utf8_str()));
+			return 1;
+		}
+	}
+
+	if (matcherTime > 0)
+		printf("Speedup: %.2fx\n", static_cast<double>(referenceTime) / matcherTime);
+	return 0;
+}
@@ -0,0 +1,293 @@
+#include <filezilla.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include "filter_matcher.h"
+
+/*
+ * This testsuite asserts the correctness of the CFilterMatcher and
+ * CStringMatcher classes.
+ */
+
+class CFilterMatcherTest : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(CFilterMatcherTest);
+	CPPUNIT_TEST(testStringMatcher);
+	CPPUNIT_TEST(testOverlapping);
+	CPPUNIT_TEST(testEmptyPattern);
+	CPPUNIT_TEST(testName);
+	CPPUNIT_TEST(testCase);
+	CPPUNIT_TEST(testPath);
+	CPPUNIT_TEST(testRegex);
+	CPPUNIT_TEST(testMatchType);
+	CPPUNIT_TEST(testFilesAndDirs);
+	CPPUNIT_TEST(testSize);
+	CPPUNIT_TEST(testMany);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+	void testStringMatcher();
+	void testOverlapping();
+	void testEmptyPattern();
+	void testName();
+	void testCase();
+	void testPath();
+	void testRegex();
+	void testMatchType();
+	void testFilesAndDirs();
+	void testSize();
+	void testMany();
+
+protected:
+	typedef CStringMatcher::kind kind;
+
+	static std::vector<char> Hits(CStringMatcher const& matcher, wxString const& text, size_t count)
+	{
+		std::vector<char> hits(count);
+		matcher.Match(text, hits);
+		return hits;
+	}
+
+	static CFilterCondition Condition(t_filterType type, int condition, wxString const& value)
+	{
+		CFilterCondition c;
+		c.type = type;
+		c.condition = condition;
+		c.strValue = value;
+		return c;
+	}
+
+	static CFilter Filter(CFilterCondition const& condition, bool matchCase = true)
+	{
+		CFilter filter;
+		filter.matchCase = matchCase;
+		filter.filters.push_back(condition);
+		return filter;
+	}
+
+	static bool Filtered(CFilter const& filter, wxString const& name, bool dir = false, wxLongLong size = 100, wxString const& path = _T("/home/user"))
+	{
+		CFilterMatcher const matcher(std::vector<CFilter>(1, filter));
+		CPPUNIT_ASSERT(matcher.IsValid());
+		return matcher.Filtered(name, path, dir, size, -1, CDateTime());
+	}
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(CFilterMatcherTest);
+
+void CFilterMatcherTest::testStringMatcher()
+{
+	CStringMatcher matcher;
+	matcher.Add(kind::contains, _T("bar"), 0);
+	matcher.Add(kind::equals, _T("foobar"), 1);
+	matcher.Add(kind::begins, _T("foo"), 2);
+	matcher.Add(kind::ends, _T("bar"), 3);
+	matcher.Compile();
+
+	std::vector<char> hits = Hits(matcher, _T("foobar"), 4);
+	CPPUNIT_ASSERT(hits[0] && hits[1] && hits[2] && hits[3]);
+
+	hits = Hits(matcher, _T("foobarbaz"), 4);
+	CPPUNIT_ASSERT(hits[0] && !hits[1] && hits[2] && !hits[3]);
+
+	hits = Hits(matcher, _T("xfoobar"), 4);
+	CPPUNIT_ASSERT(hits[0] && !hits[1] && !hits[2] && hits[3]);
+
+	hits = Hits(matcher, _T("fo\u00e4bar"), 4);
+	CPPUNIT_ASSERT(hits[0] && !hits[1] && !hits[2] && hits[3]);
+
+	hits = Hits(matcher, _T("ba"), 4);
+	CPPUNIT_ASSERT(!hits[0] && !hits[1] && !hits[2] && !hits[3]);
+
+	hits = Hits(matcher, wxString(), 4);
+	CPPUNIT_ASSERT(!hits[0] && !hits[1] && !hits[2] && !hits[3]);
+}
+
+void CFilterMatcherTest::testOverlapping()
+{
+	// Patterns that are suffixes of each other and share prefixes,
+	// including characters outside of ASCII.
+	CStringMatcher matcher;
+	matcher.Add(kind::contains, _T("he"), 0);
+	matcher.Add(kind::contains, _T("she"), 1);
+	matcher.Add(kind::contains, _T("his"), 2);
+	matcher.Add(kind::contains, _T("hers"), 3);
+	matcher.Add(kind::ends, _T("e"), 4);
+	matcher.Add(kind::equals, _T("\u00fcber"), 5);
+	matcher.Compile();
+
+	std::vector<char> hits = Hits(matcher, _T("ushers"), 6);
+	CPPUNIT_ASSERT(hits[0] && hits[1] && !hits[2] && hits[3] && !hits[4] && !hits[5]);
+
+	hits = Hits(matcher, _T("hishe"), 6);
+	CPPUNIT_ASSERT(hits[0] && hits[1] && hits[2] && !hits[3] && hits[4] && !hits[5]);
+
+	hits = Hits(matcher, _T("\u00fcber"), 6);
+	CPPUNIT_ASSERT(!hits[0] && !hits[1] && !hits[2] && !hits[3] && !hits[4] && hits[5]);
+}
+
+void CFilterMatcherTest::testEmptyPattern()
+{
+	CStringMatcher matcher;
+	matcher.Add(kind::contains, wxString(), 0);
+	matcher.Add(kind::equals, wxString(), 1);
+	matcher.Compile();
+
+	std::vector<char> hits = Hits(matcher, _T("foo"), 2);
+	CPPUNIT_ASSERT(hits[0] && !hits[1]);
+
+	hits = Hits(matcher, wxString(), 2);
+	CPPUNIT_ASSERT(hits[0] && hits[1]);
+
+	// Not containing an empty string is impossible
+	CPPUNIT_ASSERT(!Filtered(Filter(Condition(filter_name, 5, wxString())), _T("foo")));
+	CPPUNIT_ASSERT(Filtered(Filter(Condition(filter_name, 2, wxString())), _T("foo")));
+}
+
+void CFilterMatcherTest::testName()
+{
+	CPPUNIT_ASSERT(Filtered(Filter(Condition(filter_name, 0, _T("oo"))), _T("foo")));
+	CPPUNIT_ASSERT(!Filtered(Filter(Condition(filter_name, 0, _T("oo"))), _T("bar")));
+
+	CPPUNIT_ASSERT(Filtered(Filter(Condition(filter_name, 1, _T("foo"))), _T("foo")));
+	CPPUNIT_ASSERT(!Filtered(Filter(Condition(filter_name, 1, _T("foo"))), _T("foo2")));
+
+	CPPUNIT_ASSERT(Filtered(Filter(Condition(filter_name, 2, _T("fo"))), _T("foo")));
+	CPPUNIT_ASSERT(!Filtered(Filter(Condition(filter_name, 2, _T("oo"))), _T("foo")));
+
+	CPPUNIT_ASSERT(Filtered(Filter(Condition(filter_name, 3, _T(".o"))), _T("f.o")));
+	CPPUNIT_ASSERT(!Filtered(Filter(Condition(filter_name, 3, _T("f."))), _T("f.o")));
+
+	CPPUNIT_ASSERT(!Filtered(Filter(Condition(filter_name, 5, _T("oo"))), _T("foo")));
+	CPPUNIT_ASSERT(Filtered(Filter(Condition(filter_name, 5, _T("oo"))), _T("bar")));
+
+	// Unknown conditions never match
+	CPPUNIT_ASSERT(!Filtered(Filter(Condition(filter_name, 42, _T("foo"))), _T("foo")));
+}
+
+void CFilterMatcherTest::testCase()
+{
+	CPPUNIT_ASSERT(!Filtered(Filter(Condition(filter_name, 1, _T("FOO")), true), _T("foo")));
+	CPPUNIT_ASSERT(Filtered(Filter(Condition(filter_name, 1, _T("FOO")), false), _T("foo")));
+	CPPUNIT_ASSERT(Filtered(Filter(Condition(filter_name, 1, _T("foo")), false), _T("FoO")));
+	CPPUNIT_ASSERT(Filtered(Filter(Condition(filter_name, 3, _T(".TXT")), false), _T("readme.txt")));
+	CPPUNIT_ASSERT(!Filtered(Filter(Condition(filter_name, 5, _T("O")), false), _T("foo")));
+
+	// Case-sensitive and case-insensitive filters in the same matcher
+	std::vector<CFilter> filters;
+	filters.push_back(Filter(Condition(filter_name, 0, _T("ABC")), true));
+	filters.push_back(Filter(Condition(filter_name, 0, _T("XYZ")), false));
+	CFilterMatcher const matcher(filters);
+	CPPUNIT_ASSERT(matcher.Filtered(_T("ABC"), wxString(), false, -1, -1, CDateTime()));
+	CPPUNIT_ASSERT(!matcher.Filtered(_T("abc"), wxString(), false, -1, -1, CDateTime()));
+	CPPUNIT_ASSERT(matcher.Filtered(_T("xyz"), wxString(), false, -1, -1, CDateTime()));
+	CPPUNIT_ASSERT(matcher.Filtered(_T("XyZ"), wxString(), false, -1, -1, CDateTime()));
+}
+
+void CFilterMatcherTest::testPath()
+{
+	CFilter const filter = Filter(Condition(filter_path, 2, _T("/home")));
+	CPPUNIT_ASSERT(Filtered(filter, _T("foo")));
+	CPPUNIT_ASSERT(!Filtered(filter, _T("foo"), false, 100, _T("/var/home")));
+
+	// The name is not part of the path
+	CPPUNIT_ASSERT(!Filtered(Filter(Condition(filter_path, 0, _T("foo"))), _T("foo")));
+	CPPUNIT_ASSERT(!Filtered(Filter(Condition(filter_name, 0, _T("home"))), _T("foo")));
+}
+
+void CFilterMatcherTest::testRegex()
+{
+	CPPUNIT_ASSERT(Filtered(Filter(Condition(filter_name, 4, _T("^f.*\\.txt$"))), _T("foo.txt")));
+	CPPUNIT_ASSERT(!Filtered(Filter(Condition(filter_name, 4, _T("^f.*\\.txt$"))), _T("foo.txt~")));
+	CPPUNIT_ASSERT(Filtered(Filter(Condition(filter_path, 4, _T("/u[s]er$"))), _T("foo")));
+
+	// Case is not folded for regular expressions
+	CPPUNIT_ASSERT(!Filtered(Filter(Condition(filter_name, 4, _T("FOO")), false), _T("foo")));
+
+	CFilterMatcher const invalid(std::vector<CFilter>(1, Filter(Condition(filter_name, 4, _T("(")))));
+	CPPUNIT_ASSERT(!invalid.IsValid());
+	CPPUNIT_ASSERT(!invalid.Filtered(_T("("), wxString(), false, -1, -1, CDateTime()));
+}
+
+void CFilterMatcherTest::testMatchType()
+{
+	CFilter filter;
+	filter.filters.push_back(Condition(filter_name, 2, _T("foo")));
+	filter.filters.push_back(Condition(filter_name, 3, _T("bar")));
+
+	filter.matchType = CFilter::all;
+	CPPUNIT_ASSERT(Filtered(filter, _T("foobar")));
+	CPPUNIT_ASSERT(!Filtered(filter, _T("foobaz")));
+
+	filter.matchType = CFilter::any;
+	CPPUNIT_ASSERT(Filtered(filter, _T("foobaz")));
+	CPPUNIT_ASSERT(Filtered(filter, _T("bazbar")));
+	CPPUNIT_ASSERT(!Filtered(filter, _T("baz")));
+
+	filter.matchType = CFilter::none;
+	CPPUNIT_ASSERT(Filtered(filter, _T("baz")));
+	CPPUNIT_ASSERT(!Filtered(filter, _T("foobaz")));
+
+	// Without conditions, filters match everything
+	filter.filters.clear();
+	filter.matchType = CFilter::any;
+	CPPUNIT_ASSERT(Filtered(filter, _T("baz")));
+
+	CFilterMatcher const empty;
+	CPPUNIT_ASSERT(empty.empty());
+	CPPUNIT_ASSERT(!empty.Filtered(_T("baz"), wxString(), false, -1, -1, CDateTime()));
+}
+
+void CFilterMatcherTest::testFilesAndDirs()
+{
+	CFilter filter = Filter(Condition(filter_name, 0, _T("o")));
+	filter.filterDirs = false;
+	CPPUNIT_ASSERT(Filtered(filter, _T("foo"), false));
+	CPPUNIT_ASSERT(!Filtered(filter, _T("foo"), true));
+
+	filter.filterDirs = true;
+	filter.filterFiles = false;
+	CPPUNIT_ASSERT(!Filtered(filter, _T("foo"), false));
+	CPPUNIT_ASSERT(Filtered(filter, _T("foo"), true));
+}
+
+void CFilterMatcherTest::testSize()
+{
+	CFilterCondition condition = Condition(filter_size, 0, wxString());
+	condition.value = 1000;
+
+	CFilter filter = Filter(condition);
+	filter.filters.push_back(Condition(filter_name, 0, _T("o")));
+	CPPUNIT_ASSERT(Filtered(filter, _T("foo"), false, 1001));
+	CPPUNIT_ASSERT(!Filtered(filter, _T("foo"), false, 1000));
+	CPPUNIT_ASSERT(!Filtered(filter, _T("bar"), false, 1001));
+
+	// Unknown sizes are skipped
+	CPPUNIT_ASSERT(Filtered(filter, _T("foo"), false, -1));
+}
+
+void CFilterMatcherTest::testMany()
+{
+	// The matchers are shared between the filters, each filter has to
+	// see the hits of its own conditions only.
+	std::vector<CFilter> filters;
+	for (int i = 0; i < 50; ++i) {
+		CFilter filter;
+		filter.matchCase = (i % 2) != 0;
+		filter.matchType = CFilter::all;
+		filter.filters.push_back(Condition(filter_name, i % 4, wxString::Format(_T("n%d"), i)));
+		filter.filters.push_back(Condition(filter_path, 5, wxString::Format(_T("p%d"), i)));
+		filters.push_back(filter);
+	}
+	CFilterMatcher const matcher(filters);
+
+	CPPUNIT_ASSERT(matcher.Filtered(_T("n0"), _T("/"), false, -1, -1, CDateTime()));
+	CPPUNIT_ASSERT(!matcher.Filtered(_T("n0"), _T("/p0"), false, -1, -1, CDateTime()));
+	CPPUNIT_ASSERT(matcher.Filtered(_T("n0"), _T("/p1"), false, -1, -1, CDateTime()));
+	CPPUNIT_ASSERT(matcher.Filtered(_T("N2x"), _T("/"), false, -1, -1, CDateTime()));
+	CPPUNIT_ASSERT(!matcher.Filtered(_T("N3x"), _T("/"), false, -1, -1, CDateTime()));
+	CPPUNIT_ASSERT(matcher.Filtered(_T("xn3"), _T("/"), false, -1, -1, CDateTime()));
+	CPPUNIT_ASSERT(!matcher.Filtered(_T("xn3"), _T("/p3"), false, -1, -1, CDateTime()));
+	CPPUNIT_ASSERT(!matcher.Filtered(_T("foo"), _T("/"), false, -1, -1, CDateTime()));
+}
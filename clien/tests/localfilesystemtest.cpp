@@ -0,0 +1,160 @@
+#include <filezilla.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include "local_filesys.h"
+
+#ifndef __WXMSW__
+
+#include <wx/file.h>
+
+#include <map>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * This testsuite asserts the correctness of the directory enumeration
+ * of the CLocalFileSystem class.
+ */
+
+class CLocalFileSystemTest : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(CLocalFileSystemTest);
+	CPPUNIT_TEST(testEnumerate);
+	CPPUNIT_TEST(testEnumerateTypeOnly);
+	CPPUNIT_TEST(testEnumerateDirsOnly);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp();
+	void tearDown();
+
+	void testEnumerate();
+	void testEnumerateTypeOnly();
+	void testEnumerateDirsOnly();
+
+protected:
+	struct t_entry
+	{
+		bool is_link{};
+		bool is_dir{};
+		int64_t size{};
+		CDateTime time;
+	};
+
+	std::map<wxString, t_entry> Enumerate(bool dirs_only, bool details);
+
+	void CreateFile(wxString const& name, size_t size);
+
+	wxString m_path;
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(CLocalFileSystemTest);
+
+void CLocalFileSystemTest::setUp()
+{
+	char tmpl[] = "/tmp/fztestXXXXXX";
+	char* p = mkdtemp(tmpl);
+	CPPUNIT_ASSERT(p);
+	m_path = wxString(p, *wxConvFileName) + _T("/");
+
+	CreateFile(_T("file"), 42);
+	CPPUNIT_ASSERT(wxMkdir(m_path + _T("dir")));
+	CPPUNIT_ASSERT(!symlink("file", (m_path + _T("link_file")).fn_str()));
+	CPPUNIT_ASSERT(!symlink("dir", (m_path + _T("link_dir")).fn_str()));
+	CPPUNIT_ASSERT(!symlink("missing", (m_path + _T("link_dangling")).fn_str()));
+}
+
+void CLocalFileSystemTest::tearDown()
+{
+	if (!m_path.empty())
+		CLocalFileSystem::RecursiveDelete(m_path, 0);
+}
+
+void CLocalFileSystemTest::CreateFile(wxString const& name, size_t size)
+{
+	wxFile f;
+	CPPUNIT_ASSERT(f.Create(m_path + name));
+	std::string const data(size, 'x');
+	CPPUNIT_ASSERT(f.Write(data.c_str(), size) == size);
+}
+
+std::map<wxString, CLocalFileSystemTest::t_entry> CLocalFileSystemTest::Enumerate(bool dirs_only, bool details)
+{
+	std::map<wxString, t_entry> entries;
+
+	CLocalFileSystem fs;
+	CPPUNIT_ASSERT(fs.BeginFindFiles(m_path, dirs_only));
+
+	wxString name;
+	t_entry entry;
+	int mode;
+	while (details ? fs.GetNextFile(name, entry.is_link, entry.is_dir, &entry.size, &entry.time, &mode) : fs.GetNextFile(name, entry.is_link, entry.is_dir, 0, 0, 0)) {
+		CPPUNIT_ASSERT(entries.insert(std::make_pair(name, entry)).second);
+		entry = t_entry();
+	}
+
+	return entries;
+}
+
+void CLocalFileSystemTest::testEnumerate()
+{
+	auto entries = Enumerate(false, true);
+	CPPUNIT_ASSERT_EQUAL(size_t(5), entries.size());
+
+	CPPUNIT_ASSERT(!entries[_T("file")].is_dir);
+	CPPUNIT_ASSERT(!entries[_T("file")].is_link);
+	CPPUNIT_ASSERT_EQUAL(int64_t(42), entries[_T("file")].size);
+	CPPUNIT_ASSERT(entries[_T("file")].time.IsValid());
+
+	CPPUNIT_ASSERT(entries[_T("dir")].is_dir);
+	CPPUNIT_ASSERT(!entries[_T("dir")].is_link);
+	CPPUNIT_ASSERT_EQUAL(int64_t(-1), entries[_T("dir")].size);
+
+	// Links report their target
+	CPPUNIT_ASSERT(!entries[_T("link_file")].is_dir);
+	CPPUNIT_ASSERT(entries[_T("link_file")].is_link);
+	CPPUNIT_ASSERT_EQUAL(int64_t(42), entries[_T("link_file")].size);
+
+	CPPUNIT_ASSERT(entries[_T("link_dir")].is_dir);
+	CPPUNIT_ASSERT(entries[_T("link_dir")].is_link);
+
+	CPPUNIT_ASSERT(!entries[_T("link_dangling")].is_dir);
+	CPPUNIT_ASSERT_EQUAL(int64_t(-1), entries[_T("link_dangling")].size);
+}
+
+void CLocalFileSystemTest::testEnumerateTypeOnly()
+{
+	// Without details the type may come straight from the directory entry,
+	// it has to match the full enumeration.
+	auto const entries = Enumerate(false, false);
+	auto const details = Enumerate(false, true);
+	CPPUNIT_ASSERT_EQUAL(details.size(), entries.size());
+
+	for (auto const& entry : details) {
+		auto it = entries.find(entry.first);
+		CPPUNIT_ASSERT(it != entries.end());
+		CPPUNIT_ASSERT_EQUAL(entry.second.is_dir, it->second.is_dir);
+		CPPUNIT_ASSERT_EQUAL(entry.second.is_link, it->second.is_link);
+	}
+}
+
+void CLocalFileSystemTest::testEnumerateDirsOnly()
+{
+	auto entries = Enumerate(true, true);
+	CPPUNIT_ASSERT_EQUAL(size_t(2), entries.size());
+	CPPUNIT_ASSERT(entries.find(_T("dir")) != entries.end());
+	CPPUNIT_ASSERT(entries.find(_T("link_dir")) != entries.end());
+	CPPUNIT_ASSERT(entries[_T("link_dir")].is_link);
+
+	CLocalFileSystem fs;
+	CPPUNIT_ASSERT(fs.BeginFindFiles(m_path, true));
+	size_t count = 0;
+	wxString name;
+	while (fs.GetNextFile(name)) {
+		CPPUNIT_ASSERT(name == _T("dir") || name == _T("link_dir"));
+		++count;
+	}
+	CPPUNIT_ASSERT_EQUAL(size_t(2), count);
+}
+
+#endif
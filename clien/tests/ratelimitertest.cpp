@@ -0,0 +1,194 @@
+#include <filezilla.h>
+#include "ratelimiter.h"
+#include <cppunit/extensions/HelperMacros.h>
+
+/*
+ * This testsuite asserts the accuracy and fairness of the
+ * rate limiter by simulating transfers with a fake clock
+ */
+
+class CRateLimiterTest : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(CRateLimiterTest);
+	CPPUNIT_TEST(testAccuracy);
+	CPPUNIT_TEST(testClasses);
+	CPPUNIT_TEST(testWorkConserving);
+	CPPUNIT_TEST(testObjectLimit);
+	CPPUNIT_TEST(testUnlimited);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+	void testAccuracy();
+	void testClasses();
+	void testWorkConserving();
+	void testObjectLimit();
+	void testUnlimited();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(CRateLimiterTest);
+
+namespace {
+int64_t const step = 10;
+int64_t const duration = 60 * 1000;
+
+class consumer final : public CRateLimiterObject
+{
+public:
+	// Consumes at most rate bytes per second, as much as possible if 0
+	explicit consumer(int64_t rate = 0)
+		: rate_(rate)
+	{}
+
+	void Step()
+	{
+		int64_t const available = GetAvailableBytes(CRateLimiter::inbound);
+		if (!available) {
+			if (!IsWaiting(CRateLimiter::inbound)) {
+				Wait(CRateLimiter::inbound);
+			}
+			return;
+		}
+
+		int64_t used = rate_ ? (rate_ * step / 1000) : 1024 * 1024 * 1024;
+		if (available > 0) {
+			used = std::min(used, available);
+			UpdateUsage(CRateLimiter::inbound, static_cast<int>(used));
+		}
+		transferred_ += used;
+	}
+
+	int64_t const rate_;
+	int64_t transferred_{};
+};
+
+void Simulate(CRateScheduler & scheduler, std::vector<consumer*> const& consumers)
+{
+	for (int64_t t = 0; t < duration; t += step) {
+		scheduler.Distribute(CRateLimiter::inbound, step);
+		for (auto c : consumers) {
+			c->Step();
+		}
+	}
+}
+
+// Checks that value is within 1% of expected
+void AssertNear(int64_t expected, int64_t value)
+{
+	CPPUNIT_ASSERT(value * 100 >= expected * 99);
+	CPPUNIT_ASSERT(value * 100 <= expected * 101);
+}
+}
+
+void CRateLimiterTest::testAccuracy()
+{
+	CRateScheduler scheduler;
+	scheduler.SetLimit(CRateLimiter::inbound, 100000);
+
+	consumer a, b, c;
+	scheduler.Add(&a);
+	scheduler.Add(&b);
+	scheduler.Add(&c);
+
+	Simulate(scheduler, { &a, &b, &c });
+
+	int64_t const total = a.transferred_ + b.transferred_ + c.transferred_;
+	CPPUNIT_ASSERT(total <= 100000 * duration / 1000);
+	AssertNear(100000 * duration / 1000, total);
+
+	AssertNear(total / 3, a.transferred_);
+	AssertNear(total / 3, b.transferred_);
+	AssertNear(total / 3, c.transferred_);
+}
+
+void CRateLimiterTest::testClasses()
+{
+	CRateScheduler scheduler;
+	scheduler.SetLimit(CRateLimiter::inbound, 100000);
+	scheduler.SetClassLimit(_T("capped"), CRateLimiter::inbound, 20000);
+
+	consumer a, b, c;
+	scheduler.Add(&a);
+	scheduler.Add(&b);
+	scheduler.Add(&c);
+	scheduler.SetClass(&a, _T("capped"));
+
+	Simulate(scheduler, { &a, &b, &c });
+
+	// The capped class gets its limit, the others split the remainder
+	AssertNear(20000 * duration / 1000, a.transferred_);
+	AssertNear(40000 * duration / 1000, b.transferred_);
+	AssertNear(40000 * duration / 1000, c.transferred_);
+}
+
+void CRateLimiterTest::testWorkConserving()
+{
+	CRateScheduler scheduler;
+	scheduler.SetLimit(CRateLimiter::inbound, 100000);
+
+	consumer slow(10000), a, b, idle;
+	scheduler.Add(&slow);
+	scheduler.Add(&a);
+	scheduler.Add(&b);
+	scheduler.Add(&idle);
+
+	// The idle consumer never asks for data
+	Simulate(scheduler, { &slow, &a, &b });
+
+	AssertNear(10000 * duration / 1000, slow.transferred_);
+	AssertNear(45000 * duration / 1000, a.transferred_);
+	AssertNear(45000 * duration / 1000, b.transferred_);
+}
+
+void CRateLimiterTest::testObjectLimit()
+{
+	CRateScheduler scheduler;
+	scheduler.SetLimit(CRateLimiter::inbound, 100000);
+	scheduler.SetObjectLimit(CRateLimiter::inbound, 30000);
+
+	consumer a, b, c, d;
+	scheduler.Add(&a);
+	scheduler.Add(&b);
+
+	Simulate(scheduler, { &a, &b });
+
+	AssertNear(30000 * duration / 1000, a.transferred_);
+	AssertNear(30000 * duration / 1000, b.transferred_);
+
+	// With more objects, the global limit takes over
+	scheduler.Add(&c);
+	scheduler.Add(&d);
+	a.transferred_ = 0;
+	d.transferred_ = 0;
+
+	Simulate(scheduler, { &a, &b, &c, &d });
+
+	AssertNear(25000 * duration / 1000, a.transferred_);
+	AssertNear(25000 * duration / 1000, d.transferred_);
+}
+
+void CRateLimiterTest::testUnlimited()
+{
+	CRateScheduler scheduler;
+
+	consumer a;
+	scheduler.Add(&a);
+	CPPUNIT_ASSERT_EQUAL(int64_t(-1), a.GetAvailableBytes(CRateLimiter::inbound));
+
+	scheduler.SetLimit(CRateLimiter::inbound, 1000);
+	scheduler.Distribute(CRateLimiter::inbound, step);
+	CPPUNIT_ASSERT(a.GetAvailableBytes(CRateLimiter::inbound) >= 0);
+
+	a.Step();
+	a.Step();
+	CPPUNIT_ASSERT(a.IsWaiting(CRateLimiter::inbound));
+
+	// Disabling the limits wakes up waiting objects
+	scheduler.Enable(false);
+	std::vector<CRateLimiterObject*> const wakeup = scheduler.Distribute(CRateLimiter::inbound, step);
+	CPPUNIT_ASSERT_EQUAL(size_t(1), wakeup.size());
+	CPPUNIT_ASSERT(!a.IsWaiting(CRateLimiter::inbound));
+	CPPUNIT_ASSERT_EQUAL(int64_t(-1), a.GetAvailableBytes(CRateLimiter::inbound));
+}
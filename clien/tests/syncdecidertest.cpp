@@ -0,0 +1,201 @@
+#include <filezilla.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include "sync_decider.h"
+
+/*
+ * This testsuite asserts the correctness of the CSyncDecider class.
+ */
+
+class CSyncDeciderTest : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(CSyncDeciderTest);
+	CPPUNIT_TEST(testDifferent);
+	CPPUNIT_TEST(testNewer);
+	CPPUNIT_TEST(testOrphans);
+	CPPUNIT_TEST(testDirectories);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+	void testDifferent();
+	void testNewer();
+	void testOrphans();
+	void testDirectories();
+
+protected:
+	typedef CDirectoryComparison::result result;
+	typedef CSyncDecider::direction direction;
+
+	static CSyncDecider::t_rules Rules(direction dir, bool delete_orphans = false)
+	{
+		CSyncDecider::t_rules rules;
+		rules.dir = dir;
+		rules.delete_orphans = delete_orphans;
+		return rules;
+	}
+
+	static CSyncDecider::t_transfer Transfer(wxString const& name, int64_t size)
+	{
+		CSyncDecider::t_transfer t;
+		t.localName = name;
+		t.remoteName = name;
+		t.size = size;
+		return t;
+	}
+
+	static bool Empty(CSyncDecider::t_plan const& plan)
+	{
+		return plan.downloads.empty() && plan.uploads.empty() && plan.folderUploads.empty() && plan.subdirs.empty() &&
+			plan.remoteDeletes.empty() && plan.localDeletes.empty() && plan.conflicts.empty();
+	}
+
+	CLocalPath const m_localDir{_T("/home/user/")};
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(CSyncDeciderTest);
+
+void CSyncDeciderTest::testDifferent()
+{
+	CSyncDecider::t_transfer const local = Transfer(_T("a"), 1);
+	CSyncDecider::t_transfer const remote = Transfer(_T("a"), 2);
+
+	// Both ways neither side wins, the file gets reported instead
+	{
+		CSyncDecider::t_plan plan;
+		CSyncDecider(Rules(direction::both)).PlanFile(plan, result::different, local, remote, m_localDir);
+		CPPUNIT_ASSERT(plan.downloads.empty());
+		CPPUNIT_ASSERT(plan.uploads.empty());
+		CPPUNIT_ASSERT_EQUAL(size_t(1), plan.conflicts.size());
+		CPPUNIT_ASSERT(plan.conflicts[0].remoteName == _T("a"));
+		CPPUNIT_ASSERT_EQUAL(int64_t(2), plan.conflicts[0].size);
+	}
+
+	// The direction decides which side is right
+	{
+		CSyncDecider::t_plan plan;
+		CSyncDecider(Rules(direction::download)).PlanFile(plan, result::different, local, remote, m_localDir);
+		CPPUNIT_ASSERT_EQUAL(size_t(1), plan.downloads.size());
+		CPPUNIT_ASSERT(plan.uploads.empty());
+		CPPUNIT_ASSERT(plan.conflicts.empty());
+	}
+	{
+		CSyncDecider::t_plan plan;
+		CSyncDecider(Rules(direction::upload)).PlanFile(plan, result::different, local, remote, m_localDir);
+		CPPUNIT_ASSERT(plan.downloads.empty());
+		CPPUNIT_ASSERT_EQUAL(size_t(1), plan.uploads.size());
+		CPPUNIT_ASSERT(plan.conflicts.empty());
+	}
+
+	// Equal files are left alone in any direction
+	{
+		CSyncDecider::t_plan plan;
+		CSyncDecider(Rules(direction::both)).PlanFile(plan, result::equal, local, local, m_localDir);
+		CPPUNIT_ASSERT(Empty(plan));
+	}
+}
+
+void CSyncDeciderTest::testNewer()
+{
+	CSyncDecider::t_transfer const local = Transfer(_T("a"), 1);
+
+	// The file keeps the name it already has on the server
+	CSyncDecider::t_transfer remote = Transfer(_T("a"), 1);
+	remote.remoteName = _T("A");
+
+	{
+		CSyncDecider::t_plan plan;
+		CSyncDecider(Rules(direction::both)).PlanFile(plan, result::left_newer, local, remote, m_localDir);
+		CPPUNIT_ASSERT(plan.downloads.empty());
+		CPPUNIT_ASSERT_EQUAL(size_t(1), plan.uploads.size());
+		CPPUNIT_ASSERT(plan.uploads[0].localName == _T("a"));
+		CPPUNIT_ASSERT(plan.uploads[0].remoteName == _T("A"));
+	}
+	{
+		CSyncDecider::t_plan plan;
+		CSyncDecider(Rules(direction::both)).PlanFile(plan, result::right_newer, local, remote, m_localDir);
+		CPPUNIT_ASSERT_EQUAL(size_t(1), plan.downloads.size());
+		CPPUNIT_ASSERT(plan.uploads.empty());
+	}
+
+	// The direction overrides the dates
+	{
+		CSyncDecider::t_plan plan;
+		CSyncDecider(Rules(direction::download)).PlanFile(plan, result::left_newer, local, remote, m_localDir);
+		CPPUNIT_ASSERT_EQUAL(size_t(1), plan.downloads.size());
+		CPPUNIT_ASSERT(plan.uploads.empty());
+	}
+}
+
+void CSyncDeciderTest::testOrphans()
+{
+	CSyncDecider::t_transfer const local = Transfer(_T("l"), 1);
+	CSyncDecider::t_transfer const remote = Transfer(_T("r"), 1);
+	CSyncDecider::t_transfer const none;
+
+	// Copied both ways, never deleted
+	{
+		CSyncDecider::t_plan plan;
+		CSyncDecider const decider(Rules(direction::both, true));
+		decider.PlanFile(plan, result::left_only, local, none, m_localDir);
+		decider.PlanFile(plan, result::right_only, none, remote, m_localDir);
+		CPPUNIT_ASSERT_EQUAL(size_t(1), plan.uploads.size());
+		CPPUNIT_ASSERT_EQUAL(size_t(1), plan.downloads.size());
+		CPPUNIT_ASSERT(plan.localDeletes.empty());
+		CPPUNIT_ASSERT(plan.remoteDeletes.empty());
+	}
+
+	// Files only in the target are deleted if asked to
+	{
+		CSyncDecider::t_plan plan;
+		CSyncDecider const decider(Rules(direction::download, true));
+		decider.PlanFile(plan, result::left_only, local, none, m_localDir);
+		decider.PlanFile(plan, result::right_only, none, remote, m_localDir);
+		CPPUNIT_ASSERT(plan.uploads.empty());
+		CPPUNIT_ASSERT_EQUAL(size_t(1), plan.downloads.size());
+		CPPUNIT_ASSERT_EQUAL(size_t(1), plan.localDeletes.size());
+		CPPUNIT_ASSERT(plan.localDeletes.front() == _T("/home/user/l"));
+	}
+	{
+		CSyncDecider::t_plan plan;
+		CSyncDecider const decider(Rules(direction::upload, true));
+		decider.PlanFile(plan, result::right_only, none, remote, m_localDir);
+		CPPUNIT_ASSERT(plan.downloads.empty());
+		CPPUNIT_ASSERT_EQUAL(size_t(1), plan.remoteDeletes.size());
+		CPPUNIT_ASSERT(plan.remoteDeletes.front() == _T("r"));
+	}
+
+	// And kept otherwise
+	{
+		CSyncDecider::t_plan plan;
+		CSyncDecider const decider(Rules(direction::upload));
+		decider.PlanFile(plan, result::right_only, none, remote, m_localDir);
+		CPPUNIT_ASSERT(Empty(plan));
+	}
+}
+
+void CSyncDeciderTest::testDirectories()
+{
+	CSyncDecider::t_transfer const local = Transfer(_T("l"), -1);
+	CSyncDecider::t_transfer const remote = Transfer(_T("r"), -1);
+	CSyncDecider::t_transfer const none;
+
+	{
+		CSyncDecider::t_plan plan;
+		CSyncDecider const decider(Rules(direction::both));
+		decider.PlanDirectory(plan, result::left_only, local, none, m_localDir);
+		decider.PlanDirectory(plan, result::right_only, none, remote, m_localDir);
+		decider.PlanDirectory(plan, result::equal, remote, remote, m_localDir);
+		CPPUNIT_ASSERT_EQUAL(size_t(1), plan.folderUploads.size());
+		CPPUNIT_ASSERT_EQUAL(size_t(2), plan.subdirs.size());
+	}
+
+	// Remote directories are never deleted as a whole
+	{
+		CSyncDecider::t_plan plan;
+		CSyncDecider const decider(Rules(direction::upload, true));
+		decider.PlanDirectory(plan, result::right_only, none, remote, m_localDir);
+		CPPUNIT_ASSERT(Empty(plan));
+	}
+}
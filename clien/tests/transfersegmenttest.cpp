@@ -0,0 +1,166 @@
+#include <filezilla.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include "transfer_segment.h"
+
+#include <sqlite3.h>
+
+/*
+ * This testsuite asserts that the segments of a split download survive
+ * being saved to and loaded from the queue database.
+ */
+
+class CTransferSegmentTest : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(CTransferSegmentTest);
+	CPPUNIT_TEST(testRoundTrip);
+	CPPUNIT_TEST(testNoSegment);
+	CPPUNIT_TEST(testReuse);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp();
+	void tearDown();
+
+	void testRoundTrip();
+	void testNoSegment();
+	void testReuse();
+
+protected:
+	static CTransferSegment Segment(int index)
+	{
+		CTransferSegment segment;
+		segment.offset = index * 1000000000ll;
+		segment.length = 1000000000ll;
+		segment.done = 12345;
+		segment.current = 678;
+		segment.index = index;
+		segment.count = 4;
+		segment.size = 3500000000ll;
+		segment.failed = index == 2;
+		return segment;
+	}
+
+	// Inserts a row like the queue does, the segment columns come after
+	// a column of their own.
+	void Insert(CTransferSegment const* segment);
+
+	// Reads the rows in order of insertion
+	std::vector<std::pair<bool, CTransferSegment>> Load();
+
+	sqlite3* m_db{};
+	sqlite3_stmt* m_insert{};
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(CTransferSegmentTest);
+
+void CTransferSegmentTest::setUp()
+{
+	CPPUNIT_ASSERT(sqlite3_open(":memory:", &m_db) == SQLITE_OK);
+	CPPUNIT_ASSERT(sqlite3_exec(m_db, "CREATE TABLE files (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT, "
+		"segment_offset INTEGER, segment_length INTEGER, segment_done INTEGER, segment_index INTEGER, "
+		"segment_count INTEGER, segment_file_size INTEGER, segment_failed INTEGER)", 0, 0, 0) == SQLITE_OK);
+	CPPUNIT_ASSERT(sqlite3_prepare_v2(m_db, "INSERT INTO files (name, segment_offset, segment_length, segment_done, "
+		"segment_index, segment_count, segment_file_size, segment_failed) VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8)", -1, &m_insert, 0) == SQLITE_OK);
+}
+
+void CTransferSegmentTest::tearDown()
+{
+	sqlite3_finalize(m_insert);
+	sqlite3_close(m_db);
+}
+
+void CTransferSegmentTest::Insert(CTransferSegment const* segment)
+{
+	CPPUNIT_ASSERT(sqlite3_bind_text(m_insert, 1, "file", -1, SQLITE_STATIC) == SQLITE_OK);
+	CPPUNIT_ASSERT(BindTransferSegment(m_insert, 2, segment));
+	CPPUNIT_ASSERT(sqlite3_step(m_insert) == SQLITE_DONE);
+	sqlite3_reset(m_insert);
+}
+
+std::vector<std::pair<bool, CTransferSegment>> CTransferSegmentTest::Load()
+{
+	std::vector<std::pair<bool, CTransferSegment>> ret;
+
+	sqlite3_stmt* select = 0;
+	CPPUNIT_ASSERT(sqlite3_prepare_v2(m_db, "SELECT id, name, segment_offset, segment_length, segment_done, "
+		"segment_index, segment_count, segment_file_size, segment_failed FROM files ORDER BY id", -1, &select, 0) == SQLITE_OK);
+
+	while (sqlite3_step(select) == SQLITE_ROW) {
+		CTransferSegment segment;
+		bool const has = ParseTransferSegment(select, 2, segment);
+		ret.emplace_back(has, segment);
+	}
+	sqlite3_finalize(select);
+
+	return ret;
+}
+
+void CTransferSegmentTest::testRoundTrip()
+{
+	for (int i = 0; i < 4; ++i) {
+		CTransferSegment const segment = Segment(i);
+		Insert(&segment);
+	}
+
+	auto const rows = Load();
+	CPPUNIT_ASSERT_EQUAL(size_t(4), rows.size());
+	for (int i = 0; i < 4; ++i) {
+		CTransferSegment const expected = Segment(i);
+		CTransferSegment const& segment = rows[i].second;
+		CPPUNIT_ASSERT(rows[i].first);
+		CPPUNIT_ASSERT_EQUAL(expected.offset, segment.offset);
+		CPPUNIT_ASSERT_EQUAL(expected.length, segment.length);
+		CPPUNIT_ASSERT_EQUAL(expected.done, segment.done);
+		CPPUNIT_ASSERT_EQUAL(expected.index, segment.index);
+		CPPUNIT_ASSERT_EQUAL(expected.count, segment.count);
+		CPPUNIT_ASSERT_EQUAL(expected.size, segment.size);
+		CPPUNIT_ASSERT_EQUAL(expected.failed, segment.failed);
+
+		// Progress of a running transfer is lost with the transfer
+		CPPUNIT_ASSERT_EQUAL(int64_t(0), segment.current);
+		CPPUNIT_ASSERT_EQUAL(expected.length - expected.done, segment.Remaining());
+	}
+}
+
+void CTransferSegmentTest::testNoSegment()
+{
+	Insert(0);
+
+	// A single segment is no segment at all
+	CTransferSegment single = Segment(0);
+	single.count = 1;
+	Insert(&single);
+
+	// Neither is an empty one
+	CTransferSegment empty = Segment(1);
+	empty.length = 0;
+	Insert(&empty);
+
+	auto const rows = Load();
+	CPPUNIT_ASSERT_EQUAL(size_t(3), rows.size());
+	for (auto const& row : rows) {
+		CPPUNIT_ASSERT(!row.first);
+		CPPUNIT_ASSERT_EQUAL(int64_t(-1), row.second.size);
+	}
+}
+
+void CTransferSegmentTest::testReuse()
+{
+	// Rows without a segment saved after a segment through the same
+	// statement must not keep its values.
+	CTransferSegment const segment = Segment(2);
+	Insert(&segment);
+	Insert(0);
+
+	auto const rows = Load();
+	CPPUNIT_ASSERT_EQUAL(size_t(2), rows.size());
+	CPPUNIT_ASSERT(rows[0].first);
+	CPPUNIT_ASSERT(rows[0].second.failed);
+	CPPUNIT_ASSERT(!rows[1].first);
+
+	sqlite3_stmt* select = 0;
+	CPPUNIT_ASSERT(sqlite3_prepare_v2(m_db, "SELECT COUNT(*) FROM files WHERE segment_file_size IS NULL AND segment_failed IS NULL", -1, &select, 0) == SQLITE_OK);
+	CPPUNIT_ASSERT(sqlite3_step(select) == SQLITE_ROW);
+	CPPUNIT_ASSERT_EQUAL(1, sqlite3_column_int(select, 0));
+	sqlite3_finalize(select);
+}